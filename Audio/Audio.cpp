@@ -5,16 +5,173 @@
 #include "mfRoutines.h"
 #include "mfWave.h"
 #include "mfWma.h"
+#include "bufferPool.h"
+#include "levelMeter.h"
+#include "threadPool.h"
+#include "resampler.h"
+#include "pcmConvert.h"
+#include "flacEncoder.h"
+#include "sampleBuffers.h"
+#include "waveSegments.h"
+#include "activityGate.h"
+#include "spectrum.h"
+#include "debugLog.h"
+#include "errorRegistry.h"
 
 const LONG MAX_AUDIO_DURATION_MSEC = 10000; // 10 seconds
 
+// Options for the MF WAV writer, set from the command line
+WaveFileOptions g_waveOptions;
+// Recording length, set from the command line
+DWORD g_msecDuration = MAX_AUDIO_DURATION_MSEC;
+// BUFFER_POOL_* flags for the MM capture buffers
+DWORD g_dwPoolFlags = 0;
+// Number of devices to record at once
+LONG g_nThreads = 1;
+// Rate conversion for the MF writers
+ResampleOptions g_resample;
+// Sample format for the MF WAV writer
+PcmOptions g_pcm;
+// FLAC compression for the MF WAV writer
+FlacOptions g_flac;
+// Splitting of the MF WAV output into a series of files
+SegmentOptions g_segments;
+// Skipping of idle audio in the MF WAV output
+ActivityOptions g_activity;
+// Spectrum analysis of the MM and MF WAV recordings
+SpectrumOptions g_spectrum;
+// Ask the devices for their media types rather than using the catalog
+BOOL g_bRescanTypes = FALSE;
+
+// One device being recorded by printMfAudioInfo
+struct MfDeviceJob
+{
+	IMFActivate *pActivate;
+	WCHAR *szFriendlyName;
+	WCHAR *szEndpointId;        // Keys the device in the type catalog
+	BOOL useWma;
+	BOOL bPrintTypes;           // Print the stream types before recording
+	WCHAR szFileName[256];
+	HRESULT hr;
+	DWORD msecElapsed;
+};
+
+// Activates one device and records from it.  Runs on a pool thread
+// when devices are recorded in parallel.
+void recordMfDevice(LONG iDevice, void *pContext) {
+	MfDeviceJob *pJob = (MfDeviceJob *)pContext + iDevice;
+	IMFMediaSource *pSource = NULL;
+	IMFSourceReader *pReader = NULL;
+	DWORD tStart = GetTickCount();
+
+	// Devices whose names could not be read are skipped, keeping the
+	// error for the report
+	if (FAILED(pJob->hr) || pJob->szFriendlyName == NULL) {
+		return;
+	}
+
+	// Pool threads need COM.  On the main thread this fails with
+	// RPC_E_CHANGED_MODE and the existing apartment is used.
+	HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	// Create a media source
+	HRESULT hr = pJob->pActivate->ActivateObject(IID_PPV_ARGS(&pSource));
+	if (FAILED(hr)) {
+		printf("Error creating media source for device %d\n", iDevice);
+		goto CLEANUP;
+	}
+
+	// Create a source reader from the media source
+	hr = MFCreateSourceReaderFromMediaSource(pSource, NULL, &pReader);
+	if (FAILED(hr)) {
+		printf("Error creating source reader for device %d\n", iDevice);
+		goto CLEANUP;
+	}
+
+	// Print the types for this reader
+	if (pJob->bPrintTypes && pJob->szEndpointId != NULL) {
+		enumerateTypesForStreams(pJob->szEndpointId, pReader);
+	}
+
+	// Write the file
+	if(pJob->useWma) {
+		swprintf_s(pJob->szFileName, L"MFWMA-AudioTest-%s.wma",
+			pJob->szFriendlyName);
+		hr = WriteWmaFile(pReader, pJob->szFileName, g_msecDuration,
+			&g_resample);
+	} else {
+		swprintf_s(pJob->szFileName, L"MFWAV-AudioTest-%s.%s",
+			pJob->szFriendlyName, g_flac.bEnabled ? L"flac" : L"wav");
+		hr = WriteWaveFile(pReader, pJob->szFileName, g_msecDuration,
+			&g_waveOptions, &g_resample, &g_pcm, &g_flac, &g_segments,
+			&g_activity, &g_spectrum);
+	}
+
+CLEANUP:
+	// This should also release the media source
+	SafeRelease(&pReader);
+	SafeRelease(&pSource);
+	if (SUCCEEDED(hrCom)) {
+		CoUninitialize();
+	}
+	pJob->hr = hr;
+	pJob->msecElapsed = GetTickCount() - tStart;
+}
+
+// Makes a job for each device and reads the devices' names.  A device
+// whose name cannot be read keeps the error in its job, and is not
+// recorded.  Returns NULL if out of memory.
+MfDeviceJob *createMfDeviceJobs(IMFActivate **ppDevices, UINT32 count,
+								BOOL useWma) {
+	MfDeviceJob *pJobs = new (std::nothrow) MfDeviceJob[count];
+	if (pJobs == NULL) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+	ZeroMemory(pJobs, count * sizeof(MfDeviceJob));
+
+	// Get the friendly names of the devices
+	for (UINT32 iDevice = 0; iDevice < count; iDevice++) {
+		UINT32 cchName;
+		pJobs[iDevice].pActivate = ppDevices[iDevice];
+		pJobs[iDevice].useWma = useWma;
+		// The type lists would be mixed together if printed in parallel
+		pJobs[iDevice].bPrintTypes = (g_nThreads <= 1);
+		HRESULT hr = ppDevices[iDevice]->
+			GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
+			&pJobs[iDevice].szFriendlyName, &cchName);
+		if (FAILED(hr)) {
+			printf("Error getting information for audio device %d\n", iDevice);
+			printErrorDescription(hr);
+			pJobs[iDevice].hr = hr;
+			continue;
+		}
+		wprintf(L"%d %s\n", iDevice, pJobs[iDevice].szFriendlyName);
+		// Without it the types are not printed
+		ppDevices[iDevice]->GetAllocatedString(
+			MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID,
+			&pJobs[iDevice].szEndpointId, &cchName);
+	}
+	return pJobs;
+}
+
+void freeMfDeviceJobs(MfDeviceJob *pJobs, UINT32 count) {
+	if (pJobs) {
+		for (UINT32 i = 0; i < count; i++) {
+			CoTaskMemFree(pJobs[i].szFriendlyName);
+			CoTaskMemFree(pJobs[i].szEndpointId);
+		}
+		delete [] pJobs;
+	}
+}
+
 void printMfAudioInfo(BOOL useWma) {
 	printf("MF Audio Info\n");
 
-	IMFMediaSource *pSource = NULL;
 	UINT32 count = 0;
 	IMFAttributes *pAttributes = NULL;
 	IMFActivate **ppDevices = NULL;
+	MfDeviceJob *pJobs = NULL;
 
 	// Create an attribute store to hold the search criteria.
 	HRESULT hr = MFCreateAttributes(&pAttributes, 1);
@@ -30,108 +187,524 @@ void printMfAudioInfo(BOOL useWma) {
 	if (FAILED(hr)) {
 		printf("Error requesting audio devices\n");
 		printErrorDescription(hr);
+		SafeRelease(&pAttributes);
 		return;
 	}
 
 	// Enumerate the devices,
 	hr = MFEnumDeviceSources(pAttributes, &ppDevices, &count);
+	SafeRelease(&pAttributes);
 	if (FAILED(hr)) {
 		printf("Error enumerating audio devices\n");
 		printErrorDescription(hr);
 		return;
 	}
 	printf("Number of devices: %d\n", count);
+	if (count == 0) {
+		CoTaskMemFree(ppDevices);
+		return;
+	}
 
-	// Loop over devices
-	WCHAR *szFriendlyName = NULL;
-	for (UINT32 iDevice = 0; iDevice < count; iDevice++) {
-#if 0
-		// DEBUG
-		if(iDevice != 6) {
-			continue;
-		}
-#endif
-		// Get the friendly name of the device
-		hr = S_OK;
-		UINT32 cchName;
-		hr = ppDevices[iDevice]->
-			GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
-			&szFriendlyName, &cchName);
-		if (FAILED(hr)) {
-			printf("Error getting information for audio device %d\n", iDevice);
-			printErrorDescription(hr);
-			continue;
+	pJobs = createMfDeviceJobs(ppDevices, count, useWma);
+	if (pJobs == NULL) {
+		goto CLEANUP;
+	}
+
+	// The devices' media types from earlier runs
+	if (g_bRescanTypes) {
+		catalogClear();
+	} else {
+		catalogLoad(CATALOG_FILE_NAME);
+	}
+
+	// Try to record
+	{
+		if (g_msecDuration == 0) {
+			printf("Trying to record until Ctrl+C, %d device(s) at a time...\n",
+				min((LONG)count, g_nThreads));
 		} else {
-			wprintf(L"%d %s\n", iDevice, szFriendlyName);
+			printf("Trying to record for %d sec, %d device(s) at a time...\n",
+				g_msecDuration / 1000, min((LONG)count, g_nThreads));
 		}
+		DWORD tStart = GetTickCount();
+		RunInParallel(count, g_nThreads, recordMfDevice, pJobs);
+		DWORD msecTotal = GetTickCount() - tStart;
 
-		// Create a media source
-		hr = ppDevices[iDevice]->ActivateObject(IID_PPV_ARGS(&pSource));
-		if (FAILED(hr)) {
-			printf("Error creating media source for device %d\n", iDevice);
-			printErrorDescription(hr);
-			continue;
+		// Report the results
+		printf("Results:\n");
+		for (UINT32 iDevice = 0; iDevice < count; iDevice++) {
+			MfDeviceJob *pJob = &pJobs[iDevice];
+			if (pJob->szFriendlyName == NULL) {
+				printf("%d  No information\n", iDevice);
+			} else if (FAILED(pJob->hr)) {
+				wprintf(L"%d  Error writing %s file for %s\n", iDevice,
+					useWma ? L"WMA" : L"WAV", pJob->szFriendlyName);
+				printErrorDescription(pJob->hr);
+			} else {
+				wprintf(L"%d  Recorded %s (%.1f sec)\n", iDevice,
+					pJob->szFriendlyName, pJob->msecElapsed / 1000.0);
+				wprintf(L"    Output is %s\n", pJob->szFileName);
+			}
 		}
+		printf("Recorded %d device(s) in %.1f sec\n", count,
+			msecTotal / 1000.0);
+		catalogSave(CATALOG_FILE_NAME);
+	}
 
-		// Create a source reader from the media source
-		IMFSourceReader *pReader;
-		hr = MFCreateSourceReaderFromMediaSource(pSource, pAttributes, &pReader);
-		if (FAILED(hr)) {
-			printf("Error creating media source for device %d\n", iDevice);
-			printErrorDescription(hr);
+CLEANUP:
+	freeMfDeviceJobs(pJobs, count);
+	// Release the sources
+	for (DWORD i = 0; i < count; i++)  {
+		ppDevices[i]->Release();
+	}
+	CoTaskMemFree(ppDevices);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Device job benchmark
+
+// Activations of MockDeviceActivate in progress, and the most at once
+static volatile LONG s_nActivating = 0;
+static volatile LONG s_nMostActivating = 0;
+
+const DWORD MOCK_ACTIVATE_MSEC = 500;
+
+// An audio capture device for the device jobs.  Its attributes are
+// kept in a real attribute store, so a device can be made without a
+// friendly name.  Activating it takes MOCK_ACTIVATE_MSEC and fails,
+// as for a device unplugged since it was enumerated, so no file is
+// written.
+class MockDeviceActivate : public IMFActivate
+{
+	LONG m_nRefCount;
+	IMFAttributes *m_pAttributes;
+
+public:
+	LONG m_nActivations;
+
+	MockDeviceActivate(IMFAttributes *pAttributes) :
+	m_nRefCount(1), m_pAttributes(pAttributes), m_nActivations(0)
+	{
+		m_pAttributes->AddRef();
+	}
+	~MockDeviceActivate()
+	{
+		SafeRelease(&m_pAttributes);
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFAttributes) ||
+			riid == __uuidof(IMFActivate)) {
+			*ppv = static_cast<IMFActivate *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFActivate methods
+	STDMETHODIMP ActivateObject(REFIID, void **ppv)
+	{
+		*ppv = NULL;
+		InterlockedIncrement(&m_nActivations);
+		LONG nActivating = InterlockedIncrement(&s_nActivating);
+		LONG nMost = s_nMostActivating;
+		while (nActivating > nMost) {
+			LONG nWas = InterlockedCompareExchange(&s_nMostActivating,
+				nActivating, nMost);
+			if (nWas == nMost) {
+				break;
+			}
+			nMost = nWas;
+		}
+		Sleep(MOCK_ACTIVATE_MSEC);
+		InterlockedDecrement(&s_nActivating);
+		return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	}
+	STDMETHODIMP ShutdownObject() { return S_OK; }
+	STDMETHODIMP DetachObject() { return S_OK; }
+
+	// IMFAttributes methods
+	STDMETHODIMP GetItem(REFGUID guidKey, PROPVARIANT *pValue) { return m_pAttributes->GetItem(guidKey, pValue); }
+	STDMETHODIMP GetItemType(REFGUID guidKey, MF_ATTRIBUTE_TYPE *pType) { return m_pAttributes->GetItemType(guidKey, pType); }
+	STDMETHODIMP CompareItem(REFGUID guidKey, REFPROPVARIANT Value, BOOL *pbResult) { return m_pAttributes->CompareItem(guidKey, Value, pbResult); }
+	STDMETHODIMP Compare(IMFAttributes *pTheirs, MF_ATTRIBUTES_MATCH_TYPE MatchType, BOOL *pbResult) { return m_pAttributes->Compare(pTheirs, MatchType, pbResult); }
+	STDMETHODIMP GetUINT32(REFGUID guidKey, UINT32 *punValue) { return m_pAttributes->GetUINT32(guidKey, punValue); }
+	STDMETHODIMP GetUINT64(REFGUID guidKey, UINT64 *punValue) { return m_pAttributes->GetUINT64(guidKey, punValue); }
+	STDMETHODIMP GetDouble(REFGUID guidKey, double *pfValue) { return m_pAttributes->GetDouble(guidKey, pfValue); }
+	STDMETHODIMP GetGUID(REFGUID guidKey, GUID *pguidValue) { return m_pAttributes->GetGUID(guidKey, pguidValue); }
+	STDMETHODIMP GetStringLength(REFGUID guidKey, UINT32 *pcchLength) { return m_pAttributes->GetStringLength(guidKey, pcchLength); }
+	STDMETHODIMP GetString(REFGUID guidKey, LPWSTR pwszValue, UINT32 cchBufSize, UINT32 *pcchLength) { return m_pAttributes->GetString(guidKey, pwszValue, cchBufSize, pcchLength); }
+	STDMETHODIMP GetAllocatedString(REFGUID guidKey, LPWSTR *ppwszValue, UINT32 *pcchLength) { return m_pAttributes->GetAllocatedString(guidKey, ppwszValue, pcchLength); }
+	STDMETHODIMP GetBlobSize(REFGUID guidKey, UINT32 *pcbBlobSize) { return m_pAttributes->GetBlobSize(guidKey, pcbBlobSize); }
+	STDMETHODIMP GetBlob(REFGUID guidKey, UINT8 *pBuf, UINT32 cbBufSize, UINT32 *pcbBlobSize) { return m_pAttributes->GetBlob(guidKey, pBuf, cbBufSize, pcbBlobSize); }
+	STDMETHODIMP GetAllocatedBlob(REFGUID guidKey, UINT8 **ppBuf, UINT32 *pcbSize) { return m_pAttributes->GetAllocatedBlob(guidKey, ppBuf, pcbSize); }
+	STDMETHODIMP GetUnknown(REFGUID guidKey, REFIID riid, LPVOID *ppv) { return m_pAttributes->GetUnknown(guidKey, riid, ppv); }
+	STDMETHODIMP SetItem(REFGUID guidKey, REFPROPVARIANT Value) { return m_pAttributes->SetItem(guidKey, Value); }
+	STDMETHODIMP DeleteItem(REFGUID guidKey) { return m_pAttributes->DeleteItem(guidKey); }
+	STDMETHODIMP DeleteAllItems() { return m_pAttributes->DeleteAllItems(); }
+	STDMETHODIMP SetUINT32(REFGUID guidKey, UINT32 unValue) { return m_pAttributes->SetUINT32(guidKey, unValue); }
+	STDMETHODIMP SetUINT64(REFGUID guidKey, UINT64 unValue) { return m_pAttributes->SetUINT64(guidKey, unValue); }
+	STDMETHODIMP SetDouble(REFGUID guidKey, double fValue) { return m_pAttributes->SetDouble(guidKey, fValue); }
+	STDMETHODIMP SetGUID(REFGUID guidKey, REFGUID guidValue) { return m_pAttributes->SetGUID(guidKey, guidValue); }
+	STDMETHODIMP SetString(REFGUID guidKey, LPCWSTR wszValue) { return m_pAttributes->SetString(guidKey, wszValue); }
+	STDMETHODIMP SetBlob(REFGUID guidKey, const UINT8 *pBuf, UINT32 cbBufSize) { return m_pAttributes->SetBlob(guidKey, pBuf, cbBufSize); }
+	STDMETHODIMP SetUnknown(REFGUID guidKey, IUnknown *pUnknown) { return m_pAttributes->SetUnknown(guidKey, pUnknown); }
+	STDMETHODIMP LockStore() { return m_pAttributes->LockStore(); }
+	STDMETHODIMP UnlockStore() { return m_pAttributes->UnlockStore(); }
+	STDMETHODIMP GetCount(UINT32 *pcItems) { return m_pAttributes->GetCount(pcItems); }
+	STDMETHODIMP GetItemByIndex(UINT32 unIndex, GUID *pguidKey, PROPVARIANT *pValue) { return m_pAttributes->GetItemByIndex(unIndex, pguidKey, pValue); }
+	STDMETHODIMP CopyAllItems(IMFAttributes *pDest) { return m_pAttributes->CopyAllItems(pDest); }
+};
+
+// Runs the device jobs in parallel, as -threads does, on mock devices,
+// one of which has no friendly name.  Checks that every named device is
+// activated once, all at the same time, and keeps its activation error,
+// and that the unnamed device is never activated and keeps the error
+// from reading its name.
+void benchmarkMfDeviceJobs(void) {
+	const UINT32 N_DEVICES = 5;
+	const UINT32 I_UNNAMED = 2;
+	const HRESULT HR_ACTIVATE = HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+	MockDeviceActivate *pMocks[N_DEVICES];
+	IMFActivate *ppDevices[N_DEVICES];
+	MfDeviceJob *pJobs = NULL;
+	HRESULT hr = S_OK;
+
+	ZeroMemory(pMocks, sizeof(pMocks));
+	for (UINT32 i = 0; i < N_DEVICES && SUCCEEDED(hr); i++) {
+		IMFAttributes *pAttributes = NULL;
+		hr = MFCreateAttributes(&pAttributes, 2);
+		if (SUCCEEDED(hr)) {
+			hr = pAttributes->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
+				MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_GUID);
+		}
+		if (SUCCEEDED(hr) && i != I_UNNAMED) {
+			WCHAR szName[32];
+			swprintf_s(szName, L"Mock device %u", i);
+			hr = pAttributes->SetString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
+				szName);
+		}
+		if (SUCCEEDED(hr)) {
+			pMocks[i] = new (std::nothrow) MockDeviceActivate(pAttributes);
+			if (pMocks[i] == NULL) {
+				hr = E_OUTOFMEMORY;
+			}
+		}
+		ppDevices[i] = pMocks[i];
+		SafeRelease(&pAttributes);
+	}
+	if (FAILED(hr)) {
+		printf("Error creating the mock devices\n");
+		printErrorDescription(hr);
+		goto CLEANUP;
+	}
+
+	// One thread for each device, as -threads does
+	{
+		LONG nThreads = g_nThreads;
+		g_nThreads = N_DEVICES;
+		pJobs = createMfDeviceJobs(ppDevices, N_DEVICES, FALSE);
+		if (pJobs == NULL) {
+			g_nThreads = nThreads;
 			goto CLEANUP;
 		}
+		s_nActivating = 0;
+		s_nMostActivating = 0;
+		DWORD tStart = GetTickCount();
+		RunInParallel(N_DEVICES, g_nThreads, recordMfDevice, pJobs);
+		DWORD msecTotal = GetTickCount() - tStart;
+		g_nThreads = nThreads;
 
-		// Print the types for this reader
-		enumerateTypesForStreams(pReader);
-
-		// Try to record
-		printf("  Trying to record for %d sec...\n",
-			MAX_AUDIO_DURATION_MSEC / 1000);
-
-		// Write the file
-		if(useWma) {
-			WCHAR szFileName[256];
-			swprintf_s(szFileName, L"MFWMA-AudioTest-%s.wma", szFriendlyName);
-			hr = WriteWmaFile(pReader, szFileName, MAX_AUDIO_DURATION_MSEC);
-			if (FAILED(hr)) {
-				wprintf(L"Error writing WMA file for device %d for %s\n", iDevice,
-					szFileName);
-				printErrorDescription(hr);
-				goto CLEANUP;
-			}
-			wprintf(L"    Output is %s\n", szFileName);
-		} else {
-			WCHAR szFileName[256];
-			swprintf_s(szFileName, L"MFWAV-AudioTest-%s.wav", szFriendlyName);
-			hr = WriteWaveFile(pReader, szFileName, MAX_AUDIO_DURATION_MSEC);
-			if (FAILED(hr)) {
-				wprintf(L"Error writing WAV file for device %d\n", iDevice);
-				printErrorDescription(hr);
-				goto CLEANUP;
-			}
-			wprintf(L"    Output is %s\n", szFileName);
+		printf("Device jobs, %u mock devices on %u threads, device %u unnamed\n",
+			N_DEVICES, N_DEVICES, I_UNNAMED);
+		for (UINT32 i = 0; i < N_DEVICES; i++) {
+			MfDeviceJob *pJob = &pJobs[i];
+			BOOL bOk;
+			if (i == I_UNNAMED) {
+				bOk = pMocks[i]->m_nActivations == 0 &&
+					pJob->hr == MF_E_ATTRIBUTENOTFOUND &&
+					pJob->szFriendlyName == NULL && pJob->szFileName[0] == 0;
+			} else {
+				bOk = pMocks[i]->m_nActivations == 1 &&
+					pJob->hr == HR_ACTIVATE && pJob->szFriendlyName != NULL;
+			}
+			printf("  Device %u: %ld activation(s), hr 0x%08lx, %s\n", i,
+				pMocks[i]->m_nActivations, pJob->hr, bOk ? "ok" : "FAILED");
 		}
 
+		// With a thread each, the named devices are all activated at once
+		BOOL bParallel = s_nMostActivating == (LONG)(N_DEVICES - 1);
+		printf("  %ld activations at once, %.1f sec in all, %s\n",
+			s_nMostActivating, msecTotal / 1000.0, bParallel ? "ok" : "FAILED");
+	}
+
 CLEANUP:
-		// This should also release the media source
-		SafeRelease(&pReader);
+	freeMfDeviceJobs(pJobs, N_DEVICES);
+	for (UINT32 i = 0; i < N_DEVICES; i++) {
+		SafeRelease(&pMocks[i]);
 	}
+}
 
-	CoTaskMemFree(szFriendlyName);
-	szFriendlyName = NULL;
-	// Release the sources
-	for (DWORD i = 0; i < count; i++)  {
-		ppDevices[i]->Release();
+// Parses the options that follow the mode.  Returns FALSE if any are
+// invalid.
+BOOL parseOptions(int argc, _TCHAR* argv[]) {
+	for(int i = 2; i < argc; i++) {
+		if(!_stricmp(argv[i], _T("-block")) && i + 1 < argc) {
+			// Write buffer size in KB, 0 to write each sample directly
+			g_waveOptions.cbBlockSize = (DWORD)atoi(argv[++i]) * 1024;
+		} else if(!_stricmp(argv[i], _T("-seconds")) && i + 1 < argc) {
+			// Recording length, 0 to record until Ctrl+C
+			g_msecDuration = (DWORD)atoi(argv[++i]) * 1000;
+		} else if(!_stricmp(argv[i], _T("-segment")) && i + 1 < argc) {
+			// Start a new MF WAV file every so many seconds
+			g_segments.msecSegment = (DWORD)atoi(argv[++i]) * 1000;
+		} else if(!_stricmp(argv[i], _T("-segmentmb")) && i + 1 < argc) {
+			// Start a new MF WAV file every so many MB of audio data
+			g_segments.cbSegment = (ULONGLONG)atoi(argv[++i]) * 1024 * 1024;
+		} else if(!_stricmp(argv[i], _T("-gate"))) {
+			// Leave the idle stretches out of the MF WAV output
+			g_activity.bEnabled = TRUE;
+		} else if(!_stricmp(argv[i], _T("-gatedb")) && i + 1 < argc) {
+			// Level over the noise floor that counts as activity
+			g_activity.thresholdDb = (float)atof(argv[++i]);
+		} else if(!_stricmp(argv[i], _T("-gatepre")) && i + 1 < argc) {
+			// Milliseconds kept from before each active stretch
+			g_activity.msecPrePad = (DWORD)atoi(argv[++i]);
+			if (g_activity.msecPrePad > ACTIVITY_MAX_PAD_MSEC) {
+				printf("Invalid padding %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-gatepost")) && i + 1 < argc) {
+			// Milliseconds kept after each active stretch
+			g_activity.msecPostPad = (DWORD)atoi(argv[++i]);
+			if (g_activity.msecPostPad > ACTIVITY_MAX_PAD_MSEC) {
+				printf("Invalid padding %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-spectrum"))) {
+			// Analyze the spectrum of each recording as it is captured
+			g_spectrum.bEnabled = TRUE;
+		} else if(!_stricmp(argv[i], _T("-fftsize")) && i + 1 < argc) {
+			// Samples per FFT frame, a power of two
+			g_spectrum.nFftSize = (UINT32)atoi(argv[++i]);
+			if (g_spectrum.nFftSize < SPECTRUM_MIN_FFT_SIZE ||
+				g_spectrum.nFftSize > SPECTRUM_MAX_FFT_SIZE ||
+				(g_spectrum.nFftSize & (g_spectrum.nFftSize - 1)) != 0) {
+				printf("Invalid FFT size %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-ffthop")) && i + 1 < argc) {
+			// Samples between the starts of FFT frames
+			g_spectrum.nHop = (UINT32)atoi(argv[++i]);
+			if (g_spectrum.nHop == 0) {
+				printf("Invalid FFT hop %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-bands")) && i + 1 < argc) {
+			// Spectrum bands to report
+			g_spectrum.nBands = (UINT32)atoi(argv[++i]);
+			if (g_spectrum.nBands == 0 || g_spectrum.nBands > SPECTRUM_MAX_BANDS) {
+				printf("Invalid band count %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-j")) && i + 1 < argc) {
+			// Devices to record at once, 0 for one per processor
+			g_nThreads = atoi(argv[++i]);
+			if(g_nThreads <= 0) {
+				g_nThreads = GetProcessorCount();
+			}
+		} else if(!_stricmp(argv[i], _T("-largepages"))) {
+			g_dwPoolFlags |= BUFFER_POOL_LARGE_PAGES;
+		} else if(!_stricmp(argv[i], _T("-lockbuffers"))) {
+			g_dwPoolFlags |= BUFFER_POOL_LOCKED;
+		} else if(!_stricmp(argv[i], _T("-unbuffered"))) {
+			g_waveOptions.bUnbuffered = TRUE;
+		} else if(!_stricmp(argv[i], _T("-mapped"))) {
+			// Copy into a preallocated, mapped file instead of writing
+			g_waveOptions.bMapped = TRUE;
+		} else if(!_stricmp(argv[i], _T("-prealloc")) && i + 1 < argc) {
+			// MB of audio data to allocate a mapped file for, instead of
+			// the recording length
+			g_waveOptions.cbPreallocate = (ULONGLONG)atoi(argv[++i]) * 1024 * 1024;
+		} else if(!_stricmp(argv[i], _T("-checkpoint")) && i + 1 < argc) {
+			// Header checkpoint interval in seconds
+			g_waveOptions.msecCheckpoint = (DWORD)atoi(argv[++i]) * 1000;
+		} else if(!_stricmp(argv[i], _T("-checkpointmb")) && i + 1 < argc) {
+			// Header checkpoint interval in MB of audio data
+			g_waveOptions.cbCheckpoint = (ULONGLONG)atoi(argv[++i]) * 1024 * 1024;
+		} else if(!_stricmp(argv[i], _T("-sync"))) {
+			g_waveOptions.bSyncCheckpoints = TRUE;
+		} else if(!_stricmp(argv[i], _T("-rate")) && i + 1 < argc) {
+			// Sample rate to write, resampling if the device differs
+			int nRate = atoi(argv[++i]);
+			if(nRate < (int)RESAMPLER_MIN_RATE || nRate > (int)RESAMPLER_MAX_RATE) {
+				printf("Invalid rate %s (%u to %u)\n", argv[i],
+					RESAMPLER_MIN_RATE, RESAMPLER_MAX_RATE);
+				return FALSE;
+			}
+			g_resample.nSampleRate = (UINT32)nRate;
+		} else if(!_stricmp(argv[i], _T("-quality")) && i + 1 < argc) {
+			// Resampler quality: low, medium or high
+			i++;
+			int q;
+			for (q = 0; q < RESAMPLER_QUALITY_COUNT; q++) {
+				if(!_stricmp(argv[i],
+					Resampler::QualityName((ResamplerQuality)q))) {
+					break;
+				}
+			}
+			if (q == RESAMPLER_QUALITY_COUNT) {
+				printf("Invalid quality %s\n", argv[i]);
+				return FALSE;
+			}
+			g_resample.quality = (ResamplerQuality)q;
+		} else if(!_stricmp(argv[i], _T("-drift")) && i + 1 < argc) {
+			// Device clock error to correct, in ppm (needs -rate)
+			g_resample.driftPpm = atof(argv[++i]);
+		} else if(!_stricmp(argv[i], _T("-format")) && i + 1 < argc) {
+			// WAV sample format: float32, int16, int24 or int32
+			i++;
+			int f;
+			for (f = 0; f < PCM_FORMAT_COUNT; f++) {
+				if(!_stricmp(argv[i], PcmConverter::FormatName((PcmFormat)f))) {
+					break;
+				}
+			}
+			if (f == PCM_FORMAT_COUNT) {
+				printf("Invalid format %s\n", argv[i]);
+				return FALSE;
+			}
+			g_pcm.format = (PcmFormat)f;
+		} else if(!_stricmp(argv[i], _T("-dither")) && i + 1 < argc) {
+			// Dither for integer formats: none, tpdf or shaped
+			i++;
+			int d;
+			for (d = 0; d < PCM_DITHER_COUNT; d++) {
+				if(!_stricmp(argv[i], PcmConverter::DitherName((PcmDither)d))) {
+					break;
+				}
+			}
+			if (d == PCM_DITHER_COUNT) {
+				printf("Invalid dither %s\n", argv[i]);
+				return FALSE;
+			}
+			g_pcm.dither = (PcmDither)d;
+		} else if(!_stricmp(argv[i], _T("-flac"))) {
+			// Compress the MF WAV output to FLAC
+			g_flac.bEnabled = TRUE;
+		} else if(!_stricmp(argv[i], _T("-lpcorder")) && i + 1 < argc) {
+			// Highest FLAC LPC order, 0 for fixed predictors only
+			g_flac.nMaxLpcOrder = (UINT32)atoi(argv[++i]);
+			if (g_flac.nMaxLpcOrder > FLAC_MAX_LPC_ORDER) {
+				printf("Invalid LPC order %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-flacblock")) && i + 1 < argc) {
+			// Samples per FLAC frame
+			g_flac.nBlockSize = (UINT32)atoi(argv[++i]);
+			if (g_flac.nBlockSize < FLAC_MIN_BLOCK_SIZE ||
+				g_flac.nBlockSize > FLAC_MAX_BLOCK_SIZE) {
+				printf("Invalid FLAC block size %s\n", argv[i]);
+				return FALSE;
+			}
+		} else if(!_stricmp(argv[i], _T("-flacthreads")) && i + 1 < argc) {
+			// FLAC encoder threads per file, 0 for one per processor
+			g_flac.nThreads = atoi(argv[++i]);
+		} else if(!_stricmp(argv[i], _T("-rescan"))) {
+			// Query the devices' media types again, refreshing the catalog
+			g_bRescanTypes = TRUE;
+		} else {
+			printf("Invalid option %s\n", argv[i]);
+			return FALSE;
+		}
 	}
-	CoTaskMemFree(ppDevices);
+	if (g_spectrum.nHop > g_spectrum.nFftSize) {
+		printf("The FFT hop must not be longer than the FFT size\n");
+		return FALSE;
+	}
+	if (g_resample.driftPpm != 0.0 && g_resample.nSampleRate == 0) {
+		printf("-drift needs -rate; the drift is corrected by resampling\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Repairs the header of a WAV file left behind by an interrupted
+// recording.
+int repairFile(const char *szFileName) {
+	WCHAR wszFileName[MAX_PATH];
+	if(0 == MultiByteToWideChar(CP_ACP, 0, szFileName, -1, wszFileName,
+		MAX_PATH)) {
+		printf("Invalid file name %s\n", szFileName);
+		return 1;
+	}
+	ULONGLONG cbAudioData = 0;
+	HRESULT hr = RepairWaveFile(wszFileName, &cbAudioData);
+	if (FAILED(hr)) {
+		printf("Error repairing %s\n", szFileName);
+		printErrorDescription(hr);
+		return 1;
+	}
+	printf("Repaired %s: %I64u bytes of audio data.\n", szFileName,
+		cbAudioData);
+	return 0;
+}
+
+// Ends the MM and MF recordings cleanly on Ctrl+C, so the files are
+// closed with the right sizes
+BOOL WINAPI consoleCtrlHandler(DWORD dwCtrlType) {
+	if (dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_BREAK_EVENT) {
+		StopRecordings();
+		StopWaveFiles();
+		return TRUE;
+	}
+	return FALSE;
 }
 
 int _tmain(int argc, _TCHAR* argv[])
 {
+	if(argc > 2 && !_stricmp(argv[1], _T("-repair"))) {
+		return repairFile(argv[2]);
+	}
+	if(argc > 4 && !_stricmp(argv[1], _T("-repairwriter"))) {
+		// Started and killed by -repairbench
+		WCHAR wszFileName[MAX_PATH];
+		if(0 == MultiByteToWideChar(CP_ACP, 0, argv[4], -1, wszFileName,
+			MAX_PATH)) {
+			return 1;
+		}
+		return runRepairBenchWriter(atoi(argv[2]),
+			(HANDLE)(ULONG_PTR)_strtoui64(argv[3], NULL, 10), wszFileName);
+	}
+	if(argc > 1 && !_stricmp(argv[1], _T("-flacbench"))) {
+		// Optionally on a recorded WAV file
+		benchmarkFlacEncoder(argc > 2 ? argv[2] : NULL);
+		return 0;
+	}
+	if(!parseOptions(argc, argv)) {
+		return 1;
+	}
+	SetConsoleCtrlHandler(consoleCtrlHandler, TRUE);
 	if(argc > 1) {
 		if(!_stricmp(argv[1], _T("-mm"))) {
-			printAudioInfo();
+			printAudioInfo(g_msecDuration, g_dwPoolFlags, g_nThreads,
+				&g_spectrum);
 		} else if(!_stricmp(argv[1], _T("-mf"))) {
 			initializeMfCom();
 			printMfAudioInfo(TRUE);
@@ -140,10 +713,57 @@ int _tmain(int argc, _TCHAR* argv[])
 			initializeMfCom();
 			printMfAudioInfo(TRUE);
 			shutdownMfCom();
+		} else if(!_stricmp(argv[1], _T("-levelbench"))) {
+			printf("Level meter kernel: %s\n",
+				LevelMeter::KernelName(LevelMeter::BestKernel()));
+			benchmarkLevelMeter();
+		} else if(!_stricmp(argv[1], _T("-resamplebench"))) {
+			benchmarkResampler();
+		} else if(!_stricmp(argv[1], _T("-pcmbench"))) {
+			benchmarkPcmConverter();
+		} else if(!_stricmp(argv[1], _T("-wavebench"))) {
+			benchmarkWaveFile();
+		} else if(!_stricmp(argv[1], _T("-rf64bench"))) {
+			benchmarkRF64();
+		} else if(!_stricmp(argv[1], _T("-writebench"))) {
+			benchmarkWriteCoalescing();
+		} else if(!_stricmp(argv[1], _T("-repairbench"))) {
+			benchmarkRepair();
+		} else if(!_stricmp(argv[1], _T("-ringbench"))) {
+			benchmarkWaveInRing();
+		} else if(!_stricmp(argv[1], _T("-segmentbench"))) {
+			benchmarkWaveSegments();
+		} else if(!_stricmp(argv[1], _T("-gatebench"))) {
+			benchmarkActivityGate();
+		} else if(!_stricmp(argv[1], _T("-fftbench"))) {
+			benchmarkSpectrum();
+		} else if(!_stricmp(argv[1], _T("-guidbench"))) {
+			benchmarkGuidNames();
+		} else if(!_stricmp(argv[1], _T("-logbench"))) {
+			benchmarkDebugLog();
+		} else if(!_stricmp(argv[1], _T("-errorbench"))) {
+			benchmarkErrorRegistry();
+		} else if(!_stricmp(argv[1], _T("-typebench"))) {
+			initializeMfCom();
+			benchmarkMediaTypeCatalog();
+			shutdownMfCom();
+		} else if(!_stricmp(argv[1], _T("-jobbench"))) {
+			initializeMfCom();
+			benchmarkMfDeviceJobs();
+			shutdownMfCom();
+		} else if(!_stricmp(argv[1], _T("-pipebench"))) {
+			initializeMfCom();
+			benchmarkPipeline();
+			shutdownMfCom();
+		} else if(!_stricmp(argv[1], _T("-gatherbench"))) {
+			initializeMfCom();
+			benchmarkSampleBuffers();
+			shutdownMfCom();
 		} else if(!_stricmp(argv[1], _T("-mfwav"))) {
 			initializeMfCom();
 			printMfAudioInfo(FALSE);
 			shutdownMfCom();
+			printErrorCounts();
 		} else {
 			printf("Invalid option %s\n", argv[1]);
 		}
@@ -151,8 +771,10 @@ int _tmain(int argc, _TCHAR* argv[])
 		initializeMfCom();
 		printMfAudioInfo(TRUE);
 		shutdownMfCom();
+		printErrorCounts();
 	}
 	printf("All Done\n");
+	logShutdown();
 	return 0;
 }
 
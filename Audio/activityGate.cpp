@@ -0,0 +1,729 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "activityGate.h"
+
+#include <math.h>
+
+const double PI = 3.14159265358979323846;
+
+// Centres of the bands, which cover the formants of speech
+static const float bandHz[ACTIVITY_BANDS] = { 250.0f, 500.0f, 1000.0f, 2000.0f, 4000.0f };
+const float ACTIVITY_BAND_Q = 1.5f;
+// How fast the noise floor may rise, so that it follows a change in
+// the background within a few seconds but not a long word
+const float ACTIVITY_FLOOR_RISE_DB_PER_SEC = 1.0f;
+// Levels are clamped here, so digital silence has a finite floor
+const float ACTIVITY_MIN_DB = -100.0f;
+// Below this nothing is activity, however quiet the floor
+const float ACTIVITY_MIN_LEVEL_DB = -70.0f;
+// A band must clear the threshold by this much more than the overall
+// level, as its level is measured on less of the signal and varies more
+const float ACTIVITY_BAND_MARGIN_DB = 2.0f;
+// The filters settle within the first hops
+const UINT32 ACTIVITY_WARMUP_HOPS = 2;
+
+ActivityGate::ActivityGate() :
+m_nChannels(0),
+m_nHopFrames(0),
+m_pfnWrite(NULL),
+m_pfnGap(NULL),
+m_pContext(NULL),
+m_nBands(0),
+m_pChannelEnergy(NULL),
+m_pHop(NULL),
+m_pPad(NULL),
+m_hLog(INVALID_HANDLE_VALUE)
+{
+	m_szLog[0] = L'\0';
+}
+
+ActivityGate::~ActivityGate()
+{
+	CloseLog();
+	Free();
+}
+
+void ActivityGate::Free()
+{
+	delete [] m_pChannelEnergy;
+	m_pChannelEnergy = NULL;
+	delete [] m_pHop;
+	m_pHop = NULL;
+	delete [] m_pPad;
+	m_pPad = NULL;
+}
+
+HRESULT ActivityGate::Initialize(UINT32 nSampleRate, UINT32 nChannels,
+								 const ActivityOptions &options)
+{
+	if (nSampleRate == 0 || nChannels == 0 ||
+		options.msecPrePad > ACTIVITY_MAX_PAD_MSEC ||
+		options.msecPostPad > ACTIVITY_MAX_PAD_MSEC) {
+		return E_INVALIDARG;
+	}
+
+	Free();
+	m_nChannels = nChannels;
+	m_nHopFrames = max(nSampleRate * ACTIVITY_HOP_MSEC / 1000, 1U);
+	m_nMaxPadHops = (options.msecPrePad + ACTIVITY_HOP_MSEC - 1) / ACTIVITY_HOP_MSEC;
+	m_nPostHops = (options.msecPostPad + ACTIVITY_HOP_MSEC - 1) / ACTIVITY_HOP_MSEC;
+	m_options = options;
+
+	UINT32 nHopSamples = m_nHopFrames * nChannels;
+	m_pChannelEnergy = new (std::nothrow) float[nChannels];
+	m_pHop = new (std::nothrow) float[nHopSamples];
+	if (m_nMaxPadHops > 0) {
+		m_pPad = new (std::nothrow) float[m_nMaxPadHops * nHopSamples];
+	}
+	if (m_pChannelEnergy == NULL || m_pHop == NULL ||
+		(m_nMaxPadHops > 0 && m_pPad == NULL)) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+
+	// Band-pass filters with a peak gain of 1, for the bands below
+	// Nyquist
+	m_nBands = 0;
+	for (UINT32 i = 0; i < ACTIVITY_BANDS; i++) {
+		if (bandHz[i] >= 0.45f * nSampleRate) {
+			break;
+		}
+		double w0 = 2.0 * PI * bandHz[i] / nSampleRate;
+		double alpha = sin(w0) / (2.0 * ACTIVITY_BAND_Q);
+		ActivityBand *pBand = &m_bands[m_nBands++];
+		pBand->b0 = (float)(alpha / (1.0 + alpha));
+		pBand->a1 = (float)(-2.0 * cos(w0) / (1.0 + alpha));
+		pBand->a2 = (float)((1.0 - alpha) / (1.0 + alpha));
+		pBand->y1 = 0.0f;
+		pBand->y2 = 0.0f;
+		pBand->lastEnergy = 0.0f;
+		pBand->floorDb = ACTIVITY_MIN_DB;
+	}
+	m_x1 = 0.0f;
+	m_x2 = 0.0f;
+	m_floorDb = ACTIVITY_MIN_DB;
+	m_riseDb = ACTIVITY_FLOOR_RISE_DB_PER_SEC * ACTIVITY_HOP_MSEC / 1000.0f;
+	m_bActive = FALSE;
+	m_nWarmupHops = ACTIVITY_WARMUP_HOPS;
+	m_nHangover = 0;
+
+	m_nHopFill = 0;
+	m_iPadOldest = 0;
+	m_nPadHops = 0;
+	m_iPadFirstFrame = 0;
+	m_nInputFrames = 0;
+	m_nWrittenFrames = 0;
+	m_nSkippedFrames = 0;
+	m_iGapFirst = 0;
+	m_nGapFrames = 0;
+	m_cGaps = 0;
+	return S_OK;
+}
+
+void ActivityGate::SetOutput(ActivityWriteProc pfnWrite,
+							 ActivityGapProc pfnGap, void *pContext)
+{
+	m_pfnWrite = pfnWrite;
+	m_pfnGap = pfnGap;
+	m_pContext = pContext;
+}
+
+HRESULT ActivityGate::OpenLog(const WCHAR *szFileName)
+{
+	CloseLog();
+
+	// <name>.skipped.txt, beside the recording
+	WCHAR szStem[MAX_PATH];
+	HRESULT hr = StringCchCopyW(szStem, MAX_PATH, szFileName);
+	if (SUCCEEDED(hr)) {
+		*PathFindExtensionW(szStem) = L'\0';
+		hr = StringCchPrintfW(m_szLog, MAX_PATH, L"%s.skipped.txt", szStem);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	m_hLog = CreateFileW(m_szLog, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hLog == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	const char szHeader[] = "first_frame\tframes\toutput_frame\r\n";
+	DWORD cbWritten = 0;
+	if (!WriteFile(m_hLog, szHeader, sizeof(szHeader) - 1, &cbWritten, NULL)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+HRESULT ActivityGate::CloseLog()
+{
+	if (m_hLog != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hLog);
+		m_hLog = INVALID_HANDLE_VALUE;
+	}
+	return S_OK;
+}
+
+// Moves a noise floor down to the level at once, or up towards it by at
+// most the rise per hop
+void ActivityGate::UpdateFloor(float *pFloorDb, float levelDb, BOOL bReset)
+{
+	if (bReset || levelDb < *pFloorDb + m_riseDb) {
+		*pFloorDb = levelDb;
+	} else {
+		*pFloorDb += m_riseDb;
+	}
+}
+
+// Measures one hop and returns whether it is activity
+BOOL ActivityGate::Detect(const float *pFrames)
+{
+	UINT32 nChannels = m_nChannels;
+	UINT32 nBands = m_nBands;
+	float scale = 1.0f / nChannels;
+	float x1 = m_x1;
+	float x2 = m_x2;
+
+	for (UINT32 ch = 0; ch < nChannels; ch++) {
+		m_pChannelEnergy[ch] = 0.0f;
+	}
+	for (UINT32 b = 0; b < nBands; b++) {
+		m_bands[b].energy = 0.0f;
+	}
+
+	for (UINT32 i = 0; i < m_nHopFrames; i++) {
+		float mix = 0.0f;
+		for (UINT32 ch = 0; ch < nChannels; ch++) {
+			float x = pFrames[ch];
+			m_pChannelEnergy[ch] += x * x;
+			mix += x;
+		}
+		pFrames += nChannels;
+		mix *= scale;
+
+		// b0 * (x[n] - x[n-2]) - a1 * y[n-1] - a2 * y[n-2]
+		float d = mix - x2;
+		for (UINT32 b = 0; b < nBands; b++) {
+			ActivityBand *pBand = &m_bands[b];
+			float y = pBand->b0 * d - pBand->a1 * pBand->y1 - pBand->a2 * pBand->y2;
+			pBand->y2 = pBand->y1;
+			pBand->y1 = y;
+			pBand->energy += y * y;
+		}
+		x2 = x1;
+		x1 = mix;
+	}
+	m_x1 = x1;
+	m_x2 = x2;
+
+	// The level of the loudest channel
+	float energy = 0.0f;
+	for (UINT32 ch = 0; ch < nChannels; ch++) {
+		energy = max(energy, m_pChannelEnergy[ch]);
+	}
+	float levelDb = max(10.0f * log10f(energy / m_nHopFrames + 1e-12f),
+		ACTIVITY_MIN_DB);
+	BOOL bWarmup = (m_nWarmupHops > 0);
+	if (bWarmup) {
+		m_nWarmupHops--;
+	}
+	UpdateFloor(&m_floorDb, levelDb, bWarmup);
+	float snrDb = levelDb - m_floorDb;
+
+	// The band levels are over the last two hops, to steady them
+	for (UINT32 b = 0; b < nBands; b++) {
+		ActivityBand *pBand = &m_bands[b];
+		float bandDb = max(10.0f * log10f((pBand->energy + pBand->lastEnergy) /
+			(2 * m_nHopFrames) + 1e-12f), ACTIVITY_MIN_DB);
+		pBand->lastEnergy = pBand->energy;
+		UpdateFloor(&pBand->floorDb, bandDb, bWarmup);
+		snrDb = max(snrDb, bandDb - pBand->floorDb - ACTIVITY_BAND_MARGIN_DB);
+
+		// Keep the filters out of denormals in digital silence
+		if (fabsf(pBand->y1) < 1e-20f && fabsf(pBand->y2) < 1e-20f) {
+			pBand->y1 = 0.0f;
+			pBand->y2 = 0.0f;
+		}
+	}
+	if (bWarmup) {
+		return FALSE;
+	}
+
+	float thresholdDb = m_options.thresholdDb;
+	if (m_bActive) {
+		thresholdDb -= ACTIVITY_HYSTERESIS_DB;
+	}
+	m_bActive = (levelDb > ACTIVITY_MIN_LEVEL_DB && snrDb > thresholdDb);
+	return m_bActive;
+}
+
+HRESULT ActivityGate::WriteFrames(const float *pFrames, UINT32 nFrames)
+{
+	if (nFrames == 0) {
+		return S_OK;
+	}
+	HRESULT hr = m_pfnWrite(pFrames, nFrames, m_pContext);
+	if (SUCCEEDED(hr)) {
+		m_nWrittenFrames += nFrames;
+	}
+	return hr;
+}
+
+void ActivityGate::SkipFrames(ULONGLONG iFirstFrame, ULONGLONG nFrames)
+{
+	if (m_nGapFrames == 0) {
+		m_iGapFirst = iFirstFrame;
+	}
+	m_nGapFrames += nFrames;
+	m_nSkippedFrames += nFrames;
+}
+
+// Reports the skipped stretch that has just ended, if any
+HRESULT ActivityGate::EndGap()
+{
+	if (m_nGapFrames == 0) {
+		return S_OK;
+	}
+	HRESULT hr = S_OK;
+	ULONGLONG iFirst = m_iGapFirst;
+	ULONGLONG nFrames = m_nGapFrames;
+	m_nGapFrames = 0;
+	m_cGaps++;
+
+	if (m_hLog != INVALID_HANDLE_VALUE) {
+		char szLine[128];
+		DWORD cbWritten = 0;
+		hr = StringCchPrintfA(szLine, ARRAYSIZE(szLine), "%I64u\t%I64u\t%I64u\r\n",
+			iFirst, nFrames, m_nWrittenFrames);
+		if (SUCCEEDED(hr) &&
+			!WriteFile(m_hLog, szLine, (DWORD)strlen(szLine), &cbWritten, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (SUCCEEDED(hr) && m_pfnGap) {
+		hr = m_pfnGap(iFirst, nFrames, m_nWrittenFrames, m_pContext);
+	}
+	return hr;
+}
+
+// Decides on the full hop in m_pHop and writes, holds or skips it
+HRESULT ActivityGate::ProcessHop()
+{
+	UINT32 nHopSamples = m_nHopFrames * m_nChannels;
+	ULONGLONG iHopFirst = m_nInputFrames - m_nHopFrames;
+
+	if (Detect(m_pHop)) {
+		m_nHangover = m_nPostHops + 1;
+	} else if (m_nHangover > 0) {
+		m_nHangover--;
+	}
+
+	if (IsOpen()) {
+		// The held hops go first, in at most two pieces of the ring
+		HRESULT hr = EndGap();
+		if (SUCCEEDED(hr) && m_nPadHops > 0) {
+			UINT32 nFirst = min(m_nPadHops, m_nMaxPadHops - m_iPadOldest);
+			hr = WriteFrames(m_pPad + m_iPadOldest * nHopSamples,
+				nFirst * m_nHopFrames);
+			if (SUCCEEDED(hr)) {
+				hr = WriteFrames(m_pPad, (m_nPadHops - nFirst) * m_nHopFrames);
+			}
+		}
+		m_iPadOldest = 0;
+		m_nPadHops = 0;
+		if (SUCCEEDED(hr)) {
+			hr = WriteFrames(m_pHop, m_nHopFrames);
+		}
+		return hr;
+	}
+
+	// Closed: hold the hop, skipping the oldest one to make room
+	if (m_nMaxPadHops == 0) {
+		SkipFrames(iHopFirst, m_nHopFrames);
+		return S_OK;
+	}
+	if (m_nPadHops == m_nMaxPadHops) {
+		SkipFrames(m_iPadFirstFrame, m_nHopFrames);
+		m_iPadOldest = (m_iPadOldest + 1) % m_nMaxPadHops;
+		m_nPadHops--;
+		m_iPadFirstFrame += m_nHopFrames;
+	}
+	if (m_nPadHops == 0) {
+		m_iPadFirstFrame = iHopFirst;
+	}
+	UINT32 iSlot = (m_iPadOldest + m_nPadHops) % m_nMaxPadHops;
+	CopyMemory(m_pPad + iSlot * nHopSamples, m_pHop, nHopSamples * sizeof(float));
+	m_nPadHops++;
+	return S_OK;
+}
+
+HRESULT ActivityGate::Process(const float *pFrames, UINT32 nFrames)
+{
+	if (m_pHop == NULL || m_pfnWrite == NULL) {
+		return E_UNEXPECTED;
+	}
+
+	HRESULT hr = S_OK;
+	while (nFrames > 0 && SUCCEEDED(hr)) {
+		UINT32 n = min(nFrames, m_nHopFrames - m_nHopFill);
+		CopyMemory(m_pHop + m_nHopFill * m_nChannels, pFrames,
+			n * m_nChannels * sizeof(float));
+		m_nHopFill += n;
+		m_nInputFrames += n;
+		pFrames += n * m_nChannels;
+		nFrames -= n;
+
+		if (m_nHopFill == m_nHopFrames) {
+			m_nHopFill = 0;
+			hr = ProcessHop();
+		}
+	}
+	return hr;
+}
+
+HRESULT ActivityGate::Flush()
+{
+	if (m_pHop == NULL) {
+		return S_OK;
+	}
+
+	// The partial hop goes the way of the last decision.  While the
+	// gate is closed, what it was holding is idle too.
+	HRESULT hr = S_OK;
+	if (IsOpen()) {
+		hr = WriteFrames(m_pHop, m_nHopFill);
+	} else {
+		if (m_nPadHops > 0) {
+			SkipFrames(m_iPadFirstFrame, (ULONGLONG)m_nPadHops * m_nHopFrames);
+		}
+		if (m_nHopFill > 0) {
+			SkipFrames(m_nInputFrames - m_nHopFill, m_nHopFill);
+		}
+	}
+	m_nHopFill = 0;
+	m_iPadOldest = 0;
+	m_nPadHops = 0;
+	if (SUCCEEDED(hr)) {
+		hr = EndGap();
+	}
+	return hr;
+}
+
+// Synthetic recording for the benchmark: utterances of voiced and
+// unvoiced syllables between pauses, and which hops are speech
+struct ActivityTestSignal
+{
+	float       *pSpeech;
+	float       *pNoise;
+	BYTE        *pIsSpeech;     // One per hop
+	UINT32      nFrames;
+	UINT32      nHops;
+};
+
+static float RandomFloat(float lo, float hi)
+{
+	return lo + (hi - lo) * rand() / (float)RAND_MAX;
+}
+
+// Two-pole resonator at hz with the given bandwidth
+static void Resonate(float *pData, UINT32 n, float hz, float bandwidthHz,
+					 UINT32 nSampleRate)
+{
+	double r = exp(-PI * bandwidthHz / nSampleRate);
+	float a1 = (float)(2.0 * r * cos(2.0 * PI * hz / nSampleRate));
+	float a2 = (float)(-r * r);
+	float y1 = 0.0f, y2 = 0.0f;
+	for (UINT32 i = 0; i < n; i++) {
+		float y = pData[i] + a1 * y1 + a2 * y2;
+		y2 = y1;
+		y1 = y;
+		pData[i] = y;
+	}
+}
+
+static void MakeSyllable(float *pData, UINT32 n, float rms, UINT32 nSampleRate)
+{
+	if (rand() % 5 == 0) {
+		// Unvoiced: hiss shaped around 3.5 kHz
+		for (UINT32 i = 0; i < n; i++) {
+			pData[i] = RandomFloat(-1.0f, 1.0f);
+		}
+		Resonate(pData, n, RandomFloat(3000.0f, 4500.0f), 1500.0f, nSampleRate);
+	} else {
+		// Voiced: a gliding pulse train through two formants
+		float f0 = RandomFloat(100.0f, 220.0f);
+		float glide = RandomFloat(-0.3f, 0.3f);
+		float phase = 1.0f;
+		for (UINT32 i = 0; i < n; i++) {
+			phase += f0 * (1.0f + glide * i / n) / nSampleRate;
+			pData[i] = 0.0f;
+			if (phase >= 1.0f) {
+				phase -= 1.0f;
+				pData[i] = 1.0f;
+			}
+		}
+		float *pCopy = new (std::nothrow) float[n];
+		if (pCopy != NULL) {
+			CopyMemory(pCopy, pData, n * sizeof(float));
+			Resonate(pData, n, RandomFloat(300.0f, 800.0f), 90.0f, nSampleRate);
+			Resonate(pCopy, n, RandomFloat(900.0f, 2200.0f), 120.0f, nSampleRate);
+			for (UINT32 i = 0; i < n; i++) {
+				pData[i] += 0.5f * pCopy[i];
+			}
+			delete [] pCopy;
+		}
+	}
+
+	// Scale to the level asked for, fading in and out
+	double sum = 0.0;
+	for (UINT32 i = 0; i < n; i++) {
+		sum += pData[i] * pData[i];
+	}
+	float gain = (float)(rms / sqrt(sum / n + 1e-20));
+	for (UINT32 i = 0; i < n; i++) {
+		pData[i] *= gain * (float)sin(PI * (i + 0.5) / n);
+	}
+}
+
+static HRESULT MakeTestSignal(UINT32 nSeconds, UINT32 nSampleRate,
+							  UINT32 nHopFrames, ActivityTestSignal *pSignal)
+{
+	pSignal->nFrames = nSeconds * nSampleRate;
+	pSignal->nHops = (pSignal->nFrames + nHopFrames - 1) / nHopFrames;
+	pSignal->pSpeech = new (std::nothrow) float[pSignal->nFrames];
+	pSignal->pNoise = new (std::nothrow) float[pSignal->nFrames];
+	pSignal->pIsSpeech = new (std::nothrow) BYTE[pSignal->nHops];
+	if (pSignal->pSpeech == NULL || pSignal->pNoise == NULL ||
+		pSignal->pIsSpeech == NULL) {
+		return E_OUTOFMEMORY;
+	}
+	ZeroMemory(pSignal->pSpeech, pSignal->nFrames * sizeof(float));
+	ZeroMemory(pSignal->pIsSpeech, pSignal->nHops);
+
+	// Speech at about -20 dBFS, louder and quieter syllables mixed
+	UINT32 i = nSampleRate * 2;
+	while (true) {
+		UINT32 iStart = i;
+		UINT32 nUtterance = (UINT32)(RandomFloat(0.8f, 3.0f) * nSampleRate);
+		if (iStart + nUtterance >= pSignal->nFrames) {
+			break;
+		}
+		while (i < iStart + nUtterance) {
+			UINT32 nSyllable = (UINT32)(RandomFloat(0.1f, 0.25f) * nSampleRate);
+			nSyllable = min(nSyllable, pSignal->nFrames - i);
+			MakeSyllable(pSignal->pSpeech + i, nSyllable,
+				RandomFloat(0.05f, 0.15f), nSampleRate);
+			i += nSyllable + (UINT32)(RandomFloat(0.02f, 0.08f) * nSampleRate);
+		}
+		i = min(i, pSignal->nFrames);
+		for (UINT32 h = iStart / nHopFrames; h <= (i - 1) / nHopFrames; h++) {
+			pSignal->pIsSpeech[h] = 1;
+		}
+		i += (UINT32)(RandomFloat(1.0f, 5.0f) * nSampleRate);
+	}
+
+	// Noise of unit RMS, half white and half low-passed, slowly
+	// changing level by 3 dB either way
+	float lowpass = 0.0f;
+	for (i = 0; i < pSignal->nFrames; i++) {
+		float white = RandomFloat(-1.0f, 1.0f);
+		lowpass += 0.05f * (white - lowpass);
+		float swell = (float)(1.0 + 0.4 * sin(2.0 * PI * i / (20.0 * nSampleRate)));
+		pSignal->pNoise[i] = swell * (1.22f * white + 7.6f * lowpass);
+	}
+	return S_OK;
+}
+
+static void FreeTestSignal(ActivityTestSignal *pSignal)
+{
+	delete [] pSignal->pSpeech;
+	delete [] pSignal->pNoise;
+	delete [] pSignal->pIsSpeech;
+}
+
+// Follows the gate's output through the input, checking that each
+// frame written is the input frame the gaps say it should be
+struct ActivityTestOutput
+{
+	const float *pInput;
+	UINT32      nChannels;
+	UINT32      nHopFrames;
+	ULONGLONG   iInput;         // Input frame of the next one written
+	ULONGLONG   nWritten;
+	BYTE        *pSkipped;      // One per hop
+	UINT32      nMismatches;
+};
+
+static HRESULT TestWrite(const float *pFrames, UINT32 nFrames, void *pContext)
+{
+	ActivityTestOutput *pOut = (ActivityTestOutput *)pContext;
+	if (pOut->pInput &&
+		memcmp(pFrames, pOut->pInput + pOut->iInput * pOut->nChannels,
+		nFrames * pOut->nChannels * sizeof(float)) != 0) {
+		pOut->nMismatches++;
+	}
+	pOut->iInput += nFrames;
+	pOut->nWritten += nFrames;
+	return S_OK;
+}
+
+static HRESULT TestGap(ULONGLONG iFirstFrame, ULONGLONG nFrames,
+					   ULONGLONG iOutputFrame, void *pContext)
+{
+	ActivityTestOutput *pOut = (ActivityTestOutput *)pContext;
+	if (iFirstFrame != pOut->iInput || iOutputFrame != pOut->nWritten) {
+		pOut->nMismatches++;
+	}
+	if (pOut->pSkipped) {
+		// Gaps start and end on hops, but for the end of the input
+		for (ULONGLONG i = iFirstFrame; i < iFirstFrame + nFrames;
+			i += pOut->nHopFrames) {
+			pOut->pSkipped[i / pOut->nHopFrames] = 1;
+		}
+	}
+	pOut->iInput = iFirstFrame + nFrames;
+	return S_OK;
+}
+
+void benchmarkActivityGate(void) {
+	const UINT32 N_SECONDS = 120;
+	const UINT32 SAMPLE_RATE = 48000;
+	const UINT32 BLOCK_FRAMES = 480;
+	static const int snrs[] = { 30, 20, 10, 5, 0 };
+	static const UINT32 channelCounts[] = { 1, 2, 8 };
+
+	ActivityOptions options;
+	options.bEnabled = TRUE;
+	UINT32 nHopFrames = SAMPLE_RATE * ACTIVITY_HOP_MSEC / 1000;
+	UINT32 nPreHops = options.msecPrePad / ACTIVITY_HOP_MSEC;
+	UINT32 nPostHops = options.msecPostPad / ACTIVITY_HOP_MSEC;
+
+	ActivityTestSignal signal;
+	ZeroMemory(&signal, sizeof(signal));
+	UINT32 nMaxChannels = channelCounts[ARRAYSIZE(channelCounts) - 1];
+	srand(1);
+	HRESULT hr = MakeTestSignal(N_SECONDS, SAMPLE_RATE, nHopFrames, &signal);
+	float *pMix = new (std::nothrow) float[signal.nFrames * nMaxChannels];
+	BYTE *pSkipped = new (std::nothrow) BYTE[signal.nHops];
+	BYTE *pNearSpeech = new (std::nothrow) BYTE[signal.nHops];
+	if (FAILED(hr) || pMix == NULL || pSkipped == NULL || pNearSpeech == NULL) {
+		printf("Out of memory\n");
+		FreeTestSignal(&signal);
+		delete [] pMix;
+		delete [] pSkipped;
+		delete [] pNearSpeech;
+		return;
+	}
+
+	// Idle hops within the padding of speech are meant to be written,
+	// so they count as neither
+	ZeroMemory(pNearSpeech, signal.nHops);
+	for (UINT32 h = 0; h < signal.nHops; h++) {
+		if (signal.pIsSpeech[h]) {
+			UINT32 hFirst = h > nPreHops ? h - nPreHops : 0;
+			UINT32 hLast = min(h + nPostHops, signal.nHops - 1);
+			for (UINT32 k = hFirst; k <= hLast; k++) {
+				pNearSpeech[k] = 1;
+			}
+		}
+	}
+
+	printf("Activity gate benchmark, %u sec of synthetic speech in noise, "
+		"%.0f dB threshold, %u ms pre, %u ms post\n", N_SECONDS,
+		options.thresholdDb, options.msecPrePad, options.msecPostPad);
+	for (int iSnr = 0; iSnr < ARRAYSIZE(snrs); iSnr++) {
+		// Speech syllables are at about 0.1 RMS
+		float noiseRms = 0.1f * (float)pow(10.0, -snrs[iSnr] / 20.0);
+		for (UINT32 i = 0; i < signal.nFrames; i++) {
+			pMix[i] = signal.pSpeech[i] + noiseRms * signal.pNoise[i];
+		}
+
+		ActivityTestOutput output;
+		ZeroMemory(&output, sizeof(output));
+		output.pInput = pMix;
+		output.nChannels = 1;
+		output.nHopFrames = nHopFrames;
+		output.pSkipped = pSkipped;
+		ZeroMemory(pSkipped, signal.nHops);
+
+		ActivityGate gate;
+		hr = gate.Initialize(SAMPLE_RATE, 1, options);
+		gate.SetOutput(TestWrite, TestGap, &output);
+		for (UINT32 i = 0; i < signal.nFrames && SUCCEEDED(hr); i += BLOCK_FRAMES) {
+			hr = gate.Process(pMix + i, min(BLOCK_FRAMES, signal.nFrames - i));
+		}
+		if (SUCCEEDED(hr)) {
+			hr = gate.Flush();
+		}
+		if (FAILED(hr)) {
+			printf("  %2d dB SNR failed\n", snrs[iSnr]);
+			printErrorDescription(hr);
+			continue;
+		}
+
+		UINT32 nSpeech = 0, nSpeechWritten = 0, nIdle = 0, nIdleSkipped = 0;
+		for (UINT32 h = 0; h < signal.nHops; h++) {
+			if (signal.pIsSpeech[h]) {
+				nSpeech++;
+				nSpeechWritten += !pSkipped[h];
+			} else if (!pNearSpeech[h]) {
+				nIdle++;
+				nIdleSkipped += pSkipped[h];
+			}
+		}
+		BOOL bTimeline = (output.nMismatches == 0 && output.iInput == signal.nFrames &&
+			output.nWritten == gate.WrittenFrames() &&
+			gate.WrittenFrames() + gate.SkippedFrames() == gate.InputFrames());
+		printf("  %2d dB SNR: %5.1f%% of speech written, %5.1f%% of idle skipped, "
+			"%4.1f%% of the audio written in %u piece(s), timeline %s\n",
+			snrs[iSnr], 100.0 * nSpeechWritten / max(nSpeech, 1U),
+			100.0 * nIdleSkipped / max(nIdle, 1U),
+			100.0 * gate.WrittenFrames() / gate.InputFrames(), gate.GapCount() + 1,
+			bTimeline ? "matches" : "DOES NOT MATCH");
+	}
+
+	// Speed, on the 10 dB mix spread over the channels
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	float noiseRms = 0.1f * (float)pow(10.0, -10 / 20.0);
+	for (int iCount = 0; iCount < ARRAYSIZE(channelCounts); iCount++) {
+		UINT32 nChannels = channelCounts[iCount];
+		for (UINT32 i = 0; i < signal.nFrames; i++) {
+			for (UINT32 ch = 0; ch < nChannels; ch++) {
+				pMix[i * nChannels + ch] = signal.pSpeech[i] +
+					noiseRms * signal.pNoise[(i + ch * 7919) % signal.nFrames];
+			}
+		}
+
+		ActivityTestOutput output;
+		ZeroMemory(&output, sizeof(output));
+		ActivityGate gate;
+		hr = gate.Initialize(SAMPLE_RATE, nChannels, options);
+		gate.SetOutput(TestWrite, TestGap, &output);
+		LARGE_INTEGER tStart, tEnd;
+		QueryPerformanceCounter(&tStart);
+		for (UINT32 i = 0; i < signal.nFrames && SUCCEEDED(hr); i += BLOCK_FRAMES) {
+			hr = gate.Process(pMix + i * nChannels,
+				min(BLOCK_FRAMES, signal.nFrames - i));
+		}
+		if (SUCCEEDED(hr)) {
+			hr = gate.Flush();
+		}
+		QueryPerformanceCounter(&tEnd);
+		if (FAILED(hr)) {
+			printf("  %u channel(s) failed\n", nChannels);
+			printErrorDescription(hr);
+			continue;
+		}
+		double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+		printf("  %u channel(s): %6.0fx real time, %.3f%% of a core per channel\n",
+			nChannels, N_SECONDS / seconds,
+			100.0 * seconds / N_SECONDS / nChannels);
+	}
+
+	FreeTestSignal(&signal);
+	delete [] pMix;
+	delete [] pSkipped;
+	delete [] pNearSpeech;
+}
@@ -0,0 +1,152 @@
+//////////////////////////////////////////////////////////////////////////
+// activityGate.h: Skips the silent stretches of a recording
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Length of audio each decision is made on
+const DWORD ACTIVITY_HOP_MSEC = 10;
+// Bands of the channel mix that are measured on their own
+const UINT32 ACTIVITY_BANDS = 5;
+// Longest padding either side of the activity
+const DWORD ACTIVITY_MAX_PAD_MSEC = 10000;
+// How far below the threshold the level may fall before the gate
+// starts to close
+const float ACTIVITY_HYSTERESIS_DB = 4.0f;
+
+// When to write audio.  The gate opens when the level rises
+// thresholdDb above the noise floor and closes once it has fallen back
+// to within ACTIVITY_HYSTERESIS_DB of the threshold for msecPostPad.
+struct ActivityOptions
+{
+    BOOL    bEnabled;
+    float   thresholdDb;        // Level above the noise floor that opens the gate.
+    DWORD   msecPrePad;         // Audio written from before the gate opens.
+    DWORD   msecPostPad;        // Audio written after the activity ends.
+
+    ActivityOptions() :
+    bEnabled(FALSE),
+    thresholdDb(9.0f),
+    msecPrePad(300),
+    msecPostPad(500)
+    {
+    }
+};
+
+// Receives the frames the gate lets through, in order
+typedef HRESULT (*ActivityWriteProc)(const float *pFrames, UINT32 nFrames,
+                                     void *pContext);
+// Receives each stretch that was skipped: its first frame and length in
+// the input, and the frame of the output it was cut from
+typedef HRESULT (*ActivityGapProc)(ULONGLONG iFirstFrame, ULONGLONG nFrames,
+                                   ULONGLONG iOutputFrame, void *pContext);
+
+// One band-pass filter of the detector, and the band's noise floor
+struct ActivityBand
+{
+    float   b0, a1, a2;         // Coefficients, b1 is 0 and b2 is -b0
+    float   y1, y2;
+    float   energy;             // Over the current hop
+    float   lastEnergy;         // Over the previous hop
+    float   floorDb;
+};
+
+// Decides every ACTIVITY_HOP_MSEC whether the float audio passing
+// through is activity or idle, and passes on only the activity plus
+// its padding.  A hop is active when its loudest channel is well above
+// its tracked noise floor, or when one of the speech bands of the
+// channel mix is.  The bands find speech in broadband noise that hides
+// it from the overall level.  Each noise floor follows its level down
+// at once and up slowly, so steady noise closes the gate however loud
+// it is.
+//
+// While the gate is closed the last msecPrePad of audio is held in a
+// ring, and written ahead of the hop that opens it.  What falls out of
+// the ring is skipped, and each skipped stretch is reported when the
+// gate opens again or at Flush, so the timeline of the recording can be
+// put back together.  With OpenLog, they are also listed in
+// <name>.skipped.txt.
+//
+// All memory is allocated in Initialize.  The per-sample work is one
+// multiply-add per channel and ACTIVITY_BANDS biquads on the mix.
+class ActivityGate
+{
+public:
+    ActivityGate();
+    ~ActivityGate();
+
+    HRESULT Initialize(UINT32 nSampleRate, UINT32 nChannels,
+                       const ActivityOptions &options);
+    // Where the frames and the gaps go.  pfnGap may be NULL.
+    void    SetOutput(ActivityWriteProc pfnWrite, ActivityGapProc pfnGap,
+                      void *pContext);
+    HRESULT OpenLog(const WCHAR *szFileName);
+    // Passes whole frames on as the gate decides, holding back up to a
+    // hop plus the pre-padding
+    HRESULT Process(const float *pFrames, UINT32 nFrames);
+    // Decides on what is held back, at the end of the input
+    HRESULT Flush();
+    HRESULT CloseLog();
+
+    UINT32      Channels() const { return m_nChannels; }
+    BOOL        IsOpen() const { return m_nHangover > 0; }
+    ULONGLONG   InputFrames() const { return m_nInputFrames; }
+    ULONGLONG   WrittenFrames() const { return m_nWrittenFrames; }
+    ULONGLONG   SkippedFrames() const { return m_nSkippedFrames; }
+    UINT32      GapCount() const { return m_cGaps; }
+    const WCHAR *LogName() const { return m_szLog; }
+
+private:
+    BOOL    Detect(const float *pFrames);
+    void    UpdateFloor(float *pFloorDb, float levelDb, BOOL bReset);
+    HRESULT ProcessHop();
+    void    SkipFrames(ULONGLONG iFirstFrame, ULONGLONG nFrames);
+    HRESULT WriteFrames(const float *pFrames, UINT32 nFrames);
+    HRESULT EndGap();
+    void    Free();
+
+    UINT32      m_nChannels;
+    UINT32      m_nHopFrames;
+    ActivityOptions m_options;
+    ActivityWriteProc m_pfnWrite;
+    ActivityGapProc m_pfnGap;
+    void        *m_pContext;
+
+    // Detector
+    ActivityBand m_bands[ACTIVITY_BANDS];
+    UINT32      m_nBands;
+    float       m_x1, m_x2;         // Last inputs to the band filters
+    float       *m_pChannelEnergy;
+    float       m_floorDb;
+    float       m_riseDb;           // Floor rise per hop
+    BOOL        m_bActive;
+    UINT32      m_nWarmupHops;      // Hops that only set the floors
+    UINT32      m_nHangover;        // Hops until the gate closes
+    UINT32      m_nPostHops;
+
+    // The hop being filled, and the ring of hops held while closed
+    float       *m_pHop;
+    UINT32      m_nHopFill;
+    float       *m_pPad;
+    UINT32      m_nMaxPadHops;
+    UINT32      m_iPadOldest;
+    UINT32      m_nPadHops;
+    ULONGLONG   m_iPadFirstFrame;   // Input frame of the oldest held hop
+
+    ULONGLONG   m_nInputFrames;
+    ULONGLONG   m_nWrittenFrames;
+    ULONGLONG   m_nSkippedFrames;
+    ULONGLONG   m_iGapFirst;        // Skipped stretch being built
+    ULONGLONG   m_nGapFrames;
+    UINT32      m_cGaps;
+
+    WCHAR       m_szLog[MAX_PATH];
+    HANDLE      m_hLog;
+};
+
+// Runs the gate over synthetic speech in noise at several levels and
+// prints how much of the speech and the idle audio it writes, and how
+// fast it runs.
+void benchmarkActivityGate(void);
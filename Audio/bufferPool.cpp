@@ -0,0 +1,276 @@
+#include "stdafx.h"
+#include "bufferPool.h"
+
+// Enables SeLockMemoryPrivilege for the process, which large pages
+// require.  Fails unless the account has been granted the privilege.
+static BOOL EnableLockMemoryPrivilege()
+{
+	HANDLE hToken = NULL;
+	TOKEN_PRIVILEGES tp;
+	BOOL bResult = FALSE;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES,
+		&hToken)) {
+		return FALSE;
+	}
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+		&tp.Privileges[0].Luid)) {
+		// AdjustTokenPrivileges succeeds even when the privilege is
+		// not held, so check the last error as well
+		bResult = AdjustTokenPrivileges(hToken, FALSE, &tp, 0, NULL, NULL) &&
+			GetLastError() == ERROR_SUCCESS;
+	}
+	CloseHandle(hToken);
+	return bResult;
+}
+
+BufferPool::BufferPool() :
+m_pRegion(NULL),
+m_cbRegion(0),
+m_ppAll(NULL),
+m_ppFree(NULL),
+m_nAll(0),
+m_nFree(0),
+m_nMax(0),
+m_cbBuffer(0),
+m_cbAllocation(0),
+m_dwFlags(0),
+m_bLargePages(FALSE),
+m_bLocked(FALSE),
+m_cbOldMinWorkingSet(0),
+m_cbOldMaxWorkingSet(0),
+m_nHighWater(0),
+m_nAcquired(0),
+m_nGrown(0),
+m_nFailed(0)
+{
+	InitializeCriticalSection(&m_critsec);
+}
+
+BufferPool::~BufferPool()
+{
+	Shutdown();
+	DeleteCriticalSection(&m_critsec);
+}
+
+// Allocates nInitial buffers of at least cbBuffer bytes.  Should not
+// be called while buffers are in use.
+HRESULT BufferPool::Initialize(DWORD cbBuffer, LONG nInitial, LONG nMax,
+							   DWORD dwFlags)
+{
+	if (cbBuffer == 0 || nMax <= 0 || nInitial < 0 || nInitial > nMax) {
+		return E_INVALIDARG;
+	}
+
+	Shutdown();
+
+	m_ppAll = new (std::nothrow) BYTE*[nMax];
+	m_ppFree = new (std::nothrow) BYTE*[nMax];
+	if (m_ppAll == NULL || m_ppFree == NULL) {
+		Shutdown();
+		return E_OUTOFMEMORY;
+	}
+	m_nMax = nMax;
+	m_cbBuffer = cbBuffer;
+	m_dwFlags = dwFlags;
+
+	// Round each allocation up to whole pages
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	SIZE_T cbPage = si.dwPageSize;
+	m_cbAllocation = (DWORD)(((cbBuffer + cbPage - 1) / cbPage) * cbPage);
+
+	// A large page is 2 MB or more, so rather than give each buffer
+	// one, the whole pool is committed up front in as few as will
+	// hold it and the buffers are cut from that
+	m_bLargePages = FALSE;
+	if (dwFlags & BUFFER_POOL_LARGE_PAGES) {
+		SIZE_T cbLargePage = GetLargePageMinimum();
+		if (cbLargePage != 0 && EnableLockMemoryPrivilege()) {
+			SIZE_T cbPool = (SIZE_T)m_cbAllocation * nMax;
+			m_cbRegion = ((cbPool + cbLargePage - 1) / cbLargePage) * cbLargePage;
+			m_pRegion = (BYTE *)VirtualAlloc(NULL, m_cbRegion,
+				MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (m_pRegion != NULL) {
+				m_bLargePages = TRUE;
+			} else {
+				m_cbRegion = 0;
+				printf("Cannot allocate large pages (%u), using normal pages\n",
+					GetLastError());
+			}
+		} else {
+			printf("Large pages are not available, using normal pages\n");
+		}
+	}
+
+	// Locked buffers count against the working set minimum, so raise
+	// it to cover the whole pool.  Shutdown puts it back.  Large pages
+	// are always locked.
+	m_bLocked = FALSE;
+	if ((dwFlags & BUFFER_POOL_LOCKED) && !m_bLargePages) {
+		SIZE_T cbMin = 0, cbMax = 0;
+		SIZE_T cbPool = (SIZE_T)m_cbAllocation * nMax;
+		if (GetProcessWorkingSetSize(GetCurrentProcess(), &cbMin, &cbMax) &&
+			SetProcessWorkingSetSize(GetCurrentProcess(), cbMin + cbPool,
+			max(cbMax, cbMin + cbPool))) {
+			m_bLocked = TRUE;
+			m_cbOldMinWorkingSet = cbMin;
+			m_cbOldMaxWorkingSet = cbMax;
+		} else {
+			printf("Cannot raise the working set, buffers will not be locked\n");
+		}
+	}
+
+	for (LONG i = 0; i < nInitial; i++) {
+		BYTE *pBuffer = AllocateBuffer();
+		if (pBuffer == NULL) {
+			Shutdown();
+			return E_OUTOFMEMORY;
+		}
+		m_ppFree[m_nFree++] = pBuffer;
+	}
+	return S_OK;
+}
+
+// Frees all the buffers and restores the working set size.  Buffers
+// still in use are freed as well, so this should only be called once
+// they have been released.
+void BufferPool::Shutdown()
+{
+	EnterCriticalSection(&m_critsec);
+	if (m_nFree != m_nAll) {
+		printf("BufferPool: %d buffers still in use at shutdown\n",
+			m_nAll - m_nFree);
+	}
+	for (LONG i = 0; i < m_nAll; i++) {
+		FreeBuffer(m_ppAll[i]);
+	}
+	if (m_pRegion != NULL) {
+		VirtualFree(m_pRegion, 0, MEM_RELEASE);
+		m_pRegion = NULL;
+		m_cbRegion = 0;
+	}
+	if (m_bLocked) {
+		SetProcessWorkingSetSize(GetCurrentProcess(), m_cbOldMinWorkingSet,
+			m_cbOldMaxWorkingSet);
+		m_bLocked = FALSE;
+	}
+	delete [] m_ppAll;
+	delete [] m_ppFree;
+	m_ppAll = NULL;
+	m_ppFree = NULL;
+	m_nAll = 0;
+	m_nFree = 0;
+	m_nMax = 0;
+	m_nHighWater = 0;
+	m_nAcquired = 0;
+	m_nGrown = 0;
+	m_nFailed = 0;
+	LeaveCriticalSection(&m_critsec);
+}
+
+BYTE *BufferPool::Acquire()
+{
+	BYTE *pBuffer = NULL;
+
+	EnterCriticalSection(&m_critsec);
+	if (m_nFree > 0) {
+		pBuffer = m_ppFree[--m_nFree];
+	} else if (m_ppAll != NULL && m_nAll < m_nMax) {
+		pBuffer = AllocateBuffer();
+		if (pBuffer) {
+			m_nGrown++;
+		}
+	}
+	if (pBuffer) {
+		m_nAcquired++;
+		LONG nInUse = m_nAll - m_nFree;
+		if (nInUse > m_nHighWater) {
+			m_nHighWater = nInUse;
+		}
+	} else {
+		m_nFailed++;
+	}
+	LeaveCriticalSection(&m_critsec);
+	return pBuffer;
+}
+
+void BufferPool::Release(BYTE *pBuffer)
+{
+	if (pBuffer == NULL) {
+		return;
+	}
+	EnterCriticalSection(&m_critsec);
+	assert(m_nFree < m_nAll);
+	m_ppFree[m_nFree++] = pBuffer;
+	LeaveCriticalSection(&m_critsec);
+}
+
+void BufferPool::GetStats(BufferPoolStats *pStats)
+{
+	EnterCriticalSection(&m_critsec);
+	pStats->cbBuffer = m_cbBuffer;
+	pStats->cbAllocation = m_cbAllocation;
+	pStats->cbRegion = m_cbRegion;
+	pStats->nBuffers = m_nAll;
+	pStats->nInUse = m_nAll - m_nFree;
+	pStats->nHighWater = m_nHighWater;
+	pStats->nAcquired = m_nAcquired;
+	pStats->nGrown = m_nGrown;
+	pStats->nFailed = m_nFailed;
+	pStats->bLargePages = m_bLargePages;
+	pStats->bLocked = m_bLocked;
+	LeaveCriticalSection(&m_critsec);
+}
+
+// Allocates one buffer, or takes the next slice of the large-page
+// region, and adds it to m_ppAll.  Called with the lock held.
+BYTE *BufferPool::AllocateBuffer()
+{
+	if (m_pRegion != NULL) {
+		BYTE *pSlice = m_pRegion + (SIZE_T)m_nAll * m_cbAllocation;
+		m_ppAll[m_nAll++] = pSlice;
+		return pSlice;
+	}
+
+	BYTE *pBuffer = (BYTE *)VirtualAlloc(NULL, m_cbAllocation,
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pBuffer == NULL) {
+		return NULL;
+	}
+	if (m_bLocked && !VirtualLock(pBuffer, m_cbAllocation)) {
+		// Keep the buffer; it just may be paged out
+		printf("BufferPool: VirtualLock failed (%u)\n", GetLastError());
+	}
+	m_ppAll[m_nAll++] = pBuffer;
+	return pBuffer;
+}
+
+// The large-page region is freed whole, by Shutdown
+void BufferPool::FreeBuffer(BYTE *pBuffer)
+{
+	if (m_pRegion != NULL) {
+		return;
+	}
+	if (m_bLocked) {
+		VirtualUnlock(pBuffer, m_cbAllocation);
+	}
+	VirtualFree(pBuffer, 0, MEM_RELEASE);
+}
+
+void printBufferPoolStats(BufferPool *pPool) {
+	BufferPoolStats stats;
+	pPool->GetStats(&stats);
+	printf("Buffer pool: %d buffers of %u bytes (%u allocated)%s%s\n",
+		stats.nBuffers, stats.cbBuffer, stats.cbAllocation,
+		stats.bLargePages ? ", large pages" : "",
+		stats.bLocked ? ", locked" : "");
+	if (stats.bLargePages) {
+		printf("  Large-page region of %Iu KB\n", stats.cbRegion / 1024);
+	}
+	printf("  Acquired %d, grown %d, failed %d, high water %d, in use %d\n",
+		stats.nAcquired, stats.nGrown, stats.nFailed, stats.nHighWater,
+		stats.nInUse);
+}
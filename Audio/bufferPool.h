@@ -0,0 +1,82 @@
+//////////////////////////////////////////////////////////////////////////
+// bufferPool.h: Pool of page-aligned capture buffers
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Flags for BufferPool::Initialize
+const DWORD BUFFER_POOL_LARGE_PAGES = 0x1;  // Use large pages if the privilege is held
+const DWORD BUFFER_POOL_LOCKED = 0x2;       // Lock the buffers in physical memory
+
+// Counters kept by the pool
+struct BufferPoolStats
+{
+    DWORD       cbBuffer;       // Usable size of each buffer
+    DWORD       cbAllocation;   // Size actually allocated for each buffer
+    SIZE_T      cbRegion;       // Size of the large-page region, if any
+    LONG        nBuffers;       // Buffers allocated
+    LONG        nInUse;         // Buffers handed out
+    LONG        nHighWater;     // Largest nInUse seen
+    LONG        nAcquired;      // Calls to Acquire that succeeded
+    LONG        nGrown;         // Buffers allocated after Initialize
+    LONG        nFailed;        // Calls to Acquire that failed
+    BOOL        bLargePages;    // Buffers are in large pages
+    BOOL        bLocked;        // Buffers are locked in memory
+};
+
+// Fixed-size buffers that are allocated once and reused, so capture
+// routines do not allocate (or zero) memory each time they start.
+// Each buffer is page aligned: a separate VirtualAlloc allocation, or
+// with large pages a slice of one region that holds the whole pool,
+// since a large page is far bigger than a buffer.  The pool grows on
+// demand up to the maximum given to Initialize.  Acquire and Release
+// may be called from any thread.
+class BufferPool
+{
+public:
+    BufferPool();
+    ~BufferPool();
+
+    HRESULT Initialize(DWORD cbBuffer, LONG nInitial, LONG nMax, DWORD dwFlags);
+    void    Shutdown();
+
+    // Returns NULL when all nMax buffers are in use.  The contents are
+    // whatever the previous user left.
+    BYTE    *Acquire();
+    void    Release(BYTE *pBuffer);
+
+    BOOL    IsInitialized() const { return m_ppAll != NULL; }
+    DWORD   BufferSize() const { return m_cbBuffer; }
+    void    GetStats(BufferPoolStats *pStats);
+
+private:
+    BYTE    *AllocateBuffer();
+    void    FreeBuffer(BYTE *pBuffer);
+
+    CRITICAL_SECTION m_critsec;
+
+    BYTE        *m_pRegion;         // Large-page region the buffers are cut from
+    SIZE_T      m_cbRegion;
+    BYTE        **m_ppAll;          // Every buffer allocated
+    BYTE        **m_ppFree;         // Stack of free buffers
+    LONG        m_nAll;
+    LONG        m_nFree;
+    LONG        m_nMax;
+
+    DWORD       m_cbBuffer;
+    DWORD       m_cbAllocation;
+    DWORD       m_dwFlags;
+    BOOL        m_bLargePages;
+    BOOL        m_bLocked;
+    SIZE_T      m_cbOldMinWorkingSet;   // Working set before m_bLocked raised it
+    SIZE_T      m_cbOldMaxWorkingSet;
+
+    LONG        m_nHighWater;
+    LONG        m_nAcquired;
+    LONG        m_nGrown;
+    LONG        m_nFailed;
+};
+
+void printBufferPoolStats(BufferPool *pPool);
@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////
+// debugLog.h: Logging from any thread without locks or allocation
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Levels, most severe first
+#define LOG_LEVEL_ERROR     1
+#define LOG_LEVEL_WARNING   2
+#define LOG_LEVEL_INFO      3
+#define LOG_LEVEL_DEBUG     4
+
+// Calls above this level are compiled out, arguments and all.  Define
+// it in the project to override.
+#ifndef LOG_MAX_LEVEL
+#ifdef _DEBUG
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_MAX_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) logMessage(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) ((void)0)
+#endif
+#if LOG_MAX_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(format, ...) logMessage(LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#else
+#define LOG_WARNING(format, ...) ((void)0)
+#endif
+#if LOG_MAX_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) logMessage(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) ((void)0)
+#endif
+#if LOG_MAX_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) logMessage(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) ((void)0)
+#endif
+
+// The old debug print, now a debug level message
+#define debugMsg(format, ...) LOG_DEBUG(format, ##__VA_ARGS__)
+
+// Receives each formatted message, one line with its newline, on the
+// log thread
+typedef void (*LogSinkProc)(int level, const TCHAR *szLine, void *pContext);
+
+// Queues a message to be formatted on the log thread.  The format is
+// not copied and must be a literal, or otherwise outlive the process;
+// string arguments are copied.  Each thread queues into a ring of its
+// own and never waits: if its ring is full, or every ring is taken,
+// the message is dropped and counted.  Use the LOG_ macros rather than
+// calling this directly.
+void logMessage(int level, const TCHAR *format, ...);
+
+// Drops messages above the level at run time as well
+void logSetLevel(int level);
+// Sends the messages to pfnSink instead of OutputDebugString, or back
+// to OutputDebugString if pfnSink is NULL.  Call with nothing queued,
+// e.g. after logFlush.
+void logSetSink(LogSinkProc pfnSink, void *pContext);
+// Waits until the messages queued before the call have been written
+void logFlush();
+// Writes what is queued and ends the log thread.  Messages logged
+// after this are dropped.
+void logShutdown();
+// Messages dropped so far
+ULONGLONG logDroppedCount();
+
+// Times the logging call on one thread and checks, with many threads
+// logging at once, that every message is either written in order or
+// counted as dropped
+void benchmarkDebugLog(void);
@@ -0,0 +1,528 @@
+//////////////////////////////////////////////////////////////////////////
+// errorRegistry.cpp: Cached HRESULT descriptions and error counts
+//
+// Each code seen gets a slot in an open-addressed table.  A slot is
+// filled once, under a compare-and-swap on its state, and its code and
+// description never change after, so looking one up takes no lock.
+// The system has no text for most Media Foundation errors, so they are
+// described from a table of their own.
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include <Mferror.h>
+
+#include "errorRegistry.h"
+
+// Longest description taken from the system
+const DWORD ERROR_MAX_TEXT = 512;
+
+#define MF_ERROR(hr, szText) { hr, _T(#hr), _T(szText) }
+
+struct ErrorEntry
+{
+	HRESULT     hr;
+	const TCHAR *szName;
+	const TCHAR *szText;
+};
+
+static const ErrorEntry s_mfErrors[] = {
+	MF_ERROR(MF_E_PLATFORM_NOT_INITIALIZED, "Media Foundation has not been started"),
+	MF_ERROR(MF_E_BUFFERTOOSMALL, "The buffer was too small to carry the data"),
+	MF_ERROR(MF_E_INVALIDREQUEST, "The request is not valid in the current state"),
+	MF_ERROR(MF_E_INVALIDSTREAMNUMBER, "The stream number is not valid"),
+	MF_ERROR(MF_E_INVALIDMEDIATYPE, "The data is not valid for the media type"),
+	MF_ERROR(MF_E_NOTACCEPTING, "The object is not accepting input"),
+	MF_ERROR(MF_E_NOT_INITIALIZED, "The object has not been initialized"),
+	MF_ERROR(MF_E_UNSUPPORTED_REPRESENTATION, "The media type representation is not supported"),
+	MF_ERROR(MF_E_NO_MORE_TYPES, "There are no more media types"),
+	MF_ERROR(MF_E_UNSUPPORTED_SERVICE, "The service is not supported"),
+	MF_ERROR(MF_E_UNEXPECTED, "An unexpected error occurred"),
+	MF_ERROR(MF_E_INVALIDNAME, "The name is not valid"),
+	MF_ERROR(MF_E_INVALIDTYPE, "The type is not valid"),
+	MF_ERROR(MF_E_INVALID_FILE_FORMAT, "The file does not match the expected format"),
+	MF_ERROR(MF_E_INVALIDINDEX, "The index is not valid"),
+	MF_ERROR(MF_E_INVALID_TIMESTAMP, "The time stamp is not valid"),
+	MF_ERROR(MF_E_UNSUPPORTED_SCHEME, "The URL scheme is not supported"),
+	MF_ERROR(MF_E_UNSUPPORTED_BYTESTREAM_TYPE, "The byte stream type is not supported"),
+	MF_ERROR(MF_E_UNSUPPORTED_TIME_FORMAT, "The time format is not supported"),
+	MF_ERROR(MF_E_NO_SAMPLE_TIMESTAMP, "The sample has no time stamp"),
+	MF_ERROR(MF_E_NO_SAMPLE_DURATION, "The sample has no duration"),
+	MF_ERROR(MF_E_INVALID_STREAM_DATA, "The stream data is not valid"),
+	MF_ERROR(MF_E_RT_UNAVAILABLE, "Real-time services are not available"),
+	MF_ERROR(MF_E_UNSUPPORTED_RATE, "The playback rate is not supported"),
+	MF_ERROR(MF_E_NOT_FOUND, "The object was not found"),
+	MF_ERROR(MF_E_NOT_AVAILABLE, "The object is not available"),
+	MF_ERROR(MF_E_NO_CLOCK, "There is no presentation clock"),
+	MF_ERROR(MF_E_MULTIPLE_BEGIN, "An asynchronous operation is already in progress"),
+	MF_ERROR(MF_E_STATE_TRANSITION_PENDING, "A state change is still pending"),
+	MF_ERROR(MF_E_UNSUPPORTED_STATE_TRANSITION, "The state change is not supported"),
+	MF_ERROR(MF_E_UNRECOVERABLE_ERROR_OCCURRED, "An unrecoverable error occurred"),
+	MF_ERROR(MF_E_SAMPLE_HAS_TOO_MANY_BUFFERS, "The sample has too many buffers"),
+	MF_ERROR(MF_E_SAMPLE_NOT_WRITABLE, "The sample is not writable"),
+	MF_ERROR(MF_E_INVALID_KEY, "The key is not valid"),
+	MF_ERROR(MF_E_BAD_STARTUP_VERSION, "MFStartup was called with the wrong version"),
+	MF_ERROR(MF_E_INVALID_POSITION, "The position is not valid"),
+	MF_ERROR(MF_E_ATTRIBUTENOTFOUND, "The attribute was not found"),
+	MF_ERROR(MF_E_PROPERTY_TYPE_NOT_ALLOWED, "The property type is not allowed"),
+	MF_ERROR(MF_E_PROPERTY_TYPE_NOT_SUPPORTED, "The property type is not supported"),
+	MF_ERROR(MF_E_PROPERTY_EMPTY, "The property is empty"),
+	MF_ERROR(MF_E_OPERATION_CANCELLED, "The operation was canceled"),
+	MF_ERROR(MF_E_BYTESTREAM_NOT_SEEKABLE, "The byte stream cannot seek"),
+	MF_ERROR(MF_E_CANNOT_PARSE_BYTESTREAM, "The byte stream could not be parsed"),
+	MF_ERROR(MF_E_MEDIAPROC_WRONGSTATE, "The media processor is in the wrong state"),
+	MF_ERROR(MF_E_CANNOT_CREATE_SINK, "The media sink could not be created"),
+	MF_ERROR(MF_E_BYTESTREAM_UNKNOWN_LENGTH, "The byte stream length is not known"),
+	MF_ERROR(MF_E_FORMAT_CHANGE_NOT_SUPPORTED, "The format cannot change during streaming"),
+	MF_ERROR(MF_E_INVALID_WORKQUEUE, "The work queue is not valid"),
+	MF_ERROR(MF_E_DRM_UNSUPPORTED, "DRM is not supported"),
+	MF_ERROR(MF_E_UNAUTHORIZED, "The operation is not authorized"),
+	MF_ERROR(MF_E_OUT_OF_RANGE, "The value is out of range"),
+	MF_ERROR(MF_E_HW_MFT_FAILED_START_STREAMING, "The hardware device failed to start streaming"),
+	MF_ERROR(MF_E_NO_EVENTS_AVAILABLE, "There are no events in the queue"),
+	MF_ERROR(MF_E_INVALID_STATE_TRANSITION, "The state change is not valid"),
+	MF_ERROR(MF_E_END_OF_STREAM, "The end of the stream was reached"),
+	MF_ERROR(MF_E_SHUTDOWN, "The object was shut down"),
+	MF_ERROR(MF_E_NO_DURATION, "The media source has no duration"),
+	MF_ERROR(MF_E_INVALID_FORMAT, "The format is not valid"),
+	MF_ERROR(MF_E_PROPERTY_NOT_FOUND, "The property was not found"),
+	MF_ERROR(MF_E_PROPERTY_READ_ONLY, "The property is read only"),
+	MF_ERROR(MF_E_MEDIA_SOURCE_NOT_STARTED, "The media source has not been started"),
+	MF_ERROR(MF_E_UNSUPPORTED_FORMAT, "The format is not supported"),
+	MF_ERROR(MF_E_MEDIA_SOURCE_WRONGSTATE, "The media source is in the wrong state"),
+	MF_ERROR(MF_E_MEDIA_SOURCE_NO_STREAMS_SELECTED, "No streams of the media source are selected"),
+	MF_ERROR(MF_E_CANNOT_FIND_KEYFRAME_SAMPLE, "No key frame sample was found"),
+	MF_ERROR(MF_E_STREAMSINK_REMOVED, "The stream sink was removed"),
+	MF_ERROR(MF_E_STREAMSINKS_OUT_OF_SYNC, "The stream sinks are out of sync"),
+	MF_ERROR(MF_E_STREAMSINKS_FIXED, "Stream sinks cannot be added or removed"),
+	MF_ERROR(MF_E_STREAMSINK_EXISTS, "The stream sink already exists"),
+	MF_ERROR(MF_E_SAMPLEALLOCATOR_CANCELED, "The sample allocator was canceled"),
+	MF_ERROR(MF_E_SAMPLEALLOCATOR_EMPTY, "The sample allocator has no free samples"),
+	MF_ERROR(MF_E_SINK_ALREADYSTOPPED, "The media sink is already stopped"),
+	MF_ERROR(MF_E_SINK_NO_STREAMS, "The media sink has no streams"),
+	MF_ERROR(MF_E_SINK_NO_SAMPLES_PROCESSED, "The media sink processed no samples"),
+	MF_ERROR(MF_E_TOPO_INVALID_OPTIONAL_NODE, "The optional topology node is not valid"),
+	MF_ERROR(MF_E_TOPO_CANNOT_FIND_DECRYPTOR, "No decryptor was found"),
+	MF_ERROR(MF_E_TOPO_CODEC_NOT_FOUND, "No codec was found for the topology"),
+	MF_ERROR(MF_E_TOPO_CANNOT_CONNECT, "The topology nodes cannot be connected"),
+	MF_ERROR(MF_E_TOPO_UNSUPPORTED, "The topology is not supported"),
+	MF_ERROR(MF_E_TRANSFORM_TYPE_NOT_SET, "The transform media type has not been set"),
+	MF_ERROR(MF_E_TRANSFORM_STREAM_CHANGE, "The transform stream format changed"),
+	MF_ERROR(MF_E_TRANSFORM_INPUT_REMAINING, "The transform has unprocessed input"),
+	MF_ERROR(MF_E_TRANSFORM_NEED_MORE_INPUT, "The transform needs more input"),
+	MF_ERROR(MF_E_TRANSFORM_ASYNC_LOCKED, "The asynchronous transform is locked"),
+	MF_ERROR(MF_E_CLOCK_NO_TIME_SOURCE, "The clock has no time source"),
+	MF_ERROR(MF_E_CLOCK_STATE_ALREADY_SET, "The clock is already in the requested state"),
+	MF_ERROR(MF_E_QM_INVALIDSTATE, "The quality manager is in the wrong state"),
+	MF_ERROR(MF_E_TRANSCODE_NO_CONTAINERTYPE, "No container type was given for transcoding"),
+	MF_ERROR(MF_E_TRANSCODE_NO_MATCHING_ENCODER, "No encoder matches the transcode profile"),
+};
+
+enum ErrorSlotState
+{
+	ERROR_SLOT_EMPTY,
+	ERROR_SLOT_FILLING,
+	ERROR_SLOT_READY,
+};
+
+// A code seen.  Everything above nCount is written before the state
+// is set ready and never changes after.
+struct ErrorSlot
+{
+	volatile LONG state;
+	HRESULT     hr;
+	const TCHAR *szName;        // NULL unless in s_mfErrors
+	const TCHAR *szText;        // NULL if there is no description
+	volatile LONG nCount;
+	// Suppression, under s_errorLock
+	ULONGLONG   msecRefill;     // When the next report is due back
+	ULONG       nTokens;        // Reports that may be made now
+	ULONG       nSuppressed;    // Since the last report made
+};
+
+static ErrorSlot s_slots[ERROR_REGISTRY_SIZE];
+static INIT_ONCE s_errorOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION s_errorLock;
+
+static DWORD hashError(HRESULT hr) {
+	return ((DWORD)hr * 0x9E3779B1) >> 16;
+}
+
+// Returns the slot of hr, or NULL if it has none yet
+static ErrorSlot *findErrorSlot(HRESULT hr) {
+	for (DWORD i = 0; i < ERROR_REGISTRY_SIZE; i++) {
+		ErrorSlot *pSlot = &s_slots[(hashError(hr) + i) & (ERROR_REGISTRY_SIZE - 1)];
+		LONG state;
+		while ((state = pSlot->state) == ERROR_SLOT_FILLING) {
+			YieldProcessor();
+		}
+		if (state == ERROR_SLOT_EMPTY) {
+			return NULL;
+		}
+		if (pSlot->hr == hr) {
+			return pSlot;
+		}
+	}
+	return NULL;
+}
+
+// Returns the slot of hr, filling a free one with the name and text if
+// it has none.  *pbAdded is FALSE if another thread added it first.
+// Returns NULL if the table is full.
+static ErrorSlot *addErrorSlot(HRESULT hr, const TCHAR *szName,
+							   const TCHAR *szText, BOOL *pbAdded) {
+	*pbAdded = FALSE;
+	for (DWORD i = 0; i < ERROR_REGISTRY_SIZE; i++) {
+		ErrorSlot *pSlot = &s_slots[(hashError(hr) + i) & (ERROR_REGISTRY_SIZE - 1)];
+		if (InterlockedCompareExchange(&pSlot->state, ERROR_SLOT_FILLING,
+			ERROR_SLOT_EMPTY) == ERROR_SLOT_EMPTY) {
+			pSlot->hr = hr;
+			pSlot->szName = szName;
+			pSlot->szText = szText;
+			pSlot->nCount = 0;
+			pSlot->msecRefill = 0;
+			pSlot->nTokens = ERROR_REPORT_BURST;
+			pSlot->nSuppressed = 0;
+			InterlockedExchange(&pSlot->state, ERROR_SLOT_READY);
+			*pbAdded = TRUE;
+			return pSlot;
+		}
+		while (pSlot->state == ERROR_SLOT_FILLING) {
+			YieldProcessor();
+		}
+		if (pSlot->hr == hr) {
+			return pSlot;
+		}
+	}
+	return NULL;
+}
+
+static BOOL CALLBACK initErrorRegistry(PINIT_ONCE pInitOnce, void *pParameter,
+									   void **ppContext) {
+	InitializeCriticalSection(&s_errorLock);
+	for (DWORD i = 0; i < ARRAYSIZE(s_mfErrors); i++) {
+		BOOL bAdded;
+		addErrorSlot(s_mfErrors[i].hr, s_mfErrors[i].szName,
+			s_mfErrors[i].szText, &bAdded);
+	}
+	return TRUE;
+}
+
+// Asks the system to describe hr.  Returns the length, without the
+// trailing line break, or 0 if it has no description.
+static DWORD formatSystemText(HRESULT hr, TCHAR *szOut, DWORD nChars) {
+	if (FACILITY_WINDOWS == HRESULT_FACILITY(hr)) {
+		hr = HRESULT_CODE(hr);
+	}
+	DWORD nLength = FormatMessage(
+		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+		NULL, hr, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+		szOut, nChars, NULL);
+	while (nLength > 0 && (szOut[nLength - 1] == _T('\n') ||
+		szOut[nLength - 1] == _T('\r') || szOut[nLength - 1] == _T(' '))) {
+		nLength--;
+	}
+	if (nChars > 0) {
+		szOut[nLength] = _T('\0');
+	}
+	return nLength;
+}
+
+// Returns the slot of hr, describing it and adding it the first time.
+// Returns NULL if the table is full.
+static ErrorSlot *getErrorSlot(HRESULT hr) {
+	InitOnceExecuteOnce(&s_errorOnce, initErrorRegistry, NULL, NULL);
+	ErrorSlot *pSlot = findErrorSlot(hr);
+	if (pSlot != NULL) {
+		return pSlot;
+	}
+
+	TCHAR szText[ERROR_MAX_TEXT];
+	DWORD nLength = formatSystemText(hr, szText, ARRAYSIZE(szText));
+	TCHAR *szCopy = NULL;
+	if (nLength > 0) {
+		szCopy = new (std::nothrow) TCHAR[nLength + 1];
+		if (szCopy == NULL) {
+			return NULL;
+		}
+		CopyMemory(szCopy, szText, (nLength + 1) * sizeof(TCHAR));
+	}
+	BOOL bAdded;
+	pSlot = addErrorSlot(hr, NULL, szCopy, &bAdded);
+	if (!bAdded) {
+		delete [] szCopy;
+	}
+	return pSlot;
+}
+
+const TCHAR *lookupErrorName(HRESULT hr) {
+	ErrorSlot *pSlot = getErrorSlot(hr);
+	return pSlot != NULL ? pSlot->szName : NULL;
+}
+
+const TCHAR *lookupErrorText(HRESULT hr) {
+	ErrorSlot *pSlot = getErrorSlot(hr);
+	return pSlot != NULL ? pSlot->szText : NULL;
+}
+
+HRESULT formatErrorDescription(HRESULT hr, TCHAR *szOut, int nChars) {
+	ErrorSlot *pSlot = getErrorSlot(hr);
+	if (pSlot == NULL) {
+		// Not kept, so ask the system straight into the buffer
+		if (nChars > 0 && formatSystemText(hr, szOut, nChars) > 0) {
+			return S_OK;
+		}
+	} else if (pSlot->szName != NULL) {
+		return StringCchPrintf(szOut, nChars, _T("%s: %s"), pSlot->szName,
+			pSlot->szText);
+	} else if (pSlot->szText != NULL) {
+		return StringCchCopy(szOut, nChars, pSlot->szText);
+	}
+	return StringCchPrintf(szOut, nChars,
+		_T("[No further information for HRESULT 0x%08X]"), hr);
+}
+
+BOOL errorShouldReportAt(HRESULT hr, ULONGLONG msecNow, ULONG *pnSuppressed) {
+	if (pnSuppressed != NULL) {
+		*pnSuppressed = 0;
+	}
+	ErrorSlot *pSlot = getErrorSlot(hr);
+	if (pSlot == NULL) {
+		return TRUE;
+	}
+	InterlockedIncrement(&pSlot->nCount);
+
+	BOOL bReport = FALSE;
+	EnterCriticalSection(&s_errorLock);
+	if (msecNow >= pSlot->msecRefill) {
+		// A report back for each interval passed, up to the burst
+		ULONGLONG nIntervals =
+			(msecNow - pSlot->msecRefill) / ERROR_REPORT_INTERVAL_MSEC + 1;
+		pSlot->nTokens = (ULONG)min((ULONGLONG)ERROR_REPORT_BURST,
+			pSlot->nTokens + nIntervals);
+		pSlot->msecRefill += nIntervals * ERROR_REPORT_INTERVAL_MSEC;
+	}
+	if (pSlot->nTokens > 0) {
+		pSlot->nTokens--;
+		if (pnSuppressed != NULL) {
+			*pnSuppressed = pSlot->nSuppressed;
+		}
+		pSlot->nSuppressed = 0;
+		bReport = TRUE;
+	} else {
+		pSlot->nSuppressed++;
+	}
+	LeaveCriticalSection(&s_errorLock);
+	return bReport;
+}
+
+BOOL errorShouldReport(HRESULT hr, ULONG *pnSuppressed) {
+	return errorShouldReportAt(hr, GetTickCount64(), pnSuppressed);
+}
+
+ULONG errorCount(HRESULT hr) {
+	InitOnceExecuteOnce(&s_errorOnce, initErrorRegistry, NULL, NULL);
+	ErrorSlot *pSlot = findErrorSlot(hr);
+	return pSlot != NULL ? pSlot->nCount : 0;
+}
+
+static int compareErrorCounts(const void *p1, const void *p2) {
+	LONG n1 = (*(ErrorSlot * const *)p1)->nCount;
+	LONG n2 = (*(ErrorSlot * const *)p2)->nCount;
+	return n1 > n2 ? -1 : n1 < n2 ? 1 : 0;
+}
+
+void printErrorCounts() {
+	ErrorSlot *pSeen[ERROR_REGISTRY_SIZE];
+	DWORD nSeen = 0;
+	for (DWORD i = 0; i < ERROR_REGISTRY_SIZE; i++) {
+		if (s_slots[i].state == ERROR_SLOT_READY && s_slots[i].nCount > 0) {
+			pSeen[nSeen++] = &s_slots[i];
+		}
+	}
+	if (nSeen == 0) {
+		return;
+	}
+	qsort(pSeen, nSeen, sizeof(ErrorSlot *), compareErrorCounts);
+	_tprintf(_T("Errors seen:\n"));
+	for (DWORD i = 0; i < nSeen; i++) {
+		const TCHAR *szLabel = pSeen[i]->szName != NULL ? pSeen[i]->szName :
+			pSeen[i]->szText != NULL ? pSeen[i]->szText : _T("");
+		_tprintf(_T("  %8ld  0x%08X  %s\n"), pSeen[i]->nCount, pSeen[i]->hr,
+			szLabel);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+const DWORD ERROR_BENCH_THREADS = 8;
+const DWORD ERROR_BENCH_CODES = 192;
+const DWORD ERROR_BENCH_ROUNDS = 50;
+
+struct ErrorBenchThread
+{
+	HANDLE      hStart;         // Set to start every thread at once
+	const TCHAR *szTexts[ERROR_BENCH_CODES];
+};
+
+// A Win32 code, a Media Foundation code or one with no description,
+// different for each i below ERROR_BENCH_CODES
+static HRESULT errorBenchCode(DWORD i) {
+	switch (i % 3) {
+	case 0:
+		return HRESULT_FROM_WIN32(i / 3 + 1);
+	case 1:
+		return s_mfErrors[i / 3 % ARRAYSIZE(s_mfErrors)].hr;
+	default:
+		return MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x7E00 + i);
+	}
+}
+
+static unsigned __stdcall errorBenchThread(void *pParam) {
+	ErrorBenchThread *pThread = (ErrorBenchThread *)pParam;
+	WaitForSingleObject(pThread->hStart, INFINITE);
+	for (DWORD round = 0; round < ERROR_BENCH_ROUNDS; round++) {
+		for (DWORD i = 0; i < ERROR_BENCH_CODES; i++) {
+			HRESULT hr = errorBenchCode(i);
+			pThread->szTexts[i] = lookupErrorText(hr);
+			errorShouldReport(hr, NULL);
+		}
+	}
+	return 0;
+}
+
+// Describes hr the way it was done before the registry
+static void describeUncached(HRESULT hr) {
+	if (FACILITY_WINDOWS == HRESULT_FACILITY(hr)) {
+		hr = HRESULT_CODE(hr);
+	}
+	TCHAR *szErrMsg;
+	if (FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
+		NULL, hr, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+		(LPTSTR)&szErrMsg, 0, NULL) != 0) {
+		LocalFree(szErrMsg);
+	}
+}
+
+static void timeErrorDescription(const char *szLabel, HRESULT hr,
+								 LARGE_INTEGER freq) {
+	const DWORD N_UNCACHED = 2000;
+	const DWORD N_CACHED = 200000;
+	LARGE_INTEGER tStart, tEnd;
+	TCHAR szDescription[MAX_PATH];
+
+	QueryPerformanceCounter(&tStart);
+	for (DWORD i = 0; i < N_UNCACHED; i++) {
+		describeUncached(hr);
+	}
+	QueryPerformanceCounter(&tEnd);
+	double nsUncached = (tEnd.QuadPart - tStart.QuadPart) * 1e9 /
+		freq.QuadPart / N_UNCACHED;
+
+	QueryPerformanceCounter(&tStart);
+	for (DWORD i = 0; i < N_CACHED; i++) {
+		formatErrorDescription(hr, szDescription, MAX_PATH);
+	}
+	QueryPerformanceCounter(&tEnd);
+	double nsCached = (tEnd.QuadPart - tStart.QuadPart) * 1e9 /
+		freq.QuadPart / N_CACHED;
+
+	printf("  %-16s  FormatMessage %8.0f ns  registry %6.0f ns\n", szLabel,
+		nsUncached, nsCached);
+}
+
+// Checks the report decisions for a storm of one code on a made up clock
+static BOOL checkErrorSuppression() {
+	// { msec, expected to report, suppressed count expected with it }
+	static const struct { ULONGLONG msec; BOOL bReport; ULONG nSuppressed; }
+	steps[] = {
+		{ 0, TRUE, 0 }, { 0, TRUE, 0 }, { 10, TRUE, 0 },
+		{ 20, FALSE, 0 }, { 999, FALSE, 0 },
+		{ 1000, TRUE, 2 }, { 1500, FALSE, 0 },
+		{ 2000, TRUE, 1 }, { 2001, FALSE, 0 },
+		// Quiet for a long time refills the burst, and no more
+		{ 60000, TRUE, 1 }, { 60000, TRUE, 0 }, { 60000, TRUE, 0 },
+		{ 60001, FALSE, 0 },
+	};
+	const HRESULT hr = MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x7DFF);
+	ULONG nStart = errorCount(hr);
+	BOOL bOk = TRUE;
+	for (DWORD i = 0; i < ARRAYSIZE(steps); i++) {
+		ULONG nSuppressed;
+		BOOL bReport = errorShouldReportAt(hr, steps[i].msec, &nSuppressed);
+		if (bReport != steps[i].bReport ||
+			(bReport && nSuppressed != steps[i].nSuppressed)) {
+			printf("  Suppression step %u: report %d (%lu suppressed), "
+				"expected %d (%lu)\n", i, bReport, nSuppressed,
+				steps[i].bReport, steps[i].nSuppressed);
+			bOk = FALSE;
+		}
+	}
+	return bOk && errorCount(hr) - nStart == ARRAYSIZE(steps);
+}
+
+// Looks the same codes up from many threads at once and checks that
+// each got the one copy of each description and every call was counted
+static BOOL checkErrorCache() {
+	ErrorBenchThread *pThreads =
+		new (std::nothrow) ErrorBenchThread[ERROR_BENCH_THREADS];
+	if (pThreads == NULL) {
+		return FALSE;
+	}
+	HANDLE hStart = CreateEvent(NULL, TRUE, FALSE, NULL);
+	HANDLE hThreads[ERROR_BENCH_THREADS];
+	ULONG nStart[ERROR_BENCH_CODES];
+	for (DWORD i = 0; i < ERROR_BENCH_CODES; i++) {
+		nStart[i] = errorCount(errorBenchCode(i));
+	}
+	for (DWORD i = 0; i < ERROR_BENCH_THREADS; i++) {
+		pThreads[i].hStart = hStart;
+		hThreads[i] = (HANDLE)_beginthreadex(NULL, 0, errorBenchThread,
+			&pThreads[i], 0, NULL);
+	}
+	SetEvent(hStart);
+	WaitForMultipleObjects(ERROR_BENCH_THREADS, hThreads, TRUE, INFINITE);
+	for (DWORD i = 0; i < ERROR_BENCH_THREADS; i++) {
+		CloseHandle(hThreads[i]);
+	}
+	CloseHandle(hStart);
+
+	BOOL bOk = TRUE;
+	for (DWORD i = 0; i < ERROR_BENCH_CODES; i++) {
+		HRESULT hr = errorBenchCode(i);
+		ULONG nExpected = nStart[i] + ERROR_BENCH_THREADS * ERROR_BENCH_ROUNDS;
+		if (errorCount(hr) != nExpected) {
+			printf("  0x%08X counted %lu times, expected %lu\n", hr,
+				errorCount(hr), nExpected);
+			bOk = FALSE;
+		}
+		for (DWORD j = 0; j < ERROR_BENCH_THREADS; j++) {
+			if (pThreads[j].szTexts[i] != lookupErrorText(hr)) {
+				printf("  0x%08X has more than one description\n", hr);
+				bOk = FALSE;
+				break;
+			}
+		}
+	}
+	delete [] pThreads;
+	return bOk;
+}
+
+void benchmarkErrorRegistry(void) {
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Error registry benchmark, %u codes built in, room for %u\n",
+		(DWORD)ARRAYSIZE(s_mfErrors), ERROR_REGISTRY_SIZE);
+	timeErrorDescription("E_OUTOFMEMORY", E_OUTOFMEMORY, freq);
+	timeErrorDescription("MF_E_SHUTDOWN", MF_E_SHUTDOWN, freq);
+	timeErrorDescription("unknown code",
+		MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x7DFE), freq);
+
+	TCHAR szDescription[MAX_PATH];
+	formatErrorDescription(MF_E_SHUTDOWN, szDescription, MAX_PATH);
+	_tprintf(_T("  MF_E_SHUTDOWN reads \"%s\"\n"), szDescription);
+	printf("  Suppression %s\n", checkErrorSuppression() ? "works" : "FAILED");
+	printf("  Cache from %u threads %s\n", ERROR_BENCH_THREADS,
+		checkErrorCache() ? "works" : "FAILED");
+}
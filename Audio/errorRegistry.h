@@ -0,0 +1,41 @@
+//////////////////////////////////////////////////////////////////////////
+// errorRegistry.h: Cached HRESULT descriptions and error counts
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Codes tracked at once, a power of two.  Codes beyond it are still
+// described, but each time from the system, and are not counted.
+const DWORD ERROR_REGISTRY_SIZE = 512;
+// Reports of one code let through at once, and then one per interval
+const DWORD ERROR_REPORT_BURST = 3;
+const DWORD ERROR_REPORT_INTERVAL_MSEC = 1000;
+
+// The symbol of a Media Foundation error, such as "MF_E_SHUTDOWN", or
+// NULL for any other code
+const TCHAR *lookupErrorName(HRESULT hr);
+// The description of a code, from the table of Media Foundation errors
+// or the system, without a trailing newline.  Looked up once per code
+// and kept, so the string stays valid.  NULL if there is none.
+const TCHAR *lookupErrorText(HRESULT hr);
+// Writes "name: description", or as much as is known, into a buffer of
+// nChars characters.  Allocates nothing after the first lookup.
+HRESULT formatErrorDescription(HRESULT hr, TCHAR *szOut, int nChars);
+
+// Counts an occurrence of hr and returns whether to report it.  Each
+// code has a burst of reports, refilled one per interval, so a storm
+// of the same error is reported a few times a second.  *pnSuppressed
+// receives the reports held back since the last one let through.
+BOOL errorShouldReport(HRESULT hr, ULONG *pnSuppressed);
+// The same, at msecNow on a clock of the caller's
+BOOL errorShouldReportAt(HRESULT hr, ULONGLONG msecNow, ULONG *pnSuppressed);
+// Occurrences of hr counted so far
+ULONG errorCount(HRESULT hr);
+// Prints each code counted, most frequent first, if there are any
+void printErrorCounts();
+
+// Times describing an error with and without the registry, and checks
+// the suppression and, from many threads at once, the cache
+void benchmarkErrorRegistry(void);
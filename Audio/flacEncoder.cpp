@@ -0,0 +1,1657 @@
+#include "stdafx.h"
+#include "flacEncoder.h"
+#include "threadPool.h"
+#include "pcmConvert.h"
+
+#include <limits.h>
+#include <math.h>
+
+const double PI = 3.14159265358979323846;
+// Size of "fLaC" and the STREAMINFO block with its header
+const DWORD FLAC_STREAMINFO_SIZE = 4 + 4 + 34;
+// Largest frame header: sync and codes, 7-byte frame number, 16-bit
+// block size and rate, CRC-8
+const DWORD FLAC_MAX_HEADER_SIZE = 4 + 7 + 2 + 2 + 1;
+// Rice parameters above this need the 5-bit parameter coding
+const UINT32 RICE_MAX_PARAM = 14;
+const UINT32 RICE2_MAX_PARAM = 30;
+
+// Channel assignments in the frame header
+const UINT32 FLAC_CHANNELS_LEFT_SIDE = 8;
+const UINT32 FLAC_CHANNELS_RIGHT_SIDE = 9;
+const UINT32 FLAC_CHANNELS_MID_SIDE = 10;
+
+//////////////////////////////////////////////////////////////////////////
+// CRCs
+
+// CRC-8 (x^8 + x^2 + x + 1) for frame headers and CRC-16
+// (x^16 + x^15 + x^2 + 1) for whole frames, both with no reflection
+static BYTE s_crc8[256];
+static WORD s_crc16[256];
+
+static struct FlacCrcTables
+{
+	FlacCrcTables() {
+		for (UINT32 i = 0; i < 256; i++) {
+			UINT32 c8 = i;
+			UINT32 c16 = i << 8;
+			for (int bit = 0; bit < 8; bit++) {
+				c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+				c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+			}
+			s_crc8[i] = (BYTE)c8;
+			s_crc16[i] = (WORD)c16;
+		}
+	}
+} s_crcTables;
+
+static BYTE Crc8(const BYTE *p, DWORD cb)
+{
+	BYTE crc = 0;
+	while (cb--) {
+		crc = s_crc8[crc ^ *p++];
+	}
+	return crc;
+}
+
+static WORD Crc16(const BYTE *p, DWORD cb)
+{
+	WORD crc = 0;
+	while (cb--) {
+		crc = (WORD)((crc << 8) ^ s_crc16[(crc >> 8) ^ *p++]);
+	}
+	return crc;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Bit packing
+
+struct FlacBitWriter
+{
+	BYTE        *pStart;
+	BYTE        *p;
+	ULONGLONG   acc;            // Bits not yet stored, in the low nBits
+	UINT32      nBits;
+
+	void Init(BYTE *pOut) {
+		pStart = p = pOut;
+		acc = 0;
+		nBits = 0;
+	}
+
+	// Writes the low n bits of value, n <= 32
+	inline void Put(UINT32 value, UINT32 n) {
+		acc = (acc << n) | (value & (UINT32)((1ULL << n) - 1));
+		nBits += n;
+		while (nBits >= 8) {
+			nBits -= 8;
+			*p++ = (BYTE)(acc >> nBits);
+		}
+	}
+
+	inline void PutZeros(ULONGLONG n) {
+		while (n > 32) {
+			Put(0, 32);
+			n -= 32;
+		}
+		Put(0, (UINT32)n);
+	}
+
+	// Zig-zag value u as a unary quotient and k-bit remainder
+	inline void PutRice(UINT32 u, UINT32 k) {
+		UINT32 q = u >> k;
+		UINT32 rest = (1U << k) | (u & ((1U << k) - 1));
+		if (q + k + 1 <= 32) {
+			Put(rest, q + k + 1);
+		} else {
+			PutZeros(q);
+			Put(rest, k + 1);
+		}
+	}
+
+	void AlignToByte() {
+		if (nBits) {
+			Put(0, 8 - nBits);
+		}
+	}
+
+	// Only meaningful when aligned
+	DWORD Size() const { return (DWORD)(p - pStart); }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Residual coding
+
+// Partitioning and parameters chosen for a residual
+struct RicePlan
+{
+	UINT32      order;
+	BOOL        bRice2;         // 5-bit parameters
+	UINT32      params[1 << FLAC_MAX_PARTITION_ORDER];
+};
+
+static inline UINT32 ZigZag(INT32 r)
+{
+	return ((UINT32)r << 1) ^ (UINT32)(r >> 31);
+}
+
+// Best parameter for a partition of n values summing to sum, using
+// sum >> k for the remainders dropped from each quotient
+static UINT32 BestRiceParam(ULONGLONG sum, UINT32 n, ULONGLONG *pBits)
+{
+	UINT32 k0 = 0;
+	if (n > 0) {
+		ULONGLONG mean = sum / n;
+		while (k0 < RICE2_MAX_PARAM && (mean >> k0) > 1) {
+			k0++;
+		}
+	}
+	UINT32 kBest = k0;
+	ULONGLONG best = ~0ULL;
+	for (UINT32 k = (k0 > 0 ? k0 - 1 : 0); k <= min(k0 + 1, RICE2_MAX_PARAM); k++) {
+		ULONGLONG bits = (ULONGLONG)n * (k + 1) + (sum >> k);
+		if (bits < best) {
+			best = bits;
+			kBest = k;
+		}
+	}
+	*pBits = best;
+	return kBest;
+}
+
+// Chooses the partition order and Rice parameters for the residual of
+// a block of nFrames samples with a predictor of order nPredOrder, and
+// returns the exact size of the coded residual in bits.  pResidual
+// holds the nFrames - nPredOrder values after the warm-up samples.
+static ULONGLONG PlanResidual(const INT32 *pResidual, UINT32 nFrames,
+							  UINT32 nPredOrder, RicePlan *pPlan)
+{
+	ULONGLONG sums[1 << FLAC_MAX_PARTITION_ORDER];
+
+	// Partitions must divide the block evenly and the first must be
+	// longer than the warm-up
+	UINT32 maxOrder = FLAC_MAX_PARTITION_ORDER;
+	while (maxOrder > 0 && ((nFrames & ((1U << maxOrder) - 1)) != 0 ||
+		(nFrames >> maxOrder) <= nPredOrder)) {
+		maxOrder--;
+	}
+
+	UINT32 nParts = 1U << maxOrder;
+	UINT32 nPerPart = nFrames >> maxOrder;
+	const INT32 *p = pResidual;
+	for (UINT32 iPart = 0; iPart < nParts; iPart++) {
+		UINT32 n = nPerPart - (iPart == 0 ? nPredOrder : 0);
+		ULONGLONG sum = 0;
+		for (UINT32 i = 0; i < n; i++) {
+			sum += ZigZag(p[i]);
+		}
+		sums[iPart] = sum;
+		p += n;
+	}
+
+	// Try each order from the finest, merging neighbours as it goes
+	ULONGLONG bestBits = ~0ULL;
+	for (int order = (int)maxOrder; order >= 0; order--) {
+		nParts = 1U << order;
+		nPerPart = nFrames >> order;
+		ULONGLONG bits = 0;
+		UINT32 params[1 << FLAC_MAX_PARTITION_ORDER];
+		BOOL bRice2 = FALSE;
+		for (UINT32 iPart = 0; iPart < nParts; iPart++) {
+			ULONGLONG partBits;
+			UINT32 n = nPerPart - (iPart == 0 ? nPredOrder : 0);
+			params[iPart] = BestRiceParam(sums[iPart], n, &partBits);
+			bRice2 |= (params[iPart] > RICE_MAX_PARAM);
+			bits += partBits;
+		}
+		bits += nParts * (bRice2 ? 5 : 4);
+		if (bits < bestBits) {
+			bestBits = bits;
+			pPlan->order = order;
+			pPlan->bRice2 = bRice2;
+			memcpy(pPlan->params, params, nParts * sizeof(UINT32));
+		}
+		for (UINT32 iPart = 0; iPart < nParts / 2; iPart++) {
+			sums[iPart] = sums[2 * iPart] + sums[2 * iPart + 1];
+		}
+	}
+
+	// The estimate rounds each quotient down, so count exactly
+	ULONGLONG bits = 2 + 4;
+	nParts = 1U << pPlan->order;
+	nPerPart = nFrames >> pPlan->order;
+	p = pResidual;
+	for (UINT32 iPart = 0; iPart < nParts; iPart++) {
+		UINT32 n = nPerPart - (iPart == 0 ? nPredOrder : 0);
+		UINT32 k = pPlan->params[iPart];
+		bits += (pPlan->bRice2 ? 5 : 4) + (ULONGLONG)n * (k + 1);
+		for (UINT32 i = 0; i < n; i++) {
+			bits += ZigZag(p[i]) >> k;
+		}
+		p += n;
+	}
+	return bits;
+}
+
+static void WriteResidual(FlacBitWriter *pWriter, const INT32 *pResidual,
+						  UINT32 nFrames, UINT32 nPredOrder,
+						  const RicePlan *pPlan)
+{
+	pWriter->Put(pPlan->bRice2 ? 1 : 0, 2);
+	pWriter->Put(pPlan->order, 4);
+	UINT32 nParts = 1U << pPlan->order;
+	UINT32 nPerPart = nFrames >> pPlan->order;
+	const INT32 *p = pResidual;
+	for (UINT32 iPart = 0; iPart < nParts; iPart++) {
+		UINT32 n = nPerPart - (iPart == 0 ? nPredOrder : 0);
+		UINT32 k = pPlan->params[iPart];
+		pWriter->Put(k, pPlan->bRice2 ? 5 : 4);
+		for (UINT32 i = 0; i < n; i++) {
+			pWriter->PutRice(ZigZag(p[i]), k);
+		}
+		p += n;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Prediction
+
+// Sums of the absolute residuals of the fixed predictors of orders 0
+// to 4, over the samples from 4 on
+static void FixedResidualSums(const INT32 *x, UINT32 n, ULONGLONG sums[5])
+{
+	ULONGLONG s0 = 0, s1 = 0, s2 = 0, s3 = 0, s4 = 0;
+	for (UINT32 i = 4; i < n; i++) {
+		LONGLONG e0 = x[i];
+		LONGLONG e1 = e0 - x[i - 1];
+		LONGLONG e2 = e1 - ((LONGLONG)x[i - 1] - x[i - 2]);
+		LONGLONG e3 = e2 - ((LONGLONG)x[i - 1] - 2LL * x[i - 2] + x[i - 3]);
+		LONGLONG e4 = e3 - ((LONGLONG)x[i - 1] - 3LL * x[i - 2] +
+			3LL * x[i - 3] - x[i - 4]);
+		s0 += (ULONGLONG)(e0 < 0 ? -e0 : e0);
+		s1 += (ULONGLONG)(e1 < 0 ? -e1 : e1);
+		s2 += (ULONGLONG)(e2 < 0 ? -e2 : e2);
+		s3 += (ULONGLONG)(e3 < 0 ? -e3 : e3);
+		s4 += (ULONGLONG)(e4 < 0 ? -e4 : e4);
+	}
+	sums[0] = s0;
+	sums[1] = s1;
+	sums[2] = s2;
+	sums[3] = s3;
+	sums[4] = s4;
+}
+
+// Samples are at most 25 bits (a 24-bit side channel), so fixed
+// residuals of up to order 4 fit in 30 bits
+static void FixedResidual(const INT32 *x, UINT32 n, UINT32 order, INT32 *pRes)
+{
+	for (UINT32 i = order; i < n; i++) {
+		INT32 e;
+		switch (order) {
+		case 0: e = x[i]; break;
+		case 1: e = x[i] - x[i - 1]; break;
+		case 2: e = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+		case 3: e = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+		default: e = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+		}
+		pRes[i - order] = e;
+	}
+}
+
+// Returns FALSE if a residual does not fit in 32 bits, which the format
+// requires
+static BOOL LpcResidual(const INT32 *x, UINT32 n, const INT32 *pCoefs,
+						UINT32 order, int shift, INT32 *pRes)
+{
+	for (UINT32 i = order; i < n; i++) {
+		LONGLONG sum = 0;
+		for (UINT32 j = 0; j < order; j++) {
+			sum += (LONGLONG)pCoefs[j] * x[i - 1 - j];
+		}
+		LONGLONG e = x[i] - (sum >> shift);
+		if (e < INT_MIN || e > INT_MAX) {
+			return FALSE;
+		}
+		pRes[i - order] = (INT32)e;
+	}
+	return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// FlacFrameEncoder
+
+FlacFrameEncoder::FlacFrameEncoder() :
+m_nChannels(0),
+m_nBitsPerSample(0),
+m_nSampleRate(0),
+m_nBlockSize(0),
+m_nMaxLpcOrder(0),
+m_nPrecision(0),
+m_cbMaxFrame(0),
+m_pMid(NULL),
+m_pSide(NULL),
+m_pFixedResidual(NULL),
+m_pLpcResidual(NULL),
+m_pWindow(NULL),
+m_nWindowSize(0),
+m_pWindowed(NULL)
+{
+}
+
+FlacFrameEncoder::~FlacFrameEncoder()
+{
+	Free();
+}
+
+void FlacFrameEncoder::Free()
+{
+	delete [] m_pMid;
+	delete [] m_pSide;
+	delete [] m_pFixedResidual;
+	delete [] m_pLpcResidual;
+	delete [] m_pWindow;
+	delete [] m_pWindowed;
+	m_pMid = m_pSide = m_pFixedResidual = m_pLpcResidual = NULL;
+	m_pWindow = m_pWindowed = NULL;
+	m_nWindowSize = 0;
+}
+
+HRESULT FlacFrameEncoder::Initialize(UINT32 nChannels, UINT32 nBitsPerSample,
+									 UINT32 nSampleRate,
+									 const FlacOptions &options)
+{
+	Free();
+	if (nChannels == 0 || nChannels > FLAC_MAX_CHANNELS ||
+		nBitsPerSample < 4 || nBitsPerSample > 24 ||
+		nSampleRate == 0 || nSampleRate >= (1 << 20) ||
+		options.nBlockSize < FLAC_MIN_BLOCK_SIZE ||
+		options.nBlockSize > FLAC_MAX_BLOCK_SIZE ||
+		options.nMaxLpcOrder > FLAC_MAX_LPC_ORDER) {
+		return E_INVALIDARG;
+	}
+
+	m_nChannels = nChannels;
+	m_nBitsPerSample = nBitsPerSample;
+	m_nSampleRate = nSampleRate;
+	m_nBlockSize = options.nBlockSize;
+	m_nMaxLpcOrder = options.nMaxLpcOrder;
+
+	// Coefficient precision as the reference encoder picks it, finer for
+	// longer blocks.  24-bit audio gets two more bits.
+	UINT32 n = m_nBlockSize;
+	m_nPrecision = n <= 192 ? 7 : n <= 384 ? 8 : n <= 576 ? 9 :
+		n <= 1152 ? 10 : n <= 2304 ? 11 : n <= 4608 ? 12 : 13;
+	if (nBitsPerSample < 16) {
+		m_nPrecision = max(5U, 2 + nBitsPerSample / 2);
+	} else if (nBitsPerSample > 16) {
+		m_nPrecision = min(m_nPrecision + 2, 15U);
+	}
+
+	// No subframe is larger than a verbatim one, with a side channel
+	// taking one more bit
+	m_cbMaxFrame = FLAC_MAX_HEADER_SIZE + 2 + nChannels *
+		(1 + (m_nBlockSize * (nBitsPerSample + 1) + 7) / 8);
+
+	m_pMid = new (std::nothrow) INT32[m_nBlockSize];
+	m_pSide = new (std::nothrow) INT32[m_nBlockSize];
+	m_pFixedResidual = new (std::nothrow) INT32[m_nBlockSize];
+	m_pLpcResidual = new (std::nothrow) INT32[m_nBlockSize];
+	m_pWindow = new (std::nothrow) double[m_nBlockSize];
+	m_pWindowed = new (std::nothrow) double[m_nBlockSize];
+	if (m_pMid == NULL || m_pSide == NULL || m_pFixedResidual == NULL ||
+		m_pLpcResidual == NULL || m_pWindow == NULL || m_pWindowed == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+	return S_OK;
+}
+
+// Finds the LPC predictor expected to code the block in the fewest bits
+// and quantizes its coefficients.  Returns FALSE if there is none.
+BOOL FlacFrameEncoder::ComputeLpc(const INT32 *x, UINT32 n, UINT32 nBits,
+								  INT32 *pCoefs, UINT32 *pnOrder, int *pShift)
+{
+	UINT32 maxOrder = min(m_nMaxLpcOrder, n - 1);
+	if (maxOrder == 0) {
+		return FALSE;
+	}
+
+	// Tukey window with half of the block tapered, as the reference
+	// encoder uses by default
+	if (m_nWindowSize != n) {
+		UINT32 nTaper = n / 4;
+		for (UINT32 i = 0; i < n; i++) {
+			m_pWindow[i] = 1.0;
+		}
+		for (UINT32 i = 0; i < nTaper; i++) {
+			double w = 0.5 - 0.5 * cos(PI * i / nTaper);
+			m_pWindow[i] = w;
+			m_pWindow[n - 1 - i] = w;
+		}
+		m_nWindowSize = n;
+	}
+	for (UINT32 i = 0; i < n; i++) {
+		m_pWindowed[i] = x[i] * m_pWindow[i];
+	}
+
+	double r[FLAC_MAX_LPC_ORDER + 1];
+	for (UINT32 lag = 0; lag <= maxOrder; lag++) {
+		double sum = 0.0;
+		for (UINT32 i = lag; i < n; i++) {
+			sum += m_pWindowed[i] * m_pWindowed[i - lag];
+		}
+		r[lag] = sum;
+	}
+	if (r[0] <= 0.0) {
+		return FALSE;
+	}
+
+	// Levinson-Durbin recursion, keeping the predictor and error of
+	// every order
+	double lpc[FLAC_MAX_LPC_ORDER];
+	double coefs[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+	double errors[FLAC_MAX_LPC_ORDER];
+	double err = r[0];
+	UINT32 nOrders = 0;
+	for (UINT32 i = 0; i < maxOrder; i++) {
+		double k = -r[i + 1];
+		for (UINT32 j = 0; j < i; j++) {
+			k -= lpc[j] * r[i - j];
+		}
+		k /= err;
+		lpc[i] = k;
+		for (UINT32 j = 0; j < i / 2; j++) {
+			double t = lpc[j];
+			lpc[j] += k * lpc[i - 1 - j];
+			lpc[i - 1 - j] += k * t;
+		}
+		if (i & 1) {
+			lpc[i / 2] += lpc[i / 2] * k;
+		}
+		err *= 1.0 - k * k;
+		for (UINT32 j = 0; j <= i; j++) {
+			coefs[i][j] = -lpc[j];
+		}
+		errors[i] = err;
+		nOrders++;
+		if (err <= 0.0) {
+			break;
+		}
+	}
+
+	// Expected bits per residual for a Laplacian of the predicted error,
+	// plus the warm-up samples and coefficients
+	UINT32 bestOrder = 0;
+	double bestBits = 0.0;
+	for (UINT32 i = 0; i < nOrders; i++) {
+		UINT32 order = i + 1;
+		double bitsPerSample = errors[i] > 0.0 ?
+			0.5 * log(0.5 * errors[i] / n) / log(2.0) : 0.0;
+		if (bitsPerSample < 0.0) {
+			bitsPerSample = 0.0;
+		}
+		double bits = bitsPerSample * (n - order) +
+			order * (nBits + m_nPrecision);
+		if (bestOrder == 0 || bits < bestBits) {
+			bestOrder = order;
+			bestBits = bits;
+		}
+	}
+
+	// Quantize so the largest coefficient just fits, feeding each
+	// rounding error into the next coefficient
+	const double *c = coefs[bestOrder - 1];
+	double cmax = 0.0;
+	for (UINT32 j = 0; j < bestOrder; j++) {
+		cmax = max(cmax, fabs(c[j]));
+	}
+	if (cmax <= 0.0) {
+		return FALSE;
+	}
+	int log2cmax;
+	frexp(cmax, &log2cmax);
+	int shift = (int)m_nPrecision - log2cmax - 1;
+	if (shift < 0) {
+		return FALSE;
+	}
+	if (shift > 15) {
+		shift = 15;
+	}
+	INT32 qmax = (1 << (m_nPrecision - 1)) - 1;
+	INT32 qmin = -(1 << (m_nPrecision - 1));
+	double error = 0.0;
+	for (UINT32 j = 0; j < bestOrder; j++) {
+		error += c[j] * (1 << shift);
+		INT32 q = (INT32)floor(error + 0.5);
+		q = q > qmax ? qmax : (q < qmin ? qmin : q);
+		error -= q;
+		pCoefs[j] = q;
+	}
+	*pnOrder = bestOrder;
+	*pShift = shift;
+	return TRUE;
+}
+
+// Writes the smallest of the subframe types for one channel
+void FlacFrameEncoder::EncodeSubframe(FlacBitWriter *pWriter, const INT32 *x,
+									  UINT32 n, UINT32 nBits)
+{
+	// Silence, or a DC level
+	UINT32 i;
+	for (i = 1; i < n && x[i] == x[0]; i++) {
+	}
+	if (i == n) {
+		pWriter->Put(0, 8);
+		pWriter->Put(x[0], nBits);
+		return;
+	}
+
+	ULONGLONG verbatimBits = 8 + (ULONGLONG)n * nBits;
+
+	// Best fixed polynomial, picked on the sum of its residual
+	RicePlan fixedPlan;
+	UINT32 fixedOrder = 0;
+	ULONGLONG fixedBits = ~0ULL;
+	if (n > 4) {
+		ULONGLONG sums[5];
+		FixedResidualSums(x, n, sums);
+		for (UINT32 order = 1; order < 5; order++) {
+			if (sums[order] < sums[fixedOrder]) {
+				fixedOrder = order;
+			}
+		}
+		FixedResidual(x, n, fixedOrder, m_pFixedResidual);
+		fixedBits = 8 + (ULONGLONG)fixedOrder * nBits +
+			PlanResidual(m_pFixedResidual, n, fixedOrder, &fixedPlan);
+	}
+
+	// LPC
+	RicePlan lpcPlan;
+	INT32 coefs[FLAC_MAX_LPC_ORDER];
+	UINT32 lpcOrder = 0;
+	int shift = 0;
+	ULONGLONG lpcBits = ~0ULL;
+	if (m_nMaxLpcOrder > 0 && n > 4 &&
+		ComputeLpc(x, n, nBits, coefs, &lpcOrder, &shift) &&
+		LpcResidual(x, n, coefs, lpcOrder, shift, m_pLpcResidual)) {
+		lpcBits = 8 + (ULONGLONG)lpcOrder * (nBits + m_nPrecision) + 4 + 5 +
+			PlanResidual(m_pLpcResidual, n, lpcOrder, &lpcPlan);
+	}
+
+	// The subframe header is a zero bit, six bits of type and a zero
+	// for no wasted bits
+	if (lpcBits < fixedBits && lpcBits < verbatimBits) {
+		pWriter->Put(0x40 | ((lpcOrder - 1) << 1), 8);
+		for (i = 0; i < lpcOrder; i++) {
+			pWriter->Put(x[i], nBits);
+		}
+		pWriter->Put(m_nPrecision - 1, 4);
+		pWriter->Put(shift, 5);
+		for (i = 0; i < lpcOrder; i++) {
+			pWriter->Put(coefs[i], m_nPrecision);
+		}
+		WriteResidual(pWriter, m_pLpcResidual, n, lpcOrder, &lpcPlan);
+	} else if (fixedBits < verbatimBits) {
+		pWriter->Put(0x10 | (fixedOrder << 1), 8);
+		for (i = 0; i < fixedOrder; i++) {
+			pWriter->Put(x[i], nBits);
+		}
+		WriteResidual(pWriter, m_pFixedResidual, n, fixedOrder, &fixedPlan);
+	} else {
+		pWriter->Put(0x02, 8);
+		for (i = 0; i < n; i++) {
+			pWriter->Put(x[i], nBits);
+		}
+	}
+}
+
+// Frame numbers are coded like UTF-8, extended to 36 bits
+static void PutFrameNumber(FlacBitWriter *pWriter, ULONGLONG v)
+{
+	if (v < 0x80) {
+		pWriter->Put((UINT32)v, 8);
+		return;
+	}
+	UINT32 nExtra = 1;
+	while (nExtra < 6 && v >= (1ULL << (5 * nExtra + 6))) {
+		nExtra++;
+	}
+	UINT32 lead = (0xFF00 >> (nExtra + 1)) & 0xFF;
+	pWriter->Put(lead | (UINT32)(v >> (6 * nExtra)), 8);
+	while (nExtra--) {
+		pWriter->Put(0x80 | (UINT32)((v >> (6 * nExtra)) & 0x3F), 8);
+	}
+}
+
+static UINT32 BlockSizeCode(UINT32 n)
+{
+	switch (n) {
+	case 192: return 1;
+	case 576: return 2;
+	case 1152: return 3;
+	case 2304: return 4;
+	case 4608: return 5;
+	case 256: return 8;
+	case 512: return 9;
+	case 1024: return 10;
+	case 2048: return 11;
+	case 4096: return 12;
+	case 8192: return 13;
+	case 16384: return 14;
+	case 32768: return 15;
+	}
+	return n <= 256 ? 6 : 7;
+}
+
+static UINT32 SampleRateCode(UINT32 rate)
+{
+	switch (rate) {
+	case 88200: return 1;
+	case 176400: return 2;
+	case 192000: return 3;
+	case 8000: return 4;
+	case 16000: return 5;
+	case 22050: return 6;
+	case 24000: return 7;
+	case 32000: return 8;
+	case 44100: return 9;
+	case 48000: return 10;
+	case 96000: return 11;
+	}
+	if (rate % 1000 == 0 && rate / 1000 < 256) {
+		return 12;
+	}
+	if (rate < 65536) {
+		return 13;
+	}
+	if (rate % 10 == 0 && rate / 10 < 65536) {
+		return 14;
+	}
+	return 0;
+}
+
+static UINT32 SampleSizeCode(UINT32 nBits)
+{
+	switch (nBits) {
+	case 8: return 1;
+	case 12: return 2;
+	case 16: return 4;
+	case 20: return 5;
+	case 24: return 6;
+	}
+	return 0;
+}
+
+DWORD FlacFrameEncoder::EncodeFrame(const INT32 *pSamples, UINT32 nStride,
+									UINT32 nFrames, ULONGLONG iFrame,
+									BYTE *pOut)
+{
+	UINT32 n = nFrames;
+	const INT32 *pChannels[FLAC_MAX_CHANNELS];
+	UINT32 nBits[FLAC_MAX_CHANNELS];
+	UINT32 assignment = m_nChannels - 1;
+	for (UINT32 c = 0; c < m_nChannels; c++) {
+		pChannels[c] = pSamples + c * nStride;
+		nBits[c] = m_nBitsPerSample;
+	}
+
+	// For stereo, pick the pair whose second-order residuals are
+	// smallest
+	if (m_nChannels == 2 && n > 4) {
+		const INT32 *pLeft = pChannels[0];
+		const INT32 *pRight = pChannels[1];
+		for (UINT32 i = 0; i < n; i++) {
+			m_pMid[i] = (pLeft[i] + pRight[i]) >> 1;
+			m_pSide[i] = pLeft[i] - pRight[i];
+		}
+		ULONGLONG sums[4][5];
+		FixedResidualSums(pLeft, n, sums[0]);
+		FixedResidualSums(pRight, n, sums[1]);
+		FixedResidualSums(m_pMid, n, sums[2]);
+		FixedResidualSums(m_pSide, n, sums[3]);
+		ULONGLONG eLeft = sums[0][2], eRight = sums[1][2];
+		ULONGLONG eMid = sums[2][2], eSide = sums[3][2];
+		ULONGLONG best = eLeft + eRight;
+		if (eLeft + eSide < best) {
+			best = eLeft + eSide;
+			assignment = FLAC_CHANNELS_LEFT_SIDE;
+		}
+		if (eRight + eSide < best) {
+			best = eRight + eSide;
+			assignment = FLAC_CHANNELS_RIGHT_SIDE;
+		}
+		if (eMid + eSide < best) {
+			assignment = FLAC_CHANNELS_MID_SIDE;
+		}
+		switch (assignment) {
+		case FLAC_CHANNELS_LEFT_SIDE:
+			pChannels[1] = m_pSide;
+			nBits[1]++;
+			break;
+		case FLAC_CHANNELS_RIGHT_SIDE:
+			pChannels[0] = m_pSide;
+			nBits[0]++;
+			break;
+		case FLAC_CHANNELS_MID_SIDE:
+			pChannels[0] = m_pMid;
+			pChannels[1] = m_pSide;
+			nBits[1]++;
+			break;
+		}
+	}
+
+	// Frame header, always with a fixed block size
+	FlacBitWriter writer;
+	writer.Init(pOut);
+	UINT32 blockCode = BlockSizeCode(n);
+	UINT32 rateCode = SampleRateCode(m_nSampleRate);
+	writer.Put(0xFFF8, 16);
+	writer.Put(blockCode, 4);
+	writer.Put(rateCode, 4);
+	writer.Put(assignment, 4);
+	writer.Put(SampleSizeCode(m_nBitsPerSample), 3);
+	writer.Put(0, 1);
+	PutFrameNumber(&writer, iFrame);
+	if (blockCode == 6) {
+		writer.Put(n - 1, 8);
+	} else if (blockCode == 7) {
+		writer.Put(n - 1, 16);
+	}
+	if (rateCode == 12) {
+		writer.Put(m_nSampleRate / 1000, 8);
+	} else if (rateCode == 13) {
+		writer.Put(m_nSampleRate, 16);
+	} else if (rateCode == 14) {
+		writer.Put(m_nSampleRate / 10, 16);
+	}
+	writer.Put(Crc8(pOut, writer.Size()), 8);
+
+	for (UINT32 c = 0; c < m_nChannels; c++) {
+		EncodeSubframe(&writer, pChannels[c], n, nBits[c]);
+	}
+
+	writer.AlignToByte();
+	writer.Put(Crc16(pOut, writer.Size()), 16);
+	return writer.Size();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Batches
+
+// Frames to be encoded together, one worker to each encoder
+struct FlacBatch
+{
+	FlacFrameEncoder *pEncoders;
+	LONG        nWorkers;
+	const INT32 *pSamples;      // Planar, nBlockSize * nChannels per frame
+	UINT32      nChannels;
+	UINT32      nBlockSize;
+	UINT32      nSamples;       // Per channel.  The last frame may be short.
+	ULONGLONG   iFirstFrame;
+	BYTE        *pOut;          // MaxFrameSize() per frame
+	DWORD       *pcbFrames;
+};
+
+// Worker w encodes frames w, w + nWorkers, and so on
+static void EncodeBatchProc(LONG iWorker, void *pContext)
+{
+	FlacBatch *pBatch = (FlacBatch *)pContext;
+	FlacFrameEncoder *pEncoder = &pBatch->pEncoders[iWorker];
+	UINT32 nFrames = (pBatch->nSamples + pBatch->nBlockSize - 1) /
+		pBatch->nBlockSize;
+	for (UINT32 iFrame = iWorker; iFrame < nFrames; iFrame += pBatch->nWorkers) {
+		UINT32 nInFrame = min(pBatch->nBlockSize,
+			pBatch->nSamples - iFrame * pBatch->nBlockSize);
+		pBatch->pcbFrames[iFrame] = pEncoder->EncodeFrame(
+			pBatch->pSamples + (SIZE_T)iFrame * pBatch->nBlockSize *
+			pBatch->nChannels, pBatch->nBlockSize, nInFrame,
+			pBatch->iFirstFrame + iFrame,
+			pBatch->pOut + (SIZE_T)iFrame * pEncoder->MaxFrameSize());
+	}
+}
+
+// Encodes the batch and packs the frames together at the start of
+// pOut.  Returns the number of bytes.
+static DWORD EncodeFlacBatch(FlacBatch *pBatch)
+{
+	UINT32 nFrames = (pBatch->nSamples + pBatch->nBlockSize - 1) /
+		pBatch->nBlockSize;
+	pBatch->nWorkers = min(pBatch->nWorkers, (LONG)nFrames);
+	RunInParallel(pBatch->nWorkers, pBatch->nWorkers, EncodeBatchProc, pBatch);
+
+	DWORD cbMaxFrame = pBatch->pEncoders[0].MaxFrameSize();
+	DWORD cbTotal = 0;
+	for (UINT32 iFrame = 0; iFrame < nFrames; iFrame++) {
+		memmove(pBatch->pOut + cbTotal, pBatch->pOut + iFrame * cbMaxFrame,
+			pBatch->pcbFrames[iFrame]);
+		cbTotal += pBatch->pcbFrames[iFrame];
+	}
+	return cbTotal;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// FlacFile
+
+FlacFile::FlacFile() :
+m_hFile(INVALID_HANDLE_VALUE),
+m_nSampleRate(0),
+m_nChannels(0),
+m_nBitsPerSample(0),
+m_cbSample(0),
+m_pEncoders(NULL),
+m_nWorkers(0),
+m_nBatchFrames(0),
+m_pSamples(NULL),
+m_nBuffered(0),
+m_pOut(NULL),
+m_pcbFrames(NULL),
+m_iFrame(0),
+m_nTotalSamples(0),
+m_cbFile(0),
+m_cbSmallestFrame(0),
+m_cbLargestFrame(0),
+m_cWrites(0)
+{
+}
+
+FlacFile::~FlacFile()
+{
+	Close();
+}
+
+void FlacFile::Free()
+{
+	delete [] m_pEncoders;
+	delete [] m_pSamples;
+	delete [] m_pOut;
+	delete [] m_pcbFrames;
+	m_pEncoders = NULL;
+	m_pSamples = NULL;
+	m_pOut = NULL;
+	m_pcbFrames = NULL;
+}
+
+HRESULT FlacFile::Open(const WCHAR *szFileName, UINT32 nSampleRate,
+					   UINT32 nChannels, UINT32 nBitsPerSample,
+					   const FlacOptions &options)
+{
+	if (nBitsPerSample != 16 && nBitsPerSample != 24) {
+		return E_INVALIDARG;
+	}
+	m_options = options;
+	m_nSampleRate = nSampleRate;
+	m_nChannels = nChannels;
+	m_nBitsPerSample = nBitsPerSample;
+	m_cbSample = nBitsPerSample / 8;
+	m_nBuffered = 0;
+	m_iFrame = 0;
+	m_nTotalSamples = 0;
+	m_cbSmallestFrame = 0;
+	m_cbLargestFrame = 0;
+	m_cWrites = 0;
+
+	m_nWorkers = options.nThreads > 0 ? options.nThreads : GetProcessorCount();
+	m_nWorkers = min(m_nWorkers, (LONG)MAXIMUM_WAIT_OBJECTS);
+	m_nBatchFrames = m_nWorkers * FLAC_FRAMES_PER_THREAD;
+
+	m_pEncoders = new (std::nothrow) FlacFrameEncoder[m_nWorkers];
+	if (m_pEncoders == NULL) {
+		return E_OUTOFMEMORY;
+	}
+	HRESULT hr = S_OK;
+	for (LONG i = 0; i < m_nWorkers && SUCCEEDED(hr); i++) {
+		hr = m_pEncoders[i].Initialize(nChannels, nBitsPerSample, nSampleRate,
+			options);
+	}
+	if (FAILED(hr)) {
+		Free();
+		return hr;
+	}
+
+	SIZE_T nBatchSamples = (SIZE_T)m_nBatchFrames * options.nBlockSize;
+	m_pSamples = new (std::nothrow) INT32[nBatchSamples * nChannels];
+	m_pOut = new (std::nothrow) BYTE[m_nBatchFrames *
+		m_pEncoders[0].MaxFrameSize()];
+	m_pcbFrames = new (std::nothrow) DWORD[m_nBatchFrames];
+	if (m_pSamples == NULL || m_pOut == NULL || m_pcbFrames == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+
+	m_hFile = CreateFileW(szFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, 0, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		Free();
+		return hr;
+	}
+
+	// A STREAMINFO with the length unknown, rewritten by Close
+	m_cbFile = 0;
+	hr = WriteStreamInfo();
+	if (FAILED(hr)) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		Free();
+	}
+	return hr;
+}
+
+HRESULT FlacFile::WriteToFile(const void *buf, DWORD count)
+{
+	DWORD cbWritten = 0;
+	if (!WriteFile(m_hFile, buf, count, &cbWritten, NULL)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	m_cWrites++;
+	return cbWritten == count ? S_OK : E_FAIL;
+}
+
+HRESULT FlacFile::WriteStreamInfo()
+{
+	BYTE header[FLAC_STREAMINFO_SIZE];
+	FlacBitWriter writer;
+	writer.Init(header);
+	writer.Put('f', 8);
+	writer.Put('L', 8);
+	writer.Put('a', 8);
+	writer.Put('C', 8);
+	writer.Put(1, 1);                       // Last metadata block
+	writer.Put(0, 7);                       // STREAMINFO
+	writer.Put(34, 24);
+	writer.Put(m_options.nBlockSize, 16);   // Smallest block, but for the last
+	writer.Put(m_options.nBlockSize, 16);
+	writer.Put(m_cbSmallestFrame, 24);
+	writer.Put(m_cbLargestFrame, 24);
+	writer.Put(m_nSampleRate, 20);
+	writer.Put(m_nChannels - 1, 3);
+	writer.Put(m_nBitsPerSample - 1, 5);
+	writer.Put((UINT32)(m_nTotalSamples >> 32) & 0xF, 4);
+	writer.Put((UINT32)m_nTotalSamples, 32);
+	for (int i = 0; i < 4; i++) {
+		writer.Put(0, 32);                  // MD5 not computed
+	}
+
+	if (m_cbFile == 0) {
+		m_cbFile = FLAC_STREAMINFO_SIZE;
+		return WriteToFile(header, FLAC_STREAMINFO_SIZE);
+	}
+	LARGE_INTEGER pos;
+	pos.QuadPart = 0;
+	if (!SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	HRESULT hr = WriteToFile(header, FLAC_STREAMINFO_SIZE);
+	pos.QuadPart = (LONGLONG)m_cbFile;
+	if (!SetFilePointerEx(m_hFile, pos, NULL, FILE_BEGIN) && SUCCEEDED(hr)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	return hr;
+}
+
+HRESULT FlacFile::Write(const void *pData, DWORD cbData)
+{
+	if (!IsOpen()) {
+		return E_UNEXPECTED;
+	}
+	UINT32 nBlockSize = m_options.nBlockSize;
+	UINT32 nBatchSamples = m_nBatchFrames * nBlockSize;
+	DWORD cbFrame = m_nChannels * m_cbSample;
+	DWORD nFrames = cbData / cbFrame;
+	const BYTE *p = (const BYTE *)pData;
+
+	for (DWORD i = 0; i < nFrames; i++) {
+		UINT32 iFrame = m_nBuffered / nBlockSize;
+		INT32 *pDest = m_pSamples + (SIZE_T)iFrame * nBlockSize * m_nChannels +
+			m_nBuffered % nBlockSize;
+		for (UINT32 c = 0; c < m_nChannels; c++, p += m_cbSample) {
+			if (m_cbSample == 2) {
+				pDest[c * nBlockSize] = (short)(p[0] | (p[1] << 8));
+			} else {
+				pDest[c * nBlockSize] =
+					(INT32)((p[0] << 8) | (p[1] << 16) | ((UINT32)p[2] << 24)) >> 8;
+			}
+		}
+		if (++m_nBuffered == nBatchSamples) {
+			HRESULT hr = EncodeBatch();
+			if (FAILED(hr)) {
+				return hr;
+			}
+		}
+	}
+	return S_OK;
+}
+
+HRESULT FlacFile::EncodeBatch()
+{
+	FlacBatch batch;
+	batch.pEncoders = m_pEncoders;
+	batch.nWorkers = m_nWorkers;
+	batch.pSamples = m_pSamples;
+	batch.nChannels = m_nChannels;
+	batch.nBlockSize = m_options.nBlockSize;
+	batch.nSamples = m_nBuffered;
+	batch.iFirstFrame = m_iFrame;
+	batch.pOut = m_pOut;
+	batch.pcbFrames = m_pcbFrames;
+	DWORD cbBatch = EncodeFlacBatch(&batch);
+
+	UINT32 nFrames = (m_nBuffered + batch.nBlockSize - 1) / batch.nBlockSize;
+	for (UINT32 i = 0; i < nFrames; i++) {
+		if (m_cbSmallestFrame == 0 || m_pcbFrames[i] < m_cbSmallestFrame) {
+			m_cbSmallestFrame = m_pcbFrames[i];
+		}
+		m_cbLargestFrame = max(m_cbLargestFrame, m_pcbFrames[i]);
+	}
+	m_iFrame += nFrames;
+	m_nTotalSamples += m_nBuffered;
+	m_nBuffered = 0;
+
+	HRESULT hr = WriteToFile(m_pOut, cbBatch);
+	if (SUCCEEDED(hr)) {
+		m_cbFile += cbBatch;
+	}
+	return hr;
+}
+
+HRESULT FlacFile::Close()
+{
+	if (!IsOpen()) {
+		return S_OK;
+	}
+	HRESULT hr = S_OK;
+	if (m_nBuffered > 0) {
+		hr = EncodeBatch();
+	}
+	if (SUCCEEDED(hr)) {
+		hr = WriteStreamInfo();
+	}
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+	Free();
+	return hr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// Unpacks the bits of a frame, most significant first, for the check
+// that the benchmark's output decodes to its input
+struct FlacBitReader
+{
+	const BYTE  *pStart;
+	const BYTE  *p;
+	const BYTE  *pEnd;
+	ULONGLONG   acc;            // Bits not yet taken, in the low nBits
+	UINT32      nBits;
+	BOOL        bOverrun;
+
+	void Init(const BYTE *pIn, DWORD cb) {
+		pStart = p = pIn;
+		pEnd = pIn + cb;
+		acc = 0;
+		nBits = 0;
+		bOverrun = FALSE;
+	}
+
+	// Reads n bits, n <= 32
+	UINT32 Get(UINT32 n) {
+		while (nBits < n) {
+			BYTE b = 0;
+			if (p < pEnd) {
+				b = *p++;
+			} else {
+				bOverrun = TRUE;
+			}
+			acc = (acc << 8) | b;
+			nBits += 8;
+		}
+		nBits -= n;
+		return (UINT32)((acc >> nBits) & ((1ULL << n) - 1));
+	}
+
+	INT32 GetSigned(UINT32 n) {
+		UINT32 v = Get(n);
+		return n < 32 && (v >> (n - 1)) ? (INT32)(v - (1U << n)) : (INT32)v;
+	}
+
+	INT32 GetRice(UINT32 k) {
+		UINT32 q = 0;
+		while (!bOverrun && Get(1) == 0) {
+			q++;
+		}
+		UINT32 u = (q << k) | Get(k);
+		return (INT32)(u >> 1) ^ -(INT32)(u & 1);
+	}
+
+	void AlignToByte() { nBits -= nBits % 8; }
+
+	// Bytes taken so far.  Only meaningful when aligned.
+	DWORD Size() const { return (DWORD)(p - pStart) - nBits / 8; }
+};
+
+// Reads the residual of a block of n samples after order warm-up
+// samples
+static BOOL DecodeResidual(FlacBitReader *pReader, UINT32 n, UINT32 order,
+						   INT32 *pResidual)
+{
+	UINT32 method = pReader->Get(2);
+	if (method > 1) {
+		return FALSE;
+	}
+	UINT32 nParamBits = method ? 5 : 4;
+	UINT32 escape = (1U << nParamBits) - 1;
+	UINT32 partOrder = pReader->Get(4);
+	UINT32 nPerPart = n >> partOrder;
+	INT32 *pOut = pResidual;
+	for (UINT32 iPart = 0; iPart < (1U << partOrder); iPart++) {
+		UINT32 nPart = nPerPart - (iPart == 0 ? order : 0);
+		UINT32 k = pReader->Get(nParamBits);
+		if (k == escape) {
+			UINT32 nRaw = pReader->Get(5);
+			for (UINT32 i = 0; i < nPart; i++) {
+				*pOut++ = nRaw ? pReader->GetSigned(nRaw) : 0;
+			}
+		} else {
+			for (UINT32 i = 0; i < nPart; i++) {
+				*pOut++ = pReader->GetRice(k);
+			}
+		}
+	}
+	return !pReader->bOverrun;
+}
+
+// Decodes one subframe of n samples of nBits each
+static BOOL DecodeSubframe(FlacBitReader *pReader, INT32 *x, UINT32 n,
+						   UINT32 nBits, INT32 *pResidual)
+{
+	if (pReader->Get(1) != 0) {
+		return FALSE;
+	}
+	UINT32 type = pReader->Get(6);
+	if (pReader->Get(1) != 0) {
+		// Wasted bits, which the encoder never uses
+		return FALSE;
+	}
+
+	if (type == 0) {
+		INT32 v = pReader->GetSigned(nBits);
+		for (UINT32 i = 0; i < n; i++) {
+			x[i] = v;
+		}
+	} else if (type == 1) {
+		for (UINT32 i = 0; i < n; i++) {
+			x[i] = pReader->GetSigned(nBits);
+		}
+	} else if (type >= 8 && type <= 12) {
+		UINT32 order = type - 8;
+		for (UINT32 i = 0; i < order; i++) {
+			x[i] = pReader->GetSigned(nBits);
+		}
+		if (!DecodeResidual(pReader, n, order, pResidual)) {
+			return FALSE;
+		}
+		for (UINT32 i = order; i < n; i++) {
+			LONGLONG e = pResidual[i - order];
+			switch (order) {
+			case 0: break;
+			case 1: e += x[i - 1]; break;
+			case 2: e += 2LL * x[i - 1] - x[i - 2]; break;
+			case 3: e += 3LL * x[i - 1] - 3LL * x[i - 2] + x[i - 3]; break;
+			default: e += 4LL * x[i - 1] - 6LL * x[i - 2] + 4LL * x[i - 3] -
+						 x[i - 4]; break;
+			}
+			x[i] = (INT32)e;
+		}
+	} else if (type >= 32) {
+		UINT32 order = (type & 31) + 1;
+		INT32 coefs[FLAC_MAX_LPC_ORDER];
+		for (UINT32 i = 0; i < order; i++) {
+			x[i] = pReader->GetSigned(nBits);
+		}
+		UINT32 precision = pReader->Get(4) + 1;
+		int shift = pReader->GetSigned(5);
+		if (precision == 16 || shift < 0) {
+			return FALSE;
+		}
+		for (UINT32 i = 0; i < order; i++) {
+			coefs[i] = pReader->GetSigned(precision);
+		}
+		if (!DecodeResidual(pReader, n, order, pResidual)) {
+			return FALSE;
+		}
+		for (UINT32 i = order; i < n; i++) {
+			LONGLONG sum = 0;
+			for (UINT32 j = 0; j < order; j++) {
+				sum += (LONGLONG)coefs[j] * x[i - 1 - j];
+			}
+			x[i] = (INT32)(pResidual[i - order] + (sum >> shift));
+		}
+	} else {
+		return FALSE;
+	}
+	return !pReader->bOverrun;
+}
+
+// Decodes frame iFrame of cb bytes into planar channels nStride apart,
+// checking its header and both CRCs.  Returns the samples per channel,
+// or 0 if the frame is not what the encoder should have written.
+static UINT32 DecodeFlacFrame(const BYTE *pIn, DWORD cb, ULONGLONG iFrame,
+							  UINT32 nChannels, UINT32 nBitsPerSample,
+							  INT32 *pSamples, UINT32 nStride,
+							  INT32 *pResidual)
+{
+	FlacBitReader reader;
+	reader.Init(pIn, cb);
+	if (reader.Get(16) != 0xFFF8) {
+		return 0;
+	}
+	UINT32 blockCode = reader.Get(4);
+	UINT32 rateCode = reader.Get(4);
+	UINT32 assignment = reader.Get(4);
+	if (reader.Get(3) != SampleSizeCode(nBitsPerSample) || reader.Get(1) != 0) {
+		return 0;
+	}
+
+	// Frame number, coded like UTF-8
+	UINT32 lead = reader.Get(8);
+	UINT32 nExtra = 0;
+	while (nExtra < 7 && (lead & (0x80 >> nExtra))) {
+		nExtra++;
+	}
+	if (nExtra == 1 || nExtra > 7) {
+		return 0;
+	}
+	nExtra = nExtra ? nExtra - 1 : 0;
+	ULONGLONG number = lead & (0x7F >> (nExtra ? nExtra + 1 : 0));
+	for (UINT32 i = 0; i < nExtra; i++) {
+		number = (number << 6) | (reader.Get(8) & 0x3F);
+	}
+	if (number != iFrame) {
+		return 0;
+	}
+
+	UINT32 n = 0;
+	if (blockCode == 1) {
+		n = 192;
+	} else if (blockCode >= 2 && blockCode <= 5) {
+		n = 576 << (blockCode - 2);
+	} else if (blockCode == 6) {
+		n = reader.Get(8) + 1;
+	} else if (blockCode == 7) {
+		n = reader.Get(16) + 1;
+	} else if (blockCode >= 8) {
+		n = 256 << (blockCode - 8);
+	}
+	if (n == 0 || n > nStride) {
+		return 0;
+	}
+	if (rateCode == 12) {
+		reader.Get(8);
+	} else if (rateCode == 13 || rateCode == 14) {
+		reader.Get(16);
+	}
+	DWORD cbHeader = reader.Size();
+	if (reader.Get(8) != Crc8(pIn, cbHeader)) {
+		return 0;
+	}
+
+	// The side channel has one more bit
+	UINT32 iSide = nChannels;
+	if (assignment == FLAC_CHANNELS_LEFT_SIDE || assignment == FLAC_CHANNELS_MID_SIDE) {
+		iSide = 1;
+	} else if (assignment == FLAC_CHANNELS_RIGHT_SIDE) {
+		iSide = 0;
+	} else if (assignment != nChannels - 1) {
+		return 0;
+	}
+	for (UINT32 c = 0; c < nChannels; c++) {
+		if (!DecodeSubframe(&reader, pSamples + c * nStride, n,
+			nBitsPerSample + (c == iSide ? 1 : 0), pResidual)) {
+			return 0;
+		}
+	}
+
+	reader.AlignToByte();
+	DWORD cbFrame = reader.Size();
+	if (reader.Get(16) != Crc16(pIn, cbFrame) || reader.Size() != cb) {
+		return 0;
+	}
+
+	INT32 *pLeft = pSamples;
+	INT32 *pRight = pSamples + nStride;
+	for (UINT32 i = 0; i < n && iSide < nChannels; i++) {
+		switch (assignment) {
+		case FLAC_CHANNELS_LEFT_SIDE:
+			pRight[i] = pLeft[i] - pRight[i];
+			break;
+		case FLAC_CHANNELS_RIGHT_SIDE:
+			pLeft[i] = pLeft[i] + pRight[i];
+			break;
+		case FLAC_CHANNELS_MID_SIDE: {
+			INT32 side = pRight[i];
+			INT32 mid = (INT32)(((UINT32)pLeft[i] << 1) | (side & 1));
+			pLeft[i] = (mid + side) >> 1;
+			pRight[i] = (mid - side) >> 1;
+			break;
+		}
+		}
+	}
+	return n;
+}
+
+// Decodes the frames of a batch and compares them with the samples
+// that were encoded, returning the number of frames that differ
+static UINT32 CheckFlacBatch(const BYTE *pEncoded, const DWORD *pcbFrames,
+							 const INT32 *pPlanar, UINT32 nFrames,
+							 UINT32 nChannels, UINT32 nBits,
+							 UINT32 nBlockSize)
+{
+	UINT32 nBlocks = (nFrames + nBlockSize - 1) / nBlockSize;
+	UINT32 nBad = 0;
+	INT32 *pDecoded = new (std::nothrow) INT32[nBlockSize * nChannels];
+	INT32 *pResidual = new (std::nothrow) INT32[nBlockSize];
+	if (pDecoded == NULL || pResidual == NULL) {
+		delete [] pDecoded;
+		delete [] pResidual;
+		return nBlocks;
+	}
+
+	for (UINT32 b = 0; b < nBlocks; b++) {
+		UINT32 nExpected = min(nBlockSize, nFrames - b * nBlockSize);
+		UINT32 n = DecodeFlacFrame(pEncoded, pcbFrames[b], b, nChannels, nBits,
+			pDecoded, nBlockSize, pResidual);
+		const INT32 *pExpected = pPlanar + (SIZE_T)b * nBlockSize * nChannels;
+		BOOL bSame = (n == nExpected);
+		for (UINT32 c = 0; c < nChannels && bSame; c++) {
+			bSame = memcmp(pDecoded + c * nBlockSize, pExpected + c * nBlockSize,
+				n * sizeof(INT32)) == 0;
+		}
+		if (!bSame) {
+			nBad++;
+		}
+		pEncoded += pcbFrames[b];
+	}
+
+	delete [] pDecoded;
+	delete [] pResidual;
+	return nBad;
+}
+
+// Reads the samples of a PCM or float WAV file as 16- or 24-bit
+// integers.  Float is converted to 24 bits.
+static BOOL LoadBenchmarkWave(const char *szFileName, INT32 **ppSamples,
+							  UINT32 *pnFrames, UINT32 *pnChannels,
+							  UINT32 *pnBits, UINT32 *pnRate)
+{
+	const DWORD MAX_FILE_SIZE = 512 * 1024 * 1024;
+	BOOL bOk = FALSE;
+	BYTE *pFile = NULL;
+	DWORD cbFile = 0;
+	HANDLE hFile = CreateFileA(szFileName, GENERIC_READ, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		printf("Cannot open %s\n", szFileName);
+		return FALSE;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart > MAX_FILE_SIZE) {
+		printf("%s is too large, use a file under %u MB\n", szFileName,
+			MAX_FILE_SIZE / (1024 * 1024));
+		CloseHandle(hFile);
+		return FALSE;
+	}
+	cbFile = (DWORD)size.QuadPart;
+	pFile = new (std::nothrow) BYTE[cbFile];
+	if (pFile == NULL || !ReadFile(hFile, pFile, cbFile, &cbFile, NULL)) {
+		printf("Cannot read %s\n", szFileName);
+		CloseHandle(hFile);
+		delete [] pFile;
+		return FALSE;
+	}
+	CloseHandle(hFile);
+
+	// Walk the chunks for the format and the data.  A size that runs
+	// past the end, as RF64 and cut-off files have, takes the rest.
+	const WAVEFORMATEX *pFormat = NULL;
+	const BYTE *pData = NULL;
+	DWORD cbData = 0;
+	if (cbFile >= 12 && (!memcmp(pFile, "RIFF", 4) || !memcmp(pFile, "RF64", 4)) &&
+		!memcmp(pFile + 8, "WAVE", 4)) {
+		DWORD pos = 12;
+		while (pos + 8 <= cbFile) {
+			DWORD cbChunk = *(const DWORD *)(pFile + pos + 4);
+			DWORD cbLeft = cbFile - pos - 8;
+			if (cbChunk > cbLeft) {
+				cbChunk = cbLeft;
+			}
+			if (!memcmp(pFile + pos, "fmt ", 4) && cbChunk >= 16) {
+				pFormat = (const WAVEFORMATEX *)(pFile + pos + 8);
+			} else if (!memcmp(pFile + pos, "data", 4)) {
+				pData = pFile + pos + 8;
+				cbData = cbChunk;
+				break;
+			}
+			pos += 8 + cbChunk + (cbChunk & 1);
+		}
+	}
+	if (pFormat == NULL || pData == NULL) {
+		printf("%s is not a WAV file\n", szFileName);
+		delete [] pFile;
+		return FALSE;
+	}
+
+	WORD tag = pFormat->wFormatTag;
+	if (tag == WAVE_FORMAT_EXTENSIBLE && pFormat->cbSize >= 22) {
+		const WAVEFORMATEXTENSIBLE *pExt = (const WAVEFORMATEXTENSIBLE *)pFormat;
+		if (pExt->SubFormat == KSDATAFORMAT_SUBTYPE_PCM) {
+			tag = WAVE_FORMAT_PCM;
+		} else if (pExt->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT) {
+			tag = WAVE_FORMAT_IEEE_FLOAT;
+		}
+	}
+	UINT32 nChannels = pFormat->nChannels;
+	UINT32 nBits = pFormat->wBitsPerSample;
+	BOOL bFloat = (tag == WAVE_FORMAT_IEEE_FLOAT && nBits == 32);
+	if (!(bFloat || (tag == WAVE_FORMAT_PCM && (nBits == 16 || nBits == 24))) ||
+		nChannels == 0 || nChannels > FLAC_MAX_CHANNELS) {
+		printf("%s must be 16-bit, 24-bit or float, 1 to %u channels\n",
+			szFileName, FLAC_MAX_CHANNELS);
+		delete [] pFile;
+		return FALSE;
+	}
+
+	UINT32 cbSample = nBits / 8;
+	UINT32 nFrames = cbData / (nChannels * cbSample);
+	INT32 *pSamples = new (std::nothrow) INT32[(SIZE_T)nFrames * nChannels];
+	if (pSamples != NULL) {
+		const BYTE *p = pData;
+		BYTE *pConverted = NULL;
+		if (bFloat) {
+			// Stored as packed 24-bit, then read back below
+			PcmConverter converter;
+			pConverted = new (std::nothrow) BYTE[(SIZE_T)nFrames * nChannels * 3];
+			if (pConverted != NULL &&
+				SUCCEEDED(converter.Initialize(nChannels, PCM_FORMAT_INT24,
+				PCM_DITHER_TPDF))) {
+				converter.Convert((const float *)pData, nFrames, pConverted);
+			}
+			p = pConverted;
+			cbSample = 3;
+			nBits = 24;
+		}
+		if (p != NULL) {
+			for (SIZE_T i = 0; i < (SIZE_T)nFrames * nChannels; i++, p += cbSample) {
+				pSamples[i] = (cbSample == 2) ? (short)(p[0] | (p[1] << 8)) :
+					(INT32)((p[0] << 8) | (p[1] << 16) | ((UINT32)p[2] << 24)) >> 8;
+			}
+			bOk = TRUE;
+		}
+		delete [] pConverted;
+	}
+	if (!bOk) {
+		printf("Out of memory\n");
+		delete [] pSamples;
+	} else {
+		*ppSamples = pSamples;
+		*pnFrames = nFrames;
+		*pnChannels = nChannels;
+		*pnBits = nBits;
+		*pnRate = pFormat->nSamplesPerSec;
+	}
+	delete [] pFile;
+	return bOk;
+}
+
+// Thirty seconds of 24-bit stereo: a few drifting partials in one
+// channel and a delayed, quieter copy in the other, over a low noise
+// floor, with a stretch of near-silence at the end
+static INT32 *SynthesizeBenchmarkAudio(UINT32 *pnFrames, UINT32 *pnChannels,
+									   UINT32 *pnBits, UINT32 *pnRate)
+{
+	const UINT32 N_RATE = 48000;
+	const UINT32 N_FRAMES = 30 * N_RATE;
+	INT32 *pSamples = new (std::nothrow) INT32[N_FRAMES * 2];
+	if (pSamples == NULL) {
+		return NULL;
+	}
+	srand(1);
+	double left[64] = { 0 };
+	for (UINT32 i = 0; i < N_FRAMES; i++) {
+		double t = (double)i / N_RATE;
+		double noise = (rand() - rand()) / (double)RAND_MAX * 1e-4;
+		double x = noise;
+		if (i < N_FRAMES - 3 * N_RATE) {
+			double env = 0.5 + 0.4 * sin(2 * PI * 0.3 * t);
+			x += env * (0.3 * sin(2 * PI * 220.0 * t) +
+				0.15 * sin(2 * PI * 440.0 * t + 0.5 * sin(2 * PI * 5.0 * t)) +
+				0.05 * sin(2 * PI * 1320.0 * t));
+		}
+		left[i % 64] = x;
+		double right = 0.7 * left[(i + 64 - 17) % 64] + noise * 0.5;
+		pSamples[2 * i] = (INT32)floor(x * 8388607.0 + 0.5);
+		pSamples[2 * i + 1] = (INT32)floor(right * 8388607.0 + 0.5);
+	}
+	*pnFrames = N_FRAMES;
+	*pnChannels = 2;
+	*pnBits = 24;
+	*pnRate = N_RATE;
+	return pSamples;
+}
+
+void benchmarkFlacEncoder(const char *szFileName) {
+	const double MIN_SECONDS = 1.0;
+	const UINT32 lpcOrders[] = { 0, 8, 12, 32 };
+
+	INT32 *pInterleaved = NULL;
+	UINT32 nFrames = 0, nChannels = 0, nBits = 0, nRate = 0;
+	if (szFileName) {
+		if (!LoadBenchmarkWave(szFileName, &pInterleaved, &nFrames,
+			&nChannels, &nBits, &nRate)) {
+			return;
+		}
+	} else {
+		pInterleaved = SynthesizeBenchmarkAudio(&nFrames, &nChannels, &nBits,
+			&nRate);
+		if (pInterleaved == NULL) {
+			printf("Out of memory\n");
+			return;
+		}
+	}
+
+	// Lay the samples out frame by frame, as FlacFile batches them
+	FlacOptions options;
+	UINT32 nBlockSize = options.nBlockSize;
+	UINT32 nBlocks = (nFrames + nBlockSize - 1) / nBlockSize;
+	LONG nProcessors = min(GetProcessorCount(), (LONG)MAXIMUM_WAIT_OBJECTS);
+	INT32 *pPlanar = new (std::nothrow) INT32[(SIZE_T)nBlocks * nBlockSize * nChannels];
+	FlacFrameEncoder *pEncoders = new (std::nothrow) FlacFrameEncoder[nProcessors];
+	DWORD *pcbFrames = new (std::nothrow) DWORD[nBlocks];
+	BYTE *pOut = NULL;
+	if (pPlanar == NULL || pEncoders == NULL || pcbFrames == NULL) {
+		printf("Out of memory\n");
+		goto CLEANUP;
+	}
+	for (UINT32 i = 0; i < nFrames; i++) {
+		INT32 *pDest = pPlanar + (SIZE_T)(i / nBlockSize) * nBlockSize * nChannels +
+			i % nBlockSize;
+		for (UINT32 c = 0; c < nChannels; c++) {
+			pDest[c * nBlockSize] = pInterleaved[(SIZE_T)i * nChannels + c];
+		}
+	}
+
+	{
+		ULONGLONG cbPcm = (ULONGLONG)nFrames * nChannels * (nBits / 8);
+		printf("FLAC encoder benchmark, %s\n", szFileName ? szFileName :
+			"synthetic material");
+		printf("%u channel(s), %u bits, %u Hz, %.1f sec, %.1f MB of PCM\n",
+			nChannels, nBits, nRate, (double)nFrames / nRate, cbPcm / 1e6);
+
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		for (UINT32 iOrder = 0; iOrder < sizeof(lpcOrders) / sizeof(lpcOrders[0]); iOrder++) {
+			options.nMaxLpcOrder = lpcOrders[iOrder];
+			for (LONG nThreads = 1; nThreads <= nProcessors; nThreads *= 2) {
+				if (nThreads * 2 > nProcessors) {
+					nThreads = nProcessors;
+				}
+				for (LONG i = 0; i < nThreads; i++) {
+					pEncoders[i].Initialize(nChannels, nBits, nRate, options);
+				}
+				if (pOut == NULL) {
+					pOut = new (std::nothrow) BYTE[(SIZE_T)nBlocks *
+						pEncoders[0].MaxFrameSize()];
+					if (pOut == NULL) {
+						printf("Out of memory\n");
+						goto CLEANUP;
+					}
+				}
+
+				FlacBatch batch;
+				LARGE_INTEGER tStart, tEnd;
+				ULONGLONG cbEncoded = 0;
+				UINT32 nPasses = 0;
+				double seconds = 0.0;
+				QueryPerformanceCounter(&tStart);
+				do {
+					batch.pEncoders = pEncoders;
+					batch.nWorkers = nThreads;
+					batch.pSamples = pPlanar;
+					batch.nChannels = nChannels;
+					batch.nBlockSize = nBlockSize;
+					batch.nSamples = nFrames;
+					batch.iFirstFrame = 0;
+					batch.pOut = pOut;
+					batch.pcbFrames = pcbFrames;
+					cbEncoded = EncodeFlacBatch(&batch);
+					nPasses++;
+					QueryPerformanceCounter(&tEnd);
+					seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+				} while (seconds < MIN_SECONDS);
+
+				double mbPerSec = cbPcm * nPasses / (seconds * 1e6);
+				printf("  LPC order %2u, %2d thread(s): %7.1f MB/s, %6.1f MB/s per core, "
+					"%4.0fx real time, ratio %.3f\n",
+					lpcOrders[iOrder], nThreads, mbPerSec, mbPerSec / nThreads,
+					(double)nFrames * nPasses / nRate / seconds,
+					(double)(cbEncoded + FLAC_STREAMINFO_SIZE) / cbPcm);
+				if (nThreads == nProcessors) {
+					break;
+				}
+			}
+
+			// The last run's frames should decode to the input
+			UINT32 nBad = CheckFlacBatch(pOut, pcbFrames, pPlanar, nFrames,
+				nChannels, nBits, nBlockSize);
+			printf("  LPC order %2u: %u frames decoded, %u differ, %s\n",
+				lpcOrders[iOrder], nBlocks, nBad, nBad ? "FAILED" : "ok");
+		}
+	}
+
+CLEANUP:
+	delete [] pInterleaved;
+	delete [] pPlanar;
+	delete [] pEncoders;
+	delete [] pcbFrames;
+	delete [] pOut;
+}
@@ -0,0 +1,152 @@
+//////////////////////////////////////////////////////////////////////////
+// flacEncoder.h: Lossless FLAC encoder and file writer
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Samples per frame.  4096 is the reference encoder's default and is
+// within the streamable subset at any rate.
+const UINT32 FLAC_BLOCK_SIZE = 4096;
+const UINT32 FLAC_MIN_BLOCK_SIZE = 16;
+const UINT32 FLAC_MAX_BLOCK_SIZE = 65535;
+// The format allows orders up to 32; the subset allows 12 up to 48 kHz
+const UINT32 FLAC_MAX_LPC_ORDER = 32;
+const UINT32 FLAC_DEFAULT_LPC_ORDER = 8;
+const UINT32 FLAC_MAX_CHANNELS = 8;
+const UINT32 FLAC_MAX_PARTITION_ORDER = 8;
+// Frames given to each encoder thread per batch
+const UINT32 FLAC_FRAMES_PER_THREAD = 4;
+
+// How to encode a FLAC file
+struct FlacOptions
+{
+    BOOL    bEnabled;           // Write FLAC instead of WAV.
+    UINT32  nBlockSize;         // Samples per frame.
+    UINT32  nMaxLpcOrder;       // 0 uses only the fixed predictors.
+    LONG    nThreads;           // Encoder threads, 0 for one per processor.
+
+    FlacOptions() :
+    bEnabled(FALSE),
+    nBlockSize(FLAC_BLOCK_SIZE),
+    nMaxLpcOrder(FLAC_DEFAULT_LPC_ORDER),
+    nThreads(0)
+    {
+    }
+};
+
+// Packs the bits of a frame, most significant first
+struct FlacBitWriter;
+
+// Encodes single FLAC frames.  Each frame stands alone, so any number
+// of encoders can work on different frames of a stream at once.  Every
+// channel is tried with a constant, the best fixed polynomial and a
+// quantized LPC predictor from a Tukey-windowed autocorrelation, and
+// the smallest is kept, with a verbatim copy as the fallback.  Stereo
+// is decorrelated as left/side, right/side or mid/side when that is
+// estimated to be smaller.  Residuals are Rice coded with the partition
+// order and parameters chosen to minimize the frame.  Nothing here
+// depends on the platform.
+class FlacFrameEncoder
+{
+public:
+    FlacFrameEncoder();
+    ~FlacFrameEncoder();
+
+    HRESULT Initialize(UINT32 nChannels, UINT32 nBitsPerSample,
+                       UINT32 nSampleRate, const FlacOptions &options);
+
+    // Encodes nFrames samples of each channel as frame number iFrame.
+    // Channel c starts at pSamples + c * nStride.  pOut must hold
+    // MaxFrameSize() bytes.  Returns the size of the frame.
+    DWORD   EncodeFrame(const INT32 *pSamples, UINT32 nStride,
+                        UINT32 nFrames, ULONGLONG iFrame, BYTE *pOut);
+
+    DWORD   MaxFrameSize() const { return m_cbMaxFrame; }
+    UINT32  BlockSize() const { return m_nBlockSize; }
+
+private:
+    void    Free();
+    void    EncodeSubframe(FlacBitWriter *pWriter, const INT32 *pSamples,
+                           UINT32 nFrames, UINT32 nBits);
+    BOOL    ComputeLpc(const INT32 *pSamples, UINT32 nFrames, UINT32 nBits,
+                       INT32 *pCoefs, UINT32 *pnOrder, int *pShift);
+
+    UINT32  m_nChannels;
+    UINT32  m_nBitsPerSample;
+    UINT32  m_nSampleRate;
+    UINT32  m_nBlockSize;
+    UINT32  m_nMaxLpcOrder;
+    UINT32  m_nPrecision;       // Bits per quantized LPC coefficient
+    DWORD   m_cbMaxFrame;
+
+    INT32   *m_pMid;            // Mid and side channels
+    INT32   *m_pSide;
+    INT32   *m_pFixedResidual;
+    INT32   *m_pLpcResidual;
+    double  *m_pWindow;         // Tukey window for m_nWindowSize samples
+    UINT32  m_nWindowSize;
+    double  *m_pWindowed;       // The samples to be analyzed, windowed
+};
+
+// Writes a FLAC file from interleaved little-endian integer PCM, 16-bit
+// or packed 24-bit, as the PcmConverter produces it.  Frames are
+// collected into batches and a batch is encoded on several threads
+// (see RunInParallel), then written with one WriteFile in stream order.
+// The STREAMINFO block is rewritten with the length when the file is
+// closed.  The MD5 of the audio is left unset, which decoders accept.
+class FlacFile
+{
+public:
+    FlacFile();
+    ~FlacFile();
+
+    HRESULT Open(const WCHAR *szFileName, UINT32 nSampleRate,
+                 UINT32 nChannels, UINT32 nBitsPerSample,
+                 const FlacOptions &options);
+    // Takes whole frames of PCM
+    HRESULT Write(const void *pData, DWORD cbData);
+    HRESULT Close();
+
+    BOOL        IsOpen() const { return m_hFile != INVALID_HANDLE_VALUE; }
+    LONG        ThreadCount() const { return m_nWorkers; }
+    ULONGLONG   SampleCount() const { return m_nTotalSamples; }
+    ULONGLONG   PcmSize() const { return m_nTotalSamples * m_nChannels * m_cbSample; }
+    ULONGLONG   FileSize() const { return m_cbFile; }
+    DWORD       WriteCount() const { return m_cWrites; }
+
+private:
+    HRESULT EncodeBatch();
+    HRESULT WriteStreamInfo();
+    HRESULT WriteToFile(const void *buf, DWORD count);
+    void    Free();
+
+    HANDLE      m_hFile;
+    FlacOptions m_options;
+    UINT32      m_nSampleRate;
+    UINT32      m_nChannels;
+    UINT32      m_nBitsPerSample;
+    UINT32      m_cbSample;
+
+    FlacFrameEncoder *m_pEncoders;  // One per worker
+    LONG        m_nWorkers;
+    UINT32      m_nBatchFrames;     // Frames per batch
+    INT32       *m_pSamples;        // Planar samples of the batch, frame by frame
+    UINT32      m_nBuffered;        // Samples per channel in the batch
+    BYTE        *m_pOut;            // Encoded frames, MaxFrameSize() apart
+    DWORD       *m_pcbFrames;
+
+    ULONGLONG   m_iFrame;           // Number of the next frame
+    ULONGLONG   m_nTotalSamples;
+    ULONGLONG   m_cbFile;
+    DWORD       m_cbSmallestFrame;
+    DWORD       m_cbLargestFrame;
+    DWORD       m_cWrites;
+};
+
+// Times the encoder on one and on all processors and prints the
+// throughput and compression ratio, then decodes what it wrote and
+// checks it against the input.  Encodes the PCM or float WAV file
+// szFileName, or synthetic material if it is NULL.
+void benchmarkFlacEncoder(const char *szFileName);
@@ -0,0 +1,660 @@
+#include "stdafx.h"
+#include "levelMeter.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+#include <limits.h>
+#include <math.h>
+
+// Vectors processed between flushes of the narrow accumulators.  The
+// 16-bit clip counters and 32-bit sums must not overflow within one
+// chunk.
+const DWORD LEVEL_CHUNK_VECTORS_16 = 4096;
+const DWORD LEVEL_CHUNK_VECTORS_24 = 256;
+
+const int INT24_MAX = 8388607;
+const int INT24_MIN = -8388608;
+
+// Number of bits set in each 4-bit value
+static const BYTE s_bitCount[16] = {
+	0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+static void UpdatePeak(LevelSums *pSums, double peak)
+{
+	if (peak > pSums->peak) {
+		pSums->peak = peak;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+static void LevelInt16Scalar(const BYTE *pData, DWORD nSamples,
+							 LevelSums *pSums)
+{
+	const short *p = (const short *)pData;
+	ULONGLONG sumAbs = 0;
+	ULONGLONG sumSquares = 0;
+	int peak = 0;
+	ULONGLONG nClipped = 0;
+	for (DWORD i = 0; i < nSamples; i++) {
+		int x = p[i];
+		int a = x < 0 ? -x : x;
+		sumAbs += a;
+		sumSquares += (ULONGLONG)(a * a);
+		if (a > peak) peak = a;
+		if (x == SHRT_MAX || x == SHRT_MIN) nClipped++;
+	}
+	pSums->sumAbs += (double)sumAbs;
+	pSums->sumSquares += (double)sumSquares;
+	pSums->nClipped += nClipped;
+	UpdatePeak(pSums, peak);
+}
+
+static void LevelInt24Scalar(const BYTE *pData, DWORD nSamples,
+							 LevelSums *pSums)
+{
+	ULONGLONG sumAbs = 0;
+	double sumSquares = 0.0;
+	int peak = 0;
+	ULONGLONG nClipped = 0;
+	for (DWORD i = 0; i < nSamples; i++, pData += 3) {
+		// Sign-extend from the top byte
+		int x = (int)(((DWORD)pData[0] << 8) | ((DWORD)pData[1] << 16) |
+			((DWORD)pData[2] << 24)) >> 8;
+		int a = x < 0 ? -x : x;
+		sumAbs += a;
+		sumSquares += (double)a * a;
+		if (a > peak) peak = a;
+		if (x == INT24_MAX || x == INT24_MIN) nClipped++;
+	}
+	pSums->sumAbs += (double)sumAbs;
+	pSums->sumSquares += sumSquares;
+	pSums->nClipped += nClipped;
+	UpdatePeak(pSums, peak);
+}
+
+static void LevelFloat32Scalar(const BYTE *pData, DWORD nSamples,
+							   LevelSums *pSums)
+{
+	const float *p = (const float *)pData;
+	double sumAbs = 0.0;
+	double sumSquares = 0.0;
+	float peak = 0.0f;
+	ULONGLONG nClipped = 0;
+	for (DWORD i = 0; i < nSamples; i++) {
+		float a = fabsf(p[i]);
+		sumAbs += a;
+		sumSquares += (double)a * a;
+		if (a > peak) peak = a;
+		if (a >= 1.0f) nClipped++;
+	}
+	pSums->sumAbs += sumAbs;
+	pSums->sumSquares += sumSquares;
+	pSums->nClipped += nClipped;
+	UpdatePeak(pSums, peak);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// SSE2 kernels
+
+static void LevelInt16Sse2(const BYTE *pData, DWORD nSamples,
+						   LevelSums *pSums)
+{
+	const short *p = (const short *)pData;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i vPos = _mm_set1_epi16(SHRT_MAX);
+	const __m128i vNeg = _mm_set1_epi16(SHRT_MIN);
+	__m128i vMax = vNeg;
+	__m128i vMin = vPos;
+
+	while (nSamples >= 8) {
+		DWORD nVectors = min(nSamples / 8, LEVEL_CHUNK_VECTORS_16);
+		__m128i vAbs = zero;        // 4 x 32-bit
+		__m128i vSq = zero;         // 2 x 64-bit
+		__m128i vClip = zero;       // 8 x 16-bit
+		for (DWORD i = 0; i < nVectors; i++, p += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)p);
+			// |x| as unsigned 16-bit, so -32768 becomes 32768
+			__m128i sign = _mm_srai_epi16(x, 15);
+			__m128i a = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+			vAbs = _mm_add_epi32(vAbs, _mm_unpacklo_epi16(a, zero));
+			vAbs = _mm_add_epi32(vAbs, _mm_unpackhi_epi16(a, zero));
+			// Pairs of squares fit in 32 bits unsigned
+			__m128i sq = _mm_madd_epi16(x, x);
+			vSq = _mm_add_epi64(vSq, _mm_unpacklo_epi32(sq, zero));
+			vSq = _mm_add_epi64(vSq, _mm_unpackhi_epi32(sq, zero));
+			vMax = _mm_max_epi16(vMax, x);
+			vMin = _mm_min_epi16(vMin, x);
+			__m128i clip = _mm_or_si128(_mm_cmpeq_epi16(x, vPos),
+				_mm_cmpeq_epi16(x, vNeg));
+			vClip = _mm_sub_epi16(vClip, clip);
+		}
+		nSamples -= nVectors * 8;
+
+		DWORD abs[4];
+		ULONGLONG sq[2];
+		WORD clip[8];
+		_mm_storeu_si128((__m128i *)abs, vAbs);
+		_mm_storeu_si128((__m128i *)sq, vSq);
+		_mm_storeu_si128((__m128i *)clip, vClip);
+		pSums->sumAbs += (double)((ULONGLONG)abs[0] + abs[1] + abs[2] + abs[3]);
+		pSums->sumSquares += (double)(sq[0] + sq[1]);
+		for (int i = 0; i < 8; i++) {
+			pSums->nClipped += clip[i];
+		}
+	}
+
+	short hi[8], lo[8];
+	_mm_storeu_si128((__m128i *)hi, vMax);
+	_mm_storeu_si128((__m128i *)lo, vMin);
+	int peak = 0;
+	for (int i = 0; i < 8; i++) {
+		peak = max(peak, max((int)hi[i], -(int)lo[i]));
+	}
+	UpdatePeak(pSums, peak);
+
+	LevelInt16Scalar((const BYTE *)p, nSamples, pSums);
+}
+
+static void LevelInt24Sse2(const BYTE *pData, DWORD nSamples,
+						   LevelSums *pSums)
+{
+	// SSE2 has no byte shuffle, so the 4 samples in each 12 bytes are
+	// lined up with whole-register byte shifts instead, then moved to
+	// the top 3 bytes of each 32-bit element and shifted down to
+	// sign-extend them.  Nor has it 32-bit abs or max, so those are
+	// done with compares and masks.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i vPos = _mm_set1_epi32(INT24_MAX);
+	const __m128i vNeg = _mm_set1_epi32(INT24_MIN);
+	__m128i vPeak = zero;
+
+	// Each load reads 16 bytes but uses 12, so stop while at least
+	// 4 bytes past the last vector remain readable.
+	while (nSamples >= 6) {
+		DWORD nVectors = min((nSamples - 2) / 4, LEVEL_CHUNK_VECTORS_24);
+		__m128i vAbs = zero;        // 4 x 32-bit
+		__m128i vSq = zero;         // 2 x 64-bit
+		__m128i vClip = zero;       // 4 x 32-bit
+		for (DWORD i = 0; i < nVectors; i++, pData += 12) {
+			__m128i v = _mm_loadu_si128((const __m128i *)pData);
+			__m128i x01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+			__m128i x23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6),
+				_mm_srli_si128(v, 9));
+			__m128i x = _mm_unpacklo_epi64(x01, x23);
+			x = _mm_srai_epi32(_mm_slli_epi32(x, 8), 8);
+			__m128i sign = _mm_srai_epi32(x, 31);
+			__m128i a = _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+			vAbs = _mm_add_epi32(vAbs, a);
+			vSq = _mm_add_epi64(vSq, _mm_mul_epu32(a, a));
+			__m128i odd = _mm_srli_epi64(a, 32);
+			vSq = _mm_add_epi64(vSq, _mm_mul_epu32(odd, odd));
+			__m128i greater = _mm_cmpgt_epi32(a, vPeak);
+			vPeak = _mm_or_si128(_mm_and_si128(greater, a),
+				_mm_andnot_si128(greater, vPeak));
+			__m128i clip = _mm_or_si128(_mm_cmpeq_epi32(x, vPos),
+				_mm_cmpeq_epi32(x, vNeg));
+			vClip = _mm_sub_epi32(vClip, clip);
+		}
+		nSamples -= nVectors * 4;
+
+		DWORD abs[4], clip[4];
+		ULONGLONG sq[2];
+		_mm_storeu_si128((__m128i *)abs, vAbs);
+		_mm_storeu_si128((__m128i *)sq, vSq);
+		_mm_storeu_si128((__m128i *)clip, vClip);
+		pSums->sumAbs += (double)((ULONGLONG)abs[0] + abs[1] + abs[2] + abs[3]);
+		pSums->sumSquares += (double)sq[0] + (double)sq[1];
+		for (int i = 0; i < 4; i++) {
+			pSums->nClipped += clip[i];
+		}
+	}
+
+	int peak[4];
+	_mm_storeu_si128((__m128i *)peak, vPeak);
+	for (int i = 0; i < 4; i++) {
+		UpdatePeak(pSums, peak[i]);
+	}
+
+	LevelInt24Scalar(pData, nSamples, pSums);
+}
+
+static void LevelFloat32Sse2(const BYTE *pData, DWORD nSamples,
+							 LevelSums *pSums)
+{
+	const float *p = (const float *)pData;
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128d vAbs = _mm_setzero_pd();
+	__m128d vSq = _mm_setzero_pd();
+	__m128 vPeak = _mm_setzero_ps();
+	ULONGLONG nClipped = 0;
+
+	for (; nSamples >= 4; nSamples -= 4, p += 4) {
+		__m128 a = _mm_and_ps(_mm_loadu_ps(p), absMask);
+		// Sum in double precision so long recordings do not lose
+		// the small samples
+		__m128d lo = _mm_cvtps_pd(a);
+		__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(a, a));
+		vAbs = _mm_add_pd(vAbs, _mm_add_pd(lo, hi));
+		vSq = _mm_add_pd(vSq, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+		vPeak = _mm_max_ps(vPeak, a);
+		nClipped += s_bitCount[_mm_movemask_ps(_mm_cmpge_ps(a, one))];
+	}
+
+	double abs[2], sq[2];
+	float peak[4];
+	_mm_storeu_pd(abs, vAbs);
+	_mm_storeu_pd(sq, vSq);
+	_mm_storeu_ps(peak, vPeak);
+	pSums->sumAbs += abs[0] + abs[1];
+	pSums->sumSquares += sq[0] + sq[1];
+	pSums->nClipped += nClipped;
+	UpdatePeak(pSums, max(max(peak[0], peak[1]), max(peak[2], peak[3])));
+
+	LevelFloat32Scalar((const BYTE *)p, nSamples, pSums);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// AVX2 kernels
+
+static void LevelInt16Avx2(const BYTE *pData, DWORD nSamples,
+						   LevelSums *pSums)
+{
+	const short *p = (const short *)pData;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i vPos = _mm256_set1_epi16(SHRT_MAX);
+	const __m256i vNeg = _mm256_set1_epi16(SHRT_MIN);
+	__m256i vMax = vNeg;
+	__m256i vMin = vPos;
+
+	while (nSamples >= 16) {
+		DWORD nVectors = min(nSamples / 16, LEVEL_CHUNK_VECTORS_16);
+		__m256i vAbs = zero;
+		__m256i vSq = zero;
+		__m256i vClip = zero;
+		for (DWORD i = 0; i < nVectors; i++, p += 16) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)p);
+			__m256i sign = _mm256_srai_epi16(x, 15);
+			__m256i a = _mm256_sub_epi16(_mm256_xor_si256(x, sign), sign);
+			vAbs = _mm256_add_epi32(vAbs, _mm256_unpacklo_epi16(a, zero));
+			vAbs = _mm256_add_epi32(vAbs, _mm256_unpackhi_epi16(a, zero));
+			__m256i sq = _mm256_madd_epi16(x, x);
+			vSq = _mm256_add_epi64(vSq, _mm256_unpacklo_epi32(sq, zero));
+			vSq = _mm256_add_epi64(vSq, _mm256_unpackhi_epi32(sq, zero));
+			vMax = _mm256_max_epi16(vMax, x);
+			vMin = _mm256_min_epi16(vMin, x);
+			__m256i clip = _mm256_or_si256(_mm256_cmpeq_epi16(x, vPos),
+				_mm256_cmpeq_epi16(x, vNeg));
+			vClip = _mm256_sub_epi16(vClip, clip);
+		}
+		nSamples -= nVectors * 16;
+
+		DWORD abs[8];
+		ULONGLONG sq[4];
+		WORD clip[16];
+		_mm256_storeu_si256((__m256i *)abs, vAbs);
+		_mm256_storeu_si256((__m256i *)sq, vSq);
+		_mm256_storeu_si256((__m256i *)clip, vClip);
+		ULONGLONG sumAbs = 0;
+		for (int i = 0; i < 8; i++) {
+			sumAbs += abs[i];
+		}
+		pSums->sumAbs += (double)sumAbs;
+		pSums->sumSquares += (double)(sq[0] + sq[1] + sq[2] + sq[3]);
+		for (int i = 0; i < 16; i++) {
+			pSums->nClipped += clip[i];
+		}
+	}
+
+	short hi[16], lo[16];
+	_mm256_storeu_si256((__m256i *)hi, vMax);
+	_mm256_storeu_si256((__m256i *)lo, vMin);
+	int peak = 0;
+	for (int i = 0; i < 16; i++) {
+		peak = max(peak, max((int)hi[i], -(int)lo[i]));
+	}
+	UpdatePeak(pSums, peak);
+
+	_mm256_zeroupper();
+	LevelInt16Scalar((const BYTE *)p, nSamples, pSums);
+}
+
+static void LevelInt24Avx2(const BYTE *pData, DWORD nSamples,
+						   LevelSums *pSums)
+{
+	// Each 128-bit lane gets 12 bytes (4 samples), and each sample is
+	// moved to the top 3 bytes of a 32-bit element, then shifted down
+	// to sign-extend it.
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i shuf = _mm256_setr_epi8(
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i vPos = _mm256_set1_epi32(INT24_MAX);
+	const __m256i vNeg = _mm256_set1_epi32(INT24_MIN);
+	__m256i vPeak = zero;
+
+	// Each load reads 32 bytes but uses 24, so stop while at least
+	// 8 bytes past the last vector remain readable.
+	while (nSamples >= 11) {
+		DWORD nVectors = min((nSamples - 3) / 8, LEVEL_CHUNK_VECTORS_24);
+		__m256i vAbs = zero;        // 8 x 32-bit
+		__m256i vSq = zero;         // 4 x 64-bit
+		__m256i vClip = zero;       // 8 x 32-bit
+		for (DWORD i = 0; i < nVectors; i++, pData += 24) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)pData);
+			x = _mm256_permutevar8x32_epi32(x, perm);
+			x = _mm256_srai_epi32(_mm256_shuffle_epi8(x, shuf), 8);
+			__m256i a = _mm256_abs_epi32(x);
+			vAbs = _mm256_add_epi32(vAbs, a);
+			vSq = _mm256_add_epi64(vSq, _mm256_mul_epu32(a, a));
+			__m256i odd = _mm256_srli_epi64(a, 32);
+			vSq = _mm256_add_epi64(vSq, _mm256_mul_epu32(odd, odd));
+			vPeak = _mm256_max_epi32(vPeak, a);
+			__m256i clip = _mm256_or_si256(_mm256_cmpeq_epi32(x, vPos),
+				_mm256_cmpeq_epi32(x, vNeg));
+			vClip = _mm256_sub_epi32(vClip, clip);
+		}
+		nSamples -= nVectors * 8;
+
+		DWORD abs[8], clip[8];
+		ULONGLONG sq[4];
+		_mm256_storeu_si256((__m256i *)abs, vAbs);
+		_mm256_storeu_si256((__m256i *)sq, vSq);
+		_mm256_storeu_si256((__m256i *)clip, vClip);
+		ULONGLONG sumAbs = 0;
+		for (int i = 0; i < 8; i++) {
+			sumAbs += abs[i];
+			pSums->nClipped += clip[i];
+		}
+		pSums->sumAbs += (double)sumAbs;
+		pSums->sumSquares += (double)sq[0] + (double)sq[1] +
+			(double)sq[2] + (double)sq[3];
+	}
+
+	int peak[8];
+	_mm256_storeu_si256((__m256i *)peak, vPeak);
+	for (int i = 0; i < 8; i++) {
+		UpdatePeak(pSums, peak[i]);
+	}
+
+	_mm256_zeroupper();
+	LevelInt24Scalar(pData, nSamples, pSums);
+}
+
+static void LevelFloat32Avx2(const BYTE *pData, DWORD nSamples,
+							 LevelSums *pSums)
+{
+	const float *p = (const float *)pData;
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256d vAbs = _mm256_setzero_pd();
+	__m256d vSq = _mm256_setzero_pd();
+	__m256 vPeak = _mm256_setzero_ps();
+	ULONGLONG nClipped = 0;
+
+	for (; nSamples >= 8; nSamples -= 8, p += 8) {
+		__m256 a = _mm256_and_ps(_mm256_loadu_ps(p), absMask);
+		__m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(a));
+		__m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1));
+		vAbs = _mm256_add_pd(vAbs, _mm256_add_pd(lo, hi));
+		vSq = _mm256_add_pd(vSq, _mm256_add_pd(_mm256_mul_pd(lo, lo),
+			_mm256_mul_pd(hi, hi)));
+		vPeak = _mm256_max_ps(vPeak, a);
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(a, one, _CMP_GE_OQ));
+		nClipped += s_bitCount[mask & 15] + s_bitCount[mask >> 4];
+	}
+
+	double abs[4], sq[4];
+	float peak[8];
+	_mm256_storeu_pd(abs, vAbs);
+	_mm256_storeu_pd(sq, vSq);
+	_mm256_storeu_ps(peak, vPeak);
+	pSums->sumAbs += abs[0] + abs[1] + abs[2] + abs[3];
+	pSums->sumSquares += sq[0] + sq[1] + sq[2] + sq[3];
+	pSums->nClipped += nClipped;
+	for (int i = 0; i < 8; i++) {
+		UpdatePeak(pSums, peak[i]);
+	}
+
+	_mm256_zeroupper();
+	LevelFloat32Scalar((const BYTE *)p, nSamples, pSums);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+// Kernels by format and instruction set
+static const LevelKernelProc s_kernels[3][LEVEL_KERNEL_COUNT] = {
+	{ LevelInt16Scalar, LevelInt16Sse2, LevelInt16Avx2 },
+	{ LevelInt24Scalar, LevelInt24Sse2, LevelInt24Avx2 },
+	{ LevelFloat32Scalar, LevelFloat32Sse2, LevelFloat32Avx2 },
+};
+
+static const DWORD s_sampleSizes[3] = { 2, 3, 4 };
+static const double s_fullScale[3] = { 32768.0, 8388608.0, 1.0 };
+
+BOOL LevelMeter::IsKernelSupported(LevelKernel kernel)
+{
+	int info[4];
+	switch (kernel) {
+	case LEVEL_KERNEL_SCALAR:
+		return TRUE;
+	case LEVEL_KERNEL_SSE2:
+		__cpuid(info, 1);
+		return (info[3] & (1 << 26)) != 0;
+	case LEVEL_KERNEL_AVX2:
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return FALSE;
+		}
+		// The OS must save the YMM registers (OSXSAVE and XCR0)
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) {
+			return FALSE;
+		}
+		if ((_xgetbv(0) & 6) != 6) {
+			return FALSE;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	default:
+		return FALSE;
+	}
+}
+
+LevelKernel LevelMeter::BestKernel()
+{
+	static LevelKernel best = LEVEL_KERNEL_COUNT;
+	if (best == LEVEL_KERNEL_COUNT) {
+		LevelKernel kernel = LEVEL_KERNEL_SCALAR;
+		if (IsKernelSupported(LEVEL_KERNEL_AVX2)) {
+			kernel = LEVEL_KERNEL_AVX2;
+		} else if (IsKernelSupported(LEVEL_KERNEL_SSE2)) {
+			kernel = LEVEL_KERNEL_SSE2;
+		}
+		best = kernel;
+	}
+	return best;
+}
+
+const char *LevelMeter::KernelName(LevelKernel kernel)
+{
+	switch (kernel) {
+	case LEVEL_KERNEL_SCALAR: return "scalar";
+	case LEVEL_KERNEL_SSE2: return "SSE2";
+	case LEVEL_KERNEL_AVX2: return "AVX2";
+	default: return "unknown";
+	}
+}
+
+LevelMeter::LevelMeter() :
+m_format(LEVEL_FORMAT_INT16),
+m_kernel(LEVEL_KERNEL_SCALAR),
+m_pfnKernel(NULL),
+m_cbSample(2)
+{
+	SetFormat(LEVEL_FORMAT_INT16);
+}
+
+// Sets the sample format, picks the fastest kernel, and clears the
+// totals.
+void LevelMeter::SetFormat(LevelFormat format)
+{
+	m_format = format;
+	m_cbSample = s_sampleSizes[format];
+	SetKernel(BestKernel());
+	Reset();
+}
+
+// Forces a particular kernel.  Returns FALSE if the processor does not
+// support it.
+BOOL LevelMeter::SetKernel(LevelKernel kernel)
+{
+	if (!IsKernelSupported(kernel)) {
+		return FALSE;
+	}
+	m_kernel = kernel;
+	m_pfnKernel = s_kernels[m_format][kernel];
+	return TRUE;
+}
+
+void LevelMeter::Reset()
+{
+	ZeroMemory(&m_sums, sizeof(m_sums));
+}
+
+void LevelMeter::Process(const void *pData, DWORD cbData)
+{
+	DWORD nSamples = cbData / m_cbSample;
+	if (nSamples == 0) {
+		return;
+	}
+	m_pfnKernel((const BYTE *)pData, nSamples, &m_sums);
+	m_sums.nSamples += nSamples;
+}
+
+double LevelMeter::FullScale() const
+{
+	return s_fullScale[m_format];
+}
+
+double LevelMeter::MeanAbs() const
+{
+	if (m_sums.nSamples == 0) {
+		return 0.0;
+	}
+	return m_sums.sumAbs / m_sums.nSamples / FullScale();
+}
+
+double LevelMeter::Rms() const
+{
+	if (m_sums.nSamples == 0) {
+		return 0.0;
+	}
+	return sqrt(m_sums.sumSquares / m_sums.nSamples) / FullScale();
+}
+
+double LevelMeter::Peak() const
+{
+	return m_sums.peak / FullScale();
+}
+
+// Converts a fraction of full scale to dBFS
+double levelToDb(double level) {
+	if (level <= 0.0) {
+		return -HUGE_VAL;
+	}
+	return 20.0 * log10(level);
+}
+
+// Prints the levels on one line, so lines from recordings running in
+// parallel do not get mixed up.
+void printLevels(const char *szLabel, const LevelMeter &meter) {
+	printf("  %s: mean %.1f dBFS, RMS %.1f dBFS, peak %.1f dBFS, "
+		"%I64u of %I64u samples clipped\n", szLabel,
+		levelToDb(meter.MeanAbs()), levelToDb(meter.Rms()),
+		levelToDb(meter.Peak()), meter.ClipCount(), meter.SampleCount());
+}
+
+// Times each kernel on a block of noise and prints the throughput.
+// Also checks that the vector kernels agree with the scalar ones.
+void benchmarkLevelMeter(void) {
+	const DWORD N_SAMPLES = 1024 * 1024;
+	const double MIN_SECONDS = 0.25;
+	static const char *formatNames[] = { "int16", "int24", "float32" };
+
+	// Enough for the largest sample size, plus slack for the tail
+	BYTE *pData = new (std::nothrow) BYTE[N_SAMPLES * 4 + 32];
+	if (pData == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Level meter benchmark, %u samples per block\n", N_SAMPLES);
+	for (int iFormat = 0; iFormat < 3; iFormat++) {
+		LevelFormat format = (LevelFormat)iFormat;
+
+		// Noise, with some samples at full scale
+		srand(1);
+		for (DWORD i = 0; i < N_SAMPLES; i++) {
+			int x = (rand() << 15 | rand()) & 0xFFFFFF;
+			if (i % 1000 == 0) x = 0x7FFFFF;
+			if (format == LEVEL_FORMAT_INT16) {
+				((short *)pData)[i] = (short)(x >> 8);
+			} else if (format == LEVEL_FORMAT_INT24) {
+				pData[i * 3] = (BYTE)x;
+				pData[i * 3 + 1] = (BYTE)(x >> 8);
+				pData[i * 3 + 2] = (BYTE)(x >> 16);
+			} else {
+				((float *)pData)[i] = ((x << 8) >> 8) / 8388607.0f;
+			}
+		}
+		DWORD cbData = N_SAMPLES * s_sampleSizes[iFormat];
+
+		LevelMeter reference;
+		reference.SetFormat(format);
+		reference.SetKernel(LEVEL_KERNEL_SCALAR);
+		reference.Process(pData, cbData);
+
+		for (int iKernel = 0; iKernel < LEVEL_KERNEL_COUNT; iKernel++) {
+			LevelMeter meter;
+			meter.SetFormat(format);
+			if (!meter.SetKernel((LevelKernel)iKernel)) {
+				printf("  %-8s %-7s not supported\n", formatNames[iFormat],
+					LevelMeter::KernelName((LevelKernel)iKernel));
+				continue;
+			}
+
+			// Repeat until enough time has passed to be measurable
+			LARGE_INTEGER tStart, tEnd;
+			ULONGLONG nBlocks = 0;
+			double seconds = 0.0;
+			QueryPerformanceCounter(&tStart);
+			do {
+				meter.Process(pData, cbData);
+				nBlocks++;
+				QueryPerformanceCounter(&tEnd);
+				seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+			} while (seconds < MIN_SECONDS);
+
+			double samplesPerNs = nBlocks * N_SAMPLES / (seconds * 1e9);
+			BOOL bMatch =
+				fabs(meter.MeanAbs() - reference.MeanAbs()) < 1e-9 &&
+				fabs(meter.Rms() - reference.Rms()) < 1e-9 &&
+				meter.Peak() == reference.Peak() &&
+				meter.ClipCount() == nBlocks * reference.ClipCount();
+			printf("  %-8s %-7s %6.2f samples/ns%s\n", formatNames[iFormat],
+				LevelMeter::KernelName((LevelKernel)iKernel), samplesPerNs,
+				bMatch ? "" : "  MISMATCH");
+		}
+	}
+
+	delete [] pData;
+}
@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////////
+// levelMeter.h: Audio level metering
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Sample formats the meter understands
+enum LevelFormat
+{
+    LEVEL_FORMAT_INT16,         // 16-bit signed PCM
+    LEVEL_FORMAT_INT24,         // Packed 24-bit signed PCM
+    LEVEL_FORMAT_FLOAT32        // 32-bit float, full scale is 1.0
+};
+
+// Implementations of the metering loops, slowest first
+enum LevelKernel
+{
+    LEVEL_KERNEL_SCALAR,
+    LEVEL_KERNEL_SSE2,
+    LEVEL_KERNEL_AVX2,
+    LEVEL_KERNEL_COUNT
+};
+
+// Running totals, in the units of the sample format
+struct LevelSums
+{
+    ULONGLONG   nSamples;
+    double      sumAbs;
+    double      sumSquares;
+    double      peak;           // Largest absolute sample
+    ULONGLONG   nClipped;       // Samples at either limit of the format
+};
+
+typedef void (*LevelKernelProc)(const BYTE *pData, DWORD nSamples,
+                                LevelSums *pSums);
+
+// Computes mean absolute level, RMS, peak and clip count over all the
+// data passed to Process.  The work is done as each block arrives, so
+// nothing has to be kept for the end of a recording.  The fastest
+// kernel the processor supports is chosen when the format is set.
+// Levels are returned as a fraction of full scale.
+class LevelMeter
+{
+public:
+    LevelMeter();
+
+    void    SetFormat(LevelFormat format);
+    BOOL    SetKernel(LevelKernel kernel);
+    void    Reset();
+
+    // Meters the whole samples in the block.  Any trailing partial
+    // sample is ignored.
+    void    Process(const void *pData, DWORD cbData);
+
+    LevelFormat Format() const { return m_format; }
+    LevelKernel Kernel() const { return m_kernel; }
+    ULONGLONG   SampleCount() const { return m_sums.nSamples; }
+    ULONGLONG   ClipCount() const { return m_sums.nClipped; }
+    double      MeanAbs() const;
+    double      Rms() const;
+    double      Peak() const;
+    double      FullScale() const;
+
+    static BOOL         IsKernelSupported(LevelKernel kernel);
+    static LevelKernel  BestKernel();
+    static const char   *KernelName(LevelKernel kernel);
+
+private:
+    LevelFormat     m_format;
+    LevelKernel     m_kernel;
+    LevelKernelProc m_pfnKernel;
+    DWORD           m_cbSample;
+    LevelSums       m_sums;
+};
+
+double levelToDb(double level);
+void printLevels(const char *szLabel, const LevelMeter &meter);
+void benchmarkLevelMeter(void);
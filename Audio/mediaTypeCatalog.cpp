@@ -0,0 +1,1136 @@
+//////////////////////////////////////////////////////////////////////////
+// mediaTypeCatalog.cpp: Native media types of each device, kept on disk
+//
+// Asking a device for its native types goes to the driver for each
+// stream and type, so the answers are kept, one record per device, and
+// written to a file for the next run.  A record is held in memory just
+// as it is on disk: a header, the link, then each stream followed by
+// its types, each type followed by its attributes as a blob.
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "mediaTypeCatalog.h"
+
+const DWORD CATALOG_MAGIC = 0x5443544D;     // "MTCT"
+const DWORD CATALOG_VERSION = 1;
+// Largest record and file accepted, against damaged files
+const DWORD CATALOG_MAX_RECORD = 1024 * 1024;
+const DWORD CATALOG_MAX_FILE = 16 * 1024 * 1024;
+
+struct CatalogFileHeader
+{
+	DWORD magic;
+	DWORD version;
+	DWORD nRecords;
+	DWORD cbRecords;            // The records follow back to back
+};
+
+// One device, followed by its link and then its streams
+struct CatalogRecord
+{
+	DWORD cbRecord;
+	DWORD cchLink;              // With the terminator, rounded up to even
+	DWORD nStreams;
+};
+
+// One stream, followed by its types
+struct CatalogStream
+{
+	GUID  majorType;            // Of the first type
+	GUID  negotiatedSubtype;    // GUID_NULL until one is set
+	DWORD nTypes;
+	DWORD cbTypes;
+};
+
+// One native type, followed by its attributes padded to 4 bytes
+struct CatalogType
+{
+	GUID  subtype;
+	DWORD cbBlob;
+};
+
+static CatalogRecord **s_records = NULL;
+static DWORD s_nRecords = 0;
+static DWORD s_nAllocated = 0;
+static BOOL s_bChanged = FALSE;
+static INIT_ONCE s_catalogOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION s_catalogLock;
+
+static BOOL CALLBACK initCatalog(PINIT_ONCE pInitOnce, void *pParameter,
+								 void **ppContext) {
+	InitializeCriticalSection(&s_catalogLock);
+	return TRUE;
+}
+
+static void lockCatalog() {
+	InitOnceExecuteOnce(&s_catalogOnce, initCatalog, NULL, NULL);
+	EnterCriticalSection(&s_catalogLock);
+}
+
+static DWORD padToDword(DWORD cb) {
+	return (cb + 3) & ~3;
+}
+
+static const WCHAR *recordLink(const CatalogRecord *pRecord) {
+	return (const WCHAR *)(pRecord + 1);
+}
+
+static CatalogStream *firstStream(CatalogRecord *pRecord) {
+	return (CatalogStream *)((BYTE *)(pRecord + 1) +
+		pRecord->cchLink * sizeof(WCHAR));
+}
+
+static CatalogStream *nextStream(CatalogStream *pStream) {
+	return (CatalogStream *)((BYTE *)(pStream + 1) + pStream->cbTypes);
+}
+
+static CatalogType *nextType(CatalogType *pType) {
+	return (CatalogType *)((BYTE *)(pType + 1) + padToDword(pType->cbBlob));
+}
+
+// Checks that a record read from disk holds together.  cbAvailable is
+// what is left of the file.
+static BOOL checkRecord(const BYTE *pData, DWORD cbAvailable) {
+	if (cbAvailable < sizeof(CatalogRecord)) {
+		return FALSE;
+	}
+	CatalogRecord *pRecord = (CatalogRecord *)pData;
+	DWORD cbRecord = pRecord->cbRecord;
+	if (cbRecord < sizeof(CatalogRecord) || cbRecord > cbAvailable ||
+		cbRecord > CATALOG_MAX_RECORD ||
+		cbRecord % 4 != 0 || pRecord->cchLink == 0 ||
+		pRecord->cchLink % 2 != 0 ||
+		pRecord->cchLink > (cbRecord - sizeof(CatalogRecord)) / sizeof(WCHAR) ||
+		recordLink(pRecord)[pRecord->cchLink - 1] != L'\0') {
+		return FALSE;
+	}
+	const BYTE *pEnd = pData + cbRecord;
+	CatalogStream *pStream = firstStream(pRecord);
+	for (DWORD i = 0; i < pRecord->nStreams; i++) {
+		if ((DWORD)(pEnd - (BYTE *)pStream) < sizeof(CatalogStream) ||
+			pStream->cbTypes > (DWORD)(pEnd - (BYTE *)(pStream + 1))) {
+			return FALSE;
+		}
+		const BYTE *pTypesEnd = (BYTE *)(pStream + 1) + pStream->cbTypes;
+		CatalogType *pType = (CatalogType *)(pStream + 1);
+		for (DWORD j = 0; j < pStream->nTypes; j++) {
+			if ((DWORD)(pTypesEnd - (BYTE *)pType) < sizeof(CatalogType) ||
+				pType->cbBlob > CATALOG_MAX_RECORD ||
+				padToDword(pType->cbBlob) >
+				(DWORD)(pTypesEnd - (BYTE *)(pType + 1))) {
+				return FALSE;
+			}
+			pType = nextType(pType);
+		}
+		if ((BYTE *)pType != pTypesEnd) {
+			return FALSE;
+		}
+		pStream = nextStream(pStream);
+	}
+	return (BYTE *)pStream == pEnd;
+}
+
+// Returns the index of the device's record, or -1.  Call locked.
+static int findRecord(const WCHAR *szLink) {
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		if (_wcsicmp(recordLink(s_records[i]), szLink) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Returns a stream of the device, resolving the first audio or video
+// stream, or NULL.  Call locked.
+static CatalogStream *findStream(CatalogRecord *pRecord, DWORD dwStream) {
+	CatalogStream *pStream = firstStream(pRecord);
+	for (DWORD i = 0; i < pRecord->nStreams; i++) {
+		if (dwStream == (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM) {
+			if (pStream->majorType == MFMediaType_Audio) {
+				return pStream;
+			}
+		} else if (dwStream == (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM) {
+			if (pStream->majorType == MFMediaType_Video) {
+				return pStream;
+			}
+		} else if (i == dwStream) {
+			return pStream;
+		}
+		pStream = nextStream(pStream);
+	}
+	return NULL;
+}
+
+// Finds a type, failing as GetNativeMediaType would.  Call locked.
+static HRESULT findType(const WCHAR *szLink, DWORD dwStream, DWORD dwIndex,
+						CatalogStream **ppStream, CatalogType **ppType) {
+	if (szLink == NULL) {
+		return E_POINTER;
+	}
+	int iRecord = findRecord(szLink);
+	if (iRecord < 0) {
+		return MF_E_NOT_FOUND;
+	}
+	CatalogStream *pStream = findStream(s_records[iRecord], dwStream);
+	if (pStream == NULL) {
+		return MF_E_INVALIDSTREAMNUMBER;
+	}
+	*ppStream = pStream;
+	if (ppType == NULL) {
+		return S_OK;
+	}
+	if (dwIndex >= pStream->nTypes) {
+		return MF_E_NO_MORE_TYPES;
+	}
+	CatalogType *pType = (CatalogType *)(pStream + 1);
+	for (DWORD i = 0; i < dwIndex; i++) {
+		pType = nextType(pType);
+	}
+	*ppType = pType;
+	return S_OK;
+}
+
+// Adds the record, replacing any for the same device.  Call locked.
+static HRESULT addRecord(CatalogRecord *pRecord) {
+	int iRecord = findRecord(recordLink(pRecord));
+	if (iRecord >= 0) {
+		delete [] (BYTE *)s_records[iRecord];
+		s_records[iRecord] = pRecord;
+		s_bChanged = TRUE;
+		return S_OK;
+	}
+	if (s_nRecords == s_nAllocated) {
+		DWORD nAllocated = max(2 * s_nAllocated, 8);
+		CatalogRecord **ppRecords =
+			new (std::nothrow) CatalogRecord *[nAllocated];
+		if (ppRecords == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		if (s_nRecords > 0) {
+			CopyMemory(ppRecords, s_records, s_nRecords * sizeof(CatalogRecord *));
+		}
+		delete [] s_records;
+		s_records = ppRecords;
+		s_nAllocated = nAllocated;
+	}
+	s_records[s_nRecords++] = pRecord;
+	s_bChanged = TRUE;
+	return S_OK;
+}
+
+// Drops a record, moving the last into its place.  Call locked.
+static void removeRecord(DWORD iRecord) {
+	delete [] (BYTE *)s_records[iRecord];
+	s_records[iRecord] = s_records[--s_nRecords];
+	s_bChanged = TRUE;
+}
+
+// A record as it is built, growing as types are added
+struct RecordBuilder
+{
+	BYTE  *pData;
+	DWORD cbData;
+	DWORD cbAllocated;
+};
+
+// Adds cb zeroed bytes and returns their offset, or -1 if out of memory
+// or past the largest record
+static LONG appendRecord(RecordBuilder *pBuilder, DWORD cb) {
+	if (cb > CATALOG_MAX_RECORD - pBuilder->cbData) {
+		return -1;
+	}
+	if (pBuilder->cbData + cb > pBuilder->cbAllocated) {
+		DWORD cbAllocated = max(2 * pBuilder->cbAllocated, 4096);
+		while (cbAllocated < pBuilder->cbData + cb) {
+			cbAllocated *= 2;
+		}
+		BYTE *pData = new (std::nothrow) BYTE[cbAllocated];
+		if (pData == NULL) {
+			return -1;
+		}
+		if (pBuilder->cbData > 0) {
+			CopyMemory(pData, pBuilder->pData, pBuilder->cbData);
+		}
+		delete [] pBuilder->pData;
+		pBuilder->pData = pData;
+		pBuilder->cbAllocated = cbAllocated;
+	}
+	LONG offset = (LONG)pBuilder->cbData;
+	ZeroMemory(pBuilder->pData + offset, cb);
+	pBuilder->cbData += cb;
+	return offset;
+}
+
+// Adds one native type to the stream at streamOffset
+static HRESULT appendType(RecordBuilder *pBuilder, LONG streamOffset,
+						  IMFMediaType *pType) {
+	UINT32 cbBlob = 0;
+	HRESULT hr = MFGetAttributesAsBlobSize(pType, &cbBlob);
+	LONG typeOffset = -1;
+	if (SUCCEEDED(hr)) {
+		typeOffset = appendRecord(pBuilder,
+			sizeof(CatalogType) + padToDword(cbBlob));
+		if (typeOffset < 0) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		CatalogType *pCatalogType = (CatalogType *)(pBuilder->pData + typeOffset);
+		pCatalogType->cbBlob = cbBlob;
+		pType->GetGUID(MF_MT_SUBTYPE, &pCatalogType->subtype);
+		hr = MFGetAttributesAsBlob(pType, (UINT8 *)(pCatalogType + 1), cbBlob);
+	}
+	if (SUCCEEDED(hr)) {
+		CatalogStream *pStream = (CatalogStream *)(pBuilder->pData + streamOffset);
+		if (pStream->nTypes == 0) {
+			pType->GetGUID(MF_MT_MAJOR_TYPE, &pStream->majorType);
+		}
+		pStream->nTypes++;
+		pStream->cbTypes += sizeof(CatalogType) + padToDword(cbBlob);
+	}
+	return hr;
+}
+
+// Asks the reader for every native type of every stream
+static HRESULT buildRecord(const WCHAR *szLink, IMFSourceReader *pReader,
+						   CatalogRecord **ppRecord) {
+	RecordBuilder builder = { NULL, 0, 0 };
+	DWORD cchLink = (DWORD)(wcslen(szLink) + 2) & ~1;
+	HRESULT hr = S_OK;
+	if (appendRecord(&builder, sizeof(CatalogRecord)) < 0 ||
+		appendRecord(&builder, cchLink * sizeof(WCHAR)) < 0) {
+		hr = E_OUTOFMEMORY;
+	}
+	if (SUCCEEDED(hr)) {
+		CopyMemory(builder.pData + sizeof(CatalogRecord), szLink,
+			wcslen(szLink) * sizeof(WCHAR));
+		((CatalogRecord *)builder.pData)->cchLink = cchLink;
+	}
+	for (DWORD dwStream = 0; SUCCEEDED(hr); dwStream++) {
+		LONG streamOffset = appendRecord(&builder, sizeof(CatalogStream));
+		if (streamOffset < 0) {
+			hr = E_OUTOFMEMORY;
+			break;
+		}
+		for (DWORD dwIndex = 0; SUCCEEDED(hr); dwIndex++) {
+			IMFMediaType *pType = NULL;
+			hr = pReader->GetNativeMediaType(dwStream, dwIndex, &pType);
+			if (SUCCEEDED(hr)) {
+				hr = appendType(&builder, streamOffset, pType);
+				pType->Release();
+			}
+		}
+		if (hr == MF_E_INVALIDSTREAMNUMBER) {
+			// Past the last stream
+			builder.cbData = (DWORD)streamOffset;
+			hr = S_OK;
+			break;
+		} else if (hr == MF_E_NO_MORE_TYPES) {
+			((CatalogRecord *)builder.pData)->nStreams++;
+			hr = S_OK;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		((CatalogRecord *)builder.pData)->cbRecord = builder.cbData;
+		*ppRecord = (CatalogRecord *)builder.pData;
+	} else {
+		delete [] builder.pData;
+	}
+	return hr;
+}
+
+HRESULT catalogGetDevice(const WCHAR *szLink, IMFSourceReader *pReader) {
+	if (szLink == NULL) {
+		return E_POINTER;
+	}
+	lockCatalog();
+	BOOL bFound = findRecord(szLink) >= 0;
+	LeaveCriticalSection(&s_catalogLock);
+	if (bFound) {
+		return S_OK;
+	}
+	if (pReader == NULL) {
+		return MF_E_NOT_FOUND;
+	}
+
+	// Query the device unlocked; it can take a while
+	CatalogRecord *pRecord = NULL;
+	HRESULT hr = buildRecord(szLink, pReader, &pRecord);
+	if (SUCCEEDED(hr)) {
+		lockCatalog();
+		hr = addRecord(pRecord);
+		LeaveCriticalSection(&s_catalogLock);
+		if (FAILED(hr)) {
+			delete [] (BYTE *)pRecord;
+		}
+	}
+	return hr;
+}
+
+void catalogDeviceChanged(const WCHAR *szName) {
+	if (szName == NULL) {
+		return;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szName);
+	if (iRecord >= 0) {
+		removeRecord((DWORD)iRecord);
+	} else {
+		for (DWORD i = s_nRecords; i-- > 0; ) {
+			CatalogStream *pStream = findStream(s_records[i],
+				(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM);
+			if (pStream != NULL) {
+				removeRecord(i);
+			}
+		}
+	}
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+void catalogForgetDevice(const WCHAR *szLink) {
+	if (szLink == NULL) {
+		return;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szLink);
+	if (iRecord >= 0) {
+		removeRecord((DWORD)iRecord);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+HRESULT catalogGetStreamCount(const WCHAR *szLink, DWORD *pnStreams) {
+	if (szLink == NULL || pnStreams == NULL) {
+		return E_POINTER;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szLink);
+	if (iRecord >= 0) {
+		*pnStreams = s_records[iRecord]->nStreams;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return iRecord >= 0 ? S_OK : MF_E_NOT_FOUND;
+}
+
+HRESULT catalogGetNativeSubtype(const WCHAR *szLink, DWORD dwStream,
+								DWORD dwIndex, GUID *pMajorType, GUID *pSubtype) {
+	if (pMajorType == NULL || pSubtype == NULL) {
+		return E_POINTER;
+	}
+	CatalogStream *pStream;
+	CatalogType *pType;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, dwIndex, &pStream, &pType);
+	if (SUCCEEDED(hr)) {
+		*pMajorType = pStream->majorType;
+		*pSubtype = pType->subtype;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+HRESULT catalogGetNativeType(const WCHAR *szLink, DWORD dwStream,
+							 DWORD dwIndex, IMFMediaType **ppType) {
+	if (ppType == NULL) {
+		return E_POINTER;
+	}
+	*ppType = NULL;
+	IMFMediaType *pMediaType = NULL;
+	HRESULT hr = MFCreateMediaType(&pMediaType);
+	if (FAILED(hr)) {
+		return hr;
+	}
+	CatalogStream *pStream;
+	CatalogType *pType;
+	lockCatalog();
+	hr = findType(szLink, dwStream, dwIndex, &pStream, &pType);
+	if (SUCCEEDED(hr)) {
+		hr = MFInitAttributesFromBlob(pMediaType, (const UINT8 *)(pType + 1),
+			pType->cbBlob);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	if (SUCCEEDED(hr)) {
+		*ppType = pMediaType;
+	} else {
+		pMediaType->Release();
+	}
+	return hr;
+}
+
+HRESULT catalogGetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+									GUID *pSubtype) {
+	if (pSubtype == NULL) {
+		return E_POINTER;
+	}
+	CatalogStream *pStream;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, 0, &pStream, NULL);
+	if (SUCCEEDED(hr)) {
+		if (pStream->negotiatedSubtype == GUID_NULL) {
+			hr = MF_E_NOT_FOUND;
+		} else {
+			*pSubtype = pStream->negotiatedSubtype;
+		}
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+HRESULT catalogSetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+									REFGUID subtype) {
+	CatalogStream *pStream;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, 0, &pStream, NULL);
+	if (SUCCEEDED(hr) && pStream->negotiatedSubtype != subtype) {
+		pStream->negotiatedSubtype = subtype;
+		s_bChanged = TRUE;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+// Call locked
+static void clearRecords() {
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		delete [] (BYTE *)s_records[i];
+	}
+	delete [] s_records;
+	s_records = NULL;
+	s_nRecords = 0;
+	s_nAllocated = 0;
+}
+
+void catalogClear() {
+	lockCatalog();
+	clearRecords();
+	s_bChanged = TRUE;
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+// Splits the records of a file into the catalog.  Call locked, with the
+// catalog empty.
+static HRESULT readRecords(const BYTE *pData, DWORD cbData) {
+	const CatalogFileHeader *pHeader = (const CatalogFileHeader *)pData;
+	if (cbData < sizeof(CatalogFileHeader) ||
+		pHeader->magic != CATALOG_MAGIC ||
+		pHeader->version != CATALOG_VERSION ||
+		pHeader->cbRecords != cbData - sizeof(CatalogFileHeader)) {
+		return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+	}
+	const BYTE *pRecordData = pData + sizeof(CatalogFileHeader);
+	const BYTE *pEnd = pData + cbData;
+	for (DWORD i = 0; i < pHeader->nRecords; i++) {
+		DWORD cbAvailable = (DWORD)(pEnd - pRecordData);
+		if (!checkRecord(pRecordData, cbAvailable)) {
+			return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		}
+		DWORD cbRecord = ((const CatalogRecord *)pRecordData)->cbRecord;
+		BYTE *pCopy = new (std::nothrow) BYTE[cbRecord];
+		if (pCopy == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		CopyMemory(pCopy, pRecordData, cbRecord);
+		HRESULT hr = addRecord((CatalogRecord *)pCopy);
+		if (FAILED(hr)) {
+			delete [] pCopy;
+			return hr;
+		}
+		pRecordData += cbRecord;
+	}
+	return pRecordData == pEnd ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+}
+
+HRESULT catalogLoad(const WCHAR *szPath) {
+	HRESULT hr = S_OK;
+	BYTE *pData = NULL;
+	DWORD cbData = 0;
+	HANDLE hFile = CreateFileW(szPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		LARGE_INTEGER cbFile;
+		if (!GetFileSizeEx(hFile, &cbFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		} else if (cbFile.QuadPart > CATALOG_MAX_FILE) {
+			hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		} else {
+			cbData = (DWORD)cbFile.QuadPart;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		pData = new (std::nothrow) BYTE[max(cbData, 1)];
+		if (pData == NULL) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		DWORD cbRead = 0;
+		if (!ReadFile(hFile, pData, cbData, &cbRead, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		} else if (cbRead != cbData) {
+			hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+
+	lockCatalog();
+	clearRecords();
+	if (SUCCEEDED(hr)) {
+		hr = readRecords(pData, cbData);
+		if (FAILED(hr)) {
+			// All or nothing
+			clearRecords();
+		}
+	}
+	s_bChanged = FALSE;
+	LeaveCriticalSection(&s_catalogLock);
+	delete [] pData;
+	return hr;
+}
+
+HRESULT catalogSave(const WCHAR *szPath) {
+	// Written beside the file and moved over it, so a run that stops
+	// part way leaves the old one
+	WCHAR szTempPath[MAX_PATH];
+	HRESULT hr = StringCchPrintfW(szTempPath, MAX_PATH, L"%s.tmp", szPath);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	lockCatalog();
+	if (!s_bChanged) {
+		LeaveCriticalSection(&s_catalogLock);
+		return S_FALSE;
+	}
+	CatalogFileHeader header = { CATALOG_MAGIC, CATALOG_VERSION, s_nRecords, 0 };
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		header.cbRecords += s_records[i]->cbRecord;
+	}
+	HANDLE hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	DWORD cbWritten;
+	if (SUCCEEDED(hr) &&
+		!WriteFile(hFile, &header, sizeof(header), &cbWritten, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	for (DWORD i = 0; SUCCEEDED(hr) && i < s_nRecords; i++) {
+		if (!WriteFile(hFile, s_records[i], s_records[i]->cbRecord,
+			&cbWritten, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	if (SUCCEEDED(hr) &&
+		!MoveFileExW(szTempPath, szPath, MOVEFILE_REPLACE_EXISTING)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		s_bChanged = FALSE;
+	} else {
+		DeleteFileW(szTempPath);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+const DWORD MOCK_DEVICES = 16;
+const DWORD MOCK_STREAMS = 2;
+const DWORD MOCK_TYPES = 24;
+// Time a native type query takes, standing in for the driver
+const DWORD MOCK_QUERY_USEC = 200;
+
+static void spinMicroseconds(DWORD usec) {
+	LARGE_INTEGER freq, tStart, tNow;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&tStart);
+	LONGLONG ticks = freq.QuadPart * usec / 1000000;
+	do {
+		QueryPerformanceCounter(&tNow);
+	} while (tNow.QuadPart - tStart.QuadPart < ticks);
+}
+
+// A capture device that only answers GetNativeMediaType, slowly
+class MockSourceReader : public IMFSourceReader
+{
+	LONG m_nRefCount;
+	DWORD m_iDevice;
+
+public:
+	volatile LONG m_nQueries;
+
+	MockSourceReader(DWORD iDevice) :
+	m_nRefCount(1), m_iDevice(iDevice), m_nQueries(0)
+	{
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFSourceReader)) {
+			*ppv = static_cast<IMFSourceReader *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFSourceReader methods
+	STDMETHODIMP GetNativeMediaType(DWORD dwStreamIndex,
+		DWORD dwMediaTypeIndex, IMFMediaType **ppMediaType);
+	STDMETHODIMP GetStreamSelection(DWORD, BOOL *) { return E_NOTIMPL; }
+	STDMETHODIMP SetStreamSelection(DWORD, BOOL) { return E_NOTIMPL; }
+	STDMETHODIMP GetCurrentMediaType(DWORD, IMFMediaType **) { return E_NOTIMPL; }
+	STDMETHODIMP SetCurrentMediaType(DWORD, DWORD *, IMFMediaType *) { return E_NOTIMPL; }
+	STDMETHODIMP SetCurrentPosition(REFGUID, REFPROPVARIANT) { return E_NOTIMPL; }
+	STDMETHODIMP ReadSample(DWORD, DWORD, DWORD *, DWORD *, LONGLONG *,
+		IMFSample **) { return E_NOTIMPL; }
+	STDMETHODIMP Flush(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP GetServiceForStream(DWORD, REFGUID, REFIID, LPVOID *) { return E_NOTIMPL; }
+	STDMETHODIMP GetPresentationAttribute(DWORD, REFGUID, PROPVARIANT *) { return E_NOTIMPL; }
+};
+
+// A different PCM or float format for each device, stream and index
+HRESULT MockSourceReader::GetNativeMediaType(DWORD dwStreamIndex,
+	DWORD dwMediaTypeIndex, IMFMediaType **ppMediaType)
+{
+	static const UINT32 rates[] = {
+		8000, 11025, 16000, 22050, 32000, 44100, 48000, 96000
+	};
+	InterlockedIncrement(&m_nQueries);
+	spinMicroseconds(MOCK_QUERY_USEC);
+	if (dwStreamIndex >= MOCK_STREAMS) {
+		return MF_E_INVALIDSTREAMNUMBER;
+	}
+	if (dwMediaTypeIndex >= MOCK_TYPES) {
+		return MF_E_NO_MORE_TYPES;
+	}
+
+	DWORD iFormat = m_iDevice + dwStreamIndex * 7 + dwMediaTypeIndex;
+	BOOL bFloat = (iFormat % 4 == 3);
+	UINT32 nChannels = 1 + iFormat % 2;
+	UINT32 nBits = bFloat ? 32 : (iFormat / 2 % 2 ? 24 : 16);
+	UINT32 nRate = rates[iFormat / 4 % ARRAYSIZE(rates)];
+	UINT32 cbBlock = nChannels * nBits / 8;
+
+	IMFMediaType *pType = NULL;
+	HRESULT hr = MFCreateMediaType(&pType);
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetGUID(MF_MT_SUBTYPE,
+			bFloat ? MFAudioFormat_Float : MFAudioFormat_PCM);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_NUM_CHANNELS, nChannels);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, nRate);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, nBits);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, cbBlock);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, cbBlock * nRate);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppMediaType = pType;
+	} else {
+		SafeRelease(&pType);
+	}
+	return hr;
+}
+
+// Starting up a device as it was done before the catalog: every type
+// of every stream printed, then the first audio type fetched to set
+static HRESULT startDirect(IMFSourceReader *pReader) {
+	HRESULT hr = S_OK;
+	for (DWORD dwStream = 0; SUCCEEDED(hr); dwStream++) {
+		for (DWORD dwIndex = 0; SUCCEEDED(hr); dwIndex++) {
+			IMFMediaType *pType = NULL;
+			hr = pReader->GetNativeMediaType(dwStream, dwIndex, &pType);
+			SafeRelease(&pType);
+		}
+		if (hr == MF_E_NO_MORE_TYPES) {
+			hr = S_OK;
+		}
+	}
+	if (hr == MF_E_INVALIDSTREAMNUMBER) {
+		IMFMediaType *pType = NULL;
+		hr = pReader->GetNativeMediaType(0, 0, &pType);
+		SafeRelease(&pType);
+	}
+	return hr;
+}
+
+// The same through the catalog
+static HRESULT startFromCatalog(const WCHAR *szLink, IMFSourceReader *pReader) {
+	DWORD nStreams = 0;
+	HRESULT hr = catalogGetDevice(szLink, pReader);
+	if (SUCCEEDED(hr)) {
+		hr = catalogGetStreamCount(szLink, &nStreams);
+	}
+	for (DWORD dwStream = 0; SUCCEEDED(hr) && dwStream < nStreams; dwStream++) {
+		GUID majorType, subtype;
+		for (DWORD dwIndex = 0; SUCCEEDED(hr); dwIndex++) {
+			hr = catalogGetNativeSubtype(szLink, dwStream, dwIndex, &majorType,
+				&subtype);
+		}
+		if (hr == MF_E_NO_MORE_TYPES) {
+			hr = S_OK;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		IMFMediaType *pType = NULL;
+		hr = catalogGetNativeType(szLink,
+			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, 0, &pType);
+		SafeRelease(&pType);
+	}
+	return hr;
+}
+
+// Checks every type in the catalog against the device
+static BOOL checkCatalogTypes(const WCHAR *szLink, IMFSourceReader *pReader) {
+	IMFMediaType *pType = NULL;
+	if (catalogGetNativeType(szLink, MOCK_STREAMS, 0, &pType) !=
+		MF_E_INVALIDSTREAMNUMBER ||
+		catalogGetNativeType(szLink, 0, MOCK_TYPES, &pType) !=
+		MF_E_NO_MORE_TYPES) {
+		return FALSE;
+	}
+	for (DWORD dwStream = 0; dwStream < MOCK_STREAMS; dwStream++) {
+		for (DWORD dwIndex = 0; dwIndex < MOCK_TYPES; dwIndex++) {
+			IMFMediaType *pNative = NULL;
+			GUID majorType, subtype, nativeSubtype = GUID_NULL;
+			BOOL bMatch = FALSE;
+			HRESULT hr = pReader->GetNativeMediaType(dwStream, dwIndex, &pNative);
+			if (SUCCEEDED(hr)) {
+				hr = catalogGetNativeType(szLink, dwStream, dwIndex, &pType);
+			}
+			if (SUCCEEDED(hr)) {
+				hr = pType->Compare(pNative, MF_ATTRIBUTES_MATCH_ALL_ITEMS,
+					&bMatch);
+			}
+			if (SUCCEEDED(hr)) {
+				hr = catalogGetNativeSubtype(szLink, dwStream, dwIndex,
+					&majorType, &subtype);
+			}
+			if (SUCCEEDED(hr)) {
+				hr = pNative->GetGUID(MF_MT_SUBTYPE, &nativeSubtype);
+			}
+			SafeRelease(&pType);
+			SafeRelease(&pNative);
+			if (FAILED(hr) || !bMatch || majorType != MFMediaType_Audio ||
+				subtype != nativeSubtype) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+// Copies a file, keeping cbKeep bytes and flipping the given bits of
+// the DWORD at offsetFlip if it is in range, to make a damaged catalog
+static BOOL copyDamaged(const WCHAR *szFrom, const WCHAR *szTo, DWORD cbKeep,
+						DWORD offsetFlip, DWORD bitsFlipped) {
+	BYTE *pData = new (std::nothrow) BYTE[CATALOG_MAX_FILE];
+	DWORD cbData = 0;
+	BOOL bOk = FALSE;
+	HANDLE hFile = CreateFileW(szFrom, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, 0, NULL);
+	if (pData != NULL && hFile != INVALID_HANDLE_VALUE) {
+		bOk = ReadFile(hFile, pData, CATALOG_MAX_FILE, &cbData, NULL);
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	if (bOk) {
+		if (offsetFlip < cbData && cbData - offsetFlip >= sizeof(DWORD)) {
+			*(DWORD *)(pData + offsetFlip) ^= bitsFlipped;
+		}
+		hFile = CreateFileW(szTo, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		bOk = hFile != INVALID_HANDLE_VALUE &&
+			WriteFile(hFile, pData, min(cbKeep, cbData), &cbData, NULL);
+		if (hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFile);
+		}
+	}
+	delete [] pData;
+	return bOk;
+}
+
+// Reads every type of every device the catalog holds, as a run would
+static void readEveryType(WCHAR szLinks[][64], DWORD nLinks) {
+	for (DWORD i = 0; i < nLinks; i++) {
+		DWORD nStreams = 0;
+		GUID negotiated;
+		if (FAILED(catalogGetStreamCount(szLinks[i], &nStreams))) {
+			continue;
+		}
+		for (DWORD dwStream = 0; dwStream < nStreams; dwStream++) {
+			catalogGetNegotiatedSubtype(szLinks[i], dwStream, &negotiated);
+			for (DWORD dwIndex = 0; ; dwIndex++) {
+				GUID majorType, subtype;
+				IMFMediaType *pType = NULL;
+				if (FAILED(catalogGetNativeSubtype(szLinks[i], dwStream,
+					dwIndex, &majorType, &subtype))) {
+					break;
+				}
+				catalogGetNativeType(szLinks[i], dwStream, dwIndex, &pType);
+				SafeRelease(&pType);
+			}
+		}
+	}
+}
+
+// Writes a copy of the file with one to four bytes changed, half of
+// them among the headers at the start, and cut short one time in eight
+static BOOL writeMutated(const BYTE *pData, DWORD cbData, BYTE *pCopy,
+						 const WCHAR *szTo) {
+	CopyMemory(pCopy, pData, cbData);
+	DWORD nChanges = 1 + rand() % 4;
+	for (DWORD i = 0; i < nChanges; i++) {
+		DWORD offset = ((DWORD)rand() << 15) | rand();
+		offset %= (rand() % 2) ? min(cbData, 512UL) : cbData;
+		if (rand() % 2) {
+			pCopy[offset] ^= (BYTE)(1 << (rand() % 8));
+		} else {
+			pCopy[offset] = (BYTE)rand();
+		}
+	}
+	DWORD cbKeep = cbData;
+	if (rand() % 8 == 0) {
+		cbKeep = (((DWORD)rand() << 15) | rand()) % cbData;
+	}
+	DWORD cbWritten = 0;
+	HANDLE hFile = CreateFileW(szTo, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	BOOL bOk = hFile != INVALID_HANDLE_VALUE &&
+		WriteFile(hFile, pCopy, cbKeep, &cbWritten, NULL);
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	return bOk;
+}
+
+// Loads randomly damaged copies of the catalog.  A file that is
+// rejected must leave the catalog empty, and one that is taken must
+// have every type readable.
+static void checkMutatedFiles(const WCHAR *szPath, const WCHAR *szDamaged,
+							  WCHAR szLinks[][64], DWORD nLinks) {
+	const DWORD N_MUTATIONS = 2000;
+	BYTE *pData = new (std::nothrow) BYTE[CATALOG_MAX_FILE];
+	BYTE *pCopy = new (std::nothrow) BYTE[CATALOG_MAX_FILE];
+	DWORD cbData = 0;
+	BOOL bOk = FALSE;
+	HANDLE hFile = CreateFileW(szPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, 0, NULL);
+	if (pData != NULL && pCopy != NULL && hFile != INVALID_HANDLE_VALUE) {
+		bOk = ReadFile(hFile, pData, CATALOG_MAX_FILE, &cbData, NULL) &&
+			cbData > 0;
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+
+	DWORD nRejected = 0, nLoaded = 0;
+	srand(1);
+	for (DWORD i = 0; bOk && i < N_MUTATIONS; i++) {
+		DWORD nStreams;
+		bOk = writeMutated(pData, cbData, pCopy, szDamaged);
+		if (!bOk) {
+			break;
+		}
+		if (FAILED(catalogLoad(szDamaged))) {
+			nRejected++;
+			for (DWORD j = 0; bOk && j < nLinks; j++) {
+				bOk = catalogGetStreamCount(szLinks[j], &nStreams) ==
+					MF_E_NOT_FOUND;
+			}
+		} else {
+			nLoaded++;
+			readEveryType(szLinks, nLinks);
+		}
+	}
+	printf("  Mutated files: %u rejected, %u loaded, %s\n", nRejected,
+		nLoaded, bOk ? "ok" : "FAILED");
+	DeleteFileW(szDamaged);
+	delete [] pData;
+	delete [] pCopy;
+}
+
+static double elapsedMsec(LARGE_INTEGER tStart, LARGE_INTEGER freq) {
+	LARGE_INTEGER tEnd;
+	QueryPerformanceCounter(&tEnd);
+	return (tEnd.QuadPart - tStart.QuadPart) * 1000.0 / freq.QuadPart;
+}
+
+void benchmarkMediaTypeCatalog(void) {
+	WCHAR szPath[MAX_PATH], szDamaged[MAX_PATH];
+	WCHAR szLinks[MOCK_DEVICES][64];
+	MockSourceReader *pReaders[MOCK_DEVICES] = { NULL };
+	LARGE_INTEGER freq, tStart;
+	QueryPerformanceFrequency(&freq);
+
+	DWORD cchTemp = GetTempPathW(MAX_PATH, szPath);
+	if (cchTemp == 0 || cchTemp >= MAX_PATH ||
+		FAILED(StringCchCatW(szPath, MAX_PATH, L"mediaTypes.bench")) ||
+		FAILED(StringCchPrintfW(szDamaged, MAX_PATH, L"%s.damaged", szPath))) {
+		printf("No temporary path\n");
+		return;
+	}
+	for (DWORD i = 0; i < MOCK_DEVICES; i++) {
+		StringCchPrintfW(szLinks[i], ARRAYSIZE(szLinks[i]),
+			L"\\\\?\\SWD#MMDEVAPI#{0.0.1.00000000}.{mock-%u}", i);
+		pReaders[i] = new (std::nothrow) MockSourceReader(i);
+		if (pReaders[i] == NULL) {
+			printf("Out of memory\n");
+			goto CLEANUP;
+		}
+	}
+
+	printf("Media type catalog benchmark, %u devices, %u streams of %u types, "
+		"%u us a query\n", MOCK_DEVICES, MOCK_STREAMS, MOCK_TYPES,
+		MOCK_QUERY_USEC);
+	{
+		HRESULT hr = S_OK;
+		QueryPerformanceCounter(&tStart);
+		for (DWORD i = 0; SUCCEEDED(hr) && i < MOCK_DEVICES; i++) {
+			hr = startDirect(pReaders[i]);
+		}
+		printf("  Queried each run:      %8.2f ms%s\n", elapsedMsec(tStart, freq),
+			SUCCEEDED(hr) ? "" : "  FAILED");
+
+		// First run, filling the catalog
+		catalogClear();
+		QueryPerformanceCounter(&tStart);
+		for (DWORD i = 0; SUCCEEDED(hr) && i < MOCK_DEVICES; i++) {
+			hr = startFromCatalog(szLinks[i], pReaders[i]);
+		}
+		printf("  Catalog, first run:    %8.2f ms%s\n", elapsedMsec(tStart, freq),
+			SUCCEEDED(hr) ? "" : "  FAILED");
+		hr = catalogSetNegotiatedSubtype(szLinks[0],
+			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, MFAudioFormat_Float);
+		QueryPerformanceCounter(&tStart);
+		if (SUCCEEDED(hr)) {
+			hr = catalogSave(szPath);
+		}
+		printf("  Catalog saved:         %8.2f ms%s\n", elapsedMsec(tStart, freq),
+			SUCCEEDED(hr) ? "" : "  FAILED");
+
+		// Next run, from the file
+		LONG nQueries = 0;
+		for (DWORD i = 0; i < MOCK_DEVICES; i++) {
+			nQueries -= pReaders[i]->m_nQueries;
+		}
+		QueryPerformanceCounter(&tStart);
+		hr = catalogLoad(szPath);
+		for (DWORD i = 0; SUCCEEDED(hr) && i < MOCK_DEVICES; i++) {
+			hr = startFromCatalog(szLinks[i], pReaders[i]);
+		}
+		double msecWarm = elapsedMsec(tStart, freq);
+		for (DWORD i = 0; i < MOCK_DEVICES; i++) {
+			nQueries += pReaders[i]->m_nQueries;
+		}
+		printf("  Catalog, next run:     %8.2f ms, %ld device queries%s\n",
+			msecWarm, nQueries, SUCCEEDED(hr) ? "" : "  FAILED");
+	}
+
+	// Read back from disk as the devices give them
+	{
+		BOOL bOk = TRUE;
+		for (DWORD i = 0; i < MOCK_DEVICES; i++) {
+			bOk = bOk && checkCatalogTypes(szLinks[i], pReaders[i]);
+		}
+		GUID subtype = GUID_NULL;
+		bOk = bOk && SUCCEEDED(catalogGetNegotiatedSubtype(szLinks[0],
+			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, &subtype)) &&
+			subtype == MFAudioFormat_Float &&
+			catalogGetNegotiatedSubtype(szLinks[1], 0, &subtype) == MF_E_NOT_FOUND;
+		printf("  Types from disk %s\n", bOk ? "match" : "DO NOT MATCH");
+	}
+
+	// Damaged files are dropped whole
+	{
+		DWORD nStreams;
+		BOOL bOk = TRUE;
+		static const struct { DWORD cbKeep, offsetFlip, bitsFlipped; } damage[] = {
+			{ 0xFFFFFFFF, 0, 1 },                   // Magic
+			{ 0xFFFFFFFF, 3 * sizeof(DWORD), 4 },   // Records size
+			{ 0xFFFFFFFF, 4 * sizeof(DWORD), 4 },   // First record size
+			{ 0xFFFFFFFF, 6 * sizeof(DWORD), 1 },   // Stream count
+			{ 4096, 0xFFFFFFFF, 0 },                // Cut short
+		};
+		for (DWORD i = 0; i < ARRAYSIZE(damage); i++) {
+			catalogLoad(szPath);
+			bOk = bOk && copyDamaged(szPath, szDamaged, damage[i].cbKeep,
+				damage[i].offsetFlip, damage[i].bitsFlipped) &&
+				FAILED(catalogLoad(szDamaged)) &&
+				catalogGetStreamCount(szLinks[0], &nStreams) == MF_E_NOT_FOUND;
+		}
+		printf("  Damaged files %s\n", bOk ? "dropped" : "NOT DROPPED");
+		DeleteFileW(szDamaged);
+	}
+	checkMutatedFiles(szPath, szDamaged, szLinks, MOCK_DEVICES);
+
+	// Device changes
+	{
+		DWORD nStreams;
+		catalogLoad(szPath);
+		catalogDeviceChanged(szLinks[3]);
+		BOOL bOk = catalogGetStreamCount(szLinks[3], &nStreams) == MF_E_NOT_FOUND &&
+			SUCCEEDED(catalogGetStreamCount(szLinks[4], &nStreams));
+		// A stale record is dropped alone, and the next start asks the
+		// device again
+		LONG nQueries = pReaders[5]->m_nQueries;
+		catalogForgetDevice(szLinks[5]);
+		bOk = bOk && catalogGetStreamCount(szLinks[5], &nStreams) == MF_E_NOT_FOUND &&
+			SUCCEEDED(catalogGetStreamCount(szLinks[6], &nStreams)) &&
+			SUCCEEDED(startFromCatalog(szLinks[5], pReaders[5])) &&
+			pReaders[5]->m_nQueries > nQueries &&
+			checkCatalogTypes(szLinks[5], pReaders[5]);
+		catalogDeviceChanged(L"\\\\?\\USB#VID_0000&PID_0000#mock");
+		bOk = bOk && catalogGetStreamCount(szLinks[4], &nStreams) == MF_E_NOT_FOUND;
+		printf("  Device changes %s\n", bOk ? "work" : "FAILED");
+	}
+
+CLEANUP:
+	catalogClear();
+	DeleteFileW(szPath);
+	for (DWORD i = 0; i < MOCK_DEVICES; i++) {
+		SafeRelease(&pReaders[i]);
+	}
+}
@@ -0,0 +1,51 @@
+//////////////////////////////////////////////////////////////////////////
+// mediaTypeCatalog.h: Native media types of each device, kept on disk
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// The catalog file, in the working directory
+#define CATALOG_FILE_NAME L"mediaTypes.cache"
+
+// Reads the catalog, replacing what it holds.  A missing or damaged
+// file leaves it empty, and the devices are queried again.
+HRESULT catalogLoad(const WCHAR *szPath);
+// Writes the catalog if it has changed since it was read.  Returns
+// S_FALSE if there was nothing to write.
+HRESULT catalogSave(const WCHAR *szPath);
+// Forgets every device
+void catalogClear();
+
+// Makes sure the device, keyed by its symbolic link or endpoint ID, is
+// in the catalog, asking pReader for the native types of each stream
+// if it is not.  With pReader NULL, returns MF_E_NOT_FOUND instead.
+HRESULT catalogGetDevice(const WCHAR *szLink, IMFSourceReader *pReader);
+// Forgets the device named in a WM_DEVICECHANGE arrival or removal.
+// Audio devices are keyed by endpoint ID, which is not the interface
+// name given there, so a name that matches no device forgets them all.
+void catalogDeviceChanged(const WCHAR *szName);
+// Forgets one device, whose types turned out to be out of date
+void catalogForgetDevice(const WCHAR *szLink);
+
+// The streams of a device in the catalog
+HRESULT catalogGetStreamCount(const WCHAR *szLink, DWORD *pnStreams);
+// The major type and subtype of a native type, without creating it.
+// dwStream may be MF_SOURCE_READER_FIRST_AUDIO_STREAM or _VIDEO_STREAM.
+// Fails as IMFSourceReader::GetNativeMediaType does past the last
+// stream or type.
+HRESULT catalogGetNativeSubtype(const WCHAR *szLink, DWORD dwStream,
+    DWORD dwIndex, GUID *pMajorType, GUID *pSubtype);
+// A native type, as IMFSourceReader::GetNativeMediaType returns it
+HRESULT catalogGetNativeType(const WCHAR *szLink, DWORD dwStream,
+    DWORD dwIndex, IMFMediaType **ppType);
+// The subtype last set on a stream, or MF_E_NOT_FOUND if none has been
+HRESULT catalogGetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+    GUID *pSubtype);
+HRESULT catalogSetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+    REFGUID subtype);
+
+// Times starting up many devices from a mock source reader, with and
+// without the catalog, and checks the types read back from disk
+void benchmarkMediaTypeCatalog(void);
@@ -2,60 +2,39 @@
 #include "mfRoutines.h"
 #include "mfWave.h"
 
-HRESULT enumerateTypesForStreams(IMFSourceReader *pReader) {
-	HRESULT hr = S_OK;
-	DWORD dwStreamIndex = 0;
-	//WCHAR guidString[80];
-	DWORD dwMediaTypeIndex = 0;
-
-	while (SUCCEEDED(hr)) {
-		IMFMediaType *pType = NULL;
-		hr = pReader->GetNativeMediaType(dwStreamIndex, dwMediaTypeIndex, &pType);
-		if (hr == MF_E_INVALIDSTREAMNUMBER) {
-			hr = S_OK;
-			break;
-		} else if (SUCCEEDED(hr)) {
-			wprintf(L"  Stream %d:\n", dwStreamIndex);
-			hr = enumerateTypesForStream(pReader, dwStreamIndex);
-			if (SUCCEEDED(hr)) {
-				// Do something
-			}
-			pType->Release();
-		}
-		++dwStreamIndex;
+// The types come from the catalog, so the reader is only asked for
+// them the first time a device is seen
+HRESULT enumerateTypesForStreams(const WCHAR *szLink, IMFSourceReader *pReader) {
+	DWORD nStreams = 0;
+	HRESULT hr = catalogGetDevice(szLink, pReader);
+	if (SUCCEEDED(hr)) {
+		hr = catalogGetStreamCount(szLink, &nStreams);
+	}
+	for (DWORD dwStreamIndex = 0; SUCCEEDED(hr) && dwStreamIndex < nStreams;
+		dwStreamIndex++) {
+		wprintf(L"  Stream %d:\n", dwStreamIndex);
+		hr = enumerateTypesForStream(szLink, dwStreamIndex);
 	}
 	return hr;
 }
 
-HRESULT enumerateTypesForStream(IMFSourceReader *pReader, DWORD dwStreamIndex) {
+HRESULT enumerateTypesForStream(const WCHAR *szLink, DWORD dwStreamIndex) {
 	HRESULT hr = S_OK;
-	DWORD dwMediaTypeIndex = 0;
 	WCHAR guidString[80];
-	GUID type;
+	GUID majorType, subtype;
 
-	while (SUCCEEDED(hr)) {
-		IMFMediaType *pType = NULL;
-		hr = pReader->GetNativeMediaType(dwStreamIndex, dwMediaTypeIndex, &pType);
+	for (DWORD dwMediaTypeIndex = 0; SUCCEEDED(hr); dwMediaTypeIndex++) {
+		hr = catalogGetNativeSubtype(szLink, dwStreamIndex, dwMediaTypeIndex,
+			&majorType, &subtype);
 		if (hr == MF_E_NO_MORE_TYPES) {
 			hr = S_OK;
 			break;
 		} else if (SUCCEEDED(hr)) {
-			hr = pType->GetGUID(MF_MT_SUBTYPE, &type);
-			if (SUCCEEDED(hr)) {
-				hr = pType->GetGUID(MF_MT_MAJOR_TYPE, &type);
-				getFriendlyGuidString(type, guidString, 79);
-				wprintf(L"    Type: %s", guidString);
-				if (SUCCEEDED(hr)) {
-					hr = pType->GetGUID(MF_MT_SUBTYPE, &type);
-					getFriendlyGuidString(type, guidString, 79);
-					wprintf(L"/%s\n", guidString);
-				} else {
-					printf("\n");
-				}
-			}
-			pType->Release();
+			getFriendlyGuidString(majorType, guidString, 79);
+			wprintf(L"    Type: %s", guidString);
+			getFriendlyGuidString(subtype, guidString, 79);
+			wprintf(L"/%s\n", guidString);
 		}
-		++dwMediaTypeIndex;
 	}
 	return hr;
 }
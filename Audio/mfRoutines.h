@@ -6,6 +6,7 @@
 
 #include "stdafx.h"
 #include "mfUtils.h"
+#include "mediaTypeCatalog.h"
 
-HRESULT enumerateTypesForStreams(IMFSourceReader *pReader);
-HRESULT enumerateTypesForStream(IMFSourceReader *pReader, DWORD dwStreamIndex);
+HRESULT enumerateTypesForStreams(const WCHAR *szLink, IMFSourceReader *pReader);
+HRESULT enumerateTypesForStream(const WCHAR *szLink, DWORD dwStreamIndex);
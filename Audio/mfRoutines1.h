@@ -19,6 +19,5 @@
 #include "capture.h"
 
 void printMfAudioInfo(void);
-void printErrorDescription(HRESULT hr);
 void initialize();
 void shutdown();
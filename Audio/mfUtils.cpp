@@ -1,10 +1,448 @@
 #include "stdafx.h"
 #include "mfUtils.h"
 
-TCHAR szDebugString[PRINT_STRING_SIZE];
+//////////////////////////////////////////////////////////////////////////
+// GUID names
+//
+// The names are looked up in a perfect hash built on first use, so a
+// lookup costs two hashes and one comparison however many names there
+// are.  The first hash picks a bucket, and the bucket's seed for the
+// second hash sends each of its GUIDs to a slot of its own.
 
-WCHAR *getFriendlyGuidString(GUID guid) {
-	// Audio
+#define GUID_NAME(guid) { &guid, _CRT_WIDE(#guid) }
+
+// Seeds tried for a bucket before the table is made larger
+const UINT32 GUID_NAME_MAX_SEED = 4096;
+
+struct GuidNameEntry
+{
+	const GUID *pGuid;
+	const WCHAR *szName;
+};
+
+// Later entries for the same GUID take its name
+static const GuidNameEntry s_guidNames[] = {
+	// Major types
+	GUID_NAME(MFMediaType_Default),
+	GUID_NAME(MFMediaType_Audio),
+	GUID_NAME(MFMediaType_Video),
+	GUID_NAME(MFMediaType_Protected),
+	GUID_NAME(MFMediaType_SAMI),
+	GUID_NAME(MFMediaType_Script),
+	GUID_NAME(MFMediaType_Image),
+	GUID_NAME(MFMediaType_HTML),
+	GUID_NAME(MFMediaType_Binary),
+	GUID_NAME(MFMediaType_FileTransfer),
+
+	// Video subtypes.  The base is also the audio base, named below.
+	GUID_NAME(MFVideoFormat_Base),
+	GUID_NAME(MFVideoFormat_RGB32),
+	GUID_NAME(MFVideoFormat_ARGB32),
+	GUID_NAME(MFVideoFormat_RGB24),
+	GUID_NAME(MFVideoFormat_RGB555),
+	GUID_NAME(MFVideoFormat_RGB565),
+	GUID_NAME(MFVideoFormat_RGB8),
+	GUID_NAME(MFVideoFormat_AI44),
+	GUID_NAME(MFVideoFormat_AYUV),
+	GUID_NAME(MFVideoFormat_YUY2),
+	GUID_NAME(MFVideoFormat_YVYU),
+	GUID_NAME(MFVideoFormat_YVU9),
+	GUID_NAME(MFVideoFormat_UYVY),
+	GUID_NAME(MFVideoFormat_NV11),
+	GUID_NAME(MFVideoFormat_NV12),
+	GUID_NAME(MFVideoFormat_YV12),
+	GUID_NAME(MFVideoFormat_I420),
+	GUID_NAME(MFVideoFormat_IYUV),
+	GUID_NAME(MFVideoFormat_Y210),
+	GUID_NAME(MFVideoFormat_Y216),
+	GUID_NAME(MFVideoFormat_Y410),
+	GUID_NAME(MFVideoFormat_Y416),
+	GUID_NAME(MFVideoFormat_Y41P),
+	GUID_NAME(MFVideoFormat_Y41T),
+	GUID_NAME(MFVideoFormat_Y42T),
+	GUID_NAME(MFVideoFormat_P210),
+	GUID_NAME(MFVideoFormat_P216),
+	GUID_NAME(MFVideoFormat_P010),
+	GUID_NAME(MFVideoFormat_P016),
+	GUID_NAME(MFVideoFormat_v210),
+	GUID_NAME(MFVideoFormat_v216),
+	GUID_NAME(MFVideoFormat_v410),
+	GUID_NAME(MFVideoFormat_MP43),
+	GUID_NAME(MFVideoFormat_MP4S),
+	GUID_NAME(MFVideoFormat_M4S2),
+	GUID_NAME(MFVideoFormat_MP4V),
+	GUID_NAME(MFVideoFormat_WMV1),
+	GUID_NAME(MFVideoFormat_WMV2),
+	GUID_NAME(MFVideoFormat_WMV3),
+	GUID_NAME(MFVideoFormat_WVC1),
+	GUID_NAME(MFVideoFormat_MSS1),
+	GUID_NAME(MFVideoFormat_MSS2),
+	GUID_NAME(MFVideoFormat_MPG1),
+	GUID_NAME(MFVideoFormat_DVSL),
+	GUID_NAME(MFVideoFormat_DVSD),
+	GUID_NAME(MFVideoFormat_DVHD),
+	GUID_NAME(MFVideoFormat_DV25),
+	GUID_NAME(MFVideoFormat_DV50),
+	GUID_NAME(MFVideoFormat_DVH1),
+	GUID_NAME(MFVideoFormat_DVC),
+	GUID_NAME(MFVideoFormat_H264),
+	GUID_NAME(MFVideoFormat_MJPG),
+	GUID_NAME(MFVideoFormat_MPEG2),
+
+	// Audio subtypes
+	GUID_NAME(MFAudioFormat_Base),
+	GUID_NAME(MFAudioFormat_PCM),
+	GUID_NAME(MFAudioFormat_Float),
+	GUID_NAME(MFAudioFormat_DTS),
+	GUID_NAME(MFAudioFormat_Dolby_AC3_SPDIF),
+	GUID_NAME(MFAudioFormat_DRM),
+	GUID_NAME(MFAudioFormat_WMAudioV8),
+	GUID_NAME(MFAudioFormat_WMAudioV9),
+	GUID_NAME(MFAudioFormat_WMAudio_Lossless),
+	GUID_NAME(MFAudioFormat_WMASPDIF),
+	GUID_NAME(MFAudioFormat_MSP1),
+	GUID_NAME(MFAudioFormat_MP3),
+	GUID_NAME(MFAudioFormat_MPEG),
+	GUID_NAME(MFAudioFormat_AAC),
+	GUID_NAME(MFAudioFormat_ADTS),
+
+	// Media type attributes
+	GUID_NAME(MF_MT_MAJOR_TYPE),
+	GUID_NAME(MF_MT_SUBTYPE),
+	GUID_NAME(MF_MT_ALL_SAMPLES_INDEPENDENT),
+	GUID_NAME(MF_MT_FIXED_SIZE_SAMPLES),
+	GUID_NAME(MF_MT_COMPRESSED),
+	GUID_NAME(MF_MT_SAMPLE_SIZE),
+	GUID_NAME(MF_MT_WRAPPED_TYPE),
+	GUID_NAME(MF_MT_USER_DATA),
+	GUID_NAME(MF_MT_AUDIO_NUM_CHANNELS),
+	GUID_NAME(MF_MT_AUDIO_SAMPLES_PER_SECOND),
+	GUID_NAME(MF_MT_AUDIO_FLOAT_SAMPLES_PER_SECOND),
+	GUID_NAME(MF_MT_AUDIO_AVG_BYTES_PER_SECOND),
+	GUID_NAME(MF_MT_AUDIO_BLOCK_ALIGNMENT),
+	GUID_NAME(MF_MT_AUDIO_BITS_PER_SAMPLE),
+	GUID_NAME(MF_MT_AUDIO_VALID_BITS_PER_SAMPLE),
+	GUID_NAME(MF_MT_AUDIO_SAMPLES_PER_BLOCK),
+	GUID_NAME(MF_MT_AUDIO_CHANNEL_MASK),
+	GUID_NAME(MF_MT_AUDIO_FOLDDOWN_MATRIX),
+	GUID_NAME(MF_MT_AUDIO_PREFER_WAVEFORMATEX),
+	GUID_NAME(MF_MT_AAC_PAYLOAD_TYPE),
+	GUID_NAME(MF_MT_AAC_AUDIO_PROFILE_LEVEL_INDICATION),
+	GUID_NAME(MF_MT_FRAME_SIZE),
+	GUID_NAME(MF_MT_FRAME_RATE),
+	GUID_NAME(MF_MT_FRAME_RATE_RANGE_MAX),
+	GUID_NAME(MF_MT_FRAME_RATE_RANGE_MIN),
+	GUID_NAME(MF_MT_PIXEL_ASPECT_RATIO),
+	GUID_NAME(MF_MT_DRM_FLAGS),
+	GUID_NAME(MF_MT_PAD_CONTROL_FLAGS),
+	GUID_NAME(MF_MT_SOURCE_CONTENT_HINT),
+	GUID_NAME(MF_MT_VIDEO_CHROMA_SITING),
+	GUID_NAME(MF_MT_INTERLACE_MODE),
+	GUID_NAME(MF_MT_TRANSFER_FUNCTION),
+	GUID_NAME(MF_MT_VIDEO_PRIMARIES),
+	GUID_NAME(MF_MT_YUV_MATRIX),
+	GUID_NAME(MF_MT_VIDEO_LIGHTING),
+	GUID_NAME(MF_MT_VIDEO_NOMINAL_RANGE),
+	GUID_NAME(MF_MT_GEOMETRIC_APERTURE),
+	GUID_NAME(MF_MT_MINIMUM_DISPLAY_APERTURE),
+	GUID_NAME(MF_MT_PAN_SCAN_APERTURE),
+	GUID_NAME(MF_MT_PAN_SCAN_ENABLED),
+	GUID_NAME(MF_MT_AVG_BITRATE),
+	GUID_NAME(MF_MT_AVG_BIT_ERROR_RATE),
+	GUID_NAME(MF_MT_MAX_KEYFRAME_SPACING),
+	GUID_NAME(MF_MT_DEFAULT_STRIDE),
+	GUID_NAME(MF_MT_PALETTE),
+	GUID_NAME(MF_MT_MPEG_START_TIME_CODE),
+	GUID_NAME(MF_MT_MPEG2_PROFILE),
+	GUID_NAME(MF_MT_MPEG2_LEVEL),
+	GUID_NAME(MF_MT_MPEG2_FLAGS),
+	GUID_NAME(MF_MT_MPEG_SEQUENCE_HEADER),
+
+	// Device source attributes
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME),
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE),
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_GUID),
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID),
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID),
+	GUID_NAME(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK),
+};
+
+struct GuidName
+{
+	GUID guid;
+	const WCHAR *szName;        // NULL for an empty slot
+};
+
+struct GuidNameTable
+{
+	UINT32 bucketMask;
+	UINT32 slotMask;
+	UINT32 *pSeeds;             // Seed of the second hash, for each bucket
+	GuidName *pSlots;
+	GuidNameTable *pReplaced;   // The table this one replaced
+};
+
+static INIT_ONCE s_guidNamesOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION s_guidNamesLock;    // Serializes registration
+static GuidNameTable * volatile s_pGuidNames = NULL;
+static GuidName *s_pRegistered = NULL;      // Names added at run time
+static UINT32 s_nRegistered = 0;
+
+static UINT32 hashGuid(REFGUID guid, UINT32 seed) {
+	const UINT32 *p = (const UINT32 *)&guid;
+	UINT32 h = seed ^ 0x9E3779B9;
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ p[i]) * 0x01000193;
+		h ^= h >> 15;
+	}
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+static void freeGuidNameTable(GuidNameTable *pTable) {
+	if (pTable) {
+		delete [] pTable->pSeeds;
+		delete [] pTable->pSlots;
+		delete pTable;
+	}
+}
+
+// Places the members of one bucket with the first seed that gives
+// each a free slot of its own.  Returns FALSE if no seed does.
+static BOOL placeGuidBucket(GuidNameTable *pTable, const GuidName *pNames,
+							const UINT32 *pMembers, UINT32 nMembers,
+							UINT32 bucket) {
+	for (UINT32 seed = 1; seed <= GUID_NAME_MAX_SEED; seed++) {
+		UINT32 nPlaced = 0;
+		for (; nPlaced < nMembers; nPlaced++) {
+			const GuidName *pName = &pNames[pMembers[nPlaced]];
+			GuidName *pSlot = &pTable->pSlots[hashGuid(pName->guid, seed) &
+				pTable->slotMask];
+			if (pSlot->szName != NULL) {
+				break;
+			}
+			*pSlot = *pName;
+		}
+		if (nPlaced == nMembers) {
+			pTable->pSeeds[bucket] = seed;
+			return TRUE;
+		}
+		// Take back the members placed with this seed
+		while (nPlaced-- > 0) {
+			pTable->pSlots[hashGuid(pNames[pMembers[nPlaced]].guid, seed) &
+				pTable->slotMask].szName = NULL;
+		}
+	}
+	return FALSE;
+}
+
+// Builds a table with twice as many slots as names, or more if the
+// buckets do not fit.  pNames must not hold a GUID twice.
+static GuidNameTable *buildGuidNameTable(const GuidName *pNames, UINT32 nNames) {
+	UINT32 *pBuckets = new (std::nothrow) UINT32[nNames];
+	UINT32 *pMembers = new (std::nothrow) UINT32[nNames];
+	if (pBuckets == NULL || pMembers == NULL) {
+		delete [] pBuckets;
+		delete [] pMembers;
+		return NULL;
+	}
+
+	UINT32 nSlots = 2;
+	while (nSlots < 2 * nNames) {
+		nSlots *= 2;
+	}
+	GuidNameTable *pTable = NULL;
+	for (; nSlots <= 16 * nNames + 16; nSlots *= 2) {
+		pTable = new (std::nothrow) GuidNameTable;
+		if (pTable == NULL) {
+			break;
+		}
+		UINT32 nBuckets = max(nSlots / 4, 1u);
+		pTable->bucketMask = nBuckets - 1;
+		pTable->slotMask = nSlots - 1;
+		pTable->pSeeds = new (std::nothrow) UINT32[nBuckets];
+		pTable->pSlots = new (std::nothrow) GuidName[nSlots];
+		pTable->pReplaced = NULL;
+		if (pTable->pSeeds == NULL || pTable->pSlots == NULL) {
+			freeGuidNameTable(pTable);
+			pTable = NULL;
+			break;
+		}
+		ZeroMemory(pTable->pSeeds, nBuckets * sizeof(UINT32));
+		ZeroMemory(pTable->pSlots, nSlots * sizeof(GuidName));
+
+		// The largest buckets are the hardest to place, so go first
+		UINT32 nLargest = 0;
+		for (UINT32 i = 0; i < nNames; i++) {
+			pBuckets[i] = hashGuid(pNames[i].guid, 0) & pTable->bucketMask;
+		}
+		for (UINT32 b = 0; b < nBuckets; b++) {
+			UINT32 n = 0;
+			for (UINT32 i = 0; i < nNames; i++) {
+				n += (pBuckets[i] == b);
+			}
+			nLargest = max(nLargest, n);
+		}
+		BOOL bPlaced = TRUE;
+		for (UINT32 size = nLargest; size > 0 && bPlaced; size--) {
+			for (UINT32 b = 0; b < nBuckets && bPlaced; b++) {
+				UINT32 nMembers = 0;
+				for (UINT32 i = 0; i < nNames; i++) {
+					if (pBuckets[i] == b) {
+						pMembers[nMembers++] = i;
+					}
+				}
+				if (nMembers == size) {
+					bPlaced = placeGuidBucket(pTable, pNames, pMembers,
+						nMembers, b);
+				}
+			}
+		}
+		if (bPlaced) {
+			break;
+		}
+		freeGuidNameTable(pTable);
+		pTable = NULL;
+	}
+
+	delete [] pBuckets;
+	delete [] pMembers;
+	return pTable;
+}
+
+// Builds the table from the built-in names and the registered ones.
+// A GUID listed more than once takes its last name.
+static GuidNameTable *buildGuidNames() {
+	UINT32 nMax = ARRAYSIZE(s_guidNames) + s_nRegistered;
+	GuidName *pNames = new (std::nothrow) GuidName[nMax];
+	if (pNames == NULL) {
+		return NULL;
+	}
+	UINT32 nNames = 0;
+	for (UINT32 i = nMax; i-- > 0;) {
+		GuidName name;
+		if (i < ARRAYSIZE(s_guidNames)) {
+			name.guid = *s_guidNames[i].pGuid;
+			name.szName = s_guidNames[i].szName;
+		} else {
+			name = s_pRegistered[i - ARRAYSIZE(s_guidNames)];
+		}
+		UINT32 j = 0;
+		while (j < nNames && !IsEqualGUID(pNames[j].guid, name.guid)) {
+			j++;
+		}
+		if (j == nNames) {
+			pNames[nNames++] = name;
+		}
+	}
+	GuidNameTable *pTable = buildGuidNameTable(pNames, nNames);
+	delete [] pNames;
+	return pTable;
+}
+
+static BOOL CALLBACK initGuidNames(PINIT_ONCE pInitOnce, void *pParameter,
+								   void **ppContext) {
+	InitializeCriticalSection(&s_guidNamesLock);
+	s_pGuidNames = buildGuidNames();
+	return TRUE;
+}
+
+// Returns the name of a GUID, or NULL if it has none.  Allocates
+// nothing, and is safe to call from any thread.
+const WCHAR *lookupGuidName(REFGUID guid) {
+	InitOnceExecuteOnce(&s_guidNamesOnce, initGuidNames, NULL, NULL);
+	const GuidNameTable *pTable = s_pGuidNames;
+	if (pTable == NULL) {
+		return NULL;
+	}
+	UINT32 seed = pTable->pSeeds[hashGuid(guid, 0) & pTable->bucketMask];
+	const GuidName *pSlot = &pTable->pSlots[hashGuid(guid, seed) &
+		pTable->slotMask];
+	if (pSlot->szName != NULL && IsEqualGUID(pSlot->guid, guid)) {
+		return pSlot->szName;
+	}
+	return NULL;
+}
+
+// Adds a name, or replaces the name of a GUID that has one.  szName is
+// not copied and must stay valid.  The table is rebuilt, so this is
+// meant for a few calls at startup.  Tables that are replaced are kept,
+// as lookups on other threads may still be reading them.
+HRESULT registerGuidName(REFGUID guid, const WCHAR *szName) {
+	if (szName == NULL) {
+		return E_INVALIDARG;
+	}
+	InitOnceExecuteOnce(&s_guidNamesOnce, initGuidNames, NULL, NULL);
+
+	HRESULT hr = S_OK;
+	EnterCriticalSection(&s_guidNamesLock);
+	GuidName *pRegistered = new (std::nothrow) GuidName[s_nRegistered + 1];
+	if (pRegistered == NULL) {
+		hr = E_OUTOFMEMORY;
+	} else {
+		if (s_nRegistered > 0) {
+			CopyMemory(pRegistered, s_pRegistered,
+				s_nRegistered * sizeof(GuidName));
+		}
+		pRegistered[s_nRegistered].guid = guid;
+		pRegistered[s_nRegistered].szName = szName;
+		delete [] s_pRegistered;
+		s_pRegistered = pRegistered;
+		s_nRegistered++;
+
+		GuidNameTable *pTable = buildGuidNames();
+		if (pTable == NULL) {
+			s_nRegistered--;
+			hr = E_OUTOFMEMORY;
+		} else {
+			pTable->pReplaced = s_pGuidNames;
+			InterlockedExchangePointer((void * volatile *)&s_pGuidNames, pTable);
+		}
+	}
+	LeaveCriticalSection(&s_guidNamesLock);
+	return hr;
+}
+
+// Writes the name of a GUID, or its registry form if it has none, into
+// a buffer of nChars characters.  Allocates nothing.  Returns
+// STRSAFE_E_INSUFFICIENT_BUFFER if the string was cut short.
+HRESULT formatGuidString(REFGUID guid, WCHAR *szString, int nChars) {
+	const WCHAR *szName = lookupGuidName(guid);
+	if (szName != NULL) {
+		return StringCchCopyW(szString, nChars, szName);
+	}
+	return StringCchPrintfW(szString, nChars,
+		L"{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+		guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1],
+		guid.Data4[2], guid.Data4[3], guid.Data4[4], guid.Data4[5],
+		guid.Data4[6], guid.Data4[7]);
+}
+
+// Returns the name of a GUID, or "Unrecognized"
+const WCHAR *getFriendlyGuidString(GUID guid) {
+	const WCHAR *szName = lookupGuidName(guid);
+	return szName != NULL ? szName : L"Unrecognized";
+}
+
+// Returns a string representation of a GUID into the given buffer
+// with at most nChars characters
+void getFriendlyGuidString(GUID guid, WCHAR *szString, int nChars) {
+	formatGuidString(guid, szString, nChars);
+}
+
+// Returns a string representation of a GUID
+// Needs to be freed with ::CoTaskMemFree(guidString);
+WCHAR *getGuidString(GUID guid) {
+	WCHAR *guidString;
+	StringFromCLSID(guid, &guidString);
+	return guidString;
+}
+
+// The lookup as it was before the table, kept for the benchmark
+static const WCHAR *chainGuidString(GUID guid) {
 	if(guid == MFAudioFormat_Base) {
 		return L"MFAudioFormat_Base";
 	} else if(guid == MFAudioFormat_PCM) {
@@ -35,7 +473,6 @@ WCHAR *getFriendlyGuidString(GUID guid) {
 		return L"MFAudioFormat_AAC";
 	} else if(guid == MFAudioFormat_ADTS) {
 		return L"MFAudioFormat_ADTS";
-		// Major
 	} else if(guid == MFMediaType_Default) {
 		return L"MFMediaType_Default";
 	} else if(guid == MFMediaType_Audio) {
@@ -47,54 +484,119 @@ WCHAR *getFriendlyGuidString(GUID guid) {
 	}
 }
 
-// Returns a string representation of a GUID into the given buffer
-// with at mose nChars characters
-void getFriendlyGuidString(GUID guid, WCHAR *szString, int nChars) {
-	WCHAR *szFriendlyString = getFriendlyGuidString(guid);
-	if(wcscmp(szFriendlyString, L"Unrecognized")) {
-		swprintf_s(szString, nChars, szFriendlyString);
+static void chainGuidString(GUID guid, WCHAR *szString, int nChars) {
+	const WCHAR *szName = chainGuidString(guid);
+	if (wcscmp(szName, L"Unrecognized") != 0) {
+		StringCchCopyW(szString, nChars, szName);
 	} else {
-		WCHAR *guidString = getGuidString(guid);
-		swprintf_s(szString, nChars, guidString);
-		::CoTaskMemFree(guidString);
+		WCHAR *szGuid = getGuidString(guid);
+		StringCchCopyW(szString, nChars, szGuid);
+		CoTaskMemFree(szGuid);
 	}
 }
 
-// Returns a string representation of a GUID
-// Needs to be freed with ::CoTaskMemFree(guidString);
-WCHAR *getGuidString(GUID guid) {
-	WCHAR *guidString;
-	StringFromCLSID(guid, &guidString);
-	return guidString;
+// Times formatting a set of GUIDs with the chain and with the table
+static void timeGuidStrings(const char *szLabel, const GUID *pGuids,
+							UINT32 nGuids, LARGE_INTEGER freq) {
+	const double MIN_SECONDS = 0.25;
+	WCHAR szString[80];
+	double nsPerCall[2];
+
+	for (int iMethod = 0; iMethod < 2; iMethod++) {
+		LARGE_INTEGER tStart, tEnd;
+		ULONGLONG nCalls = 0;
+		double seconds = 0.0;
+		QueryPerformanceCounter(&tStart);
+		do {
+			for (UINT32 i = 0; i < nGuids; i++) {
+				if (iMethod == 0) {
+					chainGuidString(pGuids[i], szString, ARRAYSIZE(szString));
+				} else {
+					formatGuidString(pGuids[i], szString, ARRAYSIZE(szString));
+				}
+			}
+			nCalls += nGuids;
+			QueryPerformanceCounter(&tEnd);
+			seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+		} while (seconds < MIN_SECONDS);
+		nsPerCall[iMethod] = seconds * 1e9 / nCalls;
+	}
+	printf("  %-24s chain %8.1f ns  table %6.1f ns  %6.1fx\n", szLabel,
+		nsPerCall[0], nsPerCall[1], nsPerCall[0] / nsPerCall[1]);
 }
 
-TCHAR *getErrorDescription(HRESULT hr) { 
-	if(FACILITY_WINDOWS == HRESULT_FACILITY(hr)) 
-		hr = HRESULT_CODE(hr); 
-	TCHAR* szErrMsg; 
+// Checks that every built-in name is found and that names can be
+// added, then times the table against the chain it replaced
+void benchmarkGuidNames(void) {
+	const UINT32 N_UNKNOWN = 32;
+	const GUID chainGuids[] = {
+		MFAudioFormat_PCM, MFAudioFormat_Float, MFAudioFormat_AAC,
+		MFAudioFormat_ADTS, MFMediaType_Audio, MFMediaType_Video,
+	};
+	const GUID tableGuids[] = {
+		MFVideoFormat_NV12, MFVideoFormat_H264, MF_MT_FRAME_SIZE,
+		MF_MT_AUDIO_NUM_CHANNELS, MF_MT_SUBTYPE, MF_MT_MAJOR_TYPE,
+	};
 
-	if(FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM, 
-		NULL, hr, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), 
-		(LPTSTR)&szErrMsg, 0, NULL) != 0) { 
-			return szErrMsg;
-	} else {
-		return NULL;
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	UINT32 nMissing = 0;
+	for (UINT32 i = 0; i < ARRAYSIZE(s_guidNames); i++) {
+		const WCHAR *szName = lookupGuidName(*s_guidNames[i].pGuid);
+		if (szName == NULL) {
+			nMissing++;
+		}
+	}
+
+	// GUIDs with no name, and one registered at run time
+	GUID unknownGuids[N_UNKNOWN];
+	srand(1);
+	for (UINT32 i = 0; i < N_UNKNOWN; i++) {
+		BYTE *p = (BYTE *)&unknownGuids[i];
+		for (size_t j = 0; j < sizeof(GUID); j++) {
+			p[j] = (BYTE)rand();
+		}
+	}
+	BOOL bUnknown = FALSE;
+	for (UINT32 i = 0; i < N_UNKNOWN; i++) {
+		bUnknown |= lookupGuidName(unknownGuids[i]) != NULL;
 	}
+	GUID registered = unknownGuids[0];
+	registered.Data1 ^= 1;
+	HRESULT hr = registerGuidName(registered, L"Registered");
+	BOOL bRegistered = SUCCEEDED(hr) &&
+		lookupGuidName(registered) != NULL &&
+		wcscmp(lookupGuidName(registered), L"Registered") == 0 &&
+		lookupGuidName(MFAudioFormat_PCM) != NULL;
+
+	printf("GUID name benchmark, %u names\n", (UINT32)ARRAYSIZE(s_guidNames));
+	printf("  %u names not found, %s, registration %s\n", nMissing,
+		bUnknown ? "unknown GUIDs FOUND" : "unknown GUIDs not found",
+		bRegistered ? "works" : "FAILED");
+	timeGuidStrings("names in the chain", chainGuids, ARRAYSIZE(chainGuids),
+		freq);
+	timeGuidStrings("names not in the chain", tableGuids,
+		ARRAYSIZE(tableGuids), freq);
+	timeGuidStrings("unknown GUIDs", unknownGuids, N_UNKNOWN, freq);
 }
 
-void printErrorDescription(HRESULT hr) { 
-	if(FACILITY_WINDOWS == HRESULT_FACILITY(hr)) 
-		hr = HRESULT_CODE(hr); 
-	TCHAR* szErrMsg; 
+const TCHAR *getErrorDescription(HRESULT hr) {
+	return lookupErrorText(hr);
+}
 
-	if(FormatMessage( 
-		FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM, 
-		NULL, hr, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), 
-		(LPTSTR)&szErrMsg, 0, NULL) != 0) { 
-			_tprintf(TEXT("%s"), szErrMsg); 
-			LocalFree(szErrMsg); 
+void printErrorDescription(HRESULT hr) {
+	ULONG nSuppressed;
+	if (!errorShouldReport(hr, &nSuppressed)) {
+		return;
+	}
+	TCHAR szDescription[MAX_PATH];
+	formatErrorDescription(hr, szDescription, MAX_PATH);
+	if (nSuppressed > 0) {
+		_tprintf(_T("%s (%lu more since the last)\n"), szDescription,
+			nSuppressed);
 	} else {
-		_tprintf( TEXT("[No further information for HRESULT 0x%#X]\n"), hr); 
+		_tprintf(_T("%s\n"), szDescription);
 	}
 }
 
@@ -115,44 +617,37 @@ void shutdownMfCom() {
 
 void ShowMessage(HRESULT hrErr, const TCHAR *format, ...) {
 	const size_t MESSAGE_LEN = 1024;
+	TCHAR szText[MESSAGE_LEN];
 	TCHAR message[MESSAGE_LEN];
+	ULONG nSuppressed;
 
 	va_list vargs;
 	va_start(vargs,format);
-	_vstprintf_s(szDebugString, format, vargs);
+	_vstprintf_s(szText, format, vargs);
 	va_end(vargs);
 
+	// Every occurrence goes to the log; only the first few of a storm
+	// of the same error are shown
+	LOG_ERROR(_T("%s (HRESULT = 0x%X)\n"), szText, hrErr);
+	if (!errorShouldReport(hrErr, &nSuppressed)) {
+		return;
+	}
+
 	// Get the description and add the error part
-	TCHAR *szErrMsg = getErrorDescription(hrErr);
+	TCHAR szErrMsg[MAX_PATH];
+	formatErrorDescription(hrErr, szErrMsg, MAX_PATH);
 
-	HRESULT hr = StringCchPrintf (message, MESSAGE_LEN,
-		_T("%s (HRESULT = 0x%X)\n%s\n"),
-		szDebugString, hrErr,
-		szErrMsg != NULL ? szErrMsg : TEXT("No Further Information"));
+	HRESULT hr;
+	if (nSuppressed > 0) {
+		hr = StringCchPrintf (message, MESSAGE_LEN,
+			_T("%s (HRESULT = 0x%X)\n%s (%lu more since the last)\n"),
+			szText, hrErr, szErrMsg, nSuppressed);
+	} else {
+		hr = StringCchPrintf (message, MESSAGE_LEN,
+			_T("%s (HRESULT = 0x%X)\n%s\n"),
+			szText, hrErr, szErrMsg);
+	}
 	if (SUCCEEDED(hr)) {
 		_tprintf(message);
-#ifdef _DEBUG
-		OutputDebugString(szDebugString);
-#endif
-	}
-
-	// Free the description
-	if(szErrMsg) {
-		LocalFree(szErrMsg);
 	}
 }
-
-int debugMsg(const TCHAR *format, ...)
-{
-	va_list vargs;
-
-	va_start(vargs,format);
-	_vstprintf_s(szDebugString,format,vargs);
-	va_end(vargs);
-
-	if(szDebugString[0] == '\0') return 0;
-
-	// Display the string.
-	OutputDebugString(szDebugString);
-	return 0;
-}
@@ -5,20 +5,22 @@
 #pragma once
 
 #include "stdafx.h"
+#include "debugLog.h"
+#include "errorRegistry.h"
 
-#define PRINT_STRING_SIZE 1024
-// Global string for print routines.  Must be defined somewhere.
-extern TCHAR szDebugString[PRINT_STRING_SIZE];
-
-WCHAR *getFriendlyGuidString(GUID guid);
+const WCHAR *lookupGuidName(REFGUID guid);
+HRESULT registerGuidName(REFGUID guid, const WCHAR *szName);
+HRESULT formatGuidString(REFGUID guid, WCHAR *szString, int nChars);
+const WCHAR *getFriendlyGuidString(GUID guid);
 void getFriendlyGuidString(GUID guid, WCHAR *szString, int nChars);
 OLECHAR *getGuidString(GUID guid);
-TCHAR *getErrorDescription(HRESULT hr);
+const TCHAR *getErrorDescription(HRESULT hr);
 void printErrorDescription(HRESULT hr);
 void initializeMfCom();
 void shutdownMfCom();
 void ShowMessage(HRESULT hrErr, const TCHAR *format, ...);
-int debugMsg(const TCHAR *format, ...);
+// Checks the GUID name table and times it against a chain of comparisons
+void benchmarkGuidNames(void);
 
 // This has to be included in each file that uses it and so is in the header
 template <class T> void SafeRelease(T **ppT) {
@@ -1,6 +1,20 @@
 #include "stdafx.h"
 #include "mfWave.h"
 #include "mfRoutines.h"
+#include "levelMeter.h"
+#include "resampler.h"
+#include "pcmConvert.h"
+#include "flacEncoder.h"
+#include "waveSegments.h"
+#include "activityGate.h"
+
+// Set by StopWaveFiles
+static volatile LONG g_bStopWaveFiles = FALSE;
+
+void StopWaveFiles()
+{
+	InterlockedExchange(&g_bStopWaveFiles, TRUE);
+}
 
 // Selects an audio stream from the source file, and configures the
 // stream to read MFAudioFormat_Float audio
@@ -97,89 +111,313 @@ HRESULT ConfigureWaveReader(
 	return hr;
 }
 
-// Writes a block of data to a file
-// hFile: Handle to the file.
-// buf: Pointer to the buffer to write.
-// count: Size of the buffer, in bytes.
-HRESULT WriteToFile(HANDLE hFile, void* buf, DWORD count) {
-	DWORD countWritten = 0;
-	HRESULT hr = S_OK;
-	BOOL bResult = WriteFile(hFile, buf, count, &countWritten, NULL);
-	if (!bResult) {
-		hr = HRESULT_FROM_WIN32(GetLastError());
-	}
-	return hr;
-}
-
-// Writes the file-size information into the WAVE file header.
-// WAVE files use the RIFF file format. Each RIFF chunk has a data
-// size, and the RIFF header has a total file size.
-HRESULT FixUpChunkSizes(
-						HANDLE hFile,           // Output file.
-						DWORD cbHeader,         // Size of the 'fmt ' chuck.
-						DWORD cbAudioData       // Size of the 'data' chunk.
-						)
+// The file being written: WAV, a series of WAV files, or FLAC when
+// compressing
+struct WaveOutput
 {
-	HRESULT hr = S_OK;
-	LARGE_INTEGER ll;
-	ll.QuadPart = cbHeader - sizeof(DWORD);
-	if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN)) {
-		hr = HRESULT_FROM_WIN32(GetLastError());
+	WaveFile *pWaveFile;
+	FlacFile *pFlacFile;
+	SegmentedWaveFile *pSegmentedFile;
+
+	HRESULT Write(const void *pData, DWORD cbData) {
+		if (pSegmentedFile) {
+			return pSegmentedFile->Write(pData, cbData);
+		}
+		return pFlacFile ? pFlacFile->Write(pData, cbData) :
+			pWaveFile->Write(pData, cbData);
 	}
 
-	// Write the data size.
-	if (SUCCEEDED(hr)) {
-		hr = WriteToFile(hFile, &cbAudioData, sizeof(cbAudioData));
-	} else {
-		printf("Error in WriteToFile: cbAudioData\n");
-		printErrorDescription(hr);
+	HRESULT WriteSegments(const BufferSegment *pSegments, DWORD nSegments) {
+		if (pSegmentedFile) {
+			return pSegmentedFile->WriteSegments(pSegments, nSegments);
+		}
+		if (pFlacFile == NULL) {
+			return pWaveFile->WriteSegments(pSegments, nSegments);
+		}
+		HRESULT hr = S_OK;
+		for (DWORD i = 0; i < nSegments && SUCCEEDED(hr); i++) {
+			hr = pFlacFile->Write(pSegments[i].pData, pSegments[i].cbData);
+		}
 		return hr;
 	}
+};
+
+// Writes a block of float audio data, up to the maximum, metering it
+// and converting it to the file format first if asked.
+static HRESULT WriteWaveBlock(
+							  WaveOutput *pOutput,        // Output file.
+							  const BYTE *pData,          // Float audio data.
+							  DWORD cbData,               // Size of the audio data.
+							  ULONGLONG cbMaxAudioData,   // Maximum amount of audio data (bytes).
+							  LevelMeter *pMeter,         // Meters the data written, may be NULL.
+							  PcmConverter *pConverter,   // Converts to integer PCM, may be NULL.
+							  BYTE **ppConverted,         // Conversion buffer, grown as needed.
+							  DWORD *pcbConverted,        // Size of the conversion buffer.
+							  ULONGLONG *pcbAudioData     // Running total of data written.
+							  )
+{
+	if (pConverter == NULL) {
+		// Make sure not to exceed the specified maximum size.
+		if (cbMaxAudioData - *pcbAudioData < cbData) {
+			cbData = (DWORD)(cbMaxAudioData - *pcbAudioData);
+		}
+		HRESULT hr = pOutput->Write(pData, cbData);
+		if (FAILED(hr)) {
+			return hr;
+		}
+		if (pMeter) {
+			pMeter->Process(pData, cbData);
+		}
+		*pcbAudioData += cbData;
+		return S_OK;
+	}
 
-	if (SUCCEEDED(hr)) {
-		// Write the file size.
-		ll.QuadPart = sizeof(FOURCC);
-		if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN)) {
-			hr = HRESULT_FROM_WIN32(GetLastError());
+	// The maximum is in file bytes, so clip whole frames of the output
+	UINT32 cbOutFrame = pConverter->BytesPerFrame();
+	UINT32 nFrames = cbData / (pConverter->Channels() * sizeof(float));
+	if ((cbMaxAudioData - *pcbAudioData) / cbOutFrame < nFrames) {
+		nFrames = (UINT32)((cbMaxAudioData - *pcbAudioData) / cbOutFrame);
+	}
+	DWORD cbOut = nFrames * cbOutFrame;
+	if (cbOut > *pcbConverted) {
+		delete [] *ppConverted;
+		*ppConverted = new (std::nothrow) BYTE[cbOut];
+		if (*ppConverted == NULL) {
+			*pcbConverted = 0;
+			return E_OUTOFMEMORY;
 		}
+		*pcbConverted = cbOut;
 	}
 
-	if (SUCCEEDED(hr)) {
-		DWORD cbRiffFileSize = cbHeader + cbAudioData - 8;
-		// NOTE: The "size" field in the RIFF header does not include
-		// the first 8 bytes of the file. (That is, the size of the
-		// data that appears after the size field.)
-		hr = WriteToFile(hFile, &cbRiffFileSize, sizeof(cbRiffFileSize));
-	} else {
-		printf("Error in WriteToFile: cbRiffFileSize\n");
-		printErrorDescription(hr);
+	if (pMeter) {
+		pMeter->Process(pData, nFrames * pConverter->Channels() * sizeof(float));
+	}
+	pConverter->Convert((const float *)pData, nFrames, *ppConverted);
+	HRESULT hr = pOutput->Write(*ppConverted, cbOut);
+	if (FAILED(hr)) {
 		return hr;
 	}
+	*pcbAudioData += cbOut;
+	return S_OK;
+}
 
+// Everything WriteWaveBlock needs, so the activity gate can call it
+struct GatedWrite
+{
+	WaveOutput *pOutput;
+	ULONGLONG cbMaxAudioData;
+	LevelMeter *pMeter;
+	PcmConverter *pConverter;
+	BYTE **ppConverted;
+	DWORD *pcbConverted;
+	ULONGLONG *pcbAudioData;
+	UINT32 cbFrame;             // Size of a float frame.
+	ULONGLONG nMaxGateFrames;   // Frames of the recording length.
+};
+
+// Writes the frames the activity gate lets through
+static HRESULT WriteGatedFrames(const float *pFrames, UINT32 nFrames,
+								void *pContext)
+{
+	GatedWrite *pWrite = (GatedWrite *)pContext;
+	return WriteWaveBlock(pWrite->pOutput, (const BYTE *)pFrames,
+		nFrames * pWrite->cbFrame, pWrite->cbMaxAudioData, pWrite->pMeter,
+		pWrite->pConverter, pWrite->ppConverted, pWrite->pcbConverted,
+		pWrite->pcbAudioData);
+}
 
-	return hr;
+// Writes a block of float audio data, or passes it through the
+// activity gate if there is one.  The gate is given no more than the
+// recording length, whether it writes it all or not.
+static HRESULT WriteGatedBlock(
+							   GatedWrite *pWrite,     // Output and limits.
+							   ActivityGate *pGate,    // Skips idle audio, may be NULL.
+							   const BYTE *pData,      // Float audio data.
+							   DWORD cbData            // Size of the audio data.
+							   )
+{
+	if (pGate == NULL) {
+		return WriteWaveBlock(pWrite->pOutput, pData, cbData,
+			pWrite->cbMaxAudioData, pWrite->pMeter, pWrite->pConverter,
+			pWrite->ppConverted, pWrite->pcbConverted, pWrite->pcbAudioData);
+	}
+	ULONGLONG nFrames = cbData / pWrite->cbFrame;
+	if (pWrite->nMaxGateFrames - pGate->InputFrames() < nFrames) {
+		nFrames = pWrite->nMaxGateFrames - pGate->InputFrames();
+	}
+	return pGate->Process((const float *)pData, (UINT32)nFrames);
+}
+
+// Makes sure the resampling buffer holds nFrames frames
+static HRESULT GrowResampleBuffer(
+								  float **ppBuffer,       // The buffer, reallocated if too small.
+								  UINT32 *pnFrames,       // Frames it holds.
+								  UINT32 nFrames,         // Frames needed.
+								  UINT32 nChannels        // Channels per frame.
+								  )
+{
+	if (nFrames <= *pnFrames) {
+		return S_OK;
+	}
+	delete [] *ppBuffer;
+	*ppBuffer = new (std::nothrow) float[nFrames * nChannels];
+	if (*ppBuffer == NULL) {
+		*pnFrames = 0;
+		return E_OUTOFMEMORY;
+	}
+	*pnFrames = nFrames;
+	return S_OK;
+}
+
+// A frame split across the buffers of a sample, or between samples,
+// held until the rest of it arrives
+struct SplitFrame
+{
+	BYTE *pData;                // cbFrame bytes.
+	DWORD cbData;               // Bytes of the frame held so far.
+	DWORD cbFrame;              // Size of a frame.
+};
+
+// Meters and analyzes whole frames, which is all the meter and the
+// analyzer take
+static void AnalyzeFrames(
+						  const BYTE *pData,          // Whole frames.
+						  DWORD cbData,               // Size of the frames.
+						  LevelMeter *pMeter,         // May be NULL.
+						  SpectrumAnalyzer *pSpectrum // May be NULL.
+						  )
+{
+	if (cbData == 0) {
+		return;
+	}
+	if (pMeter) {
+		pMeter->Process(pData, cbData);
+	}
+	if (pSpectrum) {
+		pSpectrum->Push(pData, cbData);
+	}
+}
+
+// Meters and analyzes the buffers of a sample as one run of frames.
+// A buffer need not end on a frame, so the frame that straddles two
+// buffers, or two samples, is put together in pSplit first.
+static void AnalyzeSegments(
+							const BufferSegment *pSegments, // Buffers of the sample.
+							DWORD nSegments,            // Number of buffers.
+							SplitFrame *pSplit,         // The frame carried over.
+							LevelMeter *pMeter,         // May be NULL.
+							SpectrumAnalyzer *pSpectrum // May be NULL.
+							)
+{
+	if (pMeter == NULL && pSpectrum == NULL) {
+		return;
+	}
+	for (DWORD i = 0; i < nSegments; i++) {
+		const BYTE *pData = pSegments[i].pData;
+		DWORD cbData = pSegments[i].cbData;
+
+		// Finish the frame begun in an earlier buffer
+		if (pSplit->cbData > 0) {
+			DWORD cbCopy = min(cbData, pSplit->cbFrame - pSplit->cbData);
+			CopyMemory(pSplit->pData + pSplit->cbData, pData, cbCopy);
+			pSplit->cbData += cbCopy;
+			pData += cbCopy;
+			cbData -= cbCopy;
+			if (pSplit->cbData < pSplit->cbFrame) {
+				continue;
+			}
+			AnalyzeFrames(pSplit->pData, pSplit->cbFrame, pMeter, pSpectrum);
+			pSplit->cbData = 0;
+		}
+
+		// The whole frames in place, then keep the start of the next
+		DWORD cbWhole = cbData - cbData % pSplit->cbFrame;
+		AnalyzeFrames(pData, cbWhole, pMeter, pSpectrum);
+		pSplit->cbData = cbData - cbWhole;
+		CopyMemory(pSplit->pData, pData + cbWhole, pSplit->cbData);
+	}
 }
 
 // Decodes audio data from the source file and writes it to
 // the WAVE file.
 HRESULT WriteWaveData(
-					  HANDLE hFile,               // Output file.
+					  WaveOutput *pOutput,        // Output file.
 					  IMFSourceReader *pReader,   // Source reader.
-					  DWORD cbMaxAudioData,       // Maximum amount of audio data (bytes).
-					  DWORD *pcbDataWritten       // Receives the amount of data written.
+					  ULONGLONG cbMaxAudioData,   // Maximum amount of audio data (bytes).
+					  LevelMeter *pMeter,         // Meters the data written, may be NULL.
+					  Resampler *pResampler,      // Converts the rate first, may be NULL.
+					  PcmConverter *pConverter,   // Converts to integer PCM last, may be NULL.
+					  ActivityGate *pGate,        // Skips idle audio, may be NULL.
+					  SpectrumAnalyzer *pSpectrum, // Analyzes the captured audio, may be NULL.
+					  ULONGLONG *pcbDataWritten,  // Receives the amount of data written.
+					  ULONGLONG *pcbLinearized    // Receives the bytes copied joining sample buffers.
 					  )
 {
 	HRESULT hr = S_OK;
-	DWORD cbAudioData = 0;
+	ULONGLONG cbAudioData = 0;
 	DWORD cbBuffer = 0;
 	BYTE *pAudioData = NULL;
 	IMFSample *pSample = NULL;
 	IMFMediaBuffer *pBuffer = NULL;
+	float *pResampled = NULL;
+	UINT32 nResampled = 0;
+	BYTE *pConverted = NULL;
+	DWORD cbConverted = 0;
+	BOOL bEndOfStream = FALSE;
+	UINT32 cbFrame = pResampler ? pResampler->Channels() * sizeof(float) : 0;
+	SampleBuffers buffers;
+	ULONGLONG cbLinearized = 0;
+	GatedWrite write = { pOutput, cbMaxAudioData, pMeter, pConverter,
+		&pConverted, &cbConverted, &cbAudioData, cbFrame, MAXULONGLONG };
+	SplitFrame split = { NULL, 0, 0 };
+
+	// The gate is given the recording length in frames, and writes
+	// what it lets through here
+	if (pGate) {
+		write.cbFrame = pGate->Channels() * sizeof(float);
+		if (cbMaxAudioData != MAXULONGLONG) {
+			write.nMaxGateFrames = cbMaxAudioData / (pConverter ?
+				pConverter->BytesPerFrame() : write.cbFrame);
+		}
+		pGate->SetOutput(WriteGatedFrames, NULL, &write);
+	}
+
+	// Without conversion or gating, the meter and the analyzer see the
+	// buffers of each sample in place, and need the frame size of the
+	// reader to put together frames that straddle them
+	if (pResampler == NULL && pConverter == NULL && pGate == NULL &&
+		(pMeter || pSpectrum)) {
+		IMFMediaType *pReaderType = NULL;
+		hr = pReader->GetCurrentMediaType(
+			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, &pReaderType);
+		if (SUCCEEDED(hr)) {
+			split.cbFrame = MFGetAttributeUINT32(pReaderType,
+				MF_MT_AUDIO_BLOCK_ALIGNMENT, 0);
+			if (split.cbFrame == 0) {
+				hr = MF_E_INVALIDMEDIATYPE;
+			}
+		}
+		if (SUCCEEDED(hr)) {
+			split.pData = new (std::nothrow) BYTE[split.cbFrame];
+			if (split.pData == NULL) {
+				hr = E_OUTOFMEMORY;
+			}
+		}
+		SafeRelease(&pReaderType);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
 
 	// Get audio samples from the source reader.
 	while (true) {
 		DWORD dwFlags = 0;
 
+		if (g_bStopWaveFiles) {
+			printf("Stopped.\n");
+			break;
+		}
+
 		// Read the next sample.
 		hr = pReader->ReadSample(
 			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM,
@@ -193,6 +431,7 @@ HRESULT WriteWaveData(
 		}
 		if (dwFlags & MF_SOURCE_READERF_ENDOFSTREAM) {
 			printf("End of input file.\n");
+			bEndOfStream = TRUE;
 			break;
 		}
 
@@ -201,20 +440,63 @@ HRESULT WriteWaveData(
 			continue;
 		}
 
-		// Get a pointer to the audio data in the sample.
+		// Without conversion or gating, the buffers of the sample are
+		// written from where they are rather than joined first.
+		if (pResampler == NULL && pConverter == NULL && pGate == NULL) {
+			hr = buffers.Lock(pSample);
+			if (FAILED(hr)) { break; }
+			cbLinearized += buffers.CopiedSize();
+			DWORD cbData = buffers.Truncate((DWORD)min(cbMaxAudioData - cbAudioData,
+				(ULONGLONG)MAXDWORD));
+			hr = pOutput->WriteSegments(buffers.Segments(), buffers.Count());
+			if (SUCCEEDED(hr)) {
+				AnalyzeSegments(buffers.Segments(), buffers.Count(), &split,
+					pMeter, pSpectrum);
+			}
+			buffers.Unlock();
+			if (FAILED(hr)) { break; }
+
+			cbAudioData += cbData;
+			if (cbAudioData >= cbMaxAudioData) {
+				break;
+			}
+			SafeRelease(&pSample);
+			continue;
+		}
+
+		// Get a pointer to the audio data in the sample.  The conversions
+		// need it in one piece.
 		hr = pSample->ConvertToContiguousBuffer(&pBuffer);
 		if (FAILED(hr)) { break; }
 
 		hr = pBuffer->Lock(&pAudioData, NULL, &cbBuffer);
 		if (FAILED(hr)) { break; }
 
-		// Make sure not to exceed the specified maximum size.
-		if (cbMaxAudioData - cbAudioData < cbBuffer) {
-			cbBuffer = cbMaxAudioData - cbAudioData;
+		DWORD nBuffers = 0;
+		if (SUCCEEDED(pSample->GetBufferCount(&nBuffers)) && nBuffers > 1) {
+			cbLinearized += cbBuffer;
 		}
 
-		// Write this data to the output file.
-		hr = WriteToFile(hFile, pAudioData, cbBuffer);
+		// The analysis sees the audio as captured
+		if (pSpectrum) {
+			pSpectrum->Push(pAudioData, cbBuffer);
+		}
+
+		// Write this data to the output file, converting the rate
+		// first if asked.
+		if (pResampler) {
+			UINT32 nFrames = cbBuffer / cbFrame;
+			UINT32 nMaxOut = pResampler->MaxOutputFrames(nFrames);
+			hr = GrowResampleBuffer(&pResampled, &nResampled, nMaxOut,
+				pResampler->Channels());
+			if (FAILED(hr)) { break; }
+			UINT32 nOut = pResampler->Process((const float *)pAudioData,
+				nFrames, pResampled, nMaxOut);
+			hr = WriteGatedBlock(&write, pGate, (const BYTE *)pResampled,
+				nOut * cbFrame);
+		} else {
+			hr = WriteGatedBlock(&write, pGate, pAudioData, cbBuffer);
+		}
 
 		if (FAILED(hr)) { break; }
 
@@ -224,10 +506,8 @@ HRESULT WriteWaveData(
 
 		if (FAILED(hr)) { break; }
 
-		// Update running total of audio data.
-		cbAudioData += cbBuffer;
-
-		if (cbAudioData >= cbMaxAudioData) {
+		if (cbAudioData >= cbMaxAudioData ||
+			(pGate && pGate->InputFrames() >= write.nMaxGateFrames)) {
 			break;
 		}
 
@@ -235,15 +515,36 @@ HRESULT WriteWaveData(
 		SafeRelease(&pBuffer);
 	}
 
+	// Write what the resampler is still holding for the end of the
+	// input
+	if (SUCCEEDED(hr) && pResampler && bEndOfStream) {
+		while (cbAudioData < cbMaxAudioData) {
+			UINT32 nOut = pResampler->Flush(pResampled, nResampled);
+			if (nOut == 0) { break; }
+			hr = WriteGatedBlock(&write, pGate, (const BYTE *)pResampled,
+				nOut * cbFrame);
+			if (FAILED(hr)) { break; }
+		}
+	}
+
+	// Decide on what the gate is holding back
+	if (SUCCEEDED(hr) && pGate) {
+		hr = pGate->Flush();
+	}
+
 	if (SUCCEEDED(hr)) {
-		printf("Wrote %d bytes of audio data.\n", cbAudioData);
+		printf("Wrote %I64u bytes of audio data.\n", cbAudioData);
 		*pcbDataWritten = cbAudioData;
+		*pcbLinearized = cbLinearized;
 	}
 
 	if (pAudioData) {
 		pBuffer->Unlock();
 	}
 
+	delete [] pResampled;
+	delete [] pConverted;
+	delete [] split.pData;
 	SafeRelease(&pBuffer);
 	SafeRelease(&pSample);
 	return hr;
@@ -251,12 +552,12 @@ HRESULT WriteWaveData(
 
 
 // Calculates how much audio to write to the WAVE file, given the
-// audio format and the maximum duration of the WAVE file.
-DWORD CalculateMaxAudioDataSize(
-								IMFMediaType *pReaderType,    // The audio format.
-								DWORD cbHeader,              // The size of the WAVE file header.
-								DWORD msecAudioData          // Maximum duration, in milliseconds.
-								)
+// audio format and the maximum duration of the WAVE file.  There is no
+// 32-bit limit, as WaveFile switches to RF64 for large files.
+ULONGLONG CalculateMaxAudioDataSize(
+									IMFMediaType *pReaderType,    // The audio format.
+									DWORD msecAudioData           // Maximum duration, in milliseconds.
+									)
 {
 	UINT32 cbBlockSize = 0;         // Audio frame size, in bytes.
 	UINT32 cbBytesPerSecond = 0;    // Bytes per second.
@@ -266,16 +567,8 @@ DWORD CalculateMaxAudioDataSize(
 	cbBytesPerSecond = MFGetAttributeUINT32(pReaderType, MF_MT_AUDIO_AVG_BYTES_PER_SECOND, 0);
 
 	// Calculate the maximum amount of audio data to write.
-	// This value equals (duration in seconds x bytes/second), but cannot
-	// exceed the maximum size of the data chunk in the WAVE file.
-	// Size of the desired audio clip in bytes:
-	DWORD cbAudioClipSize = (DWORD)MulDiv(cbBytesPerSecond, msecAudioData, 1000);
-
-	// Largest possible size of the data chunk:
-	DWORD cbMaxSize = MAXDWORD - cbHeader;
-
-	// Maximum size altogether.
-	cbAudioClipSize = min(cbAudioClipSize, cbMaxSize);
+	// This value equals (duration in seconds x bytes/second).
+	ULONGLONG cbAudioClipSize = (ULONGLONG)cbBytesPerSecond * msecAudioData / 1000;
 
 	// Round to the audio block size, so that we do not write a partial audio frame.
 	cbAudioClipSize = (cbAudioClipSize / cbBlockSize) * cbBlockSize;
@@ -283,49 +576,23 @@ DWORD CalculateMaxAudioDataSize(
 	return cbAudioClipSize;
 }
 
-// Write the WAVE file header.
-// Note: This function writes placeholder values for the file size
-// and data size, as these values will need to be filled in later.
-HRESULT WriteWaveHeader(
-						HANDLE hFile,               // Output file.
-						IMFMediaType *pMediaType,   // The audio format.
-						DWORD *pcbWritten           // Receives the size of the header.
-						)
+// Creates the WAVE file and writes its header.
+HRESULT OpenWaveFile(
+					 WaveFile *pWaveFile,        // The file to open.
+					 WCHAR *szFileName,          // Name of the output file.
+					 IMFMediaType *pMediaType    // The audio format.
+					 )
 {
 	HRESULT hr = S_OK;
 	UINT32 cbFormat = 0;
 	WAVEFORMATEX *pWav = NULL;
-	*pcbWritten = 0;
 
 	// Convert the audio format into a WAVEFORMATEX structure.
 	hr = MFCreateWaveFormatExFromMFMediaType(pMediaType, &pWav, &cbFormat);
 
-	// Write the 'RIFF' header and the start of the 'fmt ' chunk.
+	// Create the file and write the header
 	if (SUCCEEDED(hr))  {
-		DWORD header[] = {
-			// RIFF header
-			FCC('RIFF'),
-			0,
-			FCC('WAVE'),
-			// Start of 'fmt ' chunk
-			FCC('fmt '),
-			cbFormat
-		};
-		DWORD dataHeader[] = { FCC('data'), 0 };
-		hr = WriteToFile(hFile, header, sizeof(header));
-
-		// Write the WAVEFORMATEX structure.
-		if (SUCCEEDED(hr)) {
-			hr = WriteToFile(hFile, pWav, cbFormat);
-		}
-
-		// Write the start of the 'data' chunk
-		if (SUCCEEDED(hr)) {
-			hr = WriteToFile(hFile, dataHeader, sizeof(dataHeader));
-		}
-		if (SUCCEEDED(hr)) {
-			*pcbWritten = sizeof(header) + cbFormat + sizeof(dataHeader);
-		}
+		hr = pWaveFile->Open(szFileName, pWav, cbFormat);
 	}
 
 	CoTaskMemFree(pWav);
@@ -336,24 +603,46 @@ HRESULT WriteWaveHeader(
 HRESULT WriteWaveFile(
 					  IMFSourceReader *pReader,   // Pointer to the source reader.
 					  WCHAR *szFileName,           // Name of the output file.
-					  LONG msecAudioData          // Maximum amount of audio data to write, in msec.
+					  LONG msecAudioData,         // Maximum amount of audio data to write, in msec.
+					  const WaveFileOptions *pOptions,  // Write options, NULL for defaults.
+					  const ResampleOptions *pResample, // Rate to write, NULL to keep the device rate.
+					  const PcmOptions *pPcm,     // Sample format to write, NULL for float.
+					  const FlacOptions *pFlac,   // Compress to FLAC, NULL to write WAV.
+					  const SegmentOptions *pSegments, // Split into files, NULL for one.
+					  const ActivityOptions *pActivity, // Skip idle audio, NULL to write it all.
+					  const SpectrumOptions *pSpectrum  // Analyze the spectrum, NULL not to.
 					  )
 {
 	HRESULT hr = S_OK;
-	DWORD cbHeader = 0;         // Size of the WAVE file header, in bytes.
-	DWORD cbAudioData = 0;      // Total bytes of audio data written to the file.
-	DWORD cbMaxAudioData = 0;
+	ULONGLONG cbAudioData = 0;  // Total bytes of audio data written to the file.
+	ULONGLONG cbLinearized = 0; // Bytes copied to join sample buffers.
+	ULONGLONG cbMaxAudioData = 0;
 	IMFMediaType *pReaderType = NULL;    // Represents the incoming audio format.
+	IMFMediaType *pFileType = NULL;      // The format written to the file.
+	WaveFile waveFile;
+	FlacFile flacFile;
+	SegmentedWaveFile segmentedFile;
+	WaveOutput output = { &waveFile, NULL, NULL };
+	LevelMeter meter;
+	Resampler resampler;
+	Resampler *pResampler = NULL;
+	PcmConverter converter;
+	PcmConverter *pConverter = NULL;
+	ActivityGate gate;
+	ActivityGate *pGate = NULL;
+	SpectrumAnalyzer analyzer;
+	SpectrumAnalyzer *pAnalyzer = NULL;
+	WAVEFORMATEXTENSIBLE wavPcm;
+	UINT32 cbPcmFormat = 0;
+	PcmFormat format = pPcm ? pPcm->format : PCM_FORMAT_FLOAT32;
+	PcmDither dither = pPcm ? pPcm->dither : PCM_DITHER_TPDF;
+	BOOL bFlac = (pFlac && pFlac->bEnabled);
+	BOOL bSegmented = (pSegments && pSegments->IsEnabled());
+	WAVEFORMATEX *pWav = NULL;
+	UINT32 cbWav = 0;
 
-	// Create the output file
-	HANDLE hFile = INVALID_HANDLE_VALUE;
-	hFile = CreateFileW(szFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
-		CREATE_ALWAYS, 0, NULL);
-	if (hFile == INVALID_HANDLE_VALUE) {
-		hr = HRESULT_FROM_WIN32(GetLastError());
-		wprintf(L"Cannot create output file: %s\n", szFileName, hr);
-		goto CLEANUP;
-	}
+	// ConfigureWaveReader asks for float samples
+	meter.SetFormat(LEVEL_FORMAT_FLOAT32);
 
 	// Configure the source reader
 	hr = ConfigureWaveReader(pReader, &pReaderType);
@@ -362,27 +651,252 @@ HRESULT WriteWaveFile(
 		goto CLEANUP;
 	}
 
-	// Write the WAVE file header.
-	if (SUCCEEDED(hr)) {
-		hr = WriteWaveHeader(hFile, pReaderType, &cbHeader);
+	// Set up the rate conversion, if the device rate is not the one
+	// wanted or its clock needs correcting
+	pFileType = pReaderType;
+	pFileType->AddRef();
+	if (pResample && pResample->nSampleRate != 0) {
+		UINT32 nInRate = MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_SAMPLES_PER_SECOND, 0);
+		UINT32 nChannels = MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_NUM_CHANNELS, 0);
+		if (nInRate != pResample->nSampleRate || pResample->driftPpm != 0.0) {
+			hr = resampler.Initialize(nInRate, pResample->nSampleRate,
+				nChannels, pResample->quality);
+			if (SUCCEEDED(hr)) {
+				resampler.SetDrift(pResample->driftPpm);
+				SafeRelease(&pFileType);
+				hr = CreateResampledType(pReaderType, pResample->nSampleRate,
+					&pFileType);
+			}
+			if (FAILED(hr)) {
+				ShowMessage(hr, _T("Resampler setup failed"));
+				goto CLEANUP;
+			}
+			pResampler = &resampler;
+			printf("Resampling %u Hz to %u Hz, %s quality, %u taps (%s)\n",
+				nInRate, pResample->nSampleRate,
+				Resampler::QualityName(pResample->quality), resampler.Taps(),
+				resampler.KernelName());
+		}
+	}
+
+	// FLAC stores integers of up to 24 bits, so float is converted to
+	// 24-bit
+	if (bFlac) {
+		if (format == PCM_FORMAT_FLOAT32) {
+			format = PCM_FORMAT_INT24;
+		} else if (format == PCM_FORMAT_INT32) {
+			hr = E_INVALIDARG;
+			ShowMessage(hr, _T("FLAC files must be int16 or int24"));
+			goto CLEANUP;
+		}
+		if (bSegmented) {
+			hr = E_INVALIDARG;
+			ShowMessage(hr, _T("Only WAV output can be split into segments"));
+			goto CLEANUP;
+		}
+	}
+
+	// Set up the conversion to integer samples, which is done last so
+	// the resampler and meter work on the float data
+	if (format != PCM_FORMAT_FLOAT32) {
+		hr = converter.Initialize(MFGetAttributeUINT32(pFileType,
+			MF_MT_AUDIO_NUM_CHANNELS, 0), format, dither);
+		if (SUCCEEDED(hr)) {
+			hr = CreatePcmWaveFormat(pFileType, format, &wavPcm,
+				&cbPcmFormat);
+		}
+		if (FAILED(hr)) {
+			ShowMessage(hr, _T("PCM conversion setup failed"));
+			goto CLEANUP;
+		}
+		pConverter = &converter;
+		printf("Writing %s samples, %s dither (%s)\n",
+			PcmConverter::FormatName(format),
+			PcmConverter::DitherName(format == PCM_FORMAT_INT32 ?
+				PCM_DITHER_NONE : dither),
+			LevelMeter::KernelName(converter.Kernel()));
+	}
+
+	// Set up the activity gate, which works on the float data at the
+	// file rate
+	if (pActivity && pActivity->bEnabled) {
+		hr = gate.Initialize(MFGetAttributeUINT32(pFileType,
+			MF_MT_AUDIO_SAMPLES_PER_SECOND, 0), MFGetAttributeUINT32(pFileType,
+			MF_MT_AUDIO_NUM_CHANNELS, 0), *pActivity);
+		if (FAILED(hr)) {
+			ShowMessage(hr, _T("Activity gate setup failed"));
+			goto CLEANUP;
+		}
+		pGate = &gate;
+		printf("Skipping idle audio, %.0f dB over the noise floor, "
+			"%u ms before and %u ms after\n", pActivity->thresholdDb,
+			pActivity->msecPrePad, pActivity->msecPostPad);
+	}
+
+	// Set up the spectrum analysis, which works on the float data at
+	// the device rate, ahead of any conversion
+	if (pSpectrum && pSpectrum->bEnabled) {
+		hr = analyzer.Initialize(MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_SAMPLES_PER_SECOND, 0), MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_NUM_CHANNELS, 0), LEVEL_FORMAT_FLOAT32, *pSpectrum);
+		if (FAILED(hr)) {
+			ShowMessage(hr, _T("Spectrum analysis setup failed"));
+			goto CLEANUP;
+		}
+		pAnalyzer = &analyzer;
+		printf("Analyzing the spectrum, %u-point frames every %u samples "
+			"in %u bands (%s)\n", pSpectrum->nFftSize, pSpectrum->nHop,
+			analyzer.BandCount(), LevelMeter::KernelName(analyzer.Kernel()));
+	}
+
+	// Calculate the maximum amount of audio to decode, in bytes.  A
+	// length of 0 records until StopWaveFiles.
+	cbMaxAudioData = CalculateMaxAudioDataSize(pFileType, msecAudioData);
+	if (pConverter) {
+		// Whole float frames convert to whole file frames
+		cbMaxAudioData = cbMaxAudioData / sizeof(float) *
+			PcmConverter::BytesPerSample(format);
+	}
+	if (msecAudioData == 0) {
+		cbMaxAudioData = MAXULONGLONG;
+	}
+
+	// Create the output file and write the WAVE or FLAC file header.
+	// A mapped file without a budget is allocated for the whole
+	// recording, or for one segment.
+	if (pOptions) {
+		WaveFileOptions options = *pOptions;
+		if (options.bMapped && options.cbPreallocate == 0 &&
+			msecAudioData != 0) {
+			options.cbPreallocate = cbMaxAudioData;
+		}
+		waveFile.SetOptions(options);
+		if (bSegmented) {
+			segmentedFile.SetOptions(options, *pSegments);
+		}
+	} else if (bSegmented) {
+		segmentedFile.SetOptions(WaveFileOptions(), *pSegments);
+	}
+	if (bSegmented) {
+		if (pConverter) {
+			hr = segmentedFile.Open(szFileName, &wavPcm.Format, cbPcmFormat);
+		} else {
+			hr = MFCreateWaveFormatExFromMFMediaType(pFileType, &pWav, &cbWav);
+			if (SUCCEEDED(hr)) {
+				hr = segmentedFile.Open(szFileName, pWav, cbWav);
+			}
+		}
+		output.pSegmentedFile = &segmentedFile;
+	} else if (bFlac) {
+		hr = flacFile.Open(szFileName, wavPcm.Format.nSamplesPerSec,
+			wavPcm.Format.nChannels, wavPcm.Format.wBitsPerSample, *pFlac);
+		output.pFlacFile = &flacFile;
+	} else if (pConverter) {
+		hr = waveFile.Open(szFileName, &wavPcm.Format, cbPcmFormat);
+	} else {
+		hr = OpenWaveFile(&waveFile, szFileName, pFileType);
+	}
+	if (FAILED(hr)) {
+		wprintf(L"Cannot create output file: %s\n", szFileName);
+		goto CLEANUP;
+	}
+	if (bFlac) {
+		printf("Compressing to FLAC, LPC order %u, %d encoder thread(s)\n",
+			pFlac->nMaxLpcOrder, flacFile.ThreadCount());
+	}
+	if (bSegmented) {
+		printf("Splitting into files of %I64u bytes\n",
+			segmentedFile.SegmentSize());
+	}
+	if (pGate) {
+		hr = gate.OpenLog(szFileName);
+		if (FAILED(hr)) {
+			ShowMessage(hr, _T("Cannot create the skipped audio list"));
+			goto CLEANUP;
+		}
 	}
 
-	// Calculate the maximum amount of audio to decode, in bytes and decode
+	// Decode audio data to the file.
 	if (SUCCEEDED(hr)) {
-		cbMaxAudioData = CalculateMaxAudioDataSize(pReaderType, cbHeader, msecAudioData);
-		// Decode audio data to the file.
-		hr = WriteWaveData(hFile, pReader, cbMaxAudioData, &cbAudioData);
+		hr = WriteWaveData(&output, pReader, cbMaxAudioData, &meter,
+			pResampler, pConverter, pGate, pAnalyzer, &cbAudioData,
+			&cbLinearized);
+	}
+
+	// Finish the analysis and print the average spectrum
+	if (SUCCEEDED(hr) && pAnalyzer) {
+		hr = analyzer.Stop();
+		printSpectrum("Spectrum", analyzer);
+	}
+
+	// Report how much the gate left out
+	if (SUCCEEDED(hr) && pGate) {
+		hr = gate.CloseLog();
+		printf("Wrote %I64u of %I64u frames (%.1f%%), skipping %u idle "
+			"stretch(es).\n", gate.WrittenFrames(), gate.InputFrames(),
+			100.0 * gate.WrittenFrames() / max(gate.InputFrames(), 1ULL),
+			gate.GapCount());
+		wprintf(L"Skipped audio is listed in %s\n", gate.LogName());
+	}
+
+	// Finish the FLAC stream and fill in its length
+	if (SUCCEEDED(hr) && bFlac) {
+		hr = flacFile.Close();
+		if (SUCCEEDED(hr)) {
+			printf("Wrote %I64u bytes of FLAC for %I64u bytes of PCM (%.1f%%) "
+				"in %u file writes.\n", flacFile.FileSize(), flacFile.PcmSize(),
+				100.0 * flacFile.FileSize() / max(flacFile.PcmSize(), 1ULL),
+				flacFile.WriteCount());
+		}
+		printLevels("Level", meter);
+	}
+
+	// Close the last segment and report how long switching files took
+	if (SUCCEEDED(hr) && bSegmented) {
+		hr = segmentedFile.Close();
+		printf("Wrote %u segment(s), switching files in %.3f ms on average, "
+			"%.3f ms at most, %u waited for the next file.\n",
+			segmentedFile.SegmentCount(), segmentedFile.AverageRotationMsec(),
+			segmentedFile.MaxRotationMsec(), segmentedFile.StallCount());
+		wprintf(L"Segments are listed in %s\n", segmentedFile.ManifestName());
+		printLevels("Level", meter);
 	}
 
 	// Fix up the RIFF headers with the correct sizes.
-	if (SUCCEEDED(hr)) {
-		hr = FixUpChunkSizes(hFile, cbHeader, cbAudioData);
+	if (SUCCEEDED(hr) && !bFlac && !bSegmented) {
+		hr = waveFile.Close();
+		if (waveFile.IsMapped()) {
+			printf("Used %u mapped views, extended the file %u time(s).\n",
+				waveFile.MapCount(), waveFile.ExtendCount());
+		} else {
+			printf("Used %u file writes.\n", waveFile.WriteCount());
+		}
+		if (cbAudioData > 0) {
+			printf("Copied %.2f bytes per byte written (%I64u joining sample "
+				"buffers, %I64u into the %s).\n",
+				(double)(cbLinearized + waveFile.CopiedSize()) / cbAudioData,
+				cbLinearized, waveFile.CopiedSize(),
+				waveFile.IsMapped() ? "mapped view" : "write buffer");
+		}
+		if (waveFile.CheckpointCount() > 0) {
+			printf("Wrote %u header checkpoints.\n",
+				waveFile.CheckpointCount());
+		}
+		if (SUCCEEDED(hr) && waveFile.IsRF64()) {
+			printf("Wrote RF64 header for %I64u bytes of audio data.\n",
+				cbAudioData);
+		}
+		printLevels("Level", meter);
 	}
 
 CLEANUP:
-	if (hFile != INVALID_HANDLE_VALUE) {
-		CloseHandle(hFile);
-	}
+	waveFile.Close();
+	flacFile.Close();
+	segmentedFile.Close();
+	CoTaskMemFree(pWav);
+	SafeRelease(&pFileType);
 	SafeRelease(&pReaderType);
 	return hr;
 }
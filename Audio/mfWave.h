@@ -3,9 +3,27 @@
 #pragma once
 
 #include "stdafx.h"
+#include "waveFile.h"
+#include "resampler.h"
+#include "pcmConvert.h"
+#include "flacEncoder.h"
+#include "waveSegments.h"
+#include "activityGate.h"
+#include "spectrum.h"
 
 HRESULT WriteWaveFile(
 					  IMFSourceReader *pReader,   // Pointer to the source reader.
 					  WCHAR *szFileName,           // Name of the output file.
-					  LONG msecAudioData          // Maximum amount of audio data to write, in msec.
+					  LONG msecAudioData,         // Maximum amount of audio data to write, in msec.
+					  const WaveFileOptions *pOptions = NULL,  // Write options, NULL for defaults.
+					  const ResampleOptions *pResample = NULL, // Rate to write, NULL to keep the device rate.
+					  const PcmOptions *pPcm = NULL,    // Sample format to write, NULL for float.
+					  const FlacOptions *pFlac = NULL,  // Compress to FLAC, NULL to write WAV.
+					  const SegmentOptions *pSegments = NULL, // Split into files, NULL for one.
+					  const ActivityOptions *pActivity = NULL, // Skip idle audio, NULL to write it all.
+					  const SpectrumOptions *pSpectrum = NULL  // Analyze the spectrum, NULL not to.
 					  );
+
+// Ends the recordings in progress, as if they had reached their
+// length.  Safe to call from a console control handler.
+void StopWaveFiles();
@@ -1,9 +1,16 @@
 #pragma once
 
 #include "stdafx.h"
+#include "resampler.h"
 
 HRESULT WriteWmaFile(
 					  IMFSourceReader *pReader,   // Pointer to the source reader.
 					  WCHAR *szFileName,          // Name of the output file.
-					  LONG msecAudioData          // Maximum amount of audio data to write, in msec.
+					  LONG msecAudioData,         // Maximum amount of audio data to write, in msec.
+					  const ResampleOptions *pResample = NULL  // Rate to encode, NULL to keep the device rate.
 					  );
+
+// Runs the read and write stages of WMA encoding against a mock device
+// that leaves gaps and a mock encoder that stalls, printing latency and
+// CPU, and checks that every sample and gap reaches the encoder in order
+void benchmarkPipeline(void);
@@ -1,7 +1,45 @@
 #include "stdafx.h"
 #include "mmRoutines.h"
+#include "bufferPool.h"
+#include "levelMeter.h"
+#include "spectrum.h"
+#include "threadPool.h"
 
-const int N_SECONDS = 10;
+const int N_RECORD_BUFFERS = 8;
+const int RECORD_BUFFER_MSEC = 50;
+const DWORD RECORD_TIMEOUT_MSEC = 2000;
+const int RECORD_SAMPLE_RATE = 44100;
+
+// Capture buffers, shared by all recordings
+static BufferPool s_recordPool;
+
+// Set by StopRecordings
+static volatile LONG s_bStopRecordings = FALSE;
+
+// The waveIn functions record() calls.  -ringbench replaces them with a
+// simulated device.
+struct WaveInFunctions
+{
+	MMRESULT (WINAPI *Open)(LPHWAVEIN, UINT, LPCWAVEFORMATEX, DWORD_PTR,
+		DWORD_PTR, DWORD);
+	MMRESULT (WINAPI *PrepareHeader)(HWAVEIN, LPWAVEHDR, UINT);
+	MMRESULT (WINAPI *AddBuffer)(HWAVEIN, LPWAVEHDR, UINT);
+	MMRESULT (WINAPI *Start)(HWAVEIN);
+	MMRESULT (WINAPI *Reset)(HWAVEIN);
+	MMRESULT (WINAPI *UnprepareHeader)(HWAVEIN, LPWAVEHDR, UINT);
+	MMRESULT (WINAPI *Close)(HWAVEIN);
+};
+
+static const WaveInFunctions s_systemWaveIn = {
+	waveInOpen, waveInPrepareHeader, waveInAddBuffer, waveInStart,
+	waveInReset, waveInUnprepareHeader, waveInClose
+};
+static const WaveInFunctions *s_pWaveIn = &s_systemWaveIn;
+
+void StopRecordings()
+{
+	InterlockedExchange(&s_bStopRecordings, TRUE);
+}
 
 const DWORD formats[] = {
 	WAVE_FORMAT_1M08,
@@ -49,80 +87,136 @@ void printMMIOError(DWORD code) {
 }
 
 // From code at http://www.bcbjournal.com/articles/vol2/9810/Low-level_wave_audio__part_3.htm
-void saveWaveFile(char *fileName, WAVEFORMATEX waveFormat, WAVEHDR waveHeader) {
+// Creates the file and writes everything up to the audio data.  The
+// chunk sizes are filled in by closeMMWaveFile.
+BOOL openMMWaveFile(char *fileName, const WAVEFORMATEX &waveFormat,
+					MMWaveFile *pFile) {
 	// Declare the structures we'll need.
-	MMCKINFO ChunkInfo;
 	MMCKINFO FormatChunkInfo;
-	MMCKINFO dataChunkInfo;
+
+	memset(pFile, 0, sizeof(MMWaveFile));
 
 	// Open the file.
 	HMMIO handle = mmioOpen(
 		fileName, 0, MMIO_CREATE | MMIO_WRITE);
 	if (!handle) {
-		printf("Error [%d] creating file %s\n");
-		return;
+		printf("Error creating file %s\n", fileName);
+		return FALSE;
 	}
 
 	// Create RIFF chunk. First zero out ChunkInfo structure.
-	memset(&ChunkInfo, 0, sizeof(MMCKINFO));
-	ChunkInfo.fccType = mmioStringToFOURCC("WAVE", 0);
+	pFile->riffChunk.fccType = mmioStringToFOURCC("WAVE", 0);
 	DWORD res = mmioCreateChunk(
-		handle, &ChunkInfo, MMIO_CREATERIFF);
+		handle, &pFile->riffChunk, MMIO_CREATERIFF);
 	if(res != MMSYSERR_NOERROR) {
 		printMMIOError(res);
-		return;
+		mmioClose(handle, 0);
+		return FALSE;
 	}
 
 	// Create the format chunk.
+	memset(&FormatChunkInfo, 0, sizeof(MMCKINFO));
 	FormatChunkInfo.ckid = mmioStringToFOURCC("fmt ", 0);
 	FormatChunkInfo.cksize = sizeof(WAVEFORMATEX);
 	res = mmioCreateChunk(handle, &FormatChunkInfo, 0);
 	if(res != MMSYSERR_NOERROR) {
 		printMMIOError(res);
-		return;
+		mmioClose(handle, 0);
+		return FALSE;
 	}
 
 	// Write the wave format data.
 	mmioWrite(handle, (char*)&waveFormat, sizeof(waveFormat));
 
-	// Create the data chunk.
+	// Create the data chunk.  Its size is not known yet; mmioAscend
+	// corrects it when the file is closed.
 	res = mmioAscend(handle, &FormatChunkInfo, 0);
 	if(res != MMSYSERR_NOERROR) {
 		printMMIOError(res);
-		return;
+		mmioClose(handle, 0);
+		return FALSE;
 	}
-	dataChunkInfo.ckid = mmioStringToFOURCC("data", 0);
-	DWORD dataSize = waveHeader.dwBytesRecorded;
-	dataChunkInfo.cksize = dataSize;
-	res = mmioCreateChunk(handle, &dataChunkInfo, 0);
+	pFile->dataChunk.ckid = mmioStringToFOURCC("data", 0);
+	pFile->dataChunk.cksize = 0;
+	res = mmioCreateChunk(handle, &pFile->dataChunk, 0);
 	if(res != MMSYSERR_NOERROR) {
 		printMMIOError(res);
-		return;
+		mmioClose(handle, 0);
+		return FALSE;
 	}
 
-	// Write the data.
-	mmioWrite(handle, (char*)waveHeader.lpData, dataSize);
+	pFile->handle = handle;
+	return TRUE;
+}
+
+// Appends audio data to the data chunk.
+BOOL writeMMWaveData(MMWaveFile *pFile, const char *pData, DWORD cbData) {
+	if (!pFile->handle) return FALSE;
+	if(mmioWrite(pFile->handle, pData, cbData) != (LONG)cbData) {
+		printf("Error writing wave data\n");
+		return FALSE;
+	}
+	pFile->cbData += cbData;
+	return TRUE;
+}
+
+// Fixes up the chunk sizes and closes the file.
+void closeMMWaveFile(MMWaveFile *pFile) {
+	if (!pFile->handle) return;
+
 	// Ascend out of the data chunk.
-	mmioAscend(handle, &dataChunkInfo, 0);
+	mmioAscend(pFile->handle, &pFile->dataChunk, 0);
 
 	// Ascend out of the RIFF chunk (the main chunk). Failure to do 
 	// this will result in a file that is unreadable by Windows95
 	// Sound Recorder.
-	mmioAscend(handle, &ChunkInfo, 0);
-	mmioClose(handle, 0);
+	mmioAscend(pFile->handle, &pFile->riffChunk, 0);
+	mmioClose(pFile->handle, 0);
+	pFile->handle = NULL;
+}
+
+void saveWaveFile(char *fileName, WAVEFORMATEX waveFormat, WAVEHDR waveHeader) {
+	MMWaveFile file;
+	if(!openMMWaveFile(fileName, waveFormat, &file)) {
+		return;
+	}
+	writeMMWaveData(&file, (char*)waveHeader.lpData,
+		waveHeader.dwBytesRecorded);
+	closeMMWaveFile(&file);
 }
 
 // Based on code at http://www.techmind.org/wave/
-double record(int iDevice, char *fileName)
+// Records from a ring of small buffers.  The driver signals an event
+// as each buffer fills; the buffer is written out and handed back, so
+// the thread sleeps between buffers and the duration is not limited
+// by memory.  The buffers come from the record buffer pool.  With
+// pSpectrum enabled, each buffer is also handed to a spectrum analyzer
+// before it goes back to the driver.  A duration of 0 records until
+// StopRecordings.  Returns the average absolute level, or DBL_MAX if
+// the device cannot record.
+double record(int iDevice, char *fileName, DWORD msecDuration,
+			  const SpectrumOptions *pSpectrum)
 {
-	const int NUMPTS = 44100 * N_SECONDS;   // N_SECONDS seconds
-	int sampleRate = 44100;
-	short int waveIn[NUMPTS];   // 'short int' is a 16-bit type; I request 16-bit samples below
-	// for 8-bit capture, you'd use 'unsigned char' or 'BYTE' 8-bit types
+	int sampleRate = RECORD_SAMPLE_RATE;
 
-	HWAVEIN hWaveIn;
-	WAVEHDR waveInHdr;
+	HWAVEIN hWaveIn = NULL;
+	WAVEHDR waveInHdr[N_RECORD_BUFFERS];
 	MMRESULT result;
+	MMWaveFile file;
+	HANDLE hEvent = NULL;
+	BYTE *waveIn[N_RECORD_BUFFERS];   // Each holds 16-bit samples; see below
+	LevelMeter meter;
+	SpectrumAnalyzer analyzer;
+	BOOL bSpectrum = FALSE;
+	double level = DBL_MAX;
+	int nPrepared = 0;
+	LARGE_INTEGER tStart, tStarted, freq;
+
+	QueryPerformanceCounter(&tStart);
+	memset(waveIn, 0, sizeof(waveIn));
+
+	memset(&file, 0, sizeof(file));
+	memset(waveInHdr, 0, sizeof(waveInHdr));
 
 	// Specify recording parameters
 	WAVEFORMATEX waveFormat;
@@ -134,79 +228,212 @@ double record(int iDevice, char *fileName)
 	waveFormat.wBitsPerSample=16;              //  16 for high quality, 8 for telephone-grade
 	waveFormat.cbSize=0;
 
-	result = waveInOpen(&hWaveIn, iDevice	, &waveFormat,
-		0L, 0L, WAVE_FORMAT_DIRECT);
+	// Sizes, in samples
+	const DWORD nBufferSamples = sampleRate * RECORD_BUFFER_MSEC / 1000;
+	const ULONGLONG nTotalSamples = msecDuration ?
+		(ULONGLONG)sampleRate * msecDuration / 1000 : MAXULONGLONG;
+	ULONGLONG nQueued = 0;
+	ULONGLONG nRecorded = 0;
+	int iNext = 0;
+
+	// Auto-reset event signaled by the driver as each buffer is done
+	hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (hEvent == NULL) {
+		printf("Failed to create event for device %d\n", iDevice);
+		return DBL_MAX;
+	}
+
+	result = s_pWaveIn->Open(&hWaveIn, iDevice, &waveFormat,
+		(DWORD_PTR)hEvent, 0L, CALLBACK_EVENT | WAVE_FORMAT_DIRECT);
 	if (result) {
 		char fault[256];
 		waveInGetErrorText(result, fault, 256);
 		printf("Failed to open waveform input device %d", iDevice);
-		return DBL_MAX;
+		hWaveIn = NULL;
+		goto CLEANUP;
 	}
 
-	// Zero the input
-	for(int i=0; i < NUMPTS; i++) {
-		waveIn[i] = 0;
+	// The analysis runs on its own thread, so it does not hold up the
+	// buffers.  Recording goes ahead without it if it cannot start.
+	if(pSpectrum && pSpectrum->bEnabled) {
+		HRESULT hr = analyzer.Initialize(sampleRate, waveFormat.nChannels,
+			LEVEL_FORMAT_INT16, *pSpectrum);
+		if (SUCCEEDED(hr)) {
+			bSpectrum = TRUE;
+		} else {
+			printf("Failed to start spectrum analysis for device %d\n", iDevice);
+		}
 	}
 
-	// Set up and prepare header for input
-	waveInHdr.lpData = (LPSTR)waveIn;
-	waveInHdr.dwBufferLength = NUMPTS*2;
-	waveInHdr.dwBytesRecorded=0;
-	waveInHdr.dwUser = 0L;
-	waveInHdr.dwFlags = 0L;
-	waveInHdr.dwLoops = 0L;
-	waveInPrepareHeader(hWaveIn, &waveInHdr, sizeof(WAVEHDR));
+	// Write the file as the buffers come in
+	if(fileName && !openMMWaveFile(fileName, waveFormat, &file)) {
+		goto CLEANUP;
+	}
 
-	// Insert a wave input buffer
-	result = waveInAddBuffer(hWaveIn, &waveInHdr, sizeof(WAVEHDR));
-	if (result) {
-		printf("Failed to read block from device %d", iDevice);
-		return DBL_MAX;
+	// Set up, prepare, and insert the input buffers.  They are not
+	// zeroed; the driver fills them before they are read.
+	for(int i=0; i < N_RECORD_BUFFERS && nQueued < nTotalSamples; i++) {
+		waveIn[i] = s_recordPool.Acquire();
+		if (waveIn[i] == NULL) {
+			printf("Failed to allocate buffers for device %d", iDevice);
+			goto CLEANUP;
+		}
+		waveInHdr[i].lpData = (LPSTR)waveIn[i];
+		waveInHdr[i].dwBufferLength = nBufferSamples*2;
+		result = s_pWaveIn->PrepareHeader(hWaveIn, &waveInHdr[i],
+			sizeof(WAVEHDR));
+		if (result) {
+			printf("Failed to prepare block for device %d", iDevice);
+			goto CLEANUP;
+		}
+		nPrepared++;
+		result = s_pWaveIn->AddBuffer(hWaveIn, &waveInHdr[i], sizeof(WAVEHDR));
+		if (result) {
+			printf("Failed to read block from device %d", iDevice);
+			goto CLEANUP;
+		}
+		nQueued += nBufferSamples;
 	}
 
 	// Commence sampling input
-	result = waveInStart(hWaveIn);
+	result = s_pWaveIn->Start(hWaveIn);
 	if (result) {
 		printf("Failed to start recording for device %d", iDevice);
-		return DBL_MAX;
+		goto CLEANUP;
 	}
+	QueryPerformanceCounter(&tStarted);
+	QueryPerformanceFrequency(&freq);
+	printf("  Device %d setup took %.3f ms\n", iDevice,
+		(tStarted.QuadPart - tStart.QuadPart) * 1000.0 / freq.QuadPart);
 
+	// Wait for each buffer in turn.  The buffers complete in the
+	// order they were added.  Each buffer is short, so a stop is seen
+	// within one buffer.
+	while(nRecorded < nTotalSamples && !s_bStopRecordings) {
+		if(WaitForSingleObject(hEvent, RECORD_TIMEOUT_MSEC) != WAIT_OBJECT_0) {
+			printf("Timed out waiting for data from device %d", iDevice);
+			goto CLEANUP;
+		}
+		while(nRecorded < nTotalSamples &&
+			(waveInHdr[iNext].dwFlags & WHDR_DONE)) {
+			WAVEHDR *pHdr = &waveInHdr[iNext];
+			DWORD nSamples = pHdr->dwBytesRecorded / 2;
+			if(nSamples > nTotalSamples - nRecorded) {
+				nSamples = (DWORD)(nTotalSamples - nRecorded);
+			}
 
-	// Wait until finished recording
-	do {
-		// Do nothing
-	} while(waveInUnprepareHeader(hWaveIn, &waveInHdr,
-		sizeof(WAVEHDR))==WAVERR_STILLPLAYING);
+			// Meter the data as it arrives and write it
+			meter.Process(pHdr->lpData, nSamples*2);
+			if(bSpectrum) {
+				analyzer.Push(pHdr->lpData, nSamples*2);
+			}
+			if(fileName && !writeMMWaveData(&file, pHdr->lpData, nSamples*2)) {
+				goto CLEANUP;
+			}
+			nRecorded += nSamples;
 
-	waveInClose(hWaveIn);
+			// Hand the buffer back if more data is needed
+			if(nQueued < nTotalSamples) {
+				pHdr->dwFlags &= ~WHDR_DONE;
+				pHdr->dwBytesRecorded = 0;
+				result = s_pWaveIn->AddBuffer(hWaveIn, pHdr, sizeof(WAVEHDR));
+				if (result) {
+					printf("Failed to read block from device %d", iDevice);
+					goto CLEANUP;
+				}
+				nQueued += nBufferSamples;
+			}
+			iNext = (iNext + 1) % N_RECORD_BUFFERS;
+		}
+	}
 
-	// Write the file
-	if(fileName) {
-		saveWaveFile(fileName, waveFormat, waveInHdr);
+	// Return the average, in sample units
+	char label[64];
+	sprintf_s(label, "Device %d level", iDevice);
+	printLevels(label, meter);
+	level = meter.MeanAbs() * meter.FullScale();
+	if(bSpectrum) {
+		analyzer.Stop();
+		sprintf_s(label, "Device %d spectrum", iDevice);
+		printSpectrum(label, analyzer);
 	}
 
-	// Return the average
-	double sum = 0.0;
-	for(int i=0; i < NUMPTS; i++) {
-		sum += waveIn[i]>0?waveIn[i]:-waveIn[i];
+CLEANUP:
+	if(hWaveIn) {
+		// Return any buffers still queued, then release them
+		s_pWaveIn->Reset(hWaveIn);
+		for(int i=0; i < nPrepared; i++) {
+			s_pWaveIn->UnprepareHeader(hWaveIn, &waveInHdr[i], sizeof(WAVEHDR));
+		}
+		s_pWaveIn->Close(hWaveIn);
 	}
-	sum /= NUMPTS;
+	closeMMWaveFile(&file);
+	for(int i=0; i < N_RECORD_BUFFERS; i++) {
+		s_recordPool.Release(waveIn[i]);
+	}
+	CloseHandle(hEvent);
 
-	return sum;
+	return level;
 }
 
-void printAudioInfo(void) {
+// One device being recorded by printAudioInfo
+struct MMDeviceJob
+{
+	BOOL bValid;                // Device caps were read
+	char fileName[1024];
+	DWORD msecDuration;
+	const SpectrumOptions *pSpectrum;   // Analysis to run, may be NULL
+	double level;               // Result of record()
+	DWORD msecElapsed;
+};
+
+// Records one device.  Runs on a pool thread when devices are recorded
+// in parallel.
+static void recordMMDevice(LONG iDevice, void *pContext) {
+	MMDeviceJob *pJob = (MMDeviceJob *)pContext + iDevice;
+	if(!pJob->bValid) return;
+	DWORD tStart = GetTickCount();
+	pJob->level = record(iDevice, pJob->fileName, pJob->msecDuration,
+		pJob->pSpectrum);
+	pJob->msecElapsed = GetTickCount() - tStart;
+}
+
+// Prints the capabilities of each device, then records from up to
+// nThreads devices at a time and prints the results.  pSpectrum, if
+// not NULL, is the spectrum analysis to run on each recording.
+void printAudioInfo(DWORD msecDuration, DWORD dwPoolFlags, LONG nThreads,
+					const SpectrumOptions *pSpectrum) {
 	printf("MM Audio Info\n");
 	UINT nDevices = waveInGetNumDevs();
 	printf("Number of devices: %d\n", nDevices);
+	if(nDevices == 0) return;
+	if(nThreads < 1) nThreads = 1;
+
+	// Enough buffers for the recordings that run at once
+	LONG nConcurrent = min((LONG)nDevices, nThreads);
+	HRESULT hr = s_recordPool.Initialize(
+		RECORD_SAMPLE_RATE * RECORD_BUFFER_MSEC / 1000 * 2,
+		N_RECORD_BUFFERS * nConcurrent, N_RECORD_BUFFERS * nConcurrent,
+		dwPoolFlags);
+	if (FAILED(hr)) {
+		printf("Error creating the buffer pool\n");
+		return;
+	}
+	MMDeviceJob *pJobs = new (std::nothrow) MMDeviceJob[nDevices];
+	if (pJobs == NULL) {
+		printf("Out of memory\n");
+		s_recordPool.Shutdown();
+		return;
+	}
+	memset(pJobs, 0, nDevices * sizeof(MMDeviceJob));
+
 	MMRESULT res = MMSYSERR_NOERROR;
 	WAVEINCAPS wic;
 	int nFormatsSupported;
-	double canRecord = 0;
 	for(UINT i=0; i < nDevices; i++) {
 		res = waveInGetDevCaps(i, &wic,  sizeof(WAVEINCAPS));
 		if(res != MMSYSERR_NOERROR) {
-			printf("Error getting information for audio device &d", i);
+			printf("Error getting information for audio device %d\n", i);
 			continue;
 		} else {
 			printf("%d %s\n", i, wic.szPname);
@@ -220,17 +447,345 @@ void printAudioInfo(void) {
 			}
 			printf("  Supports %d of %d standard formats\n",
 				nFormatsSupported, nFormats);
-			printf("  Trying to record for %d sec...\n", N_SECONDS);
-			char fileName[1024];
-			sprintf_s(fileName, "MM-AudioTest-%s.wav", wic.szPname);
-			canRecord = record(i, fileName);
-			if(canRecord == DBL_MAX) {
-				printf("  Cannot record\n");
-			} else {
-				printf("  Can record, Average absolute level=%.2f\n",
-					canRecord);
-				printf("    Output is %s\n", fileName);
+			sprintf_s(pJobs[i].fileName, "MM-AudioTest-%s.wav", wic.szPname);
+			pJobs[i].msecDuration = msecDuration;
+			pJobs[i].pSpectrum = pSpectrum;
+			pJobs[i].bValid = TRUE;
+		}
+	}
+
+	// Record all the devices
+	if(msecDuration == 0) {
+		printf("Trying to record until Ctrl+C, %d device(s) at a time...\n",
+			nConcurrent);
+	} else {
+		printf("Trying to record for %d sec, %d device(s) at a time...\n",
+			msecDuration / 1000, nConcurrent);
+	}
+	DWORD tStart = GetTickCount();
+	RunInParallel(nDevices, nThreads, recordMMDevice, pJobs);
+	DWORD msecTotal = GetTickCount() - tStart;
+
+	// Report the results
+	printf("Results:\n");
+	for(UINT i=0; i < nDevices; i++) {
+		if(!pJobs[i].bValid) {
+			printf("%d  No information\n", i);
+		} else if(pJobs[i].level == DBL_MAX) {
+			printf("%d  Cannot record\n", i);
+		} else {
+			printf("%d  Can record, Average absolute level=%.2f (%.1f sec)\n",
+				i, pJobs[i].level, pJobs[i].msecElapsed / 1000.0);
+			printf("    Output is %s\n", pJobs[i].fileName);
+		}
+	}
+	printf("Recorded %d device(s) in %.1f sec\n", nDevices, msecTotal / 1000.0);
+
+	delete [] pJobs;
+	printBufferPoolStats(&s_recordPool);
+	s_recordPool.Shutdown();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// waveIn ring benchmark
+
+// One run of record() against the simulated device
+struct WaveInBenchCase
+{
+	const char *szName;
+	DWORD msecMinGap;           // Time between deliveries, at random
+	DWORD msecMaxGap;
+	DWORD msecStall;            // One longer gap, 0 for none
+	BOOL bOverrun;              // The stall outlasts the ring and the FIFO
+};
+
+// A waveIn device that is not there.  It captures mono 16-bit samples
+// whose values count up from 0, and hands over the full buffers it has
+// data for each time it wakes, then signals the event once, so the
+// buffers arrive late and several at a time.  Samples it has no queued
+// buffer for wait in the device's FIFO, and those that overflow it are
+// dropped, as a driver does.  It also counts calls that break the
+// waveIn rules.
+static struct SimulatedWaveIn
+{
+	const WaveInBenchCase *pCase;
+	CRITICAL_SECTION critsec;
+	HANDLE hEvent;
+	HANDLE hThread;
+	volatile LONG bStop;
+	DWORD nSamplesPerSec;
+	LARGE_INTEGER tStart;
+	WAVEHDR *pQueue[N_RECORD_BUFFERS];
+	int iHead;
+	int nQueued;
+	ULONGLONG nNext;            // Next sample to hand over
+	ULONGLONG nOverflow;        // Dropped since the last buffer handed over
+	ULONGLONG nDropped;         // Dropped before a buffer handed over
+	ULONGLONG nDelivered;       // Buffers
+	DWORD nBursts;              // Wakes that delivered more than one
+	DWORD nMisuse;
+} s_sim;
+
+// Samples the device FIFO holds while no buffer is queued
+const DWORD SIM_FIFO_MSEC = 100;
+
+static unsigned __stdcall SimulatedWaveInThread(void *)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	BOOL bStalled = FALSE;
+
+	while (!s_sim.bStop) {
+		const WaveInBenchCase *pCase = s_sim.pCase;
+		DWORD msecGap = pCase->msecMinGap +
+			rand() % (pCase->msecMaxGap - pCase->msecMinGap + 1);
+		if (pCase->msecStall && !bStalled && s_sim.nDelivered >= 20) {
+			msecGap = pCase->msecStall;
+			bStalled = TRUE;
+		}
+		Sleep(msecGap);
+
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		ULONGLONG nCaptured = (ULONGLONG)(t.QuadPart - s_sim.tStart.QuadPart) *
+			s_sim.nSamplesPerSec / freq.QuadPart;
+		DWORD nBuffers = 0;
+
+		EnterCriticalSection(&s_sim.critsec);
+		while (s_sim.nQueued > 0) {
+			WAVEHDR *pHdr = s_sim.pQueue[s_sim.iHead];
+			DWORD nSamples = pHdr->dwBufferLength / sizeof(SHORT);
+			if (nCaptured - s_sim.nNext < nSamples) {
+				break;
+			}
+			SHORT *pData = (SHORT *)pHdr->lpData;
+			for (DWORD i = 0; i < nSamples; i++) {
+				pData[i] = (SHORT)(s_sim.nNext + i);
+			}
+			s_sim.nNext += nSamples;
+			s_sim.nDropped += s_sim.nOverflow;
+			s_sim.nOverflow = 0;
+			pHdr->dwBytesRecorded = nSamples * sizeof(SHORT);
+
+			// record() may poll the flag while the lock is held
+			MemoryBarrier();
+			pHdr->dwFlags = (pHdr->dwFlags & ~WHDR_INQUEUE) | WHDR_DONE;
+			s_sim.iHead = (s_sim.iHead + 1) % N_RECORD_BUFFERS;
+			s_sim.nQueued--;
+			s_sim.nDelivered++;
+			nBuffers++;
+		}
+		ULONGLONG nFifo = (ULONGLONG)s_sim.nSamplesPerSec * SIM_FIFO_MSEC / 1000;
+		if (nCaptured - s_sim.nNext > nFifo) {
+			s_sim.nOverflow += nCaptured - s_sim.nNext - nFifo;
+			s_sim.nNext = nCaptured - nFifo;
+		}
+		LeaveCriticalSection(&s_sim.critsec);
+
+		if (nBuffers > 1) {
+			s_sim.nBursts++;
+		}
+		if (nBuffers > 0) {
+			SetEvent(s_sim.hEvent);
+		}
+	}
+	return 0;
+}
+
+static MMRESULT WINAPI SimOpen(LPHWAVEIN phwi, UINT, LPCWAVEFORMATEX pwfx,
+							   DWORD_PTR dwCallback, DWORD_PTR, DWORD fdwOpen)
+{
+	if ((fdwOpen & CALLBACK_TYPEMASK) != CALLBACK_EVENT ||
+		pwfx->wBitsPerSample != 16 || pwfx->nChannels != 1) {
+		s_sim.nMisuse++;
+		return MMSYSERR_INVALPARAM;
+	}
+	s_sim.hEvent = (HANDLE)dwCallback;
+	s_sim.nSamplesPerSec = pwfx->nSamplesPerSec;
+	*phwi = (HWAVEIN)&s_sim;
+
+	// A driver signals the event for WIM_OPEN too
+	SetEvent(s_sim.hEvent);
+	return MMSYSERR_NOERROR;
+}
+
+static MMRESULT WINAPI SimPrepareHeader(HWAVEIN, LPWAVEHDR pwh, UINT)
+{
+	pwh->dwFlags |= WHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+static MMRESULT WINAPI SimAddBuffer(HWAVEIN, LPWAVEHDR pwh, UINT)
+{
+	MMRESULT result = MMSYSERR_NOERROR;
+	EnterCriticalSection(&s_sim.critsec);
+	if (!(pwh->dwFlags & WHDR_PREPARED) || (pwh->dwFlags & WHDR_INQUEUE) ||
+		s_sim.nQueued == N_RECORD_BUFFERS) {
+		s_sim.nMisuse++;
+		result = WAVERR_UNPREPARED;
+	} else {
+		pwh->dwFlags = (pwh->dwFlags & ~WHDR_DONE) | WHDR_INQUEUE;
+		s_sim.pQueue[(s_sim.iHead + s_sim.nQueued) % N_RECORD_BUFFERS] = pwh;
+		s_sim.nQueued++;
+	}
+	LeaveCriticalSection(&s_sim.critsec);
+	return result;
+}
+
+static MMRESULT WINAPI SimStart(HWAVEIN)
+{
+	QueryPerformanceCounter(&s_sim.tStart);
+	s_sim.hThread = (HANDLE)_beginthreadex(NULL, 0, SimulatedWaveInThread,
+		NULL, 0, NULL);
+	return s_sim.hThread ? MMSYSERR_NOERROR : MMSYSERR_NOMEM;
+}
+
+// Stops the device and returns the queued buffers, empty
+static MMRESULT WINAPI SimReset(HWAVEIN)
+{
+	if (s_sim.hThread) {
+		InterlockedExchange(&s_sim.bStop, TRUE);
+		WaitForSingleObject(s_sim.hThread, INFINITE);
+		CloseHandle(s_sim.hThread);
+		s_sim.hThread = NULL;
+	}
+	while (s_sim.nQueued > 0) {
+		WAVEHDR *pHdr = s_sim.pQueue[s_sim.iHead];
+		pHdr->dwBytesRecorded = 0;
+		pHdr->dwFlags = (pHdr->dwFlags & ~WHDR_INQUEUE) | WHDR_DONE;
+		s_sim.iHead = (s_sim.iHead + 1) % N_RECORD_BUFFERS;
+		s_sim.nQueued--;
+	}
+	return MMSYSERR_NOERROR;
+}
+
+static MMRESULT WINAPI SimUnprepareHeader(HWAVEIN, LPWAVEHDR pwh, UINT)
+{
+	if (pwh->dwFlags & WHDR_INQUEUE) {
+		s_sim.nMisuse++;
+		return WAVERR_STILLPLAYING;
+	}
+	pwh->dwFlags &= ~WHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+static MMRESULT WINAPI SimClose(HWAVEIN hwi)
+{
+	if (s_sim.nQueued > 0 || s_sim.hThread) {
+		s_sim.nMisuse++;
+		SimReset(hwi);
+	}
+	return MMSYSERR_NOERROR;
+}
+
+static const WaveInFunctions s_simulatedWaveIn = {
+	SimOpen, SimPrepareHeader, SimAddBuffer, SimStart,
+	SimReset, SimUnprepareHeader, SimClose
+};
+
+// Reads the samples of a file record() wrote and checks that they count
+// up by one, but for jumps where the device dropped samples.  Gives the
+// number of samples and the total size of the jumps.
+static BOOL ReadRecordedCount(char *fileName, ULONGLONG *pnSamples,
+							  ULONGLONG *pnSkipped)
+{
+	MMCKINFO riffChunk, dataChunk;
+	SHORT samples[4096];
+	SHORT expected = 0;
+	BOOL bOk = FALSE;
+
+	*pnSamples = 0;
+	*pnSkipped = 0;
+	HMMIO handle = mmioOpen(fileName, NULL, MMIO_READ);
+	if (!handle) {
+		return FALSE;
+	}
+	memset(&riffChunk, 0, sizeof(riffChunk));
+	memset(&dataChunk, 0, sizeof(dataChunk));
+	riffChunk.fccType = mmioStringToFOURCC("WAVE", 0);
+	dataChunk.ckid = mmioStringToFOURCC("data", 0);
+	if (mmioDescend(handle, &riffChunk, NULL, MMIO_FINDRIFF) == MMSYSERR_NOERROR &&
+		mmioDescend(handle, &dataChunk, &riffChunk, MMIO_FINDCHUNK) == MMSYSERR_NOERROR) {
+		LONG cbLeft = dataChunk.cksize;
+		bOk = TRUE;
+		while (cbLeft > 0 && bOk) {
+			LONG cbRead = mmioRead(handle, (HPSTR)samples,
+				min(cbLeft, (LONG)sizeof(samples)));
+			bOk = cbRead > 0;
+			for (LONG i = 0; i < cbRead / (LONG)sizeof(SHORT); i++) {
+				*pnSkipped += (USHORT)(samples[i] - expected);
+				expected = samples[i] + 1;
+				(*pnSamples)++;
 			}
+			cbLeft -= cbRead;
+		}
+	}
+	mmioClose(handle, 0);
+	return bOk;
+}
+
+// Records from the simulated device, delivering late and in bursts,
+// and checks that the file holds every sample the device captured, in
+// order, and the requested length, and that record() kept to the
+// waveIn rules.  Only a stall longer than the ring and the device FIFO
+// together may lose samples, and those must be exactly the ones missing.
+void benchmarkWaveInRing(void)
+{
+	const DWORD MSEC_RECORD = 3000;
+	const WaveInBenchCase cases[] = {
+		{ "on time", RECORD_BUFFER_MSEC, RECORD_BUFFER_MSEC, 0, FALSE },
+		{ "late, in bursts of up to 6 buffers", 0, 300, 0, FALSE },
+		{ "in bursts, one 350 ms stall", 0, 150, 350, FALSE },
+		{ "in bursts, one 800 ms stall", 0, 150, 800, TRUE },
+	};
+	char fileName[] = "RingBench.wav";
+
+	HRESULT hr = s_recordPool.Initialize(
+		RECORD_SAMPLE_RATE * RECORD_BUFFER_MSEC / 1000 * 2,
+		N_RECORD_BUFFERS, N_RECORD_BUFFERS, 0);
+	if (FAILED(hr)) {
+		printf("Error creating the buffer pool\n");
+		return;
+	}
+	InitializeCriticalSection(&s_sim.critsec);
+	s_pWaveIn = &s_simulatedWaveIn;
+	srand(1);
+
+	printf("waveIn ring check, %d buffers of %d ms, %u ms per case, "
+		"%u ms device FIFO\n", N_RECORD_BUFFERS, RECORD_BUFFER_MSEC,
+		MSEC_RECORD, SIM_FIFO_MSEC);
+	for (DWORD i = 0; i < ARRAYSIZE(cases); i++) {
+		s_sim.pCase = &cases[i];
+		s_sim.hThread = NULL;
+		s_sim.bStop = FALSE;
+		s_sim.iHead = 0;
+		s_sim.nQueued = 0;
+		s_sim.nNext = 0;
+		s_sim.nOverflow = 0;
+		s_sim.nDropped = 0;
+		s_sim.nDelivered = 0;
+		s_sim.nBursts = 0;
+		s_sim.nMisuse = 0;
+
+		double level = record(0, fileName, MSEC_RECORD);
+
+		ULONGLONG nSamples = 0, nSkipped = 0;
+		BOOL bRead = ReadRecordedCount(fileName, &nSamples, &nSkipped);
+		ULONGLONG nExpected = (ULONGLONG)RECORD_SAMPLE_RATE * MSEC_RECORD / 1000;
+		BOOL bOk = level != DBL_MAX && bRead && nSamples == nExpected &&
+			nSkipped == s_sim.nDropped && s_sim.nMisuse == 0 &&
+			(s_sim.nDropped > 0) == cases[i].bOverrun;
+		printf("  %s: %I64u buffers, %u bursts, %I64u samples written, "
+			"%I64u dropped, %I64u missing, %s\n", cases[i].szName,
+			s_sim.nDelivered, s_sim.nBursts, nSamples, s_sim.nDropped,
+			nSkipped, bOk ? "ok" : "FAILED");
+		if (s_sim.nMisuse) {
+			printf("    %u calls broke the waveIn rules\n", s_sim.nMisuse);
 		}
+		DeleteFileA(fileName);
 	}
+
+	s_pWaveIn = &s_systemWaveIn;
+	DeleteCriticalSection(&s_sim.critsec);
+	s_recordPool.Shutdown();
 }
@@ -5,13 +5,35 @@
 #pragma once
 
 #include "stdafx.h"
+#include "spectrum.h"
 
-void printAudioInfo(void);
+// A WAVE file being written with the mmio functions
+struct MMWaveFile
+{
+    HMMIO       handle;
+    MMCKINFO    riffChunk;
+    MMCKINFO    dataChunk;
+    DWORD       cbData;         // Bytes of audio data written
+};
+
+void printAudioInfo(DWORD msecDuration, DWORD dwPoolFlags, LONG nThreads,
+                    const SpectrumOptions *pSpectrum = NULL);
 void printMMIOError(DWORD code);
-double record(int iDevice, char *fileName);
+// Ends the recordings in progress, as if their time were up
+void StopRecordings();
+double record(int iDevice, char *fileName, DWORD msecDuration,
+              const SpectrumOptions *pSpectrum = NULL);
+BOOL openMMWaveFile(char *fileName, const WAVEFORMATEX &waveFormat,
+                    MMWaveFile *pFile);
+BOOL writeMMWaveData(MMWaveFile *pFile, const char *pData, DWORD cbData);
+void closeMMWaveFile(MMWaveFile *pFile);
 void saveWaveFile(char *fileName, WAVEFORMATEX waveFormat, WAVEHDR waveHeader);
+// Records from a simulated device that delivers late and in bursts,
+// and checks the file for lost, repeated or reordered samples.
+void benchmarkWaveInRing(void);
 
-extern const int N_SECONDS;
+extern const int N_RECORD_BUFFERS;      // Buffers in the capture ring
+extern const int RECORD_BUFFER_MSEC;    // Length of each buffer
 extern const DWORD formats[]; 
 extern const int nFormats;
 extern const char *formatNames[];
@@ -0,0 +1,600 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "pcmConvert.h"
+
+#include <immintrin.h>
+#include <limits.h>
+#include <math.h>
+
+const float INT16_SCALE = 32767.0f;
+const float INT24_SCALE = 8388607.0f;
+const float INT32_SCALE = 2147483648.0f;
+const float RNG_SCALE = 1.0f / 65536.0f;
+
+// Error feedback filter for noise shaping (Lipshitz et al., designed
+// for 44.1 kHz).  Moves the requantization noise above 10 kHz or so,
+// where hearing is least sensitive.
+const int SHAPE_TAPS = 5;
+static const float s_shape[SHAPE_TAPS] = {
+	2.033f, -2.165f, 1.959f, -1.590f, 0.6149f
+};
+
+static const UINT32 s_sampleSizes[PCM_FORMAT_COUNT] = { 4, 2, 3, 4 };
+
+static const char *s_formatNames[PCM_FORMAT_COUNT] = {
+	"float32", "int16", "int24", "int32"
+};
+
+static const char *s_ditherNames[PCM_DITHER_COUNT] = {
+	"none", "tpdf", "shaped"
+};
+
+// Rounds to nearest, ties to even, as the vector conversions do
+static inline int RoundToInt(float x)
+{
+	return _mm_cvtss_si32(_mm_set_ss(x));
+}
+
+// Triangular noise of +/-1 LSB, made from the two halves of one
+// xorshift output
+static inline float TpdfScalar(UINT32 *pRng)
+{
+	UINT32 x = *pRng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*pRng = x;
+	return ((int)(x & 0xFFFF) - (int)(x >> 16)) * RNG_SCALE;
+}
+
+static inline float Clamp(float x, float lo, float hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+static void PcmInt16Scalar(const float *pIn, DWORD nSamples, BYTE *pOut,
+						   PcmDitherState *pState)
+{
+	short *p = (short *)pOut;
+	for (DWORD i = 0; i < nSamples; i++) {
+		float x = pIn[i] * INT16_SCALE;
+		if (pState->bDither) {
+			x += TpdfScalar(&pState->rng[0]);
+		}
+		p[i] = (short)RoundToInt(Clamp(x, -32768.0f, 32767.0f));
+	}
+}
+
+static void PcmInt24Scalar(const float *pIn, DWORD nSamples, BYTE *pOut,
+						   PcmDitherState *pState)
+{
+	for (DWORD i = 0; i < nSamples; i++, pOut += 3) {
+		float x = pIn[i] * INT24_SCALE;
+		if (pState->bDither) {
+			x += TpdfScalar(&pState->rng[0]);
+		}
+		int n = RoundToInt(Clamp(x, -8388608.0f, 8388607.0f));
+		pOut[0] = (BYTE)n;
+		pOut[1] = (BYTE)(n >> 8);
+		pOut[2] = (BYTE)(n >> 16);
+	}
+}
+
+static void PcmInt32Scalar(const float *pIn, DWORD nSamples, BYTE *pOut,
+						   PcmDitherState * /*pState*/)
+{
+	int *p = (int *)pOut;
+	for (DWORD i = 0; i < nSamples; i++) {
+		float x = pIn[i] * INT32_SCALE;
+		// Out-of-range conversions give INT_MIN, which is only right
+		// for negative overflow
+		p[i] = (x >= INT32_SCALE) ? INT_MAX : RoundToInt(x);
+	}
+}
+
+// Requantizes with TPDF dither and feeds each sample's error back
+// through the shaping filter, separately for each channel
+static void PcmShaped(const float *pIn, DWORD nSamples, BYTE *pOut,
+					  PcmDitherState *pState, PcmFormat format)
+{
+	float scale = (format == PCM_FORMAT_INT16) ? INT16_SCALE : INT24_SCALE;
+	float lo = (format == PCM_FORMAT_INT16) ? -32768.0f : -8388608.0f;
+	float hi = (format == PCM_FORMAT_INT16) ? 32767.0f : 8388607.0f;
+
+	for (DWORD i = 0; i < nSamples; i++) {
+		float *e = pState->pErrors + pState->iChannel * SHAPE_TAPS;
+		float v = pIn[i] * scale;
+		for (int k = 0; k < SHAPE_TAPS; k++) {
+			v -= s_shape[k] * e[k];
+		}
+		int n = RoundToInt(v + TpdfScalar(&pState->rng[0]));
+
+		// The error is taken before clipping, so a clipped sample
+		// cannot drive the filter unstable
+		for (int k = SHAPE_TAPS - 1; k > 0; k--) {
+			e[k] = e[k - 1];
+		}
+		e[0] = n - v;
+
+		n = RoundToInt(Clamp((float)n, lo, hi));
+		if (format == PCM_FORMAT_INT16) {
+			((short *)pOut)[i] = (short)n;
+		} else {
+			pOut[i * 3] = (BYTE)n;
+			pOut[i * 3 + 1] = (BYTE)(n >> 8);
+			pOut[i * 3 + 2] = (BYTE)(n >> 16);
+		}
+
+		if (++pState->iChannel == pState->nChannels) {
+			pState->iChannel = 0;
+		}
+	}
+}
+
+static void PcmInt16Shaped(const float *pIn, DWORD nSamples, BYTE *pOut,
+						   PcmDitherState *pState)
+{
+	PcmShaped(pIn, nSamples, pOut, pState, PCM_FORMAT_INT16);
+}
+
+static void PcmInt24Shaped(const float *pIn, DWORD nSamples, BYTE *pOut,
+						   PcmDitherState *pState)
+{
+	PcmShaped(pIn, nSamples, pOut, pState, PCM_FORMAT_INT24);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// SSE2 kernels
+
+static inline __m128 TpdfSse2(__m128i *pRng)
+{
+	__m128i x = *pRng;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	*pRng = x;
+	__m128i d = _mm_sub_epi32(_mm_and_si128(x, _mm_set1_epi32(0xFFFF)),
+		_mm_srli_epi32(x, 16));
+	return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(RNG_SCALE));
+}
+
+static void PcmInt16Sse2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	short *p = (short *)pOut;
+	const __m128 scale = _mm_set1_ps(INT16_SCALE);
+	const __m128 lo = _mm_set1_ps(-32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f);
+	__m128i rng = _mm_loadu_si128((const __m128i *)pState->rng);
+	DWORD i = 0;
+
+	for (; i + 8 <= nSamples; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(pIn + i), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(pIn + i + 4), scale);
+		if (pState->bDither) {
+			a = _mm_add_ps(a, TpdfSse2(&rng));
+			b = _mm_add_ps(b, TpdfSse2(&rng));
+		}
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		_mm_storeu_si128((__m128i *)(p + i),
+			_mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+
+	_mm_storeu_si128((__m128i *)pState->rng, rng);
+	PcmInt16Scalar(pIn + i, nSamples - i, (BYTE *)(p + i), pState);
+}
+
+static void PcmInt24Sse2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	const __m128 scale = _mm_set1_ps(INT24_SCALE);
+	const __m128 lo = _mm_set1_ps(-8388608.0f);
+	const __m128 hi = _mm_set1_ps(8388607.0f);
+	__m128i rng = _mm_loadu_si128((const __m128i *)pState->rng);
+	DWORD i = 0;
+
+	// SSE2 has no byte shuffle, so the packing to 3 bytes is scalar
+	for (; i + 4 <= nSamples; i += 4, pOut += 12) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(pIn + i), scale);
+		if (pState->bDither) {
+			a = _mm_add_ps(a, TpdfSse2(&rng));
+		}
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		int n[4];
+		_mm_storeu_si128((__m128i *)n, _mm_cvtps_epi32(a));
+		for (int k = 0; k < 4; k++) {
+			pOut[k * 3] = (BYTE)n[k];
+			pOut[k * 3 + 1] = (BYTE)(n[k] >> 8);
+			pOut[k * 3 + 2] = (BYTE)(n[k] >> 16);
+		}
+	}
+
+	_mm_storeu_si128((__m128i *)pState->rng, rng);
+	PcmInt24Scalar(pIn + i, nSamples - i, pOut, pState);
+}
+
+static void PcmInt32Sse2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	int *p = (int *)pOut;
+	const __m128 scale = _mm_set1_ps(INT32_SCALE);
+	DWORD i = 0;
+
+	for (; i + 4 <= nSamples; i += 4) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(pIn + i), scale);
+		// Positive overflow converts to INT_MIN; flipping every bit
+		// makes it INT_MAX
+		__m128i over = _mm_castps_si128(_mm_cmpge_ps(a, scale));
+		_mm_storeu_si128((__m128i *)(p + i),
+			_mm_xor_si128(_mm_cvtps_epi32(a), over));
+	}
+
+	PcmInt32Scalar(pIn + i, nSamples - i, (BYTE *)(p + i), pState);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// AVX2 kernels
+
+static inline __m256 TpdfAvx2(__m256i *pRng)
+{
+	__m256i x = *pRng;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	*pRng = x;
+	__m256i d = _mm256_sub_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xFFFF)),
+		_mm256_srli_epi32(x, 16));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(d), _mm256_set1_ps(RNG_SCALE));
+}
+
+static void PcmInt16Avx2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	short *p = (short *)pOut;
+	const __m256 scale = _mm256_set1_ps(INT16_SCALE);
+	const __m256 lo = _mm256_set1_ps(-32768.0f);
+	const __m256 hi = _mm256_set1_ps(32767.0f);
+	__m256i rng = _mm256_loadu_si256((const __m256i *)pState->rng);
+	DWORD i = 0;
+
+	for (; i + 16 <= nSamples; i += 16) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(pIn + i), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(pIn + i + 8), scale);
+		if (pState->bDither) {
+			a = _mm256_add_ps(a, TpdfAvx2(&rng));
+			b = _mm256_add_ps(b, TpdfAvx2(&rng));
+		}
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+		// The pack works within each 128-bit lane, so put the quarters
+		// back in order afterwards
+		__m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+			_mm256_cvtps_epi32(b));
+		_mm256_storeu_si256((__m256i *)(p + i),
+			_mm256_permute4x64_epi64(packed, 0xD8));
+	}
+
+	_mm256_storeu_si256((__m256i *)pState->rng, rng);
+	_mm256_zeroupper();
+	PcmInt16Scalar(pIn + i, nSamples - i, (BYTE *)(p + i), pState);
+}
+
+static void PcmInt24Avx2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	const __m256 scale = _mm256_set1_ps(INT24_SCALE);
+	const __m256 lo = _mm256_set1_ps(-8388608.0f);
+	const __m256 hi = _mm256_set1_ps(8388607.0f);
+	// Low 3 bytes of each 32-bit value, packed to the front of each lane
+	const __m256i pack = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i rng = _mm256_loadu_si256((const __m256i *)pState->rng);
+	DWORD i = 0;
+
+	// Each lane is stored with 16-byte writes that run 4 bytes past its
+	// 12, so stop while the next samples are still there to cover them
+	for (; i + 10 <= nSamples; i += 8, pOut += 24) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(pIn + i), scale);
+		if (pState->bDither) {
+			a = _mm256_add_ps(a, TpdfAvx2(&rng));
+		}
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		__m256i n = _mm256_shuffle_epi8(_mm256_cvtps_epi32(a), pack);
+		_mm_storeu_si128((__m128i *)pOut, _mm256_castsi256_si128(n));
+		_mm_storeu_si128((__m128i *)(pOut + 12), _mm256_extracti128_si256(n, 1));
+	}
+
+	_mm256_storeu_si256((__m256i *)pState->rng, rng);
+	_mm256_zeroupper();
+	PcmInt24Scalar(pIn + i, nSamples - i, pOut, pState);
+}
+
+static void PcmInt32Avx2(const float *pIn, DWORD nSamples, BYTE *pOut,
+						 PcmDitherState *pState)
+{
+	int *p = (int *)pOut;
+	const __m256 scale = _mm256_set1_ps(INT32_SCALE);
+	DWORD i = 0;
+
+	for (; i + 8 <= nSamples; i += 8) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(pIn + i), scale);
+		__m256i over = _mm256_castps_si256(_mm256_cmp_ps(a, scale, _CMP_GE_OQ));
+		_mm256_storeu_si256((__m256i *)(p + i),
+			_mm256_xor_si256(_mm256_cvtps_epi32(a), over));
+	}
+
+	_mm256_zeroupper();
+	PcmInt32Scalar(pIn + i, nSamples - i, (BYTE *)(p + i), pState);
+}
+
+// Rounding and TPDF kernels, by format and kernel
+static const PcmConvertProc s_kernels[PCM_FORMAT_COUNT][LEVEL_KERNEL_COUNT] = {
+	{ NULL, NULL, NULL },
+	{ PcmInt16Scalar, PcmInt16Sse2, PcmInt16Avx2 },
+	{ PcmInt24Scalar, PcmInt24Sse2, PcmInt24Avx2 },
+	{ PcmInt32Scalar, PcmInt32Sse2, PcmInt32Avx2 },
+};
+
+//////////////////////////////////////////////////////////////////////////
+// PcmConverter
+
+PcmConverter::PcmConverter() :
+m_format(PCM_FORMAT_FLOAT32),
+m_dither(PCM_DITHER_NONE),
+m_nChannels(0),
+m_kernel(LEVEL_KERNEL_SCALAR),
+m_pfnConvert(NULL)
+{
+	ZeroMemory(&m_state, sizeof(m_state));
+}
+
+PcmConverter::~PcmConverter()
+{
+	delete [] m_state.pErrors;
+}
+
+HRESULT PcmConverter::Initialize(UINT32 nChannels, PcmFormat format,
+								 PcmDither dither)
+{
+	if (nChannels == 0 || format < 0 || format >= PCM_FORMAT_COUNT ||
+		dither < 0 || dither >= PCM_DITHER_COUNT) {
+		return E_INVALIDARG;
+	}
+
+	// A float is only 24 bits deep, so there is nothing to dither
+	// for 32-bit output
+	if (format == PCM_FORMAT_INT32) {
+		dither = PCM_DITHER_NONE;
+	}
+
+	delete [] m_state.pErrors;
+	ZeroMemory(&m_state, sizeof(m_state));
+	if (dither == PCM_DITHER_SHAPED) {
+		m_state.pErrors = new (std::nothrow) float[nChannels * SHAPE_TAPS];
+		if (m_state.pErrors == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		ZeroMemory(m_state.pErrors, nChannels * SHAPE_TAPS * sizeof(float));
+	}
+	m_state.bDither = (dither != PCM_DITHER_NONE);
+	m_state.nChannels = nChannels;
+	for (int i = 0; i < 8; i++) {
+		m_state.rng[i] = 0x9E3779B9u * (i + 1);
+	}
+
+	m_format = format;
+	m_dither = dither;
+	m_nChannels = nChannels;
+	SetKernel(LevelMeter::BestKernel());
+	return S_OK;
+}
+
+// Forces a particular kernel.  Returns FALSE if the processor does not
+// support it.  Noise shaping is always scalar.
+BOOL PcmConverter::SetKernel(LevelKernel kernel)
+{
+	if (!LevelMeter::IsKernelSupported(kernel)) {
+		return FALSE;
+	}
+	if (m_dither == PCM_DITHER_SHAPED) {
+		m_kernel = LEVEL_KERNEL_SCALAR;
+		m_pfnConvert = (m_format == PCM_FORMAT_INT16) ?
+			PcmInt16Shaped : PcmInt24Shaped;
+	} else {
+		m_kernel = kernel;
+		m_pfnConvert = s_kernels[m_format][kernel];
+	}
+	return TRUE;
+}
+
+DWORD PcmConverter::Convert(const float *pIn, UINT32 nFrames, BYTE *pOut)
+{
+	DWORD nSamples = nFrames * m_nChannels;
+	if (m_pfnConvert == NULL) {
+		memcpy(pOut, pIn, nSamples * sizeof(float));
+	} else {
+		m_pfnConvert(pIn, nSamples, pOut, &m_state);
+	}
+	return nFrames * BytesPerFrame();
+}
+
+UINT32 PcmConverter::BytesPerSample(PcmFormat format)
+{
+	if (format < 0 || format >= PCM_FORMAT_COUNT) {
+		return 0;
+	}
+	return s_sampleSizes[format];
+}
+
+const char *PcmConverter::FormatName(PcmFormat format)
+{
+	if (format < 0 || format >= PCM_FORMAT_COUNT) {
+		return "unknown";
+	}
+	return s_formatNames[format];
+}
+
+const char *PcmConverter::DitherName(PcmDither dither)
+{
+	if (dither < 0 || dither >= PCM_DITHER_COUNT) {
+		return "unknown";
+	}
+	return s_ditherNames[dither];
+}
+
+HRESULT CreatePcmWaveFormat(IMFMediaType *pFloatType, PcmFormat format,
+							WAVEFORMATEXTENSIBLE *pWav, UINT32 *pcbFormat)
+{
+	UINT32 nChannels = MFGetAttributeUINT32(pFloatType,
+		MF_MT_AUDIO_NUM_CHANNELS, 0);
+	UINT32 nRate = MFGetAttributeUINT32(pFloatType,
+		MF_MT_AUDIO_SAMPLES_PER_SECOND, 0);
+	UINT32 cbSample = PcmConverter::BytesPerSample(format);
+	if (nChannels == 0 || nRate == 0 || cbSample == 0) {
+		return E_INVALIDARG;
+	}
+
+	ZeroMemory(pWav, sizeof(*pWav));
+	WAVEFORMATEX *pFormat = &pWav->Format;
+	pFormat->nChannels = (WORD)nChannels;
+	pFormat->nSamplesPerSec = nRate;
+	pFormat->wBitsPerSample = (WORD)(cbSample * 8);
+	pFormat->nBlockAlign = (WORD)(nChannels * cbSample);
+	pFormat->nAvgBytesPerSec = nRate * pFormat->nBlockAlign;
+
+	BOOL bFloat = (format == PCM_FORMAT_FLOAT32);
+	if (nChannels <= 2 && (cbSample <= 2 || bFloat)) {
+		pFormat->wFormatTag = bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+		pFormat->cbSize = 0;
+		*pcbFormat = sizeof(WAVEFORMATEX);
+		return S_OK;
+	}
+
+	// Keep the device's speaker positions if it gave them
+	DWORD dwChannelMask = MFGetAttributeUINT32(pFloatType,
+		MF_MT_AUDIO_CHANNEL_MASK, 0);
+	if (dwChannelMask == 0) {
+		if (nChannels == 1) {
+			dwChannelMask = KSAUDIO_SPEAKER_MONO;
+		} else if (nChannels == 2) {
+			dwChannelMask = KSAUDIO_SPEAKER_STEREO;
+		}
+	}
+
+	pFormat->wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+	pFormat->cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+	pWav->Samples.wValidBitsPerSample = pFormat->wBitsPerSample;
+	pWav->dwChannelMask = dwChannelMask;
+	pWav->SubFormat = bFloat ? KSDATAFORMAT_SUBTYPE_IEEE_FLOAT :
+		KSDATAFORMAT_SUBTYPE_PCM;
+	*pcbFormat = sizeof(WAVEFORMATEXTENSIBLE);
+	return S_OK;
+}
+
+// Times each format, dither and kernel on a block of noise, checks the
+// vector kernels against the scalar ones, and prints how much smaller
+// an hour of stereo 48 kHz audio is than as float.
+void benchmarkPcmConverter(void) {
+	const DWORD N_FRAMES = 256 * 1024;
+	const UINT32 N_CHANNELS = 2;
+	const double MIN_SECONDS = 0.25;
+	const DWORD N_SAMPLES = N_FRAMES * N_CHANNELS;
+
+	float *pIn = new (std::nothrow) float[N_SAMPLES];
+	BYTE *pOut = new (std::nothrow) BYTE[N_SAMPLES * 4];
+	BYTE *pRef = new (std::nothrow) BYTE[N_SAMPLES * 4];
+	if (pIn == NULL || pOut == NULL || pRef == NULL) {
+		printf("Out of memory\n");
+		delete [] pIn;
+		delete [] pOut;
+		delete [] pRef;
+		return;
+	}
+
+	// Noise, with some samples past full scale to exercise the clipping
+	srand(1);
+	for (DWORD i = 0; i < N_SAMPLES; i++) {
+		pIn[i] = (float)((rand() << 15 | rand()) / 1073741823.0 * 1.8 - 0.9);
+		if (i % 1000 == 0) pIn[i] = (i % 2000) ? 1.5f : -1.5f;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("PCM conversion benchmark, %u samples per block\n", N_SAMPLES);
+	for (int iFormat = PCM_FORMAT_INT16; iFormat < PCM_FORMAT_COUNT; iFormat++) {
+		PcmFormat format = (PcmFormat)iFormat;
+		for (int iDither = 0; iDither < PCM_DITHER_COUNT; iDither++) {
+			PcmDither dither = (PcmDither)iDither;
+			if (format == PCM_FORMAT_INT32 && dither != PCM_DITHER_NONE) {
+				continue;
+			}
+
+			PcmConverter reference;
+			reference.Initialize(N_CHANNELS, format, dither);
+			reference.SetKernel(LEVEL_KERNEL_SCALAR);
+			DWORD cbOut = reference.Convert(pIn, N_FRAMES, pRef);
+
+			for (int iKernel = 0; iKernel < LEVEL_KERNEL_COUNT; iKernel++) {
+				PcmConverter converter;
+				converter.Initialize(N_CHANNELS, format, dither);
+				if (!converter.SetKernel((LevelKernel)iKernel)) {
+					printf("  %-6s %-7s %-7s not supported\n",
+						PcmConverter::FormatName(format),
+						PcmConverter::DitherName(dither),
+						LevelMeter::KernelName((LevelKernel)iKernel));
+					continue;
+				}
+				if (converter.Kernel() != iKernel) {
+					continue;
+				}
+
+				LARGE_INTEGER tStart, tEnd;
+				ULONGLONG nBlocks = 0;
+				double seconds = 0.0;
+				QueryPerformanceCounter(&tStart);
+				do {
+					converter.Convert(pIn, N_FRAMES, pOut);
+					nBlocks++;
+					QueryPerformanceCounter(&tEnd);
+					seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+				} while (seconds < MIN_SECONDS);
+
+				// The dither comes from differently seeded lanes, so only
+				// undithered output can be compared exactly
+				const char *szCheck = "";
+				if (dither == PCM_DITHER_NONE) {
+					converter.Initialize(N_CHANNELS, format, dither);
+					converter.SetKernel((LevelKernel)iKernel);
+					converter.Convert(pIn, N_FRAMES, pOut);
+					szCheck = memcmp(pOut, pRef, cbOut) ? "  MISMATCH" : "";
+				}
+				double samplesPerNs = nBlocks * N_SAMPLES / (seconds * 1e9);
+				printf("  %-6s %-7s %-7s %6.2f samples/ns, %.0fx real time%s\n",
+					PcmConverter::FormatName(format),
+					PcmConverter::DitherName(dither),
+					LevelMeter::KernelName((LevelKernel)iKernel), samplesPerNs,
+					samplesPerNs * 1e9 / (48000.0 * N_CHANNELS), szCheck);
+			}
+		}
+	}
+
+	ULONGLONG cbFloatHour = 3600ULL * 48000 * N_CHANNELS * 4;
+	printf("One hour of stereo 48 kHz audio:\n");
+	for (int iFormat = 0; iFormat < PCM_FORMAT_COUNT; iFormat++) {
+		ULONGLONG cbHour = 3600ULL * 48000 * N_CHANNELS *
+			PcmConverter::BytesPerSample((PcmFormat)iFormat);
+		printf("  %-7s %6.0f MB, %3.0f%% less to write than float\n",
+			PcmConverter::FormatName((PcmFormat)iFormat),
+			cbHour / 1048576.0, 100.0 - 100.0 * cbHour / cbFloatHour);
+	}
+
+	delete [] pIn;
+	delete [] pOut;
+	delete [] pRef;
+}
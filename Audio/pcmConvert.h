@@ -0,0 +1,98 @@
+//////////////////////////////////////////////////////////////////////////
+// pcmConvert.h: Float to integer PCM conversion with dither
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+#include "levelMeter.h"
+
+// Sample formats the WAV writer can store
+enum PcmFormat
+{
+    PCM_FORMAT_FLOAT32,         // As captured, no conversion
+    PCM_FORMAT_INT16,
+    PCM_FORMAT_INT24,           // Packed, 3 bytes per sample
+    PCM_FORMAT_INT32,
+    PCM_FORMAT_COUNT
+};
+
+// What is added before rounding to the integer format
+enum PcmDither
+{
+    PCM_DITHER_NONE,            // Plain rounding
+    PCM_DITHER_TPDF,            // Triangular dither of +/-1 LSB
+    PCM_DITHER_SHAPED,          // TPDF with the noise shaped out of the midrange
+    PCM_DITHER_COUNT
+};
+
+// How the WAV writer stores the samples
+struct PcmOptions
+{
+    PcmFormat   format;
+    PcmDither   dither;
+
+    PcmOptions() :
+    format(PCM_FORMAT_FLOAT32),
+    dither(PCM_DITHER_TPDF)
+    {
+    }
+};
+
+// Random number and noise shaping state carried between blocks
+struct PcmDitherState
+{
+    BOOL        bDither;        // Add TPDF dither
+    UINT32      rng[8];         // One xorshift generator per vector lane
+    float       *pErrors;       // Shaping filter history, per channel
+    UINT32      nChannels;
+    UINT32      iChannel;       // Channel of the next sample
+};
+
+typedef void (*PcmConvertProc)(const float *pIn, DWORD nSamples, BYTE *pOut,
+                               PcmDitherState *pDither);
+
+// Converts interleaved float samples, full scale 1.0, to integer PCM.
+// Out-of-range samples are clipped.  Plain rounding and TPDF dither
+// run in SSE2 or AVX2 when the processor has them; noise shaping
+// feeds back each sample's error into the next, so it is scalar.
+// Dither is not applied to 32-bit output, which is already finer than
+// the 24-bit precision of a float.
+class PcmConverter
+{
+public:
+    PcmConverter();
+    ~PcmConverter();
+
+    HRESULT Initialize(UINT32 nChannels, PcmFormat format, PcmDither dither);
+    BOOL    SetKernel(LevelKernel kernel);
+
+    // Converts whole frames.  Returns the bytes written to pOut, which
+    // must hold nFrames * BytesPerFrame().
+    DWORD   Convert(const float *pIn, UINT32 nFrames, BYTE *pOut);
+
+    PcmFormat   Format() const { return m_format; }
+    UINT32      Channels() const { return m_nChannels; }
+    LevelKernel Kernel() const { return m_kernel; }
+    UINT32      BytesPerFrame() const { return m_nChannels * BytesPerSample(m_format); }
+
+    static UINT32       BytesPerSample(PcmFormat format);
+    static const char   *FormatName(PcmFormat format);
+    static const char   *DitherName(PcmDither dither);
+
+private:
+    PcmFormat       m_format;
+    PcmDither       m_dither;
+    UINT32          m_nChannels;
+    LevelKernel     m_kernel;
+    PcmConvertProc  m_pfnConvert;
+    PcmDitherState  m_state;
+};
+
+// Fills in the header for a file of the given format, with the rate and
+// channels of a float media type.  WAVEFORMATEXTENSIBLE is used for
+// more than 16 bits or more than 2 channels, as those require it.
+HRESULT CreatePcmWaveFormat(IMFMediaType *pFloatType, PcmFormat format,
+                            WAVEFORMATEXTENSIBLE *pWav, UINT32 *pcbFormat);
+
+void benchmarkPcmConverter(void);
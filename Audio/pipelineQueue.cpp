@@ -0,0 +1,133 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "pipelineQueue.h"
+
+PipelineQueue::PipelineQueue() :
+m_pItems(NULL),
+m_nCapacity(0),
+m_iHead(0),
+m_nCount(0),
+m_bClosed(FALSE)
+{
+	InitializeCriticalSection(&m_critsec);
+	InitializeConditionVariable(&m_notFull);
+	InitializeConditionVariable(&m_notEmpty);
+	ZeroMemory(&m_stats, sizeof(m_stats));
+}
+
+PipelineQueue::~PipelineQueue()
+{
+	Clear();
+	delete [] m_pItems;
+	DeleteCriticalSection(&m_critsec);
+}
+
+// Allocates the queue.  Should not be called while either side is
+// active.
+HRESULT PipelineQueue::Initialize(LONG nCapacity)
+{
+	if (nCapacity <= 0) {
+		return E_INVALIDARG;
+	}
+
+	Clear();
+	delete [] m_pItems;
+	m_pItems = new (std::nothrow) PipelineItem[nCapacity];
+	if (m_pItems == NULL) {
+		m_nCapacity = 0;
+		return E_OUTOFMEMORY;
+	}
+	m_nCapacity = nCapacity;
+	m_iHead = 0;
+	m_nCount = 0;
+	m_bClosed = FALSE;
+	ZeroMemory(&m_stats, sizeof(m_stats));
+	return S_OK;
+}
+
+// Adds an item, waiting for room if the queue is full.  Returns FALSE
+// if the queue is closed, in which case the item was not added.
+BOOL PipelineQueue::Push(const PipelineItem &item)
+{
+	EnterCriticalSection(&m_critsec);
+	if (m_nCount == m_nCapacity && !m_bClosed) {
+		m_stats.nProducerWaits++;
+		while (m_nCount == m_nCapacity && !m_bClosed) {
+			SleepConditionVariableCS(&m_notFull, &m_critsec, INFINITE);
+		}
+	}
+	if (m_bClosed) {
+		LeaveCriticalSection(&m_critsec);
+		return FALSE;
+	}
+
+	PipelineItem *pSlot = &m_pItems[(m_iHead + m_nCount) % m_nCapacity];
+	*pSlot = item;
+	if (pSlot->pSample) {
+		pSlot->pSample->AddRef();
+	}
+	m_nCount++;
+	m_stats.nPushed++;
+	if (m_nCount > m_stats.nHighWater) {
+		m_stats.nHighWater = m_nCount;
+	}
+	LeaveCriticalSection(&m_critsec);
+
+	WakeConditionVariable(&m_notEmpty);
+	return TRUE;
+}
+
+// Removes an item, waiting for one if the queue is empty.  Returns
+// FALSE once the queue is closed and empty.  The caller releases the
+// returned sample.
+BOOL PipelineQueue::Pop(PipelineItem *pItem)
+{
+	EnterCriticalSection(&m_critsec);
+	if (m_nCount == 0 && !m_bClosed) {
+		m_stats.nConsumerWaits++;
+		while (m_nCount == 0 && !m_bClosed) {
+			SleepConditionVariableCS(&m_notEmpty, &m_critsec, INFINITE);
+		}
+	}
+	if (m_nCount == 0) {
+		LeaveCriticalSection(&m_critsec);
+		return FALSE;
+	}
+
+	*pItem = m_pItems[m_iHead];
+	m_pItems[m_iHead].pSample = NULL;
+	m_iHead = (m_iHead + 1) % m_nCapacity;
+	m_nCount--;
+	LeaveCriticalSection(&m_critsec);
+
+	WakeConditionVariable(&m_notFull);
+	return TRUE;
+}
+
+// Stops the queue.  Items already queued can still be popped.
+void PipelineQueue::Close()
+{
+	EnterCriticalSection(&m_critsec);
+	m_bClosed = TRUE;
+	LeaveCriticalSection(&m_critsec);
+
+	WakeAllConditionVariable(&m_notFull);
+	WakeAllConditionVariable(&m_notEmpty);
+}
+
+void PipelineQueue::GetStats(PipelineQueueStats *pStats)
+{
+	EnterCriticalSection(&m_critsec);
+	*pStats = m_stats;
+	LeaveCriticalSection(&m_critsec);
+}
+
+// Releases anything still queued
+void PipelineQueue::Clear()
+{
+	for (LONG i = 0; i < m_nCount; i++) {
+		SafeRelease(&m_pItems[(m_iHead + i) % m_nCapacity].pSample);
+	}
+	m_iHead = 0;
+	m_nCount = 0;
+}
@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////
+// pipelineQueue.h: Bounded blocking queue between pipeline stages
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Default number of items the queue holds before the producer waits
+const LONG PIPELINE_QUEUE_CAPACITY = 64;
+
+// One unit of work passed between stages.  Either a sample or, for a
+// gap in the source, a stream tick at llTimestamp.
+struct PipelineItem
+{
+    IMFSample   *pSample;       // NULL for a stream tick
+    LONGLONG    llTimestamp;    // Rebased time, in 100-ns units
+    LONGLONG    qpcRead;        // QueryPerformanceCounter when it was read
+};
+
+// Counters kept by the queue
+struct PipelineQueueStats
+{
+    LONG        nHighWater;     // Largest depth seen
+    LONG        nProducerWaits; // Times Push waited for room
+    LONG        nConsumerWaits; // Times Pop waited for an item
+    LONGLONG    nPushed;
+};
+
+// Fixed-size queue where Push waits while the queue is full (so a slow
+// consumer holds back the producer) and Pop waits while it is empty.
+// Neither spins.  Close wakes both sides: Push then fails, and Pop
+// returns the remaining items and then fails.  The queue holds a
+// reference on each queued sample.
+class PipelineQueue
+{
+public:
+    PipelineQueue();
+    ~PipelineQueue();
+
+    HRESULT Initialize(LONG nCapacity);
+    BOOL    Push(const PipelineItem &item);
+    BOOL    Pop(PipelineItem *pItem);
+    void    Close();
+    void    GetStats(PipelineQueueStats *pStats);
+
+private:
+    void    Clear();
+
+    CRITICAL_SECTION    m_critsec;
+    CONDITION_VARIABLE  m_notFull;
+    CONDITION_VARIABLE  m_notEmpty;
+
+    PipelineItem    *m_pItems;
+    LONG            m_nCapacity;
+    LONG            m_iHead;        // Next item to pop
+    LONG            m_nCount;
+    BOOL            m_bClosed;
+
+    PipelineQueueStats m_stats;
+};
@@ -0,0 +1,676 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "resampler.h"
+#include "levelMeter.h"
+
+#include <immintrin.h>
+#include <math.h>
+
+const double PI = 3.14159265358979323846;
+
+// Filter settings for each quality.  The cutoff is placed so that the
+// transition band of the Kaiser window ends at the Nyquist frequency.
+struct ResamplerTier
+{
+	UINT32 nTaps;
+	UINT32 nPhases;
+	double beta;
+};
+
+static const ResamplerTier s_tiers[RESAMPLER_QUALITY_COUNT] = {
+	{  16,   64,  5.0 },
+	{  48,  256,  8.0 },
+	{ 128,  512, 12.0 },
+};
+
+static const char *s_qualityNames[RESAMPLER_QUALITY_COUNT] = {
+	"low", "medium", "high"
+};
+
+// Zeroth-order modified Bessel function of the first kind
+static double BesselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 50; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-17) {
+			break;
+		}
+	}
+	return sum;
+}
+
+static UINT32 RoundUp8(UINT32 n)
+{
+	return (n + 7) & ~7u;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Kernels.  n is always a multiple of 8.
+
+static float DotScalar(const float *a, const float *b, UINT32 n)
+{
+	float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+	for (UINT32 i = 0; i < n; i += 4) {
+		sum0 += a[i] * b[i];
+		sum1 += a[i + 1] * b[i + 1];
+		sum2 += a[i + 2] * b[i + 2];
+		sum3 += a[i + 3] * b[i + 3];
+	}
+	return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static void LerpScalar(const float *a, const float *b, float w, float *pOut,
+					   UINT32 n)
+{
+	for (UINT32 i = 0; i < n; i++) {
+		pOut[i] = a[i] + w * (b[i] - a[i]);
+	}
+}
+
+static float DotSse(const float *a, const float *b, UINT32 n)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	for (UINT32 i = 0; i < n; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i),
+			_mm_load_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+			_mm_load_ps(b + i + 4)));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0);
+}
+
+static void LerpSse(const float *a, const float *b, float w, float *pOut,
+					UINT32 n)
+{
+	__m128 vw = _mm_set1_ps(w);
+	for (UINT32 i = 0; i < n; i += 4) {
+		__m128 va = _mm_load_ps(a + i);
+		__m128 vb = _mm_load_ps(b + i);
+		_mm_store_ps(pOut + i, _mm_add_ps(va, _mm_mul_ps(vw, _mm_sub_ps(vb, va))));
+	}
+}
+
+static float DotAvx(const float *a, const float *b, UINT32 n)
+{
+	__m256 sum = _mm256_setzero_ps();
+	for (UINT32 i = 0; i < n; i += 8) {
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+			_mm256_load_ps(b + i)));
+	}
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(sum),
+		_mm256_extractf128_ps(sum, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	_mm256_zeroupper();
+	return _mm_cvtss_f32(s);
+}
+
+static void LerpAvx(const float *a, const float *b, float w, float *pOut,
+					UINT32 n)
+{
+	__m256 vw = _mm256_set1_ps(w);
+	for (UINT32 i = 0; i < n; i += 8) {
+		__m256 va = _mm256_load_ps(a + i);
+		__m256 vb = _mm256_load_ps(b + i);
+		_mm256_store_ps(pOut + i,
+			_mm256_add_ps(va, _mm256_mul_ps(vw, _mm256_sub_ps(vb, va))));
+	}
+	_mm256_zeroupper();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Resampler
+
+Resampler::Resampler() :
+m_nInRate(0),
+m_nOutRate(0),
+m_nChannels(0),
+m_nTaps(0),
+m_nPhases(0),
+m_pTable(NULL),
+m_pCoefs(NULL),
+m_ppInput(NULL),
+m_nCapacity(0),
+m_nBuffered(0),
+m_step(1.0),
+m_pos(0.0),
+m_nInTotal(0),
+m_nOutTotal(0),
+m_pfnDot(DotScalar),
+m_pfnLerp(LerpScalar),
+m_szKernel("scalar")
+{
+}
+
+Resampler::~Resampler()
+{
+	Free();
+}
+
+void Resampler::Free()
+{
+	if (m_ppInput) {
+		for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+			_aligned_free(m_ppInput[ch]);
+		}
+		delete [] m_ppInput;
+		m_ppInput = NULL;
+	}
+	_aligned_free(m_pTable);
+	_aligned_free(m_pCoefs);
+	m_pTable = NULL;
+	m_pCoefs = NULL;
+	m_nCapacity = 0;
+	m_nBuffered = 0;
+}
+
+// Builds the filter for the conversion.  When downsampling, the
+// cutoff moves down to the output Nyquist frequency and the filter is
+// lengthened to keep the same transition band relative to it.
+HRESULT Resampler::Initialize(UINT32 nInRate, UINT32 nOutRate,
+							  UINT32 nChannels, ResamplerQuality quality)
+{
+	if (nInRate == 0 || nOutRate == 0 || nChannels == 0 ||
+		quality < 0 || quality >= RESAMPLER_QUALITY_COUNT) {
+		return E_INVALIDARG;
+	}
+	if ((ULONGLONG)nInRate > (ULONGLONG)nOutRate * RESAMPLER_MAX_RATIO ||
+		(ULONGLONG)nOutRate > (ULONGLONG)nInRate * RESAMPLER_MAX_RATIO) {
+		return E_INVALIDARG;
+	}
+
+	Free();
+	const ResamplerTier *pTier = &s_tiers[quality];
+	double ratio = min(1.0, (double)nOutRate / nInRate);
+
+	m_nInRate = nInRate;
+	m_nOutRate = nOutRate;
+	m_nChannels = nChannels;
+	m_nTaps = RoundUp8((UINT32)ceil(pTier->nTaps / ratio));
+	m_nPhases = pTier->nPhases;
+
+	m_pTable = (float *)_aligned_malloc(
+		(m_nPhases + 1) * m_nTaps * sizeof(float), 32);
+	m_pCoefs = (float *)_aligned_malloc(m_nTaps * sizeof(float), 32);
+	m_ppInput = new (std::nothrow) float *[nChannels];
+	if (m_pTable == NULL || m_pCoefs == NULL || m_ppInput == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+	ZeroMemory(m_ppInput, nChannels * sizeof(float *));
+
+	// Transition width of a Kaiser window with this beta and length,
+	// in cycles per input sample
+	double atten = pTier->beta / 0.1102 + 8.7;
+	double width = (atten - 8.0) / (2.285 * 2.0 * PI * m_nTaps);
+	double cutoff = 0.5 * ratio - width / 2.0;
+	double half = m_nTaps / 2.0;
+	double i0Beta = BesselI0(pTier->beta);
+
+	// Row p holds the taps for an output frame p/m_nPhases of the way
+	// from one input frame to the next, normalized for unity gain.
+	for (UINT32 p = 0; p <= m_nPhases; p++) {
+		float *pRow = m_pTable + p * m_nTaps;
+		double frac = (double)p / m_nPhases;
+		double sum = 0.0;
+		for (UINT32 k = 0; k < m_nTaps; k++) {
+			double d = (double)k - half + 1.0 - frac;
+			double x = d / half;
+			double window = 0.0;
+			if (x > -1.0 && x < 1.0) {
+				window = BesselI0(pTier->beta * sqrt(1.0 - x * x)) / i0Beta;
+			}
+			double sinc = (d == 0.0) ? 1.0 :
+				sin(2.0 * PI * cutoff * d) / (2.0 * PI * cutoff * d);
+			double h = 2.0 * cutoff * sinc * window;
+			pRow[k] = (float)h;
+			sum += h;
+		}
+		for (UINT32 k = 0; k < m_nTaps; k++) {
+			pRow[k] = (float)(pRow[k] / sum);
+		}
+	}
+
+	if (LevelMeter::IsKernelSupported(LEVEL_KERNEL_AVX2)) {
+		m_pfnDot = DotAvx;
+		m_pfnLerp = LerpAvx;
+		m_szKernel = "AVX";
+	} else if (LevelMeter::IsKernelSupported(LEVEL_KERNEL_SSE2)) {
+		m_pfnDot = DotSse;
+		m_pfnLerp = LerpSse;
+		m_szKernel = "SSE";
+	} else {
+		m_pfnDot = DotScalar;
+		m_pfnLerp = LerpScalar;
+		m_szKernel = "scalar";
+	}
+
+	// Reset primes half the filter, which is longer than a block of
+	// input when downsampling far
+	m_step = (double)nInRate / nOutRate;
+	if (!Reserve(max(4096, m_nTaps))) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+	Reset();
+	return S_OK;
+}
+
+// Drops any buffered input, as at the start of a stream
+void Resampler::Reset()
+{
+	// Prime with silence so the first output frame lines up with the
+	// first input frame
+	UINT32 nPrime = m_nTaps / 2 - 1;
+	for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+		ZeroMemory(m_ppInput[ch], nPrime * sizeof(float));
+	}
+	m_nBuffered = nPrime;
+	m_pos = nPrime;
+	m_nInTotal = 0;
+	m_nOutTotal = 0;
+}
+
+void Resampler::SetDrift(double ppm)
+{
+	m_step = (double)m_nInRate / m_nOutRate * (1.0 + ppm * 1e-6);
+}
+
+UINT32 Resampler::MaxOutputFrames(UINT32 nInFrames) const
+{
+	double nAvailable = m_nBuffered + nInFrames - m_pos;
+	if (nAvailable <= 0) {
+		return 0;
+	}
+	return (UINT32)ceil(nAvailable / m_step) + 1;
+}
+
+// Makes room for nFrames more input frames
+BOOL Resampler::Reserve(UINT32 nFrames)
+{
+	if (m_nBuffered + nFrames <= m_nCapacity) {
+		return TRUE;
+	}
+
+	UINT32 nCapacity = max(m_nCapacity * 2, m_nBuffered + nFrames);
+	for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+		float *p = (float *)_aligned_malloc(nCapacity * sizeof(float), 32);
+		if (p == NULL) {
+			return FALSE;
+		}
+		if (m_ppInput[ch]) {
+			memcpy(p, m_ppInput[ch], m_nBuffered * sizeof(float));
+			_aligned_free(m_ppInput[ch]);
+		}
+		m_ppInput[ch] = p;
+	}
+	m_nCapacity = nCapacity;
+	return TRUE;
+}
+
+// Splits interleaved input into the channel arrays.  NULL appends
+// silence.
+void Resampler::Append(const float *pIn, UINT32 nFrames)
+{
+	for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+		float *pDest = m_ppInput[ch] + m_nBuffered;
+		if (pIn == NULL) {
+			ZeroMemory(pDest, nFrames * sizeof(float));
+			continue;
+		}
+		const float *pSrc = pIn + ch;
+		for (UINT32 i = 0; i < nFrames; i++, pSrc += m_nChannels) {
+			pDest[i] = *pSrc;
+		}
+	}
+	m_nBuffered += nFrames;
+}
+
+// Writes output frames while the filter has all its input
+UINT32 Resampler::Produce(float *pOut, UINT32 nMaxOut)
+{
+	UINT32 half = m_nTaps / 2;
+	UINT32 nOut = 0;
+
+	while (nOut < nMaxOut) {
+		UINT32 i = (UINT32)m_pos;
+		if (i + half >= m_nBuffered) {
+			break;
+		}
+
+		double phase = (m_pos - i) * m_nPhases;
+		UINT32 p = (UINT32)phase;
+		const float *pRow = m_pTable + p * m_nTaps;
+		m_pfnLerp(pRow, pRow + m_nTaps, (float)(phase - p), m_pCoefs, m_nTaps);
+
+		UINT32 iFirst = i + 1 - half;
+		for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+			*pOut++ = m_pfnDot(m_ppInput[ch] + iFirst, m_pCoefs, m_nTaps);
+		}
+		nOut++;
+		m_pos += m_step;
+	}
+
+	m_nOutTotal += nOut;
+	return nOut;
+}
+
+// Drops the input the filter no longer needs
+void Resampler::Discard()
+{
+	UINT32 half = m_nTaps / 2;
+	UINT32 i = (UINT32)m_pos;
+	if (i + 1 <= half) {
+		return;
+	}
+	UINT32 nDrop = min(i + 1 - half, m_nBuffered);
+	for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+		memmove(m_ppInput[ch], m_ppInput[ch] + nDrop,
+			(m_nBuffered - nDrop) * sizeof(float));
+	}
+	m_nBuffered -= nDrop;
+	m_pos -= nDrop;
+}
+
+UINT32 Resampler::Process(const float *pIn, UINT32 nInFrames, float *pOut,
+						  UINT32 nMaxOut)
+{
+	Discard();
+	if (!Reserve(nInFrames)) {
+		return 0;
+	}
+	Append(pIn, nInFrames);
+	m_nInTotal += nInFrames;
+	return Produce(pOut, nMaxOut);
+}
+
+UINT32 Resampler::Flush(float *pOut, UINT32 nMaxOut)
+{
+	// The output owed for all the input, at the current ratio
+	ULONGLONG nTotal = (ULONGLONG)ceil(m_nInTotal / m_step);
+	if (m_nOutTotal >= nTotal || nMaxOut == 0) {
+		return 0;
+	}
+	nMaxOut = (UINT32)min((ULONGLONG)nMaxOut, nTotal - m_nOutTotal);
+
+	// Pad with enough silence for the last frames to be computed
+	UINT32 half = m_nTaps / 2;
+	UINT32 nPad = 0;
+	UINT32 iLast = (UINT32)(m_pos + (nMaxOut - 1) * m_step);
+	if (iLast + half >= m_nBuffered) {
+		nPad = iLast + half + 1 - m_nBuffered;
+	}
+	Discard();
+	if (!Reserve(nPad)) {
+		return 0;
+	}
+	Append(NULL, nPad);
+	return Produce(pOut, nMaxOut);
+}
+
+const char *Resampler::QualityName(ResamplerQuality quality)
+{
+	if (quality < 0 || quality >= RESAMPLER_QUALITY_COUNT) {
+		return "unknown";
+	}
+	return s_qualityNames[quality];
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Media Foundation helpers
+
+HRESULT CreateResampledType(IMFMediaType *pType, UINT32 nSampleRate,
+							IMFMediaType **ppResampled)
+{
+	IMFMediaType *pResampled = NULL;
+
+	HRESULT hr = MFCreateMediaType(&pResampled);
+	if (SUCCEEDED(hr)) {
+		hr = pType->CopyAllItems(pResampled);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pResampled->SetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, nSampleRate);
+	}
+	if (SUCCEEDED(hr)) {
+		UINT32 cbBlock = MFGetAttributeUINT32(pType,
+			MF_MT_AUDIO_BLOCK_ALIGNMENT, 0);
+		hr = pResampled->SetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND,
+			cbBlock * nSampleRate);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppResampled = pResampled;
+		(*ppResampled)->AddRef();
+	}
+
+	SafeRelease(&pResampled);
+	return hr;
+}
+
+// Wraps nFrames of output, starting at llTime, in a new sample
+static HRESULT CreateOutputSample(Resampler *pResampler, UINT32 nMaxOut,
+								  BOOL bFlush, const float *pIn,
+								  UINT32 nInFrames, LONGLONG llTime,
+								  IMFSample **ppOut)
+{
+	IMFSample *pSample = NULL;
+	IMFMediaBuffer *pBuffer = NULL;
+	BYTE *pData = NULL;
+	UINT32 cbFrame = pResampler->Channels() * sizeof(float);
+	UINT32 nOut = 0;
+
+	*ppOut = NULL;
+	HRESULT hr = MFCreateMemoryBuffer(max(nMaxOut, 1u) * cbFrame, &pBuffer);
+	if (SUCCEEDED(hr)) {
+		hr = pBuffer->Lock(&pData, NULL, NULL);
+	}
+	if (SUCCEEDED(hr)) {
+		if (bFlush) {
+			nOut = pResampler->Flush((float *)pData, nMaxOut);
+		} else {
+			nOut = pResampler->Process(pIn, nInFrames, (float *)pData, nMaxOut);
+		}
+		pBuffer->Unlock();
+		hr = pBuffer->SetCurrentLength(nOut * cbFrame);
+	}
+	if (SUCCEEDED(hr) && nOut > 0) {
+		hr = MFCreateSample(&pSample);
+		if (SUCCEEDED(hr)) {
+			hr = pSample->AddBuffer(pBuffer);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->SetSampleTime(llTime);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->SetSampleDuration(
+				nOut * 10000000LL / pResampler->OutputRate());
+		}
+		if (SUCCEEDED(hr)) {
+			*ppOut = pSample;
+			(*ppOut)->AddRef();
+		}
+	}
+
+	SafeRelease(&pSample);
+	SafeRelease(&pBuffer);
+	return hr;
+}
+
+HRESULT ResampleSample(Resampler *pResampler, IMFSample *pIn,
+					   IMFSample **ppOut)
+{
+	IMFMediaBuffer *pBuffer = NULL;
+	BYTE *pData = NULL;
+	DWORD cbData = 0;
+	LONGLONG llTime = 0;
+
+	*ppOut = NULL;
+	HRESULT hr = pIn->ConvertToContiguousBuffer(&pBuffer);
+	if (SUCCEEDED(hr)) {
+		hr = pIn->GetSampleTime(&llTime);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pBuffer->Lock(&pData, NULL, &cbData);
+	}
+	if (SUCCEEDED(hr)) {
+		UINT32 nFrames = cbData / (pResampler->Channels() * sizeof(float));
+
+		// The first output frame is computed at a point in the input
+		// that may lie before this sample
+		LONGLONG llOutTime = llTime + (LONGLONG)(
+			pResampler->NextOutputOffset() * 10000000.0 /
+			pResampler->InputRate());
+		hr = CreateOutputSample(pResampler,
+			pResampler->MaxOutputFrames(nFrames), FALSE,
+			(const float *)pData, nFrames, llOutTime, ppOut);
+		pBuffer->Unlock();
+	}
+
+	SafeRelease(&pBuffer);
+	return hr;
+}
+
+HRESULT FlushResampler(Resampler *pResampler, LONGLONG llTime,
+					   IMFSample **ppOut)
+{
+	LONGLONG llOutTime = llTime + (LONGLONG)(
+		pResampler->NextOutputOffset() * 10000000.0 /
+		pResampler->InputRate());
+	UINT32 nMaxOut = (UINT32)ceil(pResampler->Taps() *
+		(double)pResampler->OutputRate() / pResampler->InputRate()) + 1;
+	return CreateOutputSample(pResampler, nMaxOut, TRUE, NULL, 0,
+		llOutTime, ppOut);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// Measures THD+N of a tone: fits a sine of the known frequency by least
+// squares and compares what is left over with the fitted tone.
+static double MeasureThdN(const float *pData, UINT32 nFrames, UINT32 nChannels,
+						  double freq, UINT32 nRate)
+{
+	double scc = 0, sss = 0, scs = 0, syc = 0, sys = 0;
+	for (UINT32 i = 0; i < nFrames; i++) {
+		double t = 2.0 * PI * freq * i / nRate;
+		double c = cos(t), s = sin(t);
+		double y = pData[i * nChannels];
+		scc += c * c; sss += s * s; scs += c * s;
+		syc += y * c; sys += y * s;
+	}
+	double det = scc * sss - scs * scs;
+	double a = (syc * sss - sys * scs) / det;
+	double b = (sys * scc - syc * scs) / det;
+
+	double signal = 0, residual = 0;
+	for (UINT32 i = 0; i < nFrames; i++) {
+		double t = 2.0 * PI * freq * i / nRate;
+		double fit = a * cos(t) + b * sin(t);
+		double e = pData[i * nChannels] - fit;
+		signal += fit * fit;
+		residual += e * e;
+	}
+	if (residual <= 0) {
+		return -HUGE_VAL;
+	}
+	return 10.0 * log10(residual / signal);
+}
+
+// Converts a stereo tone between common rates at each quality, and
+// prints the speed in frames per second on one core and the THD+N.
+void benchmarkResampler(void) {
+	const UINT32 N_CHANNELS = 2;
+	const UINT32 N_SECONDS = 2;
+	const UINT32 BLOCK_FRAMES = 480;
+	const double TONE_HZ = 997.0;
+	static const UINT32 rates[][2] = {
+		{ 44100, 48000 }, { 48000, 44100 }, { 96000, 48000 }, { 48000, 96000 },
+		{ 192000, 12000 }
+	};
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Resampler benchmark, %u channels, %u sec of a %.0f Hz tone\n",
+		N_CHANNELS, N_SECONDS, TONE_HZ);
+	for (int iRate = 0; iRate < ARRAYSIZE(rates); iRate++) {
+		UINT32 nInRate = rates[iRate][0];
+		UINT32 nOutRate = rates[iRate][1];
+		UINT32 nInFrames = nInRate * N_SECONDS;
+		UINT32 nOutMax = (UINT32)((ULONGLONG)nInFrames * nOutRate / nInRate) + 1024;
+
+		float *pIn = new (std::nothrow) float[nInFrames * N_CHANNELS];
+		float *pOut = new (std::nothrow) float[nOutMax * N_CHANNELS];
+		if (pIn == NULL || pOut == NULL) {
+			printf("Out of memory\n");
+			delete [] pIn;
+			delete [] pOut;
+			return;
+		}
+		for (UINT32 i = 0; i < nInFrames; i++) {
+			float x = (float)(0.5 * sin(2.0 * PI * TONE_HZ * i / nInRate));
+			for (UINT32 ch = 0; ch < N_CHANNELS; ch++) {
+				pIn[i * N_CHANNELS + ch] = x;
+			}
+		}
+
+		for (int q = 0; q < RESAMPLER_QUALITY_COUNT; q++) {
+			Resampler resampler;
+			if (FAILED(resampler.Initialize(nInRate, nOutRate, N_CHANNELS,
+				(ResamplerQuality)q))) {
+				printf("Out of memory\n");
+				break;
+			}
+
+			// Feed it in capture-sized blocks
+			LARGE_INTEGER tStart, tEnd;
+			UINT32 nOut = 0;
+			QueryPerformanceCounter(&tStart);
+			for (UINT32 i = 0; i < nInFrames; i += BLOCK_FRAMES) {
+				UINT32 n = min(BLOCK_FRAMES, nInFrames - i);
+				nOut += resampler.Process(pIn + i * N_CHANNELS, n,
+					pOut + nOut * N_CHANNELS, nOutMax - nOut);
+			}
+			UINT32 nFlushed;
+			while ((nFlushed = resampler.Flush(pOut + nOut * N_CHANNELS,
+				nOutMax - nOut)) > 0) {
+				nOut += nFlushed;
+			}
+			QueryPerformanceCounter(&tEnd);
+			double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+
+			// Leave out the edges, where the filter sees the silence
+			// around the tone
+			UINT32 nSkip = resampler.Taps() * nOutRate / nInRate + 1;
+			double thdn = MeasureThdN(pOut + nSkip * N_CHANNELS,
+				nOut - 2 * nSkip, N_CHANNELS, TONE_HZ, nOutRate);
+			printf("  %5u -> %5u %-6s %3u taps %-6s %7.1f M frames/sec, "
+				"THD+N %6.1f dB, %u frames out\n", nInRate, nOutRate,
+				Resampler::QualityName((ResamplerQuality)q), resampler.Taps(),
+				resampler.KernelName(),
+				seconds > 0 ? nInFrames / seconds / 1e6 : 0.0, thdn, nOut);
+		}
+
+		delete [] pIn;
+		delete [] pOut;
+	}
+
+	// Past the ratio limit the filter would outgrow its input buffer,
+	// so Initialize refuses it
+	Resampler limit;
+	HRESULT hrOver = limit.Initialize(RESAMPLER_MAX_RATE, RESAMPLER_MIN_RATE,
+		N_CHANNELS, RESAMPLER_QUALITY_HIGH);
+	HRESULT hrEdge = limit.Initialize(16000 * RESAMPLER_MAX_RATIO, 16000,
+		N_CHANNELS, RESAMPLER_QUALITY_HIGH);
+	printf("  Ratio limit %u: %u -> %u %s, %u -> %u %s\n", RESAMPLER_MAX_RATIO,
+		RESAMPLER_MAX_RATE, RESAMPLER_MIN_RATE,
+		hrOver == E_INVALIDARG ? "refused, ok" : "FAILED",
+		16000 * RESAMPLER_MAX_RATIO, 16000,
+		SUCCEEDED(hrEdge) ? "accepted, ok" : "FAILED");
+}
@@ -0,0 +1,132 @@
+//////////////////////////////////////////////////////////////////////////
+// resampler.h: Streaming sample rate converter
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Filter length and stopband, fastest first
+enum ResamplerQuality
+{
+    RESAMPLER_QUALITY_LOW,      // 16 taps, about 54 dB stopband
+    RESAMPLER_QUALITY_MEDIUM,   // 48 taps, about 80 dB stopband
+    RESAMPLER_QUALITY_HIGH,     // 128 taps, about 117 dB stopband
+    RESAMPLER_QUALITY_COUNT
+};
+
+// Rates the capture path accepts, and the most either rate may be a
+// multiple of the other.  The filter lengthens with the downsampling
+// ratio, so the ratio bounds its length and the input it must hold.
+const UINT32 RESAMPLER_MIN_RATE = 1000;
+const UINT32 RESAMPLER_MAX_RATE = 768000;
+const UINT32 RESAMPLER_MAX_RATIO = 16;
+
+// What the capture path should resample to.  A rate of 0 keeps the
+// device rate.
+struct ResampleOptions
+{
+    UINT32              nSampleRate;
+    ResamplerQuality    quality;
+    double              driftPpm;       // How fast the device clock runs
+
+    ResampleOptions() :
+    nSampleRate(0),
+    quality(RESAMPLER_QUALITY_MEDIUM),
+    driftPpm(0.0)
+    {
+    }
+};
+
+typedef float (*ResamplerDotProc)(const float *a, const float *b, UINT32 n);
+typedef void (*ResamplerLerpProc)(const float *a, const float *b, float w,
+                                  float *pOut, UINT32 n);
+
+// Converts interleaved float audio between any two rates with a
+// Kaiser-windowed sinc filter.  The filter is tabulated at a fixed
+// number of phases, and the coefficients for each output frame are
+// interpolated between the two nearest phases, so the ratio need not
+// be rational and can be nudged while running to follow a drifting
+// clock.  The inner loops use SSE or AVX when the processor has them.
+class Resampler
+{
+public:
+    Resampler();
+    ~Resampler();
+
+    HRESULT Initialize(UINT32 nInRate, UINT32 nOutRate, UINT32 nChannels,
+                       ResamplerQuality quality);
+    void    Reset();
+
+    // Stretches the ratio for an input clock that runs ppm parts per
+    // million fast (or slow, if negative) against the output clock.
+    void    SetDrift(double ppm);
+
+    // Most frames that Process can produce from nInFrames more input
+    UINT32  MaxOutputFrames(UINT32 nInFrames) const;
+
+    // Takes all of the input and writes up to nMaxOut frames of output.
+    // Output that does not fit is produced by the next call.
+    UINT32  Process(const float *pIn, UINT32 nInFrames, float *pOut,
+                    UINT32 nMaxOut);
+
+    // Writes the output still held back for the filter once the input
+    // has ended.  Call until it returns 0.
+    UINT32  Flush(float *pOut, UINT32 nMaxOut);
+
+    // Where the next output frame falls, in input frames relative to the
+    // end of the input so far (so it is 0 or negative)
+    double  NextOutputOffset() const { return m_pos - m_nBuffered; }
+
+    UINT32  InputRate() const { return m_nInRate; }
+    UINT32  OutputRate() const { return m_nOutRate; }
+    UINT32  Channels() const { return m_nChannels; }
+    UINT32  Taps() const { return m_nTaps; }
+    const char *KernelName() const { return m_szKernel; }
+
+    static const char *QualityName(ResamplerQuality quality);
+
+private:
+    void    Free();
+    BOOL    Reserve(UINT32 nFrames);
+    void    Append(const float *pIn, UINT32 nFrames);
+    UINT32  Produce(float *pOut, UINT32 nMaxOut);
+    void    Discard();
+
+    UINT32  m_nInRate;
+    UINT32  m_nOutRate;
+    UINT32  m_nChannels;
+    UINT32  m_nTaps;                // Multiple of 8
+    UINT32  m_nPhases;
+
+    float   *m_pTable;              // (m_nPhases + 1) rows of m_nTaps
+    float   *m_pCoefs;              // Interpolated row for one frame
+    float   **m_ppInput;            // Input history, one array per channel
+    UINT32  m_nCapacity;            // Frames each array holds
+    UINT32  m_nBuffered;            // Frames in each array
+
+    double  m_step;                 // Input frames per output frame
+    double  m_pos;                  // Input position of the next output frame
+    ULONGLONG m_nInTotal;
+    ULONGLONG m_nOutTotal;
+
+    ResamplerDotProc    m_pfnDot;
+    ResamplerLerpProc   m_pfnLerp;
+    const char          *m_szKernel;
+};
+
+// Creates a copy of an uncompressed audio type at another rate
+HRESULT CreateResampledType(IMFMediaType *pType, UINT32 nSampleRate,
+                            IMFMediaType **ppResampled);
+
+// Resamples the float audio in a sample into a new sample.  Sets
+// *ppOut to NULL if the filter is still filling.
+HRESULT ResampleSample(Resampler *pResampler, IMFSample *pIn,
+                       IMFSample **ppOut);
+
+// Creates a sample holding the output left in the filter at the end of
+// the stream, or sets *ppOut to NULL if there is none.
+HRESULT FlushResampler(Resampler *pResampler, LONGLONG llTime,
+                       IMFSample **ppOut);
+
+void benchmarkResampler(void);
@@ -0,0 +1,239 @@
+#include "stdafx.h"
+#include "sampleBuffers.h"
+#include "waveFile.h"
+#include "mfUtils.h"
+
+SampleBuffers::SampleBuffers() :
+m_nSegments(0),
+m_nLocked(0),
+m_cbTotal(0),
+m_cbCopied(0)
+{
+	ZeroMemory(m_ppBuffers, sizeof(m_ppBuffers));
+}
+
+SampleBuffers::~SampleBuffers()
+{
+	Unlock();
+}
+
+HRESULT SampleBuffers::Lock(IMFSample *pSample)
+{
+	Unlock();
+
+	DWORD nBuffers = 0;
+	HRESULT hr = pSample->GetBufferCount(&nBuffers);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Too many pieces to list, so join them
+	if (nBuffers > MAX_BUFFER_SEGMENTS) {
+		DWORD cbTotal = 0;
+		hr = pSample->GetTotalLength(&cbTotal);
+		if (SUCCEEDED(hr)) {
+			hr = pSample->ConvertToContiguousBuffer(&m_ppBuffers[0]);
+		}
+		if (FAILED(hr)) {
+			return hr;
+		}
+		m_cbCopied = cbTotal;
+		nBuffers = 1;
+	} else {
+		for (DWORD i = 0; i < nBuffers && SUCCEEDED(hr); i++) {
+			hr = pSample->GetBufferByIndex(i, &m_ppBuffers[i]);
+		}
+	}
+
+	for (DWORD i = 0; i < nBuffers && SUCCEEDED(hr); i++) {
+		BYTE *pData = NULL;
+		DWORD cbData = 0;
+		hr = m_ppBuffers[i]->Lock(&pData, NULL, &cbData);
+		if (SUCCEEDED(hr)) {
+			m_nLocked++;
+			m_segments[i].pData = pData;
+			m_segments[i].cbData = cbData;
+			m_cbTotal += cbData;
+		}
+	}
+	if (FAILED(hr)) {
+		Unlock();
+		return hr;
+	}
+	m_nSegments = nBuffers;
+	return S_OK;
+}
+
+void SampleBuffers::Unlock()
+{
+	for (DWORD i = 0; i < MAX_BUFFER_SEGMENTS; i++) {
+		if (i < m_nLocked) {
+			m_ppBuffers[i]->Unlock();
+		}
+		SafeRelease(&m_ppBuffers[i]);
+	}
+	m_nSegments = 0;
+	m_nLocked = 0;
+	m_cbTotal = 0;
+	m_cbCopied = 0;
+}
+
+DWORD SampleBuffers::Truncate(DWORD cbMax)
+{
+	DWORD cbTotal = 0;
+	DWORD i;
+	for (i = 0; i < m_nSegments && cbTotal < cbMax; i++) {
+		if (m_segments[i].cbData > cbMax - cbTotal) {
+			m_segments[i].cbData = cbMax - cbTotal;
+		}
+		cbTotal += m_segments[i].cbData;
+	}
+	// The buffers past the end stay locked until Unlock
+	m_nSegments = i;
+	m_cbTotal = cbTotal;
+	return cbTotal;
+}
+
+void SampleBuffers::CopyTo(BYTE *pOut) const
+{
+	for (DWORD i = 0; i < m_nSegments; i++) {
+		CopyMemory(pOut, m_segments[i].pData, m_segments[i].cbData);
+		pOut += m_segments[i].cbData;
+	}
+}
+
+// Makes a sample of nBuffers memory buffers of cbBuffer bytes each,
+// filled with noise
+static HRESULT CreateSegmentedSample(DWORD nBuffers, DWORD cbBuffer,
+									 IMFSample **ppSample)
+{
+	IMFSample *pSample = NULL;
+	HRESULT hr = MFCreateSample(&pSample);
+	for (DWORD i = 0; i < nBuffers && SUCCEEDED(hr); i++) {
+		IMFMediaBuffer *pBuffer = NULL;
+		BYTE *pData = NULL;
+		hr = MFCreateMemoryBuffer(cbBuffer, &pBuffer);
+		if (SUCCEEDED(hr)) {
+			hr = pBuffer->Lock(&pData, NULL, NULL);
+		}
+		if (SUCCEEDED(hr)) {
+			for (DWORD j = 0; j < cbBuffer; j++) {
+				pData[j] = (BYTE)rand();
+			}
+			pBuffer->Unlock();
+			hr = pBuffer->SetCurrentLength(cbBuffer);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->AddBuffer(pBuffer);
+		}
+		SafeRelease(&pBuffer);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppSample = pSample;
+	} else {
+		SafeRelease(&pSample);
+	}
+	return hr;
+}
+
+void benchmarkSampleBuffers(void) {
+	const ULONGLONG CB_TOTAL = 256 * 1024 * 1024;
+	const DWORD CB_BUFFER = 4096;
+	const DWORD bufferCounts[] = { 1, 4, 16 };
+	const WCHAR *szFileName = L"SampleBuffersBench.wav";
+	const int N_PATHS = 4;
+	const char *szPaths[N_PATHS] = {
+		"contiguous, direct", "contiguous, buffered",
+		"segments, direct", "segments, buffered"
+	};
+
+	WAVEFORMATEX wav;
+	ZeroMemory(&wav, sizeof(wav));
+	wav.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	wav.nChannels = 2;
+	wav.nSamplesPerSec = 48000;
+	wav.wBitsPerSample = 32;
+	wav.nBlockAlign = 8;
+	wav.nAvgBytesPerSec = 48000 * 8;
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	srand(1);
+
+	printf("Sample buffer write benchmark, %I64u MB in %u byte buffers\n",
+		CB_TOTAL / (1024 * 1024), CB_BUFFER);
+	for (int iCount = 0; iCount < sizeof(bufferCounts) / sizeof(bufferCounts[0]); iCount++) {
+		DWORD nBuffers = bufferCounts[iCount];
+		IMFSample *pSample = NULL;
+		HRESULT hr = CreateSegmentedSample(nBuffers, CB_BUFFER, &pSample);
+		if (FAILED(hr)) {
+			printf("Error creating sample\n");
+			printErrorDescription(hr);
+			return;
+		}
+		printf("%u buffer(s) per sample:\n", nBuffers);
+
+		for (int iPath = 0; iPath < N_PATHS; iPath++) {
+			BOOL bSegments = (iPath >= 2);
+			WaveFileOptions options;
+			if (iPath % 2 == 0) {
+				options.cbBlockSize = 0;
+			}
+
+			LARGE_INTEGER tStart, tEnd;
+			ULONGLONG cbLinearized = 0;
+			QueryPerformanceCounter(&tStart);
+
+			WaveFile waveFile;
+			waveFile.SetOptions(options);
+			hr = waveFile.Open(szFileName, &wav, sizeof(wav));
+			for (ULONGLONG cb = 0; cb < CB_TOTAL && SUCCEEDED(hr);
+				cb += nBuffers * CB_BUFFER) {
+				if (bSegments) {
+					SampleBuffers buffers;
+					hr = buffers.Lock(pSample);
+					if (SUCCEEDED(hr)) {
+						hr = waveFile.WriteSegments(buffers.Segments(),
+							buffers.Count());
+						cbLinearized += buffers.CopiedSize();
+					}
+				} else {
+					// What WriteWaveData did for every sample
+					IMFMediaBuffer *pBuffer = NULL;
+					BYTE *pData = NULL;
+					DWORD cbData = 0;
+					hr = pSample->ConvertToContiguousBuffer(&pBuffer);
+					if (SUCCEEDED(hr)) {
+						hr = pBuffer->Lock(&pData, NULL, &cbData);
+					}
+					if (SUCCEEDED(hr)) {
+						hr = waveFile.Write(pData, cbData);
+						pBuffer->Unlock();
+						if (nBuffers > 1) {
+							cbLinearized += cbData;
+						}
+					}
+					SafeRelease(&pBuffer);
+				}
+			}
+			if (SUCCEEDED(hr)) {
+				hr = waveFile.Close();
+			}
+			QueryPerformanceCounter(&tEnd);
+			DeleteFileW(szFileName);
+			if (FAILED(hr)) {
+				printf("  %-21s failed\n", szPaths[iPath]);
+				printErrorDescription(hr);
+				continue;
+			}
+
+			double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+			double cbWritten = (double)waveFile.DataSize();
+			printf("  %-21s %7.1f MB/s, %7u writes, %.2f bytes copied per byte written\n",
+				szPaths[iPath], cbWritten / (seconds * 1024 * 1024),
+				waveFile.WriteCount(),
+				(cbLinearized + waveFile.CopiedSize()) / cbWritten);
+		}
+		SafeRelease(&pSample);
+	}
+}
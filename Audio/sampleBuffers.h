@@ -0,0 +1,60 @@
+//////////////////////////////////////////////////////////////////////////
+// sampleBuffers.h: Writing the buffers of a sample without joining them
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Most buffers of one sample that are written separately.  Samples with
+// more are made contiguous first.
+const DWORD MAX_BUFFER_SEGMENTS = 16;
+
+// One piece of data to be written, in the same form as an iovec or a
+// WSABUF, so a list of them can be handed to a vectored write.
+struct BufferSegment
+{
+    const BYTE  *pData;
+    DWORD       cbData;
+};
+
+// Locks every buffer of a sample in place and lists them as segments,
+// so they can be written in order without ConvertToContiguousBuffer
+// copying them into one buffer first.
+class SampleBuffers
+{
+public:
+    SampleBuffers();
+    ~SampleBuffers();
+
+    HRESULT Lock(IMFSample *pSample);
+    void    Unlock();
+
+    // Shortens the list to at most cbMax bytes.  Returns the new size.
+    DWORD   Truncate(DWORD cbMax);
+
+    // Copies the segments, in order, to pOut, which holds TotalSize()
+    // bytes
+    void    CopyTo(BYTE *pOut) const;
+
+    const BufferSegment *Segments() const { return m_segments; }
+    DWORD   Count() const { return m_nSegments; }
+    DWORD   TotalSize() const { return m_cbTotal; }
+    BOOL    IsContiguous() const { return m_nSegments <= 1; }
+    // Bytes ConvertToContiguousBuffer copied, for samples with too
+    // many buffers
+    DWORD   CopiedSize() const { return m_cbCopied; }
+
+private:
+    IMFMediaBuffer  *m_ppBuffers[MAX_BUFFER_SEGMENTS];
+    BufferSegment   m_segments[MAX_BUFFER_SEGMENTS];
+    DWORD           m_nSegments;
+    DWORD           m_nLocked;
+    DWORD           m_cbTotal;
+    DWORD           m_cbCopied;
+};
+
+// Writes synthetic samples made of several buffers through the old
+// contiguous path and the segment path, and prints the throughput and
+// the bytes copied for each byte written.
+void benchmarkSampleBuffers(void);
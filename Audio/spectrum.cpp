@@ -0,0 +1,1056 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "spectrum.h"
+
+#include <immintrin.h>
+#include <math.h>
+
+const double PI = 3.14159265358979323846;
+
+// Level reported for a band or bin with no energy at all
+const float SPECTRUM_FLOOR_DB = -200.0f;
+
+static float PowerToDb(double power)
+{
+	if (power <= 1e-20) {
+		return SPECTRUM_FLOOR_DB;
+	}
+	return (float)(10.0 * log10(power));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// FFT passes
+//
+// Each pass runs the stages of half-size h and 2h over blocks of 4h
+// points.  Within a block, the points k, k + h, k + 2h and k + 3h are
+// combined in registers, so the data is read and written once for the
+// two stages.  The last passes run the single stage of half-size h
+// over the whole data, where nSize is 2h.
+
+static void FftPassScalar(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+						  const float *pTwRe, const float *pTwIm)
+{
+	for (UINT32 s = 0; s < nSize; s += 4 * h) {
+		float *r = pRe + s;
+		float *i = pIm + s;
+		for (UINT32 k = 0; k < h; k++) {
+			float w1r = pTwRe[h + k], w1i = pTwIm[h + k];
+			float w2r = pTwRe[2 * h + k], w2i = pTwIm[2 * h + k];
+			float w3r = pTwRe[3 * h + k], w3i = pTwIm[3 * h + k];
+
+			// Stage h
+			float br = w1r * r[k + h] - w1i * i[k + h];
+			float bi = w1r * i[k + h] + w1i * r[k + h];
+			float dr = w1r * r[k + 3 * h] - w1i * i[k + 3 * h];
+			float di = w1r * i[k + 3 * h] + w1i * r[k + 3 * h];
+			float a0r = r[k] + br, a0i = i[k] + bi;
+			float a1r = r[k] - br, a1i = i[k] - bi;
+			float a2r = r[k + 2 * h] + dr, a2i = i[k + 2 * h] + di;
+			float a3r = r[k + 2 * h] - dr, a3i = i[k + 2 * h] - di;
+
+			// Stage 2h
+			float cr = w2r * a2r - w2i * a2i;
+			float ci = w2r * a2i + w2i * a2r;
+			float er = w3r * a3r - w3i * a3i;
+			float ei = w3r * a3i + w3i * a3r;
+			r[k] = a0r + cr;
+			i[k] = a0i + ci;
+			r[k + 2 * h] = a0r - cr;
+			i[k + 2 * h] = a0i - ci;
+			r[k + h] = a1r + er;
+			i[k + h] = a1i + ei;
+			r[k + 3 * h] = a1r - er;
+			i[k + 3 * h] = a1i - ei;
+		}
+	}
+}
+
+// The four butterflies at k to k + 3 of each block.  Needs h of at
+// least 4, so that the loads are aligned.
+static void FftPassSse(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+					   const float *pTwRe, const float *pTwIm)
+{
+	if (h < 4) {
+		FftPassScalar(pRe, pIm, nSize, h, pTwRe, pTwIm);
+		return;
+	}
+	for (UINT32 s = 0; s < nSize; s += 4 * h) {
+		float *r = pRe + s;
+		float *i = pIm + s;
+		for (UINT32 k = 0; k < h; k += 4) {
+			__m128 w1r = _mm_load_ps(pTwRe + h + k);
+			__m128 w1i = _mm_load_ps(pTwIm + h + k);
+			__m128 x1r = _mm_load_ps(r + k + h);
+			__m128 x1i = _mm_load_ps(i + k + h);
+			__m128 x3r = _mm_load_ps(r + k + 3 * h);
+			__m128 x3i = _mm_load_ps(i + k + 3 * h);
+			__m128 br = _mm_sub_ps(_mm_mul_ps(w1r, x1r), _mm_mul_ps(w1i, x1i));
+			__m128 bi = _mm_add_ps(_mm_mul_ps(w1r, x1i), _mm_mul_ps(w1i, x1r));
+			__m128 dr = _mm_sub_ps(_mm_mul_ps(w1r, x3r), _mm_mul_ps(w1i, x3i));
+			__m128 di = _mm_add_ps(_mm_mul_ps(w1r, x3i), _mm_mul_ps(w1i, x3r));
+
+			__m128 x0r = _mm_load_ps(r + k);
+			__m128 x0i = _mm_load_ps(i + k);
+			__m128 x2r = _mm_load_ps(r + k + 2 * h);
+			__m128 x2i = _mm_load_ps(i + k + 2 * h);
+			__m128 a0r = _mm_add_ps(x0r, br), a0i = _mm_add_ps(x0i, bi);
+			__m128 a1r = _mm_sub_ps(x0r, br), a1i = _mm_sub_ps(x0i, bi);
+			__m128 a2r = _mm_add_ps(x2r, dr), a2i = _mm_add_ps(x2i, di);
+			__m128 a3r = _mm_sub_ps(x2r, dr), a3i = _mm_sub_ps(x2i, di);
+
+			__m128 w2r = _mm_load_ps(pTwRe + 2 * h + k);
+			__m128 w2i = _mm_load_ps(pTwIm + 2 * h + k);
+			__m128 w3r = _mm_load_ps(pTwRe + 3 * h + k);
+			__m128 w3i = _mm_load_ps(pTwIm + 3 * h + k);
+			__m128 cr = _mm_sub_ps(_mm_mul_ps(w2r, a2r), _mm_mul_ps(w2i, a2i));
+			__m128 ci = _mm_add_ps(_mm_mul_ps(w2r, a2i), _mm_mul_ps(w2i, a2r));
+			__m128 er = _mm_sub_ps(_mm_mul_ps(w3r, a3r), _mm_mul_ps(w3i, a3i));
+			__m128 ei = _mm_add_ps(_mm_mul_ps(w3r, a3i), _mm_mul_ps(w3i, a3r));
+			_mm_store_ps(r + k, _mm_add_ps(a0r, cr));
+			_mm_store_ps(i + k, _mm_add_ps(a0i, ci));
+			_mm_store_ps(r + k + 2 * h, _mm_sub_ps(a0r, cr));
+			_mm_store_ps(i + k + 2 * h, _mm_sub_ps(a0i, ci));
+			_mm_store_ps(r + k + h, _mm_add_ps(a1r, er));
+			_mm_store_ps(i + k + h, _mm_add_ps(a1i, ei));
+			_mm_store_ps(r + k + 3 * h, _mm_sub_ps(a1r, er));
+			_mm_store_ps(i + k + 3 * h, _mm_sub_ps(a1i, ei));
+		}
+	}
+}
+
+// Eight butterflies at a time; h must be at least 8
+static void FftPassAvx(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+					   const float *pTwRe, const float *pTwIm)
+{
+	if (h < 8) {
+		FftPassSse(pRe, pIm, nSize, h, pTwRe, pTwIm);
+		return;
+	}
+	for (UINT32 s = 0; s < nSize; s += 4 * h) {
+		float *r = pRe + s;
+		float *i = pIm + s;
+		for (UINT32 k = 0; k < h; k += 8) {
+			__m256 w1r = _mm256_load_ps(pTwRe + h + k);
+			__m256 w1i = _mm256_load_ps(pTwIm + h + k);
+			__m256 x1r = _mm256_load_ps(r + k + h);
+			__m256 x1i = _mm256_load_ps(i + k + h);
+			__m256 x3r = _mm256_load_ps(r + k + 3 * h);
+			__m256 x3i = _mm256_load_ps(i + k + 3 * h);
+			__m256 br = _mm256_sub_ps(_mm256_mul_ps(w1r, x1r), _mm256_mul_ps(w1i, x1i));
+			__m256 bi = _mm256_add_ps(_mm256_mul_ps(w1r, x1i), _mm256_mul_ps(w1i, x1r));
+			__m256 dr = _mm256_sub_ps(_mm256_mul_ps(w1r, x3r), _mm256_mul_ps(w1i, x3i));
+			__m256 di = _mm256_add_ps(_mm256_mul_ps(w1r, x3i), _mm256_mul_ps(w1i, x3r));
+
+			__m256 x0r = _mm256_load_ps(r + k);
+			__m256 x0i = _mm256_load_ps(i + k);
+			__m256 x2r = _mm256_load_ps(r + k + 2 * h);
+			__m256 x2i = _mm256_load_ps(i + k + 2 * h);
+			__m256 a0r = _mm256_add_ps(x0r, br), a0i = _mm256_add_ps(x0i, bi);
+			__m256 a1r = _mm256_sub_ps(x0r, br), a1i = _mm256_sub_ps(x0i, bi);
+			__m256 a2r = _mm256_add_ps(x2r, dr), a2i = _mm256_add_ps(x2i, di);
+			__m256 a3r = _mm256_sub_ps(x2r, dr), a3i = _mm256_sub_ps(x2i, di);
+
+			__m256 w2r = _mm256_load_ps(pTwRe + 2 * h + k);
+			__m256 w2i = _mm256_load_ps(pTwIm + 2 * h + k);
+			__m256 w3r = _mm256_load_ps(pTwRe + 3 * h + k);
+			__m256 w3i = _mm256_load_ps(pTwIm + 3 * h + k);
+			__m256 cr = _mm256_sub_ps(_mm256_mul_ps(w2r, a2r), _mm256_mul_ps(w2i, a2i));
+			__m256 ci = _mm256_add_ps(_mm256_mul_ps(w2r, a2i), _mm256_mul_ps(w2i, a2r));
+			__m256 er = _mm256_sub_ps(_mm256_mul_ps(w3r, a3r), _mm256_mul_ps(w3i, a3i));
+			__m256 ei = _mm256_add_ps(_mm256_mul_ps(w3r, a3i), _mm256_mul_ps(w3i, a3r));
+			_mm256_store_ps(r + k, _mm256_add_ps(a0r, cr));
+			_mm256_store_ps(i + k, _mm256_add_ps(a0i, ci));
+			_mm256_store_ps(r + k + 2 * h, _mm256_sub_ps(a0r, cr));
+			_mm256_store_ps(i + k + 2 * h, _mm256_sub_ps(a0i, ci));
+			_mm256_store_ps(r + k + h, _mm256_add_ps(a1r, er));
+			_mm256_store_ps(i + k + h, _mm256_add_ps(a1i, ei));
+			_mm256_store_ps(r + k + 3 * h, _mm256_sub_ps(a1r, er));
+			_mm256_store_ps(i + k + 3 * h, _mm256_sub_ps(a1i, ei));
+		}
+	}
+	_mm256_zeroupper();
+}
+
+static void FftLastPassScalar(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+							  const float *pTwRe, const float *pTwIm)
+{
+	for (UINT32 k = 0; k < h; k++) {
+		float wr = pTwRe[h + k], wi = pTwIm[h + k];
+		float br = wr * pRe[k + h] - wi * pIm[k + h];
+		float bi = wr * pIm[k + h] + wi * pRe[k + h];
+		float ar = pRe[k], ai = pIm[k];
+		pRe[k] = ar + br;
+		pIm[k] = ai + bi;
+		pRe[k + h] = ar - br;
+		pIm[k + h] = ai - bi;
+	}
+}
+
+static void FftLastPassSse(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+						   const float *pTwRe, const float *pTwIm)
+{
+	if (h < 4) {
+		FftLastPassScalar(pRe, pIm, nSize, h, pTwRe, pTwIm);
+		return;
+	}
+	for (UINT32 k = 0; k < h; k += 4) {
+		__m128 wr = _mm_load_ps(pTwRe + h + k);
+		__m128 wi = _mm_load_ps(pTwIm + h + k);
+		__m128 xr = _mm_load_ps(pRe + k + h);
+		__m128 xi = _mm_load_ps(pIm + k + h);
+		__m128 br = _mm_sub_ps(_mm_mul_ps(wr, xr), _mm_mul_ps(wi, xi));
+		__m128 bi = _mm_add_ps(_mm_mul_ps(wr, xi), _mm_mul_ps(wi, xr));
+		__m128 ar = _mm_load_ps(pRe + k);
+		__m128 ai = _mm_load_ps(pIm + k);
+		_mm_store_ps(pRe + k, _mm_add_ps(ar, br));
+		_mm_store_ps(pIm + k, _mm_add_ps(ai, bi));
+		_mm_store_ps(pRe + k + h, _mm_sub_ps(ar, br));
+		_mm_store_ps(pIm + k + h, _mm_sub_ps(ai, bi));
+	}
+}
+
+static void FftLastPassAvx(float *pRe, float *pIm, UINT32 nSize, UINT32 h,
+						   const float *pTwRe, const float *pTwIm)
+{
+	if (h < 8) {
+		FftLastPassSse(pRe, pIm, nSize, h, pTwRe, pTwIm);
+		return;
+	}
+	for (UINT32 k = 0; k < h; k += 8) {
+		__m256 wr = _mm256_load_ps(pTwRe + h + k);
+		__m256 wi = _mm256_load_ps(pTwIm + h + k);
+		__m256 xr = _mm256_load_ps(pRe + k + h);
+		__m256 xi = _mm256_load_ps(pIm + k + h);
+		__m256 br = _mm256_sub_ps(_mm256_mul_ps(wr, xr), _mm256_mul_ps(wi, xi));
+		__m256 bi = _mm256_add_ps(_mm256_mul_ps(wr, xi), _mm256_mul_ps(wi, xr));
+		__m256 ar = _mm256_load_ps(pRe + k);
+		__m256 ai = _mm256_load_ps(pIm + k);
+		_mm256_store_ps(pRe + k, _mm256_add_ps(ar, br));
+		_mm256_store_ps(pIm + k, _mm256_add_ps(ai, bi));
+		_mm256_store_ps(pRe + k + h, _mm256_sub_ps(ar, br));
+		_mm256_store_ps(pIm + k + h, _mm256_sub_ps(ai, bi));
+	}
+	_mm256_zeroupper();
+}
+
+static const FftPassProc s_passes[LEVEL_KERNEL_COUNT] = {
+	FftPassScalar, FftPassSse, FftPassAvx
+};
+static const FftPassProc s_lastPasses[LEVEL_KERNEL_COUNT] = {
+	FftLastPassScalar, FftLastPassSse, FftLastPassAvx
+};
+
+//////////////////////////////////////////////////////////////////////////
+// RealFft
+
+RealFft::RealFft() :
+m_nSize(0),
+m_nHalf(0),
+m_pReverse(NULL),
+m_pTwRe(NULL),
+m_pTwIm(NULL),
+m_pSplitRe(NULL),
+m_pSplitIm(NULL),
+m_pRe(NULL),
+m_pIm(NULL),
+m_kernel(LEVEL_KERNEL_SCALAR),
+m_pfnPass(FftPassScalar),
+m_pfnLastPass(FftLastPassScalar)
+{
+}
+
+RealFft::~RealFft()
+{
+	Free();
+}
+
+void RealFft::Free()
+{
+	delete [] m_pReverse;
+	m_pReverse = NULL;
+	_aligned_free(m_pTwRe);
+	_aligned_free(m_pTwIm);
+	_aligned_free(m_pSplitRe);
+	_aligned_free(m_pSplitIm);
+	_aligned_free(m_pRe);
+	_aligned_free(m_pIm);
+	m_pTwRe = m_pTwIm = NULL;
+	m_pSplitRe = m_pSplitIm = NULL;
+	m_pRe = m_pIm = NULL;
+	m_nSize = 0;
+	m_nHalf = 0;
+}
+
+// Builds the tables for a transform of nSize real samples, and picks
+// the fastest kernel.
+HRESULT RealFft::Initialize(UINT32 nSize)
+{
+	if (nSize < SPECTRUM_MIN_FFT_SIZE || nSize > SPECTRUM_MAX_FFT_SIZE ||
+		(nSize & (nSize - 1)) != 0) {
+		return E_INVALIDARG;
+	}
+
+	Free();
+	m_nSize = nSize;
+	m_nHalf = nSize / 2;
+	m_pReverse = new (std::nothrow) UINT32[m_nHalf];
+	m_pTwRe = (float *)_aligned_malloc(m_nHalf * sizeof(float), 32);
+	m_pTwIm = (float *)_aligned_malloc(m_nHalf * sizeof(float), 32);
+	m_pSplitRe = (float *)_aligned_malloc((m_nHalf + 1) * sizeof(float), 32);
+	m_pSplitIm = (float *)_aligned_malloc((m_nHalf + 1) * sizeof(float), 32);
+	m_pRe = (float *)_aligned_malloc(m_nHalf * sizeof(float), 32);
+	m_pIm = (float *)_aligned_malloc(m_nHalf * sizeof(float), 32);
+	if (m_pReverse == NULL || m_pTwRe == NULL || m_pTwIm == NULL ||
+		m_pSplitRe == NULL || m_pSplitIm == NULL || m_pRe == NULL ||
+		m_pIm == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+
+	UINT32 nBits = 0;
+	while ((1u << nBits) < m_nHalf) {
+		nBits++;
+	}
+	for (UINT32 n = 0; n < m_nHalf; n++) {
+		UINT32 rev = 0;
+		for (UINT32 b = 0; b < nBits; b++) {
+			rev |= ((n >> b) & 1) << (nBits - 1 - b);
+		}
+		m_pReverse[n] = rev;
+	}
+
+	// exp(-2 pi i k / 2h) for the stage of half-size h, at [h + k].
+	// [0] is not used.
+	m_pTwRe[0] = 1.0f;
+	m_pTwIm[0] = 0.0f;
+	for (UINT32 h = 1; h < m_nHalf; h *= 2) {
+		for (UINT32 k = 0; k < h; k++) {
+			double angle = -PI * k / h;
+			m_pTwRe[h + k] = (float)cos(angle);
+			m_pTwIm[h + k] = (float)sin(angle);
+		}
+	}
+	for (UINT32 k = 0; k <= m_nHalf; k++) {
+		double angle = -2.0 * PI * k / m_nSize;
+		m_pSplitRe[k] = (float)cos(angle);
+		m_pSplitIm[k] = (float)sin(angle);
+	}
+
+	SetKernel(LevelMeter::BestKernel());
+	return S_OK;
+}
+
+BOOL RealFft::SetKernel(LevelKernel kernel)
+{
+	if (!LevelMeter::IsKernelSupported(kernel)) {
+		return FALSE;
+	}
+	m_kernel = kernel;
+	m_pfnPass = s_passes[kernel];
+	m_pfnLastPass = s_lastPasses[kernel];
+	return TRUE;
+}
+
+void RealFft::Forward(const float *pIn, float *pRe, float *pIm)
+{
+	const UINT32 M = m_nHalf;
+
+	// Even samples are the real part and odd ones the imaginary part,
+	// loaded in bit-reversed order four at a time.  The first two
+	// stages need no multiplies: their twiddles are 1, 1 and -i.
+	for (UINT32 n = 0; n < M; n += 4) {
+		const float *x0 = pIn + 2 * m_pReverse[n];
+		const float *x1 = pIn + 2 * m_pReverse[n + 1];
+		const float *x2 = pIn + 2 * m_pReverse[n + 2];
+		const float *x3 = pIn + 2 * m_pReverse[n + 3];
+		float a0r = x0[0] + x1[0], a0i = x0[1] + x1[1];
+		float a1r = x0[0] - x1[0], a1i = x0[1] - x1[1];
+		float a2r = x2[0] + x3[0], a2i = x2[1] + x3[1];
+		float a3r = x2[0] - x3[0], a3i = x2[1] - x3[1];
+		m_pRe[n] = a0r + a2r;
+		m_pIm[n] = a0i + a2i;
+		m_pRe[n + 2] = a0r - a2r;
+		m_pIm[n + 2] = a0i - a2i;
+		m_pRe[n + 1] = a1r + a3i;
+		m_pIm[n + 1] = a1i - a3r;
+		m_pRe[n + 3] = a1r - a3i;
+		m_pIm[n + 3] = a1i + a3r;
+	}
+
+	// The rest of the stages in pairs, and the odd one out alone
+	UINT32 h = 4;
+	for (; 4 * h <= M; h *= 4) {
+		m_pfnPass(m_pRe, m_pIm, M, h, m_pTwRe, m_pTwIm);
+	}
+	if (h < M) {
+		m_pfnLastPass(m_pRe, m_pIm, M, h, m_pTwRe, m_pTwIm);
+	}
+
+	// Split the transform Z of the packed sequence into the transforms
+	// of the even and odd samples, E and O, and combine them:
+	// X[k] = E[k] + exp(-2 pi i k / N) O[k]
+	for (UINT32 k = 0; k <= M / 2; k++) {
+		UINT32 j = (M - k) & (M - 1);
+		UINT32 kk = k & (M - 1);
+		float zr = m_pRe[kk], zi = m_pIm[kk];
+		float cr = m_pRe[j], ci = m_pIm[j];
+		float er = 0.5f * (zr + cr), ei = 0.5f * (zi - ci);
+		float or_ = 0.5f * (zi + ci), oi = -0.5f * (zr - cr);
+
+		float wr = m_pSplitRe[k], wi = m_pSplitIm[k];
+		pRe[k] = er + wr * or_ - wi * oi;
+		pIm[k] = ei + wr * oi + wi * or_;
+
+		// Bin M - k comes from the same pair, with E and O conjugated
+		// and the twiddle for M - k
+		if (k != 0 && k != M - k) {
+			wr = m_pSplitRe[M - k];
+			wi = m_pSplitIm[M - k];
+			pRe[M - k] = er + wr * or_ - wi * -oi;
+			pIm[M - k] = -ei + wr * -oi + wi * or_;
+		}
+	}
+	pRe[M] = m_pRe[0] - m_pIm[0];
+	pIm[M] = 0.0f;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// SpectrumAnalyzer
+
+SpectrumAnalyzer::SpectrumAnalyzer() :
+m_nSampleRate(0),
+m_nChannels(0),
+m_format(LEVEL_FORMAT_FLOAT32),
+m_cbFrame(0),
+m_pRing(NULL),
+m_nRing(0),
+m_nWritten(0),
+m_nRead(0),
+m_nDropped(0),
+m_pWindow(NULL),
+m_pFrame(NULL),
+m_pBinRe(NULL),
+m_pBinIm(NULL),
+m_pPower(NULL),
+m_pBandEdges(NULL),
+m_nBands(0),
+m_scale(0.0),
+m_hThread(NULL),
+m_hWork(NULL),
+m_bStop(FALSE),
+m_qpcBusy(0),
+m_pBandsDb(NULL),
+m_pBandSums(NULL),
+m_pHistory(NULL),
+m_nFrames(0)
+{
+	InitializeCriticalSection(&m_critsec);
+}
+
+SpectrumAnalyzer::~SpectrumAnalyzer()
+{
+	Free();
+	DeleteCriticalSection(&m_critsec);
+}
+
+void SpectrumAnalyzer::Free()
+{
+	Stop();
+	if (m_hWork) {
+		CloseHandle(m_hWork);
+		m_hWork = NULL;
+	}
+	_aligned_free(m_pRing);
+	_aligned_free(m_pFrame);
+	_aligned_free(m_pBinRe);
+	_aligned_free(m_pBinIm);
+	m_pRing = NULL;
+	m_pFrame = NULL;
+	m_pBinRe = NULL;
+	m_pBinIm = NULL;
+	delete [] m_pWindow;
+	delete [] m_pPower;
+	delete [] m_pBandEdges;
+	delete [] m_pBandsDb;
+	delete [] m_pBandSums;
+	delete [] m_pHistory;
+	m_pWindow = NULL;
+	m_pPower = NULL;
+	m_pBandEdges = NULL;
+	m_pBandsDb = NULL;
+	m_pBandSums = NULL;
+	m_pHistory = NULL;
+	m_nBands = 0;
+	m_nFrames = 0;
+}
+
+// Allocates everything and starts the analysis thread.  The input is
+// interleaved samples of nChannels channels in the given format.
+HRESULT SpectrumAnalyzer::Initialize(
+									 UINT32 nSampleRate,        // Input sample rate.
+									 UINT32 nChannels,          // Input channels, mixed for the analysis.
+									 LevelFormat format,        // Input sample format.
+									 const SpectrumOptions &options
+									 )
+{
+	if (nSampleRate == 0 || nChannels == 0 || options.nHop == 0 ||
+		options.nHop > options.nFftSize || options.nBands == 0 ||
+		options.nHistory == 0) {
+		return E_INVALIDARG;
+	}
+
+	Free();
+	HRESULT hr = m_fft.Initialize(options.nFftSize);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	static const DWORD sampleSizes[] = { 2, 3, 4 };
+	m_options = options;
+	m_nSampleRate = nSampleRate;
+	m_nChannels = nChannels;
+	m_format = format;
+	m_cbFrame = sampleSizes[format] * nChannels;
+
+	// At least a second of audio, so that the analysis can fall behind
+	// for a while without dropping anything
+	const UINT32 N = options.nFftSize;
+	m_nRing = 1;
+	while (m_nRing < 4 * N || m_nRing < nSampleRate) {
+		m_nRing *= 2;
+	}
+	m_nWritten = 0;
+	m_nRead = 0;
+	m_nDropped = 0;
+	m_qpcBusy = 0;
+
+	UINT32 nBins = BinCount();
+	m_pRing = (float *)_aligned_malloc(m_nRing * sizeof(float), 32);
+	m_pFrame = (float *)_aligned_malloc(N * sizeof(float), 32);
+	m_pBinRe = (float *)_aligned_malloc(nBins * sizeof(float), 32);
+	m_pBinIm = (float *)_aligned_malloc(nBins * sizeof(float), 32);
+	m_pWindow = new (std::nothrow) float[N];
+	m_pPower = new (std::nothrow) float[nBins];
+	m_pBandEdges = new (std::nothrow) UINT32[SPECTRUM_MAX_BANDS + 1];
+	m_pBandsDb = new (std::nothrow) float[SPECTRUM_MAX_BANDS];
+	m_pBandSums = new (std::nothrow) double[SPECTRUM_MAX_BANDS];
+	m_pHistory = new (std::nothrow) float[(size_t)options.nHistory * nBins];
+	if (m_pRing == NULL || m_pFrame == NULL || m_pBinRe == NULL ||
+		m_pBinIm == NULL || m_pWindow == NULL || m_pPower == NULL ||
+		m_pBandEdges == NULL || m_pBandsDb == NULL || m_pBandSums == NULL ||
+		m_pHistory == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+
+	// Periodic Hann window, scaled so that the one-sided power of the
+	// bins sums to the mean square of the frame
+	double sumSquares = 0.0;
+	for (UINT32 n = 0; n < N; n++) {
+		double w = 0.5 - 0.5 * cos(2.0 * PI * n / N);
+		m_pWindow[n] = (float)w;
+		sumSquares += w * w;
+	}
+	m_scale = 2.0 / (N * sumSquares);
+
+	// Log-spaced bands from SPECTRUM_MIN_HZ to Nyquist, each at least
+	// one bin wide.  Bands that would run past the last bin are dropped.
+	UINT32 nBands = min(options.nBands, SPECTRUM_MAX_BANDS);
+	double nyquist = nSampleRate / 2.0;
+	double lowest = min((double)SPECTRUM_MIN_HZ, nyquist / 2.0);
+	m_pBandEdges[0] = max(1u, (UINT32)(lowest * N / nSampleRate + 0.5));
+	m_nBands = 0;
+	for (UINT32 b = 1; b <= nBands; b++) {
+		double f = lowest * pow(nyquist / lowest, (double)b / nBands);
+		UINT32 edge = max((UINT32)(f * N / nSampleRate + 0.5),
+			m_pBandEdges[b - 1] + 1);
+		if (edge >= nBins) {
+			break;
+		}
+		m_pBandEdges[b] = edge;
+		m_nBands = b;
+	}
+	// The last band takes the bins up to Nyquist
+	if (m_nBands == 0) {
+		m_nBands = 1;
+	}
+	m_pBandEdges[m_nBands] = nBins;
+
+	for (UINT32 b = 0; b < SPECTRUM_MAX_BANDS; b++) {
+		m_pBandsDb[b] = SPECTRUM_FLOOR_DB;
+		m_pBandSums[b] = 0.0;
+	}
+
+	m_hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (m_hWork == NULL) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		m_bStop = FALSE;
+		m_hThread = (HANDLE)_beginthreadex(NULL, 0, AnalysisThreadProc, this,
+			0, NULL);
+		if (m_hThread == NULL) {
+			hr = E_FAIL;
+		}
+	}
+	if (FAILED(hr)) {
+		Free();
+	}
+	return hr;
+}
+
+// Mixes the channels of the block into the ring.  Takes no lock and
+// never waits, so it is safe to call from the capture callback.  What
+// does not fit is dropped.
+void SpectrumAnalyzer::Push(const void *pData, DWORD cbData)
+{
+	if (m_hThread == NULL || m_cbFrame == 0) {
+		return;
+	}
+
+	UINT32 nFrames = cbData / m_cbFrame;
+	UINT32 nWritten = (UINT32)m_nWritten;
+	UINT32 nFree = m_nRing - (nWritten - (UINT32)m_nRead);
+	if (nFrames > nFree) {
+		m_nDropped += nFrames - nFree;
+		nFrames = nFree;
+	}
+
+	const UINT32 mask = m_nRing - 1;
+	const float scale = 1.0f / m_nChannels;
+	const BYTE *pBytes = (const BYTE *)pData;
+	for (UINT32 i = 0; i < nFrames; i++) {
+		float sum = 0.0f;
+		if (m_format == LEVEL_FORMAT_INT16) {
+			const short *p = (const short *)pBytes;
+			for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+				sum += p[ch] * (1.0f / 32768.0f);
+			}
+		} else if (m_format == LEVEL_FORMAT_INT24) {
+			const BYTE *p = pBytes;
+			for (UINT32 ch = 0; ch < m_nChannels; ch++, p += 3) {
+				int x = (int)(((DWORD)p[0] << 8) | ((DWORD)p[1] << 16) |
+					((DWORD)p[2] << 24)) >> 8;
+				sum += x * (1.0f / 8388608.0f);
+			}
+		} else {
+			const float *p = (const float *)pBytes;
+			for (UINT32 ch = 0; ch < m_nChannels; ch++) {
+				sum += p[ch];
+			}
+		}
+		m_pRing[(nWritten + i) & mask] = sum * scale;
+		pBytes += m_cbFrame;
+	}
+
+	if (nFrames > 0) {
+		InterlockedExchange(&m_nWritten, (LONG)(nWritten + nFrames));
+		if (nWritten + nFrames - (UINT32)m_nRead >= m_options.nFftSize) {
+			SetEvent(m_hWork);
+		}
+	}
+}
+
+// Tells the thread to analyze what is left and waits for it to end.
+// The results stay readable.
+HRESULT SpectrumAnalyzer::Stop()
+{
+	if (m_hThread == NULL) {
+		return S_OK;
+	}
+	m_bStop = TRUE;
+	SetEvent(m_hWork);
+	WaitForSingleObject(m_hThread, INFINITE);
+	CloseHandle(m_hThread);
+	m_hThread = NULL;
+	return S_OK;
+}
+
+unsigned __stdcall SpectrumAnalyzer::AnalysisThreadProc(void *pContext)
+{
+	SpectrumAnalyzer *pAnalyzer = (SpectrumAnalyzer *)pContext;
+
+	while (TRUE) {
+		WaitForSingleObject(pAnalyzer->m_hWork, INFINITE);
+		pAnalyzer->AnalyzeFrames();
+		if (pAnalyzer->m_bStop) {
+			break;
+		}
+	}
+	return 0;
+}
+
+// Analyzes every whole frame in the ring and publishes the results.
+// The ring keeps the overlap with the next frame until it is read.
+void SpectrumAnalyzer::AnalyzeFrames()
+{
+	const UINT32 N = m_options.nFftSize;
+	const UINT32 mask = m_nRing - 1;
+	const UINT32 nBins = BinCount();
+	UINT32 nRead = (UINT32)m_nRead;
+
+	while ((UINT32)m_nWritten - nRead >= N) {
+		LARGE_INTEGER tStart, tEnd;
+		QueryPerformanceCounter(&tStart);
+
+		for (UINT32 n = 0; n < N; n++) {
+			m_pFrame[n] = m_pRing[(nRead + n) & mask] * m_pWindow[n];
+		}
+		m_fft.Forward(m_pFrame, m_pBinRe, m_pBinIm);
+
+		// The bins at DC and Nyquist have no mirror image
+		double bandPower[SPECTRUM_MAX_BANDS];
+		float bandsDb[SPECTRUM_MAX_BANDS];
+		for (UINT32 k = 0; k < nBins; k++) {
+			double power = ((double)m_pBinRe[k] * m_pBinRe[k] +
+				(double)m_pBinIm[k] * m_pBinIm[k]) * m_scale;
+			if (k == 0 || k == nBins - 1) {
+				power *= 0.5;
+			}
+			m_pPower[k] = (float)power;
+		}
+		for (UINT32 b = 0; b < m_nBands; b++) {
+			double sum = 0.0;
+			for (UINT32 k = m_pBandEdges[b]; k < m_pBandEdges[b + 1]; k++) {
+				sum += m_pPower[k];
+			}
+			bandPower[b] = sum;
+			bandsDb[b] = PowerToDb(sum);
+		}
+		for (UINT32 k = 0; k < nBins; k++) {
+			m_pPower[k] = PowerToDb(m_pPower[k]);
+		}
+
+		EnterCriticalSection(&m_critsec);
+		CopyMemory(m_pBandsDb, bandsDb, m_nBands * sizeof(float));
+		for (UINT32 b = 0; b < m_nBands; b++) {
+			m_pBandSums[b] += bandPower[b];
+		}
+		CopyMemory(m_pHistory + (size_t)(m_nFrames % m_options.nHistory) * nBins,
+			m_pPower, nBins * sizeof(float));
+		m_nFrames++;
+		LeaveCriticalSection(&m_critsec);
+
+		nRead += m_options.nHop;
+		InterlockedExchange(&m_nRead, (LONG)nRead);
+
+		QueryPerformanceCounter(&tEnd);
+		m_qpcBusy += tEnd.QuadPart - tStart.QuadPart;
+	}
+}
+
+float SpectrumAnalyzer::BandFrequency(UINT32 iBand) const
+{
+	if (m_nBands == 0) {
+		return 0.0f;
+	}
+	// The last band ends at Nyquist, which is the last bin
+	UINT32 iBin = min(m_pBandEdges[min(iBand, m_nBands)], m_fft.Size() / 2);
+	return (float)iBin * m_nSampleRate / m_fft.Size();
+}
+
+ULONGLONG SpectrumAnalyzer::FrameCount()
+{
+	EnterCriticalSection(&m_critsec);
+	ULONGLONG nFrames = m_nFrames;
+	LeaveCriticalSection(&m_critsec);
+	return nFrames;
+}
+
+double SpectrumAnalyzer::CoreFraction()
+{
+	ULONGLONG nFrames = FrameCount();
+	if (nFrames == 0) {
+		return 0.0;
+	}
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	double secondsBusy = (double)m_qpcBusy / freq.QuadPart;
+	double secondsAudio = (double)nFrames * m_options.nHop / m_nSampleRate;
+	return secondsBusy / secondsAudio;
+}
+
+BOOL SpectrumAnalyzer::GetBands(float *pBandsDb, ULONGLONG *piFrame)
+{
+	EnterCriticalSection(&m_critsec);
+	BOOL bResult = m_nFrames > 0;
+	if (bResult) {
+		CopyMemory(pBandsDb, m_pBandsDb, m_nBands * sizeof(float));
+		if (piFrame) {
+			*piFrame = m_nFrames - 1;
+		}
+	}
+	LeaveCriticalSection(&m_critsec);
+	return bResult;
+}
+
+void SpectrumAnalyzer::GetAverageBands(float *pBandsDb)
+{
+	EnterCriticalSection(&m_critsec);
+	for (UINT32 b = 0; b < m_nBands; b++) {
+		pBandsDb[b] = m_nFrames == 0 ? SPECTRUM_FLOOR_DB :
+			PowerToDb(m_pBandSums[b] / m_nFrames);
+	}
+	LeaveCriticalSection(&m_critsec);
+}
+
+UINT32 SpectrumAnalyzer::GetSpectrogram(float *pRows, UINT32 nMaxRows)
+{
+	const UINT32 nBins = BinCount();
+	EnterCriticalSection(&m_critsec);
+	UINT32 nRows = (UINT32)min((ULONGLONG)min(nMaxRows, m_options.nHistory),
+		m_nFrames);
+	for (UINT32 i = 0; i < nRows; i++) {
+		ULONGLONG iFrame = m_nFrames - nRows + i;
+		CopyMemory(pRows + (size_t)i * nBins,
+			m_pHistory + (size_t)(iFrame % m_options.nHistory) * nBins,
+			nBins * sizeof(float));
+	}
+	LeaveCriticalSection(&m_critsec);
+	return nRows;
+}
+
+// Prints the mean band levels, one band to a line, with a bar of one
+// character for every 3 dB above -90 dB.
+void printSpectrum(const char *szLabel, SpectrumAnalyzer &analyzer) {
+	float bandsDb[SPECTRUM_MAX_BANDS];
+	analyzer.GetAverageBands(bandsDb);
+
+	printf("  %s: %I64u frames of %u samples (%s), %.2f%% of a core, "
+		"%I64u samples dropped\n", szLabel, analyzer.FrameCount(),
+		(analyzer.BinCount() - 1) * 2,
+		LevelMeter::KernelName(analyzer.Kernel()),
+		100.0 * analyzer.CoreFraction(), analyzer.DroppedSamples());
+	for (UINT32 b = 0; b < analyzer.BandCount(); b++) {
+		char szBar[32];
+		int nBar = (int)((bandsDb[b] + 90.0f) / 3.0f);
+		nBar = max(0, min(nBar, (int)sizeof(szBar) - 1));
+		memset(szBar, '#', nBar);
+		szBar[nBar] = '\0';
+		printf("    %6.0f - %6.0f Hz %7.1f dB %s\n",
+			analyzer.BandFrequency(b), analyzer.BandFrequency(b + 1),
+			bandsDb[b], szBar);
+	}
+}
+
+// Checks each kernel against a DFT computed directly in double
+// precision, and prints the largest error relative to the largest bin.
+static void CheckFftAccuracy(void)
+{
+	const UINT32 MAX_SIZE = 4096;
+	float *pIn = new (std::nothrow) float[MAX_SIZE];
+	float *pRe = new (std::nothrow) float[MAX_SIZE / 2 + 1];
+	float *pIm = new (std::nothrow) float[MAX_SIZE / 2 + 1];
+	double *pRefRe = new (std::nothrow) double[MAX_SIZE / 2 + 1];
+	double *pRefIm = new (std::nothrow) double[MAX_SIZE / 2 + 1];
+	double *pCos = new (std::nothrow) double[MAX_SIZE];
+	double *pSin = new (std::nothrow) double[MAX_SIZE];
+	if (pIn == NULL || pRe == NULL || pIm == NULL || pRefRe == NULL ||
+		pRefIm == NULL || pCos == NULL || pSin == NULL) {
+		printf("Out of memory\n");
+	} else {
+		printf("  Largest error against a direct DFT:\n");
+		for (UINT32 N = SPECTRUM_MIN_FFT_SIZE; N <= MAX_SIZE; N *= 2) {
+			// Noise plus a tone that falls between bins
+			srand(N);
+			for (UINT32 n = 0; n < N; n++) {
+				pIn[n] = (float)(rand() - RAND_MAX / 2) / RAND_MAX +
+					(float)(0.5 * sin(2.0 * PI * 10.3 * n / N));
+				pCos[n] = cos(2.0 * PI * n / N);
+				pSin[n] = -sin(2.0 * PI * n / N);
+			}
+			double largest = 0.0;
+			for (UINT32 k = 0; k <= N / 2; k++) {
+				double re = 0.0, im = 0.0;
+				for (UINT32 n = 0; n < N; n++) {
+					UINT32 j = (UINT32)(((ULONGLONG)k * n) % N);
+					re += pIn[n] * pCos[j];
+					im += pIn[n] * pSin[j];
+				}
+				pRefRe[k] = re;
+				pRefIm[k] = im;
+				largest = max(largest, sqrt(re * re + im * im));
+			}
+
+			printf("    %5u", N);
+			RealFft fft;
+			if (FAILED(fft.Initialize(N))) {
+				printf(" failed\n");
+				continue;
+			}
+			for (int iKernel = 0; iKernel < LEVEL_KERNEL_COUNT; iKernel++) {
+				if (!fft.SetKernel((LevelKernel)iKernel)) {
+					continue;
+				}
+				fft.Forward(pIn, pRe, pIm);
+				double error = 0.0;
+				for (UINT32 k = 0; k <= N / 2; k++) {
+					double dr = pRe[k] - pRefRe[k];
+					double di = pIm[k] - pRefIm[k];
+					error = max(error, sqrt(dr * dr + di * di));
+				}
+				error /= largest;
+				printf("  %-6s %.1e%s", LevelMeter::KernelName((LevelKernel)iKernel),
+					error, error < 1e-5 ? "" : " FAILED");
+			}
+			printf("\n");
+		}
+	}
+	delete [] pIn;
+	delete [] pRe;
+	delete [] pIm;
+	delete [] pRefRe;
+	delete [] pRefIm;
+	delete [] pCos;
+	delete [] pSin;
+}
+
+// Times the transform alone on one core
+static void TimeFft(void)
+{
+	const double MIN_SECONDS = 0.25;
+	static const UINT32 sizes[] = { 256, 1024, 4096, 16384 };
+
+	float *pIn = (float *)_aligned_malloc(SPECTRUM_MAX_FFT_SIZE * sizeof(float), 32);
+	float *pRe = (float *)_aligned_malloc((SPECTRUM_MAX_FFT_SIZE / 2 + 1) * sizeof(float), 32);
+	float *pIm = (float *)_aligned_malloc((SPECTRUM_MAX_FFT_SIZE / 2 + 1) * sizeof(float), 32);
+	if (pIn == NULL || pRe == NULL || pIm == NULL) {
+		printf("Out of memory\n");
+		_aligned_free(pIn);
+		_aligned_free(pRe);
+		_aligned_free(pIm);
+		return;
+	}
+	srand(1);
+	for (UINT32 n = 0; n < SPECTRUM_MAX_FFT_SIZE; n++) {
+		pIn[n] = (float)(rand() - RAND_MAX / 2) / RAND_MAX;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("  Frames per second on one core:\n");
+	for (int iSize = 0; iSize < ARRAYSIZE(sizes); iSize++) {
+		UINT32 N = sizes[iSize];
+		RealFft fft;
+		if (FAILED(fft.Initialize(N))) {
+			printf("Out of memory\n");
+			break;
+		}
+		printf("    %5u", N);
+		for (int iKernel = 0; iKernel < LEVEL_KERNEL_COUNT; iKernel++) {
+			if (!fft.SetKernel((LevelKernel)iKernel)) {
+				continue;
+			}
+			LARGE_INTEGER tStart, tEnd;
+			ULONGLONG nFrames = 0;
+			double seconds = 0.0;
+			QueryPerformanceCounter(&tStart);
+			do {
+				for (int i = 0; i < 16; i++) {
+					fft.Forward(pIn, pRe, pIm);
+				}
+				nFrames += 16;
+				QueryPerformanceCounter(&tEnd);
+				seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+			} while (seconds < MIN_SECONDS);
+			printf("  %-6s %9.0f/s %7.2f us", LevelMeter::KernelName((LevelKernel)iKernel),
+				nFrames / seconds, seconds * 1e6 / nFrames);
+		}
+		printf("\n");
+	}
+	_aligned_free(pIn);
+	_aligned_free(pRe);
+	_aligned_free(pIm);
+}
+
+// Streams a tone through the analyzer at ten times real time, in
+// capture-sized blocks, and checks where and how loud it comes out.
+static void StreamTone(void)
+{
+	const UINT32 RATE = 48000;
+	const UINT32 N_CHANNELS = 2;
+	const UINT32 N_SECONDS = 5;
+	const UINT32 BLOCK_FRAMES = RATE / 100;
+	const double TONE_HZ = 1000.0;
+	const double AMPLITUDE = 0.5;
+
+	short *pBlock = new (std::nothrow) short[BLOCK_FRAMES * N_CHANNELS];
+	if (pBlock == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+
+	SpectrumOptions options;
+	options.bEnabled = TRUE;
+	SpectrumAnalyzer analyzer;
+	HRESULT hr = analyzer.Initialize(RATE, N_CHANNELS, LEVEL_FORMAT_INT16, options);
+	if (FAILED(hr)) {
+		printf("  Streaming test failed\n");
+		printErrorDescription(hr);
+		delete [] pBlock;
+		return;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	LONGLONG qpcMax = 0;
+	LONGLONG qpcTotal = 0;
+	UINT32 nBlocks = 0;
+	for (UINT32 iFrame = 0; iFrame < RATE * N_SECONDS; iFrame += BLOCK_FRAMES) {
+		for (UINT32 i = 0; i < BLOCK_FRAMES; i++) {
+			short x = (short)(32767.0 * AMPLITUDE *
+				sin(2.0 * PI * TONE_HZ * (iFrame + i) / RATE));
+			for (UINT32 ch = 0; ch < N_CHANNELS; ch++) {
+				pBlock[i * N_CHANNELS + ch] = x;
+			}
+		}
+		LARGE_INTEGER tStart, tEnd;
+		QueryPerformanceCounter(&tStart);
+		analyzer.Push(pBlock, BLOCK_FRAMES * N_CHANNELS * sizeof(short));
+		QueryPerformanceCounter(&tEnd);
+		LONGLONG qpc = tEnd.QuadPart - tStart.QuadPart;
+		qpcMax = max(qpcMax, qpc);
+		qpcTotal += qpc;
+		nBlocks++;
+		if (nBlocks % 10 == 0) {
+			Sleep(10);
+		}
+	}
+	analyzer.Stop();
+
+	float bandsDb[SPECTRUM_MAX_BANDS];
+	analyzer.GetAverageBands(bandsDb);
+	UINT32 iPeak = 0;
+	for (UINT32 b = 1; b < analyzer.BandCount(); b++) {
+		if (bandsDb[b] > bandsDb[iPeak]) {
+			iPeak = b;
+		}
+	}
+	double expectedDb = 20.0 * log10(AMPLITUDE / sqrt(2.0));
+	BOOL bPass = analyzer.BandFrequency(iPeak) <= TONE_HZ &&
+		analyzer.BandFrequency(iPeak + 1) > TONE_HZ &&
+		fabs(bandsDb[iPeak] - expectedDb) < 0.5 &&
+		analyzer.DroppedSamples() == 0;
+
+	printf("  %u sec of a %.0f Hz tone, %u channels at %u Hz, %u-point frames "
+		"every %u samples:\n", N_SECONDS, TONE_HZ, N_CHANNELS, RATE,
+		options.nFftSize, options.nHop);
+	printf("    Peak band %.0f - %.0f Hz at %.2f dB (expected %.2f dB), "
+		"%I64u frames, %I64u samples dropped%s\n",
+		analyzer.BandFrequency(iPeak), analyzer.BandFrequency(iPeak + 1),
+		bandsDb[iPeak], expectedDb, analyzer.FrameCount(),
+		analyzer.DroppedSamples(), bPass ? "" : "  FAILED");
+	printf("    Push avg %.2f us, max %.2f us; analysis %.3f%% of a core\n",
+		1e6 * qpcTotal / nBlocks / freq.QuadPart,
+		1e6 * qpcMax / freq.QuadPart, 100.0 * analyzer.CoreFraction());
+	delete [] pBlock;
+}
+
+void benchmarkSpectrum(void) {
+	printf("Spectrum benchmark, best kernel %s\n",
+		LevelMeter::KernelName(LevelMeter::BestKernel()));
+	CheckFftAccuracy();
+	TimeFft();
+	StreamTone();
+}
@@ -0,0 +1,177 @@
+//////////////////////////////////////////////////////////////////////////
+// spectrum.h: Streaming FFT spectrum analysis of captured audio
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+#include "levelMeter.h"
+
+// Limits on the transform size, which must be a power of two
+const UINT32 SPECTRUM_MIN_FFT_SIZE = 64;
+const UINT32 SPECTRUM_MAX_FFT_SIZE = 32768;
+const UINT32 SPECTRUM_MAX_BANDS = 64;
+// Lowest band edge, in Hz
+const float SPECTRUM_MIN_HZ = 40.0f;
+
+// How to analyze.  Frames of nFftSize samples start every nHop
+// samples, so with the default hop each sample is in four frames.
+struct SpectrumOptions
+{
+    BOOL    bEnabled;
+    UINT32  nFftSize;           // Samples per frame, a power of two.
+    UINT32  nHop;               // Samples between frames, 1 to nFftSize.
+    UINT32  nBands;             // Log-spaced bands from SPECTRUM_MIN_HZ to Nyquist.
+    UINT32  nHistory;           // Spectrogram rows kept for readers.
+
+    SpectrumOptions() :
+    bEnabled(FALSE),
+    nFftSize(2048),
+    nHop(512),
+    nBands(24),
+    nHistory(256)
+    {
+    }
+};
+
+// A pass over the stage of half-size nHalf of a complex FFT held as
+// separate real and imaginary arrays, or over the stages nHalf and
+// 2 * nHalf together.  The twiddles for the stage of half-size h start
+// at [h].
+typedef void (*FftPassProc)(float *pRe, float *pIm, UINT32 nSize, UINT32 nHalf,
+                            const float *pTwRe, const float *pTwIm);
+
+// Forward transform of nSize real samples to nSize / 2 + 1 complex
+// bins.  The samples are packed as a complex sequence of half the
+// length, which is transformed in place and then split into the bins
+// of the real sequence.  The first two stages are done as the samples
+// are loaded in bit-reversed order, and the rest in pairs, so each
+// pass reads and writes the data once for two stages.  An odd stage
+// left over is done alone at the end.  The passes run four or eight
+// butterflies at a time with SSE or AVX.
+// Nothing is allocated after Initialize.
+class RealFft
+{
+public:
+    RealFft();
+    ~RealFft();
+
+    HRESULT Initialize(UINT32 nSize);
+    // Forces a particular kernel.  Returns FALSE if the processor does
+    // not support it.
+    BOOL    SetKernel(LevelKernel kernel);
+
+    // pRe and pIm receive Size() / 2 + 1 bins
+    void    Forward(const float *pIn, float *pRe, float *pIm);
+
+    UINT32      Size() const { return m_nSize; }
+    LevelKernel Kernel() const { return m_kernel; }
+
+private:
+    void    Free();
+
+    UINT32      m_nSize;
+    UINT32      m_nHalf;            // Length of the complex transform
+    UINT32      *m_pReverse;        // Bit-reversed index of each
+    float       *m_pTwRe;           // Stage twiddles, m_nHalf of each
+    float       *m_pTwIm;
+    float       *m_pSplitRe;        // exp(-2 pi i k / m_nSize), m_nHalf + 1 of each
+    float       *m_pSplitIm;
+    float       *m_pRe;             // Work arrays, m_nHalf of each
+    float       *m_pIm;
+    LevelKernel m_kernel;
+    FftPassProc m_pfnPass;          // Two stages
+    FftPassProc m_pfnLastPass;      // One stage
+};
+
+// Analyzes a capture stream on a thread of its own.  Push mixes the
+// channels down and copies them into a ring, and never waits: if the
+// analysis falls more than the ring behind, the new samples are
+// dropped and counted.  The analysis thread takes Hann-windowed
+// frames from the ring and publishes, for each, the band levels and a
+// spectrogram row of every bin.  Readers copy them out under a lock
+// that the capture side never takes.
+//
+// Levels are in dB of mean square relative to full scale, so a full
+// scale sine reads -3 dB.
+class SpectrumAnalyzer
+{
+public:
+    SpectrumAnalyzer();
+    ~SpectrumAnalyzer();
+
+    HRESULT Initialize(UINT32 nSampleRate, UINT32 nChannels,
+                       LevelFormat format, const SpectrumOptions &options);
+    // Called from the capture thread with whole frames
+    void    Push(const void *pData, DWORD cbData);
+    // Analyzes the frames that are complete and ends the thread
+    HRESULT Stop();
+
+    UINT32      BandCount() const { return m_nBands; }
+    UINT32      BinCount() const { return m_fft.Size() / 2 + 1; }
+    float       BandFrequency(UINT32 iBand) const;  // Lower edge, in Hz
+    UINT32      SampleRate() const { return m_nSampleRate; }
+    ULONGLONG   FrameCount();
+    ULONGLONG   DroppedSamples() const { return m_nDropped; }
+    LevelKernel Kernel() const { return m_fft.Kernel(); }
+    // Time the analysis thread was busy, per second of audio analyzed
+    double      CoreFraction();
+
+    // The newest band levels and the frame they are from.  Returns
+    // FALSE before the first frame.
+    BOOL    GetBands(float *pBandsDb, ULONGLONG *piFrame);
+    // Mean band levels over every frame so far
+    void    GetAverageBands(float *pBandsDb);
+    // Copies up to nMaxRows of the newest spectrogram rows, oldest
+    // first, each of BinCount() levels.  Returns the rows copied.
+    UINT32  GetSpectrogram(float *pRows, UINT32 nMaxRows);
+
+private:
+    static unsigned __stdcall AnalysisThreadProc(void *pContext);
+    void    AnalyzeFrames();
+    void    Free();
+
+    SpectrumOptions m_options;
+    UINT32      m_nSampleRate;
+    UINT32      m_nChannels;
+    LevelFormat m_format;
+    DWORD       m_cbFrame;          // Bytes per frame of the input
+    RealFft     m_fft;
+
+    // Mixed samples, written by Push and read by the analysis thread.
+    // The counts run on and wrap; each side writes only its own.
+    float       *m_pRing;
+    UINT32      m_nRing;            // A power of two
+    volatile LONG m_nWritten;
+    volatile LONG m_nRead;
+    ULONGLONG   m_nDropped;
+
+    // Analysis thread
+    float       *m_pWindow;
+    float       *m_pFrame;
+    float       *m_pBinRe;
+    float       *m_pBinIm;
+    float       *m_pPower;
+    UINT32      *m_pBandEdges;      // First bin of each band, and the end
+    UINT32      m_nBands;
+    double      m_scale;            // From squared magnitude to mean square
+    HANDLE      m_hThread;
+    HANDLE      m_hWork;            // Signaled by Push
+    volatile BOOL m_bStop;
+    LONGLONG    m_qpcBusy;
+
+    // Published results, under m_critsec
+    CRITICAL_SECTION m_critsec;
+    float       *m_pBandsDb;
+    double      *m_pBandSums;       // Mean square, summed over frames
+    float       *m_pHistory;        // m_options.nHistory rows
+    ULONGLONG   m_nFrames;
+};
+
+// Prints the mean band levels as a bar chart
+void printSpectrum(const char *szLabel, SpectrumAnalyzer &analyzer);
+
+// Checks each FFT kernel against a direct DFT and prints the frames
+// per second each runs on one core, then streams a tone through the
+// analyzer.
+void benchmarkSpectrum(void);
@@ -10,6 +10,8 @@
 #include <float.h>
 #include <stdio.h>
 #include <tchar.h>
+#include <new>
+#include <process.h>
 
 #include <windows.h>
 #include <windowsx.h>
@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "threadPool.h"
+
+// State shared by the threads of one RunInParallel call
+struct ParallelJob
+{
+	volatile LONG iNext;        // Next item to hand out
+	LONG nItems;
+	ParallelWorkProc pfnWork;
+	void *pContext;
+};
+
+static unsigned __stdcall ParallelThreadProc(void *pv)
+{
+	ParallelJob *pJob = (ParallelJob *)pv;
+	while (true) {
+		LONG iItem = InterlockedIncrement(&pJob->iNext) - 1;
+		if (iItem >= pJob->nItems) {
+			break;
+		}
+		pJob->pfnWork(iItem, pJob->pContext);
+	}
+	return 0;
+}
+
+HRESULT RunInParallel(
+					  LONG nItems,                  // Number of work items.
+					  LONG nMaxThreads,             // Concurrency limit.
+					  ParallelWorkProc pfnWork,     // Called for each item.
+					  void *pContext                // Passed to pfnWork.
+					  )
+{
+	HRESULT hr = S_OK;
+	HANDLE hThreads[MAXIMUM_WAIT_OBJECTS];
+	LONG nThreads = 0;
+	ParallelJob job;
+
+	if (nItems <= 0) {
+		return S_OK;
+	}
+
+	job.iNext = 0;
+	job.nItems = nItems;
+	job.pfnWork = pfnWork;
+	job.pContext = pContext;
+
+	// No more threads than items, or than can be waited on at once
+	LONG nWanted = min(nItems, nMaxThreads);
+	nWanted = min(nWanted, (LONG)MAXIMUM_WAIT_OBJECTS);
+	if (nWanted <= 1) {
+		ParallelThreadProc(&job);
+		return S_OK;
+	}
+
+	for (LONG i = 0; i < nWanted; i++) {
+		hThreads[nThreads] = (HANDLE)_beginthreadex(NULL, 0,
+			ParallelThreadProc, &job, 0, NULL);
+		if (hThreads[nThreads] == NULL) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+		nThreads++;
+	}
+
+	// If no thread could be started, do the work here.  Otherwise the
+	// threads that did start take all the items.
+	if (nThreads == 0) {
+		ParallelThreadProc(&job);
+		return hr;
+	}
+
+	WaitForMultipleObjects(nThreads, hThreads, TRUE, INFINITE);
+	for (LONG i = 0; i < nThreads; i++) {
+		CloseHandle(hThreads[i]);
+	}
+	return S_OK;
+}
+
+LONG GetProcessorCount(void)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (LONG)si.dwNumberOfProcessors;
+}
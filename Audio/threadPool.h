@@ -0,0 +1,24 @@
+//////////////////////////////////////////////////////////////////////////
+// threadPool.h: Runs work items on a bounded number of threads
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Called once for each item, possibly on another thread
+typedef void (*ParallelWorkProc)(LONG iItem, void *pContext);
+
+// Runs pfnWork for items 0 to nItems - 1 on at most nMaxThreads threads
+// and returns when all have finished.  Items are handed out in order
+// as threads become free.  With one thread, the items run on the
+// calling thread.
+HRESULT RunInParallel(
+                      LONG nItems,                  // Number of work items.
+                      LONG nMaxThreads,             // Concurrency limit.
+                      ParallelWorkProc pfnWork,     // Called for each item.
+                      void *pContext                // Passed to pfnWork.
+                      );
+
+// Number of logical processors
+LONG GetProcessorCount(void);
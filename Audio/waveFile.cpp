@@ -0,0 +1,1566 @@
+#include "stdafx.h"
+#include "waveFile.h"
+#include "mfUtils.h"
+
+#include <psapi.h>
+#include <winioctl.h>
+
+// Layout of the start of the file.  The 'JUNK' chunk is the same size as
+// a 'ds64' chunk without a table and becomes one if the file is RF64.
+//   0  'RIFF' or 'RF64'
+//   4  RIFF size (0xFFFFFFFF for RF64)
+//   8  'WAVE'
+//  12  'JUNK' or 'ds64'
+//  16  28
+//  20  RIFF size (64-bit)
+//  28  data size (64-bit)
+//  36  sample count (64-bit)
+//  44  table length (0)
+//  48  'fmt ' chunk, then the 'data' chunk
+const DWORD DS64_CHUNK_SIZE = 28;
+const DWORD RIFF_SIZE_OFFSET = 4;
+const DWORD DS64_ID_OFFSET = 12;
+const DWORD DS64_DATA_OFFSET = 20;
+
+// Sizes that do not fit in a 32-bit chunk size are written as this
+const DWORD RF64_SIZE_PLACEHOLDER = 0xFFFFFFFF;
+
+WaveFile::WaveFile() :
+m_hFile(INVALID_HANDLE_VALUE),
+m_hHeaderFile(INVALID_HANDLE_VALUE),
+m_pBlock(NULL),
+m_cbBlock(0),
+m_cbBlockUsed(0),
+m_cbFile(0),
+m_cWrites(0),
+m_cbCopied(0),
+m_cbLastCheckpoint(0),
+m_tLastCheckpoint(0),
+m_cCheckpoints(0),
+m_cbHeader(0),
+m_nBlockAlign(0),
+m_cbAudioData(0),
+m_bRF64(FALSE),
+m_hMapping(NULL),
+m_pView(NULL),
+m_cbViewOffset(0),
+m_cbView(0),
+m_cbAllocated(0),
+m_cMaps(0),
+m_cExtends(0)
+{
+	m_szFileName[0] = L'\0';
+}
+
+WaveFile::~WaveFile()
+{
+	Close();
+	FreeBlock();
+}
+
+// Sets the buffering options.  Takes effect at the next Open.
+void WaveFile::SetOptions(const WaveFileOptions &options)
+{
+	m_options = options;
+}
+
+// Creates the file and writes a header with placeholder sizes.
+HRESULT WaveFile::Open(
+					   const WCHAR *szFileName,    // Name of the output file.
+					   const WAVEFORMATEX *pWav,   // The audio format.
+					   DWORD cbFormat              // Size of the format, in bytes.
+					   )
+{
+	HRESULT hr = S_OK;
+	if (IsOpen()) {
+		return E_UNEXPECTED;
+	}
+
+	m_cbHeader = 0;
+	m_cbAudioData = 0;
+	m_cbFile = 0;
+	m_cWrites = 0;
+	m_cbCopied = 0;
+	m_cbLastCheckpoint = 0;
+	m_tLastCheckpoint = GetTickCount64();
+	m_cCheckpoints = 0;
+	m_bRF64 = FALSE;
+	m_cbAllocated = 0;
+	m_cMaps = 0;
+	m_cExtends = 0;
+	m_nBlockAlign = pWav->nBlockAlign;
+	if (m_nBlockAlign == 0) {
+		return E_INVALIDARG;
+	}
+
+	hr = StringCchCopyW(m_szFileName, MAX_PATH, szFileName);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Set up the write buffer, rounded to whole sectors.  Unbuffered
+	// writes have to go through it to stay sector aligned.  Mapped
+	// files copy straight into the view and need neither.
+	if (m_options.bMapped) {
+		m_options.bUnbuffered = FALSE;
+		m_options.cbBlockSize = 0;
+	}
+	DWORD cbBlock = m_options.cbBlockSize;
+	if (cbBlock == 0 && m_options.bUnbuffered) {
+		cbBlock = WAVE_FILE_BLOCK_SIZE;
+	}
+	if (cbBlock != 0) {
+		cbBlock = max(cbBlock, WAVE_FILE_MIN_BLOCK_SIZE);
+		cbBlock = min(cbBlock, WAVE_FILE_MAX_BLOCK_SIZE);
+		cbBlock = (cbBlock / WAVE_FILE_SECTOR_SIZE) * WAVE_FILE_SECTOR_SIZE;
+	}
+	if (cbBlock != m_cbBlock) {
+		FreeBlock();
+		if (cbBlock != 0) {
+			// VirtualAlloc returns page-aligned memory
+			m_pBlock = (BYTE *)VirtualAlloc(NULL, cbBlock,
+				MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			if (m_pBlock == NULL) {
+				return E_OUTOFMEMORY;
+			}
+			m_cbBlock = cbBlock;
+		}
+	}
+	m_cbBlockUsed = 0;
+
+	DWORD dwFlags = 0;
+	if (m_options.bUnbuffered) {
+		dwFlags |= FILE_FLAG_NO_BUFFERING;
+	}
+	// Checkpoints write the header through a second handle
+	DWORD dwShare = FILE_SHARE_READ;
+	if (m_options.msecCheckpoint != 0 || m_options.cbCheckpoint != 0) {
+		dwShare |= FILE_SHARE_WRITE;
+	}
+	// A read-write mapping needs a handle that can read
+	DWORD dwAccess = GENERIC_WRITE;
+	if (m_options.bMapped) {
+		dwAccess |= GENERIC_READ;
+	}
+	m_hFile = CreateFileW(szFileName, dwAccess, dwShare, NULL,
+		CREATE_ALWAYS, dwFlags, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		return hr;
+	}
+
+	// Allocate the whole file now, with room for the header, so that it
+	// is not extended a piece at a time
+	if (m_options.bMapped) {
+		hr = ExtendMapping(m_options.cbPreallocate + WAVE_FILE_SECTOR_SIZE);
+	}
+
+	if (SUCCEEDED(hr)) {
+		hr = WriteHeader(pWav, cbFormat);
+	}
+	if (FAILED(hr)) {
+		UnmapFile();
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+	return hr;
+}
+
+// Appends audio data.  The caller keeps the data a multiple of the
+// block alignment.
+HRESULT WaveFile::Write(const void *pData, DWORD cbData)
+{
+	if (!IsOpen()) {
+		return E_UNEXPECTED;
+	}
+	HRESULT hr = Append(pData, cbData);
+	if (SUCCEEDED(hr)) {
+		m_cbAudioData += cbData;
+		if (CheckpointDue()) {
+			hr = Checkpoint();
+		}
+	}
+	return hr;
+}
+
+// Appends the pieces of one block of audio data.  The caller keeps the
+// total a multiple of the block alignment; the pieces need not be.
+HRESULT WaveFile::WriteSegments(const BufferSegment *pSegments,
+								DWORD nSegments)
+{
+	if (!IsOpen()) {
+		return E_UNEXPECTED;
+	}
+	HRESULT hr = S_OK;
+	for (DWORD i = 0; i < nSegments && SUCCEEDED(hr); i++) {
+		hr = Append(pSegments[i].pData, pSegments[i].cbData);
+		if (SUCCEEDED(hr)) {
+			m_cbAudioData += pSegments[i].cbData;
+		}
+	}
+	if (SUCCEEDED(hr) && CheckpointDue()) {
+		hr = Checkpoint();
+	}
+	return hr;
+}
+
+// Flushes the buffer, fixes up the header and closes the file.
+HRESULT WaveFile::Close()
+{
+	if (!IsOpen()) {
+		return S_OK;
+	}
+
+	HRESULT hr = S_OK;
+
+	if (m_hHeaderFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hHeaderFile);
+		m_hHeaderFile = INVALID_HANDLE_VALUE;
+	}
+
+	// The data chunk must have an even size
+	if (m_cbAudioData & 1) {
+		BYTE pad = 0;
+		hr = Append(&pad, 1);
+	}
+
+	if (SUCCEEDED(hr)) {
+		if (m_options.bMapped) {
+			hr = FinishMapped();
+		} else if (m_options.bUnbuffered) {
+			hr = FinishUnbuffered();
+		} else {
+			hr = FlushBlock();
+		}
+	} else {
+		UnmapFile();
+	}
+
+	if (SUCCEEDED(hr)) {
+		hr = FixUpChunkSizes();
+	}
+
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+	return hr;
+}
+
+// Write the WAVE file header.
+// Note: This function writes placeholder values for the file size
+// and data size, as these values will need to be filled in later.
+HRESULT WaveFile::WriteHeader(const WAVEFORMATEX *pWav, DWORD cbFormat)
+{
+	HRESULT hr = S_OK;
+	DWORD header[] = {
+		// RIFF header
+		FCC('RIFF'),
+		0,
+		FCC('WAVE'),
+		// Space for a ds64 chunk
+		FCC('JUNK'),
+		DS64_CHUNK_SIZE,
+		0, 0, 0, 0, 0, 0, 0,
+		// Start of 'fmt ' chunk
+		FCC('fmt '),
+		cbFormat
+	};
+	DWORD dataHeader[] = { FCC('data'), 0 };
+	BYTE pad = 0;
+
+	hr = Append(header, sizeof(header));
+
+	// Write the WAVEFORMATEX structure, padded to an even size.
+	if (SUCCEEDED(hr)) {
+		hr = Append(pWav, cbFormat);
+	}
+	if (SUCCEEDED(hr) && (cbFormat & 1)) {
+		hr = Append(&pad, 1);
+	}
+
+	// Write the start of the 'data' chunk
+	if (SUCCEEDED(hr)) {
+		hr = Append(dataHeader, sizeof(dataHeader));
+	}
+	if (SUCCEEDED(hr)) {
+		m_cbHeader = sizeof(header) + cbFormat + (cbFormat & 1) +
+			sizeof(dataHeader);
+	}
+	return hr;
+}
+
+// Writes a block of data at the given offset.  Leaves the file
+// position after the written data.
+static HRESULT WriteAtOffset(HANDLE hFile, ULONGLONG offset, const void *buf,
+							 DWORD count)
+{
+	LARGE_INTEGER ll;
+	ll.QuadPart = offset;
+	if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	DWORD countWritten = 0;
+	if (!WriteFile(hFile, buf, count, &countWritten, NULL)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+// Writes the file-size information into the WAVE file header.
+// WAVE files use the RIFF file format. Each RIFF chunk has a data
+// size, and the RIFF header has a total file size.  When either size
+// does not fit in 32 bits, the file is rewritten as RF64: the sizes go
+// in the 'ds64' chunk and the 32-bit fields are set to 0xFFFFFFFF.
+// The header must have the reserved 'JUNK' chunk for RF64.
+static HRESULT WriteChunkSizes(
+							   HANDLE hFile,            // Output file.
+							   DWORD cbHeader,          // Size of the header, in bytes.
+							   ULONGLONG cbAudioData,   // Size of the 'data' chunk.
+							   DWORD nBlockAlign,       // Audio frame size, in bytes.
+							   BOOL *pbRF64             // Receives whether RF64 was used.
+							   )
+{
+	HRESULT hr = S_OK;
+
+	// NOTE: The "size" field in the RIFF header does not include
+	// the first 8 bytes of the file. (That is, the size of the
+	// data that appears after the size field.)
+	ULONGLONG cbRiffFileSize = cbHeader + cbAudioData + (cbAudioData & 1) - 8;
+	*pbRF64 = (cbRiffFileSize > MAXDWORD);
+
+	if (*pbRF64) {
+		DWORD riffHeader[] = { FCC('RF64'), RF64_SIZE_PLACEHOLDER };
+		DWORD ds64Id = FCC('ds64');
+		ULONGLONG ds64[] = {
+			cbRiffFileSize,
+			cbAudioData,
+			cbAudioData / nBlockAlign
+		};
+
+		hr = WriteAtOffset(hFile, 0, riffHeader, sizeof(riffHeader));
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, DS64_ID_OFFSET, &ds64Id, sizeof(ds64Id));
+		}
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, DS64_DATA_OFFSET, ds64, sizeof(ds64));
+		}
+		if (SUCCEEDED(hr)) {
+			DWORD cbData = RF64_SIZE_PLACEHOLDER;
+			hr = WriteAtOffset(hFile, cbHeader - sizeof(DWORD), &cbData,
+				sizeof(cbData));
+		}
+	} else {
+		DWORD cbRiff = (DWORD)cbRiffFileSize;
+		DWORD cbData = (DWORD)cbAudioData;
+		hr = WriteAtOffset(hFile, cbHeader - sizeof(DWORD), &cbData,
+			sizeof(cbData));
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, RIFF_SIZE_OFFSET, &cbRiff, sizeof(cbRiff));
+		}
+	}
+	return hr;
+}
+
+// Writes the final sizes into the header.  Called after the write
+// buffer has been flushed.
+HRESULT WaveFile::FixUpChunkSizes()
+{
+	HRESULT hr = WriteChunkSizes(m_hFile, m_cbHeader, m_cbAudioData,
+		m_nBlockAlign, &m_bRF64);
+	if (FAILED(hr)) {
+		printf("Error in FixUpChunkSizes\n");
+	}
+	return hr;
+}
+
+// Writes the sizes of the data that has reached the file so far into
+// the header, so that the file is readable if the recording is cut
+// off.  Data still in the write buffer is not counted.  The header is
+// written through a second handle so the position and alignment of
+// the data writes are not disturbed.
+HRESULT WaveFile::Checkpoint()
+{
+	HRESULT hr = S_OK;
+	if (m_hHeaderFile == INVALID_HANDLE_VALUE) {
+		m_hHeaderFile = CreateFileW(m_szFileName, GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		if (m_hHeaderFile == INVALID_HANDLE_VALUE) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	// Data must be on disk before the header claims it
+	if (m_options.bSyncCheckpoints) {
+		if (m_pView && !FlushViewOfFile(m_pView, 0)) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		if (!FlushFileBuffers(m_hFile)) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	ULONGLONG cbOnDisk = m_cbFile - m_cbBlockUsed;
+	ULONGLONG cbAudioData = 0;
+	if (cbOnDisk > m_cbHeader) {
+		cbAudioData = min(cbOnDisk - m_cbHeader, m_cbAudioData);
+		cbAudioData = (cbAudioData / m_nBlockAlign) * m_nBlockAlign;
+	}
+
+	BOOL bRF64 = FALSE;
+	hr = WriteChunkSizes(m_hHeaderFile, m_cbHeader, cbAudioData,
+		m_nBlockAlign, &bRF64);
+	if (SUCCEEDED(hr) && m_options.bSyncCheckpoints) {
+		if (!FlushFileBuffers(m_hHeaderFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	m_cbLastCheckpoint = m_cbAudioData;
+	m_tLastCheckpoint = GetTickCount64();
+	m_cCheckpoints++;
+	return hr;
+}
+
+// Returns TRUE when a checkpoint is due.
+BOOL WaveFile::CheckpointDue() const
+{
+	if (m_options.cbCheckpoint != 0 &&
+		m_cbAudioData - m_cbLastCheckpoint >= m_options.cbCheckpoint) {
+		return TRUE;
+	}
+	if (m_options.msecCheckpoint != 0 &&
+		GetTickCount64() - m_tLastCheckpoint >= m_options.msecCheckpoint) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Adds data to the write buffer, writing out each block as it fills.
+// Without a buffer the data is written directly.
+HRESULT WaveFile::Append(const void *buf, DWORD count)
+{
+	HRESULT hr = S_OK;
+	if (m_options.bMapped) {
+		return AppendMapped(buf, count);
+	}
+	if (m_pBlock == NULL) {
+		hr = WriteToFile(buf, count);
+		if (SUCCEEDED(hr)) {
+			m_cbFile += count;
+		}
+		return hr;
+	}
+
+	const BYTE *pData = (const BYTE *)buf;
+	while (count > 0 && SUCCEEDED(hr)) {
+		// Large writes into an empty buffer can skip the copy, but
+		// only when the data does not have to be sector aligned.
+		if (m_cbBlockUsed == 0 && count >= m_cbBlock &&
+			!m_options.bUnbuffered) {
+			DWORD cbDirect = (count / m_cbBlock) * m_cbBlock;
+			hr = WriteToFile(pData, cbDirect);
+			if (SUCCEEDED(hr)) {
+				m_cbFile += cbDirect;
+				pData += cbDirect;
+				count -= cbDirect;
+			}
+			continue;
+		}
+
+		DWORD cbCopy = min(count, m_cbBlock - m_cbBlockUsed);
+		CopyMemory(m_pBlock + m_cbBlockUsed, pData, cbCopy);
+		m_cbCopied += cbCopy;
+		m_cbBlockUsed += cbCopy;
+		m_cbFile += cbCopy;
+		pData += cbCopy;
+		count -= cbCopy;
+		if (m_cbBlockUsed == m_cbBlock) {
+			hr = FlushBlock();
+		}
+	}
+	return hr;
+}
+
+// Writes out whatever is in the write buffer.
+HRESULT WaveFile::FlushBlock()
+{
+	if (m_pBlock == NULL || m_cbBlockUsed == 0) {
+		return S_OK;
+	}
+	HRESULT hr = WriteToFile(m_pBlock, m_cbBlockUsed);
+	if (SUCCEEDED(hr)) {
+		m_cbBlockUsed = 0;
+	}
+	return hr;
+}
+
+// Writes the last partial block of an unbuffered file.  The block is
+// padded to a whole sector, the file is reopened with buffering so the
+// header can be patched, and the padding is cut off again.
+HRESULT WaveFile::FinishUnbuffered()
+{
+	HRESULT hr = S_OK;
+	if (m_cbBlockUsed > 0) {
+		DWORD cbPadded = ((m_cbBlockUsed + WAVE_FILE_SECTOR_SIZE - 1) /
+			WAVE_FILE_SECTOR_SIZE) * WAVE_FILE_SECTOR_SIZE;
+		ZeroMemory(m_pBlock + m_cbBlockUsed, cbPadded - m_cbBlockUsed);
+		hr = WriteToFile(m_pBlock, cbPadded);
+		if (SUCCEEDED(hr)) {
+			m_cbBlockUsed = 0;
+		}
+	}
+
+	CloseHandle(m_hFile);
+	m_hFile = CreateFileW(m_szFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, 0, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	if (SUCCEEDED(hr)) {
+		LARGE_INTEGER ll;
+		ll.QuadPart = m_cbFile;
+		if (0 == SetFilePointerEx(m_hFile, ll, NULL, FILE_BEGIN) ||
+			0 == SetEndOfFile(m_hFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	return hr;
+}
+
+// Writes a block of data at the current position.
+HRESULT WaveFile::WriteToFile(const void *buf, DWORD count)
+{
+	DWORD countWritten = 0;
+	HRESULT hr = S_OK;
+	BOOL bResult = WriteFile(m_hFile, buf, count, &countWritten, NULL);
+	if (!bResult) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	m_cWrites++;
+	return hr;
+}
+
+void WaveFile::FreeBlock()
+{
+	if (m_pBlock) {
+		VirtualFree(m_pBlock, 0, MEM_RELEASE);
+		m_pBlock = NULL;
+	}
+	m_cbBlock = 0;
+	m_cbBlockUsed = 0;
+}
+
+// Copies data into the mapped view, moving the view along the file and
+// growing the file when the data reaches the end of either.
+HRESULT WaveFile::AppendMapped(const void *buf, DWORD count)
+{
+	HRESULT hr = S_OK;
+	const BYTE *pData = (const BYTE *)buf;
+	while (count > 0) {
+		if (m_pView == NULL || m_cbFile >= m_cbViewOffset + m_cbView) {
+			if (m_cbFile >= m_cbAllocated) {
+				hr = ExtendMapping(m_cbAllocated +
+					max(m_cbAllocated / 4, WAVE_FILE_MAP_GROWTH));
+				if (FAILED(hr)) {
+					return hr;
+				}
+			}
+			hr = MapView((m_cbFile / WAVE_FILE_MAP_WINDOW) * WAVE_FILE_MAP_WINDOW);
+			if (FAILED(hr)) {
+				return hr;
+			}
+		}
+		DWORD offset = (DWORD)(m_cbFile - m_cbViewOffset);
+		DWORD cbCopy = min(count, m_cbView - offset);
+		CopyMemory(m_pView + offset, pData, cbCopy);
+		m_cbCopied += cbCopy;
+		m_cbFile += cbCopy;
+		pData += cbCopy;
+		count -= cbCopy;
+	}
+	return hr;
+}
+
+// Sets the file size, rounded up to whole views, and maps the whole of
+// it.  Any view is unmapped first.
+HRESULT WaveFile::ExtendMapping(ULONGLONG cbFile)
+{
+	cbFile = ((cbFile + WAVE_FILE_MAP_WINDOW - 1) / WAVE_FILE_MAP_WINDOW) *
+		WAVE_FILE_MAP_WINDOW;
+	UnmapFile();
+
+	LARGE_INTEGER ll;
+	ll.QuadPart = cbFile;
+	if (0 == SetFilePointerEx(m_hFile, ll, NULL, FILE_BEGIN) ||
+		0 == SetEndOfFile(m_hFile)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (m_hMapping == NULL) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (m_cbAllocated != 0) {
+		m_cExtends++;
+	}
+	m_cbAllocated = cbFile;
+	return S_OK;
+}
+
+// Maps the window that starts at offset, which is a multiple of
+// WAVE_FILE_MAP_WINDOW.  Dirty pages of the old view are left to the
+// system to write.
+HRESULT WaveFile::MapView(ULONGLONG offset)
+{
+	if (m_pView) {
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+	DWORD cbView = (DWORD)min((ULONGLONG)WAVE_FILE_MAP_WINDOW,
+		m_cbAllocated - offset);
+	m_pView = (BYTE *)MapViewOfFile(m_hMapping, FILE_MAP_WRITE,
+		(DWORD)(offset >> 32), (DWORD)offset, cbView);
+	if (m_pView == NULL) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	m_cbViewOffset = offset;
+	m_cbView = cbView;
+	m_cMaps++;
+	return S_OK;
+}
+
+void WaveFile::UnmapFile()
+{
+	if (m_pView) {
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+	if (m_hMapping) {
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+	m_cbView = 0;
+}
+
+// Unmaps the file and cuts off the allocation past the data, so the
+// header can be patched with WriteFile.
+HRESULT WaveFile::FinishMapped()
+{
+	UnmapFile();
+	LARGE_INTEGER ll;
+	ll.QuadPart = m_cbFile;
+	if (0 == SetFilePointerEx(m_hFile, ll, NULL, FILE_BEGIN) ||
+		0 == SetEndOfFile(m_hFile)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	m_cbAllocated = m_cbFile;
+	return S_OK;
+}
+
+// Finds the end of the last byte that is not zero between cbStart and
+// cbEnd, reading backwards from cbEnd.  Gives cbStart if all are zero.
+static HRESULT FindEndOfNonZero(HANDLE hFile, ULONGLONG cbStart,
+								ULONGLONG cbEnd, ULONGLONG *pcbEnd)
+{
+	const DWORD CHUNK_SIZE = 1024 * 1024;
+	HRESULT hr = S_OK;
+	BYTE *pChunk = new (std::nothrow) BYTE[CHUNK_SIZE];
+	if (pChunk == NULL) {
+		return E_OUTOFMEMORY;
+	}
+
+	*pcbEnd = cbStart;
+	while (cbEnd > cbStart) {
+		DWORD cbChunk = (DWORD)min(cbEnd - cbStart, (ULONGLONG)CHUNK_SIZE);
+		LARGE_INTEGER ll;
+		DWORD cbRead = 0;
+		ll.QuadPart = cbEnd - cbChunk;
+		if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN) ||
+			!ReadFile(hFile, pChunk, cbChunk, &cbRead, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+		if (cbRead != cbChunk) {
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+			break;
+		}
+		DWORD i = cbChunk;
+		while (i > 0 && pChunk[i - 1] == 0) {
+			i--;
+		}
+		if (i > 0) {
+			*pcbEnd = cbEnd - cbChunk + i;
+			break;
+		}
+		cbEnd -= cbChunk;
+	}
+
+	delete [] pChunk;
+	return hr;
+}
+
+// Repairs the header of a WAVE file whose recording was cut off.  The
+// audio runs to the end of the file, rounded down to whole frames.  But
+// when the file's last frame is all zero past the size a checkpoint
+// wrote, that tail is the zeroed allocation a mapped file leaves, or a
+// preallocated extent, so the audio is cut after the last frame past
+// the checkpoint that is not all zero.
+// Files over 4 GB can only be repaired if they have the reserved 'JUNK'
+// chunk that WaveFile writes, as it is needed for the RF64 sizes.
+HRESULT RepairWaveFile(
+					   const WCHAR *szFileName,    // File to repair.
+					   ULONGLONG *pcbAudioData     // Receives the recovered data size.
+					   )
+{
+	const DWORD MAX_HEADER_SIZE = 64 * 1024;
+	HRESULT hr = S_OK;
+	BYTE *pHeader = NULL;
+	DWORD cbRead = 0;
+	DWORD cbHeader = 0;         // Offset of the audio data.
+	DWORD nBlockAlign = 0;
+	BOOL bCanRF64 = FALSE;
+	LARGE_INTEGER fileSize;
+	ULONGLONG cbAvailable = 0;  // Data that fits in the file
+	ULONGLONG cbCheckpoint = 0; // Data size in the header
+	ULONGLONG cbAudioData = 0;
+	BOOL bRF64 = FALSE;
+	DWORD pos = 12;
+
+	*pcbAudioData = 0;
+
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_READ | GENERIC_WRITE, 0,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	pHeader = new (std::nothrow) BYTE[MAX_HEADER_SIZE];
+	if (pHeader == NULL) {
+		hr = E_OUTOFMEMORY;
+		goto CLEANUP;
+	}
+	if (!ReadFile(hFile, pHeader, MAX_HEADER_SIZE, &cbRead, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto CLEANUP;
+	}
+	if (!GetFileSizeEx(hFile, &fileSize)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		goto CLEANUP;
+	}
+
+	// Check the RIFF header
+	if (cbRead < 12 ||
+		(*(DWORD *)pHeader != FCC('RIFF') && *(DWORD *)pHeader != FCC('RF64')) ||
+		*(DWORD *)(pHeader + 8) != FCC('WAVE')) {
+		hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+		goto CLEANUP;
+	}
+
+	// Walk the chunks up to the 'data' chunk
+	while (pos + 8 <= cbRead) {
+		DWORD ckid = *(DWORD *)(pHeader + pos);
+		DWORD cksize = *(DWORD *)(pHeader + pos + 4);
+		if (ckid == FCC('data')) {
+			cbHeader = pos + 8;
+			break;
+		}
+		if (pos == DS64_ID_OFFSET && cksize == DS64_CHUNK_SIZE &&
+			(ckid == FCC('JUNK') || ckid == FCC('ds64'))) {
+			bCanRF64 = TRUE;
+		}
+		if (ckid == FCC('fmt ') && cksize >= 16 && pos + 8 + 14 <= cbRead) {
+			// nBlockAlign is at offset 12 in WAVEFORMATEX
+			nBlockAlign = *(WORD *)(pHeader + pos + 8 + 12);
+		}
+		if (cksize > cbRead) {
+			break;
+		}
+		pos += 8 + cksize + (cksize & 1);
+	}
+	if (cbHeader == 0 || nBlockAlign == 0) {
+		hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+		goto CLEANUP;
+	}
+
+	// Whole frames that the file has room for
+	if ((ULONGLONG)fileSize.QuadPart > cbHeader) {
+		cbAvailable = (ULONGLONG)fileSize.QuadPart - cbHeader;
+		cbAvailable = (cbAvailable / nBlockAlign) * nBlockAlign;
+	}
+
+	// The size the last checkpoint wrote, from the 'ds64' chunk once
+	// the file has become RF64
+	if (*(DWORD *)pHeader == FCC('RF64')) {
+		if (*(DWORD *)(pHeader + DS64_ID_OFFSET) == FCC('ds64') &&
+			DS64_DATA_OFFSET + 16 <= cbRead) {
+			cbCheckpoint = *(ULONGLONG *)(pHeader + DS64_DATA_OFFSET + 8);
+		}
+	} else {
+		cbCheckpoint = *(DWORD *)(pHeader + cbHeader - sizeof(DWORD));
+	}
+	cbCheckpoint = (cbCheckpoint / nBlockAlign) * nBlockAlign;
+	if (cbCheckpoint > cbAvailable) {
+		cbCheckpoint = 0;
+	}
+
+	// Every whole frame in the file is kept, unless the file runs past
+	// the checkpointed size into a last frame that is all zero.  Then it
+	// was allocated ahead of the data, and the audio ends at the last
+	// frame after the checkpoint that holds any.
+	cbAudioData = cbAvailable;
+	if (cbAvailable > cbCheckpoint) {
+		ULONGLONG cbLastFrame = cbHeader + cbAvailable - nBlockAlign;
+		ULONGLONG cbEnd = 0;
+		hr = FindEndOfNonZero(hFile, cbLastFrame, cbHeader + cbAvailable,
+			&cbEnd);
+		if (SUCCEEDED(hr) && cbEnd == cbLastFrame) {
+			hr = FindEndOfNonZero(hFile, cbHeader + cbCheckpoint, cbLastFrame,
+				&cbEnd);
+			cbAudioData = cbEnd - cbHeader;
+			cbAudioData = (cbAudioData + nBlockAlign - 1) / nBlockAlign *
+				nBlockAlign;
+		}
+		if (FAILED(hr)) {
+			goto CLEANUP;
+		}
+	}
+	if (cbHeader + cbAudioData + (cbAudioData & 1) - 8 > MAXDWORD &&
+		!bCanRF64) {
+		hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		goto CLEANUP;
+	}
+
+	// Cut off anything past the audio and add the pad byte if needed
+	{
+		LARGE_INTEGER ll;
+		ll.QuadPart = cbHeader + cbAudioData;
+		if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN) ||
+			0 == SetEndOfFile(hFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			goto CLEANUP;
+		}
+		if (cbAudioData & 1) {
+			BYTE pad = 0;
+			DWORD countWritten = 0;
+			if (!WriteFile(hFile, &pad, 1, &countWritten, NULL)) {
+				hr = HRESULT_FROM_WIN32(GetLastError());
+				goto CLEANUP;
+			}
+		}
+	}
+
+	hr = WriteChunkSizes(hFile, cbHeader, cbAudioData, nBlockAlign, &bRF64);
+	if (SUCCEEDED(hr)) {
+		*pcbAudioData = cbAudioData;
+	}
+
+CLEANUP:
+	delete [] pHeader;
+	CloseHandle(hFile);
+	return hr;
+}
+
+// Number of extents the file occupies on disk, or 0 if the file system
+// cannot say
+static DWORD CountFileExtents(const WCHAR *szFileName)
+{
+	HANDLE hFile = CreateFileW(szFileName, FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	STARTING_VCN_INPUT_BUFFER input;
+	input.StartingVcn.QuadPart = 0;
+	BYTE buffer[4096];
+	RETRIEVAL_POINTERS_BUFFER *pExtents = (RETRIEVAL_POINTERS_BUFFER *)buffer;
+	DWORD cExtents = 0;
+	while (true) {
+		DWORD cbReturned = 0;
+		BOOL bDone = DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS,
+			&input, sizeof(input), pExtents, sizeof(buffer), &cbReturned, NULL);
+		if (!bDone && GetLastError() != ERROR_MORE_DATA) {
+			break;
+		}
+		cExtents += pExtents->ExtentCount;
+		if (bDone || pExtents->ExtentCount == 0) {
+			break;
+		}
+		input.StartingVcn = pExtents->Extents[pExtents->ExtentCount - 1].NextVcn;
+	}
+	CloseHandle(hFile);
+	return cExtents;
+}
+
+void benchmarkWaveFile(void) {
+	const ULONGLONG CB_TOTAL = 512 * 1024 * 1024;
+	// 20 msec of stereo float at 48 kHz, a typical capture buffer
+	const DWORD CB_PIECE = 48000 / 50 * 2 * sizeof(float);
+	const WCHAR *szFileName = L"WaveFileBench.wav";
+	const int N_MODES = 5;
+	const char *szModes[N_MODES] = {
+		"direct", "buffered", "unbuffered", "mapped", "mapped, grown"
+	};
+
+	BYTE *pPiece = new (std::nothrow) BYTE[CB_PIECE];
+	if (pPiece == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+	srand(1);
+	for (DWORD i = 0; i < CB_PIECE; i++) {
+		pPiece[i] = (BYTE)rand();
+	}
+
+	WAVEFORMATEX wav;
+	ZeroMemory(&wav, sizeof(wav));
+	wav.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	wav.nChannels = 2;
+	wav.nSamplesPerSec = 48000;
+	wav.wBitsPerSample = 32;
+	wav.nBlockAlign = 8;
+	wav.nAvgBytesPerSec = 48000 * 8;
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("WAV writer benchmark, %I64u MB in %u byte pieces\n",
+		CB_TOTAL / (1024 * 1024), CB_PIECE);
+	for (int iMode = 0; iMode < N_MODES; iMode++) {
+		WaveFileOptions options;
+		switch (iMode) {
+		case 0: options.cbBlockSize = 0; break;
+		case 2: options.bUnbuffered = TRUE; break;
+		case 3: options.bMapped = TRUE; options.cbPreallocate = CB_TOTAL; break;
+		case 4: options.bMapped = TRUE; break;
+		}
+
+		PROCESS_MEMORY_COUNTERS pmcStart, pmcEnd;
+		pmcStart.cb = pmcEnd.cb = sizeof(PROCESS_MEMORY_COUNTERS);
+		GetProcessMemoryInfo(GetCurrentProcess(), &pmcStart, sizeof(pmcStart));
+		LARGE_INTEGER tStart, tEnd;
+		QueryPerformanceCounter(&tStart);
+
+		WaveFile waveFile;
+		waveFile.SetOptions(options);
+		HRESULT hr = waveFile.Open(szFileName, &wav, sizeof(wav));
+		for (ULONGLONG cb = 0; cb < CB_TOTAL && SUCCEEDED(hr); cb += CB_PIECE) {
+			hr = waveFile.Write(pPiece, CB_PIECE);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = waveFile.Close();
+		}
+
+		QueryPerformanceCounter(&tEnd);
+		GetProcessMemoryInfo(GetCurrentProcess(), &pmcEnd, sizeof(pmcEnd));
+		if (FAILED(hr)) {
+			printf("  %-14s failed\n", szModes[iMode]);
+			printErrorDescription(hr);
+			waveFile.Close();
+			DeleteFileW(szFileName);
+			continue;
+		}
+
+		double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+		printf("  %-14s %7.1f MB/s, %6u writes, %6u maps, %7u page faults, "
+			"%4u extents\n", szModes[iMode],
+			waveFile.DataSize() / (seconds * 1024 * 1024), waveFile.WriteCount(),
+			waveFile.MapCount(), pmcEnd.PageFaultCount - pmcStart.PageFaultCount,
+			CountFileExtents(szFileName));
+		DeleteFileW(szFileName);
+	}
+
+	delete [] pPiece;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// RF64 benchmark
+
+// Writes a header for cbAudioData bytes of audio and extends the file
+// to hold them without writing them, by making it sparse.  With bJunk
+// the header is WaveFile's, with room for 'ds64'; without it, it is
+// the plain 44-byte header other writers produce.  The first and last
+// frames are written, so repair keeps the whole file.
+static HRESULT MakeSparseWaveFile(const WCHAR *szFileName,
+								  const WAVEFORMATEX *pWav, BOOL bJunk,
+								  ULONGLONG cbAudioData, DWORD *pcbHeader)
+{
+	HRESULT hr = S_OK;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+
+	if (bJunk) {
+		WaveFileOptions options;
+		WaveFile waveFile;
+		options.cbBlockSize = 0;
+		waveFile.SetOptions(options);
+		hr = waveFile.Open(szFileName, pWav, sizeof(WAVEFORMATEX));
+		if (SUCCEEDED(hr)) {
+			*pcbHeader = waveFile.HeaderSize();
+			hr = waveFile.Close();
+		}
+		if (FAILED(hr)) {
+			return hr;
+		}
+		hFile = CreateFileW(szFileName, GENERIC_READ | GENERIC_WRITE, 0,
+			NULL, OPEN_EXISTING, 0, NULL);
+	} else {
+		hFile = CreateFileW(szFileName, GENERIC_READ | GENERIC_WRITE, 0,
+			NULL, CREATE_ALWAYS, 0, NULL);
+	}
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	if (!bJunk) {
+		DWORD header[] = { FCC('RIFF'), 36, FCC('WAVE'), FCC('fmt '), 16 };
+		DWORD dataHeader[] = { FCC('data'), 0 };
+		hr = WriteAtOffset(hFile, 0, header, sizeof(header));
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, sizeof(header), pWav, 16);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, sizeof(header) + 16, dataHeader,
+				sizeof(dataHeader));
+		}
+		*pcbHeader = sizeof(header) + 16 + sizeof(dataHeader);
+	}
+
+	DWORD cbReturned = 0;
+	if (SUCCEEDED(hr) && !DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0,
+		NULL, 0, &cbReturned, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		LARGE_INTEGER ll;
+		ll.QuadPart = *pcbHeader + cbAudioData;
+		if (0 == SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN) ||
+			0 == SetEndOfFile(hFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (SUCCEEDED(hr) && cbAudioData >= pWav->nBlockAlign) {
+		BYTE frame[64];
+		FillMemory(frame, sizeof(frame), 0x55);
+		hr = WriteAtOffset(hFile, *pcbHeader, frame, pWav->nBlockAlign);
+		if (SUCCEEDED(hr)) {
+			hr = WriteAtOffset(hFile, *pcbHeader + cbAudioData - pWav->nBlockAlign,
+				frame, pWav->nBlockAlign);
+		}
+	}
+	CloseHandle(hFile);
+	return hr;
+}
+
+// Checks the sizes in the header of a file holding cbAudioData bytes
+// of audio: the RIFF sizes if they fit in 32 bits, otherwise RF64 with
+// the sizes in 'ds64' and 0xFFFFFFFF in the 32-bit fields.  The file
+// must end with the data, padded to an even size.
+static BOOL CheckWaveSizes(const WCHAR *szFileName, DWORD cbHeader,
+						   ULONGLONG cbAudioData, DWORD nBlockAlign)
+{
+	BYTE header[256];
+	DWORD cbRead = 0;
+	LARGE_INTEGER fileSize;
+	BOOL bOk = FALSE;
+
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_READ, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	if (cbHeader <= sizeof(header) &&
+		ReadFile(hFile, header, cbHeader, &cbRead, NULL) && cbRead == cbHeader &&
+		GetFileSizeEx(hFile, &fileSize)) {
+		ULONGLONG cbRiff = cbHeader + cbAudioData + (cbAudioData & 1) - 8;
+		DWORD cbData32 = *(DWORD *)(header + cbHeader - sizeof(DWORD));
+		bOk = (ULONGLONG)fileSize.QuadPart == cbRiff + 8;
+		if (cbRiff > MAXDWORD) {
+			bOk = bOk && cbHeader > DS64_DATA_OFFSET + 28 &&
+				*(DWORD *)header == FCC('RF64') &&
+				*(DWORD *)(header + RIFF_SIZE_OFFSET) == RF64_SIZE_PLACEHOLDER &&
+				*(DWORD *)(header + DS64_ID_OFFSET) == FCC('ds64') &&
+				*(DWORD *)(header + DS64_ID_OFFSET + 4) == DS64_CHUNK_SIZE &&
+				*(ULONGLONG *)(header + DS64_DATA_OFFSET) == cbRiff &&
+				*(ULONGLONG *)(header + DS64_DATA_OFFSET + 8) == cbAudioData &&
+				*(ULONGLONG *)(header + DS64_DATA_OFFSET + 16) ==
+				cbAudioData / nBlockAlign &&
+				*(DWORD *)(header + DS64_DATA_OFFSET + 24) == 0 &&
+				cbData32 == RF64_SIZE_PLACEHOLDER;
+		} else {
+			bOk = bOk && *(DWORD *)header == FCC('RIFF') &&
+				*(DWORD *)(header + RIFF_SIZE_OFFSET) == cbRiff &&
+				cbData32 == cbAudioData;
+		}
+	}
+	CloseHandle(hFile);
+	return bOk;
+}
+
+// Repairs sparse files with data sizes on either side of the 4 GB RIFF
+// limit and checks the header RepairWaveFile writes, which is the one
+// WaveFile writes at a checkpoint or Close.  Then repairs each again,
+// which reads the sizes back, from 'ds64' for an RF64 file.  A file
+// over the limit without room for 'ds64' must be refused.
+void benchmarkRF64(void)
+{
+	const WCHAR *szFileName = L"RF64Bench.wav";
+	const ULONGLONG GB = 1024 * 1024 * 1024;
+	WAVEFORMATEX wav;
+	ZeroMemory(&wav, sizeof(wav));
+	wav.wFormatTag = WAVE_FORMAT_PCM;
+	wav.nChannels = 2;
+	wav.nSamplesPerSec = 48000;
+	wav.wBitsPerSample = 16;
+	wav.nBlockAlign = 4;
+	wav.nAvgBytesPerSec = 48000 * 4;
+
+	// WaveFile's header is 12 + 36 + 8 + sizeof(WAVEFORMATEX) + 8 bytes.
+	// The largest data it can hold as RIFF, in whole frames:
+	const DWORD cbHeader = 12 + 8 + DS64_CHUNK_SIZE + 8 +
+		sizeof(WAVEFORMATEX) + (sizeof(WAVEFORMATEX) & 1) + 8;
+	const ULONGLONG cbMaxRiff =
+		((ULONGLONG)MAXDWORD + 8 - cbHeader) / wav.nBlockAlign * wav.nBlockAlign;
+
+	struct {
+		const char *szName;
+		ULONGLONG cbAudioData;
+		BOOL bJunk;
+	} cases[] = {
+		{ "1 MB", 1024 * 1024, TRUE },
+		{ "largest RIFF", cbMaxRiff, TRUE },
+		{ "one frame past RIFF", cbMaxRiff + wav.nBlockAlign, TRUE },
+		{ "6 GB", 6 * GB, TRUE },
+		{ "6 GB, no room for ds64", 6 * GB, FALSE },
+	};
+
+	printf("RF64 header check, sparse files, %u-byte frames\n", wav.nBlockAlign);
+	for (DWORD i = 0; i < ARRAYSIZE(cases); i++) {
+		DWORD cbFileHeader = 0;
+		ULONGLONG cbRepaired = 0;
+		ULONGLONG cbRepairedAgain = 0;
+		BOOL bOk = FALSE;
+
+		HRESULT hr = MakeSparseWaveFile(szFileName, &wav, cases[i].bJunk,
+			cases[i].cbAudioData, &cbFileHeader);
+		if (FAILED(hr)) {
+			printf("  %-24s cannot make a sparse file, skipped\n",
+				cases[i].szName);
+			printErrorDescription(hr);
+			DeleteFileW(szFileName);
+			continue;
+		}
+
+		hr = RepairWaveFile(szFileName, &cbRepaired);
+		if (!cases[i].bJunk) {
+			bOk = hr == HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+			printf("  %-24s %s, %s\n", cases[i].szName,
+				bOk ? "refused" : "not refused", bOk ? "ok" : "FAILED");
+			DeleteFileW(szFileName);
+			continue;
+		}
+		if (SUCCEEDED(hr)) {
+			bOk = cbFileHeader == cbHeader &&
+				cbRepaired == cases[i].cbAudioData &&
+				CheckWaveSizes(szFileName, cbFileHeader, cbRepaired,
+				wav.nBlockAlign);
+			hr = RepairWaveFile(szFileName, &cbRepairedAgain);
+		}
+		bOk = bOk && SUCCEEDED(hr) && cbRepairedAgain == cbRepaired &&
+			CheckWaveSizes(szFileName, cbFileHeader, cbRepaired, wav.nBlockAlign);
+		printf("  %-24s %I64u bytes, %s, %s\n", cases[i].szName, cbRepaired,
+			cbHeader + cbRepaired - 8 > MAXDWORD ? "RF64" : "RIFF",
+			bOk ? "ok" : "FAILED");
+		if (FAILED(hr)) {
+			printErrorDescription(hr);
+		}
+		DeleteFileW(szFileName);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Write coalescing benchmark
+
+// Whether two files hold the same bytes
+static BOOL CompareFiles(const WCHAR *szFile1, const WCHAR *szFile2)
+{
+	const DWORD CHUNK_SIZE = 1024 * 1024;
+	BOOL bSame = FALSE;
+	BYTE *pChunk1 = new (std::nothrow) BYTE[CHUNK_SIZE];
+	BYTE *pChunk2 = new (std::nothrow) BYTE[CHUNK_SIZE];
+	HANDLE hFile1 = CreateFileW(szFile1, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, 0, NULL);
+	HANDLE hFile2 = CreateFileW(szFile2, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, 0, NULL);
+
+	if (pChunk1 && pChunk2 && hFile1 != INVALID_HANDLE_VALUE &&
+		hFile2 != INVALID_HANDLE_VALUE) {
+		for (;;) {
+			DWORD cbRead1 = 0, cbRead2 = 0;
+			if (!ReadFile(hFile1, pChunk1, CHUNK_SIZE, &cbRead1, NULL) ||
+				!ReadFile(hFile2, pChunk2, CHUNK_SIZE, &cbRead2, NULL) ||
+				cbRead1 != cbRead2 || memcmp(pChunk1, pChunk2, cbRead1) != 0) {
+				break;
+			}
+			if (cbRead1 == 0) {
+				bSame = TRUE;
+				break;
+			}
+		}
+	}
+	if (hFile1 != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile1);
+	}
+	if (hFile2 != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile2);
+	}
+	delete [] pChunk1;
+	delete [] pChunk2;
+	return bSame;
+}
+
+// Writes the same pieces of audio, of random sizes up to 16 KB as a
+// capture delivers them and now and then 3 MB, without a write buffer (one WriteFile per piece,
+// as before coalescing) and then through buffers of several sizes.
+// The direct file must take one WriteFile per piece plus three for the
+// header.  A coalesced file may take no more than one per block, since
+// every write but the last is at least a block, and must hold the same
+// bytes as the direct one with the right sizes in its header.
+void benchmarkWriteCoalescing(void)
+{
+	const ULONGLONG CB_TOTAL = 64 * 1024 * 1024;
+	const DWORD CB_SOURCE = 4 * 1024 * 1024;
+	const DWORD CB_LARGE = 3 * 1024 * 1024;
+	const WCHAR *szDirect = L"WriteBenchDirect.wav";
+	const WCHAR *szFileName = L"WriteBench.wav";
+	const struct {
+		const char *szName;
+		DWORD cbBlockSize;
+		BOOL bUnbuffered;
+	} modes[] = {
+		{ "direct", 0, FALSE },
+		{ "64 KB blocks", 64 * 1024, FALSE },
+		{ "1 MB blocks", 1024 * 1024, FALSE },
+		{ "8 MB blocks", 8 * 1024 * 1024, FALSE },
+		{ "1 MB unbuffered", 1024 * 1024, TRUE },
+	};
+
+	WAVEFORMATEX wav;
+	ZeroMemory(&wav, sizeof(wav));
+	wav.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	wav.nChannels = 2;
+	wav.nSamplesPerSec = 48000;
+	wav.wBitsPerSample = 32;
+	wav.nBlockAlign = 8;
+	wav.nAvgBytesPerSec = 48000 * 8;
+
+	BYTE *pSource = new (std::nothrow) BYTE[CB_SOURCE];
+	if (pSource == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+	srand(1);
+	for (DWORD i = 0; i < CB_SOURCE; i++) {
+		pSource[i] = (BYTE)rand();
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("WAV write coalescing check, %I64u MB in pieces of up to 16 KB\n",
+		CB_TOTAL / (1024 * 1024));
+	DWORD cDirectWrites = 0;
+	for (DWORD iMode = 0; iMode < ARRAYSIZE(modes); iMode++) {
+		WaveFileOptions options;
+		options.cbBlockSize = modes[iMode].cbBlockSize;
+		options.bUnbuffered = modes[iMode].bUnbuffered;
+		const WCHAR *szFile = iMode == 0 ? szDirect : szFileName;
+
+		LARGE_INTEGER tStart, tEnd;
+		QueryPerformanceCounter(&tStart);
+
+		// The same pieces every time
+		WaveFile waveFile;
+		DWORD cPieces = 0;
+		DWORD cbOffset = 0;
+		srand(2);
+		waveFile.SetOptions(options);
+		HRESULT hr = waveFile.Open(szFile, &wav, sizeof(wav));
+		while (waveFile.DataSize() < CB_TOTAL && SUCCEEDED(hr)) {
+			DWORD cbPiece = (rand() % 1000 == 0) ? CB_LARGE :
+				(1 + rand() % 2048) * wav.nBlockAlign;
+			if (cbOffset + cbPiece > CB_SOURCE) {
+				cbOffset = 0;
+			}
+			hr = waveFile.Write(pSource + cbOffset, cbPiece);
+			cbOffset += cbPiece;
+			cPieces++;
+		}
+		if (SUCCEEDED(hr)) {
+			hr = waveFile.Close();
+		}
+		QueryPerformanceCounter(&tEnd);
+		if (FAILED(hr)) {
+			printf("  %-16s failed\n", modes[iMode].szName);
+			printErrorDescription(hr);
+			waveFile.Close();
+			DeleteFileW(szFile);
+			continue;
+		}
+
+		ULONGLONG cbFile = waveFile.HeaderSize() + waveFile.DataSize();
+		BOOL bOk = CheckWaveSizes(szFile, waveFile.HeaderSize(),
+			waveFile.DataSize(), wav.nBlockAlign);
+		if (iMode == 0) {
+			cDirectWrites = waveFile.WriteCount();
+			bOk = bOk && cDirectWrites == cPieces + 3;
+		} else {
+			ULONGLONG cMaxWrites = (cbFile + options.cbBlockSize - 1) /
+				options.cbBlockSize;
+			bOk = bOk && waveFile.WriteCount() <= cMaxWrites &&
+				CompareFiles(szDirect, szFileName);
+			DeleteFileW(szFileName);
+		}
+
+		double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+		printf("  %-16s %6u pieces, %6u writes (%.1f%% of direct), "
+			"%7.1f MB/s, %s\n", modes[iMode].szName, cPieces,
+			waveFile.WriteCount(),
+			100.0 * waveFile.WriteCount() / max(cDirectWrites, 1U),
+			waveFile.DataSize() / (seconds * 1024 * 1024), bOk ? "ok" : "FAILED");
+	}
+	DeleteFileW(szDirect);
+	delete [] pSource;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Repair benchmark
+
+// How the writer that -repairbench kills writes its file
+struct RepairBenchCase
+{
+	const char *szName;
+	DWORD cbBlockSize;
+	BOOL bMapped;
+	ULONGLONG cbPreallocate;
+	BOOL bCheckpoints;
+};
+
+const ULONGLONG REPAIR_BENCH_TOTAL = 256 * 1024 * 1024;
+// Most frames the writer writes at once
+const DWORD REPAIR_BENCH_MAX_FRAMES = 2048;
+
+static const RepairBenchCase g_repairCases[] = {
+	{ "direct, checkpoints", 0, FALSE, 0, TRUE },
+	{ "1 MB blocks, checkpoints", 1024 * 1024, FALSE, 0, TRUE },
+	{ "1 MB blocks, no checkpoints", 1024 * 1024, FALSE, 0, FALSE },
+	{ "mapped, checkpoints", 0, TRUE, REPAIR_BENCH_TOTAL, TRUE },
+	{ "mapped, grown, checkpoints", 0, TRUE, 0, TRUE },
+};
+
+static void GetRepairBenchFormat(WAVEFORMATEX *pWav)
+{
+	ZeroMemory(pWav, sizeof(*pWav));
+	pWav->wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	pWav->nChannels = 2;
+	pWav->nSamplesPerSec = 48000;
+	pWav->wBitsPerSample = 32;
+	pWav->nBlockAlign = 8;
+	pWav->nAvgBytesPerSec = 48000 * 8;
+}
+
+// Frame n of the writer's data.  No frame is all zero, so a zeroed
+// tail is never taken for data.
+static void GetRepairBenchFrame(ULONGLONG n, DWORD frame[2])
+{
+	frame[0] = (DWORD)n + 1;
+	frame[1] = ~(DWORD)n;
+}
+
+// The process -repairbench starts.  Opens the file, signals hReady, and
+// writes capture-sized pieces of numbered frames until it is killed or
+// has written REPAIR_BENCH_TOTAL bytes, then waits to be killed.
+int runRepairBenchWriter(DWORD iCase, HANDLE hReady, const WCHAR *szFileName)
+{
+	if (iCase >= ARRAYSIZE(g_repairCases)) {
+		return 1;
+	}
+	const RepairBenchCase *pCase = &g_repairCases[iCase];
+	DWORD *pPiece = new (std::nothrow) DWORD[REPAIR_BENCH_MAX_FRAMES * 2];
+	if (pPiece == NULL) {
+		return 1;
+	}
+
+	WaveFileOptions options;
+	WAVEFORMATEX wav;
+	WaveFile waveFile;
+	GetRepairBenchFormat(&wav);
+	options.cbBlockSize = pCase->cbBlockSize;
+	options.bMapped = pCase->bMapped;
+	options.cbPreallocate = pCase->cbPreallocate;
+	if (pCase->bCheckpoints) {
+		options.msecCheckpoint = 100;
+		options.cbCheckpoint = 4 * 1024 * 1024;
+	}
+	waveFile.SetOptions(options);
+	HRESULT hr = waveFile.Open(szFileName, &wav, sizeof(wav));
+	SetEvent(hReady);
+
+	ULONGLONG nFrames = 0;
+	srand(GetTickCount());
+	for (DWORD i = 0; SUCCEEDED(hr) && waveFile.DataSize() < REPAIR_BENCH_TOTAL;
+		i++) {
+		DWORD cFrames = 1 + rand() % REPAIR_BENCH_MAX_FRAMES;
+		for (DWORD j = 0; j < cFrames; j++) {
+			GetRepairBenchFrame(nFrames++, pPiece + 2 * j);
+		}
+		hr = waveFile.Write(pPiece, cFrames * wav.nBlockAlign);
+		if (i % 32 == 0) {
+			Sleep(1);
+		}
+	}
+	Sleep(INFINITE);
+	return 0;
+}
+
+// Number of whole frames after the header that hold the writer's data,
+// counting from the first
+static ULONGLONG CountRepairBenchFrames(const WCHAR *szFileName,
+									   DWORD cbHeader)
+{
+	const DWORD CHUNK_FRAMES = 128 * 1024;
+	ULONGLONG nFrames = 0;
+	DWORD *pChunk = new (std::nothrow) DWORD[CHUNK_FRAMES * 2];
+	HANDLE hFile = CreateFileW(szFileName, GENERIC_READ, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, 0, NULL);
+
+	if (pChunk && hFile != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER ll;
+		ll.QuadPart = cbHeader;
+		BOOL bMore = SetFilePointerEx(hFile, ll, NULL, FILE_BEGIN);
+		while (bMore) {
+			DWORD cbRead = 0;
+			if (!ReadFile(hFile, pChunk, CHUNK_FRAMES * 8, &cbRead, NULL)) {
+				break;
+			}
+			DWORD cFrames = cbRead / 8;
+			for (DWORD i = 0; i < cFrames && bMore; i++) {
+				DWORD frame[2];
+				GetRepairBenchFrame(nFrames, frame);
+				bMore = pChunk[2 * i] == frame[0] && pChunk[2 * i + 1] == frame[1];
+				if (bMore) {
+					nFrames++;
+				}
+			}
+			bMore = bMore && cFrames == CHUNK_FRAMES;
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	delete [] pChunk;
+	return nFrames;
+}
+
+// Starts a writer in another process, kills it partway through, and
+// repairs what it left.  The repair must keep every frame the writer
+// got to the file and no more, at least as much as the last checkpoint
+// claimed, and leave a header with those sizes.  A mapped file may keep
+// the rest of the piece the kill cut short.
+void benchmarkRepair(void)
+{
+	const DWORD N_RUNS = 4;
+	const WCHAR *szFileName = L"RepairBench.wav";
+	WAVEFORMATEX wav;
+	WCHAR szExe[MAX_PATH];
+	GetRepairBenchFormat(&wav);
+	const DWORD cbHeader = 12 + 8 + DS64_CHUNK_SIZE + 8 + sizeof(wav) + 8;
+
+	if (0 == GetModuleFileNameW(NULL, szExe, MAX_PATH)) {
+		printErrorDescription(HRESULT_FROM_WIN32(GetLastError()));
+		return;
+	}
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+	HANDLE hReady = CreateEvent(&sa, FALSE, FALSE, NULL);
+	if (hReady == NULL) {
+		printErrorDescription(HRESULT_FROM_WIN32(GetLastError()));
+		return;
+	}
+
+	printf("WAV repair check, writers killed after 50 to 800 ms\n");
+	srand(1);
+	for (DWORD iCase = 0; iCase < ARRAYSIZE(g_repairCases); iCase++) {
+		printf("  %s:\n", g_repairCases[iCase].szName);
+		for (DWORD iRun = 0; iRun < N_RUNS; iRun++) {
+			WCHAR szCommand[2 * MAX_PATH];
+			STARTUPINFOW si = { sizeof(si) };
+			PROCESS_INFORMATION pi;
+			DWORD msecKill = 50 + rand() % 751;
+			HRESULT hr = StringCchPrintfW(szCommand, ARRAYSIZE(szCommand),
+				L"\"%s\" -repairwriter %u %Iu %s", szExe, iCase,
+				(ULONG_PTR)hReady, szFileName);
+			if (FAILED(hr) || !CreateProcessW(NULL, szCommand, NULL, NULL,
+				TRUE, 0, NULL, NULL, &si, &pi)) {
+				printf("    cannot start the writer\n");
+				continue;
+			}
+			WaitForSingleObject(hReady, 10000);
+			Sleep(msecKill);
+			TerminateProcess(pi.hProcess, 1);
+			WaitForSingleObject(pi.hProcess, INFINITE);
+			CloseHandle(pi.hThread);
+			CloseHandle(pi.hProcess);
+
+			// What the writer left: the data size its last checkpoint
+			// wrote, and the frames that reached the file
+			BYTE header[cbHeader];
+			DWORD cbRead = 0;
+			LARGE_INTEGER fileSize = { 0 };
+			HANDLE hFile = CreateFileW(szFileName, GENERIC_READ,
+				FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+			if (hFile == INVALID_HANDLE_VALUE) {
+				printf("    no file left, FAILED\n");
+				continue;
+			}
+			ReadFile(hFile, header, cbHeader, &cbRead, NULL);
+			GetFileSizeEx(hFile, &fileSize);
+			CloseHandle(hFile);
+			ULONGLONG cbWritten =
+				CountRepairBenchFrames(szFileName, cbHeader) * wav.nBlockAlign;
+			ULONGLONG cbRepaired = 0;
+			hr = RepairWaveFile(szFileName, &cbRepaired);
+
+			// A write buffer holds the header until the first block is
+			// written, so a writer killed before then leaves nothing to
+			// repair
+			if (cbRead < cbHeader || *(DWORD *)header != FCC('RIFF')) {
+				BOOL bOk = hr == HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+				printf("    killed after %3u ms: no header yet, %s, %s\n",
+					msecKill, bOk ? "refused" : "not refused",
+					bOk ? "ok" : "FAILED");
+				DeleteFileW(szFileName);
+				continue;
+			}
+
+			// A kill in the middle of copying a piece into a mapped view
+			// can leave the end of the piece without the start, as the
+			// copy need not go in order.  Repair keeps the piece, hole
+			// and all.
+			ULONGLONG cbCheckpoint = *(DWORD *)(header + cbHeader - sizeof(DWORD));
+			ULONGLONG cbTorn = g_repairCases[iCase].bMapped ?
+				REPAIR_BENCH_MAX_FRAMES * wav.nBlockAlign : 0;
+			BOOL bOk = SUCCEEDED(hr) && cbRepaired >= cbWritten &&
+				cbRepaired <= cbWritten + cbTorn && cbRepaired >= cbCheckpoint &&
+				CheckWaveSizes(szFileName, cbHeader, cbRepaired, wav.nBlockAlign);
+			printf("    killed after %3u ms: %9I64u bytes in the file, "
+				"%9I64u checkpointed, %9I64u written, %9I64u repaired, %s\n",
+				msecKill, (ULONGLONG)fileSize.QuadPart - cbHeader, cbCheckpoint,
+				cbWritten, cbRepaired, bOk ? "ok" : "FAILED");
+			if (FAILED(hr)) {
+				printErrorDescription(hr);
+			}
+			DeleteFileW(szFileName);
+		}
+	}
+	CloseHandle(hReady);
+}
@@ -0,0 +1,162 @@
+//////////////////////////////////////////////////////////////////////////
+// waveFile.h: WAVE file writer
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+#include "sampleBuffers.h"
+
+// Default size of the write-coalescing buffer
+const DWORD WAVE_FILE_BLOCK_SIZE = 1024 * 1024;
+// Limits and alignment for the block size.  Blocks are a multiple of
+// the sector size so they can be written with FILE_FLAG_NO_BUFFERING.
+const DWORD WAVE_FILE_MIN_BLOCK_SIZE = 64 * 1024;
+const DWORD WAVE_FILE_MAX_BLOCK_SIZE = 8 * 1024 * 1024;
+const DWORD WAVE_FILE_SECTOR_SIZE = 4096;
+// Size of each view of the file in mapped mode.  A multiple of the
+// 64 KB allocation granularity, so views can start at any multiple.
+const DWORD WAVE_FILE_MAP_WINDOW = 16 * 1024 * 1024;
+// Least a mapped file grows by once the data passes what was allocated
+const ULONGLONG WAVE_FILE_MAP_GROWTH = 64 * 1024 * 1024;
+
+// Options for writing a WAVE file
+struct WaveFileOptions
+{
+    DWORD   cbBlockSize;        // Size of the write buffer.  0 writes each call directly.
+    BOOL    bUnbuffered;        // Bypass the system cache (FILE_FLAG_NO_BUFFERING).
+
+    // Header checkpoints.  The sizes in the header are brought up to
+    // date every msecCheckpoint milliseconds or cbCheckpoint bytes of
+    // audio data, whichever comes first.  0 disables either trigger.
+    DWORD       msecCheckpoint;
+    ULONGLONG   cbCheckpoint;
+    BOOL        bSyncCheckpoints;   // Flush data and header to disk at each checkpoint.
+
+    // Mapped mode.  The file is allocated up front for cbPreallocate
+    // bytes of audio data and the data is copied into mapped views of
+    // it instead of being written.  Replaces the write buffer and
+    // unbuffered writes.
+    BOOL        bMapped;
+    ULONGLONG   cbPreallocate;      // 0 allocates one view at a time.
+
+    WaveFileOptions() : cbBlockSize(WAVE_FILE_BLOCK_SIZE), bUnbuffered(FALSE),
+        msecCheckpoint(0), cbCheckpoint(0), bSyncCheckpoints(FALSE),
+        bMapped(FALSE), cbPreallocate(0)
+    {
+    }
+};
+
+// Writes a RIFF/WAVE file.  The header reserves room for an RF64 'ds64'
+// chunk (as a 'JUNK' chunk), so that if the data grows past what 32-bit
+// RIFF sizes can describe the file is converted to RF64 (EBU Tech 3306)
+// in place when it is closed.  Files under 4 GB remain plain WAVE files.
+//
+// Data is collected in a sector-aligned block and written a block at a
+// time, so the number of WriteFile calls does not depend on how small
+// the pieces passed to Write are.
+//
+// In mapped mode the file is instead extended to its expected size when
+// it is opened, so the file system can give it few, large extents, and
+// Write copies straight into a mapped window of the file.  The unused
+// allocation is cut off by Close.  A recording cut off in this mode
+// leaves the allocation behind, zeroed; checkpoints keep the header
+// correct in the meantime.
+class WaveFile
+{
+public:
+    WaveFile();
+    ~WaveFile();
+
+    void    SetOptions(const WaveFileOptions &options);
+    HRESULT Open(const WCHAR *szFileName, const WAVEFORMATEX *pWav, DWORD cbFormat);
+    HRESULT Write(const void *pData, DWORD cbData);
+    // Writes the segments in order as one piece of data.  Without a
+    // write buffer, each goes straight to the file.
+    HRESULT WriteSegments(const BufferSegment *pSegments, DWORD nSegments);
+    HRESULT Close();
+
+    BOOL        IsOpen() const { return m_hFile != INVALID_HANDLE_VALUE; }
+    BOOL        IsRF64() const { return m_bRF64; }
+    DWORD       HeaderSize() const { return m_cbHeader; }
+    DWORD       BlockAlign() const { return m_nBlockAlign; }
+    ULONGLONG   DataSize() const { return m_cbAudioData; }
+    DWORD       WriteCount() const { return m_cWrites; }
+    ULONGLONG   CopiedSize() const { return m_cbCopied; }
+    DWORD       CheckpointCount() const { return m_cCheckpoints; }
+    BOOL        IsMapped() const { return m_options.bMapped; }
+    DWORD       MapCount() const { return m_cMaps; }
+    DWORD       ExtendCount() const { return m_cExtends; }
+
+private:
+    HRESULT WriteHeader(const WAVEFORMATEX *pWav, DWORD cbFormat);
+    HRESULT FixUpChunkSizes();
+    HRESULT Checkpoint();
+    BOOL    CheckpointDue() const;
+    HRESULT Append(const void *buf, DWORD count);
+    HRESULT FlushBlock();
+    HRESULT FinishUnbuffered();
+    HRESULT WriteToFile(const void *buf, DWORD count);
+    void    FreeBlock();
+    HRESULT AppendMapped(const void *buf, DWORD count);
+    HRESULT ExtendMapping(ULONGLONG cbFile);
+    HRESULT MapView(ULONGLONG offset);
+    void    UnmapFile();
+    HRESULT FinishMapped();
+
+    HANDLE      m_hFile;
+    HANDLE      m_hHeaderFile;      // Second handle used for checkpoints.
+    WCHAR       m_szFileName[MAX_PATH];
+    WaveFileOptions m_options;
+
+    BYTE        *m_pBlock;          // Write buffer, NULL when writing directly.
+    DWORD       m_cbBlock;          // Size of the write buffer.
+    DWORD       m_cbBlockUsed;      // Bytes waiting in the write buffer.
+    ULONGLONG   m_cbFile;           // Bytes in the file, including the buffer.
+    DWORD       m_cWrites;          // Number of WriteFile calls.
+    ULONGLONG   m_cbCopied;         // Bytes copied into the buffer or view.
+
+    ULONGLONG   m_cbLastCheckpoint; // Audio data size at the last checkpoint.
+    ULONGLONG   m_tLastCheckpoint;  // Tick count at the last checkpoint.
+    DWORD       m_cCheckpoints;
+
+    DWORD       m_cbHeader;         // Size of everything before the audio data.
+    DWORD       m_nBlockAlign;      // Audio frame size, in bytes.
+    ULONGLONG   m_cbAudioData;      // Bytes of audio data written so far.
+    BOOL        m_bRF64;            // Set when the header was written as RF64.
+
+    HANDLE      m_hMapping;         // Mapped mode only
+    BYTE        *m_pView;
+    ULONGLONG   m_cbViewOffset;     // File offset of the view.
+    DWORD       m_cbView;
+    ULONGLONG   m_cbAllocated;      // File size, including the unused allocation.
+    DWORD       m_cMaps;            // Views mapped.
+    DWORD       m_cExtends;         // Times the file outgrew its allocation.
+};
+
+// Repairs the header of a WAVE file whose recording was cut off.  The
+// audio runs to the end of the file in whole frames.  A zeroed tail
+// past the checkpointed size, left by mapped or preallocated writing,
+// is cut off.
+HRESULT RepairWaveFile(
+                       const WCHAR *szFileName,    // File to repair.
+                       ULONGLONG *pcbAudioData     // Receives the recovered data size.
+                       );
+
+// Writes the same data through each of the write modes and prints the
+// throughput, page faults and number of file extents for each.
+void benchmarkWaveFile(void);
+
+// Repairs sparse files either side of the 4 GB RIFF limit and checks
+// the RIFF or RF64 sizes in each header.
+void benchmarkRF64(void);
+
+// Writes the same pieces with and without write coalescing, and checks
+// the number of WriteFile calls and that the files match.
+void benchmarkWriteCoalescing(void);
+
+// Kills a process writing a WAVE file partway through, in each write
+// mode, and checks that RepairWaveFile recovers what reached the file.
+// runRepairBenchWriter is the process it kills.
+void benchmarkRepair(void);
+int runRepairBenchWriter(DWORD iCase, HANDLE hReady, const WCHAR *szFileName);
@@ -0,0 +1,656 @@
+#include "stdafx.h"
+#include "waveSegments.h"
+#include "mfUtils.h"
+
+SegmentedWaveFile::SegmentedWaveFile() :
+m_hManifest(INVALID_HANDLE_VALUE),
+m_pFormat(NULL),
+m_cbFormat(0),
+m_cbSegment(0),
+m_iSegment(0),
+m_iFirstFrame(0),
+m_cbAudioData(0),
+m_hThread(NULL),
+m_hWork(NULL),
+m_hIdle(NULL),
+m_bStop(FALSE),
+m_bCloseWork(FALSE),
+m_iClosing(0),
+m_iClosingFrame(0),
+m_bOpenWork(FALSE),
+m_hrWork(S_OK),
+m_qpcRotationMax(0),
+m_qpcRotationTotal(0),
+m_cRotations(0),
+m_cStalls(0)
+{
+	m_szStem[0] = L'\0';
+	m_szExtension[0] = L'\0';
+	m_szManifest[0] = L'\0';
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	m_qpcFrequency = freq.QuadPart;
+}
+
+SegmentedWaveFile::~SegmentedWaveFile()
+{
+	Close();
+}
+
+// Sets the options for each file and when to start the next.  Takes
+// effect at the next Open.
+void SegmentedWaveFile::SetOptions(const WaveFileOptions &options,
+								   const SegmentOptions &segments)
+{
+	m_waveOptions = options;
+	m_options = segments;
+}
+
+// Opens the first segment and starts the worker opening the second.
+// szFileName is the name of the recording; the segments and the
+// manifest are named after it.
+HRESULT SegmentedWaveFile::Open(
+								const WCHAR *szFileName,    // Name of the recording.
+								const WAVEFORMATEX *pWav,   // The audio format.
+								DWORD cbFormat              // Size of the format, in bytes.
+								)
+{
+	if (IsOpen()) {
+		return E_UNEXPECTED;
+	}
+	if (pWav->nBlockAlign == 0) {
+		return E_INVALIDARG;
+	}
+
+	// Split the name around the extension
+	HRESULT hr = StringCchCopyW(m_szStem, MAX_PATH, szFileName);
+	if (SUCCEEDED(hr)) {
+		WCHAR *pExtension = PathFindExtensionW(m_szStem);
+		hr = StringCchCopyW(m_szExtension, MAX_PATH, pExtension);
+		*pExtension = L'\0';
+	}
+	if (SUCCEEDED(hr)) {
+		hr = StringCchPrintfW(m_szManifest, MAX_PATH, L"%s.segments.txt",
+			m_szStem);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// The segment size is whichever limit is smaller, in whole frames
+	ULONGLONG cbSegment = m_options.cbSegment;
+	if (m_options.msecSegment != 0) {
+		ULONGLONG cbTime = (ULONGLONG)pWav->nAvgBytesPerSec *
+			m_options.msecSegment / 1000;
+		if (cbSegment == 0 || cbTime < cbSegment) {
+			cbSegment = cbTime;
+		}
+	}
+	if (cbSegment == 0) {
+		cbSegment = MAXULONGLONG;
+	}
+	m_cbSegment = max(cbSegment / pWav->nBlockAlign * pWav->nBlockAlign,
+		(ULONGLONG)pWav->nBlockAlign);
+
+	m_pFormat = (WAVEFORMATEX *)new (std::nothrow) BYTE[cbFormat];
+	if (m_pFormat == NULL) {
+		return E_OUTOFMEMORY;
+	}
+	CopyMemory(m_pFormat, pWav, cbFormat);
+	m_cbFormat = cbFormat;
+
+	// Mapped files are allocated for no more than one segment
+	WaveFileOptions options = m_waveOptions;
+	if (options.bMapped &&
+		(options.cbPreallocate == 0 || options.cbPreallocate > m_cbSegment)) {
+		options.cbPreallocate = m_cbSegment;
+	}
+	for (UINT32 i = 0; i < SEGMENT_FILES; i++) {
+		m_files[i].SetOptions(options);
+	}
+
+	m_iSegment = 0;
+	m_iFirstFrame = 0;
+	m_cbAudioData = 0;
+	m_hrWork = S_OK;
+	m_qpcRotationMax = 0;
+	m_qpcRotationTotal = 0;
+	m_cRotations = 0;
+	m_cStalls = 0;
+
+	m_hManifest = CreateFileW(m_szManifest, GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hManifest == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		const char szHeader[] = "segment\tfile\tfirst_frame\tframes\tbytes\r\n";
+		DWORD cbWritten = 0;
+		if (!WriteFile(m_hManifest, szHeader, sizeof(szHeader) - 1,
+			&cbWritten, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		hr = OpenSegment(0);
+	}
+
+	// Start the worker on the second segment
+	if (SUCCEEDED(hr)) {
+		m_hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_hIdle = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hWork == NULL || m_hIdle == NULL) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		m_bStop = FALSE;
+		m_bCloseWork = FALSE;
+		m_bOpenWork = TRUE;
+		m_hThread = (HANDLE)_beginthreadex(NULL, 0, WorkerThreadProc, this,
+			0, NULL);
+		if (m_hThread == NULL) {
+			hr = E_FAIL;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		SetEvent(m_hWork);
+	} else {
+		Free();
+	}
+	return hr;
+}
+
+// Writes audio data, which must be whole frames, moving on to the next
+// segment whenever one is full.
+HRESULT SegmentedWaveFile::Write(const void *pData, DWORD cbData)
+{
+	const BYTE *pBytes = (const BYTE *)pData;
+	HRESULT hr = S_OK;
+
+	while (cbData > 0 && SUCCEEDED(hr)) {
+		WaveFile *pFile = &m_files[m_iSegment % SEGMENT_FILES];
+
+		// Move on only when there is more to write, so that the last
+		// segment is never empty
+		if (pFile->DataSize() >= m_cbSegment) {
+			hr = Rotate();
+			continue;
+		}
+
+		DWORD cbWrite = (DWORD)min((ULONGLONG)cbData,
+			m_cbSegment - pFile->DataSize());
+		hr = pFile->Write(pBytes, cbWrite);
+		pBytes += cbWrite;
+		cbData -= cbWrite;
+		m_cbAudioData += cbWrite;
+	}
+	return hr;
+}
+
+HRESULT SegmentedWaveFile::WriteSegments(const BufferSegment *pSegments,
+										 DWORD nSegments)
+{
+	HRESULT hr = S_OK;
+	for (DWORD i = 0; i < nSegments && SUCCEEDED(hr); i++) {
+		hr = Write(pSegments[i].pData, pSegments[i].cbData);
+	}
+	return hr;
+}
+
+// Waits for the worker, closes the last segment, and removes the
+// segment the worker opened in advance.
+HRESULT SegmentedWaveFile::Close()
+{
+	if (!IsOpen()) {
+		return S_OK;
+	}
+
+	HRESULT hr = S_OK;
+
+	// There is always one piece of work outstanding
+	if (m_hThread) {
+		WaitForSingleObject(m_hIdle, INFINITE);
+		hr = m_hrWork;
+	}
+
+	HRESULT hrClose = CloseSegment(m_iSegment, m_iFirstFrame);
+	if (SUCCEEDED(hr)) {
+		hr = hrClose;
+	}
+
+	UINT32 iNext = m_iSegment + 1;
+	if (m_files[iNext % SEGMENT_FILES].IsOpen()) {
+		WCHAR szName[MAX_PATH];
+		m_files[iNext % SEGMENT_FILES].Close();
+		GetSegmentName(iNext, szName);
+		DeleteFileW(szName);
+	}
+
+	Free();
+	return hr;
+}
+
+// Stops the worker and releases everything.  Files still open are
+// closed as they are.
+void SegmentedWaveFile::Free()
+{
+	if (m_hThread) {
+		m_bStop = TRUE;
+		SetEvent(m_hWork);
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = NULL;
+	}
+	if (m_hWork) {
+		CloseHandle(m_hWork);
+		m_hWork = NULL;
+	}
+	if (m_hIdle) {
+		CloseHandle(m_hIdle);
+		m_hIdle = NULL;
+	}
+	for (UINT32 i = 0; i < SEGMENT_FILES; i++) {
+		m_files[i].Close();
+	}
+	if (m_hManifest != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hManifest);
+		m_hManifest = INVALID_HANDLE_VALUE;
+	}
+	delete [] (BYTE *)m_pFormat;
+	m_pFormat = NULL;
+}
+
+// Switches to the next segment, which the worker has already opened,
+// and hands the full one to the worker to close.
+HRESULT SegmentedWaveFile::Rotate()
+{
+	LARGE_INTEGER tStart, tEnd;
+	QueryPerformanceCounter(&tStart);
+
+	// The worker normally finished long ago
+	if (WaitForSingleObject(m_hIdle, 0) != WAIT_OBJECT_0) {
+		m_cStalls++;
+		WaitForSingleObject(m_hIdle, INFINITE);
+	}
+	if (FAILED(m_hrWork)) {
+		// Signal the idle event again for Close
+		SetEvent(m_hIdle);
+		return m_hrWork;
+	}
+
+	m_iClosing = m_iSegment;
+	m_iClosingFrame = m_iFirstFrame;
+	m_iFirstFrame += m_files[m_iSegment % SEGMENT_FILES].DataSize() /
+		m_pFormat->nBlockAlign;
+	m_iSegment++;
+	m_bCloseWork = TRUE;
+	m_bOpenWork = TRUE;
+	SetEvent(m_hWork);
+
+	QueryPerformanceCounter(&tEnd);
+	LONGLONG qpc = tEnd.QuadPart - tStart.QuadPart;
+	m_qpcRotationMax = max(m_qpcRotationMax, qpc);
+	m_qpcRotationTotal += qpc;
+	m_cRotations++;
+	return S_OK;
+}
+
+// Opens the file for segment iSegment, which is not in use
+HRESULT SegmentedWaveFile::OpenSegment(UINT32 iSegment)
+{
+	WCHAR szName[MAX_PATH];
+	GetSegmentName(iSegment, szName);
+	return m_files[iSegment % SEGMENT_FILES].Open(szName, m_pFormat,
+		m_cbFormat);
+}
+
+// Closes the file for segment iSegment and lists it in the manifest
+HRESULT SegmentedWaveFile::CloseSegment(UINT32 iSegment, ULONGLONG iFirstFrame)
+{
+	WaveFile *pFile = &m_files[iSegment % SEGMENT_FILES];
+	ULONGLONG cbData = pFile->DataSize();
+	HRESULT hr = pFile->Close();
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	WCHAR szName[MAX_PATH];
+	char szLine[MAX_PATH + 128];
+	DWORD cbWritten = 0;
+	GetSegmentName(iSegment, szName);
+	hr = StringCchPrintfA(szLine, ARRAYSIZE(szLine),
+		"%u\t%S\t%I64u\t%I64u\t%I64u\r\n", iSegment,
+		PathFindFileNameW(szName), iFirstFrame,
+		cbData / m_pFormat->nBlockAlign, cbData);
+	if (SUCCEEDED(hr) &&
+		!WriteFile(m_hManifest, szLine, (DWORD)strlen(szLine), &cbWritten, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	return hr;
+}
+
+void SegmentedWaveFile::GetSegmentName(UINT32 iSegment, WCHAR *szName) const
+{
+	StringCchPrintfW(szName, MAX_PATH, L"%s-%05u%s", m_szStem, iSegment,
+		m_szExtension);
+}
+
+// Runs the work Rotate hands over: opening the segment after the
+// current one first, since the next rotation needs it, then closing
+// the one just finished.
+unsigned __stdcall SegmentedWaveFile::WorkerThreadProc(void *pContext)
+{
+	SegmentedWaveFile *pFile = (SegmentedWaveFile *)pContext;
+
+	while (TRUE) {
+		WaitForSingleObject(pFile->m_hWork, INFINITE);
+		if (pFile->m_bStop) {
+			break;
+		}
+
+		HRESULT hr = S_OK;
+		if (pFile->m_bOpenWork) {
+			hr = pFile->OpenSegment(pFile->m_iSegment + 1);
+			pFile->m_bOpenWork = FALSE;
+		}
+		if (pFile->m_bCloseWork) {
+			HRESULT hrClose = pFile->CloseSegment(pFile->m_iClosing,
+				pFile->m_iClosingFrame);
+			if (SUCCEEDED(hr)) {
+				hr = hrClose;
+			}
+			pFile->m_bCloseWork = FALSE;
+		}
+		if (FAILED(hr) && SUCCEEDED(pFile->m_hrWork)) {
+			pFile->m_hrWork = hr;
+		}
+		SetEvent(pFile->m_hIdle);
+	}
+	return 0;
+}
+
+double SegmentedWaveFile::MaxRotationMsec() const
+{
+	return 1000.0 * m_qpcRotationMax / m_qpcFrequency;
+}
+
+double SegmentedWaveFile::AverageRotationMsec() const
+{
+	if (m_cRotations == 0) {
+		return 0;
+	}
+	return 1000.0 * m_qpcRotationTotal / m_cRotations / m_qpcFrequency;
+}
+
+// The byte at offset n of the recording the check writes
+static BYTE CheckByte(ULONGLONG n)
+{
+	return (BYTE)(n ^ (n >> 8) ^ (n >> 16));
+}
+
+// Reads a whole file into a new buffer, which the caller deletes
+static HRESULT ReadWholeFile(const WCHAR *szName, BYTE **ppData, DWORD *pcbData)
+{
+	HRESULT hr = S_OK;
+	LARGE_INTEGER size;
+	DWORD cbRead = 0;
+	*ppData = NULL;
+	*pcbData = 0;
+
+	HANDLE hFile = CreateFileW(szName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (!GetFileSizeEx(hFile, &size)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	} else if (size.QuadPart > MAXDWORD) {
+		hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppData = new (std::nothrow) BYTE[(DWORD)size.QuadPart + 1];
+		if (*ppData == NULL) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	if (SUCCEEDED(hr) &&
+		(!ReadFile(hFile, *ppData, (DWORD)size.QuadPart, &cbRead, NULL) ||
+		cbRead != (DWORD)size.QuadPart)) {
+		hr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+	}
+	CloseHandle(hFile);
+	if (FAILED(hr)) {
+		delete [] *ppData;
+		*ppData = NULL;
+		return hr;
+	}
+	(*ppData)[cbRead] = 0;
+	*pcbData = cbRead;
+	return S_OK;
+}
+
+// Reads back the segments and the manifest of a closed recording of
+// cbTotal bytes of CheckByte.  The 'data' chunks joined in order must
+// be the recording, and each manifest line must give the segment's
+// first frame, frame count and size.  Prints the first difference.
+static BOOL CheckJoinedSegments(
+								const SegmentedWaveFile &file,  // The closed recording.
+								UINT32 nSegments,               // Segments it was split into.
+								ULONGLONG cbTotal,              // Bytes written.
+								DWORD cbFrame                   // Size of a frame.
+								)
+{
+	BYTE *pManifest = NULL;
+	DWORD cbManifest = 0;
+	if (FAILED(ReadWholeFile(file.ManifestName(), &pManifest, &cbManifest))) {
+		printf("    cannot read the manifest\n");
+		return FALSE;
+	}
+
+	BOOL bOk = TRUE;
+	ULONGLONG cbJoined = 0;
+	const char *pLine = (const char *)pManifest;
+	for (UINT32 i = 0; i < nSegments && bOk; i++) {
+		// <index> <name> <first frame> <frames> <bytes>
+		const char *pName = strchr(pLine, '\t');
+		const char *pFirst = pName ? strchr(pName + 1, '\t') : NULL;
+		if (pFirst == NULL || strtoul(pLine, NULL, 10) != i) {
+			printf("    manifest line %u is missing\n", i);
+			bOk = FALSE;
+			break;
+		}
+		char *pEnd = NULL;
+		ULONGLONG iFirstFrame = _strtoui64(pFirst + 1, &pEnd, 10);
+		ULONGLONG nFrames = _strtoui64(pEnd, &pEnd, 10);
+		ULONGLONG cbData = _strtoui64(pEnd, &pEnd, 10);
+		pLine = strchr(pEnd, '\n');
+		pLine = pLine ? pLine + 1 : pEnd;
+		if (iFirstFrame * cbFrame != cbJoined || nFrames * cbFrame != cbData) {
+			printf("    manifest line %u gives frames %I64u+%I64u, %I64u bytes, "
+				"at frame %I64u\n", i, iFirstFrame, nFrames, cbData,
+				cbJoined / cbFrame);
+			bOk = FALSE;
+			break;
+		}
+
+		// Find the 'data' chunk of the segment and compare it
+		WCHAR szName[MAX_PATH];
+		BYTE *pFile = NULL;
+		DWORD cbFile = 0;
+		DWORD pos = 12;
+		file.GetSegmentName(i, szName);
+		if (FAILED(ReadWholeFile(szName, &pFile, &cbFile))) {
+			printf("    cannot read segment %u\n", i);
+			bOk = FALSE;
+			break;
+		}
+		while (pos + 8 <= cbFile && *(DWORD *)(pFile + pos) != FCC('data')) {
+			DWORD cksize = *(DWORD *)(pFile + pos + 4);
+			pos += 8 + cksize + (cksize & 1);
+		}
+		if (pos + 8 > cbFile || *(DWORD *)(pFile + pos + 4) != cbData ||
+			pos + 8 + cbData > cbFile) {
+			printf("    segment %u has no 'data' chunk of %I64u bytes\n", i, cbData);
+			bOk = FALSE;
+		}
+		for (DWORD j = 0; bOk && j < (DWORD)cbData; j++) {
+			if (pFile[pos + 8 + j] != CheckByte(cbJoined + j)) {
+				printf("    segment %u differs at byte %I64u of the recording\n",
+					i, cbJoined + j);
+				bOk = FALSE;
+			}
+		}
+		delete [] pFile;
+		cbJoined += cbData;
+	}
+	if (bOk && cbJoined != cbTotal) {
+		printf("    segments hold %I64u of %I64u bytes\n", cbJoined, cbTotal);
+		bOk = FALSE;
+	}
+	delete [] pManifest;
+	return bOk;
+}
+
+// Writes the check pattern in packets of changing frame counts, so the
+// splits fall in different places in each packet, and checks that the
+// segments join up to it again
+static void checkWaveSegments(const WCHAR *szFileName, const WAVEFORMATEX &wav)
+{
+	const DWORD MSEC_TOTAL = 10 * 1000;
+	const DWORD MAX_PACKET_FRAMES = 997;
+
+	BYTE *pPacket = new (std::nothrow) BYTE[MAX_PACKET_FRAMES * wav.nBlockAlign];
+	if (pPacket == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+
+	printf("Joined segments check, %u sec of audio in packets of 1 to %u frames\n",
+		MSEC_TOTAL / 1000, MAX_PACKET_FRAMES);
+	for (int iMode = 0; iMode < 2; iMode++) {
+		WaveFileOptions options;
+		options.bMapped = (iMode == 1);
+		SegmentOptions segments;
+		segments.msecSegment = 100;
+
+		SegmentedWaveFile file;
+		file.SetOptions(options, segments);
+		HRESULT hr = file.Open(szFileName, &wav, sizeof(wav));
+		ULONGLONG cbTotal = (ULONGLONG)wav.nAvgBytesPerSec * MSEC_TOTAL / 1000;
+		ULONGLONG cbWritten = 0;
+		for (UINT32 iPacket = 0; cbWritten < cbTotal && SUCCEEDED(hr); iPacket++) {
+			DWORD cbPacket = (1 + iPacket * 131 % MAX_PACKET_FRAMES) *
+				wav.nBlockAlign;
+			cbPacket = (DWORD)min((ULONGLONG)cbPacket, cbTotal - cbWritten);
+			for (DWORD i = 0; i < cbPacket; i++) {
+				pPacket[i] = CheckByte(cbWritten + i);
+			}
+			hr = file.Write(pPacket, cbPacket);
+			cbWritten += cbPacket;
+		}
+		UINT32 nSegments = file.SegmentCount();
+		if (SUCCEEDED(hr)) {
+			hr = file.Close();
+		}
+
+		BOOL bOk = SUCCEEDED(hr) &&
+			CheckJoinedSegments(file, nSegments, cbWritten, wav.nBlockAlign);
+		if (FAILED(hr)) {
+			printErrorDescription(hr);
+		}
+		printf("  %-8s %u segments: %s\n", options.bMapped ? "mapped" : "buffered",
+			nSegments, bOk ? "ok" : "FAILED");
+
+		for (UINT32 i = 0; i <= nSegments; i++) {
+			WCHAR szName[MAX_PATH];
+			file.GetSegmentName(i, szName);
+			DeleteFileW(szName);
+		}
+		DeleteFileW(file.ManifestName());
+	}
+	delete [] pPacket;
+}
+
+void benchmarkWaveSegments(void) {
+	const DWORD MSEC_TOTAL = 60 * 1000;
+	const DWORD MSEC_PACKET = 10;
+	const DWORD segmentLengths[] = { 1000, 100, 20 };
+	const WCHAR *szFileName = L"WaveSegmentsBench.wav";
+
+	WAVEFORMATEX wav;
+	ZeroMemory(&wav, sizeof(wav));
+	wav.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+	wav.nChannels = 2;
+	wav.nSamplesPerSec = 48000;
+	wav.wBitsPerSample = 32;
+	wav.nBlockAlign = 8;
+	wav.nAvgBytesPerSec = 48000 * 8;
+
+	// One packet of noise, written over and over
+	DWORD cbPacket = wav.nAvgBytesPerSec / 1000 * MSEC_PACKET;
+	BYTE *pPacket = new (std::nothrow) BYTE[cbPacket];
+	if (pPacket == NULL) {
+		printf("Out of memory\n");
+		return;
+	}
+	srand(1);
+	for (DWORD i = 0; i < cbPacket; i++) {
+		pPacket[i] = (BYTE)rand();
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Segment rotation benchmark, %u sec of audio in %u ms packets\n",
+		MSEC_TOTAL / 1000, MSEC_PACKET);
+	for (int iMode = 0; iMode < 2; iMode++) {
+		for (int iLength = 0; iLength < sizeof(segmentLengths) / sizeof(segmentLengths[0]); iLength++) {
+			WaveFileOptions options;
+			options.bMapped = (iMode == 1);
+			SegmentOptions segments;
+			segments.msecSegment = segmentLengths[iLength];
+
+			LARGE_INTEGER tStart, tEnd;
+			QueryPerformanceCounter(&tStart);
+
+			SegmentedWaveFile file;
+			file.SetOptions(options, segments);
+			HRESULT hr = file.Open(szFileName, &wav, sizeof(wav));
+			for (DWORD msec = 0; msec < MSEC_TOTAL && SUCCEEDED(hr);
+				msec += MSEC_PACKET) {
+				hr = file.Write(pPacket, cbPacket);
+			}
+			UINT32 nSegments = file.SegmentCount();
+			if (SUCCEEDED(hr)) {
+				hr = file.Close();
+			}
+			QueryPerformanceCounter(&tEnd);
+
+			// Remove the segments and the manifest
+			for (UINT32 i = 0; i <= nSegments; i++) {
+				WCHAR szName[MAX_PATH];
+				file.GetSegmentName(i, szName);
+				DeleteFileW(szName);
+			}
+			DeleteFileW(file.ManifestName());
+
+			if (FAILED(hr)) {
+				printf("  %s, %4u ms segments failed\n",
+					options.bMapped ? "mapped" : "buffered", segments.msecSegment);
+				printErrorDescription(hr);
+				continue;
+			}
+			double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+			printf("  %-8s %4u ms segments: %5u files in %6.2f sec, "
+				"switch avg %.3f ms, max %.3f ms, %u stalls\n",
+				options.bMapped ? "mapped" : "buffered", segments.msecSegment,
+				nSegments, seconds, file.AverageRotationMsec(),
+				file.MaxRotationMsec(), file.StallCount());
+		}
+	}
+	delete [] pPacket;
+
+	checkWaveSegments(szFileName, wav);
+}
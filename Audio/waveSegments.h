@@ -0,0 +1,109 @@
+//////////////////////////////////////////////////////////////////////////
+// waveSegments.h: WAVE output split across a series of files
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+#include "waveFile.h"
+
+// When to start a new file.  Whichever limit is reached first applies.
+struct SegmentOptions
+{
+    DWORD       msecSegment;        // Length of each file, 0 for no limit.
+    ULONGLONG   cbSegment;          // Audio data in each file, 0 for no limit.
+
+    SegmentOptions() : msecSegment(0), cbSegment(0)
+    {
+    }
+
+    BOOL IsEnabled() const { return msecSegment != 0 || cbSegment != 0; }
+};
+
+// Writes one stream of audio as numbered WAVE files, <name>-00000.wav,
+// <name>-00001.wav and so on, each holding SegmentSize() bytes of audio
+// data except the last.  Files are split on audio frame boundaries, so
+// the segments joined end to end are the whole recording.
+//
+// Opening a file and fixing up its header are the slow parts of
+// rotating, so a worker thread does both: it opens the next segment
+// while the current one is being written, and closes each finished
+// one after Write has moved on.  Write itself only swaps to the file
+// that is already open, and waits only if the worker has fallen a
+// whole segment behind.
+//
+// Each closed segment is listed in <name>.segments.txt with its first
+// audio frame in the recording, its frame count and its size.
+class SegmentedWaveFile
+{
+public:
+    SegmentedWaveFile();
+    ~SegmentedWaveFile();
+
+    void    SetOptions(const WaveFileOptions &options, const SegmentOptions &segments);
+    HRESULT Open(const WCHAR *szFileName, const WAVEFORMATEX *pWav, DWORD cbFormat);
+    HRESULT Write(const void *pData, DWORD cbData);
+    HRESULT WriteSegments(const BufferSegment *pSegments, DWORD nSegments);
+    HRESULT Close();
+
+    BOOL        IsOpen() const { return m_pFormat != NULL; }
+    ULONGLONG   SegmentSize() const { return m_cbSegment; }
+    ULONGLONG   DataSize() const { return m_cbAudioData; }
+    UINT32      SegmentCount() const { return m_iSegment + 1; }
+    const WCHAR *ManifestName() const { return m_szManifest; }
+    // Name of segment iSegment; szName holds MAX_PATH characters
+    void        GetSegmentName(UINT32 iSegment, WCHAR *szName) const;
+
+    // Time Write spent switching files, in milliseconds, and the number
+    // of switches that had to wait for the worker
+    double      MaxRotationMsec() const;
+    double      AverageRotationMsec() const;
+    UINT32      StallCount() const { return m_cStalls; }
+
+private:
+    // Files in use: the one being written, the next one, and the one
+    // being closed.  Segment i is written to m_files[i % 3].
+    static const UINT32 SEGMENT_FILES = 3;
+
+    static unsigned __stdcall WorkerThreadProc(void *pContext);
+    HRESULT Rotate();
+    HRESULT OpenSegment(UINT32 iSegment);
+    HRESULT CloseSegment(UINT32 iSegment, ULONGLONG iFirstFrame);
+    void    Free();
+
+    WaveFileOptions m_waveOptions;
+    SegmentOptions  m_options;
+    WCHAR       m_szStem[MAX_PATH];     // File name without the extension
+    WCHAR       m_szExtension[MAX_PATH];
+    WCHAR       m_szManifest[MAX_PATH];
+    HANDLE      m_hManifest;
+    WAVEFORMATEX *m_pFormat;            // Copy of the format, for each segment
+    DWORD       m_cbFormat;
+    ULONGLONG   m_cbSegment;
+
+    WaveFile    m_files[SEGMENT_FILES];
+    UINT32      m_iSegment;             // Segment being written
+    ULONGLONG   m_iFirstFrame;          // Its first audio frame
+    ULONGLONG   m_cbAudioData;
+
+    // Work for the worker thread, handed over while it is idle
+    HANDLE      m_hThread;
+    HANDLE      m_hWork;                // Signaled to start the work
+    HANDLE      m_hIdle;                // Signaled when the work is done
+    volatile BOOL m_bStop;
+    BOOL        m_bCloseWork;           // Close segment m_iClosing
+    UINT32      m_iClosing;
+    ULONGLONG   m_iClosingFrame;
+    BOOL        m_bOpenWork;            // Open segment m_iSegment + 1
+    HRESULT     m_hrWork;               // First failure of the worker
+
+    LONGLONG    m_qpcFrequency;
+    LONGLONG    m_qpcRotationMax;
+    LONGLONG    m_qpcRotationTotal;
+    UINT32      m_cRotations;
+    UINT32      m_cStalls;
+};
+
+// Writes synthetic audio through SegmentedWaveFile at short segment
+// lengths and prints the time taken to switch files.
+void benchmarkWaveSegments(void);
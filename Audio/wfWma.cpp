@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "mfWma.h"
 #include "mfRoutines.h"
+#include "pipelineQueue.h"
+#include "resampler.h"
 
 struct EncodingParameters
 {
@@ -163,16 +165,14 @@ HRESULT ConfigureEncoder(
 	for(UINT32 i=0; i < count; i++) {
 		hr = pReaderType->GetItemByIndex(i, &guid, &propVariant);
 		if(FAILED(hr)) {
-			debugMsg(_T("ConfigureEncoder: ")
-				_T("GetItemByIndex failed for index %d (0x%08X)\n"), i);
-			ShowMessage(hr, szDebugString);
+			ShowMessage(hr, _T("ConfigureEncoder: ")
+				_T("GetItemByIndex failed for index %d"), i);
 			goto DONE;
 		}
 		hr = CopyAttribute(pReaderType, pType2, guid);
 		if(FAILED(hr)) {
-			debugMsg(_T("ConfigureEncoder: ")
-				_T("CopyAttribute failed for index %d (0x%08X)\n"), i);
-			ShowMessage(hr, szDebugString);
+			ShowMessage(hr, _T("ConfigureEncoder: ")
+				_T("CopyAttribute failed for index %d"), i);
 			goto DONE;
 		}
 	}
@@ -193,46 +193,233 @@ DONE:
 	return hr;
 }
 
+// State shared by the read stage and the write stage of ReadSamples
+struct WmaPipeline
+{
+	IMFSinkWriter *pWriter;
+	DWORD sink_stream;
+	PipelineQueue queue;
+	Resampler *pResampler;      // Converts the rate before encoding, or NULL
+	LONGLONG llInputEnd;        // End time of the last sample, for the resampler
+	HRESULT hrWriter;           // First error from the write stage
+	LONGLONG nSamples;          // Samples written
+	LONGLONG nTicks;            // Stream ticks sent for gaps
+	double msecLatencySum;      // Time from read to written
+	double msecLatencyMax;
+	LARGE_INTEGER freq;
+};
+
+// Write stage.  Passes each sample to the sink writer, which encodes
+// it, until the queue is closed and empty.
+static unsigned __stdcall WmaWriterThreadProc(void *pv)
+{
+	WmaPipeline *pPipeline = (WmaPipeline *)pv;
+	PipelineItem item;
+	HRESULT hr = S_OK;
+
+	HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	while (pPipeline->queue.Pop(&item)) {
+		if (SUCCEEDED(pPipeline->hrWriter)) {
+			if (item.pSample && pPipeline->pResampler) {
+				IMFSample *pResampled = NULL;
+				LONGLONG llDuration = 0;
+				if (SUCCEEDED(item.pSample->GetSampleDuration(&llDuration))) {
+					pPipeline->llInputEnd = item.llTimestamp + llDuration;
+				}
+				hr = ResampleSample(pPipeline->pResampler, item.pSample,
+					&pResampled);
+				if (SUCCEEDED(hr) && pResampled) {
+					hr = pPipeline->pWriter->WriteSample(pPipeline->sink_stream,
+						pResampled);
+				}
+				SafeRelease(&pResampled);
+				pPipeline->nSamples++;
+			} else if (item.pSample) {
+				hr = pPipeline->pWriter->WriteSample(pPipeline->sink_stream,
+					item.pSample);
+				pPipeline->nSamples++;
+			} else {
+				hr = pPipeline->pWriter->SendStreamTick(pPipeline->sink_stream,
+					item.llTimestamp);
+				pPipeline->nTicks++;
+			}
+			if (FAILED(hr)) {
+				// Stop the read stage
+				pPipeline->hrWriter = hr;
+				pPipeline->queue.Close();
+			}
+
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			double msecLatency = (now.QuadPart - item.qpcRead) * 1000.0 /
+				pPipeline->freq.QuadPart;
+			pPipeline->msecLatencySum += msecLatency;
+			if (msecLatency > pPipeline->msecLatencyMax) {
+				pPipeline->msecLatencyMax = msecLatency;
+			}
+		}
+		SafeRelease(&item.pSample);
+	}
+
+	// Write the end of the audio the resampler was holding back
+	if (pPipeline->pResampler && SUCCEEDED(pPipeline->hrWriter)) {
+		IMFSample *pResampled = NULL;
+		hr = FlushResampler(pPipeline->pResampler, pPipeline->llInputEnd,
+			&pResampled);
+		if (SUCCEEDED(hr) && pResampled) {
+			hr = pPipeline->pWriter->WriteSample(pPipeline->sink_stream,
+				pResampled);
+		}
+		if (FAILED(hr)) {
+			pPipeline->hrWriter = hr;
+		}
+		SafeRelease(&pResampled);
+	}
+
+	if (SUCCEEDED(hrCom)) {
+		CoUninitialize();
+	}
+	return 0;
+}
+
+static ULONGLONG FileTimeToMsec(const FILETIME &ft)
+{
+	return (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000;
+}
+
+// CPU time used by the process so far, in msec
+static ULONGLONG GetProcessCpuMsec()
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit,
+		&ftKernel, &ftUser)) {
+		return 0;
+	}
+	return FileTimeToMsec(ftKernel) + FileTimeToMsec(ftUser);
+}
+
+// Reads samples on this thread and hands them to a writer thread
+// through a bounded queue, so reading the next sample overlaps with
+// encoding the last one.  ReadSample blocks until the source has
+// something, and gaps in the source are passed on as stream ticks.
+// When the encoder falls behind, the queue fills and the read stage
+// waits for it.
 HRESULT ReadSamples(IMFSourceReader *pReader, IMFSinkWriter *pWriter,
-					DWORD sink_stream, LONG msecAudioData)
+					DWORD sink_stream, LONG msecAudioData,
+					Resampler *pResampler)
 {
 	HRESULT hr = S_OK;
 	DWORD dwStreamFlags;
 	LONGLONG llTimestamp;
-	LONGLONG llBaseTime;
-	IMFSample *pSample;
+	LONGLONG llBaseTime = 0;
+	IMFSample *pSample = NULL;
+	HANDLE hWriterThread = NULL;
+	WmaPipeline pipeline;
+	PipelineQueueStats stats;
+	DWORD tStart = GetTickCount();
+	ULONGLONG msecCpuStart = GetProcessCpuMsec();
 
 	LONGLONG llEndTime = msecAudioData * 10000LL;
 
+	pipeline.pWriter = pWriter;
+	pipeline.sink_stream = sink_stream;
+	pipeline.pResampler = pResampler;
+	pipeline.llInputEnd = 0;
+	pipeline.hrWriter = S_OK;
+	pipeline.nSamples = 0;
+	pipeline.nTicks = 0;
+	pipeline.msecLatencySum = 0.0;
+	pipeline.msecLatencyMax = 0.0;
+	QueryPerformanceFrequency(&pipeline.freq);
+
+	hr = pipeline.queue.Initialize(PIPELINE_QUEUE_CAPACITY);
+	if (FAILED(hr)) { return hr; }
+
+	hWriterThread = (HANDLE)_beginthreadex(NULL, 0, WmaWriterThreadProc,
+		&pipeline, 0, NULL);
+	if (hWriterThread == NULL) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
 	BOOL first = TRUE;
 	while(TRUE) {
 		hr = pReader->ReadSample(
-			sink_stream,            // stream
+			(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, // stream
 			0,                      // control flags
 			NULL,   // actual
 			&dwStreamFlags,         // stream flags
 			&llTimestamp,           // timestamp
 			&pSample                // sample
 			);
-		if(!pSample) continue;
+		if (FAILED(hr)) { goto DONE; }
+		if (dwStreamFlags & MF_SOURCE_READERF_ERROR) {
+			hr = E_FAIL;
+			goto DONE;
+		}
+		if (dwStreamFlags & MF_SOURCE_READERF_ENDOFSTREAM) {
+			printf("End of stream.\n");
+			goto DONE;
+		}
+		BOOL bTick = (dwStreamFlags & MF_SOURCE_READERF_STREAMTICK) != 0;
+		if (!pSample && !bTick) continue;
+
 		if(first) {
 			first = FALSE;
 			llBaseTime = llTimestamp;
 		}
 		// Rebase the time stamp
 		llTimestamp -= llBaseTime;
-		hr = pSample->SetSampleTime(llTimestamp);
-		if (FAILED(hr)) { goto DONE; }
 
-		// Write the sample
-		hr = pWriter->WriteSample(0, pSample);
-		if (FAILED(hr)) { goto DONE; }
+		PipelineItem item;
+		item.pSample = pSample;
+		item.llTimestamp = llTimestamp;
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		item.qpcRead = now.QuadPart;
+		if (pSample) {
+			hr = pSample->SetSampleTime(llTimestamp);
+			if (FAILED(hr)) { goto DONE; }
+		}
+
+		// Hand it to the write stage, waiting if the queue is full.
+		// This fails only if the write stage has stopped.
+		if (!pipeline.queue.Push(item)) { goto DONE; }
+		SafeRelease(&pSample);
 
 		// Quit after the specified time
 		if(llTimestamp > llEndTime) break;
 	}
 
 DONE:
+	SafeRelease(&pSample);
+
+	// Let the write stage finish what is queued
+	pipeline.queue.Close();
+	WaitForSingleObject(hWriterThread, INFINITE);
+	CloseHandle(hWriterThread);
+	if (SUCCEEDED(hr)) {
+		hr = pipeline.hrWriter;
+	}
+
+	// Report how the pipeline did
+	DWORD msecElapsed = GetTickCount() - tStart;
+	ULONGLONG msecCpu = GetProcessCpuMsec() - msecCpuStart;
+	pipeline.queue.GetStats(&stats);
+	printf("Wrote %I64d samples and %I64d stream ticks.\n",
+		pipeline.nSamples, pipeline.nTicks);
+	if (pipeline.nSamples + pipeline.nTicks > 0) {
+		printf("Latency: average %.2f ms, max %.2f ms\n",
+			pipeline.msecLatencySum / (pipeline.nSamples + pipeline.nTicks),
+			pipeline.msecLatencyMax);
+	}
+	printf("Queue: high water %d of %d, reader waited %d times, "
+		"writer waited %d times\n", stats.nHighWater,
+		PIPELINE_QUEUE_CAPACITY, stats.nProducerWaits, stats.nConsumerWaits);
+	if (msecElapsed > 0) {
+		printf("CPU: %I64u ms in %u ms (%.1f%% of one core)\n", msecCpu,
+			msecElapsed, msecCpu * 100.0 / msecElapsed);
+	}
 	return hr;
 }
 
@@ -240,7 +427,8 @@ DONE:
 HRESULT WriteWmaFile(
 					 IMFSourceReader *pReader,   // Pointer to the source reader.
 					 WCHAR *szFileName,          // Name of the output file.
-					 LONG msecAudioData          // Maximum amount of audio data to write, in msec.
+					 LONG msecAudioData,         // Maximum amount of audio data to write, in msec.
+					 const ResampleOptions *pResample  // Rate to encode, NULL to keep the device rate.
 					 )
 {
 	HRESULT hr = S_OK;
@@ -249,7 +437,11 @@ HRESULT WriteWmaFile(
 	DWORD cbAudioData = 0;      // Total bytes of audio data written to the file.
 	DWORD cbMaxAudioData = 0;
 	IMFMediaType *pReaderType = NULL;    // Represents the reader audio format.
+	IMFMediaType *pEncoderType = NULL;   // The format passed to the encoder.
+	IMFSinkWriter *pWriter = NULL;
 	EncodingParameters params;
+	Resampler resampler;
+	Resampler *pResampler = NULL;
 
 	// Configure the source reader to get uncompressed audio from the source file.
 	hr = ConfigureWmfReader(pReader, &pReaderType);
@@ -258,8 +450,37 @@ HRESULT WriteWmaFile(
 		goto DONE;
 	}
 
+	// Set up the rate conversion, if the device rate is not the one
+	// wanted or its clock needs correcting
+	pEncoderType = pReaderType;
+	pEncoderType->AddRef();
+	if (pResample && pResample->nSampleRate != 0) {
+		UINT32 nInRate = MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_SAMPLES_PER_SECOND, 0);
+		UINT32 nChannels = MFGetAttributeUINT32(pReaderType,
+			MF_MT_AUDIO_NUM_CHANNELS, 0);
+		if (nInRate != pResample->nSampleRate || pResample->driftPpm != 0.0) {
+			hr = resampler.Initialize(nInRate, pResample->nSampleRate,
+				nChannels, pResample->quality);
+			if (SUCCEEDED(hr)) {
+				resampler.SetDrift(pResample->driftPpm);
+				SafeRelease(&pEncoderType);
+				hr = CreateResampledType(pReaderType, pResample->nSampleRate,
+					&pEncoderType);
+			}
+			if (FAILED(hr)) {
+				ShowMessage(hr, _T("Resampler setup failed"));
+				goto DONE;
+			}
+			pResampler = &resampler;
+			printf("Resampling %u Hz to %u Hz, %s quality, %u taps (%s)\n",
+				nInRate, pResample->nSampleRate,
+				Resampler::QualityName(pResample->quality), resampler.Taps(),
+				resampler.KernelName());
+		}
+	}
+
 	// Create the sink writer
-	IMFSinkWriter *pWriter;
 	hr = MFCreateSinkWriterFromURL(szFileName, NULL, NULL, &pWriter);
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("MFCreateSinkWriterFromURL failed"));
@@ -268,7 +489,7 @@ HRESULT WriteWmaFile(
 
 	params.subtype = MFAudioFormat_WMAudioV8;
 	params.bitrate = 240 * 1000;
-	hr = ConfigureEncoder(params, pReaderType, pWriter, &sink_stream);
+	hr = ConfigureEncoder(params, pEncoderType, pWriter, &sink_stream);
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("ConfigureEncoder failed"));
 		goto DONE;
@@ -281,7 +502,7 @@ HRESULT WriteWmaFile(
 	//	hr = WriteWaveData(hFile, pReader, cbMaxAudioData, &cbAudioData);
 	//}
 
-	hr = pWriter->SetInputMediaType(sink_stream, pReaderType, NULL);
+	hr = pWriter->SetInputMediaType(sink_stream, pEncoderType, NULL);
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("SetInputMediaType failed"));
 		goto DONE;
@@ -294,7 +515,7 @@ HRESULT WriteWmaFile(
 	}
 
 	// Loop over samples
-	hr = ReadSamples(pReader, pWriter, sink_stream, msecAudioData);
+	hr = ReadSamples(pReader, pWriter, sink_stream, msecAudioData, pResampler);
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("ReadSamples failed"));
 		goto DONE;
@@ -304,9 +525,284 @@ DONE:
 	if (pWriter) {
 		pWriter->Finalize();
 	}
+	SafeRelease(&pEncoderType);
 	SafeRelease(&pReaderType);
 	SafeRelease(&pWriter);
 	// pReader will be released later
 
 	return hr;
 }
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// 10 ms of 48 kHz stereo float per packet
+const LONGLONG PIPE_PACKET_HNS = 100000;
+const DWORD PIPE_PACKET_BYTES = 480 * 8;
+
+// One run of ReadSamples against the mocks below
+struct PipeBenchCase
+{
+	const char *szName;
+	DWORD nGapEvery;        // A gap after every so many packets
+	DWORD msecGap;          // Length of each gap
+	DWORD usecEncode;       // Time the writer takes per sample
+	DWORD msecStallEvery;   // The writer stalls every so often...
+	DWORD msecStall;        // ...for this long
+};
+
+static void spinPipeMicroseconds(DWORD usec) {
+	LARGE_INTEGER freq, tStart, tNow;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&tStart);
+	LONGLONG ticks = freq.QuadPart * usec / 1000000;
+	do {
+		QueryPerformanceCounter(&tNow);
+	} while (tNow.QuadPart - tStart.QuadPart < ticks);
+}
+
+// A capture device that delivers a packet every 10 ms of real time and
+// leaves gaps in the stream, reported as stream ticks as a real source
+// reader does
+class GapSourceReader : public IMFSourceReader
+{
+	LONG m_nRefCount;
+	const PipeBenchCase *m_pCase;
+	LONGLONG m_llNext;          // Time of the next packet
+	DWORD m_nPackets;
+	LARGE_INTEGER m_freq;
+	LARGE_INTEGER m_tStart;
+
+public:
+	LONG m_nSamples;
+	LONG m_nTicks;
+
+	GapSourceReader(const PipeBenchCase *pCase) :
+	m_nRefCount(1), m_pCase(pCase), m_llNext(0), m_nPackets(0),
+	m_nSamples(0), m_nTicks(0)
+	{
+		QueryPerformanceFrequency(&m_freq);
+		QueryPerformanceCounter(&m_tStart);
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFSourceReader)) {
+			*ppv = static_cast<IMFSourceReader *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFSourceReader methods
+	STDMETHODIMP ReadSample(DWORD, DWORD, DWORD *pdwActualStreamIndex,
+		DWORD *pdwStreamFlags, LONGLONG *pllTimestamp, IMFSample **ppSample);
+	STDMETHODIMP GetNativeMediaType(DWORD, DWORD, IMFMediaType **) { return E_NOTIMPL; }
+	STDMETHODIMP GetStreamSelection(DWORD, BOOL *) { return E_NOTIMPL; }
+	STDMETHODIMP SetStreamSelection(DWORD, BOOL) { return E_NOTIMPL; }
+	STDMETHODIMP GetCurrentMediaType(DWORD, IMFMediaType **) { return E_NOTIMPL; }
+	STDMETHODIMP SetCurrentMediaType(DWORD, DWORD *, IMFMediaType *) { return E_NOTIMPL; }
+	STDMETHODIMP SetCurrentPosition(REFGUID, REFPROPVARIANT) { return E_NOTIMPL; }
+	STDMETHODIMP Flush(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP GetServiceForStream(DWORD, REFGUID, REFIID, LPVOID *) { return E_NOTIMPL; }
+	STDMETHODIMP GetPresentationAttribute(DWORD, REFGUID, PROPVARIANT *) { return E_NOTIMPL; }
+};
+
+// Blocks until the next packet is due, as ReadSample does on a device.
+// After every nGapEvery packets the device goes quiet for msecGap, and
+// the call returns a stream tick at the time the data resumes.
+HRESULT GapSourceReader::ReadSample(DWORD, DWORD, DWORD *pdwActualStreamIndex,
+	DWORD *pdwStreamFlags, LONGLONG *pllTimestamp, IMFSample **ppSample)
+{
+	HRESULT hr = S_OK;
+	IMFSample *pSample = NULL;
+	IMFMediaBuffer *pBuffer = NULL;
+	BOOL bTick = m_pCase->nGapEvery > 0 && m_nPackets > 0 &&
+		m_nPackets % m_pCase->nGapEvery == 0;
+
+	if (bTick) {
+		m_llNext += m_pCase->msecGap * 10000LL;
+	}
+
+	LARGE_INTEGER tNow;
+	LONGLONG llDue = m_tStart.QuadPart + m_llNext * m_freq.QuadPart / 10000000;
+	QueryPerformanceCounter(&tNow);
+	if (tNow.QuadPart < llDue) {
+		Sleep((DWORD)((llDue - tNow.QuadPart) * 1000 / m_freq.QuadPart));
+	}
+
+	if (pdwActualStreamIndex) {
+		*pdwActualStreamIndex = 0;
+	}
+	*pllTimestamp = m_llNext;
+	*ppSample = NULL;
+	m_nPackets++;
+	if (bTick) {
+		*pdwStreamFlags = MF_SOURCE_READERF_STREAMTICK;
+		m_nTicks++;
+		return S_OK;
+	}
+
+	*pdwStreamFlags = 0;
+	hr = MFCreateSample(&pSample);
+	if (SUCCEEDED(hr)) {
+		hr = MFCreateMemoryBuffer(PIPE_PACKET_BYTES, &pBuffer);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pBuffer->SetCurrentLength(PIPE_PACKET_BYTES);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pSample->AddBuffer(pBuffer);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pSample->SetSampleDuration(PIPE_PACKET_HNS);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppSample = pSample;
+		pSample = NULL;
+		m_llNext += PIPE_PACKET_HNS;
+		m_nSamples++;
+	}
+	SafeRelease(&pBuffer);
+	SafeRelease(&pSample);
+	return hr;
+}
+
+// An encoder that takes usecEncode of CPU per sample, stalls now and
+// then as a disk would, and checks that times never go backwards
+class CountingSinkWriter : public IMFSinkWriter
+{
+	LONG m_nRefCount;
+	const PipeBenchCase *m_pCase;
+	DWORD m_tLastStall;
+
+public:
+	LONG m_nSamples;
+	LONG m_nTicks;
+	LONG m_nOutOfOrder;
+	LONGLONG m_llLast;
+
+	CountingSinkWriter(const PipeBenchCase *pCase) :
+	m_nRefCount(1), m_pCase(pCase), m_tLastStall(GetTickCount()),
+	m_nSamples(0), m_nTicks(0), m_nOutOfOrder(0), m_llLast(-1)
+	{
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFSinkWriter)) {
+			*ppv = static_cast<IMFSinkWriter *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFSinkWriter methods
+	STDMETHODIMP WriteSample(DWORD, IMFSample *pSample)
+	{
+		LONGLONG llTime = 0;
+		pSample->GetSampleTime(&llTime);
+		Check(llTime);
+		m_nSamples++;
+		spinPipeMicroseconds(m_pCase->usecEncode);
+		if (m_pCase->msecStallEvery &&
+			GetTickCount() - m_tLastStall >= m_pCase->msecStallEvery) {
+			Sleep(m_pCase->msecStall);
+			m_tLastStall = GetTickCount();
+		}
+		return S_OK;
+	}
+	STDMETHODIMP SendStreamTick(DWORD, LONGLONG llTimestamp)
+	{
+		Check(llTimestamp);
+		m_nTicks++;
+		return S_OK;
+	}
+	STDMETHODIMP AddStream(IMFMediaType *, DWORD *) { return E_NOTIMPL; }
+	STDMETHODIMP SetInputMediaType(DWORD, IMFMediaType *, IMFAttributes *) { return E_NOTIMPL; }
+	STDMETHODIMP BeginWriting() { return E_NOTIMPL; }
+	STDMETHODIMP PlaceMarker(DWORD, LPVOID) { return E_NOTIMPL; }
+	STDMETHODIMP NotifyEndOfSegment(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP Flush(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP Finalize() { return E_NOTIMPL; }
+	STDMETHODIMP GetServiceForStream(DWORD, REFGUID, REFIID, LPVOID *) { return E_NOTIMPL; }
+	STDMETHODIMP GetStatistics(DWORD, MF_SINK_WRITER_STATISTICS *) { return E_NOTIMPL; }
+
+private:
+	void Check(LONGLONG llTime)
+	{
+		if (llTime < m_llLast) {
+			m_nOutOfOrder++;
+		}
+		m_llLast = llTime;
+	}
+};
+
+void benchmarkPipeline(void) {
+	const LONG MSEC_RUN = 3000;
+	const PipeBenchCase cases[] = {
+		{ "steady, no gaps", 0, 0, 50, 0, 0 },
+		{ "100 ms gap every 0.5 s", 50, 100, 50, 0, 0 },
+		{ "200 ms writer stall every 1 s", 50, 100, 50, 1000, 200 },
+		{ "writer slower than real time", 50, 100, 15000, 0, 0 },
+	};
+
+	printf("WMA read/write pipeline benchmark, %d ms per case, "
+		"%d packet queue\n", MSEC_RUN, PIPELINE_QUEUE_CAPACITY);
+	for (DWORD i = 0; i < ARRAYSIZE(cases); i++) {
+		GapSourceReader *pReader = new (std::nothrow) GapSourceReader(&cases[i]);
+		CountingSinkWriter *pWriter = new (std::nothrow) CountingSinkWriter(&cases[i]);
+		if (pReader == NULL || pWriter == NULL) {
+			printf("Out of memory\n");
+			delete pReader;
+			delete pWriter;
+			return;
+		}
+
+		printf("%s (%u us per sample):\n", cases[i].szName, cases[i].usecEncode);
+		HRESULT hr = ReadSamples(pReader, pWriter, 0, MSEC_RUN, NULL);
+		if (FAILED(hr)) {
+			printErrorDescription(hr);
+		}
+
+		// Every sample and gap read is written, in order
+		BOOL bOk = SUCCEEDED(hr) && pWriter->m_nOutOfOrder == 0 &&
+			pWriter->m_nSamples == pReader->m_nSamples &&
+			pWriter->m_nTicks == pReader->m_nTicks;
+		printf("  %ld samples and %ld ticks read, %ld and %ld written, %s\n",
+			pReader->m_nSamples, pReader->m_nTicks, pWriter->m_nSamples,
+			pWriter->m_nTicks, bOk ? "ok" : "FAILED");
+		SafeRelease(&pReader);
+		SafeRelease(&pWriter);
+	}
+}
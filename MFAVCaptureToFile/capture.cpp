@@ -16,20 +16,17 @@
 #include "mfUtils.h"
 
 #include "capture.h"
+#include "mediaTypeCatalog.h"
 
 HRESULT CopyAttribute(IMFAttributes *pSrc, IMFAttributes *pDest, const GUID& key);
 
 
 void DeviceList::Clear()
 {
-	for (UINT32 i = 0; i < m_cDevices; i++)
+	while (m_cDevices > 0)
 	{
-		SafeRelease(&m_ppDevices[i]);
+		Remove(m_cDevices - 1);
 	}
-	CoTaskMemFree(m_ppDevices);
-	m_ppDevices = NULL;
-
-	m_cDevices = 0;
 }
 
 BOOL DeviceList::IsAudio()
@@ -37,14 +34,116 @@ BOOL DeviceList::IsAudio()
 	return m_useAudio;
 }
 
-HRESULT DeviceList::EnumerateDevices(BOOL useAudio)
+// Audio devices are known by endpoint ID, video devices by symbolic link
+const GUID& DeviceList::LinkKey() const
+{
+	return m_useAudio ? MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID :
+		MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK;
+}
+
+// The index of the device with a link, or Count() if there is none.
+// The search starts at iStart and wraps around: the devices are
+// enumerated in much the same order each time, so starting after the
+// last one found nearly always finds the next at once.
+UINT32 DeviceList::Find(const WCHAR *szLink, UINT32 iStart) const
+{
+	for (UINT32 n = 0; n < m_cDevices; n++)
+	{
+		UINT32 i = (iStart + n) % m_cDevices;
+		if (_wcsicmp(m_pDevices[i].szLink, szLink) == 0)
+		{
+			return i;
+		}
+	}
+	return m_cDevices;
+}
+
+// Appends a device, taking szLink, and tells the listeners.  Only the
+// name is read from the enumerated activation object.
+HRESULT DeviceList::Add(WCHAR *szLink, IMFActivate *pSource)
 {
 	HRESULT hr = S_OK;
-	IMFAttributes *pAttributes = NULL;
+	WCHAR *szName = NULL;
+
+	if (m_cDevices == m_cAllocated)
+	{
+		UINT32 cAllocated = m_cAllocated ? m_cAllocated * 2 : 8;
+		Device *pDevices = new (std::nothrow) Device[cAllocated];
+		if (pDevices == NULL)
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		else
+		{
+			if (m_cDevices > 0)
+			{
+				memcpy(pDevices, m_pDevices, m_cDevices * sizeof(Device));
+			}
+			delete [] m_pDevices;
+			m_pDevices = pDevices;
+			m_cAllocated = cAllocated;
+		}
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = pSource->GetAllocatedString(
+			MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
+			&szName,
+			NULL
+			);
+	}
+
+	if (FAILED(hr))
+	{
+		CoTaskMemFree(szLink);
+		return hr;
+	}
+
+	Device& device = m_pDevices[m_cDevices++];
+	device.id = m_nextId++;
+	device.szLink = szLink;
+	device.szName = szName;
+	device.pActivate = NULL;
 
-	m_useAudio = useAudio;
+	Publish(DeviceList_Added, device);
+	return hr;
+}
+
+// Tells the listeners, then drops the device, keeping the order of the rest
+void DeviceList::Remove(UINT32 index)
+{
+	Device& device = m_pDevices[index];
+
+	Publish(DeviceList_Removed, device);
+
+	SafeRelease(&device.pActivate);
+	CoTaskMemFree(device.szLink);
+	CoTaskMemFree(device.szName);
+
+	m_cDevices--;
+	if (index < m_cDevices)
+	{
+		memmove(&m_pDevices[index], &m_pDevices[index + 1],
+			(m_cDevices - index) * sizeof(Device));
+	}
+}
+
+void DeviceList::Publish(DeviceListEvent event, const Device& device)
+{
+	for (UINT32 i = 0; i < m_cListeners; i++)
+	{
+		m_listeners[i].pfn(event, device.id, device.szName,
+			m_listeners[i].pContext);
+	}
+}
 
-	Clear();
+HRESULT DeviceList::EnumerateDevices(BOOL useAudio)
+{
+	HRESULT hr = S_OK;
+	IMFAttributes *pAttributes = NULL;
+	IMFActivate **ppSources = NULL;
+	UINT32 cSources = 0;
 
 	// Initialize an attribute store. We will use this to
 	// specify the enumeration parameters.
@@ -62,17 +161,83 @@ HRESULT DeviceList::EnumerateDevices(BOOL useAudio)
 
 	// Enumerate devices.
 	if (SUCCEEDED(hr)) {
-		hr = MFEnumDeviceSources(pAttributes, &m_ppDevices, &m_cDevices);
+		hr = MFEnumDeviceSources(pAttributes, &ppSources, &cSources);
+	}
+
+	if (SUCCEEDED(hr)) {
+		hr = Merge(useAudio, ppSources, cSources);
 	}
 
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("Failed to enumerate devices"));
 	}
 
+	for (UINT32 i = 0; i < cSources; i++) {
+		SafeRelease(&ppSources[i]);
+	}
+	CoTaskMemFree(ppSources);
 	SafeRelease(&pAttributes);
 	return hr;
 }
 
+HRESULT DeviceList::Merge(BOOL useAudio, IMFActivate **ppSources, UINT32 cSources)
+{
+	HRESULT hr = S_OK;
+	BOOL *pbFound = NULL;
+
+	// Audio and video devices have nothing in common
+	if (useAudio != m_useAudio)
+	{
+		Clear();
+		m_useAudio = useAudio;
+	}
+
+	// The devices listed before this refresh, which are the first
+	// cPrevious entries while new ones are appended.
+	UINT32 cPrevious = m_cDevices;
+
+	if (cPrevious > 0) {
+		pbFound = new (std::nothrow) BOOL[cPrevious];
+		if (pbFound == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		ZeroMemory(pbFound, cPrevious * sizeof(BOOL));
+	}
+
+	// Keep the devices found again, and add the rest
+	UINT32 iNext = 0;
+	for (UINT32 i = 0; i < cSources && SUCCEEDED(hr); i++) {
+		WCHAR *szLink = NULL;
+
+		hr = ppSources[i]->GetAllocatedString(LinkKey(), &szLink, NULL);
+		if (SUCCEEDED(hr)) {
+			UINT32 index = Find(szLink, iNext);
+			if (index < m_cDevices) {
+				if (index < cPrevious) {
+					pbFound[index] = TRUE;
+				}
+				iNext = index + 1;
+				CoTaskMemFree(szLink);
+			} else {
+				hr = Add(szLink, ppSources[i]);
+			}
+		}
+	}
+
+	// Drop the devices that have gone, unless the enumeration failed
+	// part way and some were not looked for.
+	if (SUCCEEDED(hr)) {
+		for (UINT32 i = cPrevious; i-- > 0; ) {
+			if (!pbFound[i]) {
+				Remove(i);
+			}
+		}
+	}
+
+	delete [] pbFound;
+	return hr;
+}
+
 
 HRESULT DeviceList::GetDevice(UINT32 index, IMFActivate **ppActivate)
 {
@@ -81,10 +246,43 @@ HRESULT DeviceList::GetDevice(UINT32 index, IMFActivate **ppActivate)
 		return E_INVALIDARG;
 	}
 
-	*ppActivate = m_ppDevices[index];
-	(*ppActivate)->AddRef();
+	HRESULT hr = S_OK;
+	Device& device = m_pDevices[index];
 
-	return S_OK;
+	// The activation object is made from the link alone, as the media
+	// source would be, rather than kept from the enumeration.
+	if (device.pActivate == NULL)
+	{
+		IMFAttributes *pAttributes = NULL;
+
+		hr = MFCreateAttributes(&pAttributes, 3);
+		if (SUCCEEDED(hr)) {
+			hr = pAttributes->SetGUID(
+				MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
+				m_useAudio ? MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_GUID :
+				MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID
+				);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pAttributes->SetString(LinkKey(), device.szLink);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pAttributes->SetString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
+				device.szName);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = MFCreateDeviceSourceActivate(pAttributes, &device.pActivate);
+		}
+		SafeRelease(&pAttributes);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		*ppActivate = device.pActivate;
+		(*ppActivate)->AddRef();
+	}
+
+	return hr;
 }
 
 HRESULT DeviceList::GetDeviceName(UINT32 index, WCHAR **ppszName)
@@ -94,15 +292,73 @@ HRESULT DeviceList::GetDeviceName(UINT32 index, WCHAR **ppszName)
 		return E_INVALIDARG;
 	}
 
-	HRESULT hr = S_OK;
+	size_t cb = (wcslen(m_pDevices[index].szName) + 1) * sizeof(WCHAR);
 
-	hr = m_ppDevices[index]->GetAllocatedString(
-		MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME,
-		ppszName,
-		NULL
-		);
+	*ppszName = (WCHAR *)CoTaskMemAlloc(cb);
+	if (*ppszName == NULL)
+	{
+		return E_OUTOFMEMORY;
+	}
+	memcpy(*ppszName, m_pDevices[index].szName, cb);
 
-	return hr;
+	return S_OK;
+}
+
+UINT32 DeviceList::GetDeviceId(UINT32 index) const
+{
+	return index < m_cDevices ? m_pDevices[index].id : 0;
+}
+
+HRESULT DeviceList::FindDevice(UINT32 id, UINT32 *pIndex) const
+{
+	for (UINT32 i = 0; i < m_cDevices; i++)
+	{
+		if (m_pDevices[i].id == id)
+		{
+			*pIndex = i;
+			return S_OK;
+		}
+	}
+	return E_INVALIDARG;
+}
+
+void DeviceList::ReleaseDevices()
+{
+	for (UINT32 i = 0; i < m_cDevices; i++)
+	{
+		SafeRelease(&m_pDevices[i].pActivate);
+	}
+}
+
+HRESULT DeviceList::AddListener(DeviceListProc pfn, void *pContext)
+{
+	if (pfn == NULL)
+	{
+		return E_POINTER;
+	}
+	if (m_cListeners == DEVICE_LIST_MAX_LISTENERS)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	m_listeners[m_cListeners].pfn = pfn;
+	m_listeners[m_cListeners].pContext = pContext;
+	m_cListeners++;
+
+	return S_OK;
+}
+
+void DeviceList::RemoveListener(DeviceListProc pfn, void *pContext)
+{
+	for (UINT32 i = 0; i < m_cListeners; i++)
+	{
+		if (m_listeners[i].pfn == pfn && m_listeners[i].pContext == pContext)
+		{
+			m_cListeners--;
+			m_listeners[i] = m_listeners[m_cListeners];
+			return;
+		}
+	}
 }
 
 
@@ -142,11 +398,23 @@ HRESULT CCapture::CreateInstance(
 CCapture::CCapture(HWND hwnd, BOOL useAudio) :
 m_pReader(NULL),
 m_pWriter(NULL),
+m_dwSinkStream(0),
+m_hWriterThread(NULL),
+m_hSampleEvent(NULL),
+m_hSharedEvent(NULL),
+m_bStopWriter(FALSE),
+m_hrWrite(S_OK),
+m_nUnwritten(0),
 m_hwndEvent(hwnd),
 m_nRefCount(1),
 m_bFirstSample(FALSE),
 m_llBaseTime(0),
+m_pSessionClock(NULL),
+m_dwPreRollSeconds(0),
+m_bArmed(FALSE),
+m_bFlushPreRoll(FALSE),
 m_pwszSymbolicLink(NULL),
+m_pFactory(NULL),
 m_useAudio(useAudio)
 {
 	InitializeCriticalSection(&m_critsec);
@@ -160,6 +428,11 @@ CCapture::~CCapture()
 {
 	assert(m_pReader == NULL);
 	assert(m_pWriter == NULL);
+	assert(m_hWriterThread == NULL);
+	if (m_hSampleEvent)
+	{
+		CloseHandle(m_hSampleEvent);
+	}
 	DeleteCriticalSection(&m_critsec);
 }
 
@@ -236,20 +509,41 @@ HRESULT CCapture::OnReadSample(
 		goto DONE;
 	}
 
-	if (pSample) {
+	if (pSample && m_bArmed) {
+		// Keep it in memory until the trigger.  The time base is not
+		// known yet, so it keeps its device time.
+		hr = CopyToPreRoll(pSample, llTimeStamp);
+		if (FAILED(hr)) { goto DONE; }
+	} else if (pSample) {
 		if (m_bFirstSample) {
-			m_llBaseTime = llTimeStamp;
+			m_llBaseTime = m_pSessionClock ? m_pSessionClock->BaseTime() : llTimeStamp;
 			m_bFirstSample = FALSE;
 		}
 
-		// rebase the time stamp
-		llTimeStamp -= m_llBaseTime;
+		// Samples captured before the session started would get a
+		// negative time, so they are dropped.
+		if (llTimeStamp < m_llBaseTime) {
+			m_clockTracker.CountEarly();
+		} else {
+			LONGLONG llDuration = 0;
+			if (FAILED(pSample->GetSampleDuration(&llDuration))) {
+				llDuration = 0;
+			}
+			m_clockTracker.AddSample(llTimeStamp, llDuration);
+
+			// rebase the time stamp
+			llTimeStamp -= m_llBaseTime;
 
-		hr = pSample->SetSampleTime(llTimeStamp);
-		if (FAILED(hr)) { goto DONE; }
+			hr = pSample->SetSampleTime(llTimeStamp);
+			if (FAILED(hr)) { goto DONE; }
 
-		hr = m_pWriter->WriteSample(0, pSample);  // KE: Should be_sink_stream
-		if (FAILED(hr)) { goto DONE; }
+			// Hand the sample to the writer thread.  If the queue is full
+			// the sample is dropped and counted as an overrun rather than
+			// stalling the next read.
+			if (m_queue.Push(pSample)) {
+				SetEvent(m_hSharedEvent ? m_hSharedEvent : m_hSampleEvent);
+			}
+		}
 	}
 
 	// Read another sample.
@@ -350,10 +644,12 @@ HRESULT CCapture::StartCapture(
 	EnterCriticalSection(&m_critsec);
 
 	// Create the media source for the device.
-	hr = pActivate->ActivateObject(
-		__uuidof(IMFMediaSource),
-		(void**)&pSource
-		);
+	if (m_pFactory == NULL) {
+		hr = pActivate->ActivateObject(
+			__uuidof(IMFMediaSource),
+			(void**)&pSource
+			);
+	}
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("StartCapture: ActivateObject failed"));
 	}
@@ -376,14 +672,17 @@ HRESULT CCapture::StartCapture(
 	}
 
 	if (SUCCEEDED(hr)) {
-		hr = OpenMediaSource(pSource);
+		hr = m_pFactory ? m_pFactory->CreateReader(pActivate, this, &m_pReader) :
+			OpenMediaSource(pSource);
 	}
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("StartCapture: OpenMediaSource failed"));
 	}
 
 	// Create the sink writer
-	if (SUCCEEDED(hr)) {
+	if (SUCCEEDED(hr) && m_pFactory) {
+		hr = m_pFactory->CreateWriter(pwszFileName, &m_pWriter);
+	} else if (SUCCEEDED(hr)) {
 		hr = MFCreateSinkWriterFromURL(
 			pwszFileName,
 			NULL,
@@ -395,7 +694,7 @@ HRESULT CCapture::StartCapture(
 		ShowMessage(hr, _T("StartCapture: MFCreateSinkWriterFromURL failed"));
 #if 0
 		// Debug
-		ShowMessage(hr, _T("pwszFileName=%s", pwszFileName));
+		ShowMessage(hr, _T("pwszFileName=%s"), pwszFileName);
 #endif
 	}
 
@@ -407,9 +706,26 @@ HRESULT CCapture::StartCapture(
 		ShowMessage(hr, _T("StartCapture: ConfigureCapture failed"));
 	}
 
+	// Start the thread that writes the queued samples
+	if (SUCCEEDED(hr)) {
+		hr = StartWriterThread();
+	}
+	if(FAILED(hr)) {
+		ShowMessage(hr, _T("StartCapture: StartWriterThread failed"));
+	}
+
+	// Allocate the pre-roll, if any, now that the format is known
+	if (SUCCEEDED(hr) && m_dwPreRollSeconds > 0) {
+		hr = StartPreRoll();
+		if(FAILED(hr)) {
+			ShowMessage(hr, _T("StartCapture: StartPreRoll failed"));
+		}
+	}
+
 	if (SUCCEEDED(hr)) {
 		m_bFirstSample = TRUE;
 		m_llBaseTime = 0;
+		m_clockTracker.Reset();
 
 		// Request the first frame which causes OnReadSample which calls it again
 		hr = m_pReader->ReadSample(
@@ -447,6 +763,14 @@ HRESULT CCapture::EndCaptureSession()
 
 	HRESULT hr = S_OK;
 
+	// Stopping before the trigger keeps what the pre-roll holds
+	if (m_bArmed) {
+		Trigger();
+	}
+
+	// Write whatever is still queued before finalizing
+	StopWriterThread();
+
 	if (m_pWriter)
 	{
 		hr = m_pWriter->Finalize();
@@ -472,6 +796,21 @@ BOOL CCapture::IsCapturing()
 
 
 
+//-------------------------------------------------------------------
+//  GetAlignment
+//  Reports where the first sample fell relative to the time base and
+//  the measured drift of the device clock.
+//-------------------------------------------------------------------
+
+void CCapture::GetAlignment(ClockAlignment *pAlign)
+{
+	EnterCriticalSection(&m_critsec);
+	m_clockTracker.GetAlignment(
+		m_pSessionClock ? m_pSessionClock->BaseTime() : m_llBaseTime, pAlign);
+	LeaveCriticalSection(&m_critsec);
+}
+
+
 //-------------------------------------------------------------------
 //  CheckDeviceLost
 //  Checks whether the media capture device was removed.
@@ -528,13 +867,105 @@ DONE:
 
 
 
+//-------------------------------------------------------------------
+//  NegotiateSubtype
+//
+//  Sets pReaderType on the reader with the subtype that was set last
+//  time, the native subtype if it is one of ours, or else the first of
+//  ours that the reader will decode to.
+//-------------------------------------------------------------------
+
+static HRESULT NegotiateSubtype(IMFSourceReader *pReader, DWORD dwStream,
+								IMFMediaType *pReaderType, const GUID *subtypes,
+								UINT32 nSubtypes, const WCHAR *szLink,
+								GUID *pNegotiated)
+{
+	HRESULT hr = S_OK;
+	BOOL    bUseNativeType = FALSE;
+	GUID subtype = { 0 };
+	GUID negotiated = { 0 };
+
+	hr = pReaderType->GetGUID(MF_MT_SUBTYPE, &subtype);
+	if (FAILED(hr)) {
+		debugMsg(_T("ConfigureSourceReader: ")
+			_T("GetGUID MF_MT_SUBTYPE failed (0x%08X)\n"), hr);
+		return hr;
+	}
+
+	// Try the subtype that was set last time, so negotiation is
+	// usually a single call
+	if (SUCCEEDED(catalogGetNegotiatedSubtype(szLink, dwStream, &negotiated))) {
+		hr = pReaderType->SetGUID(MF_MT_SUBTYPE, negotiated);
+		if (SUCCEEDED(hr)) {
+			hr = pReader->SetCurrentMediaType(dwStream, NULL, pReaderType);
+		}
+		if (SUCCEEDED(hr)) {
+			*pNegotiated = negotiated;
+			return hr;
+		}
+		debugMsg(_T("ConfigureSourceReader: ")
+			_T("Last subtype failed (0x%08X)\n"), hr);
+		hr = pReaderType->SetGUID(MF_MT_SUBTYPE, subtype);
+		if (FAILED(hr)) {
+			return hr;
+		}
+	}
+
+	// See if subtype is one of ours and use it if so
+	for (UINT32 i = 0; i < nSubtypes; i++) {
+		if (subtype == subtypes[i]) {
+			hr = pReader->SetCurrentMediaType(dwStream, NULL, pReaderType);
+			negotiated = subtype;
+			bUseNativeType = TRUE;
+			break;
+		}
+	}
+
+	// If not found found, try each of ours in turn
+	if (!bUseNativeType) {
+		// None of the native types worked. The camera might offer
+		// output a compressed type such as MJPEG or DV.
+
+		// Try adding a decoder (MF_MT_SUBTYPE).
+		for (UINT32 i = 0; i < nSubtypes; i++) {
+			hr = pReaderType->SetGUID(MF_MT_SUBTYPE, subtypes[i]);
+			if (FAILED(hr)) {
+				debugMsg(_T("ConfigureSourceReader: ")
+					_T("SetGUID MF_MT_SUBTYPE failed for subtype %d (0x%08X)\n"),
+					i, hr);
+				return hr;
+			}
+
+			hr = pReader->SetCurrentMediaType(dwStream, NULL, pReaderType);
+			if (SUCCEEDED(hr)) {
+				negotiated = subtypes[i];
+				break;
+			} else {
+				// Debug
+				debugMsg(_T("ConfigureSourceReader: ")
+					_T("Failed for subtype %d (0x%08X)\n"), i, hr);
+			}
+		}
+	}
+
+	if (SUCCEEDED(hr)) {
+		*pNegotiated = negotiated;
+	}
+	return hr;
+}
+
 //-------------------------------------------------------------------
 //  ConfigureSourceReader
 //
-//  Sets the media type on the source reader.
+//  Sets the media type on the source reader.  The native type comes
+//  from the catalog, and the subtype that was set last time is tried
+//  first.  If the reader takes no type made from the catalog's record,
+//  the record is out of date: it is dropped, and the types are asked
+//  of the reader again for one more try.
 //-------------------------------------------------------------------
 
-HRESULT ConfigureSourceReader(IMFSourceReader *pReader, BOOL useAudio)
+HRESULT ConfigureSourceReader(IMFSourceReader *pReader, BOOL useAudio,
+							  const WCHAR *szLink)
 {
 	// The list of acceptable types.
 	GUID audioSubtypes[] = {
@@ -549,7 +980,7 @@ HRESULT ConfigureSourceReader(IMFSourceReader *pReader, BOOL useAudio)
 		MFVideoFormat_NV12, MFVideoFormat_YUY2, MFVideoFormat_UYVY,
 		MFVideoFormat_RGB32, MFVideoFormat_RGB24, MFVideoFormat_IYUV
 	};
-	UINT32 nVideoSubtypes = ARRAYSIZE(audioSubtypes);
+	UINT32 nVideoSubtypes = ARRAYSIZE(videoSubtypes);
 	GUID *subtypes;
 	UINT32 nSubtypes;
 	if(useAudio) {
@@ -559,10 +990,12 @@ HRESULT ConfigureSourceReader(IMFSourceReader *pReader, BOOL useAudio)
 		subtypes = videoSubtypes;
 		nSubtypes = nVideoSubtypes;
 	}
+	DWORD dwStream = useAudio ? (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM :
+		(DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM;
 
 	HRESULT hr = S_OK;
-	BOOL    bUseNativeType = FALSE;
-	GUID subtype = { 0 };
+	BOOL    bFromCatalog = FALSE;
+	GUID negotiated = { 0 };
 	IMFMediaType *pReaderType = NULL;
 
 	// If the source's native format matches any of the formats in
@@ -573,75 +1006,58 @@ HRESULT ConfigureSourceReader(IMFSourceReader *pReader, BOOL useAudio)
 	// provide a list to the user and have the user select the
 	// camera's output format. That is outside the scope of this
 	// sample, however.
-	hr = pReader->GetNativeMediaType(
-		useAudio ? (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM :
-		(DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-		0,  // Type index
-		&pReaderType
-		);
-
+	hr = catalogGetDevice(szLink, pReader);
+	if (SUCCEEDED(hr)) {
+		hr = catalogGetNativeType(szLink, dwStream, 0, &pReaderType);
+		bFromCatalog = SUCCEEDED(hr);
+	}
 	if (FAILED(hr)) {
-		ShowMessage(hr, _T("ConfigureSourceReader: GetNativeMediaType failed"));
-		goto DONE;
+		debugMsg(_T("ConfigureSourceReader: ")
+			_T("No catalog entry (0x%08X), asking the reader\n"), hr);
+		hr = pReader->GetNativeMediaType(dwStream, 0, &pReaderType);
 	}
 
-	hr = pReaderType->GetGUID(MF_MT_SUBTYPE, &subtype);
 	if (FAILED(hr)) {
-		ShowMessage(hr, _T("ConfigureSourceReader: GetGUID MF_MT_SUBTYPE failed"));
+		ShowMessage(hr, _T("ConfigureSourceReader: GetNativeMediaType failed"));
 		goto DONE;
 	}
 
-	// See if subtype is one of ours and use it if so
-	for (UINT32 i = 0; i < nSubtypes; i++) {
-		if (subtype == subtypes[i]) {
-			hr = pReader->SetCurrentMediaType(
-				useAudio ? (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM :
-				(DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-				NULL,
-				pReaderType
-				);
-
-			bUseNativeType = TRUE;
-			break;
-		}
-	}
-
-	// If not found found, try each of ours in turn
-	if (!bUseNativeType) {
-		// None of the native types worked. The camera might offer
-		// output a compressed type such as MJPEG or DV.
-
-		// Try adding a decoder (MF_MT_SUBTYPE).
-		for (UINT32 i = 0; i < nSubtypes; i++) {
-			hr = pReaderType->SetGUID(MF_MT_SUBTYPE, subtypes[i]);
-			if (FAILED(hr)) {
-				debugMsg(_T("ConfigureSourceReader: ")
-					_T("SetGUID MF_MT_SUBTYPE failed for subtype %d (0x%08X)\n"),
-					i);
-				goto DONE;
-			}
-
-			hr = pReader->SetCurrentMediaType(
-				useAudio ? (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM :
-				(DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-				NULL,
-				pReaderType
-				);
-			if (SUCCEEDED(hr)) {
-				break;
-			} else {
-				// Debug
-				debugMsg(_T("ConfigureSourceReader: ")
-					_T("Failed for subtype %d (0x%08X)\n"), i);
-			}
+	hr = NegotiateSubtype(pReader, dwStream, pReaderType, subtypes, nSubtypes,
+		szLink, &negotiated);
+
+	// The device may have changed without a notification.  Drop its
+	// record, which asks the reader again, and try once more.
+	if (FAILED(hr) && bFromCatalog) {
+		debugMsg(_T("ConfigureSourceReader: ")
+			_T("Catalog type failed (0x%08X), asking the reader\n"), hr);
+		catalogForgetDevice(szLink);
+		SafeRelease(&pReaderType);
+		hr = catalogGetDevice(szLink, pReader);
+		if (FAILED(hr)) {
+			// Go on with the reader's type, leaving the device out of
+			// the catalog rather than with part of a record
+			debugMsg(_T("ConfigureSourceReader: ")
+				_T("Could not record the device again (0x%08X)\n"), hr);
+			catalogForgetDevice(szLink);
 		}
+		hr = pReader->GetNativeMediaType(dwStream, 0, &pReaderType);
 		if (FAILED(hr)) {
-			ShowMessage(hr, _T("ConfigureSourceReader: ")
-				_T("Failed to set any of our subtypes (0x%08X)"));
+			ShowMessage(hr, _T("ConfigureSourceReader: GetNativeMediaType failed"));
 			goto DONE;
 		}
+		hr = NegotiateSubtype(pReader, dwStream, pReaderType, subtypes,
+			nSubtypes, szLink, &negotiated);
+	}
+
+	if (FAILED(hr)) {
+		ShowMessage(hr, _T("ConfigureSourceReader: ")
+			_T("Failed to set any of our subtypes"));
+		goto DONE;
 	}
 
+	// Remember it for next time
+	catalogSetNegotiatedSubtype(szLink, dwStream, negotiated);
+
 DONE:
 	SafeRelease(&pReaderType);
 	return hr;
@@ -697,44 +1113,42 @@ HRESULT ConfigureEncoder(
 		for(UINT32 i=0; i < count; i++) {
 			hr = pReaderType->GetItemByIndex(i, &guid, &propVariant);
 			if(FAILED(hr)) {
-				debugMsg(_T("ConfigureEncoder: ")
-					_T("GetItemByIndex failed for index %d (0x%08X)\n"), i);
-				ShowMessage(hr, szDebugString);
+				ShowMessage(hr, _T("ConfigureEncoder: ")
+					_T("GetItemByIndex failed for index %d"), i);
 				goto DONE;
 			}
 			hr = CopyAttribute(pReaderType, pType2, guid);
 			if(FAILED(hr)) {
-				debugMsg(_T("ConfigureEncoder: ")
-					_T("CopyAttribute failed for index %d (0x%08X)\n"), i);
-				ShowMessage(hr, szDebugString);
+				ShowMessage(hr, _T("ConfigureEncoder: ")
+					_T("CopyAttribute failed for index %d"), i);
 				goto DONE;
 			}
 		}
 	} else {
 		hr = CopyAttribute(pReaderType, pType2, MF_MT_FRAME_SIZE);
 		if(FAILED(hr)) {
-			ShowMessage(hr, NULL,
+			ShowMessage(hr,
 				_T("ConfigureEncoder: CopyAttribute MF_MT_FRAME_SIZE failed"));
 			goto DONE;
 		}
 
 		hr = CopyAttribute(pReaderType, pType2, MF_MT_FRAME_RATE);
 		if(FAILED(hr)) {
-			ShowMessage(hr, NULL,
+			ShowMessage(hr,
 				_T("ConfigureEncoder: CopyAttribute MF_MT_FRAME_RATE failed"));
 			goto DONE;
 		}
 
 		hr = CopyAttribute(pReaderType, pType2, MF_MT_PIXEL_ASPECT_RATIO);
 		if(FAILED(hr)) {
-			ShowMessage(hr, NULL,
+			ShowMessage(hr,
 				_T("ConfigureEncoder: CopyAttribute MF_MT_PIXEL_ASPECT_RATIO failed"));
 			goto DONE;
 		}
 
 		hr = CopyAttribute(pReaderType, pType2, MF_MT_INTERLACE_MODE);
 		if(FAILED(hr)) {
-			ShowMessage(hr, NULL,
+			ShowMessage(hr,
 				_T("ConfigureEncoder: CopyAttribute MF_MT_INTERLACE_MODE failed"));
 			goto DONE;
 		}
@@ -770,7 +1184,7 @@ HRESULT CCapture::ConfigureCapture(const EncodingParameters &param,
 	DWORD sink_stream = 0;
 	IMFMediaType *pReaderType = NULL;
 
-	hr = ConfigureSourceReader(m_pReader, m_useAudio);
+	hr = ConfigureSourceReader(m_pReader, m_useAudio, m_pwszSymbolicLink);
 	if(FAILED(hr)) {
 		ShowMessage(hr, _T("ConfigureCapture: ConfigureSourceReader failed"));
 		goto DONE;
@@ -791,6 +1205,7 @@ HRESULT CCapture::ConfigureCapture(const EncodingParameters &param,
 		ShowMessage(hr, _T("ConfigureCapture: ConfigureEncoder failed"));
 		goto DONE;
 	}
+	m_dwSinkStream = sink_stream;
 
 	if(!useAudio) {
 		// Register the color converter DSP for this process, in the video
@@ -841,6 +1256,11 @@ HRESULT CCapture::EndCaptureInternal()
 {
 	HRESULT hr = S_OK;
 
+	if (m_bArmed) {
+		Trigger();
+	}
+	StopWriterThread();
+
 	if (m_pWriter)
 	{
 		hr = m_pWriter->Finalize();
@@ -858,6 +1278,397 @@ HRESULT CCapture::EndCaptureInternal()
 
 
 
+//-------------------------------------------------------------------
+// StartWriterThread
+//
+// Creates the sample queue and the thread that drains it into the
+// sink writer.  With a shared writer only the queue is created.
+//-------------------------------------------------------------------
+
+HRESULT CCapture::StartWriterThread()
+{
+	HRESULT hr = m_queue.Initialize(SAMPLE_QUEUE_CAPACITY);
+	if (FAILED(hr)) {
+		return hr;
+	}
+	m_hrWrite = S_OK;
+	m_nUnwritten = 0;
+	if (m_hSharedEvent) {
+		return S_OK;
+	}
+
+	if (m_hSampleEvent == NULL) {
+		m_hSampleEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hSampleEvent == NULL) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+
+	m_bStopWriter = FALSE;
+	m_hWriterThread = (HANDLE)_beginthreadex(NULL, 0, WriterThreadProc,
+		this, 0, NULL);
+	if (m_hWriterThread == NULL) {
+		return E_FAIL;
+	}
+	return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// StopWriterThread
+//
+// Tells the writer thread to finish the queue and waits for it.
+// Must not be called from the writer thread.  With a shared writer,
+// its owner must have stopped it first; anything still queued is
+// written here.
+//-------------------------------------------------------------------
+
+void CCapture::StopWriterThread()
+{
+	if (m_hWriterThread) {
+		m_bStopWriter = TRUE;
+		SetEvent(m_hSampleEvent);
+		WaitForSingleObject(m_hWriterThread, INFINITE);
+		CloseHandle(m_hWriterThread);
+		m_hWriterThread = NULL;
+	} else if (m_hSharedEvent && m_pWriter) {
+		DrainQueue();
+	} else {
+		return;
+	}
+
+	SampleQueueStats stats;
+	m_queue.GetStats(&stats);
+	debugMsg(_T("StopWriterThread: pushed=%I64d high-water=%d overruns=%d\n"),
+		stats.nPushed, stats.nHighWater, stats.nOverruns);
+	if (FAILED(m_hrWrite)) {
+		debugMsg(_T("StopWriterThread: write failed 0x%08X, ")
+			_T("%d samples not written\n"), m_hrWrite, m_nUnwritten);
+	}
+	m_queue.Clear();
+}
+
+
+//-------------------------------------------------------------------
+// DrainQueue
+//
+// Writes all queued samples.  Called on the writer thread, which is
+// the shared writer's thread when there is one.  After a write fails
+// the rest are dropped, so the window gets one error, not one per
+// sample.
+//-------------------------------------------------------------------
+
+void CCapture::DrainQueue()
+{
+	IMFSample *pSample = NULL;
+	while (m_queue.Pop(&pSample)) {
+		// Trigger flags the pre-roll before anything after it is
+		// queued, so seeing the sample means seeing the flag.
+		if (m_bFlushPreRoll) {
+			WritePreRoll();
+		}
+		if (SUCCEEDED(m_hrWrite)) {
+			OnWriteResult(m_pWriter->WriteSample(m_dwSinkStream, pSample));
+		} else {
+			m_nUnwritten++;
+		}
+		SafeRelease(&pSample);
+	}
+	if (m_bFlushPreRoll) {
+		WritePreRoll();
+	}
+}
+
+
+//-------------------------------------------------------------------
+// StartPreRoll
+//
+// Sizes the pre-roll from the reader's output format and arms it.
+//-------------------------------------------------------------------
+
+HRESULT CCapture::StartPreRoll()
+{
+	IMFMediaType *pType = NULL;
+	UINT64 cbPerSecond = 0;
+
+	HRESULT hr = m_pReader->GetCurrentMediaType(
+		m_useAudio ? (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM :
+		(DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+		&pType
+		);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	if (m_useAudio) {
+		UINT32 cbAvg = 0;
+		hr = pType->GetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, &cbAvg);
+		cbPerSecond = cbAvg;
+	} else {
+		GUID subtype = { 0 };
+		UINT32 width = 0, height = 0, num = 0, den = 0;
+		UINT32 cbImage = 0;
+		hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+		if (SUCCEEDED(hr)) {
+			hr = MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &width, &height);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = MFGetAttributeRatio(pType, MF_MT_FRAME_RATE, &num, &den);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = MFCalculateImageSize(subtype, width, height, &cbImage);
+		}
+		if (SUCCEEDED(hr) && den != 0) {
+			cbPerSecond = (UINT64)cbImage * num / den;
+		}
+	}
+	SafeRelease(&pType);
+	if (FAILED(hr)) {
+		return hr;
+	}
+	if (cbPerSecond == 0) {
+		return MF_E_INVALIDMEDIATYPE;
+	}
+
+	// A quarter second more covers the space lost at the end of the
+	// ring when a sample does not fit there
+	UINT64 cbCapacity = cbPerSecond * m_dwPreRollSeconds + cbPerSecond / 4;
+	if (cbCapacity > MAXDWORD / 2) {
+		return E_OUTOFMEMORY;
+	}
+	hr = m_preRoll.Initialize((DWORD)cbCapacity,
+		m_dwPreRollSeconds * PREROLL_ENTRIES_PER_SECOND,
+		m_dwPreRollSeconds * 10000000LL);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	debugMsg(_T("StartPreRoll: %u seconds, %u bytes\n"),
+		m_dwPreRollSeconds, (DWORD)cbCapacity);
+	m_bArmed = TRUE;
+	return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// CopyToPreRoll
+//
+// Copies a sample into the pre-roll.  Called from OnReadSample while
+// armed.  Nothing is allocated: the buffers of the sample are copied
+// one after another straight into the ring.
+//-------------------------------------------------------------------
+
+HRESULT CCapture::CopyToPreRoll(IMFSample *pSample, LONGLONG llTimeStamp)
+{
+	DWORD cbTotal = 0;
+	DWORD nBuffers = 0;
+	LONGLONG llDuration = 0;
+
+	HRESULT hr = pSample->GetTotalLength(&cbTotal);
+	if (SUCCEEDED(hr)) {
+		hr = pSample->GetBufferCount(&nBuffers);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+	if (FAILED(pSample->GetSampleDuration(&llDuration))) {
+		llDuration = 0;
+	}
+
+	// A sample larger than the whole ring is counted as dropped
+	BYTE *pDest = m_preRoll.Reserve(cbTotal);
+	if (pDest == NULL) {
+		return S_OK;
+	}
+
+	DWORD cbCopied = 0;
+	for (DWORD i = 0; i < nBuffers && SUCCEEDED(hr); i++) {
+		IMFMediaBuffer *pBuffer = NULL;
+		BYTE *pData = NULL;
+		DWORD cbData = 0;
+		hr = pSample->GetBufferByIndex(i, &pBuffer);
+		if (SUCCEEDED(hr)) {
+			hr = pBuffer->Lock(&pData, NULL, &cbData);
+		}
+		if (SUCCEEDED(hr)) {
+			cbData = min(cbData, cbTotal - cbCopied);
+			CopyMemory(pDest + cbCopied, pData, cbData);
+			cbCopied += cbData;
+			pBuffer->Unlock();
+		}
+		SafeRelease(&pBuffer);
+	}
+	if (SUCCEEDED(hr)) {
+		m_preRoll.Commit(llTimeStamp, llDuration);
+	}
+	return hr;
+}
+
+
+//-------------------------------------------------------------------
+// Trigger
+//
+// Stops filling the pre-roll and has the writer thread write it,
+// followed by every sample from now on.  The file starts at the
+// session base when there is one (the session moves it back by the
+// pre-roll), otherwise at the oldest sample kept.
+//-------------------------------------------------------------------
+
+HRESULT CCapture::Trigger()
+{
+	EnterCriticalSection(&m_critsec);
+	if (!m_bArmed) {
+		LeaveCriticalSection(&m_critsec);
+		return S_FALSE;
+	}
+
+	PreRollEntry entry;
+	if (m_pSessionClock) {
+		m_llBaseTime = m_pSessionClock->BaseTime();
+		m_bFirstSample = FALSE;
+	} else if (m_preRoll.GetEntry(0, &entry)) {
+		m_llBaseTime = entry.llTime;
+		m_bFirstSample = FALSE;
+	}
+
+	// OnReadSample did not see these as written samples, so count them
+	// here, in order, before any that follow
+	for (DWORD i = 0; i < m_preRoll.Count(); i++) {
+		m_preRoll.GetEntry(i, &entry);
+		if (entry.llTime < m_llBaseTime) {
+			m_clockTracker.CountEarly();
+		} else {
+			m_clockTracker.AddSample(entry.llTime, entry.llDuration);
+		}
+	}
+	debugMsg(_T("Trigger: %u samples, %I64d ms of pre-roll, %I64d dropped\n"),
+		m_preRoll.Count(), m_preRoll.Duration() / 10000,
+		m_preRoll.DroppedCount());
+
+	// From here OnReadSample queues samples and leaves the ring to the
+	// writer thread
+	m_bArmed = FALSE;
+	InterlockedExchange(&m_bFlushPreRoll, TRUE);
+	SetEvent(m_hSharedEvent ? m_hSharedEvent : m_hSampleEvent);
+
+	LeaveCriticalSection(&m_critsec);
+	return S_OK;
+}
+
+
+BOOL CCapture::IsArmed()
+{
+	EnterCriticalSection(&m_critsec);
+	BOOL bArmed = m_bArmed;
+	LeaveCriticalSection(&m_critsec);
+
+	return bArmed;
+}
+
+
+//-------------------------------------------------------------------
+// WritePreRoll
+//
+// Writes the pre-roll after a trigger.  Called on the writer thread.
+// The sink writer may hold on to the samples it is given, so each one
+// gets a buffer of its own here; this happens once per capture.
+//-------------------------------------------------------------------
+
+void CCapture::WritePreRoll()
+{
+	PreRollEntry entry;
+	for (DWORD i = 0; i < m_preRoll.Count(); i++) {
+		const BYTE *pData = m_preRoll.GetEntry(i, &entry);
+		if (entry.llTime < m_llBaseTime) {
+			continue;
+		}
+		if (FAILED(m_hrWrite)) {
+			m_nUnwritten++;
+			continue;
+		}
+
+		IMFSample *pSample = NULL;
+		IMFMediaBuffer *pBuffer = NULL;
+		BYTE *pDest = NULL;
+		HRESULT hr = MFCreateMemoryBuffer(entry.cbData, &pBuffer);
+		if (SUCCEEDED(hr)) {
+			hr = pBuffer->Lock(&pDest, NULL, NULL);
+		}
+		if (SUCCEEDED(hr)) {
+			CopyMemory(pDest, pData, entry.cbData);
+			pBuffer->Unlock();
+			hr = pBuffer->SetCurrentLength(entry.cbData);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = MFCreateSample(&pSample);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->AddBuffer(pBuffer);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->SetSampleTime(entry.llTime - m_llBaseTime);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->SetSampleDuration(entry.llDuration);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = m_pWriter->WriteSample(m_dwSinkStream, pSample);
+		}
+		SafeRelease(&pSample);
+		SafeRelease(&pBuffer);
+		OnWriteResult(hr);
+	}
+	m_preRoll.Clear();
+	InterlockedExchange(&m_bFlushPreRoll, FALSE);
+}
+
+
+//-------------------------------------------------------------------
+// OnWriteResult
+//
+// Notes the result of writing a sample.  The first failure is posted
+// to the window and stops further writes until the next capture.
+// Called on the writer thread.
+//-------------------------------------------------------------------
+
+void CCapture::OnWriteResult(HRESULT hr)
+{
+	if (FAILED(hr) && SUCCEEDED(m_hrWrite)) {
+		m_hrWrite = hr;
+		NotifyError(hr);
+	}
+}
+
+
+//-------------------------------------------------------------------
+// WriterThreadProc
+//
+// Waits for samples from OnReadSample and writes them.
+//-------------------------------------------------------------------
+
+unsigned __stdcall CCapture::WriterThreadProc(void *pContext)
+{
+	CCapture *pCapture = (CCapture *)pContext;
+
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	while (TRUE) {
+		WaitForSingleObject(pCapture->m_hSampleEvent, INFINITE);
+		pCapture->DrainQueue();
+		if (pCapture->m_bStopWriter) {
+			// Catch anything queued after the last drain
+			pCapture->DrainQueue();
+			break;
+		}
+	}
+
+	if (SUCCEEDED(hr)) {
+		CoUninitialize();
+	}
+	return 0;
+}
+
+
 //-------------------------------------------------------------------
 // CopyAttribute
 //
@@ -879,3 +1690,243 @@ HRESULT CopyAttribute(IMFAttributes *pSrc, IMFAttributes *pDest, const GUID& key
 	PropVariantClear(&var);
 	return hr;
 }
+
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+const UINT32 FAKE_MAX_PLUGGED = 96;
+const UINT32 FAKE_MAX_IDS = 4096;
+const UINT32 FAKE_BURSTS = 300;
+
+// A made-up device, plugged in.  id is the ID the list gave it, or 0
+// before the first check that saw it.
+struct FakeDevice
+{
+	IMFActivate *pActivate;
+	UINT32      serial;
+	UINT32      id;
+};
+
+// What the listener heard, checked against the list after each refresh
+struct DeviceListCheck
+{
+	// Devices added and not yet removed.  A refresh adds the new
+	// devices before it removes the ones gone.
+	UINT32  ids[2 * FAKE_MAX_PLUGGED];
+	UINT32  cIds;
+	BYTE    used[FAKE_MAX_IDS];     // Every ID ever added
+	UINT32  cAdded;
+	UINT32  cRemoved;
+	BOOL    bOk;
+};
+
+static void checkListener(DeviceListEvent event, UINT32 id,
+						  const WCHAR *szName, void *pContext)
+{
+	DeviceListCheck *pCheck = (DeviceListCheck *)pContext;
+	if (event == DeviceList_Added) {
+		pCheck->cAdded++;
+		if (id == 0 || id >= FAKE_MAX_IDS || pCheck->used[id] ||
+			pCheck->cIds == ARRAYSIZE(pCheck->ids) || szName == NULL) {
+			printf("  Device %u added again\n", id);
+			pCheck->bOk = FALSE;
+			return;
+		}
+		pCheck->used[id] = 1;
+		pCheck->ids[pCheck->cIds++] = id;
+	} else {
+		pCheck->cRemoved++;
+		for (UINT32 i = 0; i < pCheck->cIds; i++) {
+			if (pCheck->ids[i] == id) {
+				pCheck->ids[i] = pCheck->ids[--pCheck->cIds];
+				return;
+			}
+		}
+		printf("  Device %u removed but never added\n", id);
+		pCheck->bOk = FALSE;
+	}
+}
+
+// Makes an activation object that holds only what the list reads: the
+// link under both keys, and the friendly name.  An audio renderer's
+// serves, as it is never activated.
+static HRESULT createFakeDevice(UINT32 serial, FakeDevice *pDevice)
+{
+	WCHAR szLink[128], szName[64];
+	IMFActivate *pActivate = NULL;
+	HRESULT hr = MFCreateAudioRendererActivate(&pActivate);
+	if (SUCCEEDED(hr)) {
+		hr = StringCchPrintfW(szLink, ARRAYSIZE(szLink),
+			L"\\\\?\\usb#vid_%04x&pid_%04x#%u#"
+			L"{65e8773d-8f56-11d0-a3b9-00a0c9223196}\\global",
+			serial & 0xFFFF, (serial * 7) & 0xFFFF, serial);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = StringCchPrintfW(szName, ARRAYSIZE(szName), L"Fake device %u",
+			serial);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pActivate->SetString(
+			MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID, szLink);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pActivate->SetString(
+			MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK, szLink);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pActivate->SetString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, szName);
+	}
+	if (SUCCEEDED(hr)) {
+		pDevice->pActivate = pActivate;
+		pDevice->serial = serial;
+		pDevice->id = 0;
+	} else {
+		SafeRelease(&pActivate);
+	}
+	return hr;
+}
+
+// Checks the list against the plugged devices and what the listener
+// heard.  A device keeps the ID it was first seen with.
+static BOOL checkDeviceList(DeviceList *pList, FakeDevice *pPlugged,
+							UINT32 cPlugged, const DeviceListCheck *pCheck)
+{
+	if (pList->Count() != cPlugged || pCheck->cIds != cPlugged) {
+		printf("  %u devices listed and %u heard of, with %u plugged in\n",
+			pList->Count(), pCheck->cIds, cPlugged);
+		return FALSE;
+	}
+	for (UINT32 i = 0; i < pList->Count(); i++) {
+		WCHAR *szName = NULL;
+		UINT32 id = pList->GetDeviceId(i);
+		UINT32 serial = 0;
+		BOOL bHeard = FALSE;
+		if (FAILED(pList->GetDeviceName(i, &szName))) {
+			return FALSE;
+		}
+		serial = wcstoul(szName + wcslen(L"Fake device "), NULL, 10);
+		CoTaskMemFree(szName);
+
+		for (UINT32 k = 0; k < pCheck->cIds; k++) {
+			bHeard = bHeard || pCheck->ids[k] == id;
+		}
+		UINT32 j = 0;
+		while (j < cPlugged && pPlugged[j].serial != serial) {
+			j++;
+		}
+		if (j == cPlugged || !bHeard) {
+			printf("  Device %u (ID %u) is listed but %s\n", serial, id,
+				j == cPlugged ? "not plugged in" : "was not heard of");
+			return FALSE;
+		}
+		if (pPlugged[j].id == 0) {
+			pPlugged[j].id = id;
+		} else if (pPlugged[j].id != id) {
+			printf("  Device %u changed ID from %u to %u\n", serial,
+				pPlugged[j].id, id);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Plugs and unplugs made-up devices in random bursts, merging each
+// burst into a DeviceList the way a WM_DEVICECHANGE refresh does, and
+// checks after each that the list matches the devices plugged in,
+// that every device kept its ID, and that no ID was used twice.  Every
+// hundred bursts the list switches between audio and video.
+void benchmarkDeviceList(void)
+{
+	FakeDevice plugged[FAKE_MAX_PLUGGED];
+	IMFActivate *ppSources[FAKE_MAX_PLUGGED];
+	UINT32 cPlugged = 0;
+	UINT32 nextSerial = 0;
+	UINT32 cRefreshes = 0;
+	BOOL useAudio = TRUE;
+	LONGLONG qpcMerge = 0;
+	LARGE_INTEGER freq, tStart, tEnd;
+	HRESULT hr = S_OK;
+
+	DeviceListCheck *pCheck = new (std::nothrow) DeviceListCheck;
+	DeviceList *pList = new (std::nothrow) DeviceList;
+	if (pCheck == NULL || pList == NULL) {
+		printf("Out of memory\n");
+		delete pCheck;
+		delete pList;
+		return;
+	}
+	ZeroMemory(pCheck, sizeof(*pCheck));
+	pCheck->bOk = TRUE;
+	pList->AddListener(checkListener, pCheck);
+	QueryPerformanceFrequency(&freq);
+	srand(1);
+
+	printf("Device list check, %u bursts of 1 to 8 plug and unplug events, "
+		"up to %u devices\n", FAKE_BURSTS, FAKE_MAX_PLUGGED);
+	for (; cPlugged < 32 && SUCCEEDED(hr); cPlugged++) {
+		hr = createFakeDevice(nextSerial++, &plugged[cPlugged]);
+	}
+	for (UINT32 burst = 0; burst <= FAKE_BURSTS && SUCCEEDED(hr) &&
+		pCheck->bOk; burst++) {
+		// The first refresh finds the devices plugged in at the start
+		UINT32 nEvents = burst == 0 ? 0 : 1 + rand() % 8;
+		for (UINT32 e = 0; e < nEvents && SUCCEEDED(hr); e++) {
+			if ((rand() % 2 && cPlugged > 1) || cPlugged == FAKE_MAX_PLUGGED) {
+				UINT32 j = rand() % cPlugged;
+				SafeRelease(&plugged[j].pActivate);
+				memmove(&plugged[j], &plugged[j + 1],
+					(cPlugged - j - 1) * sizeof(FakeDevice));
+				cPlugged--;
+			} else {
+				// New devices show up anywhere in the enumeration
+				UINT32 j = rand() % (cPlugged + 1);
+				memmove(&plugged[j + 1], &plugged[j],
+					(cPlugged - j) * sizeof(FakeDevice));
+				cPlugged++;
+				hr = createFakeDevice(nextSerial++, &plugged[j]);
+				if (FAILED(hr)) {
+					memmove(&plugged[j], &plugged[j + 1],
+						(cPlugged - j - 1) * sizeof(FakeDevice));
+					cPlugged--;
+				}
+			}
+		}
+		if (burst > 0 && burst % 100 == 0) {
+			useAudio = !useAudio;
+			for (UINT32 j = 0; j < cPlugged; j++) {
+				plugged[j].id = 0;
+			}
+		}
+
+		// Enumerated in reverse now and then, which the list must not
+		// take for a change
+		for (UINT32 j = 0; j < cPlugged; j++) {
+			ppSources[j] = plugged[burst % 7 == 3 ? cPlugged - 1 - j : j].pActivate;
+		}
+		QueryPerformanceCounter(&tStart);
+		if (SUCCEEDED(hr)) {
+			hr = pList->Merge(useAudio, ppSources, cPlugged);
+		}
+		QueryPerformanceCounter(&tEnd);
+		qpcMerge += tEnd.QuadPart - tStart.QuadPart;
+		cRefreshes++;
+		if (SUCCEEDED(hr) && pCheck->bOk) {
+			pCheck->bOk = checkDeviceList(pList, plugged, cPlugged, pCheck);
+		}
+	}
+
+	if (FAILED(hr)) {
+		printErrorDescription(hr);
+	}
+	printf("  %u refreshes, %u devices added, %u removed, %u plugged in at "
+		"the end, %.1f us a refresh: %s\n", cRefreshes, pCheck->cAdded,
+		pCheck->cRemoved, cPlugged, 1e6 * qpcMerge / freq.QuadPart /
+		max(cRefreshes, 1U), SUCCEEDED(hr) && pCheck->bOk ? "ok" : "FAILED");
+
+	delete pList;
+	delete pCheck;
+	for (UINT32 j = 0; j < cPlugged; j++) {
+		SafeRelease(&plugged[j].pActivate);
+	}
+}
@@ -14,32 +14,98 @@
 #pragma once
 
 #include "stdafx.h"
+#include "sampleQueue.h"
+#include "sessionClock.h"
+#include "preRollBuffer.h"
 
 const UINT WM_APP_PREVIEW_ERROR = WM_APP + 1;    // wparam = HRESULT
 
+// What a refresh of a DeviceList found
+enum DeviceListEvent
+{
+    DeviceList_Added,
+    DeviceList_Removed,
+};
+
+// Called on the thread that refreshes the list, with the device still
+// in it.  szName is valid for the call only.
+typedef void (*DeviceListProc)(DeviceListEvent event, UINT32 id,
+    const WCHAR *szName, void *pContext);
+
+const UINT32 DEVICE_LIST_MAX_LISTENERS = 4;
+
+// The capture devices of one kind.  Each refresh is compared with the
+// last, so a device that stays keeps its place and its ID, and the
+// listeners hear only of the devices that came or went.  A device's
+// IMFActivate is created when it is first asked for.
 class DeviceList
 {
+    struct Device
+    {
+        UINT32      id;
+        WCHAR       *szLink;        // Symbolic link or endpoint ID
+        WCHAR       *szName;
+        IMFActivate *pActivate;     // NULL until asked for
+    };
+
+    struct Listener
+    {
+        DeviceListProc  pfn;
+        void            *pContext;
+    };
+
     UINT32      m_cDevices;
-    IMFActivate **m_ppDevices;
-	BOOL m_useAudio;
+    UINT32      m_cAllocated;
+    Device      *m_pDevices;
+    UINT32      m_nextId;
+    BOOL        m_useAudio;
+    Listener    m_listeners[DEVICE_LIST_MAX_LISTENERS];
+    UINT32      m_cListeners;
+
+    const GUID& LinkKey() const;
+    UINT32  Find(const WCHAR *szLink, UINT32 iStart) const;
+    HRESULT Add(WCHAR *szLink, IMFActivate *pSource);
+    void    Remove(UINT32 index);
+    void    Publish(DeviceListEvent event, const Device& device);
 
 public:
-    DeviceList() : m_ppDevices(NULL), m_cDevices(0), m_useAudio(0)
+    DeviceList() : m_cDevices(0), m_cAllocated(0), m_pDevices(NULL),
+        m_nextId(1), m_useAudio(0), m_cListeners(0)
     {
 
     }
     ~DeviceList()
     {
+        m_cListeners = 0;
         Clear();
+        delete [] m_pDevices;
     }
 
     UINT32  Count() const { return m_cDevices; }
 
+    // Forgets every device, telling the listeners of each
     void    Clear();
+    // Enumerates the devices and brings the list up to date.  Switching
+    // between audio and video replaces every device.
     HRESULT EnumerateDevices(BOOL useAudio);
+    // Brings the list up to date with an enumeration of cSources
+    // devices, which the caller still owns.  EnumerateDevices calls it
+    // with MFEnumDeviceSources' list; -devicebench with made-up ones.
+    HRESULT Merge(BOOL useAudio, IMFActivate **ppSources, UINT32 cSources);
+    // Creates the device's IMFActivate the first time it is asked for
     HRESULT GetDevice(UINT32 index, IMFActivate **ppActivate);
     HRESULT GetDeviceName(UINT32 index, WCHAR **ppszName);
-	BOOL	IsAudio();
+    // The ID of a device, which stays the same while it is in the list.
+    // IDs are never 0 and never reused.
+    UINT32  GetDeviceId(UINT32 index) const;
+    // The index of a device by ID, or E_INVALIDARG if it has gone
+    HRESULT FindDevice(UINT32 id, UINT32 *pIndex) const;
+    // Releases every IMFActivate handed out, and with it the media
+    // source activated from it.  The next GetDevice creates a new one.
+    void    ReleaseDevices();
+    HRESULT AddListener(DeviceListProc pfn, void *pContext);
+    void    RemoveListener(DeviceListProc pfn, void *pContext);
+    BOOL    IsAudio();
 };
 
 
@@ -49,6 +115,19 @@ struct EncodingParameters
     UINT32  bitrate;
 };
 
+// Makes the source reader and sink writer of a capture in place of
+// the device's and the file's, so captures can be run without
+// hardware.  The reader must deliver samples to pCallback as an
+// asynchronous source reader does.
+class CaptureFactory
+{
+public:
+    virtual HRESULT CreateReader(IMFActivate *pActivate,
+        IMFSourceReaderCallback *pCallback, IMFSourceReader **ppReader) = 0;
+    virtual HRESULT CreateWriter(const WCHAR *pwszFileName,
+        IMFSinkWriter **ppWriter) = 0;
+};
+
 class CCapture : public IMFSourceReaderCallback
 {
 public:
@@ -86,6 +165,31 @@ public:
     HRESULT     EndCaptureSession();
     BOOL        IsCapturing();
     HRESULT     CheckDeviceLost(DEV_BROADCAST_HDR *pHdr, BOOL *pbDeviceLost);
+    void        GetQueueStats(SampleQueueStats *pStats) { m_queue.GetStats(pStats); }
+
+    // Has the samples written by a thread the caller owns instead of
+    // one per capture.  hEvent is signaled when samples are queued, and
+    // the owner calls DrainQueue from its thread.  Must be called
+    // before StartCapture.
+    void        SetSharedWriter(HANDLE hEvent) { m_hSharedEvent = hEvent; }
+    void        DrainQueue();
+
+    // Rebases the sample times against a clock shared with other
+    // captures instead of this capture's first sample.  Must be called
+    // before StartCapture.
+    void        SetSessionClock(const SessionClock *pClock) { m_pSessionClock = pClock; }
+    void        GetAlignment(ClockAlignment *pAlign);
+
+    // Keeps the last dwSeconds of samples in memory instead of writing
+    // them, until Trigger writes them and everything after.  0 writes
+    // from the start.  Must be called before StartCapture.
+    void        SetPreRoll(DWORD dwSeconds) { m_dwPreRollSeconds = dwSeconds; }
+
+    // Captures through the factory's reader and writer instead of
+    // activating the device.  Must be called before StartCapture.
+    void        SetFactory(CaptureFactory *pFactory) { m_pFactory = pFactory; }
+    HRESULT     Trigger();
+    BOOL        IsArmed();
 
 protected:
 
@@ -108,6 +212,20 @@ protected:
     HRESULT ConfigureCapture(const EncodingParameters& param, BOOL useAudio);
     HRESULT EndCaptureInternal();
 
+    // Pre-roll.  While armed, OnReadSample copies samples into the
+    // ring; after Trigger the writer thread writes the ring before
+    // anything queued.
+    HRESULT StartPreRoll();
+    HRESULT CopyToPreRoll(IMFSample *pSample, LONGLONG llTimeStamp);
+    void    WritePreRoll();
+
+    // Writer thread.  OnReadSample only queues samples; the writer
+    // thread passes them to the sink writer.
+    static unsigned __stdcall WriterThreadProc(void *pContext);
+    HRESULT StartWriterThread();
+    void    StopWriterThread();
+    void    OnWriteResult(HRESULT hr);
+
     long                    m_nRefCount;        // Reference count.
     CRITICAL_SECTION        m_critsec;
 
@@ -115,11 +233,33 @@ protected:
 
     IMFSourceReader         *m_pReader;
     IMFSinkWriter           *m_pWriter;
+    DWORD                   m_dwSinkStream;     // Stream index in the sink writer.
+
+    SampleQueue             m_queue;            // Samples waiting for the writer thread.
+    HANDLE                  m_hWriterThread;
+    HANDLE                  m_hSampleEvent;     // Signaled when samples are queued.
+    HANDLE                  m_hSharedEvent;     // Shared writer's event, or NULL.
+    volatile BOOL           m_bStopWriter;
+    HRESULT                 m_hrWrite;          // First failed write, or S_OK.
+    LONG                    m_nUnwritten;       // Samples dropped after it.
 
     BOOL                    m_bFirstSample;
     LONGLONG                m_llBaseTime;
+    const SessionClock      *m_pSessionClock;   // Shared time base, or NULL.
+    ClockTracker            m_clockTracker;     // Drift of the device clock.
+
+    PreRollBuffer           m_preRoll;          // Samples before the trigger.
+    DWORD                   m_dwPreRollSeconds;
+    BOOL                    m_bArmed;           // Filling the pre-roll.
+    volatile LONG           m_bFlushPreRoll;    // Triggered, pre-roll not yet written.
 
     WCHAR                   *m_pwszSymbolicLink;
+    CaptureFactory          *m_pFactory;        // Stands in for the device, or NULL.
 
 	int						m_useAudio;
-};
\ No newline at end of file
+};
+
+// Merges random bursts of made-up devices plugging in and out into a
+// DeviceList, and checks the list, the IDs and the listener events
+// after each
+void benchmarkDeviceList(void);
@@ -0,0 +1,1271 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// captureSession.cpp: Captures from several devices at once.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "utils.h"
+#include "mfUtils.h"
+
+#include "captureSession.h"
+
+CaptureSession::CaptureSession(HWND hwnd, BOOL useAudio) :
+m_hwndEvent(hwnd),
+m_useAudio(useAudio),
+m_bCapturing(FALSE),
+m_bArmed(FALSE),
+m_dwPreRollSeconds(0),
+m_pFactory(NULL),
+m_bStopWriters(FALSE),
+m_cDevices(0),
+m_cThreads(0),
+m_tStart(0),
+m_msecCaptured(0)
+{
+	ZeroMemory(m_devices, sizeof(m_devices));
+	ZeroMemory(m_threads, sizeof(m_threads));
+}
+
+CaptureSession::~CaptureSession()
+{
+	Stop();
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		SafeRelease(&m_devices[i].pActivate);
+	}
+}
+
+//-------------------------------------------------------------------
+// AddDevice
+//
+// Adds a device to the session.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::AddDevice(IMFActivate *pActivate,
+								  const WCHAR *pwszFileName)
+{
+	if (m_bCapturing) {
+		return MF_E_INVALIDREQUEST;
+	}
+	if (m_cDevices == MAX_SESSION_DEVICES) {
+		return E_OUTOFMEMORY;
+	}
+
+	Device *pDevice = &m_devices[m_cDevices];
+	HRESULT hr = StringCchCopyW(pDevice->szFileName, MAX_PATH, pwszFileName);
+	if (FAILED(hr)) {
+		return hr;
+	}
+	pDevice->pActivate = pActivate;
+	pDevice->pActivate->AddRef();
+	pDevice->pCapture = NULL;
+	pDevice->hr = S_OK;
+	m_cDevices++;
+	return S_OK;
+}
+
+//-------------------------------------------------------------------
+// Start
+//
+// Starts capturing from every device.  A device that fails to start
+// is reported and skipped; Start fails only if none could be started.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::Start(const EncodingParameters &param)
+{
+	HRESULT hr = S_OK;
+	UINT32 cStarted = 0;
+
+	if (m_bCapturing || m_cDevices == 0) {
+		return MF_E_INVALIDREQUEST;
+	}
+
+	// One writer thread per device, up to the number of processors
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	m_cThreads = min(m_cDevices, (UINT32)si.dwNumberOfProcessors);
+	if (m_cThreads == 0) {
+		m_cThreads = 1;
+	}
+	for (UINT32 i = 0; i < m_cThreads; i++) {
+		m_threads[i].pSession = this;
+		m_threads[i].iThread = i;
+		m_threads[i].hThread = NULL;
+		m_threads[i].hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_threads[i].hEvent == NULL) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			goto DONE;
+		}
+	}
+
+	// Start the captures.  Device i is written by thread i % m_cThreads.
+	m_clock.Start();
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		Device *pDevice = &m_devices[i];
+		pDevice->hr = CCapture::CreateInstance(m_hwndEvent, m_useAudio,
+			&pDevice->pCapture);
+		if (SUCCEEDED(pDevice->hr)) {
+			pDevice->pCapture->SetSharedWriter(
+				m_threads[i % m_cThreads].hEvent);
+			pDevice->pCapture->SetSessionClock(&m_clock);
+			pDevice->pCapture->SetPreRoll(m_dwPreRollSeconds);
+			pDevice->pCapture->SetFactory(m_pFactory);
+			pDevice->hr = pDevice->pCapture->StartCapture(pDevice->pActivate,
+				pDevice->szFileName, param);
+		}
+		if (FAILED(pDevice->hr)) {
+			debugMsg(_T("CaptureSession::Start: device %u failed (0x%08X)\n"),
+				i, pDevice->hr);
+			if (pDevice->pCapture) {
+				pDevice->pCapture->EndCaptureSession();
+				SafeRelease(&pDevice->pCapture);
+			}
+			hr = pDevice->hr;
+			continue;
+		}
+		cStarted++;
+	}
+	if (cStarted == 0) {
+		goto DONE;
+	}
+	hr = S_OK;
+
+	// Start the writer threads
+	m_bStopWriters = FALSE;
+	for (UINT32 i = 0; i < m_cThreads; i++) {
+		m_threads[i].hThread = (HANDLE)_beginthreadex(NULL, 0,
+			WriterThreadProc, &m_threads[i], 0, NULL);
+		if (m_threads[i].hThread == NULL) {
+			hr = E_FAIL;
+			goto DONE;
+		}
+	}
+
+	m_bCapturing = TRUE;
+	m_bArmed = (m_dwPreRollSeconds > 0);
+	m_tStart = GetTickCount();
+
+DONE:
+	if (FAILED(hr)) {
+		m_bCapturing = TRUE;
+		Stop();
+	}
+	return hr;
+}
+
+//-------------------------------------------------------------------
+// Stop
+//
+// Stops every capture and finalizes the files.  Returns the first
+// error.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::Stop()
+{
+	HRESULT hr = S_OK;
+
+	if (!m_bCapturing) {
+		return S_OK;
+	}
+
+	// Stopping before the trigger keeps what the pre-roll holds
+	Trigger();
+	m_msecCaptured = GetTickCount() - m_tStart;
+
+	// Write everything queued so far, then let each capture write
+	// what arrived since and finalize its file
+	StopWriterThreads();
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		Device *pDevice = &m_devices[i];
+		if (pDevice->pCapture == NULL) {
+			continue;
+		}
+		HRESULT hrEnd = pDevice->pCapture->EndCaptureSession();
+		if (FAILED(hrEnd) && SUCCEEDED(hr)) {
+			hr = hrEnd;
+		}
+		pDevice->pCapture->GetQueueStats(&pDevice->stats);
+		pDevice->pCapture->GetAlignment(&pDevice->align);
+		SafeRelease(&pDevice->pCapture);
+
+		hrEnd = WriteAlignment(pDevice);
+		if (FAILED(hrEnd)) {
+			debugMsg(_T("CaptureSession::Stop: no alignment file for device %u (0x%08X)\n"),
+				i, hrEnd);
+		}
+	}
+
+	for (UINT32 i = 0; i < m_cThreads; i++) {
+		if (m_threads[i].hEvent) {
+			CloseHandle(m_threads[i].hEvent);
+			m_threads[i].hEvent = NULL;
+		}
+	}
+	m_bCapturing = FALSE;
+	return hr;
+}
+
+//-------------------------------------------------------------------
+// Trigger
+//
+// Moves the session base back by the pre-roll and triggers every
+// capture, so each writes what it kept and everything after.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::Trigger()
+{
+	HRESULT hr = S_OK;
+
+	if (!m_bArmed) {
+		return S_FALSE;
+	}
+
+	m_clock.StartAt(MFGetSystemTime() - m_dwPreRollSeconds * 10000000LL);
+	m_tStart = GetTickCount() - m_dwPreRollSeconds * 1000;
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		if (m_devices[i].pCapture == NULL) {
+			continue;
+		}
+		HRESULT hrTrigger = m_devices[i].pCapture->Trigger();
+		if (FAILED(hrTrigger) && SUCCEEDED(hr)) {
+			hr = hrTrigger;
+		}
+	}
+	m_bArmed = FALSE;
+	return hr;
+}
+
+//-------------------------------------------------------------------
+// CheckDeviceLost
+//
+// Checks whether any of the devices was removed.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::CheckDeviceLost(DEV_BROADCAST_HDR *pHdr,
+										BOOL *pbDeviceLost)
+{
+	if (pbDeviceLost == NULL) {
+		return E_POINTER;
+	}
+
+	*pbDeviceLost = FALSE;
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		if (m_devices[i].pCapture == NULL) {
+			continue;
+		}
+		BOOL bLost = FALSE;
+		HRESULT hr = m_devices[i].pCapture->CheckDeviceLost(pHdr, &bLost);
+		if (FAILED(hr)) {
+			return hr;
+		}
+		if (bLost) {
+			*pbDeviceLost = TRUE;
+			break;
+		}
+	}
+	return S_OK;
+}
+
+//-------------------------------------------------------------------
+// GetReport
+//
+// Describes the samples written and dropped for each device.
+//-------------------------------------------------------------------
+
+void CaptureSession::GetReport(WCHAR *pszReport, size_t cchReport)
+{
+	double seconds = m_msecCaptured / 1000.0;
+
+	StringCchPrintfW(pszReport, cchReport,
+		L"Captured %u device(s) for %.1f sec with %u writer thread(s)\n\n",
+		m_cDevices, seconds, m_cThreads);
+	for (UINT32 i = 0; i < m_cDevices; i++) {
+		Device *pDevice = &m_devices[i];
+		WCHAR szLine[MAX_PATH + 128];
+		if (FAILED(pDevice->hr)) {
+			StringCchPrintfW(szLine, ARRAYSIZE(szLine),
+				L"%s: not started (0x%08X)\n",
+				PathFindFileNameW(pDevice->szFileName), pDevice->hr);
+		} else {
+			StringCchPrintfW(szLine, ARRAYSIZE(szLine),
+				L"%s: %I64d samples (%.1f/sec), %d dropped, queue high water %d, "
+				L"offset %.3f ms, drift %+.1f ppm\n",
+				PathFindFileNameW(pDevice->szFileName), pDevice->stats.nPushed,
+				seconds > 0 ? pDevice->stats.nPushed / seconds : 0.0,
+				pDevice->stats.nOverruns, pDevice->stats.nHighWater,
+				pDevice->align.llStartOffset / 10000.0, pDevice->align.driftPpm);
+		}
+		StringCchCatW(pszReport, cchReport, szLine);
+	}
+}
+
+//-------------------------------------------------------------------
+// GetDeviceStats
+//
+// Gives the queue counters and clock alignment of one device.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::GetDeviceStats(UINT32 index, SampleQueueStats *pStats,
+									   ClockAlignment *pAlign) const
+{
+	if (index >= m_cDevices) {
+		return E_INVALIDARG;
+	}
+	if (FAILED(m_devices[index].hr)) {
+		return m_devices[index].hr;
+	}
+	*pStats = m_devices[index].stats;
+	*pAlign = m_devices[index].align;
+	return S_OK;
+}
+
+//-------------------------------------------------------------------
+// WriteAlignment
+//
+// Writes <file>.align.txt, giving where the file starts on the session
+// timeline and how fast the device clock ran.  To line the files up,
+// delay each by its offset; to keep them aligned over a long capture,
+// resample each by its drift.
+//-------------------------------------------------------------------
+
+HRESULT CaptureSession::WriteAlignment(const Device *pDevice)
+{
+	WCHAR szPath[MAX_PATH];
+	char szText[512];
+	DWORD cbWritten = 0;
+
+	HRESULT hr = StringCchPrintfW(szPath, MAX_PATH, L"%s.align.txt",
+		pDevice->szFileName);
+	if (SUCCEEDED(hr)) {
+		hr = StringCchPrintfA(szText, ARRAYSIZE(szText),
+			"start_offset_100ns=%I64d\r\n"
+			"start_offset_ms=%.3f\r\n"
+			"drift_ppm=%.3f\r\n"
+			"samples=%I64d\r\n"
+			"early_samples_dropped=%I64d\r\n",
+			pDevice->align.llStartOffset,
+			pDevice->align.llStartOffset / 10000.0,
+			pDevice->align.driftPpm,
+			pDevice->align.nSamples,
+			pDevice->align.nEarly);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	HANDLE hFile = CreateFileW(szPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (!WriteFile(hFile, szText, (DWORD)strlen(szText), &cbWritten, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	CloseHandle(hFile);
+	return hr;
+}
+
+//-------------------------------------------------------------------
+// WriterThreadProc
+//
+// Writes the samples of the devices assigned to one thread.
+//-------------------------------------------------------------------
+
+unsigned __stdcall CaptureSession::WriterThreadProc(void *pContext)
+{
+	WriterThread *pThread = (WriterThread *)pContext;
+	CaptureSession *pSession = pThread->pSession;
+
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+	while (TRUE) {
+		WaitForSingleObject(pThread->hEvent, INFINITE);
+		pSession->DrainDevices(pThread->iThread);
+		if (pSession->m_bStopWriters) {
+			// Catch anything queued after the last drain
+			pSession->DrainDevices(pThread->iThread);
+			break;
+		}
+	}
+
+	if (SUCCEEDED(hr)) {
+		CoUninitialize();
+	}
+	return 0;
+}
+
+// Drains the queues of the devices written by one thread
+void CaptureSession::DrainDevices(UINT32 iThread)
+{
+	for (UINT32 i = iThread; i < m_cDevices; i += m_cThreads) {
+		if (m_devices[i].pCapture) {
+			m_devices[i].pCapture->DrainQueue();
+		}
+	}
+}
+
+// Tells the writer threads to finish and waits for them
+void CaptureSession::StopWriterThreads()
+{
+	m_bStopWriters = TRUE;
+	for (UINT32 i = 0; i < m_cThreads; i++) {
+		if (m_threads[i].hThread) {
+			SetEvent(m_threads[i].hEvent);
+		}
+	}
+	for (UINT32 i = 0; i < m_cThreads; i++) {
+		if (m_threads[i].hThread) {
+			WaitForSingleObject(m_threads[i].hThread, INFINITE);
+			CloseHandle(m_threads[i].hThread);
+			m_threads[i].hThread = NULL;
+		}
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// Every synthetic device delivers 10 ms of 48 kHz stereo float
+const LONGLONG SYNTH_PERIOD_HNS = 100000;
+const DWORD SYNTH_SAMPLE_BYTES = 480 * 8;
+
+static HRESULT createSyntheticType(IMFMediaType **ppType)
+{
+	IMFMediaType *pType = NULL;
+	HRESULT hr = MFCreateMediaType(&pType);
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_Float);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_NUM_CHANNELS, 2);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, 48000);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, 32);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, 8);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = pType->SetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, 48000 * 8);
+	}
+	if (SUCCEEDED(hr)) {
+		*ppType = pType;
+		pType->AddRef();
+	}
+	SafeRelease(&pType);
+	return hr;
+}
+
+// An asynchronous source reader for a device that is not there.  Each
+// ReadSample is answered on the reader's thread when the next sample
+// is due.  The device clock runs driftPpm fast, and samples are
+// stamped with the host time they were due, as a device stamps them.
+class SyntheticReader : public IMFSourceReader
+{
+	LONG m_nRefCount;
+	IMFSourceReaderCallback *m_pCallback;
+	HANDLE m_hThread;
+	HANDLE m_hRequest;          // Signaled by ReadSample
+	volatile BOOL m_bStop;
+	LONGLONG m_llStart;         // Host time of the first sample
+	double m_period;            // Host time between samples
+
+public:
+	LONG m_nDelivered;
+
+	SyntheticReader(IMFSourceReaderCallback *pCallback, double driftPpm) :
+	m_nRefCount(1), m_pCallback(pCallback), m_hThread(NULL), m_hRequest(NULL),
+	m_bStop(FALSE), m_llStart(MFGetSystemTime()),
+	m_period(SYNTH_PERIOD_HNS / (1.0 + driftPpm * 1e-6)), m_nDelivered(0)
+	{
+		m_pCallback->AddRef();
+	}
+
+	HRESULT Start()
+	{
+		m_hRequest = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hRequest == NULL) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		m_hThread = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, this, 0, NULL);
+		return m_hThread ? S_OK : E_FAIL;
+	}
+
+	// Stops the thread and lets go of the capture
+	void Shutdown()
+	{
+		if (m_hThread) {
+			m_bStop = TRUE;
+			SetEvent(m_hRequest);
+			WaitForSingleObject(m_hThread, INFINITE);
+			CloseHandle(m_hThread);
+			m_hThread = NULL;
+		}
+		if (m_hRequest) {
+			CloseHandle(m_hRequest);
+			m_hRequest = NULL;
+		}
+		SafeRelease(&m_pCallback);
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFSourceReader)) {
+			*ppv = static_cast<IMFSourceReader *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			Shutdown();
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFSourceReader methods
+	STDMETHODIMP ReadSample(DWORD, DWORD, DWORD *, DWORD *, LONGLONG *, IMFSample **)
+	{
+		SetEvent(m_hRequest);
+		return S_OK;
+	}
+	STDMETHODIMP GetNativeMediaType(DWORD dwStream, DWORD dwIndex, IMFMediaType **ppType)
+	{
+		if (dwStream != 0 && dwStream != (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM) {
+			return MF_E_INVALIDSTREAMNUMBER;
+		}
+		if (dwIndex > 0) {
+			return MF_E_NO_MORE_TYPES;
+		}
+		return createSyntheticType(ppType);
+	}
+	STDMETHODIMP GetCurrentMediaType(DWORD dwStream, IMFMediaType **ppType)
+	{
+		return GetNativeMediaType(dwStream, 0, ppType);
+	}
+	STDMETHODIMP SetCurrentMediaType(DWORD, DWORD *, IMFMediaType *) { return S_OK; }
+	STDMETHODIMP GetStreamSelection(DWORD, BOOL *) { return E_NOTIMPL; }
+	STDMETHODIMP SetStreamSelection(DWORD, BOOL) { return E_NOTIMPL; }
+	STDMETHODIMP SetCurrentPosition(REFGUID, REFPROPVARIANT) { return E_NOTIMPL; }
+	STDMETHODIMP Flush(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP GetServiceForStream(DWORD, REFGUID, REFIID, LPVOID *) { return E_NOTIMPL; }
+	STDMETHODIMP GetPresentationAttribute(DWORD, REFGUID, PROPVARIANT *) { return E_NOTIMPL; }
+
+private:
+	static unsigned __stdcall ThreadProc(void *pContext);
+};
+
+unsigned __stdcall SyntheticReader::ThreadProc(void *pContext)
+{
+	SyntheticReader *pReader = (SyntheticReader *)pContext;
+
+	for (;;) {
+		WaitForSingleObject(pReader->m_hRequest, INFINITE);
+		if (pReader->m_bStop) {
+			break;
+		}
+
+		// Wait until the sample is due
+		LONGLONG llDue = pReader->m_llStart +
+			(LONGLONG)(pReader->m_nDelivered * pReader->m_period);
+		LONGLONG llNow = MFGetSystemTime();
+		if (llNow < llDue) {
+			Sleep((DWORD)((llDue - llNow) / 10000));
+		}
+
+		// Each sample starts with its sequence number
+		IMFSample *pSample = NULL;
+		IMFMediaBuffer *pBuffer = NULL;
+		BYTE *pData = NULL;
+		HRESULT hr = MFCreateSample(&pSample);
+		if (SUCCEEDED(hr)) {
+			hr = MFCreateMemoryBuffer(SYNTH_SAMPLE_BYTES, &pBuffer);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pBuffer->Lock(&pData, NULL, NULL);
+		}
+		if (SUCCEEDED(hr)) {
+			ZeroMemory(pData, SYNTH_SAMPLE_BYTES);
+			CopyMemory(pData, &pReader->m_nDelivered, sizeof(LONG));
+			pBuffer->Unlock();
+			hr = pBuffer->SetCurrentLength(SYNTH_SAMPLE_BYTES);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->AddBuffer(pBuffer);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pSample->SetSampleDuration(SYNTH_PERIOD_HNS);
+		}
+		pReader->m_pCallback->OnReadSample(hr, 0, 0, llDue,
+			SUCCEEDED(hr) ? pSample : NULL);
+		pReader->m_nDelivered++;
+		SafeRelease(&pBuffer);
+		SafeRelease(&pSample);
+	}
+	return 0;
+}
+
+// The sequence number a synthetic sample starts with, or -1
+static LONG readSequence(IMFSample *pSample)
+{
+	IMFMediaBuffer *pBuffer = NULL;
+	BYTE *pData = NULL;
+	DWORD cbData = 0;
+	LONG seq = -1;
+
+	if (SUCCEEDED(pSample->GetBufferByIndex(0, &pBuffer)) &&
+		SUCCEEDED(pBuffer->Lock(&pData, NULL, &cbData))) {
+		if (cbData >= sizeof(LONG)) {
+			CopyMemory(&seq, pData, sizeof(LONG));
+		}
+		pBuffer->Unlock();
+	}
+	SafeRelease(&pBuffer);
+	return seq;
+}
+
+// A sink writer that takes usecWrite per sample, stalls once for
+// msecStall if asked, and checks that sample times only increase.  It
+// also counts breaks in the sequence numbers, and steps between sample
+// times more than 1% off the period.
+class SyntheticWriter : public IMFSinkWriter
+{
+	LONG m_nRefCount;
+	DWORD m_usecWrite;
+	DWORD m_msecStall;
+	LONGLONG m_llLast;
+	LONG m_nLastSeq;
+	LARGE_INTEGER m_freq;
+
+public:
+	LONG m_nWritten;
+	LONG m_nOutOfOrder;
+	LONG m_nSeqBreaks;
+	LONG m_nUneven;
+	LONGLONG m_llFirst;         // Time of the first sample written
+
+	SyntheticWriter(DWORD usecWrite, DWORD msecStall) :
+	m_nRefCount(1), m_usecWrite(usecWrite), m_msecStall(msecStall),
+	m_llLast(-1), m_nLastSeq(-1), m_nWritten(0), m_nOutOfOrder(0),
+	m_nSeqBreaks(0), m_nUneven(0), m_llFirst(-1)
+	{
+		QueryPerformanceFrequency(&m_freq);
+	}
+
+	// IUnknown methods
+	STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+	{
+		if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFSinkWriter)) {
+			*ppv = static_cast<IMFSinkWriter *>(this);
+			AddRef();
+			return S_OK;
+		}
+		*ppv = NULL;
+		return E_NOINTERFACE;
+	}
+	STDMETHODIMP_(ULONG) AddRef()
+	{
+		return InterlockedIncrement(&m_nRefCount);
+	}
+	STDMETHODIMP_(ULONG) Release()
+	{
+		ULONG uCount = InterlockedDecrement(&m_nRefCount);
+		if (uCount == 0) {
+			delete this;
+		}
+		return uCount;
+	}
+
+	// IMFSinkWriter methods
+	STDMETHODIMP WriteSample(DWORD, IMFSample *pSample)
+	{
+		LONGLONG llTime = 0;
+		pSample->GetSampleTime(&llTime);
+		LONG seq = readSequence(pSample);
+		if (llTime < m_llLast) {
+			m_nOutOfOrder++;
+		}
+		if (m_nWritten == 0) {
+			m_llFirst = llTime;
+		} else {
+			LONGLONG llStep = llTime - m_llLast;
+			if (seq != m_nLastSeq + 1) {
+				m_nSeqBreaks++;
+			}
+			if (llStep < SYNTH_PERIOD_HNS - SYNTH_PERIOD_HNS / 100 ||
+				llStep > SYNTH_PERIOD_HNS + SYNTH_PERIOD_HNS / 100) {
+				m_nUneven++;
+			}
+		}
+		m_llLast = llTime;
+		m_nLastSeq = seq;
+
+		// The stall comes half a second in, once the queue is running
+		if (m_msecStall && m_nWritten == 50) {
+			Sleep(m_msecStall);
+		}
+		LARGE_INTEGER t0, t1;
+		QueryPerformanceCounter(&t0);
+		do {
+			QueryPerformanceCounter(&t1);
+		} while ((t1.QuadPart - t0.QuadPart) * 1000000 < m_usecWrite * m_freq.QuadPart);
+		m_nWritten++;
+		return S_OK;
+	}
+	STDMETHODIMP AddStream(IMFMediaType *, DWORD *pdwStreamIndex)
+	{
+		*pdwStreamIndex = 0;
+		return S_OK;
+	}
+	STDMETHODIMP SetInputMediaType(DWORD, IMFMediaType *, IMFAttributes *) { return S_OK; }
+	STDMETHODIMP BeginWriting() { return S_OK; }
+	STDMETHODIMP Finalize() { return S_OK; }
+	STDMETHODIMP SendStreamTick(DWORD, LONGLONG) { return E_NOTIMPL; }
+	STDMETHODIMP PlaceMarker(DWORD, LPVOID) { return E_NOTIMPL; }
+	STDMETHODIMP NotifyEndOfSegment(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP Flush(DWORD) { return E_NOTIMPL; }
+	STDMETHODIMP GetServiceForStream(DWORD, REFGUID, REFIID, LPVOID *) { return E_NOTIMPL; }
+	STDMETHODIMP GetStatistics(DWORD, MF_SINK_WRITER_STATISTICS *) { return E_NOTIMPL; }
+};
+
+// One session of the benchmark
+struct SessionBenchCase
+{
+	const char *szName;
+	UINT32 cDevices;
+	DWORD usecWrite;            // Writer cost per sample, every device
+	DWORD msecStall;            // One stall of device 0's writer
+};
+
+// Hands out a synthetic reader and writer per device, in the order
+// the session starts them
+class SyntheticDevices : public CaptureFactory
+{
+public:
+	const SessionBenchCase *m_pCase;
+	SyntheticReader *m_pReaders[MAX_SESSION_DEVICES];
+	SyntheticWriter *m_pWriters[MAX_SESSION_DEVICES];
+	UINT32 m_cReaders;
+	UINT32 m_cWriters;
+
+	SyntheticDevices(const SessionBenchCase *pCase) :
+	m_pCase(pCase), m_cReaders(0), m_cWriters(0)
+	{
+		ZeroMemory(m_pReaders, sizeof(m_pReaders));
+		ZeroMemory(m_pWriters, sizeof(m_pWriters));
+	}
+	~SyntheticDevices()
+	{
+		for (UINT32 i = 0; i < m_cReaders; i++) {
+			m_pReaders[i]->Shutdown();
+			SafeRelease(&m_pReaders[i]);
+		}
+		for (UINT32 i = 0; i < m_cWriters; i++) {
+			SafeRelease(&m_pWriters[i]);
+		}
+	}
+
+	// Device i runs (i % 5 - 2) * 50 ppm fast
+	static double DriftPpm(UINT32 i) { return ((int)(i % 5) - 2) * 50.0; }
+
+	HRESULT CreateReader(IMFActivate *, IMFSourceReaderCallback *pCallback,
+		IMFSourceReader **ppReader)
+	{
+		if (m_cReaders == MAX_SESSION_DEVICES) {
+			return E_OUTOFMEMORY;
+		}
+		SyntheticReader *pReader = new (std::nothrow) SyntheticReader(pCallback,
+			DriftPpm(m_cReaders));
+		if (pReader == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		m_pReaders[m_cReaders++] = pReader;
+		HRESULT hr = pReader->Start();
+		if (SUCCEEDED(hr)) {
+			*ppReader = pReader;
+			pReader->AddRef();
+		}
+		return hr;
+	}
+
+	HRESULT CreateWriter(const WCHAR *, IMFSinkWriter **ppWriter)
+	{
+		if (m_cWriters == MAX_SESSION_DEVICES) {
+			return E_OUTOFMEMORY;
+		}
+		SyntheticWriter *pWriter = new (std::nothrow) SyntheticWriter(
+			m_pCase->usecWrite, m_cWriters == 0 ? m_pCase->msecStall : 0);
+		if (pWriter == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		m_pWriters[m_cWriters++] = pWriter;
+		*ppWriter = pWriter;
+		pWriter->AddRef();
+		return S_OK;
+	}
+};
+
+// Runs one session and checks each device: everything queued was
+// written in order, everything delivered was queued or counted as
+// dropped, and the drift measured is the drift the device was given
+static BOOL runSessionBench(const SessionBenchCase *pCase, DWORD msecRun)
+{
+	SyntheticDevices devices(pCase);
+	CaptureSession session(NULL, TRUE);
+	EncodingParameters param = { MFAudioFormat_WMAudioV8, 128000 };
+	WCHAR szTempDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	BOOL bOk = TRUE;
+	HRESULT hr = S_OK;
+
+	if (GetTempPathW(MAX_PATH, szTempDir) == 0) {
+		return FALSE;
+	}
+
+	// The session reads only the endpoint ID from a device's activate
+	// object, and with a factory set never activates it, so an audio
+	// renderer's serves to hold it
+	session.SetFactory(&devices);
+	for (UINT32 i = 0; i < pCase->cDevices && SUCCEEDED(hr); i++) {
+		IMFActivate *pActivate = NULL;
+		WCHAR szLink[64];
+		hr = MFCreateAudioRendererActivate(&pActivate);
+		if (SUCCEEDED(hr)) {
+			hr = StringCchPrintfW(szLink, ARRAYSIZE(szLink),
+				L"synthetic device %u", i);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pActivate->SetString(
+				MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID, szLink);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = StringCchPrintfW(szFile, MAX_PATH, L"%ssessionbench%u.wma",
+				szTempDir, i);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = session.AddDevice(pActivate, szFile);
+		}
+		SafeRelease(&pActivate);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = session.Start(param);
+	}
+	if (FAILED(hr)) {
+		printf("  Cannot start the session (0x%08X)\n", hr);
+		return FALSE;
+	}
+	Sleep(msecRun);
+	hr = session.Stop();
+	if (FAILED(hr)) {
+		printf("  Stop failed (0x%08X)\n", hr);
+		bOk = FALSE;
+	}
+
+	// Stop has shut off the captures, so the readers deliver no more
+	for (UINT32 i = 0; i < devices.m_cReaders; i++) {
+		devices.m_pReaders[i]->Shutdown();
+	}
+
+	WCHAR szReport[4096];
+	session.GetReport(szReport, ARRAYSIZE(szReport));
+	printf("%S", szReport);
+
+	for (UINT32 i = 0; i < pCase->cDevices; i++) {
+		SampleQueueStats stats;
+		ClockAlignment align;
+		hr = session.GetDeviceStats(i, &stats, &align);
+		if (FAILED(hr) || i >= devices.m_cReaders || i >= devices.m_cWriters) {
+			printf("  device %u: not started, FAILED\n", i);
+			bOk = FALSE;
+			continue;
+		}
+		SyntheticReader *pReader = devices.m_pReaders[i];
+		SyntheticWriter *pWriter = devices.m_pWriters[i];
+
+		// The sample being delivered as the capture stopped is ignored
+		LONGLONG nAccounted = stats.nPushed + stats.nOverruns + align.nEarly;
+		double driftError = align.driftPpm - SyntheticDevices::DriftPpm(i);
+		BOOL bDevice = pWriter->m_nWritten == stats.nPushed &&
+			pWriter->m_nOutOfOrder == 0 &&
+			pReader->m_nDelivered >= nAccounted &&
+			pReader->m_nDelivered <= nAccounted + 1 &&
+			driftError > -1.0 && driftError < 1.0;
+		printf("  device %u: %ld delivered, %ld written, %d dropped, "
+			"drift %+.1f ppm (given %+.0f), %s\n", i, pReader->m_nDelivered,
+			pWriter->m_nWritten, stats.nOverruns, align.driftPpm,
+			SyntheticDevices::DriftPpm(i), bDevice ? "ok" : "FAILED");
+		bOk = bOk && bDevice;
+
+		WCHAR szAlign[MAX_PATH];
+		if (SUCCEEDED(StringCchPrintfW(szAlign, MAX_PATH,
+			L"%ssessionbench%u.wma.align.txt", szTempDir, i))) {
+			DeleteFileW(szAlign);
+		}
+	}
+	return bOk;
+}
+
+void benchmarkCaptureSession(void)
+{
+	const DWORD MSEC_RUN = 5000;
+	const SessionBenchCase cases[] = {
+		{ "4 devices, 1 ms per write", 4, 1000, 0 },
+		{ "16 devices, 1 ms per write", 16, 1000, 0 },
+		{ "8 devices, device 0's writer stalls 3 s", 8, 1000, 3000 },
+	};
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+
+	printf("Capture session benchmark, %u ms per case, %u processors, "
+		"%d sample queue\n", MSEC_RUN, si.dwNumberOfProcessors,
+		SAMPLE_QUEUE_CAPACITY);
+	printf("Each device delivers 100 samples/sec\n");
+	for (DWORD i = 0; i < ARRAYSIZE(cases); i++) {
+		printf("\n%s:\n", cases[i].szName);
+		BOOL bOk = runSessionBench(&cases[i], MSEC_RUN);
+		printf("%s\n", bOk ? "ok" : "FAILED");
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Pre-roll benchmark
+
+// One run of samples through a PreRollBuffer.  Sample n is sized from a
+// hash of n, between cbMin and cbMax, except that every nthOversize is
+// larger than the ring.  Each starts with n, and the rest of its bytes
+// follow from n, so a sample in the wrong place or torn by the wrap
+// shows.
+struct PreRollRingCase
+{
+	const char *szName;
+	DWORD cbCapacity;
+	DWORD nMaxEntries;
+	LONGLONG llWindow;
+	DWORD cbMin;
+	DWORD cbMax;
+	DWORD nthOversize;          // 0 for none
+};
+
+static BOOL isOversize(const PreRollRingCase *pCase, DWORD seq)
+{
+	return pCase->nthOversize != 0 && seq % pCase->nthOversize == 0;
+}
+
+static DWORD preRollSampleSize(const PreRollRingCase *pCase, DWORD seq)
+{
+	if (isOversize(pCase, seq)) {
+		return pCase->cbCapacity + 1;
+	}
+	return pCase->cbMin + (seq * 2654435761U >> 8) % (pCase->cbMax - pCase->cbMin + 1);
+}
+
+static void fillPreRollSample(BYTE *pData, DWORD cbData, DWORD seq)
+{
+	CopyMemory(pData, &seq, sizeof(DWORD));
+	for (DWORD j = sizeof(DWORD); j < cbData; j++) {
+		pData[j] = (BYTE)(seq + j);
+	}
+}
+
+// The next sample after seq that fits in the ring
+static DWORD nextAccepted(const PreRollRingCase *pCase, DWORD seq)
+{
+	do {
+		seq++;
+	} while (isOversize(pCase, seq));
+	return seq;
+}
+
+struct PreRollRingResult
+{
+	DWORD nPushed;
+	DWORD nTriggers;
+	DWORD nWraps;
+	DWORD cbMaxLost;            // Most space left unused at the end of the ring
+	DWORD nBadEntries;          // Out of sequence, wrong time or torn
+	DWORD nNotFull;             // Triggers where the ring had room to spare
+	BOOL bDroppedCount;         // DroppedCount matched what went missing
+};
+
+// Pushes samples 10 ms apart into the ring and triggers at random.  At
+// each trigger the ring must hold the samples up to the last one
+// pushed, in order, 10 ms apart, intact, and within the window; and
+// once it has dropped any, it must be full by bytes, slots or window.
+// The capture queues the next samples itself, so they skip the ring;
+// then it is cleared and refilled, as a new capture would.
+static void runPreRollRing(const PreRollRingCase *pCase, DWORD nSamples,
+						   PreRollRingResult *pResult)
+{
+	const LONGLONG llPeriod = 100000;
+	const LONGLONG llStart = 1234567;
+	PreRollBuffer ring;
+	PreRollEntry entry;
+	BYTE *pSample = NULL;
+	DWORD seq = 0;
+	LONGLONG nRejected = 0;
+	LONGLONG nAccepted = 0;
+	LONGLONG nCleared = 0;
+
+	ZeroMemory(pResult, sizeof(*pResult));
+	pSample = new (std::nothrow) BYTE[pCase->cbCapacity + 1];
+	if (pSample == NULL || FAILED(ring.Initialize(pCase->cbCapacity,
+		pCase->nMaxEntries, pCase->llWindow))) {
+		delete [] pSample;
+		pResult->nBadEntries = 1;
+		return;
+	}
+
+	srand(1);
+	while (seq < nSamples) {
+		// Armed: fill the ring for a while
+		DWORD seqArmed = seq;
+		DWORD nArmed = 200 + rand() % 2000;
+		DWORD seqLast = MAXDWORD;
+		BOOL bHaveNewest = FALSE;
+		PreRollEntry newest = { 0 };
+		for (DWORD i = 0; i < nArmed; i++, seq++) {
+			DWORD cbData = preRollSampleSize(pCase, seq);
+			if (cbData > pCase->cbCapacity) {
+				if (ring.Reserve(cbData) == NULL) {
+					nRejected++;
+				} else {
+					pResult->nBadEntries++;
+				}
+				continue;
+			}
+			fillPreRollSample(pSample, cbData, seq);
+			ring.Push(pSample, cbData, llStart + seq * llPeriod, llPeriod);
+			nAccepted++;
+			seqLast = seq;
+
+			// Count the wraps and the space each leaves at the end
+			ring.GetEntry(ring.Count() - 1, &entry);
+			if (bHaveNewest && entry.cbOffset < newest.cbOffset + newest.cbData) {
+				pResult->nWraps++;
+				pResult->cbMaxLost = max(pResult->cbMaxLost,
+					pCase->cbCapacity - (newest.cbOffset + newest.cbData));
+			}
+			newest = entry;
+			bHaveNewest = TRUE;
+		}
+		pResult->nTriggers++;
+
+		// Trigger: what the ring holds, oldest first
+		DWORD seqExpected = MAXDWORD;
+		DWORD cbHeld = 0;
+		for (DWORD i = 0; i < ring.Count(); i++) {
+			const BYTE *pData = ring.GetEntry(i, &entry);
+			DWORD seqEntry = MAXDWORD;
+			CopyMemory(&seqEntry, pData, sizeof(DWORD));
+			BOOL bEntry = (seqExpected == MAXDWORD || seqEntry == seqExpected) &&
+				seqEntry < seq &&
+				entry.cbData == preRollSampleSize(pCase, seqEntry) &&
+				entry.llTime == llStart + seqEntry * llPeriod &&
+				entry.llDuration == llPeriod;
+			for (DWORD j = sizeof(DWORD); j < entry.cbData && bEntry; j++) {
+				bEntry = pData[j] == (BYTE)(seqEntry + j);
+			}
+			if (!bEntry) {
+				pResult->nBadEntries++;
+			}
+			seqExpected = nextAccepted(pCase, seqEntry);
+			cbHeld += entry.cbData;
+		}
+		if (ring.Count() == 0 || seqExpected != nextAccepted(pCase, seqLast) ||
+			ring.Duration() > pCase->llWindow) {
+			pResult->nBadEntries++;
+		}
+
+		// A ring that has dropped anything since it was armed is full
+		DWORD seqFirst = isOversize(pCase, seqArmed) ?
+			nextAccepted(pCase, seqArmed) : seqArmed;
+		ring.GetEntry(0, &entry);
+		DWORD seqOldest = (DWORD)((entry.llTime - llStart) / llPeriod);
+		if (seqOldest > seqFirst &&
+			ring.Count() < pCase->nMaxEntries &&
+			ring.Duration() + llPeriod <= pCase->llWindow &&
+			cbHeld + 2 * pCase->cbMax <= pCase->cbCapacity) {
+			pResult->nNotFull++;
+		}
+
+		seq += 50;
+		nCleared += ring.Count();
+		ring.Clear();
+	}
+
+	// Everything accepted was either cleared at a trigger or dropped
+	pResult->nPushed = seq;
+	pResult->bDroppedCount =
+		ring.DroppedCount() == nRejected + nAccepted - nCleared;
+	delete [] pSample;
+}
+
+// One session of synthetic devices with a pre-roll.  The devices stamp
+// each sample with a sequence number, and every writer must see an
+// unbroken sequence with times one period apart, from the oldest sample
+// of the pre-roll, across the trigger, to the last.
+static BOOL runPreRollSession(const SessionBenchCase *pCase,
+							  DWORD dwPreRollSeconds, DWORD msecArmed,
+							  DWORD msecTriggered)
+{
+	SyntheticDevices devices(pCase);
+	CaptureSession session(NULL, TRUE);
+	EncodingParameters param = { MFAudioFormat_WMAudioV8, 128000 };
+	WCHAR szTempDir[MAX_PATH];
+	WCHAR szFile[MAX_PATH];
+	BOOL bOk = TRUE;
+	HRESULT hr = S_OK;
+
+	if (GetTempPathW(MAX_PATH, szTempDir) == 0) {
+		return FALSE;
+	}
+
+	session.SetFactory(&devices);
+	session.SetPreRoll(dwPreRollSeconds);
+	for (UINT32 i = 0; i < pCase->cDevices && SUCCEEDED(hr); i++) {
+		IMFActivate *pActivate = NULL;
+		WCHAR szLink[64];
+		hr = MFCreateAudioRendererActivate(&pActivate);
+		if (SUCCEEDED(hr)) {
+			hr = StringCchPrintfW(szLink, ARRAYSIZE(szLink),
+				L"synthetic device %u", i);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = pActivate->SetString(
+				MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_ENDPOINT_ID, szLink);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = StringCchPrintfW(szFile, MAX_PATH, L"%sprerollbench%u.wma",
+				szTempDir, i);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = session.AddDevice(pActivate, szFile);
+		}
+		SafeRelease(&pActivate);
+	}
+	if (SUCCEEDED(hr)) {
+		hr = session.Start(param);
+	}
+	if (FAILED(hr)) {
+		printf("  Cannot start the session (0x%08X)\n", hr);
+		return FALSE;
+	}
+
+	// With no time after the trigger, Stop triggers
+	Sleep(msecArmed);
+	if (msecTriggered > 0) {
+		hr = session.Trigger();
+		if (FAILED(hr)) {
+			printf("  Trigger failed (0x%08X)\n", hr);
+			bOk = FALSE;
+		}
+		Sleep(msecTriggered);
+	}
+	hr = session.Stop();
+	if (FAILED(hr)) {
+		printf("  Stop failed (0x%08X)\n", hr);
+		bOk = FALSE;
+	}
+	for (UINT32 i = 0; i < devices.m_cReaders; i++) {
+		devices.m_pReaders[i]->Shutdown();
+	}
+
+	// The slowest device fits one sample less in the window, and a
+	// sample or two may start before the session base and be left out,
+	// but the rest of the pre-roll must be written
+	LONG nPreRoll = (LONG)(dwPreRollSeconds * 10000000LL / SYNTH_PERIOD_HNS);
+	for (UINT32 i = 0; i < pCase->cDevices; i++) {
+		SampleQueueStats stats;
+		ClockAlignment align;
+		hr = session.GetDeviceStats(i, &stats, &align);
+		if (FAILED(hr) || i >= devices.m_cWriters) {
+			printf("  device %u: not started, FAILED\n", i);
+			bOk = FALSE;
+			continue;
+		}
+		SyntheticWriter *pWriter = devices.m_pWriters[i];
+		LONG nFromRing = pWriter->m_nWritten - (LONG)stats.nPushed;
+		BOOL bDevice = stats.nOverruns == 0 &&
+			pWriter->m_nSeqBreaks == 0 &&
+			pWriter->m_nUneven == 0 &&
+			pWriter->m_nOutOfOrder == 0 &&
+			pWriter->m_llFirst >= 0 &&
+			nFromRing >= nPreRoll - 3 && nFromRing <= nPreRoll;
+		printf("  device %u: %ld from the pre-roll, %I64d after, first at "
+			"%I64d ms, %ld breaks, %ld uneven steps, %s\n", i, nFromRing,
+			stats.nPushed, pWriter->m_llFirst / 10000, pWriter->m_nSeqBreaks,
+			pWriter->m_nUneven, bDevice ? "ok" : "FAILED");
+		bOk = bOk && bDevice;
+
+		WCHAR szAlign[MAX_PATH];
+		if (SUCCEEDED(StringCchPrintfW(szAlign, MAX_PATH,
+			L"%sprerollbench%u.wma.align.txt", szTempDir, i))) {
+			DeleteFileW(szAlign);
+		}
+	}
+	return bOk;
+}
+
+void benchmarkPreRoll(void)
+{
+	const DWORD N_SAMPLES = 200000;
+	const LONGLONG SEC = 10000000;
+	const PreRollRingCase rings[] = {
+		{ "Ring smaller than the window", 64 * 1024, 4096, 100 * SEC, 4, 6000, 0 },
+		{ "Ring larger than the window", 1024 * 1024, 4096, SEC, 4, 6000, 0 },
+		{ "Slots run out first", 1024 * 1024, 64, 100 * SEC, 4, 6000, 0 },
+		{ "Every 37th sample larger than the ring", 32 * 1024, 4096, 100 * SEC,
+		  4, 6000, 37 },
+	};
+	BOOL bOk = TRUE;
+
+	printf("Pre-roll benchmark\n");
+	printf("\nRings, %u samples 10 ms apart, 4 to 6000 bytes:\n", N_SAMPLES);
+	for (DWORD i = 0; i < ARRAYSIZE(rings); i++) {
+		PreRollRingResult result;
+		LARGE_INTEGER freq, t0, t1;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&t0);
+		runPreRollRing(&rings[i], N_SAMPLES, &result);
+		QueryPerformanceCounter(&t1);
+
+		BOOL bRing = result.nBadEntries == 0 && result.nNotFull == 0 &&
+			result.bDroppedCount;
+		printf("  %s: %u triggers, %u wraps, up to %u bytes lost at the end, "
+			"%.1f ms, %s\n", rings[i].szName, result.nTriggers, result.nWraps,
+			result.cbMaxLost,
+			(t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart,
+			bRing ? "ok" : "FAILED");
+		if (!bRing) {
+			printf("    %u bad entries, %u not full, dropped count %s\n",
+				result.nBadEntries, result.nNotFull,
+				result.bDroppedCount ? "ok" : "wrong");
+		}
+		bOk = bOk && bRing;
+	}
+
+	const SessionBenchCase session = { "4 devices", 4, 100, 0 };
+	printf("\n4 devices, 1 s pre-roll, armed 2.5 s, triggered, 1 s more:\n");
+	bOk = runPreRollSession(&session, 1, 2500, 1000) && bOk;
+	printf("\n4 devices, 1 s pre-roll, stopped while armed after 2.5 s:\n");
+	bOk = runPreRollSession(&session, 1, 2500, 0) && bOk;
+	printf("%s\n", bOk ? "ok" : "FAILED");
+}
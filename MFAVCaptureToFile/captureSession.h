@@ -0,0 +1,106 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// captureSession.h: Captures from several devices at once.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+#include "capture.h"
+
+const UINT32 MAX_SESSION_DEVICES = 32;
+
+// Runs one CCapture per device, each writing its own file.  Rather
+// than a writer thread per capture, the session has a small set of
+// writer threads (no more than the number of processors), and each
+// capture's samples are written by one of them.
+//
+// All the captures are rebased against one session clock, so their
+// files share a timeline: each file starts at its device's offset from
+// the session start.  At Stop the offset and the measured drift of each
+// device clock are written next to the file, in <file>.align.txt.
+class CaptureSession
+{
+public:
+    CaptureSession(HWND hwnd, BOOL useAudio);
+    ~CaptureSession();
+
+    // Adds a device to capture to the given file.  Must be called
+    // before Start.
+    HRESULT AddDevice(IMFActivate *pActivate, const WCHAR *pwszFileName);
+
+    HRESULT Start(const EncodingParameters &param);
+    HRESULT Stop();
+    BOOL    IsCapturing() const { return m_bCapturing; }
+
+    // Keeps the last dwSeconds of every device in memory until Trigger,
+    // then writes them and everything after.  The session timeline
+    // starts dwSeconds before the trigger.  Must be called before Start.
+    void    SetPreRoll(DWORD dwSeconds) { m_dwPreRollSeconds = dwSeconds; }
+    HRESULT Trigger();
+    BOOL    IsArmed() const { return m_bArmed; }
+    UINT32  Count() const { return m_cDevices; }
+    HRESULT CheckDeviceLost(DEV_BROADCAST_HDR *pHdr, BOOL *pbDeviceLost);
+
+    // Captures through the factory instead of activating the devices.
+    // Must be called before Start.
+    void    SetFactory(CaptureFactory *pFactory) { m_pFactory = pFactory; }
+
+    // Describes what each device wrote and dropped.  Valid after Stop.
+    void    GetReport(WCHAR *pszReport, size_t cchReport);
+    HRESULT GetDeviceStats(UINT32 index, SampleQueueStats *pStats,
+                           ClockAlignment *pAlign) const;
+
+private:
+    struct Device
+    {
+        IMFActivate         *pActivate;
+        CCapture            *pCapture;
+        WCHAR               szFileName[MAX_PATH];
+        HRESULT             hr;             // Result of StartCapture
+        SampleQueueStats    stats;          // Queue counters at Stop
+        ClockAlignment      align;          // Offset and drift at Stop
+    };
+
+    struct WriterThread
+    {
+        CaptureSession      *pSession;
+        UINT32              iThread;
+        HANDLE              hThread;
+        HANDLE              hEvent;         // Signaled by the captures it writes
+    };
+
+    static unsigned __stdcall WriterThreadProc(void *pContext);
+    void    DrainDevices(UINT32 iThread);
+    void    StopWriterThreads();
+    HRESULT WriteAlignment(const Device *pDevice);
+
+    HWND            m_hwndEvent;
+    BOOL            m_useAudio;
+    BOOL            m_bCapturing;
+    BOOL            m_bArmed;           // Waiting for Trigger
+    DWORD           m_dwPreRollSeconds;
+    CaptureFactory  *m_pFactory;        // Stands in for the devices, or NULL
+    volatile BOOL   m_bStopWriters;
+
+    Device          m_devices[MAX_SESSION_DEVICES];
+    UINT32          m_cDevices;
+
+    WriterThread    m_threads[MAX_SESSION_DEVICES];
+    UINT32          m_cThreads;
+
+    SessionClock    m_clock;            // Time base of every capture
+    DWORD           m_tStart;           // GetTickCount at Start
+    DWORD           m_msecCaptured;     // Length of the session
+};
+
+// Runs sessions of synthetic devices, each delivering samples in real
+// time to a writer with a set cost, and prints the throughput, drops
+// and drift of each device
+void benchmarkCaptureSession(void);
+
+// Runs samples through pre-roll rings of several shapes, triggering at
+// random, then sessions of synthetic devices with a pre-roll, and
+// checks that every sample kept and written follows the one before
+void benchmarkPreRoll(void);
@@ -0,0 +1,619 @@
+//////////////////////////////////////////////////////////////////////////
+// debugLog.cpp: Logging from any thread without locks or allocation
+//
+// A thread claims a ring of its own the first time it logs and gives it
+// back when it exits.  logMessage packs the format pointer, a time
+// stamp and the raw arguments into the ring, and the log thread takes
+// the records from every ring in time order and formats them.  So the
+// cost on the logging thread is scanning the format and a copy, and
+// memory is bounded by LOG_MAX_THREADS rings.
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "debugLog.h"
+
+const DWORD LOG_RING_SIZE = 32 * 1024;     // Bytes per ring, a power of two
+const DWORD LOG_MAX_THREADS = 64;          // Rings, so threads logging at once
+const DWORD LOG_MAX_RECORD = 1024;         // Bytes, header included
+const DWORD LOG_MAX_LINE = 2048;           // Characters of a formatted line
+const DWORD LOG_POLL_MSEC = 20;            // Longest a message waits
+
+// Header of a record.  The arguments follow in 8 byte slots, in the
+// order the format takes them.  Strings are copied, terminator
+// included, into as many slots as they need.
+struct LogRecord
+{
+	UINT32      cbRecord;       // Header and arguments, a multiple of 8
+	UINT32      level;
+	LONGLONG    qpc;
+	const TCHAR *format;
+	DWORD       dwThreadId;
+};
+
+const DWORD LOG_HEADER_SIZE = (sizeof(LogRecord) + 7) & ~7;
+
+// Written by the thread that owns it and read by the log thread.  The
+// counts run on and wrap; each side writes only its own.
+struct LogRing
+{
+	BYTE        *pData;
+	volatile LONG nWritten;     // Bytes
+	volatile LONG nRead;
+	volatile LONG nDropped;     // Records that did not fit
+	volatile LONG bOwned;
+};
+
+enum LogArgType
+{
+	LOG_ARG_NONE,               // A literal, or a conversion not supported
+	LOG_ARG_INT,
+	LOG_ARG_INT64,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_POINTER,
+	LOG_ARG_STRINGA,
+	LOG_ARG_STRINGW,
+};
+
+// One conversion of a format
+struct LogSpec
+{
+	const TCHAR *pStart;        // The '%'
+	const TCHAR *pEnd;          // After the conversion character
+	int         nStars;         // Width and precision arguments taken first
+	LogArgType  type;
+};
+
+static LogRing s_rings[LOG_MAX_THREADS];
+static INIT_ONCE s_logOnce = INIT_ONCE_STATIC_INIT;
+static DWORD s_dwFlsIndex = FLS_OUT_OF_INDEXES;
+static volatile LONG s_nLevel = LOG_MAX_LEVEL;
+static volatile LONG s_nUnringed = 0;       // Dropped with no ring to take them
+static volatile BOOL s_bRunning = FALSE;
+static volatile BOOL s_bStop = FALSE;
+static HANDLE s_hThread = NULL;
+static HANDLE s_hWake = NULL;               // Signaled to drain the rings now
+static HANDLE s_hFlushed = NULL;            // Signaled after each drain
+static volatile LONG s_nFlushRequests = 0;
+static volatile LONG s_nFlushesDone = 0;
+static LONGLONG s_qpcStart;
+static LONGLONG s_qpcFrequency;
+static LogSinkProc s_pfnSink = NULL;
+static void *s_pSinkContext = NULL;
+
+// Parses the conversion that starts at the '%' at p
+static void parseLogSpec(const TCHAR *p, LogSpec *pSpec) {
+	pSpec->pStart = p++;
+	pSpec->nStars = 0;
+	pSpec->type = LOG_ARG_NONE;
+
+	while (*p == _T('-') || *p == _T('+') || *p == _T(' ') ||
+		*p == _T('#') || *p == _T('0')) {
+		p++;
+	}
+	for (int i = 0; i < 2; i++) {
+		// Width, then precision
+		if (*p == _T('*')) {
+			pSpec->nStars++;
+			p++;
+		} else {
+			while (*p >= _T('0') && *p <= _T('9')) p++;
+		}
+		if (i == 0 && *p == _T('.')) {
+			p++;
+		} else {
+			break;
+		}
+	}
+
+	int nSize = sizeof(int);        // Of an integer argument
+	int nWide = 0;                  // Of a string, 1 wide, -1 narrow
+	if (p[0] == _T('I') && p[1] == _T('6') && p[2] == _T('4')) {
+		nSize = 8;
+		p += 3;
+	} else if (p[0] == _T('I') && p[1] == _T('3') && p[2] == _T('2')) {
+		p += 3;
+	} else if (p[0] == _T('l') && p[1] == _T('l')) {
+		nSize = 8;
+		p += 2;
+	} else if (p[0] == _T('h') && p[1] == _T('h')) {
+		p += 2;
+	} else if (*p == _T('I') || *p == _T('z') || *p == _T('t') ||
+		*p == _T('j')) {
+		nSize = *p == _T('j') ? 8 : sizeof(void *);
+		p++;
+	} else if (*p == _T('l') || *p == _T('w')) {
+		nSize = sizeof(long);
+		nWide = 1;
+		p++;
+	} else if (*p == _T('h')) {
+		nWide = -1;
+		p++;
+	} else if (*p == _T('L')) {
+		p++;
+	}
+
+	switch (*p) {
+	case _T('d'): case _T('i'): case _T('u'): case _T('o'):
+	case _T('x'): case _T('X'):
+		pSpec->type = nSize == 8 ? LOG_ARG_INT64 : LOG_ARG_INT;
+		break;
+	case _T('c'): case _T('C'):
+		pSpec->type = LOG_ARG_INT;
+		break;
+	case _T('e'): case _T('E'): case _T('f'): case _T('F'):
+	case _T('g'): case _T('G'): case _T('a'): case _T('A'):
+		pSpec->type = LOG_ARG_DOUBLE;
+		break;
+	case _T('p'):
+	case _T('n'):   // Taken, but never written through
+		pSpec->type = LOG_ARG_POINTER;
+		break;
+	case _T('s'): case _T('S'):
+		if (nWide == 0) {
+			// %s is a string of TCHARs and %S of the other kind
+			nWide = ((*p == _T('s')) == (sizeof(TCHAR) == sizeof(WCHAR))) ?
+				1 : -1;
+		}
+		pSpec->type = nWide > 0 ? LOG_ARG_STRINGW : LOG_ARG_STRINGA;
+		break;
+	}
+	if (*p != _T('\0')) {
+		p++;
+	}
+	pSpec->pEnd = p;
+}
+
+// Copies a string into slots at pOut, cut short to fit in cbMax bytes.
+// Returns the bytes used, or 0 if not even the terminator fits.
+template <class C> static DWORD packLogString(BYTE *pOut, DWORD cbMax,
+											  const C *sz, const C *szNull) {
+	if (cbMax < sizeof(C)) {
+		return 0;
+	}
+	if (sz == NULL) {
+		sz = szNull;
+	}
+	C *pChars = (C *)pOut;
+	DWORD nMax = cbMax / sizeof(C) - 1;
+	DWORD n = 0;
+	while (n < nMax && sz[n] != 0) {
+		pChars[n] = sz[n];
+		n++;
+	}
+	pChars[n] = 0;
+	return ((n + 1) * sizeof(C) + 7) & ~7;
+}
+
+// Packs the arguments the format takes into pOut, as far as they fit
+// in cbMax bytes.  Returns the bytes used.
+static DWORD packLogArgs(BYTE *pOut, DWORD cbMax, const TCHAR *format,
+						 va_list vargs) {
+	DWORD cb = 0;
+	for (const TCHAR *p = format; *p != _T('\0');) {
+		if (*p != _T('%')) {
+			p++;
+			continue;
+		}
+		LogSpec spec;
+		parseLogSpec(p, &spec);
+		p = spec.pEnd;
+
+		for (int i = 0; i < spec.nStars && cb + 8 <= cbMax; i++) {
+			*(int *)(pOut + cb) = va_arg(vargs, int);
+			cb += 8;
+		}
+		if (spec.type != LOG_ARG_NONE && cb + 8 > cbMax) {
+			break;
+		}
+		switch (spec.type) {
+		case LOG_ARG_INT:
+			*(int *)(pOut + cb) = va_arg(vargs, int);
+			cb += 8;
+			break;
+		case LOG_ARG_INT64:
+			*(LONGLONG *)(pOut + cb) = va_arg(vargs, LONGLONG);
+			cb += 8;
+			break;
+		case LOG_ARG_DOUBLE:
+			*(double *)(pOut + cb) = va_arg(vargs, double);
+			cb += 8;
+			break;
+		case LOG_ARG_POINTER:
+			*(void **)(pOut + cb) = va_arg(vargs, void *);
+			cb += 8;
+			break;
+		case LOG_ARG_STRINGA:
+			cb += packLogString(pOut + cb, cbMax - cb,
+				va_arg(vargs, const char *), "(null)");
+			break;
+		case LOG_ARG_STRINGW:
+			cb += packLogString(pOut + cb, cbMax - cb,
+				va_arg(vargs, const WCHAR *), L"(null)");
+			break;
+		}
+	}
+	return cb;
+}
+
+static void copyToRing(LogRing *pRing, DWORD offset, const BYTE *pData,
+					   DWORD cbData) {
+	offset &= LOG_RING_SIZE - 1;
+	DWORD cbFirst = min(cbData, LOG_RING_SIZE - offset);
+	CopyMemory(pRing->pData + offset, pData, cbFirst);
+	CopyMemory(pRing->pData, pData + cbFirst, cbData - cbFirst);
+}
+
+static void copyFromRing(const LogRing *pRing, DWORD offset, BYTE *pData,
+						 DWORD cbData) {
+	offset &= LOG_RING_SIZE - 1;
+	DWORD cbFirst = min(cbData, LOG_RING_SIZE - offset);
+	CopyMemory(pData, pRing->pData + offset, cbFirst);
+	CopyMemory(pData + cbFirst, pRing->pData, cbData - cbFirst);
+}
+
+// Formats one conversion, passing the width and precision arguments
+// first.  Returns the end of what was written.
+template <class T> static TCHAR *printLogArg(TCHAR *pOut, size_t nOut,
+											 const TCHAR *szSpec,
+											 const int *pStars, int nStars,
+											 T value) {
+	TCHAR *pEnd = pOut;
+	if (nStars == 0) {
+		StringCchPrintfEx(pOut, nOut, &pEnd, NULL, 0, szSpec, value);
+	} else if (nStars == 1) {
+		StringCchPrintfEx(pOut, nOut, &pEnd, NULL, 0, szSpec, pStars[0],
+			value);
+	} else {
+		StringCchPrintfEx(pOut, nOut, &pEnd, NULL, 0, szSpec, pStars[0],
+			pStars[1], value);
+	}
+	return pEnd;
+}
+
+// Formats the message of a record as printf would have.  Conversions
+// whose arguments did not fit in the record are left out.
+static void formatLogRecord(const BYTE *pRecord, TCHAR *szOut, size_t nOut) {
+	const LogRecord *pHeader = (const LogRecord *)pRecord;
+	const BYTE *pArgs = pRecord + LOG_HEADER_SIZE;
+	const BYTE *pArgsEnd = pRecord + pHeader->cbRecord;
+	TCHAR *pOut = szOut;
+	TCHAR *pOutEnd = szOut + nOut - 1;
+
+	for (const TCHAR *p = pHeader->format; *p != _T('\0') && pOut < pOutEnd;) {
+		if (*p != _T('%')) {
+			*pOut++ = *p++;
+			continue;
+		}
+		LogSpec spec;
+		parseLogSpec(p, &spec);
+		p = spec.pEnd;
+		if (spec.pEnd - spec.pStart == 2 && spec.pStart[1] == _T('%')) {
+			*pOut++ = _T('%');
+			continue;
+		}
+
+		int stars[2];
+		for (int i = 0; i < spec.nStars && pArgs + 8 <= pArgsEnd; i++) {
+			stars[i] = *(const int *)pArgs;
+			pArgs += 8;
+		}
+		if (spec.type == LOG_ARG_NONE || pArgs >= pArgsEnd) {
+			continue;
+		}
+		TCHAR szSpec[32];
+		size_t nSpec = min((size_t)(spec.pEnd - spec.pStart),
+			ARRAYSIZE(szSpec) - 1);
+		CopyMemory(szSpec, spec.pStart, nSpec * sizeof(TCHAR));
+		szSpec[nSpec] = _T('\0');
+		if (spec.pEnd[-1] == _T('n')) {
+			pArgs += 8;
+			continue;
+		}
+
+		size_t nLeft = pOutEnd - pOut + 1;
+		switch (spec.type) {
+		case LOG_ARG_INT:
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars,
+				*(const int *)pArgs);
+			pArgs += 8;
+			break;
+		case LOG_ARG_INT64:
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars,
+				*(const LONGLONG *)pArgs);
+			pArgs += 8;
+			break;
+		case LOG_ARG_DOUBLE:
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars,
+				*(const double *)pArgs);
+			pArgs += 8;
+			break;
+		case LOG_ARG_POINTER:
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars,
+				*(void * const *)pArgs);
+			pArgs += 8;
+			break;
+		case LOG_ARG_STRINGA: {
+			const char *sz = (const char *)pArgs;
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars, sz);
+			pArgs += ((strlen(sz) + 1) * sizeof(char) + 7) & ~7;
+			break;
+		}
+		case LOG_ARG_STRINGW: {
+			const WCHAR *sz = (const WCHAR *)pArgs;
+			pOut = printLogArg(pOut, nLeft, szSpec, stars, spec.nStars, sz);
+			pArgs += ((wcslen(sz) + 1) * sizeof(WCHAR) + 7) & ~7;
+			break;
+		}
+		}
+	}
+	*pOut = _T('\0');
+}
+
+// Adds the time, thread and level, ends the line, and hands it on
+static void writeLogLine(int level, LONGLONG qpc, DWORD dwThreadId,
+						 const TCHAR *szMessage) {
+	static const TCHAR levelChars[] = _T("?EWID");
+	TCHAR szLine[LOG_MAX_LINE];
+	TCHAR *pEnd = szLine;
+	size_t nLeft = ARRAYSIZE(szLine) - 1;   // Room for the newline
+
+	StringCchPrintfEx(szLine, nLeft, &pEnd, &nLeft, 0,
+		_T("%10.6f %5lu %c %s"),
+		(double)(qpc - s_qpcStart) / s_qpcFrequency, dwThreadId,
+		levelChars[level >= 0 && level <= LOG_LEVEL_DEBUG ? level : 0],
+		szMessage);
+	if (pEnd == szLine || pEnd[-1] != _T('\n')) {
+		*pEnd++ = _T('\n');
+		*pEnd = _T('\0');
+	}
+	if (s_pfnSink != NULL) {
+		s_pfnSink(level, szLine, s_pSinkContext);
+	} else {
+		OutputDebugString(szLine);
+	}
+}
+
+// Writes the records that are in the rings now, oldest first, and
+// reports the ones dropped since the last time
+static void drainLogRings() {
+	static LONG droppedReported[LOG_MAX_THREADS];
+	static LONG nUnringedReported;
+	LONG nEnd[LOG_MAX_THREADS];
+	LONGLONG qpcHead[LOG_MAX_THREADS];      // MAXLONGLONG when drained
+	LONGLONG recordSlots[LOG_MAX_RECORD / 8];
+	BYTE *record = (BYTE *)recordSlots;
+	TCHAR szMessage[LOG_MAX_LINE];
+
+	for (DWORD i = 0; i < LOG_MAX_THREADS; i++) {
+		LogRing *pRing = &s_rings[i];
+		qpcHead[i] = MAXLONGLONG;
+		if (pRing->pData == NULL) {
+			continue;
+		}
+		nEnd[i] = pRing->nWritten;
+		if (pRing->nRead != nEnd[i]) {
+			LogRecord header;
+			copyFromRing(pRing, pRing->nRead, (BYTE *)&header, sizeof(header));
+			qpcHead[i] = header.qpc;
+		}
+	}
+
+	for (;;) {
+		DWORD iOldest = 0;
+		for (DWORD i = 1; i < LOG_MAX_THREADS; i++) {
+			if (qpcHead[i] < qpcHead[iOldest]) {
+				iOldest = i;
+			}
+		}
+		if (qpcHead[iOldest] == MAXLONGLONG) {
+			break;
+		}
+
+		LogRing *pRing = &s_rings[iOldest];
+		LONG nRead = pRing->nRead;
+		LogRecord *pHeader = (LogRecord *)record;
+		copyFromRing(pRing, nRead, record, sizeof(LogRecord));
+		copyFromRing(pRing, nRead, record, pHeader->cbRecord);
+		formatLogRecord(record, szMessage, ARRAYSIZE(szMessage));
+		writeLogLine(pHeader->level, pHeader->qpc, pHeader->dwThreadId,
+			szMessage);
+
+		nRead = (LONG)((DWORD)nRead + pHeader->cbRecord);
+		InterlockedExchange(&pRing->nRead, nRead);
+		if (nRead != nEnd[iOldest]) {
+			LogRecord header;
+			copyFromRing(pRing, nRead, (BYTE *)&header, sizeof(header));
+			qpcHead[iOldest] = header.qpc;
+		} else {
+			qpcHead[iOldest] = MAXLONGLONG;
+		}
+	}
+
+	LARGE_INTEGER qpcNow;
+	QueryPerformanceCounter(&qpcNow);
+	for (DWORD i = 0; i < LOG_MAX_THREADS; i++) {
+		LONG nDropped = s_rings[i].nDropped;
+		if (nDropped != droppedReported[i]) {
+			StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+				_T("[%ld messages dropped, log ring full]"),
+				nDropped - droppedReported[i]);
+			writeLogLine(LOG_LEVEL_WARNING, qpcNow.QuadPart,
+				GetCurrentThreadId(), szMessage);
+			droppedReported[i] = nDropped;
+		}
+	}
+	LONG nUnringed = s_nUnringed;
+	if (nUnringed != nUnringedReported) {
+		StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
+			_T("[%ld messages dropped, more than %u threads logging]"),
+			nUnringed - nUnringedReported, LOG_MAX_THREADS);
+		writeLogLine(LOG_LEVEL_WARNING, qpcNow.QuadPart,
+			GetCurrentThreadId(), szMessage);
+		nUnringedReported = nUnringed;
+	}
+}
+
+static unsigned __stdcall logThreadProc(void *pContext) {
+	for (;;) {
+		// Read first, so a flush requested during the drain waits
+		// for the next one
+		LONG nFlushRequests = s_nFlushRequests;
+		BOOL bStop = s_bStop;
+		drainLogRings();
+		InterlockedExchange(&s_nFlushesDone, nFlushRequests);
+		SetEvent(s_hFlushed);
+		if (bStop) {
+			break;
+		}
+		WaitForSingleObject(s_hWake, LOG_POLL_MSEC);
+	}
+	return 0;
+}
+
+// Gives the ring of a thread back when it exits.  Records it has not
+// written yet stay, and are written before those of the next owner.
+static void WINAPI releaseLogRing(void *pData) {
+	if (pData != NULL) {
+		InterlockedExchange(&((LogRing *)pData)->bOwned, FALSE);
+	}
+}
+
+static BOOL CALLBACK initLog(PINIT_ONCE pInitOnce, void *pParameter,
+							 void **ppContext) {
+	LARGE_INTEGER li;
+	QueryPerformanceFrequency(&li);
+	s_qpcFrequency = li.QuadPart;
+	QueryPerformanceCounter(&li);
+	s_qpcStart = li.QuadPart;
+
+	s_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	s_hFlushed = CreateEvent(NULL, FALSE, FALSE, NULL);
+	DWORD dwFlsIndex = FlsAlloc(releaseLogRing);
+	if (s_hWake == NULL || s_hFlushed == NULL ||
+		dwFlsIndex == FLS_OUT_OF_INDEXES) {
+		return TRUE;
+	}
+	s_hThread = (HANDLE)_beginthreadex(NULL, 0, logThreadProc, NULL, 0, NULL);
+	if (s_hThread == NULL) {
+		return TRUE;
+	}
+	s_dwFlsIndex = dwFlsIndex;
+	s_bRunning = TRUE;
+	return TRUE;
+}
+
+// Returns the ring of the calling thread, claiming one the first time
+static LogRing *getLogRing() {
+	if (s_dwFlsIndex != FLS_OUT_OF_INDEXES) {
+		LogRing *pRing = (LogRing *)FlsGetValue(s_dwFlsIndex);
+		if (pRing != NULL) {
+			return pRing;
+		}
+	}
+	InitOnceExecuteOnce(&s_logOnce, initLog, NULL, NULL);
+	if (!s_bRunning) {
+		return NULL;
+	}
+
+	for (DWORD i = 0; i < LOG_MAX_THREADS; i++) {
+		LogRing *pRing = &s_rings[i];
+		if (InterlockedCompareExchange(&pRing->bOwned, TRUE, FALSE) != FALSE) {
+			continue;
+		}
+		if (pRing->pData == NULL) {
+			BYTE *pData = new (std::nothrow) BYTE[LOG_RING_SIZE];
+			if (pData == NULL) {
+				InterlockedExchange(&pRing->bOwned, FALSE);
+				return NULL;
+			}
+			InterlockedExchangePointer((void * volatile *)&pRing->pData, pData);
+		}
+		FlsSetValue(s_dwFlsIndex, pRing);
+		return pRing;
+	}
+	return NULL;
+}
+
+void logMessage(int level, const TCHAR *format, ...) {
+	if (level > s_nLevel || format == NULL) {
+		return;
+	}
+	LogRing *pRing = getLogRing();
+	if (pRing == NULL) {
+		InterlockedIncrement(&s_nUnringed);
+		return;
+	}
+
+	LONGLONG recordSlots[LOG_MAX_RECORD / 8];
+	BYTE *record = (BYTE *)recordSlots;
+	LogRecord *pHeader = (LogRecord *)record;
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	pHeader->level = level;
+	pHeader->qpc = qpc.QuadPart;
+	pHeader->format = format;
+	pHeader->dwThreadId = GetCurrentThreadId();
+	va_list vargs;
+	va_start(vargs, format);
+	pHeader->cbRecord = LOG_HEADER_SIZE + packLogArgs(record + LOG_HEADER_SIZE,
+		LOG_MAX_RECORD - LOG_HEADER_SIZE, format, vargs);
+	va_end(vargs);
+
+	LONG nWritten = pRing->nWritten;
+	DWORD cbUsed = (DWORD)(nWritten - pRing->nRead);
+	if (cbUsed + pHeader->cbRecord > LOG_RING_SIZE) {
+		pRing->nDropped++;
+		return;
+	}
+	copyToRing(pRing, nWritten, record, pHeader->cbRecord);
+	InterlockedExchange(&pRing->nWritten,
+		(LONG)((DWORD)nWritten + pHeader->cbRecord));
+
+	// Wake the log thread early if the ring is filling
+	if (cbUsed < LOG_RING_SIZE / 2 &&
+		cbUsed + pHeader->cbRecord >= LOG_RING_SIZE / 2) {
+		SetEvent(s_hWake);
+	}
+}
+
+void logSetLevel(int level) {
+	InterlockedExchange(&s_nLevel, level);
+}
+
+void logSetSink(LogSinkProc pfnSink, void *pContext) {
+	s_pSinkContext = pContext;
+	s_pfnSink = pfnSink;
+}
+
+void logFlush() {
+	if (!s_bRunning) {
+		return;
+	}
+	LONG nRequest = InterlockedIncrement(&s_nFlushRequests);
+	SetEvent(s_hWake);
+	while (s_bRunning && s_nFlushesDone - nRequest < 0) {
+		WaitForSingleObject(s_hFlushed, LOG_POLL_MSEC);
+	}
+}
+
+void logShutdown() {
+	if (!s_bRunning) {
+		return;
+	}
+	s_bStop = TRUE;
+	SetEvent(s_hWake);
+	WaitForSingleObject(s_hThread, INFINITE);
+	s_bRunning = FALSE;
+	CloseHandle(s_hThread);
+	s_hThread = NULL;
+	// The rings and events stay, as threads still holding a ring may
+	// log into it and signal
+}
+
+ULONGLONG logDroppedCount() {
+	ULONGLONG nDropped = (DWORD)s_nUnringed;
+	for (DWORD i = 0; i < LOG_MAX_THREADS; i++) {
+		nDropped += (DWORD)s_rings[i].nDropped;
+	}
+	return nDropped;
+}
@@ -0,0 +1,645 @@
+//////////////////////////////////////////////////////////////////////////
+// mediaTypeCatalog.cpp: Native media types of each device, kept on disk
+//
+// Asking a device for its native types goes to the driver for each
+// stream and type, so the answers are kept, one record per device, and
+// written to a file for the next run.  A record is held in memory just
+// as it is on disk: a header, the link, then each stream followed by
+// its types, each type followed by its attributes as a blob.
+//////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "mediaTypeCatalog.h"
+
+const DWORD CATALOG_MAGIC = 0x5443544D;     // "MTCT"
+const DWORD CATALOG_VERSION = 1;
+// Largest record and file accepted, against damaged files
+const DWORD CATALOG_MAX_RECORD = 1024 * 1024;
+const DWORD CATALOG_MAX_FILE = 16 * 1024 * 1024;
+
+struct CatalogFileHeader
+{
+	DWORD magic;
+	DWORD version;
+	DWORD nRecords;
+	DWORD cbRecords;            // The records follow back to back
+};
+
+// One device, followed by its link and then its streams
+struct CatalogRecord
+{
+	DWORD cbRecord;
+	DWORD cchLink;              // With the terminator, rounded up to even
+	DWORD nStreams;
+};
+
+// One stream, followed by its types
+struct CatalogStream
+{
+	GUID  majorType;            // Of the first type
+	GUID  negotiatedSubtype;    // GUID_NULL until one is set
+	DWORD nTypes;
+	DWORD cbTypes;
+};
+
+// One native type, followed by its attributes padded to 4 bytes
+struct CatalogType
+{
+	GUID  subtype;
+	DWORD cbBlob;
+};
+
+static CatalogRecord **s_records = NULL;
+static DWORD s_nRecords = 0;
+static DWORD s_nAllocated = 0;
+static BOOL s_bChanged = FALSE;
+static INIT_ONCE s_catalogOnce = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION s_catalogLock;
+
+static BOOL CALLBACK initCatalog(PINIT_ONCE pInitOnce, void *pParameter,
+								 void **ppContext) {
+	InitializeCriticalSection(&s_catalogLock);
+	return TRUE;
+}
+
+static void lockCatalog() {
+	InitOnceExecuteOnce(&s_catalogOnce, initCatalog, NULL, NULL);
+	EnterCriticalSection(&s_catalogLock);
+}
+
+static DWORD padToDword(DWORD cb) {
+	return (cb + 3) & ~3;
+}
+
+static const WCHAR *recordLink(const CatalogRecord *pRecord) {
+	return (const WCHAR *)(pRecord + 1);
+}
+
+static CatalogStream *firstStream(CatalogRecord *pRecord) {
+	return (CatalogStream *)((BYTE *)(pRecord + 1) +
+		pRecord->cchLink * sizeof(WCHAR));
+}
+
+static CatalogStream *nextStream(CatalogStream *pStream) {
+	return (CatalogStream *)((BYTE *)(pStream + 1) + pStream->cbTypes);
+}
+
+static CatalogType *nextType(CatalogType *pType) {
+	return (CatalogType *)((BYTE *)(pType + 1) + padToDword(pType->cbBlob));
+}
+
+// Checks that a record read from disk holds together.  cbAvailable is
+// what is left of the file.
+static BOOL checkRecord(const BYTE *pData, DWORD cbAvailable) {
+	if (cbAvailable < sizeof(CatalogRecord)) {
+		return FALSE;
+	}
+	CatalogRecord *pRecord = (CatalogRecord *)pData;
+	DWORD cbRecord = pRecord->cbRecord;
+	if (cbRecord < sizeof(CatalogRecord) || cbRecord > cbAvailable ||
+		cbRecord > CATALOG_MAX_RECORD ||
+		cbRecord % 4 != 0 || pRecord->cchLink == 0 ||
+		pRecord->cchLink % 2 != 0 ||
+		pRecord->cchLink > (cbRecord - sizeof(CatalogRecord)) / sizeof(WCHAR) ||
+		recordLink(pRecord)[pRecord->cchLink - 1] != L'\0') {
+		return FALSE;
+	}
+	const BYTE *pEnd = pData + cbRecord;
+	CatalogStream *pStream = firstStream(pRecord);
+	for (DWORD i = 0; i < pRecord->nStreams; i++) {
+		if ((DWORD)(pEnd - (BYTE *)pStream) < sizeof(CatalogStream) ||
+			pStream->cbTypes > (DWORD)(pEnd - (BYTE *)(pStream + 1))) {
+			return FALSE;
+		}
+		const BYTE *pTypesEnd = (BYTE *)(pStream + 1) + pStream->cbTypes;
+		CatalogType *pType = (CatalogType *)(pStream + 1);
+		for (DWORD j = 0; j < pStream->nTypes; j++) {
+			if ((DWORD)(pTypesEnd - (BYTE *)pType) < sizeof(CatalogType) ||
+				pType->cbBlob > CATALOG_MAX_RECORD ||
+				padToDword(pType->cbBlob) >
+				(DWORD)(pTypesEnd - (BYTE *)(pType + 1))) {
+				return FALSE;
+			}
+			pType = nextType(pType);
+		}
+		if ((BYTE *)pType != pTypesEnd) {
+			return FALSE;
+		}
+		pStream = nextStream(pStream);
+	}
+	return (BYTE *)pStream == pEnd;
+}
+
+// Returns the index of the device's record, or -1.  Call locked.
+static int findRecord(const WCHAR *szLink) {
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		if (_wcsicmp(recordLink(s_records[i]), szLink) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Returns a stream of the device, resolving the first audio or video
+// stream, or NULL.  Call locked.
+static CatalogStream *findStream(CatalogRecord *pRecord, DWORD dwStream) {
+	CatalogStream *pStream = firstStream(pRecord);
+	for (DWORD i = 0; i < pRecord->nStreams; i++) {
+		if (dwStream == (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM) {
+			if (pStream->majorType == MFMediaType_Audio) {
+				return pStream;
+			}
+		} else if (dwStream == (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM) {
+			if (pStream->majorType == MFMediaType_Video) {
+				return pStream;
+			}
+		} else if (i == dwStream) {
+			return pStream;
+		}
+		pStream = nextStream(pStream);
+	}
+	return NULL;
+}
+
+// Finds a type, failing as GetNativeMediaType would.  Call locked.
+static HRESULT findType(const WCHAR *szLink, DWORD dwStream, DWORD dwIndex,
+						CatalogStream **ppStream, CatalogType **ppType) {
+	if (szLink == NULL) {
+		return E_POINTER;
+	}
+	int iRecord = findRecord(szLink);
+	if (iRecord < 0) {
+		return MF_E_NOT_FOUND;
+	}
+	CatalogStream *pStream = findStream(s_records[iRecord], dwStream);
+	if (pStream == NULL) {
+		return MF_E_INVALIDSTREAMNUMBER;
+	}
+	*ppStream = pStream;
+	if (ppType == NULL) {
+		return S_OK;
+	}
+	if (dwIndex >= pStream->nTypes) {
+		return MF_E_NO_MORE_TYPES;
+	}
+	CatalogType *pType = (CatalogType *)(pStream + 1);
+	for (DWORD i = 0; i < dwIndex; i++) {
+		pType = nextType(pType);
+	}
+	*ppType = pType;
+	return S_OK;
+}
+
+// Adds the record, replacing any for the same device.  Call locked.
+static HRESULT addRecord(CatalogRecord *pRecord) {
+	int iRecord = findRecord(recordLink(pRecord));
+	if (iRecord >= 0) {
+		delete [] (BYTE *)s_records[iRecord];
+		s_records[iRecord] = pRecord;
+		s_bChanged = TRUE;
+		return S_OK;
+	}
+	if (s_nRecords == s_nAllocated) {
+		DWORD nAllocated = max(2 * s_nAllocated, 8);
+		CatalogRecord **ppRecords =
+			new (std::nothrow) CatalogRecord *[nAllocated];
+		if (ppRecords == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		if (s_nRecords > 0) {
+			CopyMemory(ppRecords, s_records, s_nRecords * sizeof(CatalogRecord *));
+		}
+		delete [] s_records;
+		s_records = ppRecords;
+		s_nAllocated = nAllocated;
+	}
+	s_records[s_nRecords++] = pRecord;
+	s_bChanged = TRUE;
+	return S_OK;
+}
+
+// Drops a record, moving the last into its place.  Call locked.
+static void removeRecord(DWORD iRecord) {
+	delete [] (BYTE *)s_records[iRecord];
+	s_records[iRecord] = s_records[--s_nRecords];
+	s_bChanged = TRUE;
+}
+
+// A record as it is built, growing as types are added
+struct RecordBuilder
+{
+	BYTE  *pData;
+	DWORD cbData;
+	DWORD cbAllocated;
+};
+
+// Adds cb zeroed bytes and returns their offset, or -1 if out of memory
+// or past the largest record
+static LONG appendRecord(RecordBuilder *pBuilder, DWORD cb) {
+	if (cb > CATALOG_MAX_RECORD - pBuilder->cbData) {
+		return -1;
+	}
+	if (pBuilder->cbData + cb > pBuilder->cbAllocated) {
+		DWORD cbAllocated = max(2 * pBuilder->cbAllocated, 4096);
+		while (cbAllocated < pBuilder->cbData + cb) {
+			cbAllocated *= 2;
+		}
+		BYTE *pData = new (std::nothrow) BYTE[cbAllocated];
+		if (pData == NULL) {
+			return -1;
+		}
+		if (pBuilder->cbData > 0) {
+			CopyMemory(pData, pBuilder->pData, pBuilder->cbData);
+		}
+		delete [] pBuilder->pData;
+		pBuilder->pData = pData;
+		pBuilder->cbAllocated = cbAllocated;
+	}
+	LONG offset = (LONG)pBuilder->cbData;
+	ZeroMemory(pBuilder->pData + offset, cb);
+	pBuilder->cbData += cb;
+	return offset;
+}
+
+// Adds one native type to the stream at streamOffset
+static HRESULT appendType(RecordBuilder *pBuilder, LONG streamOffset,
+						  IMFMediaType *pType) {
+	UINT32 cbBlob = 0;
+	HRESULT hr = MFGetAttributesAsBlobSize(pType, &cbBlob);
+	LONG typeOffset = -1;
+	if (SUCCEEDED(hr)) {
+		typeOffset = appendRecord(pBuilder,
+			sizeof(CatalogType) + padToDword(cbBlob));
+		if (typeOffset < 0) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		CatalogType *pCatalogType = (CatalogType *)(pBuilder->pData + typeOffset);
+		pCatalogType->cbBlob = cbBlob;
+		pType->GetGUID(MF_MT_SUBTYPE, &pCatalogType->subtype);
+		hr = MFGetAttributesAsBlob(pType, (UINT8 *)(pCatalogType + 1), cbBlob);
+	}
+	if (SUCCEEDED(hr)) {
+		CatalogStream *pStream = (CatalogStream *)(pBuilder->pData + streamOffset);
+		if (pStream->nTypes == 0) {
+			pType->GetGUID(MF_MT_MAJOR_TYPE, &pStream->majorType);
+		}
+		pStream->nTypes++;
+		pStream->cbTypes += sizeof(CatalogType) + padToDword(cbBlob);
+	}
+	return hr;
+}
+
+// Asks the reader for every native type of every stream
+static HRESULT buildRecord(const WCHAR *szLink, IMFSourceReader *pReader,
+						   CatalogRecord **ppRecord) {
+	RecordBuilder builder = { NULL, 0, 0 };
+	DWORD cchLink = (DWORD)(wcslen(szLink) + 2) & ~1;
+	HRESULT hr = S_OK;
+	if (appendRecord(&builder, sizeof(CatalogRecord)) < 0 ||
+		appendRecord(&builder, cchLink * sizeof(WCHAR)) < 0) {
+		hr = E_OUTOFMEMORY;
+	}
+	if (SUCCEEDED(hr)) {
+		CopyMemory(builder.pData + sizeof(CatalogRecord), szLink,
+			wcslen(szLink) * sizeof(WCHAR));
+		((CatalogRecord *)builder.pData)->cchLink = cchLink;
+	}
+	for (DWORD dwStream = 0; SUCCEEDED(hr); dwStream++) {
+		LONG streamOffset = appendRecord(&builder, sizeof(CatalogStream));
+		if (streamOffset < 0) {
+			hr = E_OUTOFMEMORY;
+			break;
+		}
+		for (DWORD dwIndex = 0; SUCCEEDED(hr); dwIndex++) {
+			IMFMediaType *pType = NULL;
+			hr = pReader->GetNativeMediaType(dwStream, dwIndex, &pType);
+			if (SUCCEEDED(hr)) {
+				hr = appendType(&builder, streamOffset, pType);
+				pType->Release();
+			}
+		}
+		if (hr == MF_E_INVALIDSTREAMNUMBER) {
+			// Past the last stream
+			builder.cbData = (DWORD)streamOffset;
+			hr = S_OK;
+			break;
+		} else if (hr == MF_E_NO_MORE_TYPES) {
+			((CatalogRecord *)builder.pData)->nStreams++;
+			hr = S_OK;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		((CatalogRecord *)builder.pData)->cbRecord = builder.cbData;
+		*ppRecord = (CatalogRecord *)builder.pData;
+	} else {
+		delete [] builder.pData;
+	}
+	return hr;
+}
+
+HRESULT catalogGetDevice(const WCHAR *szLink, IMFSourceReader *pReader) {
+	if (szLink == NULL) {
+		return E_POINTER;
+	}
+	lockCatalog();
+	BOOL bFound = findRecord(szLink) >= 0;
+	LeaveCriticalSection(&s_catalogLock);
+	if (bFound) {
+		return S_OK;
+	}
+	if (pReader == NULL) {
+		return MF_E_NOT_FOUND;
+	}
+
+	// Query the device unlocked; it can take a while
+	CatalogRecord *pRecord = NULL;
+	HRESULT hr = buildRecord(szLink, pReader, &pRecord);
+	if (SUCCEEDED(hr)) {
+		lockCatalog();
+		hr = addRecord(pRecord);
+		LeaveCriticalSection(&s_catalogLock);
+		if (FAILED(hr)) {
+			delete [] (BYTE *)pRecord;
+		}
+	}
+	return hr;
+}
+
+void catalogDeviceChanged(const WCHAR *szName) {
+	if (szName == NULL) {
+		return;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szName);
+	if (iRecord >= 0) {
+		removeRecord((DWORD)iRecord);
+	} else {
+		for (DWORD i = s_nRecords; i-- > 0; ) {
+			CatalogStream *pStream = findStream(s_records[i],
+				(DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM);
+			if (pStream != NULL) {
+				removeRecord(i);
+			}
+		}
+	}
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+void catalogForgetDevice(const WCHAR *szLink) {
+	if (szLink == NULL) {
+		return;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szLink);
+	if (iRecord >= 0) {
+		removeRecord((DWORD)iRecord);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+HRESULT catalogGetStreamCount(const WCHAR *szLink, DWORD *pnStreams) {
+	if (szLink == NULL || pnStreams == NULL) {
+		return E_POINTER;
+	}
+	lockCatalog();
+	int iRecord = findRecord(szLink);
+	if (iRecord >= 0) {
+		*pnStreams = s_records[iRecord]->nStreams;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return iRecord >= 0 ? S_OK : MF_E_NOT_FOUND;
+}
+
+HRESULT catalogGetNativeSubtype(const WCHAR *szLink, DWORD dwStream,
+								DWORD dwIndex, GUID *pMajorType, GUID *pSubtype) {
+	if (pMajorType == NULL || pSubtype == NULL) {
+		return E_POINTER;
+	}
+	CatalogStream *pStream;
+	CatalogType *pType;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, dwIndex, &pStream, &pType);
+	if (SUCCEEDED(hr)) {
+		*pMajorType = pStream->majorType;
+		*pSubtype = pType->subtype;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+HRESULT catalogGetNativeType(const WCHAR *szLink, DWORD dwStream,
+							 DWORD dwIndex, IMFMediaType **ppType) {
+	if (ppType == NULL) {
+		return E_POINTER;
+	}
+	*ppType = NULL;
+	IMFMediaType *pMediaType = NULL;
+	HRESULT hr = MFCreateMediaType(&pMediaType);
+	if (FAILED(hr)) {
+		return hr;
+	}
+	CatalogStream *pStream;
+	CatalogType *pType;
+	lockCatalog();
+	hr = findType(szLink, dwStream, dwIndex, &pStream, &pType);
+	if (SUCCEEDED(hr)) {
+		hr = MFInitAttributesFromBlob(pMediaType, (const UINT8 *)(pType + 1),
+			pType->cbBlob);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	if (SUCCEEDED(hr)) {
+		*ppType = pMediaType;
+	} else {
+		pMediaType->Release();
+	}
+	return hr;
+}
+
+HRESULT catalogGetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+									GUID *pSubtype) {
+	if (pSubtype == NULL) {
+		return E_POINTER;
+	}
+	CatalogStream *pStream;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, 0, &pStream, NULL);
+	if (SUCCEEDED(hr)) {
+		if (pStream->negotiatedSubtype == GUID_NULL) {
+			hr = MF_E_NOT_FOUND;
+		} else {
+			*pSubtype = pStream->negotiatedSubtype;
+		}
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+HRESULT catalogSetNegotiatedSubtype(const WCHAR *szLink, DWORD dwStream,
+									REFGUID subtype) {
+	CatalogStream *pStream;
+	lockCatalog();
+	HRESULT hr = findType(szLink, dwStream, 0, &pStream, NULL);
+	if (SUCCEEDED(hr) && pStream->negotiatedSubtype != subtype) {
+		pStream->negotiatedSubtype = subtype;
+		s_bChanged = TRUE;
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
+// Call locked
+static void clearRecords() {
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		delete [] (BYTE *)s_records[i];
+	}
+	delete [] s_records;
+	s_records = NULL;
+	s_nRecords = 0;
+	s_nAllocated = 0;
+}
+
+void catalogClear() {
+	lockCatalog();
+	clearRecords();
+	s_bChanged = TRUE;
+	LeaveCriticalSection(&s_catalogLock);
+}
+
+// Splits the records of a file into the catalog.  Call locked, with the
+// catalog empty.
+static HRESULT readRecords(const BYTE *pData, DWORD cbData) {
+	const CatalogFileHeader *pHeader = (const CatalogFileHeader *)pData;
+	if (cbData < sizeof(CatalogFileHeader) ||
+		pHeader->magic != CATALOG_MAGIC ||
+		pHeader->version != CATALOG_VERSION ||
+		pHeader->cbRecords != cbData - sizeof(CatalogFileHeader)) {
+		return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+	}
+	const BYTE *pRecordData = pData + sizeof(CatalogFileHeader);
+	const BYTE *pEnd = pData + cbData;
+	for (DWORD i = 0; i < pHeader->nRecords; i++) {
+		DWORD cbAvailable = (DWORD)(pEnd - pRecordData);
+		if (!checkRecord(pRecordData, cbAvailable)) {
+			return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		}
+		DWORD cbRecord = ((const CatalogRecord *)pRecordData)->cbRecord;
+		BYTE *pCopy = new (std::nothrow) BYTE[cbRecord];
+		if (pCopy == NULL) {
+			return E_OUTOFMEMORY;
+		}
+		CopyMemory(pCopy, pRecordData, cbRecord);
+		HRESULT hr = addRecord((CatalogRecord *)pCopy);
+		if (FAILED(hr)) {
+			delete [] pCopy;
+			return hr;
+		}
+		pRecordData += cbRecord;
+	}
+	return pRecordData == pEnd ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+}
+
+HRESULT catalogLoad(const WCHAR *szPath) {
+	HRESULT hr = S_OK;
+	BYTE *pData = NULL;
+	DWORD cbData = 0;
+	HANDLE hFile = CreateFileW(szPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		LARGE_INTEGER cbFile;
+		if (!GetFileSizeEx(hFile, &cbFile)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		} else if (cbFile.QuadPart > CATALOG_MAX_FILE) {
+			hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		} else {
+			cbData = (DWORD)cbFile.QuadPart;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		pData = new (std::nothrow) BYTE[max(cbData, 1)];
+		if (pData == NULL) {
+			hr = E_OUTOFMEMORY;
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		DWORD cbRead = 0;
+		if (!ReadFile(hFile, pData, cbData, &cbRead, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		} else if (cbRead != cbData) {
+			hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+
+	lockCatalog();
+	clearRecords();
+	if (SUCCEEDED(hr)) {
+		hr = readRecords(pData, cbData);
+		if (FAILED(hr)) {
+			// All or nothing
+			clearRecords();
+		}
+	}
+	s_bChanged = FALSE;
+	LeaveCriticalSection(&s_catalogLock);
+	delete [] pData;
+	return hr;
+}
+
+HRESULT catalogSave(const WCHAR *szPath) {
+	// Written beside the file and moved over it, so a run that stops
+	// part way leaves the old one
+	WCHAR szTempPath[MAX_PATH];
+	HRESULT hr = StringCchPrintfW(szTempPath, MAX_PATH, L"%s.tmp", szPath);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	lockCatalog();
+	if (!s_bChanged) {
+		LeaveCriticalSection(&s_catalogLock);
+		return S_FALSE;
+	}
+	CatalogFileHeader header = { CATALOG_MAGIC, CATALOG_VERSION, s_nRecords, 0 };
+	for (DWORD i = 0; i < s_nRecords; i++) {
+		header.cbRecords += s_records[i]->cbRecord;
+	}
+	HANDLE hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	DWORD cbWritten;
+	if (SUCCEEDED(hr) &&
+		!WriteFile(hFile, &header, sizeof(header), &cbWritten, NULL)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	for (DWORD i = 0; SUCCEEDED(hr) && i < s_nRecords; i++) {
+		if (!WriteFile(hFile, s_records[i], s_records[i]->cbRecord,
+			&cbWritten, NULL)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	if (SUCCEEDED(hr) &&
+		!MoveFileExW(szTempPath, szPath, MOVEFILE_REPLACE_EXISTING)) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+	}
+	if (SUCCEEDED(hr)) {
+		s_bChanged = FALSE;
+	} else {
+		DeleteFileW(szTempPath);
+	}
+	LeaveCriticalSection(&s_catalogLock);
+	return hr;
+}
+
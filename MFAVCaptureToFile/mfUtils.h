@@ -17,10 +17,15 @@
 #include <shlwapi.h>
 #include <Mferror.h>
 
-WCHAR *getFriendlyGuidString(GUID guid);
+#include "errorRegistry.h"
+
+const WCHAR *lookupGuidName(REFGUID guid);
+HRESULT registerGuidName(REFGUID guid, const WCHAR *szName);
+HRESULT formatGuidString(REFGUID guid, WCHAR *szString, int nChars);
+const WCHAR *getFriendlyGuidString(GUID guid);
 void getFriendlyGuidString(GUID guid, WCHAR *szString, int nChars);
 OLECHAR *getGuidString(GUID guid);
-TCHAR *getErrorDescription(HRESULT hr);
+const TCHAR *getErrorDescription(HRESULT hr);
 void printErrorDescription(HRESULT hr);
 void initializeMfCom();
 void shutdownMfCom();
@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "preRollBuffer.h"
+
+PreRollBuffer::PreRollBuffer() :
+m_pData(NULL),
+m_cbCapacity(0),
+m_pEntries(NULL),
+m_nMaxEntries(0),
+m_iOldest(0),
+m_nEntries(0),
+m_cbWrite(0),
+m_cbReserved(0),
+m_llWindow(0),
+m_nDropped(0)
+{
+}
+
+PreRollBuffer::~PreRollBuffer()
+{
+	Free();
+}
+
+HRESULT PreRollBuffer::Initialize(DWORD cbCapacity, DWORD nMaxEntries,
+								  LONGLONG llWindow)
+{
+	if (cbCapacity == 0 || nMaxEntries == 0 || llWindow <= 0) {
+		return E_INVALIDARG;
+	}
+
+	Free();
+	m_pData = new (std::nothrow) BYTE[cbCapacity];
+	m_pEntries = new (std::nothrow) PreRollEntry[nMaxEntries];
+	if (m_pData == NULL || m_pEntries == NULL) {
+		Free();
+		return E_OUTOFMEMORY;
+	}
+	m_cbCapacity = cbCapacity;
+	m_nMaxEntries = nMaxEntries;
+	m_llWindow = llWindow;
+	m_nDropped = 0;
+	Clear();
+	return S_OK;
+}
+
+void PreRollBuffer::Free()
+{
+	delete [] m_pData;
+	m_pData = NULL;
+	delete [] m_pEntries;
+	m_pEntries = NULL;
+	m_cbCapacity = 0;
+	m_nMaxEntries = 0;
+	Clear();
+}
+
+void PreRollBuffer::Clear()
+{
+	m_iOldest = 0;
+	m_nEntries = 0;
+	m_cbWrite = 0;
+	m_cbReserved = 0;
+}
+
+void PreRollBuffer::DropOldest()
+{
+	m_iOldest = (m_iOldest + 1) % m_nMaxEntries;
+	m_nEntries--;
+	m_nDropped++;
+	if (m_nEntries == 0) {
+		m_cbWrite = 0;
+	}
+}
+
+BYTE *PreRollBuffer::Reserve(DWORD cbData)
+{
+	if (m_pData == NULL || cbData > m_cbCapacity) {
+		m_cbReserved = 0;
+		m_nDropped++;
+		return NULL;
+	}
+
+	if (m_nEntries == m_nMaxEntries) {
+		DropOldest();
+	}
+
+	// The samples in use run from the oldest to m_cbWrite, wrapping at
+	// most once.  Drop the oldest until the new one fits after the
+	// newest, or at the start of the block when the end is too short.
+	while (m_nEntries > 0) {
+		DWORD cbOldest = Oldest().cbOffset;
+		if (m_cbWrite > cbOldest) {
+			if (cbData <= m_cbCapacity - m_cbWrite) {
+				break;
+			}
+			if (cbData <= cbOldest) {
+				m_cbWrite = 0;
+				break;
+			}
+		} else if (cbData <= cbOldest - m_cbWrite) {
+			break;
+		}
+		DropOldest();
+	}
+	if (m_nEntries == 0 && cbData > m_cbCapacity - m_cbWrite) {
+		m_cbWrite = 0;
+	}
+
+	m_cbReserved = cbData;
+	return m_pData + m_cbWrite;
+}
+
+void PreRollBuffer::Commit(LONGLONG llTime, LONGLONG llDuration)
+{
+	PreRollEntry *pEntry = &m_pEntries[(m_iOldest + m_nEntries) % m_nMaxEntries];
+	pEntry->cbOffset = m_cbWrite;
+	pEntry->cbData = m_cbReserved;
+	pEntry->llTime = llTime;
+	pEntry->llDuration = llDuration;
+	m_nEntries++;
+	m_cbWrite += m_cbReserved;
+	m_cbReserved = 0;
+
+	// Age out what is no longer within the window of the newest sample
+	LONGLONG llEnd = llTime + llDuration;
+	while (m_nEntries > 1 && llEnd - Oldest().llTime > m_llWindow) {
+		DropOldest();
+	}
+}
+
+BOOL PreRollBuffer::Push(const BYTE *pData, DWORD cbData, LONGLONG llTime,
+						 LONGLONG llDuration)
+{
+	BYTE *pDest = Reserve(cbData);
+	if (pDest == NULL) {
+		return FALSE;
+	}
+	CopyMemory(pDest, pData, cbData);
+	Commit(llTime, llDuration);
+	return TRUE;
+}
+
+const BYTE *PreRollBuffer::GetEntry(DWORD i, PreRollEntry *pEntry) const
+{
+	if (i >= m_nEntries) {
+		return NULL;
+	}
+	*pEntry = m_pEntries[(m_iOldest + i) % m_nMaxEntries];
+	return m_pData + pEntry->cbOffset;
+}
+
+// Time from the start of the oldest sample to the end of the newest
+LONGLONG PreRollBuffer::Duration() const
+{
+	if (m_nEntries == 0) {
+		return 0;
+	}
+	const PreRollEntry &newest =
+		m_pEntries[(m_iOldest + m_nEntries - 1) % m_nMaxEntries];
+	return newest.llTime + newest.llDuration - Oldest().llTime;
+}
@@ -0,0 +1,76 @@
+//////////////////////////////////////////////////////////////////////////
+// preRollBuffer.h: Fixed-size ring of the most recent captured samples
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Seconds kept before the trigger when none are given
+const DWORD PREROLL_DEFAULT_SECONDS = 10;
+const DWORD PREROLL_MAX_SECONDS = 600;
+// Index slots per second of pre-roll.  Audio sources deliver a sample
+// every 10 ms or so and video sources one per frame, so this leaves
+// room for either.
+const DWORD PREROLL_ENTRIES_PER_SECOND = 256;
+
+// Where one sample is in the ring, and its times, in 100-ns units
+struct PreRollEntry
+{
+    DWORD       cbOffset;
+    DWORD       cbData;
+    LONGLONG    llTime;
+    LONGLONG    llDuration;
+};
+
+// Keeps copies of the last llWindow of samples in one block of memory
+// allocated up front.  Each new sample is copied in after the previous
+// one, wrapping to the start of the block when it does not fit at the
+// end, and the oldest samples are dropped to make room or when they
+// fall outside the window.  Nothing is allocated after Initialize.
+//
+// There is no locking.  One thread fills the ring; once it stops,
+// another may read it (see CCapture::Trigger).  Nothing here depends
+// on Media Foundation.
+class PreRollBuffer
+{
+public:
+    PreRollBuffer();
+    ~PreRollBuffer();
+
+    HRESULT Initialize(DWORD cbCapacity, DWORD nMaxEntries, LONGLONG llWindow);
+    void    Free();
+    // Drops every sample but keeps the memory
+    void    Clear();
+
+    // Makes room for a sample of cbData bytes and returns where to copy
+    // it, or NULL if it is larger than the ring.  Commit records it.
+    BYTE    *Reserve(DWORD cbData);
+    void    Commit(LONGLONG llTime, LONGLONG llDuration);
+    BOOL    Push(const BYTE *pData, DWORD cbData, LONGLONG llTime,
+                 LONGLONG llDuration);
+
+    // Sample i, oldest first
+    const BYTE *GetEntry(DWORD i, PreRollEntry *pEntry) const;
+
+    DWORD       Count() const { return m_nEntries; }
+    BOOL        IsInitialized() const { return m_pData != NULL; }
+    DWORD       Capacity() const { return m_cbCapacity; }
+    LONGLONG    Duration() const;
+    LONGLONG    DroppedCount() const { return m_nDropped; }
+
+private:
+    const PreRollEntry &Oldest() const { return m_pEntries[m_iOldest]; }
+    void    DropOldest();
+
+    BYTE            *m_pData;
+    DWORD           m_cbCapacity;
+    PreRollEntry    *m_pEntries;        // Ring of m_nMaxEntries
+    DWORD           m_nMaxEntries;
+    DWORD           m_iOldest;
+    DWORD           m_nEntries;
+    DWORD           m_cbWrite;          // Where the next sample goes
+    DWORD           m_cbReserved;       // Size of the reserved sample
+    LONGLONG        m_llWindow;
+    LONGLONG        m_nDropped;         // Samples that aged out or were too large
+};
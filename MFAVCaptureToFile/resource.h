@@ -10,6 +10,10 @@
 #define IDC_CAPTURE_BOTTOM              1005
 #define IDC_AUDIO                       1006
 #define IDC_VIDEO                       1007
+#define IDC_ALL_DEVICES                 1008
+#define IDC_PREROLL                     1009
+#define IDC_PREROLL_SECONDS             1010
+#define IDC_TRIGGER                     1011
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -18,7 +22,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        102
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1008
+#define _APS_NEXT_CONTROL_VALUE         1012
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
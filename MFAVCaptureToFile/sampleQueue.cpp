@@ -0,0 +1,248 @@
+#include "stdafx.h"
+#include "mfUtils.h"
+#include "sampleQueue.h"
+
+SampleQueue::SampleQueue() :
+m_ppSamples(NULL),
+m_nMask(0),
+m_nHead(0),
+m_nTail(0),
+m_nHighWater(0),
+m_nOverruns(0),
+m_nPushed(0)
+{
+}
+
+SampleQueue::~SampleQueue()
+{
+	Clear();
+	delete [] m_ppSamples;
+}
+
+// Allocates the ring.  nCapacity must be a power of 2.  Should not be
+// called while a producer or consumer is active.
+HRESULT SampleQueue::Initialize(LONG nCapacity)
+{
+	if (nCapacity <= 0 || (nCapacity & (nCapacity - 1)) != 0) {
+		return E_INVALIDARG;
+	}
+
+	Clear();
+	delete [] m_ppSamples;
+	m_ppSamples = new (std::nothrow) IMFSample*[nCapacity];
+	if (m_ppSamples == NULL) {
+		m_nMask = 0;
+		return E_OUTOFMEMORY;
+	}
+	ZeroMemory(m_ppSamples, nCapacity * sizeof(IMFSample*));
+	m_nMask = (ULONG)nCapacity - 1;
+
+	m_nHead = 0;
+	m_nTail = 0;
+	m_nHighWater = 0;
+	m_nOverruns = 0;
+	m_nPushed = 0;
+	return S_OK;
+}
+
+// Releases anything still queued.  Should not be called while a
+// producer or consumer is active.
+void SampleQueue::Clear()
+{
+	IMFSample *pSample = NULL;
+	while (Pop(&pSample)) {
+		SafeRelease(&pSample);
+	}
+}
+
+BOOL SampleQueue::Push(IMFSample *pSample)
+{
+	if (m_ppSamples == NULL) {
+		return FALSE;
+	}
+
+	ULONG tail = m_nTail;
+	ULONG head = m_nHead;
+	if (tail - head > m_nMask) {
+		InterlockedIncrement(&m_nOverruns);
+		return FALSE;
+	}
+
+	pSample->AddRef();
+	m_ppSamples[tail & m_nMask] = pSample;
+
+	// Publish the slot before moving the tail
+	MemoryBarrier();
+	m_nTail = tail + 1;
+
+	// Only the producer writes these
+	LONG depth = (LONG)(tail + 1 - head);
+	if (depth > m_nHighWater) {
+		m_nHighWater = depth;
+	}
+	m_nPushed = m_nPushed + 1;
+	return TRUE;
+}
+
+BOOL SampleQueue::Pop(IMFSample **ppSample)
+{
+	ULONG head = m_nHead;
+	ULONG tail = m_nTail;
+	if (head == tail) {
+		return FALSE;
+	}
+
+	// Read the slot only after seeing the tail that published it
+	MemoryBarrier();
+	*ppSample = m_ppSamples[head & m_nMask];
+	m_ppSamples[head & m_nMask] = NULL;
+
+	// Hand the slot back to the producer
+	MemoryBarrier();
+	m_nHead = head + 1;
+	return TRUE;
+}
+
+void SampleQueue::GetStats(SampleQueueStats *pStats) const
+{
+	pStats->nDepth = Depth();
+	pStats->nHighWater = m_nHighWater;
+	pStats->nOverruns = m_nOverruns;
+	pStats->nPushed = m_nPushed;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// One run of a synthetic producer against a consumer thread
+struct QueueBenchRun
+{
+	SampleQueue     *pQueue;
+	LONG            nSamples;       // Samples the producer offers
+	DWORD           msecPace;       // Producer sleep every 8 samples
+	DWORD           msecStall;      // Consumer stall every 256 samples
+	volatile LONG   bDone;          // Set by the producer when finished
+	LONG            nPopped;
+	LONG            nOutOfOrder;
+	LONG            nLeaked;        // Samples still referenced after the last release
+};
+
+// The consumer: checks that sample times only increase, since the
+// producer numbers them, and that the queue gave up its reference
+static unsigned __stdcall queueBenchConsumer(void *pContext)
+{
+	QueueBenchRun *pRun = (QueueBenchRun *)pContext;
+	LONGLONG llLast = -1;
+
+	for (;;) {
+		IMFSample *pSample = NULL;
+		if (!pRun->pQueue->Pop(&pSample)) {
+			if (pRun->bDone && pRun->pQueue->Depth() == 0) {
+				break;
+			}
+			Sleep(0);
+			continue;
+		}
+
+		LONGLONG llTime = 0;
+		pSample->GetSampleTime(&llTime);
+		if (llTime <= llLast) {
+			pRun->nOutOfOrder++;
+		}
+		llLast = llTime;
+		if (pSample->Release() != 0) {
+			pRun->nLeaked++;
+		}
+
+		pRun->nPopped++;
+		if (pRun->msecStall && (pRun->nPopped % 256) == 0) {
+			Sleep(pRun->msecStall);
+		}
+	}
+	return 0;
+}
+
+static void runQueueBench(const char *szName, LONG nCapacity, LONG nSamples,
+	DWORD msecPace, DWORD msecStall, LARGE_INTEGER freq)
+{
+	SampleQueue queue;
+	QueueBenchRun run = { &queue, nSamples, msecPace, msecStall, FALSE, 0, 0, 0 };
+	LONGLONG llPushTicks = 0;
+	LONGLONG llMaxPushTicks = 0;
+
+	HRESULT hr = queue.Initialize(nCapacity);
+	HANDLE hConsumer = NULL;
+	if (SUCCEEDED(hr)) {
+		hConsumer = (HANDLE)_beginthreadex(NULL, 0, queueBenchConsumer,
+			&run, 0, NULL);
+		if (hConsumer == NULL) {
+			hr = E_FAIL;
+		}
+	}
+
+	LARGE_INTEGER tStart, tEnd;
+	QueryPerformanceCounter(&tStart);
+	for (LONG i = 0; i < nSamples && SUCCEEDED(hr); i++) {
+		IMFSample *pSample = NULL;
+		hr = MFCreateSample(&pSample);
+		if (SUCCEEDED(hr)) {
+			pSample->SetSampleTime(i);
+
+			LARGE_INTEGER t0, t1;
+			QueryPerformanceCounter(&t0);
+			queue.Push(pSample);
+			QueryPerformanceCounter(&t1);
+			llPushTicks += t1.QuadPart - t0.QuadPart;
+			llMaxPushTicks = max(llMaxPushTicks, t1.QuadPart - t0.QuadPart);
+
+			// The queue holds its own reference, if it took the sample
+			pSample->Release();
+		}
+		if (msecPace && (i % 8) == 7) {
+			Sleep(msecPace);
+		}
+	}
+	QueryPerformanceCounter(&tEnd);
+	run.bDone = TRUE;
+	if (hConsumer) {
+		WaitForSingleObject(hConsumer, INFINITE);
+		CloseHandle(hConsumer);
+	}
+	if (FAILED(hr)) {
+		printf("  %-26s failed\n", szName);
+		printErrorDescription(hr);
+		return;
+	}
+
+	SampleQueueStats stats;
+	queue.GetStats(&stats);
+	BOOL bOk = run.nOutOfOrder == 0 && run.nLeaked == 0 &&
+		stats.nPushed == run.nPopped &&
+		stats.nPushed + stats.nOverruns == nSamples;
+	double seconds = (double)(tEnd.QuadPart - tStart.QuadPart) / freq.QuadPart;
+	printf("  %-26s %9.0f samples/s, push avg %.2f us max %.1f us, "
+		"high water %ld/%ld, %ld overruns, %s\n",
+		szName, nSamples / seconds,
+		llPushTicks * 1e6 / ((double)freq.QuadPart * nSamples),
+		llMaxPushTicks * 1e6 / (double)freq.QuadPart,
+		stats.nHighWater, nCapacity, stats.nOverruns, bOk ? "ok" : "FAILED");
+	if (!bOk) {
+		printf("    %ld popped, %I64d pushed, %ld out of order, %ld leaked\n",
+			run.nPopped, stats.nPushed, run.nOutOfOrder, run.nLeaked);
+	}
+}
+
+void benchmarkSampleQueue(void)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Sample queue benchmark\n");
+	runQueueBench("unpaced", SAMPLE_QUEUE_CAPACITY, 200000, 0, 0, freq);
+	runQueueBench("unpaced, 8 slots", 8, 200000, 0, 0, freq);
+	// About a 10 ms callback period, with the writer stalling for
+	// longer than the queue lasts
+	runQueueBench("paced, 100 ms stalls", 64, 4000, 10, 100, freq);
+	runQueueBench("paced, 1 ms stalls", SAMPLE_QUEUE_CAPACITY, 4000, 10, 1, freq);
+}
@@ -0,0 +1,57 @@
+//////////////////////////////////////////////////////////////////////////
+// sampleQueue.h: Bounded single-producer/single-consumer sample queue
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Default number of slots in the capture queue.  Must be a power of 2.
+const LONG SAMPLE_QUEUE_CAPACITY = 256;
+
+// Counters kept by the queue
+struct SampleQueueStats
+{
+    LONG        nDepth;         // Samples currently queued
+    LONG        nHighWater;     // Largest depth seen
+    LONG        nOverruns;      // Samples dropped because the queue was full
+    LONGLONG    nPushed;        // Samples accepted
+};
+
+// Lock-free ring of IMFSample pointers between exactly one producer
+// (the source reader callback) and one consumer (the writer thread).
+// The queue holds a reference on each sample while it is queued.
+class SampleQueue
+{
+public:
+    SampleQueue();
+    ~SampleQueue();
+
+    HRESULT Initialize(LONG nCapacity);
+    void    Clear();
+
+    // Producer side.  Returns FALSE and counts an overrun when full.
+    BOOL    Push(IMFSample *pSample);
+
+    // Consumer side.  Returns FALSE when empty.  The caller releases
+    // the returned sample.
+    BOOL    Pop(IMFSample **ppSample);
+
+    LONG    Depth() const { return (LONG)(m_nTail - m_nHead); }
+    void    GetStats(SampleQueueStats *pStats) const;
+
+private:
+    IMFSample       **m_ppSamples;
+    ULONG           m_nMask;            // Capacity - 1
+
+    volatile ULONG  m_nHead;            // Next slot to read, written by the consumer
+    volatile ULONG  m_nTail;            // Next slot to write, written by the producer
+
+    volatile LONG   m_nHighWater;
+    volatile LONG   m_nOverruns;
+    volatile LONGLONG m_nPushed;
+};
+
+// Runs a synthetic producer against a consumer thread, with and without
+// overruns, and checks the order and counts of what comes out
+void benchmarkSampleQueue(void);
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "sessionClock.h"
+
+const double HNS_PER_SEC = 10000000.0;
+
+void ClockTracker::Reset()
+{
+	m_llFirstTime = 0;
+	m_llMediaTime = 0;
+	m_nSamples = 0;
+	m_nEarly = 0;
+	m_sumX = 0;
+	m_sumY = 0;
+	m_sumXX = 0;
+	m_sumXY = 0;
+}
+
+// Adds a sample's host time stamp and duration, both in 100-ns units.
+// Samples without a duration still count but add no media time.
+void ClockTracker::AddSample(LONGLONG llTimestamp, LONGLONG llDuration)
+{
+	if (m_nSamples == 0) {
+		m_llFirstTime = llTimestamp;
+	}
+
+	double x = (llTimestamp - m_llFirstTime) / HNS_PER_SEC;
+	double y = m_llMediaTime / HNS_PER_SEC;
+	m_sumX += x;
+	m_sumY += y;
+	m_sumXX += x * x;
+	m_sumXY += x * y;
+	m_nSamples++;
+
+	if (llDuration > 0) {
+		m_llMediaTime += llDuration;
+	}
+}
+
+// Reports the alignment against the session base.  The drift is 0
+// until there are enough samples, spread over time, to fit.
+void ClockTracker::GetAlignment(LONGLONG llBaseTime, ClockAlignment *pAlign) const
+{
+	pAlign->llStartOffset = m_nSamples ? m_llFirstTime - llBaseTime : 0;
+	pAlign->nSamples = m_nSamples;
+	pAlign->nEarly = m_nEarly;
+	pAlign->driftPpm = 0;
+
+	double n = (double)m_nSamples;
+	double denom = n * m_sumXX - m_sumX * m_sumX;
+	if (m_nSamples > 2 && denom > 0) {
+		double slope = (n * m_sumXY - m_sumX * m_sumY) / denom;
+		pAlign->driftPpm = (slope - 1.0) * 1e6;
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+// One simulated device
+struct ClockBenchCase
+{
+	double driftPpm;            // Device clock rate - host rate
+	LONGLONG llJitter;          // Time stamps are off by up to this much
+	LONGLONG llDuration;        // Sample duration, in device time
+};
+
+void benchmarkClockTracker(void)
+{
+	const double SECONDS = 3600.0;
+	const double TOLERANCE_PPM = 0.1;
+	const ClockBenchCase cases[] = {
+		{ 0.0, 10000, 100000 },
+		{ 100.0, 10000, 100000 },
+		{ -250.0, 10000, 100000 },
+		{ 40.0, 10000, 100000 },
+		{ 40.0, 50000, 100000 },
+		{ -250.0, 10000, 213333 },
+	};
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+
+	printf("Clock drift check, %.0f s per device, tolerance %.1f ppm\n",
+		SECONDS, TOLERANCE_PPM);
+	for (DWORD i = 0; i < ARRAYSIZE(cases); i++) {
+		const ClockBenchCase *pCase = &cases[i];
+		ClockTracker tracker;
+		ClockAlignment align;
+		ULONG seed = 12345 + i;
+		LONGLONG llStart = 123456789012LL;
+		double period = pCase->llDuration / (1.0 + pCase->driftPpm * 1e-6);
+		LONGLONG nSamples = (LONGLONG)(SECONDS * HNS_PER_SEC / period);
+
+		// Host time stamps fall on the device's schedule, off by a
+		// uniform jitter, as the samples are stamped when they arrive
+		QueryPerformanceCounter(&t0);
+		for (LONGLONG n = 0; n < nSamples; n++) {
+			seed = seed * 1664525 + 1013904223;
+			LONGLONG llJitter = (LONGLONG)((seed >> 8) % (2 * pCase->llJitter + 1)) -
+				pCase->llJitter;
+			tracker.AddSample(llStart + (LONGLONG)(n * period) + llJitter,
+				pCase->llDuration);
+		}
+		QueryPerformanceCounter(&t1);
+		tracker.GetAlignment(llStart, &align);
+
+		double error = align.driftPpm - pCase->driftPpm;
+		BOOL bOk = align.nSamples == nSamples &&
+			error > -TOLERANCE_PPM && error < TOLERANCE_PPM;
+		printf("%+7.1f ppm, jitter %5.1f ms, %5.1f ms samples: measured %+9.3f ppm, "
+			"%.3f us per sample, %s\n", pCase->driftPpm,
+			pCase->llJitter / 10000.0, pCase->llDuration / 10000.0,
+			align.driftPpm,
+			(t1.QuadPart - t0.QuadPart) * 1e6 / freq.QuadPart / nSamples,
+			bOk ? "ok" : "FAILED");
+	}
+}
@@ -0,0 +1,72 @@
+//////////////////////////////////////////////////////////////////////////
+// sessionClock.h: Shared time base and clock drift for several captures
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "stdafx.h"
+
+// Time base shared by the captures of one session.  Capture devices
+// stamp their samples with the Media Foundation system time (derived
+// from QueryPerformanceCounter), so rebasing every capture against the
+// same instant puts all the files on one timeline.
+class SessionClock
+{
+public:
+    SessionClock() : m_llBaseTime(0) {}
+
+    // The base is read by the capture callbacks while a trigger may be
+    // moving it, so it is written and read whole, even on x86
+    void        Start() { StartAt(MFGetSystemTime()); }
+    // Moves the base, as when a pre-roll puts it before the trigger
+    void        StartAt(LONGLONG llBaseTime) { InterlockedExchange64(&m_llBaseTime, llBaseTime); }
+    LONGLONG    BaseTime() const
+    {
+        return InterlockedCompareExchange64(
+            const_cast<volatile LONGLONG *>(&m_llBaseTime), 0, 0);
+    }
+
+private:
+    volatile LONGLONG m_llBaseTime; // MFGetSystemTime at Start, 100-ns units
+};
+
+// Where a capture sits on the session timeline and how fast its clock
+// runs compared with the host clock
+struct ClockAlignment
+{
+    LONGLONG    llStartOffset;      // First sample time, relative to the session base
+    double      driftPpm;           // Device clock rate - host rate, parts per million
+    LONGLONG    nSamples;           // Samples measured
+    LONGLONG    nEarly;             // Samples dropped for preceding the session base
+};
+
+// Measures the drift of a device clock.  The media time a device
+// delivers (the sum of its sample durations) is fitted by least
+// squares against the host time stamps on its samples; the slope of
+// the fit is the rate of the device clock relative to the host.
+class ClockTracker
+{
+public:
+    ClockTracker() { Reset(); }
+
+    void    Reset();
+    void    AddSample(LONGLONG llTimestamp, LONGLONG llDuration);
+    void    CountEarly() { m_nEarly++; }
+    void    GetAlignment(LONGLONG llBaseTime, ClockAlignment *pAlign) const;
+
+private:
+    LONGLONG    m_llFirstTime;      // Host time stamp of the first sample
+    LONGLONG    m_llMediaTime;      // Media time delivered so far
+    LONGLONG    m_nSamples;
+    LONGLONG    m_nEarly;
+
+    // Least-squares sums, in seconds since the first sample
+    double      m_sumX;             // Host time
+    double      m_sumY;             // Media time
+    double      m_sumXX;
+    double      m_sumXY;
+};
+
+// Feeds ClockTracker an hour of jittered time stamps from simulated
+// devices at several known drifts and checks the drift it reports
+void benchmarkClockTracker(void);
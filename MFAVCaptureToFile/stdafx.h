@@ -6,6 +6,7 @@
 #pragma once
 
 #include <tchar.h>
+#include <process.h>
 #include <new>
 #include <windows.h>
 #include <mfapi.h>
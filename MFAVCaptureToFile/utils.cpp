@@ -1,8 +1,6 @@
 #include "stdafx.h"
 #include "utils.h"
 
-TCHAR szDebugString[PRINT_STRING_SIZE];
-
 /**************************** ansiToUnicode *******************************/
 DWORD ansiToUnicode(LPCSTR pszA, LPWSTR *ppszW)
 // Function to convert a char string to a unicode string.  If *ppszW
@@ -94,68 +92,45 @@ DWORD unicodeToAnsi(LPCWSTR pszW, LPSTR *ppszA)
 /**************************** errMsg **************************************/
 int errMsg(const TCHAR *format, ...)
 {
+	TCHAR szMessage[PRINT_STRING_SIZE];
 	va_list vargs;
 
 	va_start(vargs,format);
-	_vstprintf_s(szDebugString,format,vargs);
+	_vstprintf_s(szMessage,format,vargs);
 	va_end(vargs);
 
-	if(szDebugString[0] == '\0') return 0;
+	if(szMessage[0] == '\0') return 0;
 
 	// Display the string.
-	MessageBox(NULL,szDebugString,_T("Warning"),
+	MessageBox(NULL,szMessage,_T("Warning"),
 		MB_OK|MB_ICONWARNING|MB_TOPMOST);
-#ifdef _DEBUG
-	// Add a linefeed and print for debug
-	errno_t res = _tcscat_s(szDebugString, _T("\n"));
-	if(res) {
-		OutputDebugString(szDebugString);
-	}
-#endif
+	LOG_WARNING(_T("%s"), szMessage);
 
 	return 0;
 }
 /**************************** infoMsg *************************************/
 int infoMsg(const TCHAR *format, ...)
 {
+	TCHAR szMessage[PRINT_STRING_SIZE];
 	va_list vargs;
 
 	va_start(vargs,format);
-	_vstprintf_s(szDebugString,format,vargs);
+	_vstprintf_s(szMessage,format,vargs);
 	va_end(vargs);
 
-	if(szDebugString[0] == '\0') return 0;
+	if(szMessage[0] == '\0') return 0;
 
 	// Display the string.
-	MessageBox(NULL,szDebugString,_T("Information"),
+	MessageBox(NULL,szMessage,_T("Information"),
 		MB_OK|MB_ICONINFORMATION|MB_TOPMOST);
-#ifdef _DEBUG
-	// Add a linefeed and print for debug
-	errno_t res = _tcscat_s(szDebugString, _T("\n"));
-	if(res) {
-		OutputDebugString(szDebugString);
-	}
-#endif
+	LOG_INFO(_T("%s"), szMessage);
 
-	return 0;
-}/**************************** debugMsg ************************************/
-int debugMsg(const TCHAR *format, ...)
-{
-	va_list vargs;
-
-	va_start(vargs,format);
-	_vstprintf_s(szDebugString,format,vargs);
-	va_end(vargs);
-
-	if(szDebugString[0] == '\0') return 0;
-
-	// Display the string.
-	OutputDebugString(szDebugString);
 	return 0;
 }
 /**************************** sysErrMsg ***********************************/
 void sysErrMsg(LPTSTR lpHead)
 {
+	TCHAR szMessage[PRINT_STRING_SIZE];
 	LPTSTR lpMsgBuf=NULL;
 	DWORD error = GetLastError();
 	DWORD status;
@@ -174,22 +149,32 @@ void sysErrMsg(LPTSTR lpHead)
 	// Process any inserts in lpMsgBuf
 	// ...
 	if(status && lpMsgBuf) {
-		_stprintf_s(szDebugString,_T("%s (Error %d) %s"),lpHead,error,lpMsgBuf);
-		MessageBox(NULL,szDebugString,_T("Warning"),
+		_stprintf_s(szMessage,_T("%s (Error %d) %s"),lpHead,error,lpMsgBuf);
+		MessageBox(NULL,szMessage,_T("Warning"),
 			MB_OK|MB_ICONWARNING|MB_TOPMOST);
 		// Free the buffer
 	} else {
-		_stprintf_s(szDebugString,_T("%s (Error %d) No information is available"),
+		_stprintf_s(szMessage,_T("%s (Error %d) No information is available"),
 			lpHead,error);
-		MessageBox(NULL,szDebugString,_T("Warning"),
+		MessageBox(NULL,szMessage,_T("Warning"),
 			MB_OK|MB_ICONWARNING|MB_TOPMOST);
 	}
-#ifdef _DEBUG
-	// Add a linefeed and print for debug
-	errno_t res = _tcscat_s(szDebugString, _T("\n"));
-	if(res) {
-		OutputDebugString(szDebugString);
-	}
-#endif
+	LOG_WARNING(_T("%s"), szMessage);
 	LocalFree((HLOCAL)lpMsgBuf);
 }
+/**************************** openConsole *********************************/
+// Gives this windowed program a console for printf: the one it was run
+// from if there is one, else a new one, and says which in *pbNew
+BOOL openConsole(BOOL *pbNew)
+{
+	FILE *pFile = NULL;
+
+	*pbNew = FALSE;
+	if(!AttachConsole(ATTACH_PARENT_PROCESS)) {
+		if(!AllocConsole()) return FALSE;
+		*pbNew = TRUE;
+	}
+	if(freopen_s(&pFile,"CONOUT$","w",stdout) != 0) return FALSE;
+	if(freopen_s(&pFile,"CONIN$","r",stdin) != 0) return FALSE;
+	return TRUE;
+}
@@ -14,8 +14,10 @@
 #include "stdafx.h"
 #include "utils.h"
 #include "mfUtils.h"
+#include "mediaTypeCatalog.h"
 
 #include "capture.h"
+#include "captureSession.h"
 #include "resource.h"
 
 // Include the v6 common controls in the manifest
@@ -33,7 +35,7 @@ enum FileContainer {
 };
 
 DeviceList  g_devices;
-CCapture    *g_pCapture = NULL;
+CaptureSession *g_pSession = NULL;
 HDEVNOTIFY  g_hdevnotify = NULL;
 BOOL g_useAudio = 1;
 FileContainer g_file = FileContainer_TOP;
@@ -42,6 +44,11 @@ int g_lastVideoDevice = 0;
 
 const UINT32 TARGET_BIT_RATE = 240 * 1000;
 
+// Plugging in a device sends a burst of WM_DEVICECHANGE, so the device
+// list is refreshed once they have stopped for this long.
+const UINT_PTR IDT_DEVICE_REFRESH = 1;
+const UINT DEVICE_REFRESH_DELAY_MSEC = 250;
+
 INT_PTR CALLBACK DialogProc(HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam);
 
 void    OnInitDialog(HWND hDlg);
@@ -50,19 +57,28 @@ void    OnCloseDialog();
 void    UpdateUI(HWND hDlg);
 void    StopCapture(HWND hDlg);
 void    StartCapture(HWND hDlg);
+void    TriggerCapture(HWND hDlg);
 void    OnSelectEncodingType(HWND hDlg);
 
 HRESULT GetSelectedDevice(HWND hDlg, IMFActivate **ppActivate);
+HRESULT AddAllDevices(const WCHAR *pszFile);
 HRESULT UpdateDeviceList(HWND hDlg);
+void    OnDeviceListChange(DeviceListEvent event, UINT32 id, const WCHAR *szName, void *pContext);
 void    OnDeviceChange(HWND hwnd, WPARAM reason, DEV_BROADCAST_HDR *pHdr);
 
 void    EnableDialogControl(HWND hDlg, int nIDDlgItem, BOOL bEnable);
+int     RunBenchmark(const WCHAR *szCmdLine);
 
 INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/,
-					LPWSTR /*lpCmdLine*/, INT /*nCmdShow*/)
+					LPWSTR lpCmdLine, INT /*nCmdShow*/)
 {
 	HeapSetInformation(NULL, HeapEnableTerminationOnCorruption, NULL, 0);
 
+	// Self-checks run from the command line, in place of the dialog
+	if (lpCmdLine != NULL && lpCmdLine[0] == L'-') {
+		return RunBenchmark(lpCmdLine);
+	}
+
 	INT_PTR ret = DialogBox(
 		hInstance,
 		MAKEINTRESOURCE(IDD_DIALOG1),
@@ -75,9 +91,58 @@ INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/,
 			MB_OK | MB_ICONERROR );
 	}
 
+	logShutdown();
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// RunBenchmark
+//
+// Runs the self-check named by the first word of the command line,
+// printing to a console.
+//-----------------------------------------------------------------------------
+
+int RunBenchmark(const WCHAR *szCmdLine)
+{
+	WCHAR szName[64];
+	BOOL bNewConsole = FALSE;
+	size_t i = 0;
+
+	for (; i < ARRAYSIZE(szName) - 1 && szCmdLine[i] != L'\0' && szCmdLine[i] != L' '; i++) {
+		szName[i] = szCmdLine[i];
+	}
+	szName[i] = L'\0';
+
+	if (!openConsole(&bNewConsole)) {
+		return 1;
+	}
+	initializeMfCom();
+
+	if (!_wcsicmp(szName, L"-queuebench")) {
+		benchmarkSampleQueue();
+	} else if (!_wcsicmp(szName, L"-sessionbench")) {
+		benchmarkCaptureSession();
+	} else if (!_wcsicmp(szName, L"-clockbench")) {
+		benchmarkClockTracker();
+	} else if (!_wcsicmp(szName, L"-devicebench")) {
+		benchmarkDeviceList();
+	} else if (!_wcsicmp(szName, L"-prerollbench")) {
+		benchmarkPreRoll();
+	} else {
+		printf("Unknown option %S.  Options: -queuebench -sessionbench "
+			"-clockbench -devicebench -prerollbench\n", szName);
+	}
+
+	shutdownMfCom();
+	logShutdown();
+	if (bNewConsole) {
+		printf("Press Enter to close\n");
+		getchar();
+	}
 	return 0;
 }
 
+
 //-----------------------------------------------------------------------------
 // Dialog procedure
 //-----------------------------------------------------------------------------
@@ -91,6 +156,14 @@ INT_PTR CALLBACK DialogProc(HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam)
 		case WM_DEVICECHANGE:
 			OnDeviceChange(hDlg, wParam, (PDEV_BROADCAST_HDR)lParam);
 			return TRUE;
+		case WM_TIMER:
+			if (wParam == IDT_DEVICE_REFRESH) {
+				KillTimer(hDlg, IDT_DEVICE_REFRESH);
+				UpdateDeviceList(hDlg);
+				UpdateUI(hDlg);
+				return TRUE;
+			}
+			break;
 		case WM_COMMAND:
 			switch (LOWORD(wParam)) {
 				case IDC_CAPTURE_TOP:
@@ -110,12 +183,19 @@ INT_PTR CALLBACK DialogProc(HWND hDlg, UINT msg, WPARAM wParam, LPARAM lParam)
 					OnSelectEncodingType(hDlg);
 					return TRUE;
 				case IDC_CAPTURE:
-					if (g_pCapture && g_pCapture->IsCapturing()) {
+					if (g_pSession && g_pSession->IsCapturing()) {
 						StopCapture(hDlg);
 					} else {
 						StartCapture(hDlg);
 					}
 					return TRUE;
+				case IDC_TRIGGER:
+					TriggerCapture(hDlg);
+					return TRUE;
+				case IDC_ALL_DEVICES:
+				case IDC_PREROLL:
+					UpdateUI(hDlg);
+					return TRUE;
 				case IDCANCEL:
 					OnCloseDialog();
 					::EndDialog(hDlg, IDCANCEL);
@@ -140,6 +220,12 @@ void OnInitDialog(HWND hDlg) {
 	// Set the default name for capture
 	HWND hEdit = GetDlgItem(hDlg, IDC_OUTPUT_FILE);
     SetWindowText(hEdit, TEXT("capture.mp4"));
+	SetDlgItemInt(hDlg, IDC_PREROLL_SECONDS, PREROLL_DEFAULT_SECONDS, FALSE);
+
+	// Keep the device combo box in step with the device list
+	if (SUCCEEDED(hr)) {
+		hr = g_devices.AddListener(OnDeviceListChange, hDlg);
+	}
 
 	// Initialize the button and file name
 	OnSelectEncodingType(hDlg);
@@ -149,6 +235,11 @@ void OnInitDialog(HWND hDlg) {
 		hr = MFStartup(MF_VERSION);
 	}
 
+	// The devices' media types from earlier runs
+	if (SUCCEEDED(hr)) {
+		catalogLoad(CATALOG_FILE_NAME);
+	}
+
 	// Register for device notifications
 	if (SUCCEEDED(hr)) {
 		DEV_BROADCAST_DEVICEINTERFACE di = { 0 };
@@ -199,14 +290,11 @@ void OnInitDialog(HWND hDlg) {
 
 void OnCloseDialog()
 {
-	if (g_pCapture)
-	{
-		g_pCapture->EndCaptureSession();
-	}
-
-	SafeRelease(&g_pCapture);
+	delete g_pSession;
+	g_pSession = NULL;
 
 	g_devices.Clear();
+	catalogSave(CATALOG_FILE_NAME);
 
 	if (g_hdevnotify)
 	{
@@ -260,26 +348,56 @@ void StartCapture(HWND hDlg) {
 		ShowMessage(hr, L"Failed to get value of capture file");
 	}
 
-	// Create the media source for the capture device.
 	if (SUCCEEDED(hr)) {
-		hr = GetSelectedDevice(hDlg, &pActivate);
+		g_pSession = new (std::nothrow) CaptureSession(hDlg, g_useAudio);
+		if (g_pSession == NULL) {
+			hr = E_OUTOFMEMORY;
+		}
 	}
 	if(FAILED(hr)) {
-		ShowMessage(hr, L"Failed to get selected device");
+		ShowMessage(hr, L"Failed to create capture instance");
 	}
-	// Start capturing.
+
+	// Add the selected device, or every device.
 	if (SUCCEEDED(hr)) {
-		hr = CCapture::CreateInstance(hDlg, g_useAudio, &g_pCapture);
+		if (BST_CHECKED == IsDlgButtonChecked(hDlg, IDC_ALL_DEVICES)) {
+			hr = AddAllDevices(pszFile);
+		} else {
+			hr = GetSelectedDevice(hDlg, &pActivate);
+			if (SUCCEEDED(hr)) {
+				hr = g_pSession->AddDevice(pActivate, pszFile);
+			}
+		}
+		if(FAILED(hr)) {
+			ShowMessage(hr, L"Failed to get selected device");
+		}
 	}
-	if(FAILED(hr)) {
-		ShowMessage(hr, L"Failed to create capture instance");
+
+	// With a pre-roll, capture into memory until Trigger
+	if (SUCCEEDED(hr) &&
+		BST_CHECKED == IsDlgButtonChecked(hDlg, IDC_PREROLL)) {
+		BOOL bValid = FALSE;
+		UINT seconds = GetDlgItemInt(hDlg, IDC_PREROLL_SECONDS, &bValid, FALSE);
+		if (!bValid || seconds == 0 || seconds > PREROLL_MAX_SECONDS) {
+			hr = E_INVALIDARG;
+			ShowMessage(hr, L"The pre-roll must be 1 to %u seconds",
+				PREROLL_MAX_SECONDS);
+		} else {
+			g_pSession->SetPreRoll(seconds);
+		}
 	}
 
+	// Start capturing.
 	if (SUCCEEDED(hr)) {
-		hr = g_pCapture->StartCapture(pActivate, pszFile, params);
+		hr = g_pSession->Start(params);
+		if(FAILED(hr)) {
+			ShowMessage(hr, L"Error starting capture");
+		}
 	}
-	if(FAILED(hr)) {
-		ShowMessage(hr, L"Error starting capture");
+
+	if (FAILED(hr)) {
+		delete g_pSession;
+		g_pSession = NULL;
 	}
 
 	if (SUCCEEDED(hr)) {
@@ -290,6 +408,26 @@ void StartCapture(HWND hDlg) {
 }
 
 
+//-----------------------------------------------------------------------------
+// TriggerCapture
+//
+// Writes the pre-roll and starts writing everything after it.
+//-----------------------------------------------------------------------------
+
+void TriggerCapture(HWND hDlg)
+{
+	if (g_pSession == NULL) {
+		return;
+	}
+	HRESULT hr = g_pSession->Trigger();
+	UpdateUI(hDlg);
+
+	if (FAILED(hr)) {
+		ShowMessage(hr, L"Error triggering capture");
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // StopCapture
 //
@@ -299,13 +437,21 @@ void StartCapture(HWND hDlg) {
 void StopCapture(HWND hDlg)
 {
 	HRESULT hr = S_OK;
-	hr = g_pCapture->EndCaptureSession();
-	SafeRelease(&g_pCapture);
-	UpdateDeviceList(hDlg);
+	hr = g_pSession->Stop();
+
+	// With several devices, show what each one wrote and dropped.
+	if (g_pSession->Count() > 1) {
+		WCHAR szReport[4096];
+		g_pSession->GetReport(szReport, ARRAYSIZE(szReport));
+		MessageBox(hDlg, szReport, L"Capture Summary", MB_OK);
+	}
 
-	// NOTE: Updating the device list releases the existing IMFActivate
-	// pointers. This ensures that the current instance of the capture
-	// source is released.
+	delete g_pSession;
+	g_pSession = NULL;
+
+	// NOTE: Releasing the IMFActivate pointers ensures that the current
+	// instance of the capture source is released.
+	g_devices.ReleaseDevices();
 	UpdateUI(hDlg);
 
 	if (FAILED(hr))	{
@@ -332,70 +478,121 @@ HRESULT GetSelectedDevice(HWND hDlg, IMFActivate **ppActivate)
 		return HRESULT_FROM_WIN32(GetLastError());
 	}
 
-	// Now find the index of the device within the device list.
+	// Now find the device within the device list.
 	//
-	// This index is stored as item data in the combo box, so that
+	// The device ID is stored as item data in the combo box, so that
 	// the order of the combo box items does not need to match the
-	// order of the device list.
-	LRESULT iDeviceIndex = ComboBox_GetItemData(hDeviceList, iListIndex);
+	// order of the device list, which changes as devices come and go.
+	LRESULT id = ComboBox_GetItemData(hDeviceList, iListIndex);
 
-	if (iDeviceIndex == CB_ERR) {
+	if (id == CB_ERR) {
 		return HRESULT_FROM_WIN32(GetLastError());
 	}
 
+	UINT32 iDevice = 0;
+	HRESULT hr = g_devices.FindDevice((UINT32)id, &iDevice);
+
 	// Now create the media source.
-	return g_devices.GetDevice((UINT32)iDeviceIndex, ppActivate);
+	if (SUCCEEDED(hr)) {
+		hr = g_devices.GetDevice(iDevice, ppActivate);
+	}
+	return hr;
+}
+
+
+//-----------------------------------------------------------------------------
+// AddAllDevices
+//
+// Adds every capture device to the session.  Each device writes its
+// own file, named by inserting the device index before the extension
+// (capture.mp4 becomes capture-0.mp4, capture-1.mp4, ...).
+//-----------------------------------------------------------------------------
+
+HRESULT AddAllDevices(const WCHAR *pszFile)
+{
+	HRESULT hr = S_OK;
+	WCHAR szBase[MAX_PATH];
+	WCHAR szExt[MAX_PATH];
+	WCHAR szDeviceFile[MAX_PATH];
+
+	hr = StringCchCopy(szExt, MAX_PATH, PathFindExtension(pszFile));
+	if (SUCCEEDED(hr)) {
+		hr = StringCchCopy(szBase, MAX_PATH, pszFile);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+	PathRemoveExtension(szBase);
+
+	for (UINT32 i = 0; i < g_devices.Count() && SUCCEEDED(hr); i++) {
+		IMFActivate *pActivate = NULL;
+
+		hr = StringCchPrintf(szDeviceFile, MAX_PATH, L"%s-%u%s",
+			szBase, i, szExt);
+		if (SUCCEEDED(hr)) {
+			hr = g_devices.GetDevice(i, &pActivate);
+		}
+		if (SUCCEEDED(hr)) {
+			hr = g_pSession->AddDevice(pActivate, szDeviceFile);
+		}
+		SafeRelease(&pActivate);
+	}
+	return hr;
 }
 
 
 //-----------------------------------------------------------------------------
 // UpdateDeviceList
 //
-// Enumerates the capture devices and populates the list of device
-// names in the dialog UI.
+// Enumerates the capture devices.  The device list tells
+// OnDeviceListChange of any that came or went, which updates the list
+// of device names in the dialog UI.
 //-----------------------------------------------------------------------------
 
 HRESULT UpdateDeviceList(HWND hDlg) {
 	HRESULT hr = S_OK;
-	WCHAR *szFriendlyName = NULL;
 	HWND hCombobox = GetDlgItem(hDlg, IDC_DEVICE_LIST);
 
-	ComboBox_ResetContent( hCombobox );
-	g_devices.Clear();
 	hr = g_devices.EnumerateDevices(g_useAudio);
-	if (FAILED(hr)) { goto done; }
 
-	for (UINT32 iDevice = 0; iDevice < g_devices.Count(); iDevice++) {
-		// Get the friendly name of the device.
-		hr = g_devices.GetDeviceName(iDevice, &szFriendlyName);
-		if (FAILED(hr)) { goto done; }
+	// If the selected device was removed, select the first item.
+	if (ComboBox_GetCurSel(hCombobox) == CB_ERR && g_devices.Count() > 0) {
+		ComboBox_SetCurSel(hCombobox, 0);
+	}
+
+	return hr;
+}
+
+
+//-----------------------------------------------------------------------------
+// OnDeviceListChange
+//
+// Adds or removes the name of a device in the dialog UI.
+//-----------------------------------------------------------------------------
+
+void OnDeviceListChange(DeviceListEvent event, UINT32 id, const WCHAR *szName, void *pContext)
+{
+	HWND hCombobox = GetDlgItem((HWND)pContext, IDC_DEVICE_LIST);
 
+	if (event == DeviceList_Added) {
 		// Add the string to the combo-box. This message returns the index in the list.
-		int iListIndex = ComboBox_AddString(hCombobox, szFriendlyName);
+		int iListIndex = ComboBox_AddString(hCombobox, szName);
 		if (iListIndex == CB_ERR || iListIndex == CB_ERRSPACE) {
-			hr = E_FAIL;
-			goto done;
+			return;
 		}
 
 		// The list might be sorted, so the list index is not always the same as the
-		// array index. Therefore, set the array index as item data.
-		int result = ComboBox_SetItemData(hCombobox, iListIndex, iDevice);
-		if (result == CB_ERR) {
-			hr = E_FAIL;
-			goto done;
+		// array index. Therefore, set the device ID as item data.
+		ComboBox_SetItemData(hCombobox, iListIndex, id);
+	} else {
+		int cItems = ComboBox_GetCount(hCombobox);
+		for (int i = 0; i < cItems; i++) {
+			if (ComboBox_GetItemData(hCombobox, i) == (LRESULT)id) {
+				ComboBox_DeleteString(hCombobox, i);
+				break;
+			}
 		}
-
-		CoTaskMemFree(szFriendlyName);
-		szFriendlyName = NULL;
-	}
-
-	if (g_devices.Count() > 0) {
-		// Select the first item.
-		ComboBox_SetCurSel(hCombobox, 0);
 	}
-
-done:
-	return hr;
 }
 
 
@@ -478,7 +675,10 @@ void OnSelectEncodingType(HWND hDlg) {
 
 void UpdateUI(HWND hDlg) {
 	BOOL bEnable = (g_devices.Count() > 0);     // Are there any capture devices?
-	BOOL bCapturing = (g_pCapture != NULL);     // Is capture in progress now?
+	BOOL bCapturing = (g_pSession != NULL);     // Is capture in progress now?
+	BOOL bAllDevices = (BST_CHECKED == IsDlgButtonChecked(hDlg, IDC_ALL_DEVICES));
+	BOOL bPreRoll = (BST_CHECKED == IsDlgButtonChecked(hDlg, IDC_PREROLL));
+	BOOL bArmed = (g_pSession != NULL && g_pSession->IsArmed());
 
 	HWND hButton = GetDlgItem(hDlg, IDC_CAPTURE);
 
@@ -489,7 +689,8 @@ void UpdateUI(HWND hDlg) {
 	}
 
 	EnableDialogControl(hDlg, IDC_CAPTURE, bCapturing || bEnable);
-	EnableDialogControl(hDlg, IDC_DEVICE_LIST, !bCapturing && bEnable);
+	EnableDialogControl(hDlg, IDC_DEVICE_LIST, !bCapturing && bEnable && !bAllDevices);
+	EnableDialogControl(hDlg, IDC_TRIGGER, bArmed);
 
 	// The following cannot be changed while capture is in progress,
 	// but are OK to change when there are no capture devices.
@@ -498,6 +699,9 @@ void UpdateUI(HWND hDlg) {
 	EnableDialogControl(hDlg, IDC_AUDIO, !bCapturing);
 	EnableDialogControl(hDlg, IDC_VIDEO, !bCapturing);
 	EnableDialogControl(hDlg, IDC_OUTPUT_FILE, !bCapturing);
+	EnableDialogControl(hDlg, IDC_ALL_DEVICES, !bCapturing);
+	EnableDialogControl(hDlg, IDC_PREROLL, !bCapturing);
+	EnableDialogControl(hDlg, IDC_PREROLL_SECONDS, !bCapturing && bPreRoll);
 }
 
 
@@ -511,10 +715,10 @@ void OnDeviceChange(HWND hDlg, WPARAM reason, DEV_BROADCAST_HDR *pHdr)
 {
 	if (reason == DBT_DEVNODES_CHANGED || reason == DBT_DEVICEARRIVAL) {
 		// Check for added/removed devices, regardless of whether
-		// the application is capturing at this time.
+		// the application is capturing at this time.  Each message
+		// restarts the timer, so a burst of them means one refresh.
 
-		UpdateDeviceList(hDlg);
-		UpdateUI(hDlg);
+		SetTimer(hDlg, IDT_DEVICE_REFRESH, DEVICE_REFRESH_DELAY_MSEC, NULL);
 	}
 
 	// Now check if the current capture device was lost.
@@ -525,11 +729,16 @@ void OnDeviceChange(HWND hDlg, WPARAM reason, DEV_BROADCAST_HDR *pHdr)
 		return;
 	}
 
+	// A device that comes back may not offer the same types
+	if (reason == DBT_DEVICEARRIVAL || reason == DBT_DEVICEREMOVECOMPLETE) {
+		catalogDeviceChanged(((DEV_BROADCAST_DEVICEINTERFACE *)pHdr)->dbcc_name);
+	}
+
 	HRESULT hr = S_OK;
 	BOOL bDeviceLost = FALSE;
 
-	if (g_pCapture && g_pCapture->IsCapturing()) {
-		hr = g_pCapture->CheckDeviceLost(pHdr, &bDeviceLost);
+	if (g_pSession && g_pSession->IsCapturing()) {
+		hr = g_pSession->CheckDeviceLost(pHdr, &bDeviceLost);
 
 		if (FAILED(hr) || bDeviceLost) {
 			StopCapture(hDlg);